@@ -15,6 +15,13 @@ else
 PLATFORM = linux
 endif
 
+# SCZ (compressed SCP) support requires zlib. Disable with zlib=n.
+zlib ?= y
+
+# Read-ahead of stream images through io_uring (Linux only). Falls back to
+# posix_fadvise() at run time if the kernel refuses it. Disable with uring=n.
+uring ?= y
+
 PREFIX ?= /usr/local
 BINDIR = $(PREFIX)/bin
 INCLUDEDIR = $(PREFIX)/include
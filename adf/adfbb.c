@@ -34,15 +34,6 @@ uint32_t checksum(void *dat)
     return ~csum;
 }
 
-static int compare_bb(char *bb, const char *tmpl, unsigned int sz)
-{
-    unsigned int i;
-    for (i = 0; i < sz; i++)
-        if (bb[12+i] != tmpl[i])
-            return -1;
-    return 0;
-}
-
 static void copy_bb(char *bb, const char *tmpl, unsigned int sz)
 {
     unsigned int i;
@@ -122,7 +113,7 @@ static void decode_new_raw_bb(char *bb, const char *filename)
     free(buf);
 }
 
-static int test_lamer(char *bb)
+static int test_lamer(const char *bb)
 {
     unsigned int i;
     char sig[0x20];
@@ -155,11 +146,109 @@ static const char kick20_bootable[] = {
     0x62, 0x72, 0x61, 0x72, 0x79, 0x00
 };
 
+/* Known bootblocks, tested in order. A template is matched against the
+ * bootblock code (from byte offset 12), keyed on its first longword so that
+ * a full compare is made only against plausible candidates. Anything else is
+ * matched by a test function, which returns 0 on a match. */
+static struct bb_sig {
+    const char *name;
+    const char *tmpl;
+    unsigned int sz;
+    int (*test)(const char *bb);
+    uint32_t key;
+} bb_sigs[] = {
+    { "Kickstart 1.3 bootblock",
+      kick13_bootable, sizeof(kick13_bootable) },
+    { "Kickstart 1.3 bootblock",
+      kick20_bootable, sizeof(kick20_bootable) },
+    { "** LAMER EXTERMINATOR VIRUS!!!!!! **",
+      .test = test_lamer },
+};
+
+static uint32_t bb_key(const char *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static void init_bb_sigs(void)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(bb_sigs); i++)
+        if (bb_sigs[i].tmpl)
+            bb_sigs[i].key = bb_key(bb_sigs[i].tmpl);
+}
+
+static const struct bb_sig *identify_bb(const char *bb)
+{
+    const struct bb_sig *sig;
+    uint32_t key = bb_key(&bb[12]);
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(bb_sigs); i++) {
+        sig = &bb_sigs[i];
+        if (sig->tmpl ? ((sig->key == key)
+                         && !memcmp(&bb[12], sig->tmpl, sig->sz))
+            : !sig->test(bb))
+            return sig;
+    }
+
+    return NULL;
+}
+
+static void report_bb(const char *bb)
+{
+    const struct bb_sig *sig;
+    uint32_t rootblock;
+
+    if (strncmp(&bb[0], "DOS", 3)) {
+        printf("Volume type: NDOS\n");
+    } else {
+        uint8_t flags = bb[3];
+        if (flags & 0xf8)
+            printf("** Meaningless flags set at byte offset 3 (%02x)\n",
+                   flags);
+        printf("Volume type: %cFS ", (flags & 1) ? 'F' : 'O');
+        if (flags & 2)
+            printf("INTL ");
+        if (flags & 4)
+            printf("DIRC&INTL");
+        printf("\n");
+    }
+
+    if (checksum((void *)bb) != 0) {
+        printf("Disk is not bootable.\n");
+        return;
+    }
+
+    rootblock = be32toh(*(uint32_t *)&bb[8]);
+    if (rootblock != 880)
+        printf("** Bogus rootblock index %u\n", rootblock);
+
+    sig = identify_bb(bb);
+    printf("%s\n", sig ? sig->name : "** Unrecognised bootable bootblock!");
+}
+
 int main(int argc, char **argv)
 {
-    int fd, fixup = 0;
+    int i, fd, fixup = 0;
     char bb[1024];
-    uint32_t rootblock, csum;
+
+    init_bb_sigs();
+
+    /* Several images: report on each bootblock in turn. */
+    if ((argc > 2) && (argv[2][0] != '-')) {
+        for (i = 1; i < argc; i++) {
+            if ((fd = file_open(argv[i], O_RDONLY)) == -1)
+                err(1, "%s", argv[i]);
+            read_exact(fd, &bb, sizeof(bb));
+            close(fd);
+            printf("%s:\n", argv[i]);
+            report_bb(bb);
+        }
+        return 0;
+    }
 
     if (argc == 3) {
         if (!strcmp(argv[2], "-w"))
@@ -178,6 +267,7 @@ int main(int argc, char **argv)
     if (argc != 2) {
     usage:
         errx(1, "Usage: adfbb <filename> [-w] [-f] [-{g,r}<new block>]\n"
+             "       adfbb <filename> <filename>...\n"
              " -w: Overwrite bootblock with Kick 1.3 block\n"
              " -f: Fix up bootblock checksum\n"
              " -r: New raw file to decode and poke\n"
@@ -190,40 +280,8 @@ int main(int argc, char **argv)
 
     read_exact(fd, &bb, sizeof(bb));
 
-    if (strncmp(&bb[0], "DOS", 3)) {
-        printf("Volume type: NDOS\n");
-    } else {
-        uint8_t flags = bb[3];
-        if (flags & 0xf8)
-            printf("** Meaningless flags set at byte offset 3 (%02x)\n",
-                   flags);
-        printf("Volume type: %cFS ", (flags & 1) ? 'F' : 'O');
-        if (flags & 2)
-            printf("INTL ");
-        if (flags & 4)
-            printf("DIRC&INTL");
-        printf("\n");
-    }
-
-    if ((csum = checksum(bb)) != 0) {
-        printf("Disk is not bootable.\n");
-        goto out;
-    }
-
-    rootblock = be32toh(*(uint32_t *)&bb[8]);
-    if (rootblock != 880)
-        printf("** Bogus rootblock index %u\n", rootblock);
-
-    if (!compare_bb(bb, kick13_bootable, sizeof(kick13_bootable)))
-        printf("Kickstart 1.3 bootblock\n");
-    else if (!compare_bb(bb, kick20_bootable, sizeof(kick20_bootable)))
-        printf("Kickstart 1.3 bootblock\n");
-    else if (!test_lamer(bb))
-        printf("** LAMER EXTERMINATOR VIRUS!!!!!! **\n");
-    else
-        printf("** Unrecognised bootable bootblock!\n");
+    report_bb(bb);
 
-out:
     if (fixup) {
         if (fixup == 1)
             copy_bb(bb, kick13_bootable, sizeof(kick13_bootable));
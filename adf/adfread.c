@@ -17,331 +17,374 @@
 #include <unistd.h>
 #include <time.h>
 #include <utime.h>
-#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <libdisk/amigados_fs.h>
+
+/* Each image is extracted by a single thread, so the state of the image in
+ * progress is per-thread. */
+static __thread struct ados_fs *fs;
+static __thread FILE *out;       /* listing, or NULL */
+static __thread FILE *manifest;  /* or NULL */
+static __thread size_t root_len; /* manifest paths are relative to this */
+static __thread int failed;
+static int is_readonly;
+
+/* Report a damaged filesystem. The walk is abandoned, but in batch mode the
+ * remaining images are still extracted. */
+static int fs_err(void)
+{
+    warnx("%s", ados_fs_error(fs));
+    failed = 1;
+    return -1;
+}
 
-/* Physical characteristics of an AmigaDOS DS/DD floppy disk. */
-#define BYTES_PER_BLOCK   512
-#define BLOCKS_PER_TRACK   11
-#define TRACKS_PER_CYL      2
-#define CYLS_PER_DISK      80
+static const char *format_time(time_t time, char *str)
+{
+    ctime_r(&time, str);
+    str[strlen(str)-1] = '\0'; /* nobble the newline */
+    return str;
+}
 
-/* Computed characteristics. */
-#define TRACKS_PER_DISK   (TRACKS_PER_CYL*CYLS_PER_DISK)
-#define BLOCKS_PER_DISK   (BLOCKS_PER_TRACK*TRACKS_PER_DISK)
-#define BYTES_PER_DISK    (BYTES_PER_BLOCK*BLOCKS_PER_DISK)
+static void set_times(const char *path, time_t time)
+{
+    struct utimbuf utimbuf = { time, time };
+    (void)utime(path, &utimbuf);
+}
 
-#define HASH_SIZE (BYTES_PER_BLOCK/4-56)
+static int handle_file(char *path, const struct ados_entry *file)
+{
+    int file_fd, rc = 0;
+    char *buf, tstr[32];
 
-typedef struct {
-    uint8_t len;
-    uint8_t chars[1];
-} bcpl_string_t;
+    if (out)
+        fprintf(out, " %-54s %6u %s\n", path, file->size,
+                format_time(file->mtime, tstr));
 
-struct ffs_datestamp {
-    uint32_t days, mins, ticks;
-};
+    if (is_readonly)
+        goto out;
 
-struct ffs_root_block {
-    uint32_t type;
-    uint32_t header_key;
-    uint32_t max_seq;
-    uint32_t hash_size;
-    uint32_t mbz_0;
-    uint32_t checksum;
-    uint32_t hash[HASH_SIZE];
-    uint32_t bitmap_flag;
-    uint32_t bitmap_keys[25];
-    uint32_t bitmap_extended;
-    struct ffs_datestamp root_altered_datestamp;
-    uint8_t disk_name[40];
-    struct ffs_datestamp disk_altered_datestamp;
-    struct ffs_datestamp disk_made_datestamp;
-    uint32_t mbz_1[3];
-    uint32_t subtype;
-};
+    file_fd = file_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (file_fd == -1)
+        err(1, "%s", path);
 
-struct ffs_dir {
-    uint32_t type;
-    uint32_t header_key;
-    uint32_t mbz_0[3];
-    uint32_t checksum;
-    uint32_t hash[HASH_SIZE];
-    uint32_t mbz_1[2];
-    uint32_t protection_bits;
-    uint32_t mbz_2[1];
-    uint8_t dir_comment[92];
-    struct ffs_datestamp datestamp;
-    uint8_t dir_name[36];
-    uint32_t mbz_3[7];
-    uint32_t hash_chain;
-    uint32_t parent;
-    uint32_t mbz_4[1];
-    uint32_t subtype;
-};
+    /* The whole file is gathered and then written with a single call. */
+    buf = memalloc(file->size ? file->size : 1);
+    if (ados_fs_read_file(fs, file, buf)) {
+        rc = fs_err();
+    } else {
+        write_exact(file_fd, buf, file->size);
+        if (manifest)
+            fprintf(manifest, "%08x %u %lld %s\n",
+                    crc32(buf, file->size), file->size,
+                    (long long)file->mtime, path + root_len);
+    }
+    memfree(buf);
 
-struct ffs_fileheader {
-    uint32_t type;
-    uint32_t header_key;
-    uint32_t max_seq;
-    uint32_t mbz_0[1];
-    uint32_t first_data;
-    uint32_t checksum;
-    uint32_t data[HASH_SIZE];
-    uint32_t mbz_1[2];
-    uint32_t protection_bits;
-    uint32_t file_size;
-    uint8_t dir_comment[92];
-    struct ffs_datestamp datestamp;
-    uint8_t file_name[36];
-    uint32_t mbz_3[7];
-    uint32_t hash_chain;
-    uint32_t parent;
-    uint32_t extension;
-    uint32_t subtype;
-};
+    close(file_fd);
+    set_times(path, file->mtime);
+
+out:
+    free(path);
+    return rc;
+}
 
-#define T_HEADER     2
-#define T_LIST      16
+static int handle_dir(char *prefix, const struct ados_entry *dir);
 
-#define ST_ROOT      1
-#define ST_USERDIR   2
-#define ST_FILE     -3
+static int handle_entry(void *opaque, const struct ados_entry *ent)
+{
+    const char *prefix = opaque;
+    char *path;
 
-static int is_ffs, is_readonly;
+    if ((path = malloc(strlen(prefix) + strlen(ent->name) + 2)) == NULL)
+        err(1, NULL);
+    strcpy(path, prefix);
+    strcat(path, ent->name);
 
-/* read_exact, write_exact */
-#include "../libdisk/util.c"
+    return (ent->type == ADOS_DIR) ? handle_dir(path, ent)
+        : handle_file(path, ent);
+}
 
-static void *get_block(int fd, unsigned int block)
+static int handle_dir(char *prefix, const struct ados_entry *dir)
 {
-    off_t off;
-    void *dat;
+    char tstr[32];
+    int rc;
 
-    if (block >= BLOCKS_PER_DISK)
-        errx(1, "Block index %u out of range", block);
+    if (!is_readonly)
+        (void)posix_mkdir(prefix, 0777);
 
-    dat = malloc(BYTES_PER_BLOCK);
-    if (dat == NULL)
-        err(1, NULL);
+    strcat(prefix, "/");
+    if (out)
+        fprintf(out, " %-61s %s\n", prefix, format_time(dir->mtime, tstr));
 
-    off = lseek(fd, block * BYTES_PER_BLOCK, SEEK_SET);
-    if (off < 0)
-        err(1, NULL);
+    /* A damaged subdirectory has already been reported by fs_err(). */
+    if ((rc = ados_fs_read_dir(fs, dir, handle_entry, prefix)) && !failed)
+        rc = fs_err();
 
-    read_exact(fd, dat, BYTES_PER_BLOCK);
+    if (!is_readonly)
+        set_times(prefix, dir->mtime);
 
-    return dat;
+    free(prefix);
+    return rc;
 }
 
-static void put_block(void *dat)
+/* A plain ADF is used as is. Any other image is decoded by libdisk. Returns
+ * NULL, having said why, if there is no AmigaDOS volume to read. */
+static struct ados_fs *open_fs(const char *name, uint8_t **pimage)
 {
-    memset(dat, 0xAA, BYTES_PER_BLOCK);
-    free(dat);
-}
+    struct ados_fs *fs = NULL;
+    struct disk *d;
+    off_t sz;
+    int fd;
 
-static void checksum_block(void *dat)
-{
-    uint32_t sum = 0, *blk = dat;
-    unsigned int i;
+    *pimage = NULL;
 
-    for (i = 0; i < BYTES_PER_BLOCK/4; i++)
-        sum += be32toh(blk[i]);
+    fd = file_open(name, O_RDONLY);
+    if (fd == -1) {
+        warn("%s", name);
+        return NULL;
+    }
+    if ((sz = lseek(fd, 0, SEEK_END)) < 0)
+        err(1, NULL);
 
-    if (sum != 0)
-        errx(1, "Bad block checksum %08x", sum);
-}
+    if ((sz == 160*11*512) || (sz == 160*22*512)) {
+        *pimage = memalloc(sz);
+        if (lseek(fd, 0, SEEK_SET) < 0)
+            err(1, NULL);
+        read_exact(fd, *pimage, sz);
+        close(fd);
+        fs = ados_fs_open_image(*pimage, sz);
+    } else {
+        close(fd);
+        if ((d = disk_open(name, DISKFL_read_only)) == NULL) {
+            warnx("%s: Not an ADF or a disk image", name);
+            return NULL;
+        }
+        fs = ados_fs_open_disk(d);
+        disk_close(d);
+    }
 
-static const char *format_bcpl_string(uint8_t *bcpl_str)
-{
-    static char str[64];
-    if (bcpl_str[0] > (sizeof(str)-1))
-        errx(1, "BCPL string too long");
-    sprintf(str, "%.*s", bcpl_str[0], &bcpl_str[1]);
-    return str;
+    if (fs == NULL) {
+        warnx("%s: Not an AmigaDOS volume", name);
+        memfree(*pimage);
+    }
+    return fs;
 }
 
-static time_t time_from_datestamp(struct ffs_datestamp *stamp)
+/* Extract image @name below @dest_dir, or just list it if @dest_dir is
+ * NULL. Returns 0 on success, or -1 if the image could not be read. */
+static int extract(const char *name, const char *dest_dir)
 {
-    time_t time = (time_t)(8*365+2)*24*60*60;
-    time += (time_t)be32toh(stamp->days)*24*60*60;
-    time += (time_t)be32toh(stamp->mins)*60;
-    time += (time_t)be32toh(stamp->ticks)/50;
-    return time;
-}
+    struct ados_volume vol;
+    struct ados_entry root;
+    char *path, tstr[32];
+    uint8_t *image;
+
+    failed = 0;
+    if ((fs = open_fs(name, &image)) == NULL)
+        return -1;
+    if (ados_fs_get_volume(fs, &vol) || ados_fs_root(fs, &root)) {
+        fs_err();
+        goto out;
+    }
 
-static const char *format_datestamp(struct ffs_datestamp *stamp)
-{
-    time_t time = time_from_datestamp(stamp);
-    char *str = ctime(&time);
-    str[strlen(str)-1] = '\0'; /* nobble the newline */
-    return str;
+    if (dest_dir == NULL)
+        dest_dir = ".";
+    path = memalloc(strlen(dest_dir) + 1 + strlen(vol.name) + 2);
+    strcpy(path, dest_dir);
+    if (path[strlen(path)-1] != '/')
+        strcat(path, "/");
+    root_len = strlen(path);
+    strcat(path, vol.name);
+
+    if (out) {
+        fprintf(out, "%s is an %s volume\n", vol.name,
+                vol.is_ffs ? "FFS" : "OFS");
+        fprintf(out, "Created:\t%s\n", format_time(vol.created, tstr));
+        fprintf(out, "Last altered:\t%s\n", format_time(vol.altered, tstr));
+    }
+
+    /* handle_dir() frees @path. */
+    (void)handle_dir(path, &root);
+
+out:
+    ados_fs_close(fs);
+    memfree(image);
+    return failed ? -1 : 0;
 }
 
-static void set_times(const char *path, time_t time)
+struct batch {
+    pthread_mutex_t lock;
+    unsigned int next, nr, nr_failed;
+    char **image;
+    const char *dest_root;
+};
+
+/* Image "dir/foo.adf" is extracted to <dest_root>/foo.adf/, and its files
+ * are listed in <dest_root>/foo.adf.manifest. */
+static void batch_one(struct batch *b, const char *name)
 {
-    struct utimbuf utimbuf = { time, time };
-    (void)utime(path, &utimbuf);
+    const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    char *dest, *mname;
+    int rc;
+
+    dest = memalloc(strlen(b->dest_root) + strlen(base) + 2);
+    sprintf(dest, "%s/%s", b->dest_root, base);
+    (void)posix_mkdir(dest, 0777);
+
+    mname = memalloc(strlen(dest) + sizeof(".manifest"));
+    sprintf(mname, "%s.manifest", dest);
+    if ((manifest = fopen(mname, "w")) == NULL)
+        err(1, "%s", mname);
+
+    rc = extract(name, dest);
+
+    if (fclose(manifest) != 0)
+        err(1, "%s", mname);
+    manifest = NULL;
+
+    printf("%s: %s\n", name, rc ? "FAILED" : "OK");
+    if (rc) {
+        pthread_mutex_lock(&b->lock);
+        b->nr_failed++;
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    memfree(mname);
+    memfree(dest);
 }
 
-static void handle_file(int fd, char *path, struct ffs_fileheader *file)
+static void *worker_fn(void *_b)
 {
-    int file_fd;
-    unsigned int todo, nxtblk, data_per_block;
-    time_t time = time_from_datestamp(&file->datestamp);
-
-    printf(" %-54s %6u %s\n",
-           path,
-           be32toh(file->file_size),
-           format_datestamp(&file->datestamp));
+    struct batch *b = _b;
+    unsigned int i;
 
-    if (is_readonly)
-        return;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->nr)
+            break;
+        batch_one(b, b->image[i]);
+    }
 
-    file_fd = file_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
-    if (file_fd == -1)
-        err(1, "%s", path);
+    return NULL;
+}
 
-    data_per_block = is_ffs ? BYTES_PER_BLOCK : BYTES_PER_BLOCK-24;
-
-    todo = be32toh(file->file_size);
-    for (nxtblk = 0; todo != 0; nxtblk++) {
-        unsigned int idx, this_todo;
-        char *dat;
-        if (nxtblk == HASH_SIZE) {
-            idx = be32toh(file->extension);
-            put_block(file);
-            file = get_block(fd, idx);
-            checksum_block(file);
-            if ((be32toh(file->type) != T_LIST) ||
-                (be32toh(file->subtype) != ST_FILE))
-                errx(1, "Bad file-ext block");
-            nxtblk = 0;
+static void add_image(struct batch *b, const char *dir, const char *name)
+{
+    unsigned int nr = b->nr;
+
+    /* Grow by doubling: the array is full whenever @nr is a power of 2. */
+    if ((nr & (nr - 1)) == 0) {
+        char **old = b->image;
+        b->image = memalloc(max(nr * 2, 16u) * sizeof(*b->image));
+        if (old != NULL) {
+            memcpy(b->image, old, nr * sizeof(*b->image));
+            memfree(old);
         }
-        idx = be32toh(file->data[HASH_SIZE-nxtblk-1]);
-        dat = get_block(fd, idx);
-        if (!is_ffs)
-            checksum_block(dat);
-        this_todo = (todo > data_per_block) ? data_per_block : todo;
-        write_exact(file_fd, &dat[is_ffs?0:24], this_todo);
-        put_block(dat);
-        todo -= this_todo;
     }
 
-    close(file_fd);
-    set_times(path, time);
-
-    put_block(file);
-    free(path);
+    b->image[nr] = memalloc((dir ? strlen(dir) + 1 : 0) + strlen(name) + 1);
+    sprintf(b->image[nr], "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+    b->nr++;
 }
 
-static void handle_dir(int fd, char *prefix, struct ffs_dir *dir)
+static int cmp_str(const void *a, const void *b)
 {
-    uint32_t idx;
-    unsigned int i;
-    char *path;
-    const char *name;
-    struct ffs_fileheader *file;
-
-    if (!is_readonly)
-        (void)posix_mkdir(prefix, 0777);
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-    strcat(prefix, "/");
-    printf(" %-61s %s\n", prefix, format_datestamp(&dir->datestamp));
-
-    for (i = 0; i < HASH_SIZE; i++) {
-        idx = be32toh(dir->hash[i]);
-        while (idx != 0) {
-            file = get_block(fd, idx);
-            if (be32toh(file->type) != T_HEADER)
-                errx(1, "Not a header block (type %08x)", be32toh(file->type));
-            checksum_block(file);
-
-            name = format_bcpl_string(file->file_name);
-            if ((path = malloc(strlen(prefix) + strlen(name) + 2)) == NULL)
-                err(1, NULL);
-            strcpy(path, prefix);
-            strcat(path, name);
-
-            idx = be32toh(file->hash_chain);
-
-            switch ((int)be32toh(file->subtype)) {
-            case ST_USERDIR:
-                handle_dir(fd, path, (struct ffs_dir *)file);
-                break;
-            case ST_FILE:
-                handle_file(fd, path, file);
-                break;
-            default:
-                errx(1, "Unrecognised subtype %08x", be32toh(dir->subtype));
-            }
+/* @list is a directory, whose regular files are all taken to be images, or
+ * a file naming one image per line. In a list, blank lines and lines
+ * starting with '#' are ignored. */
+static void read_image_list(struct batch *b, const char *list)
+{
+    char line[4096];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    FILE *fp;
+    size_t len;
+
+    if (stat(list, &st) != 0)
+        err(1, "%s", list);
+
+    if (S_ISDIR(st.st_mode)) {
+        if ((dir = opendir(list)) == NULL)
+            err(1, "%s", list);
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] == '.')
+                continue;
+            add_image(b, list, ent->d_name);
+            if ((stat(b->image[b->nr-1], &st) != 0) || !S_ISREG(st.st_mode))
+                memfree(b->image[--b->nr]);
         }
+        closedir(dir);
+        /* Directory order is arbitrary: make the job order repeatable. */
+        qsort(b->image, b->nr, sizeof(*b->image), cmp_str);
+        return;
     }
 
-    if (!is_readonly)
-        set_times(prefix, time_from_datestamp(&dir->datestamp));
+    if ((fp = fopen(list, "r")) == NULL)
+        err(1, "%s", list);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if ((len == 0) || (line[0] == '#'))
+            continue;
+        add_image(b, NULL, line);
+    }
+    fclose(fp);
+}
 
-    put_block(dir);
-    free(prefix);
+static int batch(const char *list, const char *dest_root, unsigned int jobs)
+{
+    struct batch b = { .next = 0, .dest_root = dest_root };
+    pthread_t *threads;
+    unsigned int i;
+    int rc;
+
+    read_image_list(&b, list);
+    (void)posix_mkdir(dest_root, 0777);
+
+    /* Each image has its own filesystem instance: run them on a pool of
+     * worker threads, the calling thread being worker 0. */
+    pthread_mutex_init(&b.lock, NULL);
+    jobs = max(min(jobs, b.nr), 1u);
+    threads = memalloc(jobs * sizeof(*threads));
+    for (i = 1; i < jobs; i++)
+        if ((rc = pthread_create(&threads[i], NULL, worker_fn, &b)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    worker_fn(&b);
+    for (i = 1; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    memfree(threads);
+    pthread_mutex_destroy(&b.lock);
+
+    printf("%u images, %u failed\n", b.nr, b.nr_failed);
+
+    for (i = 0; i < b.nr; i++)
+        memfree(b.image[i]);
+    memfree(b.image);
+    return b.nr_failed ? 1 : 0;
 }
 
 int main(int argc, char **argv)
 {
-    int fd;
-    off_t sz;
-    struct ffs_root_block *root_block;
-    char *boot_block, *dest_dir = ".", *tmp;
-    const char *vol;
+    if ((argc >= 4) && (argc <= 5) && !strcmp(argv[1], "-b"))
+        return batch(argv[2], argv[3], (argc == 5) ? atoi(argv[4]) : 1);
 
-    if (argc == 3)
-        dest_dir = argv[2];
-    else if (argc == 2)
+    if (argc == 2)
         is_readonly = 1;
-    else
-        errx(1, "Usage: adfread <filename> [<dest_dir>]");
-
-    fd = file_open(argv[1], O_RDONLY);
-    if (fd == -1)
-        err(1, "%s", argv[1]);
-
-    sz = lseek(fd, 0, SEEK_END);
-    if (sz < 0)
-        err(1, NULL);
-    if (sz != BYTES_PER_DISK)
-        errx(1, "Bad file size %ld bytes (expected %ld bytes)",
-             (long)sz, (long)BYTES_PER_DISK);
-
-    boot_block = get_block(fd, 0);
-    if (strncmp(boot_block, "DOS", 3))
-        errx(1, "Bad Amiga bootblock");
-    is_ffs = boot_block[3] & 1;
-    put_block(boot_block);
-
-    root_block = get_block(fd, BLOCKS_PER_DISK/2);
-    checksum_block(root_block);
-    if ((be32toh(root_block->type) != T_HEADER) ||
-        (be32toh(root_block->subtype) != ST_ROOT) ||
-        (be32toh(root_block->hash_size) != HASH_SIZE))
-        errx(1, "Bad root block");
-
-    vol = format_bcpl_string(root_block->disk_name);
-    if ((tmp = malloc(strlen(dest_dir) + 1 + strlen(vol) + 2)) == NULL)
-        err(1, NULL);
-    strcpy(tmp, dest_dir);
-    dest_dir = tmp;
-    if (dest_dir[strlen(dest_dir)-1] != '/')
-        strcat(dest_dir, "/");
-    strcat(dest_dir, vol);
-
-    printf("%s is an %s volume\n", vol, is_ffs ? "FFS" : "OFS");
-    printf("Created:\t%s\n", 
-           format_datestamp(&root_block->disk_made_datestamp));
-    printf("Last altered:\t%s\n",
-           format_datestamp(&root_block->disk_altered_datestamp));
-
-    handle_dir(fd, dest_dir, (struct ffs_dir *)root_block);
+    else if (argc != 3)
+        errx(1, "Usage: adfread <filename> [<dest_dir>]\n"
+             "       adfread -b <list_file|image_dir> <dest_dir> [<jobs>]");
 
-    return 0;
+    out = stdout;
+    return extract(argv[1], is_readonly ? NULL : argv[2]) ? 1 : 0;
 }
 
 /*
@@ -139,22 +139,103 @@ extern void __asm grab_track(
     register __d0 unsigned int count);
 
 #define BYTES_PER_TRACK (128*1024)
+#define NR_TRACKS 160
+
+/* Tracks captured back to back between writes to the target file. */
+#define DEFAULT_BATCH 10
+
+/* Take over the machine and start the motor. */
+static void begin_capture(UWORD *dmacon, UWORD *intena, UWORD *adkcon)
+{
+    *intena = custom->intenar;
+    custom->intena = 0x7fff;
+    *dmacon = custom->dmaconr;
+    custom->dmacon = 0x7fff;
+    *adkcon = custom->adkconr;
+    custom->adkcon = 0x7f00;
+    custom->adkcon = 0x9100; /* no precomp, no word sync, MFM */
+    custom->dsklen = 0;
+
+    /* Motor on, drive 0, seek inwards, side 0.
+     * NB. We must do this as a three-step process:
+     *  1. Deselect all drives
+     *  2. Assert motor-on line
+     *  3. Select required drive
+     * As drives sample the motor-on signal only on the asserting edge of 
+     * their select signal. If a drive is selected in the same write cycle 
+     * as the motor-on signal is asserted, some drives will sample the 
+     * motor-on signal too early and turn *off* their motor! */
+    ciab->ciaprb |= 0x78;
+    ciab->ciaprb = (UBYTE)~CIAF_DSKMOTOR;
+    ciab->ciaprb = (UBYTE)~(CIAF_DSKMOTOR
+                            | (1u << (CIAB_DSKSEL0 + unit))
+                            | CIAF_DSKDIREC);
+
+    wait_dskrdy();
+}
+
+/* Give the machine back. The drive stays selected with its motor on, and
+ * the heads stay put, ready for the next batch. */
+static void end_capture(UWORD dmacon, UWORD intena, UWORD adkcon)
+{
+    custom->adkcon = 0x7f00;
+    custom->adkcon = 0x8000 | adkcon;
+    custom->dmacon = 0x7fff;
+    custom->dmacon = 0x8000 | dmacon;
+    custom->intena = 0x7fff;
+    custom->intena = 0x8000 | intena;
+}
+
+static void capture_track(int track, unsigned char *dat)
+{
+    if (track & 1) {
+        /* Side 1. */
+        ciab->ciaprb &= ~(UBYTE)CIAF_DSKSIDE;
+    } else if (track == 0) {
+        seek_track0();
+    } else {
+        /* Side 0, and step the heads inwards one track. */
+        ciab->ciaprb |= CIAF_DSKSIDE;
+        ciab->ciaprb &= (UBYTE)~CIAF_DSKSTEP;
+        ciab->ciaprb |= CIAF_DSKSTEP;
+        cia_delay_ms(18);
+    }
+
+    /* Full-range free-running CIAB timer A. */
+    ciab->ciacra &= 0xc0;
+    ciab->ciatalo = 0xff;
+    ciab->ciatahi = 0xff;
+    ciab->ciacra |= CIACRAF_START;
+
+    grab_track(dat, BYTES_PER_TRACK);
+
+    /* Stop CIAB timer A. */
+    ciab->ciacra &= 0xc0;
+
+    if (track == NR_TRACKS-1)
+        seek_track0();
+}
 
 int main(int argc, char **argv)
 {
     FILE *fp;
     UWORD dmacon, intena, adkcon;
-    int track;
+    int track, i, batch = DEFAULT_BATCH;
     unsigned char *dat;
 
-    if ((argc != 2) && (argc != 3)) {
-        fprintf(stderr, "Usage: diskread <target_filename> [drive #]\n");
+    if ((argc < 2) || (argc > 4)) {
+        fprintf(stderr, "Usage: diskread <target_filename> [drive #] "
+                "[tracks per batch]\n");
         exit(1);
     }
 
-    if (argc == 3)
+    if (argc >= 3)
         unit = *argv[2] - '0';
     drivename[2] = '0' + unit;
+    if ((argc == 4) && ((batch = atoi(argv[3])) <= 0))
+        batch = 1;
+    if (batch > NR_TRACKS)
+        batch = NR_TRACKS;
 
     acquire_drive();
 
@@ -164,83 +245,33 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    if ((dat = malloc(BYTES_PER_TRACK)) == NULL) {
+    /* Capture buffers need not be chip RAM: the CPU polls DSKBYTR. */
+    while (((dat = malloc(batch * BYTES_PER_TRACK)) == NULL) && (batch > 1))
+        batch /= 2;
+    if (dat == NULL) {
         fprintf(stderr, "Could not alloc %u bytes\n", BYTES_PER_TRACK);
         fclose(fp);
         release_drive();
         exit(1);
     }
 
-    printf("Reading %s track 0", drivename);
-
-    for (track = 0; track < 160; track++) {
-        if (track > 10)
-            putchar('\b');
-        if (track > 100)
-            putchar('\b');
-        printf("\b%d", track);
+    for (track = 0; track < NR_TRACKS; track += i) {
+        printf("\rReading %s track %d", drivename, track);
         fflush(stdout);
 
-        intena = custom->intenar;
-        custom->intena = 0x7fff;
-        dmacon = custom->dmaconr;
-        custom->dmacon = 0x7fff;
-        adkcon = custom->adkconr;
-        custom->adkcon = 0x7f00;
-        custom->adkcon = 0x9100; /* no precomp, no word sync, MFM */
-        custom->dsklen = 0;
-
-        /* Motor on, drive 0, seek inwards, side 0.
-         * NB. We must do this as a three-step process:
-         *  1. Deselect all drives
-         *  2. Assert motor-on line
-         *  3. Select required drive
-         * As drives sample the motor-on signal only on the asserting edge of 
-         * their select signal. If a drive is selected in the same write cycle 
-         * as the motor-on signal is asserted, some drives will sample the 
-         * motor-on signal too early and turn *off* their motor! */
-        ciab->ciaprb |= 0x78;
-        ciab->ciaprb = (UBYTE)~CIAF_DSKMOTOR;
-        ciab->ciaprb = (UBYTE)~(CIAF_DSKMOTOR
-                                | (1u << (CIAB_DSKSEL0 + unit))
-                                | CIAF_DSKDIREC);
-
-        wait_dskrdy();
-
-        if (track & 1) {
-            /* Side 1. */
-            ciab->ciaprb &= ~(UBYTE)CIAF_DSKSIDE;
-        } else if (track == 0) {
-            seek_track0();
-        } else {
-            /* Step the heads inwards one track. */
-            ciab->ciaprb &= (UBYTE)~CIAF_DSKSTEP;
-            ciab->ciaprb |= CIAF_DSKSTEP;
-            cia_delay_ms(18);
+        /* The system is stopped while a batch is captured, so the file
+         * cannot be written meanwhile: instead capture several tracks,
+         * without a pause for the system at each, and write them in one go
+         * while the heads rest on the next. */
+        begin_capture(&dmacon, &intena, &adkcon);
+        for (i = 0; (i < batch) && (track + i < NR_TRACKS); i++)
+            capture_track(track + i, dat + i * BYTES_PER_TRACK);
+        end_capture(dmacon, intena, adkcon);
+
+        if (fwrite(dat, BYTES_PER_TRACK, i, fp) != i) {
+            fprintf(stderr, "\nError writing \"%s\"\n", argv[1]);
+            break;
         }
-
-        /* Full-range free-running CIAB timer A. */
-        ciab->ciacra &= 0xc0;
-        ciab->ciatalo = 0xff;
-        ciab->ciatahi = 0xff;
-        ciab->ciacra |= CIACRAF_START;
-
-        grab_track(dat, BYTES_PER_TRACK);
-
-        /* Stop CIAB timer A. */
-        ciab->ciacra &= 0xc0;
-
-        if (track == 159)
-            seek_track0();
-
-        custom->adkcon = 0x7f00;
-        custom->adkcon = 0x8000 | adkcon;
-        custom->dmacon = 0x7fff;
-        custom->dmacon = 0x8000 | dmacon;
-        custom->intena = 0x7fff;
-        custom->intena = 0x8000 | intena;
-
-        fwrite(dat, BYTES_PER_TRACK, 1, fp);
     }
 
     printf("\n");
@@ -0,0 +1,1009 @@
+/*
+ * bench/bench.c
+ *
+ * Throughput benchmarks for libdisk. Tracks of each benchmarked format are
+ * synthesised in memory, so no input images are needed. Workloads:
+ *  tbuf:      regenerate raw tracks via the handler's read_raw()
+ *  decode:    PLL decode of a soft flux stream (flux_next_bit())
+ *  write_raw: analyse a soft flux stream via the handler's write_raw()
+ *  flux:      analyse an SCP image of the tracks, rendered with drive
+ *             imperfections, via the handler's write_raw()
+ *  close:     write back a populated disk via the container's close()
+ *  read:      open the written-back image, and read every track's bitcells
+ *
+ * Mbit/s counts one revolution of bitcells per track processed (the decode
+ * workload counts every bitcell it reads). Allocation counts are of
+ * memalloc() calls, per track.
+ *
+ * With --handlers, the workloads give way to a matrix of tbuf and write_raw
+ * throughput for every handler, which may be saved as a baseline and
+ * compared with a later run.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include <libdisk/util.h>
+#include <private/disk.h>
+
+static unsigned int nr_tracks, nr_runs = 1;
+static char **filters;
+static unsigned int nr_filters;
+static char tmpdir[] = "/tmp/libdisk-bench.XXXXXX";
+
+/* Flux corpus: peak jitter (ns), peak speed variation (%), and weak
+ * bitcells per track. Kept in corpus_dir if given. */
+static unsigned int corpus_jitter = 100, corpus_weak;
+static double corpus_speed = 1.0;
+static char *corpus_dir;
+
+#ifdef BENCH_COUNT_ALLOCS
+/* Linked with -Wl,--wrap=memalloc: count every libdisk allocation. */
+static unsigned long nr_allocs;
+void *__real_memalloc(size_t size);
+void *__wrap_memalloc(size_t size)
+{
+    nr_allocs++;
+    return __real_memalloc(size);
+}
+#endif
+
+struct result {
+    uint64_t bits;
+    unsigned int tracks;
+    double secs;
+    unsigned long allocs;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result_start(struct result *r)
+{
+    memset(r, 0, sizeof(*r));
+#ifdef BENCH_COUNT_ALLOCS
+    r->allocs = nr_allocs;
+#endif
+    r->secs = now();
+}
+
+static void result_end(struct result *r)
+{
+    r->secs = now() - r->secs;
+#ifdef BENCH_COUNT_ALLOCS
+    r->allocs = nr_allocs - r->allocs;
+#endif
+}
+
+static int selected(const char *name)
+{
+    unsigned int i;
+    if (nr_filters == 0)
+        return 1;
+    for (i = 0; i < nr_filters; i++)
+        if (strstr(name, filters[i]) != NULL)
+            return 1;
+    return 0;
+}
+
+/* Report the fastest of @nr_runs results. */
+static void report(const char *name, struct result *r)
+{
+    struct result *best = r;
+    unsigned int i;
+
+    for (i = 1; i < nr_runs; i++)
+        if (r[i].secs < best->secs)
+            best = &r[i];
+
+    printf("%-24s %10.2f %10.1f", name,
+           best->bits / best->secs / 1e6, best->tracks / best->secs);
+#ifdef BENCH_COUNT_ALLOCS
+    printf(" %12.1f", (double)best->allocs / (best->tracks ?: 1));
+#else
+    printf(" %12s", "-");
+#endif
+    printf("\n");
+}
+
+/*
+ * Synthetic track contents, set up as the handler's write_raw() would.
+ */
+
+static void fill_random(uint8_t *p, unsigned int len, uint32_t *seed)
+{
+    unsigned int i;
+    for (i = 0; i < len; i++)
+        p[i] = (uint8_t)rnd16(seed);
+}
+
+static void seed_amigados(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+
+    init_track_info(ti, TRKTYP_amigados);
+    ti->dat = memalloc(ti->len);
+    fill_random(ti->dat, ti->len, seed);
+    ti->data_bitoff = 1024;
+    ti->total_bits = DEFAULT_BITS_PER_TRACK(d);
+    set_all_sectors_valid(ti);
+}
+
+static void seed_ibm_mfm(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    uint8_t sec_map[9], cyl_map[9], head_map[9], mark_map[9];
+    uint8_t dat[9*512];
+    unsigned int i;
+
+    for (i = 0; i < 9; i++) {
+        sec_map[i] = i + 1;
+        cyl_map[i] = tracknr / 2;
+        head_map[i] = tracknr & 1;
+        mark_map[i] = IBM_MARK_DAM;
+    }
+    fill_random(dat, sizeof(dat), seed);
+    setup_ibm_mfm_track(d, tracknr, TRKTYP_ibm_mfm_dd, 9, 2,
+                        sec_map, cyl_map, head_map, mark_map, dat);
+}
+
+static void seed_ibm_fm(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    uint8_t sec_map[10], cyl_map[10], head_map[10], mark_map[10];
+    uint8_t dat[10*256];
+    unsigned int i;
+
+    for (i = 0; i < 10; i++) {
+        sec_map[i] = i + 1;
+        cyl_map[i] = tracknr / 2;
+        head_map[i] = tracknr & 1;
+        mark_map[i] = IBM_MARK_DAM;
+    }
+    fill_random(dat, sizeof(dat), seed);
+    setup_ibm_mfm_track(d, tracknr, TRKTYP_ibm_fm_dd, 10, 1,
+                        sec_map, cyl_map, head_map, mark_map, dat);
+}
+
+static void seed_sega_system_24(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+
+    /* High density: twice the bitcells of a DD track. */
+    init_track_info(ti, TRKTYP_sega_system_24);
+    ti->len = 5*2048 + 1024 + 256;
+    ti->dat = memalloc(ti->len);
+    fill_random(ti->dat, ti->len, seed);
+    ti->data_bitoff = 500;
+    ti->total_bits = DEFAULT_BITS_PER_TRACK(d) * 2;
+    set_all_sectors_valid(ti);
+}
+
+static void seed_copylock(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    uint32_t lfsr_seed;
+
+    /* Only lfsr_seed[22:0] is used, and it must be non-zero. */
+    do {
+        lfsr_seed = ((uint32_t)rnd16(seed) << 16 | rnd16(seed)) & 0x7fffff;
+    } while (lfsr_seed == 0);
+
+    init_track_info(ti, TRKTYP_copylock);
+    ti->len = 4;
+    ti->dat = memalloc(ti->len);
+    *(uint32_t *)ti->dat = htobe32(lfsr_seed);
+    ti->data_bitoff = 1024;
+    ti->total_bits = DEFAULT_BITS_PER_TRACK(d);
+    set_all_sectors_valid(ti);
+}
+
+static void seed_longtrack(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+
+    init_track_info(ti, TRKTYP_protec_longtrack);
+    ti->len = 1;
+    ti->dat = memalloc(ti->len);
+    ti->dat[0] = 0x33;
+    ti->data_bitoff = 1024;
+    ti->total_bits = 110000;
+}
+
+static const struct format_bench {
+    const char *name;
+    enum track_type type;
+    void (*seed)(struct disk *, unsigned int tracknr, uint32_t *seed);
+} formats[] = {
+    { "amigados", TRKTYP_amigados, seed_amigados },
+    { "ibm_mfm", TRKTYP_ibm_mfm_dd, seed_ibm_mfm },
+    { "ibm_fm", TRKTYP_ibm_fm_dd, seed_ibm_fm },
+    { "sega_system_24", TRKTYP_sega_system_24, seed_sega_system_24 },
+    { "copylock", TRKTYP_copylock, seed_copylock },
+    { "longtrack", TRKTYP_protec_longtrack, seed_longtrack }
+};
+
+/* Containers, and the format of the tracks written to each. */
+static const struct container_bench {
+    const char *suffix;
+    const char *format;
+    bool_t readable;
+} containers[] = {
+    { "adf", "amigados", 1 },
+    { "eadf", "amigados", 1 },
+    { "dsk", "amigados", 1 },
+    { "hfe", "amigados", 1 },
+    { "ipf", "amigados", 1 },
+    { "scp", "amigados", 0 },
+    { "img", "ibm_mfm", 0 },
+    { "imd", "ibm_mfm", 1 },
+    { "jv3", "ibm_mfm", 0 }
+};
+
+/* A scratch disk holding synthetic tracks, and their raw bitcells. */
+struct source {
+    const struct format_bench *fmt;
+    struct disk *disk;
+    struct track_raw **raw;
+};
+
+static struct source *source_create(const struct format_bench *fmt)
+{
+    struct source *src = memalloc(sizeof(*src));
+    uint32_t seed = 0x12345678;
+    unsigned int i;
+
+    src->fmt = fmt;
+    if ((src->disk = disk_create("bench.dsk", DISKFL_read_only)) == NULL)
+        errx(1, "Cannot create scratch disk");
+    src->raw = memalloc(nr_tracks * sizeof(*src->raw));
+    for (i = 0; i < nr_tracks; i++) {
+        track_mark_unformatted(src->disk, i);
+        fmt->seed(src->disk, i, &seed);
+        src->raw[i] = track_alloc_raw_buffer(src->disk);
+        track_read_raw(src->raw[i], i);
+    }
+
+    return src;
+}
+
+static void source_destroy(struct source *src)
+{
+    unsigned int i;
+    for (i = 0; i < nr_tracks; i++)
+        track_free_raw_buffer(src->raw[i]);
+    memfree(src->raw);
+    disk_close(src->disk);
+    memfree(src);
+}
+
+/* Analyse every source track into destination disk @d. */
+static void write_tracks(struct source *src, struct disk *d, struct result *r)
+{
+    struct track_raw *raw;
+    struct stream *s;
+    unsigned int i;
+
+    for (i = 0; i < nr_tracks; i++) {
+        raw = src->raw[i];
+        s = stream_soft_open(
+            raw->bits, track_raw_speed(raw), raw->bitlen, DEFAULT_RPM);
+        if (track_write_raw_from_stream(d, i, src->fmt->type, s) != 0)
+            errx(1, "%s: Track %u.%u not recognised",
+                 src->fmt->name, i/2, i&1);
+        stream_close(s);
+        if (r != NULL) {
+            r->bits += raw->bitlen;
+            r->tracks++;
+        }
+    }
+}
+
+static void bench_tbuf(struct source *src, struct result *r)
+{
+    unsigned int i;
+
+    /* Time the handlers, not the raw track cache. */
+    raw_cache_flush(src->disk);
+    result_start(r);
+    for (i = 0; i < nr_tracks; i++) {
+        track_read_raw(src->raw[i], i);
+        r->bits += src->raw[i]->bitlen;
+        r->tracks++;
+    }
+    result_end(r);
+}
+
+static void bench_decode(struct source *src, struct result *r)
+{
+    struct track_raw *raw;
+    struct stream *s;
+    unsigned int i;
+
+    result_start(r);
+    for (i = 0; i < nr_tracks; i++) {
+        raw = src->raw[i];
+        s = stream_soft_open(
+            raw->bits, track_raw_speed(raw), raw->bitlen, DEFAULT_RPM);
+        stream_select_track(s, i);
+        while (stream_next_bit(s) != -1)
+            r->bits++;
+        stream_close(s);
+        r->tracks++;
+    }
+    result_end(r);
+}
+
+static void bench_write_raw(struct source *src, struct result *r)
+{
+    struct disk *d;
+
+    if ((d = disk_create("bench.dsk", DISKFL_read_only)) == NULL)
+        errx(1, "Cannot create scratch disk");
+    result_start(r);
+    write_tracks(src, d, r);
+    result_end(r);
+    disk_close(d);
+}
+
+static void bench_close(
+    struct source *src, const char *suffix, struct result *r)
+{
+    char name[sizeof(tmpdir) + 16];
+    struct disk *d;
+    unsigned int i;
+
+    snprintf(name, sizeof(name), "%s/bench.%s", tmpdir, suffix);
+    if ((d = disk_create(name, 0)) == NULL)
+        errx(1, "Cannot create %s", name);
+    memset(r, 0, sizeof(*r));
+    write_tracks(src, d, NULL);
+
+    result_start(r);
+    for (i = 0; i < nr_tracks; i++) {
+        r->bits += src->raw[i]->bitlen;
+        r->tracks++;
+    }
+    disk_close(d);
+    result_end(r);
+
+    unlink(name);
+}
+
+static void bench_read(
+    struct source *src, const char *suffix, struct result *r)
+{
+    char name[sizeof(tmpdir) + 16];
+    struct track_raw *raw;
+    struct disk *d;
+    unsigned int i;
+
+    snprintf(name, sizeof(name), "%s/bench.%s", tmpdir, suffix);
+    if ((d = disk_create(name, 0)) == NULL)
+        errx(1, "Cannot create %s", name);
+    write_tracks(src, d, NULL);
+    disk_close(d);
+
+    result_start(r);
+    if ((d = disk_open(name, DISKFL_read_only)) == NULL)
+        errx(1, "Cannot open %s", name);
+    raw = track_alloc_raw_buffer(d);
+    for (i = 0; i < nr_tracks; i++) {
+        track_read_raw(raw, i);
+        r->bits += raw->bitlen;
+        r->tracks++;
+    }
+    track_free_raw_buffer(raw);
+    disk_close(d);
+    result_end(r);
+
+    unlink(name);
+}
+
+/*
+ * Flux corpus: each format's source tracks rendered as an SCP image, as a
+ * drive would read them back: every revolution is a fresh read, its flux
+ * transitions jittered and its rotation speed varying. Rendering uses a
+ * fixed PRNG seed, so the corpus is the same on every run and every host.
+ */
+
+#define CORPUS_REVS 2
+
+struct scp_header {
+    uint8_t sig[3];
+    uint8_t version;
+    uint8_t disk_type;
+    uint8_t nr_revolutions;
+    uint8_t start_track;
+    uint8_t end_track;
+    uint8_t flags;
+    uint8_t cell_width;
+    uint16_t reserved;
+    uint32_t checksum;
+};
+
+#define SCP_NS_PER_TICK 25u
+#define SCP_MAX_TRACKS 168
+
+/* Uniform in [-1,1). */
+static double rnd_unit(uint32_t *seed)
+{
+    return (int16_t)rnd16(seed) / 32768.0;
+}
+
+/* Triangle wave of period 1, in [-1,1]. */
+static double triangle(double x)
+{
+    x -= (int64_t)x;
+    return (x < 0.5) ? 4*x - 1 : 3 - 4*x;
+}
+
+static void put_sample(uint16_t *out, uint32_t *nr, uint32_t ticks)
+{
+    while (ticks >= 0x10000u) {
+        out[(*nr)++] = 0;
+        ticks -= 0x10000u;
+    }
+    out[(*nr)++] = htobe16(ticks ?: 1);
+}
+
+/* Render one revolution of the ideal flux @in (@nr_in big-endian samples,
+ * @duration ticks) into @out. Returns the number of samples written. */
+static uint32_t render_rev(
+    const uint16_t *in, uint32_t nr_in, uint32_t duration,
+    double weak_start, double weak_end, double av_cell,
+    uint16_t *out, uint32_t *seed)
+{
+    double phase = rnd16(seed) / 65536.0, len = duration * SCP_NS_PER_TICK;
+    double t = 0, warped = 0, pos, f;
+    uint32_t i, acc = 0, tick, last = 0, nr = 0;
+    uint16_t x;
+
+    for (i = 0; i < nr_in; i++) {
+        x = be16toh(in[i]);
+        acc += x ?: 0x10000u;
+        if (x == 0)
+            continue;
+        f = 1 + corpus_speed / 100 * triangle(t / len + phase);
+        t += acc * (double)SCP_NS_PER_TICK;
+        warped += acc * (double)SCP_NS_PER_TICK * f;
+        acc = 0;
+        pos = warped + corpus_jitter * rnd_unit(seed);
+        if ((t >= weak_start) && (t < weak_end))
+            pos += 2 * av_cell * rnd_unit(seed);
+        tick = (pos > 0) ? pos / SCP_NS_PER_TICK : 0;
+        if (tick <= last)
+            tick = last + 1;
+        put_sample(out, &nr, tick - last);
+        last = tick;
+    }
+
+    return nr;
+}
+
+static void checksum_and_write(
+    int fd, uint32_t *p_csum, const void *dat, size_t len)
+{
+    const uint8_t *p = dat;
+    write_exact(fd, dat, len);
+    while (len--)
+        *p_csum += *p++;
+}
+
+static void write_corpus(struct source *src, const char *name)
+{
+    struct scp_header hdr;
+    struct track_raw *raw;
+    uint32_t th_offs[SCP_MAX_TRACKS], rev_hdr[CORPUS_REVS][3];
+    uint32_t seed = TBUF_PRNG_INIT, csum = 0, file_off, nr_in, duration;
+    uint32_t nr[CORPUS_REVS], rev_off;
+    uint16_t *in, *out[CORPUS_REVS];
+    uint8_t trk_hdr[4];
+    double av_cell, weak_start = 0, weak_end = 0;
+    unsigned int i, j;
+    int fd;
+
+    if ((fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", name);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.sig, "SCP", sizeof(hdr.sig));
+    hdr.disk_type = 4; /* Amiga */
+    hdr.nr_revolutions = CORPUS_REVS;
+    hdr.end_track = nr_tracks - 1;
+    hdr.flags = 1u << 0; /* index cued */
+    memset(th_offs, 0, sizeof(th_offs));
+    write_exact(fd, &hdr, sizeof(hdr));
+    write_exact(fd, th_offs, sizeof(th_offs));
+    file_off = sizeof(hdr) + sizeof(th_offs);
+
+    for (i = 0; i < nr_tracks; i++) {
+        raw = src->raw[i];
+        in = track_raw_scp_flux(raw, &nr_in, &duration);
+        av_cell = (double)duration * SCP_NS_PER_TICK / raw->bitlen;
+        if (corpus_weak && (corpus_weak < raw->bitlen)) {
+            weak_start = (rnd16(&seed) * (raw->bitlen - corpus_weak)
+                          / 65536) * av_cell;
+            weak_end = weak_start + corpus_weak * av_cell;
+        }
+
+        rev_off = sizeof(trk_hdr) + sizeof(rev_hdr);
+        for (j = 0; j < CORPUS_REVS; j++) {
+            out[j] = memalloc_nz((2 * nr_in + 1) * sizeof(*out[j]));
+            nr[j] = render_rev(in, nr_in, duration, weak_start, weak_end,
+                               av_cell, out[j], &seed);
+            rev_hdr[j][0] = htole32(duration);
+            rev_hdr[j][1] = htole32(nr[j]);
+            rev_hdr[j][2] = htole32(rev_off);
+            rev_off += nr[j] * sizeof(*out[j]);
+        }
+
+        th_offs[i] = htole32(file_off);
+        memcpy(trk_hdr, "TRK", 3);
+        trk_hdr[3] = i;
+        checksum_and_write(fd, &csum, trk_hdr, sizeof(trk_hdr));
+        checksum_and_write(fd, &csum, rev_hdr, sizeof(rev_hdr));
+        for (j = 0; j < CORPUS_REVS; j++) {
+            checksum_and_write(fd, &csum, out[j], nr[j] * sizeof(*out[j]));
+            memfree(out[j]);
+        }
+        file_off += rev_off;
+        memfree(in);
+    }
+
+    lseek(fd, sizeof(hdr), SEEK_SET);
+    checksum_and_write(fd, &csum, th_offs, sizeof(th_offs));
+    hdr.checksum = htole32(csum);
+    lseek(fd, 0, SEEK_SET);
+    write_exact(fd, &hdr, sizeof(hdr));
+    close(fd);
+}
+
+static void bench_flux(
+    struct source *src, const char *name, struct result *r)
+{
+    struct stream *s;
+    struct disk *d;
+    unsigned int i, nr_bad = 0;
+
+    if ((d = disk_create("bench.dsk", DISKFL_read_only)) == NULL)
+        errx(1, "Cannot create scratch disk");
+    if ((s = stream_open(name, DEFAULT_RPM, DEFAULT_RPM)) == NULL)
+        errx(1, "Cannot open %s", name);
+
+    result_start(r);
+    for (i = 0; i < nr_tracks; i++) {
+        if (track_write_raw_from_stream(d, i, src->fmt->type, s) != 0)
+            nr_bad++;
+        r->bits += src->raw[i]->bitlen;
+        r->tracks++;
+    }
+    result_end(r);
+
+    if (nr_bad)
+        warnx("%s: %u of %u tracks not recognised",
+              name, nr_bad, nr_tracks);
+    stream_close(s);
+    disk_close(d);
+}
+
+/*
+ * Handler matrix: every track type with both read_raw() and write_raw(), its
+ * tracks seeded with random data in the layout init_track_info() gives it.
+ * Handlers whose data has internal structure (lengths, keys, checksums) may
+ * not recognise their own random tracks: their write_raw() is not timed.
+ */
+
+struct handler_result {
+    double tbuf, write_raw; /* Mbit/s; 0 if not timed */
+};
+
+static enum track_type handler_type;
+
+static void seed_handler(
+    struct disk *d, unsigned int tracknr, uint32_t *seed)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+
+    init_track_info(ti, handler_type);
+    ti->dat = memalloc(ti->len);
+    fill_random(ti->dat, ti->len, seed);
+    ti->data_bitoff = 1024;
+    ti->total_bits = DEFAULT_BITS_PER_TRACK(d);
+    switch (handlers[handler_type]->density) {
+    case trkden_single: ti->total_bits /= 2; break;
+    case trkden_high: ti->total_bits *= 2; break;
+    case trkden_extra: ti->total_bits *= 4; break;
+    default: break;
+    }
+    set_all_sectors_valid(ti);
+}
+
+/* Time the handler's write_raw() on every source track, or return 0 if it
+ * does not recognise them all. */
+static double handler_write_raw(struct source *src)
+{
+    struct track_raw *raw;
+    struct stream *s;
+    struct disk *d;
+    struct result r;
+    unsigned int i;
+    int rc = 0;
+
+    if ((d = disk_create("bench.dsk", DISKFL_read_only)) == NULL)
+        errx(1, "Cannot create scratch disk");
+    result_start(&r);
+    for (i = 0; (i < nr_tracks) && (rc == 0); i++) {
+        raw = src->raw[i];
+        s = stream_soft_open(
+            raw->bits, track_raw_speed(raw), raw->bitlen, DEFAULT_RPM);
+        rc = track_write_raw_from_stream(d, i, src->fmt->type, s);
+        stream_close(s);
+        r.bits += raw->bitlen;
+    }
+    result_end(&r);
+    disk_close(d);
+
+    return rc ? 0 : r.bits / r.secs / 1e6;
+}
+
+/* Runs in a child process, as a handler may fault on random data. Its
+ * warnings are of no interest here. */
+static void handler_bench(enum track_type type, struct handler_result *hr)
+{
+    struct format_bench fmt = {
+        disk_get_format_id_name(type), type, seed_handler };
+    struct source *src;
+    struct result r;
+    unsigned int k;
+    double mbps;
+    int fd;
+
+    if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+
+    memset(hr, 0, sizeof(*hr));
+    handler_type = type;
+    src = source_create(&fmt);
+
+    for (k = 0; k < nr_runs; k++) {
+        bench_tbuf(src, &r);
+        hr->tbuf = max_t(double, hr->tbuf, r.bits / r.secs / 1e6);
+        if ((k == 0) || (hr->write_raw != 0)) {
+            mbps = handler_write_raw(src);
+            hr->write_raw = mbps ? max_t(double, hr->write_raw, mbps) : 0;
+        }
+    }
+
+    source_destroy(src);
+}
+
+/* Returns -1 if the handler faulted. */
+static int handler_bench_child(
+    enum track_type type, struct handler_result *hr)
+{
+    int pfd[2], status;
+    pid_t pid;
+    ssize_t rc;
+
+    if (pipe(pfd) != 0)
+        err(1, "pipe");
+    fflush(stdout);
+    if ((pid = fork()) == -1)
+        err(1, "fork");
+    if (pid == 0) {
+        close(pfd[0]);
+        handler_bench(type, hr);
+        write_exact(pfd[1], hr, sizeof(*hr));
+        _exit(0);
+    }
+
+    close(pfd[1]);
+    rc = read(pfd[0], hr, sizeof(*hr));
+    close(pfd[0]);
+    if ((waitpid(pid, &status, 0) != pid)
+        || !WIFEXITED(status) || WEXITSTATUS(status)
+        || (rc != sizeof(*hr)))
+        return -1;
+    return 0;
+}
+
+/* Look up @id_name in baseline file @fp. */
+static int baseline_lookup(
+    FILE *fp, const char *id_name, struct handler_result *hr)
+{
+    char line[256], name[128];
+
+    if (fp == NULL)
+        return -1;
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((line[0] == '#')
+            || (sscanf(line, "%lf %lf %127s", &hr->tbuf, &hr->write_raw,
+                       name) != 3))
+            continue;
+        if (!strcmp(name, id_name))
+            return 0;
+    }
+    return -1;
+}
+
+static void print_change(double now, double base)
+{
+    if ((now == 0) || (base == 0))
+        printf(" %8s", "-");
+    else
+        printf(" %+7.1f%%", (now - base) * 100 / base);
+}
+
+static void bench_handlers(const char *baseline, const char *save)
+{
+    const struct track_handler *thnd;
+    struct handler_result hr, base;
+    const char *id_name;
+    char name[64];
+    FILE *in = NULL, *out = NULL;
+    unsigned int type, nr_slower = 0;
+
+    if ((baseline != NULL) && ((in = fopen(baseline, "r")) == NULL))
+        err(1, "%s", baseline);
+    if ((save != NULL) && ((out = fopen(save, "w")) == NULL))
+        err(1, "%s", save);
+    if (out != NULL)
+        fprintf(out, "# libdisk bench handler baseline: "
+                "tbuf_mbps write_raw_mbps handler\n");
+
+    printf("%-32s %10s %10s", "handler", "tbuf", "write_raw");
+    if (in != NULL)
+        printf(" %9s %9s", "tbuf %", "write %");
+    printf("\n");
+
+    for (type = 0; disk_get_format(type) != NULL; type++) {
+        thnd = handlers[type];
+        id_name = disk_get_format_id_name(type);
+        snprintf(name, sizeof(name), "handler/%s", id_name);
+        if ((thnd->read_raw == NULL) || (thnd->write_raw == NULL)
+            || (thnd->nr_sectors == 0) || (thnd->bytes_per_sector == 0)
+            || !selected(name))
+            continue;
+
+        if (handler_bench_child(type, &hr) != 0) {
+            printf("%-32s %10s %10s\n", id_name, "fault", "-");
+            continue;
+        }
+
+        printf("%-32s %10.2f ", id_name, hr.tbuf);
+        if (hr.write_raw != 0)
+            printf("%10.2f", hr.write_raw);
+        else
+            printf("%10s", "-");
+        if ((in != NULL) && !baseline_lookup(in, id_name, &base)) {
+            print_change(hr.tbuf, base.tbuf);
+            print_change(hr.write_raw, base.write_raw);
+            if ((hr.tbuf < base.tbuf * 0.9)
+                || (hr.write_raw && (hr.write_raw < base.write_raw * 0.9))) {
+                printf(" slower");
+                nr_slower++;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+
+        if (out != NULL)
+            fprintf(out, "%.2f %.2f %s\n", hr.tbuf, hr.write_raw, id_name);
+    }
+
+    if (in != NULL) {
+        printf("%u handlers more than 10%% slower than %s\n",
+               nr_slower, baseline);
+        fclose(in);
+    }
+    if ((out != NULL) && (fclose(out) != 0))
+        err(1, "%s", save);
+}
+
+static void usage(int rc)
+{
+    printf("Usage: bench [options] [workload...]\n");
+    printf("Runs each workload whose name contains any given string.\n");
+    printf("Options:\n");
+    printf("  -h, --help          Display this information\n");
+    printf("  -r, --runs=N        Report the best of N runs (default 1)\n");
+    printf("  -t, --tracks=N      Tracks per workload run (default 160)\n");
+    printf("Handler matrix options:\n");
+    printf("  -H, --handlers      Time every handler's read_raw and write_raw,\n");
+    printf("                      in place of the workloads (default 16 tracks)\n");
+    printf("  -b, --baseline=FILE Compare the matrix with FILE\n");
+    printf("  -s, --save=FILE     Save the matrix to FILE, as a baseline\n");
+    printf("Flux corpus options:\n");
+    printf("  -c, --corpus=DIR    Keep the corpus, as DIR/<format>.scp\n");
+    printf("  -J, --jitter=NS     Peak flux transition jitter (default 100)\n");
+    printf("  -S, --speed=PCT     Peak rotation speed variation (default 1)\n");
+    printf("  -W, --weak=N        Weak bitcells per track (default 0)\n");
+    exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+    const struct format_bench *fmt;
+    struct source *src;
+    struct result *r;
+    char name[64], *path, *baseline = NULL, *save = NULL;
+    unsigned int i, j, k;
+    int ch, matrix = 0;
+
+    const static char sopts[] = "hr:t:c:J:S:W:Hb:s:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "runs", 1, NULL, 'r' },
+        { "tracks", 1, NULL, 't' },
+        { "corpus", 1, NULL, 'c' },
+        { "jitter", 1, NULL, 'J' },
+        { "speed", 1, NULL, 'S' },
+        { "weak", 1, NULL, 'W' },
+        { "handlers", 0, NULL, 'H' },
+        { "baseline", 1, NULL, 'b' },
+        { "save", 1, NULL, 's' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'r':
+            nr_runs = atoi(optarg);
+            break;
+        case 't':
+            if ((nr_tracks = atoi(optarg)) == 0)
+                usage(1);
+            break;
+        case 'c':
+            corpus_dir = optarg;
+            break;
+        case 'J':
+            corpus_jitter = atoi(optarg);
+            break;
+        case 'S':
+            corpus_speed = atof(optarg);
+            break;
+        case 'W':
+            corpus_weak = atoi(optarg);
+            break;
+        case 'H':
+            matrix = 1;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 's':
+            save = optarg;
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (nr_tracks == 0)
+        nr_tracks = matrix ? 16 : 160;
+    if ((nr_runs == 0) || (nr_tracks > 160)
+        || (!matrix && ((baseline != NULL) || (save != NULL))))
+        usage(1);
+
+    filters = &argv[optind];
+    nr_filters = argc - optind;
+
+    if (matrix) {
+        bench_handlers(baseline, save);
+        return 0;
+    }
+
+    if (mkdtemp(tmpdir) == NULL)
+        err(1, "%s", tmpdir);
+
+    r = memalloc(nr_runs * sizeof(*r));
+
+    printf("%-24s %10s %10s %12s\n",
+           "workload", "Mbit/s", "tracks/s", "allocs/track");
+
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        fmt = &formats[i];
+        src = NULL;
+
+#define RUN(wl, fn) do {                                        \
+        snprintf(name, sizeof(name), "%s/%s", wl, fmt->name);   \
+        if (!selected(name))                                    \
+            break;                                              \
+        if (src == NULL)                                        \
+            src = source_create(fmt);                           \
+        for (k = 0; k < nr_runs; k++)                           \
+            fn(src, &r[k]);                                     \
+        report(name, r);                                        \
+    } while (0)
+        RUN("tbuf", bench_tbuf);
+        RUN("decode", bench_decode);
+        RUN("write_raw", bench_write_raw);
+#undef RUN
+
+        snprintf(name, sizeof(name), "flux/%s", fmt->name);
+        if (selected(name)) {
+            if (src == NULL)
+                src = source_create(fmt);
+            path = memalloc(strlen(corpus_dir ?: tmpdir)
+                            + strlen(fmt->name) + 6);
+            sprintf(path, "%s/%s.scp", corpus_dir ?: tmpdir, fmt->name);
+            write_corpus(src, path);
+            for (k = 0; k < nr_runs; k++)
+                bench_flux(src, path, &r[k]);
+            report(name, r);
+            if (corpus_dir == NULL)
+                unlink(path);
+            memfree(path);
+        }
+
+        for (j = 0; j < ARRAY_SIZE(containers); j++) {
+            if (strcmp(containers[j].format, fmt->name))
+                continue;
+            snprintf(name, sizeof(name), "close/%s", containers[j].suffix);
+            if (!selected(name))
+                continue;
+            if (src == NULL)
+                src = source_create(fmt);
+            for (k = 0; k < nr_runs; k++)
+                bench_close(src, containers[j].suffix, &r[k]);
+            report(name, r);
+        }
+
+        for (j = 0; j < ARRAY_SIZE(containers); j++) {
+            if (strcmp(containers[j].format, fmt->name) ||
+                !containers[j].readable)
+                continue;
+            snprintf(name, sizeof(name), "read/%s", containers[j].suffix);
+            if (!selected(name))
+                continue;
+            if (src == NULL)
+                src = source_create(fmt);
+            for (k = 0; k < nr_runs; k++)
+                bench_read(src, containers[j].suffix, &r[k]);
+            report(name, r);
+        }
+
+        if (src != NULL)
+            source_destroy(src);
+    }
+
+    memfree(r);
+    rmdir(tmpdir);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,380 @@
+/*
+ * disk-analyse/batch.c
+ *
+ * Batch mode: analyse every image listed in a manifest, without paying process
+ * startup and config parsing for each. As in server mode, the format database
+ * and support libraries are loaded once, and each image is analysed in a
+ * process forked from this one, up to a given number at once.
+ *
+ * Manifest lines are "<in_file> <out_file> [<format>]", separated by
+ * whitespace. Blank lines and lines starting with '#' are ignored.
+ *
+ * On a NUMA host the workers are divided among the nodes, and each job is
+ * pinned to its node's CPUs, so that the flux buffers it allocates are local
+ * to it. Images are queued to the nodes round-robin, and a node whose queue
+ * is empty steals from the back of the longest.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* sched_setaffinity() */
+#include <sched.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#if !defined(__MINGW32__)
+#include <sys/wait.h>
+#endif
+
+#include "common.h"
+
+#if !defined(__MINGW32__)
+
+struct batch_job {
+    char *in, *out, *format;
+    pid_t pid;
+    unsigned int node;
+    FILE *log; /* the job's stdout and stderr */
+    struct timespec start;
+};
+
+/* A NUMA node's workers, and its queue of jobs q[head..tail). */
+struct batch_node {
+#if defined(__linux__)
+    cpu_set_t cpus;
+#endif
+    unsigned int *q, head, tail, ahead;
+    unsigned int nr_workers, nr_running;
+};
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec)
+        + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Parse one manifest line in place. Returns 0 if there is a job on it. */
+static int parse_line(char *line, struct batch_job *job, const char *path,
+                      unsigned int lineno)
+{
+    char *f[3], *p;
+    unsigned int nr = 0;
+
+    for (p = strtok(line, " \t\r\n"); p && (p[0] != '#');
+         p = strtok(NULL, " \t\r\n")) {
+        if (nr++ == 3)
+            break;
+        f[nr-1] = p;
+    }
+
+    if (nr == 0)
+        return -1;
+    if ((nr < 2) || (nr > 3))
+        errx(1, "%s:%u: Expected <in_file> <out_file> [<format>]",
+             path, lineno);
+
+    job->in = strdup(f[0]);
+    job->out = strdup(f[1]);
+    job->format = (nr == 3) ? strdup(f[2]) : NULL;
+    job->pid = 0;
+    return 0;
+}
+
+#if defined(__linux__)
+
+/* Parse a sysfs list such as "0-3,8-11" into @set. */
+static int parse_list(const char *path, cpu_set_t *set)
+{
+    char buf[1024], *p;
+    unsigned long lo, hi;
+    FILE *fp;
+    int rc = -1;
+
+    CPU_ZERO(set);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if (fgets(buf, sizeof(buf), fp) == NULL)
+        goto out;
+    for (p = buf; (*p >= '0') && (*p <= '9'); p++) {
+        lo = hi = strtoul(p, &p, 10);
+        if (*p == '-')
+            hi = strtoul(p+1, &p, 10);
+        for (; (lo <= hi) && (lo < CPU_SETSIZE); lo++)
+            CPU_SET(lo, set);
+        if (*p != ',')
+            break;
+    }
+    rc = 0;
+out:
+    fclose(fp);
+    return rc;
+}
+
+/* The online NUMA nodes which have CPUs. */
+static struct batch_node *get_nodes(unsigned int *pnr)
+{
+    struct batch_node *nodes = NULL;
+    cpu_set_t online;
+    char path[64];
+    unsigned int i, nr = 0;
+
+    if (parse_list("/sys/devices/system/node/online", &online) != 0)
+        goto out;
+    nodes = memalloc(CPU_COUNT(&online) * sizeof(*nodes));
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, &online))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+                 i);
+        if ((parse_list(path, &nodes[nr].cpus) == 0)
+            && CPU_COUNT(&nodes[nr].cpus))
+            nr++;
+    }
+
+out:
+    if (nr == 0) {
+        memfree(nodes);
+        nodes = memalloc(sizeof(*nodes));
+        CPU_ZERO(&nodes[0].cpus);
+        nr = 1;
+    }
+    *pnr = nr;
+    return nodes;
+}
+
+#else
+
+static struct batch_node *get_nodes(unsigned int *pnr)
+{
+    *pnr = 1;
+    return memalloc(sizeof(struct batch_node));
+}
+
+#endif
+
+static void start_job(struct batch_job *job, struct batch_node *node,
+                      bool_t pin, int (*fn)(int argc, char **argv))
+{
+    char *argv[6];
+    int argc = 0;
+
+    argv[argc++] = "disk-analyse";
+    if (job->format) {
+        argv[argc++] = "-f";
+        argv[argc++] = job->format;
+    }
+    argv[argc++] = job->in;
+    argv[argc++] = job->out;
+    argv[argc] = NULL;
+
+    if ((job->log = tmpfile()) == NULL)
+        err(1, "tmpfile");
+    fflush(stdout);
+    fflush(stderr);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    if ((job->pid = fork()) < 0)
+        err(1, "fork");
+    if (job->pid == 0) {
+        int fd = fileno(job->log);
+        if ((dup2(fd, 1) < 0) || (dup2(fd, 2) < 0))
+            _exit(0xff);
+#if defined(__linux__)
+        if (pin)
+            (void)sched_setaffinity(0, sizeof(node->cpus), &node->cpus);
+#endif
+        exit(fn(argc, argv));
+    }
+}
+
+/* Print a finished job's output. Returns 0 if it succeeded. */
+static int finish_job(struct batch_job *job, int st)
+{
+    char buf[4096];
+    size_t nr;
+    int rc = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+
+    if (!quiet || rc)
+        printf("== %s -> %s: %s (%.2fs)\n", job->in, job->out,
+               rc ? "FAILED" : "OK", elapsed(&job->start));
+    rewind(job->log);
+    while ((nr = fread(buf, 1, sizeof(buf), job->log)) != 0)
+        fwrite(buf, 1, nr, stdout);
+    fclose(job->log);
+
+    free(job->in);
+    free(job->out);
+    free(job->format);
+    job->pid = 0;
+    return rc;
+}
+
+/* Start reading an upcoming job's input into the page cache, which its
+ * process will share. Inputs which are not single files (Kryoflux dumps) are
+ * left to libdisk's own read-ahead of each track. */
+static void readahead_input(const char *path)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return;
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
+/* Read the whole manifest before starting any job: jobs exit through stdio,
+ * which may move the file offset they share with us. */
+static struct batch_job *read_manifest(const char *path, unsigned int *pnr)
+{
+    struct batch_job *jobs = NULL;
+    char line[4096];
+    unsigned int lineno = 0, nr = 0, max = 0;
+    FILE *fp;
+
+    if (!strcmp(path, "-"))
+        fp = stdin;
+    else if ((fp = fopen(path, "r")) == NULL)
+        err(1, "%s", path);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (nr == max) {
+            max = max ? max * 2 : 64;
+            jobs = realloc(jobs, max * sizeof(*jobs));
+            if (jobs == NULL)
+                err(1, NULL);
+        }
+        if (parse_line(line, &jobs[nr], path, ++lineno) == 0)
+            nr++;
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+    *pnr = nr;
+    return jobs;
+}
+
+int batch(const char *path, unsigned int nr_workers,
+          int (*fn)(int argc, char **argv))
+{
+    struct batch_job *jobs, *job;
+    struct batch_node *nodes, *node, *victim;
+    struct timespec start;
+    struct stat st;
+    unsigned int i, n, nr, nr_nodes, nr_started = 0, nr_running = 0;
+    unsigned int nr_failed = 0;
+    uint64_t bytes = 0;
+    double secs;
+    pid_t pid;
+    int status;
+
+    jobs = read_manifest(path, &nr);
+
+    nodes = get_nodes(&nr_nodes);
+    nr_nodes = min(nr_nodes, nr_workers);
+    for (n = 0; n < nr_nodes; n++) {
+        node = &nodes[n];
+        node->q = memalloc((nr / nr_nodes + 1) * sizeof(*node->q));
+        node->head = node->tail = node->ahead = node->nr_running = 0;
+        node->nr_workers = nr_workers / nr_nodes
+            + (n < nr_workers % nr_nodes);
+    }
+    for (i = 0; i < nr; i++) {
+        node = &nodes[i % nr_nodes];
+        node->q[node->tail++] = i;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((nr_started < nr) || nr_running) {
+        for (n = 0; n < nr_nodes; n++) {
+            node = &nodes[n];
+            while (node->nr_running < node->nr_workers) {
+                if (node->head < node->tail) {
+                    job = &jobs[node->q[node->head++]];
+                } else {
+                    for (victim = NULL, i = 0; i < nr_nodes; i++)
+                        if ((nodes[i].head < nodes[i].tail)
+                            && ((victim == NULL)
+                                || ((nodes[i].tail - nodes[i].head)
+                                    > (victim->tail - victim->head))))
+                            victim = &nodes[i];
+                    if (victim == NULL)
+                        break;
+                    job = &jobs[victim->q[--victim->tail]];
+                }
+                if (stat(job->in, &st) == 0)
+                    bytes += st.st_size;
+                job->node = n;
+                start_job(job, node, nr_nodes > 1, fn);
+                node->nr_running++;
+                nr_running++;
+                nr_started++;
+            }
+            for (node->ahead = max(node->ahead, node->head);
+                 (node->ahead < node->tail)
+                     && (node->ahead < node->head + node->nr_workers);
+                 node->ahead++)
+                readahead_input(jobs[node->q[node->ahead]].in);
+        }
+
+        if ((pid = waitpid(-1, &status, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err(1, "waitpid");
+        }
+        for (i = 0; i < nr; i++) {
+            if (jobs[i].pid != pid)
+                continue;
+            nodes[jobs[i].node].nr_running--;
+            nr_failed += !!finish_job(&jobs[i], status);
+            nr_running--;
+        }
+    }
+
+    for (n = 0; n < nr_nodes; n++)
+        memfree(nodes[n].q);
+    memfree(nodes);
+    free(jobs);
+
+    secs = elapsed(&start);
+    printf("Batch: %u image%s (%u failed) in %.2fs, %u at once: "
+           "%.2f images/s, %.2f MB/s\n", nr, (nr == 1) ? "" : "s",
+           nr_failed, secs, nr_workers, secs ? nr / secs : 0.0,
+           secs ? bytes / secs / 1e6 : 0.0);
+
+    return nr_failed ? 1 : 0;
+}
+
+#else /* defined(__MINGW32__) */
+
+int batch(const char *path, unsigned int nr_workers,
+          int (*fn)(int argc, char **argv))
+{
+    errx(1, "Batch mode is not supported on this platform");
+}
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
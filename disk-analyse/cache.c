@@ -0,0 +1,180 @@
+/*
+ * disk-analyse/cache.c
+ *
+ * Result cache for --cache: each analysed track's result is kept in a
+ * directory shared across runs, keyed by a digest of the track's flux and of
+ * everything else which decides how it is analysed (track number, formats in
+ * the order tried, PLL and RPM settings, calibrated clock, disk flags, and
+ * the disk's tags so far). A track seen before with the same key is not
+ * analysed again.
+ *
+ * Entries are journal records (see journal.c), one per file, named by key and
+ * fanned out over subdirectories by its first byte:
+ *  <dir>/<kk>/<key, 32 hex digits>
+ * The cache is scratch state for the machine that wrote it. It does not know
+ * when format handlers change: clear it after upgrading libdisk.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libdisk/stream.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+#define CACHE_MAGIC "DACACHE1"
+
+static char *cache_dir;
+static uint64_t cache_salt;
+static unsigned int cache_seq;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__MINGW32__)
+#define mkdir(path, mode) mkdir(path)
+#endif
+
+void cache_open(const char *dir, uint32_t disk_flags, uint32_t clock_ns)
+{
+    if ((mkdir(dir, 0777) != 0) && (errno != EEXIST))
+        err(1, "Unable to create cache %s", dir);
+    cache_dir = memalloc(strlen(dir) + 1);
+    strcpy(cache_dir, dir);
+    cache_salt = hash64_add(CACHE_MAGIC, sizeof(CACHE_MAGIC), 0);
+    cache_salt = hash64_add(&disk_flags, sizeof(disk_flags), cache_salt);
+    if (clock_ns)
+        cache_salt = hash64_add(&clock_ns, sizeof(clock_ns), cache_salt);
+}
+
+static char *entry_path(const uint64_t key[2])
+{
+    char *path = memalloc(strlen(cache_dir) + 40);
+    sprintf(path, "%s/%02x/%016llx%016llx", cache_dir,
+            (unsigned int)(key[0] >> 56),
+            (unsigned long long)key[0], (unsigned long long)key[1]);
+    return path;
+}
+
+int cache_key(struct disk *d, struct stream *s, unsigned int tracknr,
+              const struct format_list *list, unsigned int pos,
+              uint64_t key[2])
+{
+    struct {
+        uint32_t tracknr, drive_rpm, data_rpm;
+        int32_t period_adj, phase_adj, kernel;
+        uint32_t idle_revs_sectored, idle_revs_track;
+    } params;
+    struct disktag *tag;
+    const char *name;
+    uint64_t h;
+    unsigned int i;
+
+    if ((cache_dir == NULL) || (stream_select_track(s, tracknr) != 0)
+        || (stream_track_digest(s, &key[0]) != 0))
+        return -1;
+
+    memset(&params, 0, sizeof(params));
+    params.tracknr = tracknr;
+    params.drive_rpm = s->drive_rpm;
+    params.data_rpm = s->data_rpm;
+    params.period_adj = s->pll_period_adj_pct;
+    params.phase_adj = s->pll_phase_adj_pct;
+    params.kernel = s->pll_kernel;
+    params.idle_revs_sectored = s->idle_revs_sectored;
+    params.idle_revs_track = s->idle_revs_track;
+    h = hash64_add(&params, sizeof(params), cache_salt);
+
+    /* Formats by name, as their numbering may change between builds. */
+    for (i = 0; i < list->nr; i++) {
+        name = disk_get_format_id_name(list->ent[(pos + i) % list->nr]);
+        h = hash64_add(name, strlen(name) + 1, h);
+    }
+
+    for (i = 0; (tag = disk_get_tag_by_idx(d, i)) != NULL; i++)
+        if (tag->id != DSKTAG_end)
+            h = hash64_add(tag, sizeof(*tag) + tag->len, h);
+
+    key[1] = h;
+    return 0;
+}
+
+int cache_lookup(struct disk *d, unsigned int tracknr, const uint64_t key[2])
+{
+    char *path = entry_path(key);
+    struct stat st;
+    uint8_t *buf;
+    FILE *fp;
+    int rc = -1;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+        goto out;
+    if ((fstat(fileno(fp), &st) == 0) && (st.st_size > 0)
+        && (st.st_size < (64 << 20))) {
+        buf = memalloc(st.st_size);
+        if (fread(buf, st.st_size, 1, fp) == 1)
+            rc = journal_unpack(d, tracknr, buf, st.st_size);
+        memfree(buf);
+    }
+    fclose(fp);
+
+out:
+    memfree(path);
+    return rc;
+}
+
+void cache_store(struct disk *d, unsigned int tracknr,
+                 const uint64_t key[2], int unidentified)
+{
+    char *path = entry_path(key), *tmp, *p;
+    uint32_t len;
+    void *buf;
+    FILE *fp;
+    bool_t ok;
+
+    /* Written aside and renamed into place, so that concurrent runs sharing
+     * the cache never see a partial entry. */
+    tmp = memalloc(strlen(path) + 32);
+    pthread_mutex_lock(&cache_lock);
+    sprintf(tmp, "%s.%ld.%u", path, (long)getpid(), cache_seq++);
+    pthread_mutex_unlock(&cache_lock);
+
+    p = strrchr(path, '/');
+    *p = '\0';
+    if ((mkdir(path, 0777) != 0) && (errno != EEXIST))
+        goto fail;
+    *p = '/';
+
+    if ((fp = fopen(tmp, "wb")) == NULL)
+        goto fail;
+    buf = journal_pack(d, tracknr, unidentified, &len);
+    ok = (fwrite(buf, len, 1, fp) == 1);
+    memfree(buf);
+    if ((fclose(fp) != 0) || !ok || (rename(tmp, path) != 0)) {
+        (void)remove(tmp);
+        goto fail;
+    }
+
+    goto out;
+
+fail:
+    warn("Unable to write cache entry %s", tmp);
+out:
+    memfree(tmp);
+    memfree(path);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,198 @@
+/*
+ * disk-analyse/calibrate.c
+ *
+ * Drive calibration for --calibrate. The drive's revolution time, and the
+ * bitcell period of double-density tracks, are measured from index to index
+ * over the first tracks of each capture, and kept across runs per capture
+ * device. The profile sets the drive RPM and the clock the PLL starts from,
+ * in place of the nominal 300 RPM and 2us.
+ *
+ * The profiles are plain text, one per line, in the drive's own time:
+ *  <revolution ns> <revolutions> <bitcell ps> <bitcells> <device>
+ * where <revolutions> and <bitcells> count the tracks measured.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdisk/stream.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+#define CAL_TRACKS      8   /* measured per run, of as many again tried */
+#define CAL_MAX_WEIGHT  256 /* of a profile's past measurements */
+#define CELL_NS         2000
+
+struct profile {
+    uint64_t rev_ns, cell_ps;
+    uint32_t nr_revs, nr_cells;
+};
+
+static void measure(struct stream *s, unsigned int start, unsigned int end,
+                    unsigned int step, struct profile *m)
+{
+    uint64_t sum_rev = 0, sum_cell = 0, rev;
+    unsigned int i, n;
+
+    for (i = start, n = 0; (i <= end) && (n < 2*CAL_TRACKS); i += step) {
+        n++;
+        if (stream_select_track(s, i) != 0)
+            continue;
+        stream_reset(s);
+        stream_next_index(s);
+        if ((s->nr_index < 2) || (s->track_len_bc == 0))
+            continue;
+        if (m->nr_revs == CAL_TRACKS)
+            break;
+
+        /* Undo the stream's scaling to data RPM. */
+        rev = (uint64_t)s->track_len_ns * s->data_rpm / s->drive_rpm;
+        if ((rev < 60000000000ull / 500) || (rev > 60000000000ull / 100))
+            continue;
+        sum_rev += rev;
+        m->nr_revs++;
+
+        /* The bitcell count is only meaningful if the PLL, starting from the
+         * double-density clock, was locked to it: MFM, whose shortest flux
+         * interval is two bitcells. */
+        if (abs((int)s->flux_min_ns - 2*CELL_NS) > CELL_NS / 5)
+            continue;
+        sum_cell += rev * 1000 / s->track_len_bc;
+        m->nr_cells++;
+    }
+
+    if (m->nr_revs)
+        m->rev_ns = sum_rev / m->nr_revs;
+    if (m->nr_cells)
+        m->cell_ps = sum_cell / m->nr_cells;
+}
+
+/* Fold measurement @m into profile @p, by weight of tracks measured. */
+static void merge(struct profile *p, const struct profile *m)
+{
+    uint32_t w;
+
+    w = min_t(uint32_t, p->nr_revs, CAL_MAX_WEIGHT);
+    if (m->nr_revs) {
+        p->rev_ns = (p->rev_ns * w + m->rev_ns * m->nr_revs)
+            / (w + m->nr_revs);
+        p->nr_revs = w + m->nr_revs;
+    }
+
+    w = min_t(uint32_t, p->nr_cells, CAL_MAX_WEIGHT);
+    if (m->nr_cells) {
+        p->cell_ps = (p->cell_ps * w + m->cell_ps * m->nr_cells)
+            / (w + m->nr_cells);
+        p->nr_cells = w + m->nr_cells;
+    }
+}
+
+/* Read the profiles in @path, merging @m into that of @device, and write
+ * them back. */
+static void update(const char *path, const char *device,
+                   struct profile *p, const struct profile *m)
+{
+    struct profile q;
+    char line[512], dev[256], *tmp;
+    unsigned long long rev_ns, cell_ps;
+    unsigned int nr_revs, nr_cells;
+    FILE *fp, *out;
+    bool_t found = 0;
+
+    /* Write a temporary file and rename it into place, so that an
+     * interrupted run never leaves truncated profiles. */
+    tmp = memalloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    if ((out = fopen(tmp, "w")) == NULL) {
+        warn("Unable to write drive profiles to %s", tmp);
+        goto out;
+    }
+    fprintf(out, "# disk-analyse drive profiles: "
+            "rev_ns revs cell_ps cells device\n");
+
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if ((line[0] == '#')
+                || (sscanf(line, "%llu %u %llu %u %255[^\n]", &rev_ns,
+                           &nr_revs, &cell_ps, &nr_cells, dev) != 5))
+                continue;
+            q.rev_ns = rev_ns;
+            q.nr_revs = nr_revs;
+            q.cell_ps = cell_ps;
+            q.nr_cells = nr_cells;
+            if (!found && !strcmp(dev, device)) {
+                merge(&q, m);
+                *p = q;
+                found = 1;
+            }
+            fprintf(out, "%llu %u %llu %u %s\n",
+                    (unsigned long long)q.rev_ns, q.nr_revs,
+                    (unsigned long long)q.cell_ps, q.nr_cells, dev);
+        }
+        fclose(fp);
+    }
+
+    if (!found) {
+        *p = *m;
+        fprintf(out, "%llu %u %llu %u %s\n",
+                (unsigned long long)p->rev_ns, p->nr_revs,
+                (unsigned long long)p->cell_ps, p->nr_cells, device);
+    }
+
+    if ((fclose(out) != 0) || (rename(tmp, path) != 0)) {
+        warn("Unable to write drive profiles to %s", path);
+        (void)remove(tmp);
+    }
+
+out:
+    memfree(tmp);
+}
+
+void calibrate(const char *path, struct stream *s, unsigned int start,
+               unsigned int end, unsigned int step,
+               unsigned int *drive_rpm, unsigned int *clock_ns)
+{
+    struct profile p, m;
+    const char *device;
+
+    memset(&m, 0, sizeof(m));
+    measure(s, start, end, step, &m);
+
+    /* Only a device which names itself has a profile to keep. */
+    device = stream_device(s);
+    if (device[0] == '\0')
+        p = m;
+    else
+        update(path, device, &p, &m);
+
+    *drive_rpm = *clock_ns = 0;
+    if (p.nr_revs)
+        *drive_rpm = (60000000000ull + p.rev_ns / 2) / p.rev_ns;
+    if (p.nr_cells && *drive_rpm)
+        *clock_ns = (p.cell_ps * *drive_rpm + s->data_rpm * 500)
+            / (s->data_rpm * 1000);
+
+    if (quiet)
+        return;
+    printf("Calibration: %s: ", device[0] ? device : "unknown device");
+    if (p.nr_revs)
+        printf("%.2f RPM (%u tracks)", 60e9 / p.rev_ns, p.nr_revs);
+    else
+        printf("no index");
+    if (p.nr_cells)
+        printf(", %.1fns bitcell (%u tracks)", p.cell_ps / 1e3, p.nr_cells);
+    printf("%s\n", device[0] ? "" : ": not saved");
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,12 +1,100 @@
 #ifndef __MFMPARSE_COMMON_H__
 #define __MFMPARSE_COMMON_H__
 
+#define NR_CONFIG_TRACKS 200
+
+/* Immutable once parsed: tracks of a range share one list. */
 struct format_list {
-    uint16_t nr, max, pos;
+    uint16_t nr, idx; /* idx numbers the distinct lists of a config */
     uint16_t ent[1];
 };
 
+/* Rotating start position in each format list, indexed by list->idx. Each
+ * analysis pass keeps its own, so a track tries first the format which
+ * matched the last track it analysed from the same list. */
+struct format_cursor {
+    uint16_t pos[NR_CONFIG_TRACKS];
+};
+
 extern struct format_list **parse_config(char *config, char *specifier);
+extern void free_format_lists(struct format_list **lists);
+/* Keep @config's format database loaded for later parse_config() calls. */
+extern void config_preload(char *config);
+
+/* Path of the top-level config file opened by parse_config(). */
+extern char *config_path;
+
+extern void learn_load(const char *path, const char *title);
+extern void learn_reorder(
+    struct format_list *list, struct format_cursor *cur, unsigned int track);
+extern void learn_update(unsigned int track, unsigned int type);
+extern void learn_save(void);
+
+/* Fingerprint of a disk's first two tracks, as analysed. Returns -1 if they
+ * are not both cleanly decoded. */
+extern int ident_fingerprint(struct disk *d, uint32_t *print);
+/* The title (allocated) whose fingerprint @print is in @path, else NULL. */
+extern char *ident_lookup(const char *path, uint32_t print);
+extern void ident_record(const char *path, uint32_t print, const char *title);
+
+/* Measure the drive's RPM and bitcell period over the first tracks of @s, in
+ * [@start,@end] every @step, and fold them into the profile kept in @path for
+ * the device which captured @s. Returns the profile's drive RPM and the clock
+ * the PLL should start from (in ns), each 0 if it could not be measured. */
+extern void calibrate(const char *path, struct stream *s, unsigned int start,
+                      unsigned int end, unsigned int step,
+                      unsigned int *drive_rpm, unsigned int *clock_ns);
+
+extern void journal_open(struct disk *d, const char *out, const char *in);
+/* -1 if @tracknr was not replayed from the journal, else whether it was left
+ * unidentified. */
+extern int journal_replayed(unsigned int tracknr);
+extern void journal_track(struct disk *d, unsigned int tracknr,
+                          int unidentified);
+/* Analysis is complete: the journal is deleted. */
+extern void journal_close(void);
+/* A track's result as a self-checking record (allocated), and back: unpacking
+ * returns whether the track was left unidentified, or -1 if @buf is not a
+ * valid record for @tracknr. */
+extern void *journal_pack(struct disk *d, unsigned int tracknr,
+                          int unidentified, uint32_t *plen);
+extern int journal_unpack(struct disk *d, unsigned int tracknr,
+                          const void *buf, uint32_t len);
+
+/* Persistent per-track result cache for --cache, keyed by the track's flux
+ * and everything else that decides its analysis. @clock_ns is the clock the
+ * PLL starts from, if calibrated (else 0). */
+extern void cache_open(const char *dir, uint32_t disk_flags,
+                       uint32_t clock_ns);
+/* Key for analysing track @tracknr of @s against @list, trying formats from
+ * @pos onwards. Returns 0, or -1 if there is no cache or the track's flux
+ * differs on every pass (so its results cannot be reused). */
+extern int cache_key(struct disk *d, struct stream *s, unsigned int tracknr,
+                     const struct format_list *list, unsigned int pos,
+                     uint64_t key[2]);
+/* Replay a cached result. Returns as journal_unpack(). */
+extern int cache_lookup(struct disk *d, unsigned int tracknr,
+                        const uint64_t key[2]);
+extern void cache_store(struct disk *d, unsigned int tracknr,
+                        const uint64_t key[2], int unidentified);
+
+/* NDJSON per-track report for --report (@path "-" is stdout). */
+extern void report_open(const char *path);
+extern void report_track(struct disk *d, unsigned int tracknr,
+                         struct stream *s, int unidentified, int replayed,
+                         uint64_t nsecs);
+extern void report_close(void);
+
+/* Serve jobs on a Unix socket: each is run by @job in a forked process. */
+extern void serve(const char *path, unsigned int nr_workers,
+                  int (*job)(int argc, char **argv));
+/* Run a job on a server. Returns the job's exit status. */
+extern int serve_connect(const char *path, int argc, char **argv);
+
+/* Run a job for each image in a manifest, up to @nr_workers at once, each by
+ * @job in a forked process. Returns non-zero if any job failed. */
+extern int batch(const char *path, unsigned int nr_workers,
+                 int (*job)(int argc, char **argv));
 
 extern int quiet, verbose;
 
@@ -4,24 +4,84 @@
  * Parse config file which defines allowed formats for particular disks.
  * 
  * Written in 2011 by Keir Fraser
+ *
+ * The config is compiled to a database of entries in file order, with
+ * INCLUDEs flattened and each definition resolved to per-track format
+ * lists. A lookup replays the scan over those entries, so its result,
+ * including any parse error, is that of parsing the source directly. The
+ * database is cached beside the config (or failing that in the user's cache
+ * directory) and rebuilt when a source file or libdisk's format list changes.
  */
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 #include <libdisk/disk.h>
 #include <libdisk/util.h>
 
 #include "common.h"
 
-#define NR_TRACKS 200
-
 #define DEF_DIR PREFIX "/share/disk-analyse"
 #define DEF_FIL "formats"
 
+#define DB_MAGIC "DADB"
+#define DB_VERSION 1
+
+struct db_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t formats_crc; /* format ids are only valid for this libdisk */
+    uint32_t nr_files, nr_ents, heap_len;
+};
+
+/* A source file the database was compiled from. A path which was searched
+ * but not found is recorded with size DB_ABSENT: it must stay absent. */
+struct db_file {
+    int64_t mtime;
+    uint64_t size;
+    uint32_t name, pad;
+};
+#define DB_ABSENT (~0ull)
+
+/* Entries are replayed in order. Title 0 (the empty heap string) belongs to
+ * no specifier: an ENT_ERR without a title is hit by every lookup. */
+struct db_ent {
+    uint32_t kind, title, arg;
+};
+#define ENT_ALIAS 0 /* arg: target specifier */
+#define ENT_WARN  1 /* arg: warning message */
+#define ENT_DEF   2 /* arg: struct db_def */
+#define ENT_ERR   3 /* arg: error message */
+#define ENT_END   4 /* arg: location of end of config */
+
+/* Each list is stored as a count followed by that many format ids. */
+struct db_def {
+    uint32_t err, lists;
+    uint16_t track[NR_CONFIG_TRACKS];
+};
+#define DB_NONE   0xffff
+#define DB_IGNORE 0xfffe
+
+struct db {
+    const struct db_header *hdr;
+    const struct db_file *files;
+    const struct db_ent *ents;
+    const char *heap;
+    void *dat;
+    size_t len;
+    int mapped;
+};
+
 struct token {
     enum { STR, NUM, CHR, EOL } type;
     union {
@@ -33,6 +93,8 @@ struct token {
     } u;
 };
 
+char *config_path;
+
 static struct file_info {
     FILE *f;
     char *name;
@@ -40,16 +102,130 @@ static struct file_info {
     struct file_info *next;
 } *fi;
 
+static struct db_build {
+    uint8_t *heap;
+    uint32_t heap_len, heap_max;
+    struct db_ent *ents;
+    unsigned int nr_ents, max_ents;
+    struct db_file *files;
+    unsigned int nr_files, max_files;
+    uint32_t err;
+    jmp_buf jmp;
+} *build;
+
+static void *grow(void *old, unsigned int nr, unsigned int *max, size_t sz)
+{
+    void *p;
+
+    if (nr < *max)
+        return old;
+    *max = *max ? *max * 2 : 64;
+    p = memalloc(*max * sz);
+    if (old != NULL) {
+        memcpy(p, old, nr * sz);
+        memfree(old);
+    }
+    return p;
+}
+
+static uint32_t heap_add(const void *p, size_t len)
+{
+    uint32_t off = (build->heap_len + 3) & ~3;
+    unsigned int max = build->heap_max;
+
+    while (off + len > max)
+        build->heap = grow(build->heap, max, &max, 1);
+    build->heap_max = max;
+    memset(build->heap + build->heap_len, 0, off - build->heap_len);
+    if (len != 0)
+        memcpy(build->heap + off, p, len);
+    build->heap_len = off + len;
+    return off;
+}
+
+static uint32_t heap_str(const char *s)
+{
+    return heap_add(s, strlen(s) + 1);
+}
+
+static uint32_t vheap_err(const char *f, va_list args)
+{
+    char errs[128], *msg;
+    uint32_t off;
+    int len;
+
+    vsnprintf(errs, sizeof(errs), f, args);
+    len = snprintf(NULL, 0, "error at %s:%u: %s", fi->name, fi->line, errs);
+    msg = memalloc(len + 1);
+    sprintf(msg, "error at %s:%u: %s", fi->name, fi->line, errs);
+    off = heap_str(msg);
+    memfree(msg);
+    return off;
+}
+
+static uint32_t heap_err(const char *f, ...)
+{
+    va_list args;
+    uint32_t off;
+
+    va_start(args, f);
+    off = vheap_err(f, args);
+    va_end(args);
+    return off;
+}
+
+/* Record only the first error in a definition, which is where a direct
+ * parse would have stopped. */
+static void def_err(uint32_t *err, const char *f, ...)
+{
+    va_list args;
+
+    if (*err != 0)
+        return;
+    va_start(args, f);
+    *err = vheap_err(f, args);
+    va_end(args);
+}
+
+/* Errors in the token stream end compilation: no later entry is reachable. */
 static void parse_err(const char *f, ...)
 {
-    char errs[128];
     va_list args;
 
     va_start(args, f);
-    vsnprintf(errs, sizeof(errs), f, args);
+    build->err = vheap_err(f, args);
     va_end(args);
 
-    errx(1, "error at %s:%u: %s", fi->name, fi->line, errs);
+    longjmp(build->jmp, 1);
+}
+
+static void add_ent(uint32_t kind, uint32_t title, uint32_t arg)
+{
+    struct db_ent *e;
+
+    build->ents = grow(build->ents, build->nr_ents, &build->max_ents,
+                       sizeof(*build->ents));
+    e = &build->ents[build->nr_ents++];
+    e->kind = kind;
+    e->title = title;
+    e->arg = arg;
+}
+
+static void add_file(const char *name, int exists)
+{
+    struct db_file *f;
+    struct stat st;
+
+    build->files = grow(build->files, build->nr_files, &build->max_files,
+                        sizeof(*build->files));
+    f = &build->files[build->nr_files++];
+    f->name = heap_str(name);
+    f->mtime = 0;
+    f->size = DB_ABSENT;
+    if (exists && (stat(name, &st) == 0)) {
+        f->mtime = st.st_mtime;
+        f->size = st.st_size;
+    }
 }
 
 static int mygetc(void)
@@ -152,6 +328,8 @@ static struct file_info *open_file(char *name)
         sprintf(fi->name, "%s/%s", path, name);
         free(path);
         if ((fi->f = fopen(fi->name, "r")) == NULL) {
+            if (build != NULL)
+                add_file(fi->name, 0);
             memfree(fi->name);
             fi->name = memalloc(strlen(DEF_DIR) + strlen(name) + 2);
             sprintf(fi->name, "%s/%s", DEF_DIR, name);
@@ -163,6 +341,9 @@ static struct file_info *open_file(char *name)
         fi->f = fopen(fi->name, "r");
     }
 
+    if (build != NULL)
+        add_file(fi->name, fi->f != NULL);
+
     if (fi->f == NULL) {
         memfree(fi->name);
         memfree(fi);
@@ -180,49 +361,126 @@ void close_file(struct file_info *fi)
     memfree(fi);
 }
 
-struct format_list *realloc_format_list(struct format_list *old)
+static uint32_t formats_crc(void)
 {
-    struct format_list *list;
-    unsigned int max = old ? old->max*2 : 4;
-    list = memalloc(sizeof(*list) + (max-1)*2);
-    if (old) {
-        memcpy(list, old, sizeof(*list) + (old->max-1)*2);
-        memfree(old);
-    }
-    list->max = max;
-    return list;
+    const char *fmtname;
+    uint32_t crc = 0xffffffff;
+    unsigned int i;
+
+    for (i = 0; (fmtname = disk_get_format_id_name(i)) != NULL; i++)
+        crc = crc32_add(fmtname, strlen(fmtname) + 1, crc);
+
+    return crc;
 }
 
-struct format_list **parse_config(char *config, char *specifier)
+/* Compile the definition whose title line is in @t. On return @t holds the
+ * first token of the line which ended the definition. */
+static uint32_t compile_def(struct token *t)
 {
-    unsigned int i;
-    struct format_list **formats, ignore_list;
-    struct token t;
-    char *spec;
+    struct db_def def;
+    uint32_t *lists = NULL;
+    uint16_t *list = NULL; /* list[0] is the count */
+    unsigned int i, start, end, step, nr, idx;
+    unsigned int nr_lists = 0, max_lists = 0, max_list = 0;
+    int id, ignore;
 
-    formats = memalloc(NR_TRACKS * sizeof(*formats));
+    def.err = 0;
+    for (i = 0; i < NR_CONFIG_TRACKS; i++)
+        def.track[i] = DB_NONE;
 
-    if (specifier == NULL)
-        specifier = "default";
+    for (;;) {
+        while (t->type != EOL)
+            parse_token(t);
+        parse_token(t);
+        if ((t->type == CHR) && (t->u.ch == '*')) {
+            t->type = NUM;
+            t->u.num.start = 0;
+            t->u.num.end = NR_CONFIG_TRACKS-1;
+            t->u.num.step = 1;
+        }
+        if (t->type != NUM)
+            break;
+        start = t->u.num.start;
+        end = t->u.num.end;
+        step = t->u.num.step;
+        if ((start >= NR_CONFIG_TRACKS) || (end >= NR_CONFIG_TRACKS))
+            def_err(&def.err, "bad track range %u-%u", start, end);
+        if (step == 0)
+            def_err(&def.err, "bad track step 0");
+        nr = ignore = 0;
+        for (;;) {
+            parse_token(t);
+            if (t->type == EOL)
+                break;
+            if (ignore) {
+                def_err(&def.err, "'ignore' must be sole format specifier");
+            } else if (t->type != STR) {
+                def_err(&def.err, "expected format string");
+            } else if (!strcmp("ignore", t->u.str)) {
+                if (nr != 0)
+                    def_err(&def.err,
+                            "'ignore' must be sole format specifier");
+                ignore = 1;
+            } else if ((id = disk_get_format_by_id_name(t->u.str)) < 0) {
+                def_err(&def.err, "bad format name \"%s\"", t->u.str);
+            } else {
+                list = grow(list, nr+1, &max_list, sizeof(*list));
+                list[++nr] = id;
+            }
+        }
+        if ((nr == 0) && !ignore)
+            def_err(&def.err, "empty format list");
+        if (def.err != 0)
+            continue;
+        if (ignore) {
+            idx = DB_IGNORE;
+        } else {
+            list[0] = nr;
+            lists = grow(lists, nr_lists, &max_lists, sizeof(*lists));
+            idx = nr_lists;
+            lists[nr_lists++] = heap_add(list, (nr+1) * sizeof(*list));
+        }
+        for (i = start; i <= end; i += step)
+            if (def.track[i] == DB_NONE)
+                def.track[i] = idx;
+    }
 
-    spec = memalloc(strlen(specifier)+1);
-    strcpy(spec, specifier);
+    for (i = 0; i < NR_CONFIG_TRACKS; i++)
+        if (def.track[i] == DB_NONE)
+            def_err(&def.err, "no format specified for track %u", i);
 
-    if ((fi = open_file(config ? : DEF_FIL)) == NULL)
-        errx(1, "could not open config file \"%s\"", config ? : DEF_FIL);
+    def.lists = heap_add(lists, nr_lists * sizeof(*lists));
+    memfree(lists);
+    memfree(list);
+
+    return heap_add(&def, sizeof(def));
+}
+
+/* Compile every entry of the config open at @fi. */
+static void compile(void)
+{
+    struct file_info *fi2;
+    struct token t;
+    uint32_t title;
+
+    if (setjmp(build->jmp)) {
+        add_ent(ENT_ERR, 0, build->err);
+        return;
+    }
 
     for (;;) {
         parse_token(&t);
+    line:
         if ((t.type == EOL) && (t.u.ch == EOF)) {
-            struct file_info *fi2 = fi->next;
-            if (fi2 == NULL)
-                parse_err("no match for \"%s\"", spec);
+            if ((fi2 = fi->next) == NULL) {
+                add_ent(ENT_END, 0, heap_err("no match for"));
+                return;
+            }
             close_file(fi);
             fi = fi2;
         } else if (t.type != STR) {
             /* nothing */
         } else if (!strcmp("INCLUDE", t.u.str)) {
-            struct file_info *fi2;
             parse_token(&t);
             if (t.type != STR)
                 parse_err("expected string after INCLUDE");
@@ -231,106 +489,410 @@ struct format_list **parse_config(char *config, char *specifier)
             fi2->next = fi;
             fi = fi2;
             t.type = EOL;
-        } else if (!strcmp(spec, t.u.str)) {
+        } else {
+            title = heap_str(t.u.str);
             parse_token(&t);
             if ((t.type == CHR) && (t.u.ch == '=')) {
                 parse_token(&t);
                 if (t.type != STR)
-                    parse_err("expected string after =");
-                if (verbose)
-                    printf("Format \"%s\" -> \"%s\"\n", spec, t.u.str);
-                memfree(spec);
-                spec = memalloc(strlen(t.u.str)+1);
-                strcpy(spec, t.u.str);
+                    add_ent(ENT_ERR, title,
+                            heap_err("expected string after ="));
+                else
+                    add_ent(ENT_ALIAS, title, heap_str(t.u.str));
             } else if ((t.type == STR) && !strcmp(t.u.str, "WARN")) {
                 while (t.type != EOL)
                     parse_token(&t);
                 parse_token(&t);
                 if (t.type != STR)
-                    parse_err("expected string after WARN");
-                printf("*** WARNING: %s\n", t.u.str);
+                    add_ent(ENT_ERR, title,
+                            heap_err("expected string after WARN"));
+                else
+                    add_ent(ENT_WARN, title, heap_str(t.u.str));
             } else {
-                goto found;
+                add_ent(ENT_DEF, title, compile_def(&t));
+                goto line;
             }
         }
         while (t.type != EOL)
             parse_token(&t);
     }
+}
+
+static void db_build(struct db *db)
+{
+    struct db_header hdr;
+    size_t files_len, ents_len;
+    uint8_t *p;
+
+    build = memalloc(sizeof(*build));
+    heap_str(""); /* title 0 */
+    add_file(fi->name, 1);
+    compile();
+    heap_str(""); /* the heap ends in a NUL */
+    while (fi != NULL) {
+        struct file_info *fi2 = fi->next;
+        close_file(fi);
+        fi = fi2;
+    }
+
+    memcpy(hdr.magic, DB_MAGIC, sizeof(hdr.magic));
+    hdr.version = DB_VERSION;
+    hdr.formats_crc = formats_crc();
+    hdr.nr_files = build->nr_files;
+    hdr.nr_ents = build->nr_ents;
+    hdr.heap_len = build->heap_len;
+
+    files_len = hdr.nr_files * sizeof(*build->files);
+    ents_len = hdr.nr_ents * sizeof(*build->ents);
+    db->len = sizeof(hdr) + files_len + ents_len + hdr.heap_len;
+    db->dat = p = memalloc(db->len);
+    db->mapped = 0;
+    memcpy(p, &hdr, sizeof(hdr));
+    memcpy(p += sizeof(hdr), build->files, files_len);
+    memcpy(p += files_len, build->ents, ents_len);
+    memcpy(p += ents_len, build->heap, hdr.heap_len);
+
+    memfree(build->files);
+    memfree(build->ents);
+    memfree(build->heap);
+    memfree(build);
+    build = NULL;
+}
+
+static int db_valid(struct db *db)
+{
+    const struct db_header *hdr = db->dat;
+    const struct db_ent *e;
+
+    if ((db->len < sizeof(*hdr))
+        || memcmp(hdr->magic, DB_MAGIC, sizeof(hdr->magic))
+        || (hdr->version != DB_VERSION)
+        || (db->len != (sizeof(*hdr)
+                        + (size_t)hdr->nr_files * sizeof(struct db_file)
+                        + (size_t)hdr->nr_ents * sizeof(struct db_ent)
+                        + hdr->heap_len)))
+        return 0;
+
+    db->hdr = hdr;
+    db->files = (const struct db_file *)(hdr + 1);
+    db->ents = (const struct db_ent *)(db->files + hdr->nr_files);
+    db->heap = (const char *)(db->ents + hdr->nr_ents);
+
+    /* Every lookup must end at an unconditional error or end-of-config. */
+    if ((hdr->heap_len == 0) || (db->heap[hdr->heap_len-1] != '\0')
+        || (hdr->nr_ents == 0))
+        return 0;
+    e = &db->ents[hdr->nr_ents-1];
+    if ((e->kind != ENT_END) && ((e->kind != ENT_ERR) || (e->title != 0)))
+        return 0;
+
+    return 1;
+}
+
+static int db_fresh(const struct db *db)
+{
+    const struct db_file *f;
+    struct stat st;
+    unsigned int i;
+
+    if (db->hdr->formats_crc != formats_crc())
+        return 0;
+
+    for (i = 0; i < db->hdr->nr_files; i++) {
+        f = &db->files[i];
+        if (f->name >= db->hdr->heap_len)
+            return 0;
+        if (stat(&db->heap[f->name], &st) != 0) {
+            if (f->size != DB_ABSENT)
+                return 0;
+        } else if ((f->size != st.st_size) || (f->mtime != st.st_mtime)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void db_close(struct db *db)
+{
+#if !defined(__MINGW32__)
+    if (db->mapped)
+        munmap(db->dat, db->len);
+    else
+#endif
+        memfree(db->dat);
+    db->dat = NULL;
+}
+
+static int db_load(struct db *db, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = file_open(path, O_RDONLY)) == -1)
+        return 0;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        close(fd);
+        return 0;
+    }
+    db->len = st.st_size;
+
+#if !defined(__MINGW32__)
+    db->dat = mmap(NULL, db->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (db->dat != MAP_FAILED) {
+        db->mapped = 1;
+        close(fd);
+        goto check;
+    }
+#endif
+
+    db->dat = memalloc(db->len);
+    db->mapped = 0;
+    if (read(fd, db->dat, db->len) != (ssize_t)db->len) {
+        close(fd);
+        db_close(db);
+        return 0;
+    }
+    close(fd);
+
+#if !defined(__MINGW32__)
+check:
+#endif
+    if (!db_valid(db) || !db_fresh(db)) {
+        db_close(db);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int db_save(const struct db *db, const char *path)
+{
+    char *tmp;
+    FILE *fp;
+    int ok = 0;
+
+    tmp = memalloc(strlen(path) + 16);
+    sprintf(tmp, "%s.%u.tmp", path, (unsigned int)getpid());
+    if ((fp = fopen(tmp, "wb")) == NULL)
+        goto out;
+    ok = (fwrite(db->dat, db->len, 1, fp) == 1);
+    if ((fclose(fp) != 0) || !ok || (rename(tmp, path) != 0)) {
+        (void)remove(tmp);
+        ok = 0;
+    }
+
+out:
+    memfree(tmp);
+    return ok;
+}
+
+/* Database locations, in order of preference: beside the config file, else
+ * in the user's cache directory. */
+static char *db_path(unsigned int i)
+{
+    const char *dir, *sub = "";
+    char *path;
+
+    switch (i) {
+    case 0:
+        path = memalloc(strlen(config_path) + 4);
+        sprintf(path, "%s.db", config_path);
+        return path;
+    case 1:
+        if ((dir = getenv("XDG_CACHE_HOME")) == NULL) {
+            if ((dir = getenv("HOME")) == NULL)
+                return NULL;
+            sub = "/.cache";
+        }
+        path = memalloc(strlen(dir) + strlen(sub) + 32);
+        sprintf(path, "%s%s", dir, sub);
+        (void)posix_mkdir(path, 0777);
+        sprintf(path + strlen(path), "/disk-analyse-%08x.db",
+                crc32(config_path, strlen(config_path)));
+        return path;
+    }
+
+    return NULL;
+}
+
+static const void *db_ptr(const struct db *db, uint32_t off, size_t len)
+{
+    if ((off > db->hdr->heap_len) || (len > db->hdr->heap_len - off))
+        errx(1, "corrupt format database for %s", config_path);
+    return &db->heap[off];
+}
+
+static const char *db_str(const struct db *db, uint32_t off)
+{
+    return db_ptr(db, off, 1);
+}
+
+static struct format_list **db_formats(
+    const struct db *db, uint32_t off, const char *spec)
+{
+    const struct db_def *def;
+    const uint32_t *lists;
+    const uint16_t *ent;
+    struct format_list **formats, **made, *list;
+    unsigned int i, idx, nr_lists = 0, nr_made = 0;
 
-found:
     if (verbose)
         printf("Found format \"%s\"\n", spec);
-    for (;;) {
-        const char *fmtname;
-        unsigned int start, end, step;
-        struct format_list *list = realloc_format_list(NULL);
 
-        while (t.type != EOL)
-            parse_token(&t);
-        parse_token(&t);
-        if ((t.type == CHR) && (t.u.ch == '*')) {
-            t.type = NUM;
-            t.u.num.start = 0;
-            t.u.num.end = NR_TRACKS-1;
-            t.u.num.step = 1;
+    def = db_ptr(db, off, sizeof(*def));
+    if (def->err != 0)
+        errx(1, "%s", db_str(db, def->err));
+
+    for (i = 0; i < NR_CONFIG_TRACKS; i++)
+        if ((def->track[i] != DB_IGNORE) && (def->track[i] >= nr_lists))
+            nr_lists = def->track[i] + 1;
+    lists = db_ptr(db, def->lists, nr_lists * sizeof(*lists));
+
+    /* Tracks which share a list in the config share it here too. */
+    formats = memalloc(NR_CONFIG_TRACKS * sizeof(*formats));
+    made = memalloc(nr_lists * sizeof(*made));
+    for (i = 0; i < NR_CONFIG_TRACKS; i++) {
+        if ((idx = def->track[i]) == DB_IGNORE)
+            continue;
+        if (made[idx] == NULL) {
+            ent = db_ptr(db, lists[idx], sizeof(*ent));
+            ent = db_ptr(db, lists[idx], (ent[0]+1) * sizeof(*ent));
+            if (ent[0] == 0)
+                errx(1, "corrupt format database for %s", config_path);
+            list = memalloc(sizeof(*list) + (ent[0]-1)*2);
+            list->nr = ent[0];
+            list->idx = nr_made++;
+            memcpy(list->ent, &ent[1], ent[0] * sizeof(*ent));
+            made[idx] = list;
         }
-        if (t.type != NUM)
+        formats[i] = made[idx];
+    }
+    memfree(made);
+
+    return formats;
+}
+
+static struct format_list **db_lookup(
+    const struct db *db, const char *specifier)
+{
+    const struct db_ent *e;
+    const char *spec = specifier;
+    unsigned int i;
+
+    for (i = 0; i < db->hdr->nr_ents; i++) {
+        e = &db->ents[i];
+        if (e->kind == ENT_END)
+            errx(1, "%s \"%s\"", db_str(db, e->arg), spec);
+        if ((e->title != 0) && strcmp(db_str(db, e->title), spec))
+            continue;
+        switch (e->kind) {
+        case ENT_ALIAS:
+            if (verbose)
+                printf("Format \"%s\" -> \"%s\"\n",
+                       spec, db_str(db, e->arg));
+            spec = db_str(db, e->arg);
             break;
-        start = t.u.num.start;
-        end = t.u.num.end;
-        step = t.u.num.step;
-        if ((start >= NR_TRACKS) || (end >= NR_TRACKS))
-            parse_err("bad track range %u-%u", start, end);
-        for (;;) {
-            parse_token(&t);
-            if (t.type == EOL)
-                break;
-            if (list == &ignore_list)
-                parse_err("'ignore' must be sole format specifier");
-            if (t.type != STR)
-                parse_err("expected format string");
-            if (!strcmp("ignore", t.u.str)) {
-                if (list->nr != 0)
-                    parse_err("'ignore' must be sole format specifier");
-                memfree(list);
-                list = &ignore_list;
-            } else {
-                for (i = 0;
-                     (fmtname = disk_get_format_id_name(i)) != NULL;
-                     i++)
-                    if (!strcmp(fmtname, t.u.str))
-                        break;
-                if (fmtname == NULL)
-                    parse_err("bad format name \"%s\"", t.u.str);
-                if (list->nr == list->max)
-                    list = realloc_format_list(list);
-                list->ent[list->nr++] = i;
-            }
+        case ENT_WARN:
+            printf("*** WARNING: %s\n", db_str(db, e->arg));
+            break;
+        case ENT_DEF:
+            return db_formats(db, e->arg, spec);
+        case ENT_ERR:
+            errx(1, "%s", db_str(db, e->arg));
         }
-        if ((list->nr == 0) && (list != &ignore_list))
-            parse_err("empty format list");
-        for (i = start; i <= end; i += step)
-            if (formats[i] == NULL)
-                formats[i] = list;
     }
 
-    for (i = 0; i < NR_TRACKS; i++) {
-        if (formats[i] == NULL)
-            parse_err("no format specified for track %u", i);
-        if (formats[i] == &ignore_list)
-            formats[i] = NULL;
+    errx(1, "corrupt format database for %s", config_path);
+}
+
+/* Load the database for @config, building it first if need be. */
+static void config_db(struct db *db, char *config)
+{
+    char *path;
+    unsigned int i;
+
+    if ((fi = open_file(config ? : DEF_FIL)) == NULL)
+        errx(1, "could not open config file \"%s\"", config ? : DEF_FIL);
+    config_path = memalloc(strlen(fi->name) + 1);
+    strcpy(config_path, fi->name);
+
+    for (i = 0; (path = db_path(i)) != NULL; i++) {
+        int ok = db_load(db, path);
+        memfree(path);
+        if (ok)
+            break;
     }
 
-    memfree(spec);
-    while (fi != NULL) {
-        struct file_info *fi2 = fi->next;
+    if (path != NULL) {
         close_file(fi);
-        fi = fi2;
+        fi = NULL;
+    } else {
+        db_build(db);
+        for (i = 0; (path = db_path(i)) != NULL; i++) {
+            int ok = db_save(db, path);
+            memfree(path);
+            if (ok)
+                break;
+        }
+        if (!db_valid(db))
+            errx(1, "could not compile config file \"%s\"", config_path);
+    }
+}
+
+/* The database kept loaded by config_preload(), and the config it is for. */
+static struct db resident_db;
+static char *resident_config, *resident_path;
+
+void config_preload(char *config)
+{
+    config_db(&resident_db, config);
+    resident_path = config_path;
+    if (config != NULL) {
+        resident_config = memalloc(strlen(config) + 1);
+        strcpy(resident_config, config);
+    }
+}
+
+struct format_list **parse_config(char *config, char *specifier)
+{
+    struct format_list **formats;
+    struct db db;
+
+    if (specifier == NULL)
+        specifier = "default";
+
+    if ((resident_db.dat != NULL)
+        && ((config && resident_config) ? !strcmp(config, resident_config)
+            : (config == resident_config))
+        && db_fresh(&resident_db)) {
+        config_path = resident_path;
+        return db_lookup(&resident_db, specifier);
     }
 
+    config_db(&db, config);
+    formats = db_lookup(&db, specifier);
+    db_close(&db);
+
     return formats;
 }
 
+void free_format_lists(struct format_list **lists)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < NR_CONFIG_TRACKS; i++) {
+        if (lists[i] == NULL)
+            continue;
+        for (j = i+1; j < NR_CONFIG_TRACKS; j++)
+            if (lists[j] == lists[i])
+                lists[j] = NULL;
+        memfree(lists[i]);
+    }
+
+    memfree(lists);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -7,6 +7,7 @@
  */
 
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,11 @@
 #include <time.h>
 #include <utime.h>
 #include <getopt.h>
+#include <pthread.h>
+
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 
 #include <libdisk/stream.h>
 #include <libdisk/disk.h>
@@ -29,8 +35,37 @@ static unsigned int start_cyl, end_cyl, disk_flags;
 static int index_align, clear_bad_sectors, single_sided = -1;
 static unsigned int drive_rpm = 300, data_rpm = 300;
 static int pll_period_adj_pct = -1, pll_phase_adj_pct = -1;
+static int pll_reference, pll_auto;
+static unsigned int nr_jobs = 1;
+static uint64_t mem_budget;
+static bool_t mem_compress;
+static unsigned int idle_revs_sectored, idle_revs_track;
+static unsigned int watch_secs;
+static char *calibrate_file;
+static unsigned int cal_drive_rpm, cal_clock_ns;
+static enum { STATS_none, STATS_text, STATS_json } stats;
+static int learn, resume, merge, verify, identify;
+static char *learn_file, *ident_file;
+/* Title given to --identify a disk's fingerprint as, and the fingerprint. */
+static char *ident_title;
+static uint32_t ident_print;
+static bool_t ident_printed;
 static struct format_list **format_lists;
-static char *in, *out;
+static struct format_cursor cursor;
+static char *in, *out, **outs;
+static unsigned int nr_outs;
+static char *config, *format;
+static char *serve_path, *connect_path, *batch_path, *report_file;
+static char *progress_file;
+static char *cache_path, *update_path, *trace_file;
+/* Per track: non-zero if copied by --update from an earlier output. */
+static uint8_t *updated;
+static unsigned int nr_cache_hits, nr_cache_lookups;
+static pthread_mutex_t cache_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct track_stats_table *stats_table;
+static struct trace *trace;
+static struct progress *progress;
+static int serving_job;
 
 /* Iteration start/step for single- and double-sided modes. */
 #define _TRACK_START ((single_sided == 1) ? 1 : 0)
@@ -46,7 +81,9 @@ static char *in, *out;
 
 static void usage(int rc)
 {
-    printf("Usage: disk-analyse [options] in_file out_file\n");
+    printf("Usage: disk-analyse [options] in_file out_file [out_file...]\n");
+    printf("       disk-analyse [options] --serve=SOCKET\n");
+    printf("       disk-analyse [options] --batch=MANIFEST\n");
     printf("Options:\n");
     printf("  -h, --help          Display this information\n");
     printf("  -q, --quiet         Quiesce normal informational output\n");
@@ -56,6 +93,8 @@ static void usage(int rc)
     printf("  -p, --pll-period-adj=PCT (PCT=0..100) PLL period adjustment\n");
     printf("  -P, --pll-phase-adj=PCT (PCT=0..100) PLL phase adjustment\n");
     printf("                      Amount observed flux affects PLL\n");
+    printf("  -R, --pll-reference Use the reference (non fixed-point) PLL\n");
+    printf("  -a, --pll-auto      Retry bad tracks over a grid of PLL settings\n");
     printf("  -r, --rpm=DRIVE[:DATA] RPM of drive that created the input,\n");
     printf("                         Original recording RPM of data [300]\n");
     printf("  -s, --start-cyl=N   Start cylinder\n");
@@ -64,6 +103,54 @@ static void usage(int rc)
     printf("  -k, --kryoflux-hack Fill empty tracks with prev track's data\n");
     printf("  -f, --format=FORMAT Name of format descriptor in config file\n");
     printf("  -c, --config=FILE   Config file to parse for format info\n");
+    printf("  -j, --jobs=N        Worker threads for analysis and probing [1]\n");
+    printf("  -T, --stats[=json]  Print per-format analysis time and matches,\n");
+    printf("                      and libdisk allocations\n");
+    printf("  -L, --learn[=FILE]  Try formats in order of past matches,\n");
+    printf("                      kept in FILE [<config file>.order]\n");
+    printf("  -Y, --identify[=FILE] Without --format, analyse each disk as the\n");
+    printf("                      title whose fingerprint (of tracks 0-1) is\n");
+    printf("                      kept in FILE [<config file>.ident]. With it,\n");
+    printf("                      keep the disk's fingerprint as that title's\n");
+    printf("  -J, --resume        Journal analysed tracks to <out_file>.journal\n");
+    printf("                      and skip those journaled by an earlier run\n");
+    printf("  -K, --cache=DIR     Keep each track's result in DIR, and reuse\n");
+    printf("                      results kept by earlier runs for tracks\n");
+    printf("                      with the same flux and settings\n");
+    printf("  -m, --merge         in_file is a comma-separated list of partial\n");
+    printf("                      outputs (e.g., of --start-cyl/--end-cyl\n");
+    printf("                      shards): combine their tracks and tags\n");
+    printf("                      without re-analysis\n");
+    printf("  -V, --verify        Read each output back, and check that every\n");
+    printf("                      track decodes as it was analysed\n");
+    printf("  -U, --update=DSK    Re-analyse only tracks of DSK, an earlier\n");
+    printf("                      output, whose format is unformatted, raw,\n");
+    printf("                      or not in their format list. Copy the rest\n");
+    printf("  -O, --report=FILE   Write per-track results to FILE as NDJSON,\n");
+    printf("                      as each track is analysed ('-' is stdout)\n");
+    printf("  -G, --progress=FILE Append progress events to FILE as NDJSON\n");
+    printf("                      ('-' is stderr; a Unix socket is connected to)\n");
+    printf("  -M, --mem-budget=MB Bound memory held for track data and each\n");
+    printf("                      stream's decode buffers, spilling analysed\n");
+    printf("                      tracks to a temporary file beyond it\n");
+    printf("  -z, --compress      Hold analysed track data compressed in memory\n");
+    printf("  -I, --idle-revs=N[:M] Give up a format after N revolutions with\n");
+    printf("                      no new valid sector (M for formats decoded\n");
+    printf("                      as a single block) [no limit]\n");
+    printf("  -W, --watch[=SECS]  Analyse a Kryoflux STREAM capture as it is\n");
+    printf("                      made: each track once DTC completes its file.\n");
+    printf("                      The capture ends when none is for SECS [30]\n");
+    printf("  -A, --calibrate=FILE Measure the drive's RPM and bitcell period\n");
+    printf("                      over the first tracks, and decode with the\n");
+    printf("                      profile kept in FILE for the capture device\n");
+    printf("  -t, --trace=FILE    Write a timeline of analysis to FILE, as\n");
+    printf("                      Chrome trace JSON (for Perfetto)\n");
+    printf("  -D, --serve=SOCKET  Run jobs sent to SOCKET, up to --jobs at once,\n");
+    printf("                      with the above options as their defaults\n");
+    printf("  -X, --connect=SOCKET Run this job on a --serve server\n");
+    printf("  -B, --batch=MANIFEST Analyse each \"in_file out_file [format]\" line\n");
+    printf("                      of MANIFEST ('-' is stdin), up to --jobs at\n");
+    printf("                      once, with the above options as defaults\n");
     printf("Supported file formats (suffix => type):\n");
     printf("  .adf  => ADF\n");
     printf("  .eadf => Extended-ADF\n");
@@ -77,7 +164,10 @@ static void usage(int rc)
     printf("Read-only support:\n");
     printf("  .dat  => Diskread\n");
     printf("  .dfi  => DiscFerret DFE2\n");
+    printf("  .scz  => Supercard Pro (compressed, see scp_pack)\n");
     printf("  *.raw => Kryoflux STREAM\n");
+    printf("  /dev/tty* => Supercard Pro device, read live\n");
+    printf("  .tar  => Kryoflux STREAM (archive of *.raw)\n");
     printf("  .{ct,ctr,raw} => CAPS/SPS CT Raw\n");
     printf("Write-only support:\n");
     printf("  .jv3  => JV3 TRS80 Emulator\n");
@@ -115,126 +205,1087 @@ static void dump_track_list(struct disk *d)
     printf("%u.%u: %s\n", TRACK_ARG(i-TRACK_STEP), prev_name);
 }
 
-static void probe_stream(void)
+struct format_stats {
+    enum track_type type;
+    struct track_stats st;
+};
+
+static int format_stats_cmp(const void *a, const void *b)
+{
+    const struct format_stats *x = a, *y = b;
+    return (x->st.nsecs < y->st.nsecs) ? 1 : (x->st.nsecs > y->st.nsecs) ? -1
+        : (int)x->type - (int)y->type;
+}
+
+/* Formats tried during analysis, most time-consuming first; then libdisk's
+ * allocations, by what they were made for. */
+static void dump_format_stats(void)
+{
+    struct format_stats *fs;
+    unsigned int i, nr = 0, max = 0;
+    struct track_stats st;
+    struct mem_stats ms;
+    uint64_t live, peak;
+
+    while (disk_get_format_id_name(max) != NULL)
+        max++;
+    fs = memalloc(max * sizeof(*fs));
+    for (i = 0; i < max; i++) {
+        if ((track_get_stats(stats_table, i, &st) != 0) || (st.calls == 0))
+            continue;
+        fs[nr].type = i;
+        fs[nr].st = st;
+        nr++;
+    }
+    qsort(fs, nr, sizeof(*fs), format_stats_cmp);
+
+    if (stats == STATS_json) {
+        printf("{\"formats\": [");
+        for (i = 0; i < nr; i++)
+            printf("%s\n  {\"id\": \"%s\", \"calls\": %"PRIu64
+                   ", \"matches\": %"PRIu64", \"bitcells\": %"PRIu64
+                   ", \"nsecs\": %"PRIu64"}",
+                   i ? "," : "", disk_get_format_id_name(fs[i].type),
+                   fs[i].st.calls, fs[i].st.matches,
+                   fs[i].st.bitcells, fs[i].st.nsecs);
+        mem_get_usage(&live, &peak);
+        printf("\n],\n\"memory\": {\"live\": %"PRIu64", \"peak\": %"PRIu64
+               ", \"tags\": [", live, peak);
+        for (i = 0; mem_get_stats(i, &ms) == 0; i++)
+            printf("%s\n  {\"tag\": \"%s\", \"allocs\": %"PRIu64
+                   ", \"bytes\": %"PRIu64"}",
+                   i ? "," : "", mem_tag_name(i), ms.allocs, ms.bytes);
+        printf("\n]}}\n");
+    } else {
+        printf("%-32s %8s %8s %10s %10s\n",
+               "Format", "Calls", "Matches", "Mbitcells", "ms");
+        for (i = 0; i < nr; i++)
+            printf("%-32s %8"PRIu64" %8"PRIu64" %10.2f %10.1f\n",
+                   disk_get_format_id_name(fs[i].type),
+                   fs[i].st.calls, fs[i].st.matches,
+                   fs[i].st.bitcells / 1e6, fs[i].st.nsecs / 1e6);
+        mem_get_usage(&live, &peak);
+        printf("\n%-32s %8s %10s\n", "Allocations", "Count", "MB");
+        for (i = 0; mem_get_stats(i, &ms) == 0; i++)
+            printf("%-32s %8"PRIu64" %10.2f\n",
+                   mem_tag_name(i), ms.allocs, ms.bytes / 1e6);
+        printf("Peak live: %.2f MB, at exit: %.2f MB\n",
+               peak / 1e6, live / 1e6);
+    }
+
+    memfree(fs);
+}
+
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Disks are given the run's threads, statistics table and trace. */
+static struct disk *setup_disk(struct disk *d)
+{
+    if (d != NULL) {
+        disk_set_jobs(d, nr_jobs);
+        disk_set_stats(d, stats_table);
+        disk_set_trace(d, trace);
+    }
+    return d;
+}
+
+static struct disk *create_disk(const char *name, unsigned int flags)
+{
+    return setup_disk(disk_create(name, flags));
+}
+
+static struct disk *open_disk(const char *name, unsigned int flags)
+{
+    return setup_disk(disk_open(name, flags));
+}
+
+static struct stream *open_stream(void)
 {
     struct stream *s;
-    struct disk *d;
-    struct disk_info *di;
-    struct track_info *ti;
-    unsigned int i;
+    uint64_t t0 = time_ns();
 
-    if ((s = stream_open(in, drive_rpm, data_rpm)) == NULL)
-        errx(1, "Failed to probe input file: %s", in);
+    /* A capture being watched may not have written its first track yet. */
+    while ((s = stream_open(in, drive_rpm, data_rpm)) == NULL) {
+        if (!watch_secs || (time_ns() - t0 >= watch_secs * 1000000000ull))
+            errx(1, "Failed to probe input file: %s", in);
+        usleep(100000);
+    }
 
     if (pll_period_adj_pct >= 0)
         s->pll_period_adj_pct = pll_period_adj_pct;
     if (pll_phase_adj_pct >= 0)
         s->pll_phase_adj_pct = pll_phase_adj_pct;
+    if (pll_reference)
+        s->pll_kernel = PLL_reference;
+    s->mem_budget = mem_budget;
+    s->idle_revs_sectored = idle_revs_sectored;
+    s->idle_revs_track = idle_revs_track;
+    s->pll_stats_on = verbose || (report_file != NULL);
+    s->wait_secs = watch_secs;
+    s->trace = trace;
+    if (cal_drive_rpm)
+        s->drive_rpm = cal_drive_rpm;
+    if (cal_clock_ns)
+        stream_set_density(s, cal_clock_ns);
+
+    return s;
+}
+
+/* Set up for --calibrate, on a stream of its own: flux already loaded is
+ * scaled by the RPM it was loaded with. */
+static void calibrate_drive(void)
+{
+    struct stream *s;
+
+    if (calibrate_file == NULL)
+        return;
+    s = open_stream();
+    calibrate(calibrate_file, s, TRACK_START,
+              end_cyl ? end_cyl*2+1 : UINT_MAX, TRACK_STEP,
+              &cal_drive_rpm, &cal_clock_ns);
+    stream_close(s);
+}
+
+struct probe_result {
+    int ok;
+    char name[128];
+    unsigned int valid_sectors, nr_sectors;
+};
+
+/* Record the format which track @i has just matched. */
+static void probe_matched(
+    struct disk *d, unsigned int i, struct probe_result *r)
+{
+    struct track_info *ti = &disk_get_info(d)->track[i];
+
+    r->ok = 1;
+    track_get_format_name(d, i, r->name, sizeof(r->name));
+    r->valid_sectors = next_invalid_sector(ti, 0);
+    r->nr_sectors = ti->nr_sectors;
+}
+
+static void probe_format(
+    struct disk *d, struct stream *s, unsigned int i, unsigned int j,
+    struct probe_result *r)
+{
+    if (track_write_raw_from_stream(d, i, j, s) == 0)
+        probe_matched(d, i, r);
+}
+
+/* Sequential probe of one track, over every format but the raw ones. */
+struct probe_seq {
+    struct disk *d;
+    unsigned int track;
+    const uint16_t *types;
+    struct probe_result *res;
+};
+
+static int probe_seq_matched(void *arg, unsigned int k)
+{
+    struct probe_seq *p = arg;
+    probe_matched(p->d, p->track, &p->res[p->types[k]]);
+    return 1;
+}
+
+/* Parallel probe of one track: each worker claims formats from a shared
+ * counter and tries them on its own clone of the track's stream, writing
+ * into a private scratch disk. */
+struct probe_worker {
+    pthread_t thread;
+    struct disk *d;
+    struct stream *s;
+    unsigned int track, nr_formats;
+    struct probe_result *res;
+};
+
+static pthread_mutex_t next_format_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_format;
+
+static void *probe_worker_fn(void *arg)
+{
+    struct probe_worker *w = arg;
+    unsigned int j;
+
+    for (;;) {
+        pthread_mutex_lock(&next_format_lock);
+        j = next_format++;
+        pthread_mutex_unlock(&next_format_lock);
+        if (j >= w->nr_formats)
+            break;
+        if (!(disk_get_format(j)->flags & TRKFMT_raw))
+            probe_format(w->d, w->s, w->track, j, &w->res[j]);
+    }
+
+    return NULL;
+}
+
+static void copy_tags(struct disk *dst, struct disk *src)
+{
+    struct disktag *t;
+    unsigned int k;
+
+    for (k = 0; (t = disk_get_tag_by_idx(src, k)) != NULL; k++)
+        if (t->id != DSKTAG_end)
+            disk_set_tag(dst, t->id, t->len, t + 1);
+}
+
+/* Returns -1 if the track's stream cannot be cloned. */
+static int probe_track_parallel(
+    struct disk *d, struct stream *s, struct probe_worker *workers,
+    unsigned int i, unsigned int nr_formats, struct probe_result *res)
+{
+    unsigned int j;
+    int rc, last = -1;
+
+    if (stream_select_track(s, i) != 0)
+        return -1;
+
+    for (j = 0; j < nr_jobs; j++) {
+        if ((workers[j].s = stream_clone(s)) == NULL) {
+            while (j--)
+                stream_close(workers[j].s);
+            return -1;
+        }
+    }
+
+    next_format = 0;
+    for (j = 0; j < nr_jobs; j++) {
+        struct probe_worker *w = &workers[j];
+        /* Handlers may depend on tags found on earlier tracks. */
+        copy_tags(w->d, d);
+        w->track = i;
+        w->nr_formats = nr_formats;
+        w->res = res;
+        if ((rc = pthread_create(&w->thread, NULL, probe_worker_fn, w)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    }
+
+    for (j = 0; j < nr_jobs; j++) {
+        pthread_join(workers[j].thread, NULL);
+        stream_close(workers[j].s);
+        copy_tags(d, workers[j].d);
+    }
+
+    /* Leave the output track as a sequential probe would: as written by the
+     * last format tried. */
+    for (j = 0; j < nr_formats; j++)
+        if (!(disk_get_format(j)->flags & TRKFMT_raw))
+            last = j;
+    if (last >= 0)
+        (void)track_write_raw_from_stream(d, i, last, s);
+
+    return 0;
+}
+
+static void probe_stream(void)
+{
+    struct stream *s;
+    struct disk *d;
+    struct disk_info *di;
+    struct probe_worker *workers = NULL;
+    struct probe_result *res;
+    unsigned int i, j, nr, nr_formats, nr_types;
+    uint16_t *types;
+    const char *fmtname;
+
+    calibrate_drive();
+    s = open_stream();
     if (verbose)
         printf("PLL Parameters: period_adj=%d%% phase_adj=%d%%\n",
                s->pll_period_adj_pct, s->pll_phase_adj_pct);
 
-    if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
+    if ((d = create_disk(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
     di = disk_get_info(d);
 
+    for (nr_formats = 0; disk_get_format_id_name(nr_formats); nr_formats++)
+        continue;
+    res = memalloc(nr_formats * sizeof(*res));
+
+    /* Skip raw formats, they accept everything. */
+    types = memalloc(nr_formats * sizeof(*types));
+    for (j = nr_types = 0; j < nr_formats; j++)
+        if (!(disk_get_format(j)->flags & TRKFMT_raw))
+            types[nr_types++] = j;
+
+    if (nr_jobs > 1) {
+        workers = memalloc(nr_jobs * sizeof(*workers));
+        for (j = 0; j < nr_jobs; j++) {
+            workers[j].d = create_disk(
+                out, DISKFL_read_only | DISKFL_rpm(data_rpm));
+            if (workers[j].d == NULL)
+                errx(1, "Unable to create scratch disk");
+        }
+    }
+
     for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
-        unsigned int j, k, nr = 0;
-        char name[128];
-        const char *fmtname;
         printf("T%u.%u: ", TRACK_ARG(i));
-        for (j = 0; (fmtname = disk_get_format_id_name(j)) != NULL; j++) {
-            if (!strncmp(fmtname, "raw_", 4)) {
-                /* Skip raw formats, they accept everything. */
+        memset(res, 0, nr_formats * sizeof(*res));
+        if ((nr_jobs <= 1)
+            || probe_track_parallel(d, s, workers, i, nr_formats, res)) {
+            struct probe_seq p = {
+                .d = d, .track = i, .types = types, .res = res };
+            (void)track_write_raw_from_stream_any(
+                d, i, types, nr_types, 0, s, probe_seq_matched, &p);
+        }
+
+        for (j = nr = 0; j < nr_formats; j++) {
+            struct probe_result *r = &res[j];
+            fmtname = disk_get_format_id_name(j);
+            if (!r->ok)
+                continue;
+            if (!strncmp(r->name, "AmigaDOS", 8)
+                && strcmp(fmtname, "amigados")) {
+                /* Skip umpteen variations on AmigaDOS. */
                 continue;
             }
-            if (track_write_raw_from_stream(d, i, j, s) == 0) {
-                track_get_format_name(d, i, name, sizeof(name));
-                if (!strncmp(name, "AmigaDOS", 8)
-                    && strcmp(fmtname, "amigados")) {
-                    /* Skip umpteen variations on AmigaDOS. */
-                    continue;
-                }
-                if (nr++)
-                    printf(", ");
-                printf("%s(%s)", name, fmtname);
-                ti = &di->track[i];
-                for (k = 0; k < ti->nr_sectors; k++)
-                    if (!is_valid_sector(ti, k))
-                        break;
-                if (k != ti->nr_sectors)
-                    printf("[%u/%u]", k, ti->nr_sectors);
-            }
+            if (nr++)
+                printf(", ");
+            printf("%s(%s)", r->name, fmtname);
+            if (r->valid_sectors != r->nr_sectors)
+                printf("[%u/%u]", r->valid_sectors, r->nr_sectors);
         }
         if (!nr)
             printf("Unidentified");
         printf("\n");
     }
 
+    if (workers != NULL) {
+        for (j = 0; j < nr_jobs; j++)
+            disk_close(workers[j].d);
+        memfree(workers);
+    }
+    memfree(types);
+    memfree(res);
     disk_close(d);
     stream_close(s);
 }
 
-static void handle_stream(void)
+/* Bitcells read from @s since it was opened. */
+static uint64_t bitcells_read(struct stream *s)
+{
+    return s->bc_read_base + s->index_offset_bc;
+}
+
+/* Track @i is done, after @nsecs: report it, and count it towards progress
+ * from the stream's counters as they were at its start. */
+static void track_done(struct disk *d, unsigned int i, struct stream *s,
+                       int unidentified, int replayed, uint64_t nsecs,
+                       uint64_t flux0, uint64_t bc0)
+{
+    report_track(d, i, s, unidentified, replayed, nsecs);
+    progress_track(progress, i, nsecs, 0, s->nr_flux - flux0, bitcells_read(s) - bc0);
+}
+
+/* Name a bad track as soon as it is analysed, while a watched capture can
+ * still re-read it. */
+static void watch_flag(struct disk *d, unsigned int i, int unidentified)
+{
+    struct track_info *ti = &disk_get_info(d)->track[i];
+    unsigned int j, nr = 0;
+
+    for (j = next_invalid_sector(ti, 0); j < ti->nr_sectors;
+         j = next_invalid_sector(ti, j+1))
+        nr++;
+    if (unidentified)
+        fprintf(stderr, "** T%u.%u: Unidentified\n", TRACK_ARG(i));
+    else if (nr)
+        fprintf(stderr, "** T%u.%u: %u bad sector%s\n",
+                TRACK_ARG(i), nr, (nr > 1) ? "s" : "");
+}
+
+/* Analyse one track against its format list. Returns 1 if unidentified. */
+static unsigned int analyse_track(
+    struct disk *d, struct stream *s, struct format_list *list,
+    struct format_cursor *cur, unsigned int i)
 {
+    uint16_t *pos;
+    uint64_t t0, flux0 = s->nr_flux, bc0 = bitcells_read(s), key[2];
+    unsigned int j, unidentified = 0;
+    int rc, cached;
+
+    if (list == NULL)
+        return 0;
+
+    if ((rc = journal_replayed(i)) >= 0) {
+        track_done(d, i, s, rc, 1, 0, flux0, bc0);
+        return rc;
+    }
+
+    if (updated && updated[i]) {
+        track_done(d, i, s, 0, 1, 0, flux0, bc0);
+        return 0;
+    }
+
+    t0 = time_ns();
+    learn_reorder(list, cur, i);
+    pos = &cur->pos[list->idx];
+
+    cached = (cache_key(d, s, i, list, *pos, key) == 0);
+    if (cached && ((rc = cache_lookup(d, i, key)) >= 0)) {
+        /* Leave the cursor where analysis would have. */
+        for (j = 0; j < list->nr; j++)
+            if (list->ent[j] == disk_get_info(d)->track[i].type)
+                *pos = j;
+        pthread_mutex_lock(&cache_stats_lock);
+        nr_cache_lookups++;
+        nr_cache_hits++;
+        pthread_mutex_unlock(&cache_stats_lock);
+        journal_track(d, i, rc);
+        track_done(d, i, s, rc, 1, time_ns() - t0, flux0, bc0);
+        track_settle(d, i);
+        return rc;
+    }
+
+    if ((rc = track_write_raw_from_stream_any(
+             d, i, list->ent, list->nr, *pos, s, NULL, NULL)) >= 0) {
+        *pos = rc;
+    } else if (track_write_raw_from_stream(d, i, TRKTYP_unformatted, s) != 0) {
+        /* Tracks 160+ are expected to be unused. Don't warn about them. */
+        if (i < 160)
+            unidentified = 1;
+        else
+            track_mark_unformatted(d, i);
+    }
+
+    if (cached) {
+        cache_store(d, i, key, unidentified);
+        pthread_mutex_lock(&cache_stats_lock);
+        nr_cache_lookups++;
+        pthread_mutex_unlock(&cache_stats_lock);
+    }
+    journal_track(d, i, unidentified);
+    track_done(d, i, s, unidentified, 0, time_ns() - t0, flux0, bc0);
+    if (watch_secs)
+        watch_flag(d, i, unidentified);
+    track_settle(d, i);
+    return unidentified;
+}
+
+/* Parallel analysis: each worker owns a stream and a cursor into the shared
+ * format lists, and claims cylinders from a shared counter, analysing both
+ * heads in turn so that its stream's prefetch of the second head's flux is
+ * put to use. Tracks are independent: a handler only writes its own
+ * track_info, and disk tags are internally locked. */
+struct worker {
+    pthread_t thread;
+    struct disk *d;
     struct stream *s;
+    struct format_cursor cursor;
+    unsigned int unidentified;
+};
+
+static pthread_mutex_t next_track_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_track;
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    struct disk_info *di = disk_get_info(w->d);
+    unsigned int i, end;
+
+    for (;;) {
+        pthread_mutex_lock(&next_track_lock);
+        i = next_track;
+        next_track = (TRACK_STEP == 1) ? (i | 1) + 1 : i + TRACK_STEP;
+        pthread_mutex_unlock(&next_track_lock);
+        if (i > TRACK_END(di))
+            break;
+        end = min_t(unsigned int, (TRACK_STEP == 1) ? i | 1 : i,
+                    TRACK_END(di));
+        for (; i <= end; i++)
+            w->unidentified += analyse_track(
+                w->d, w->s, format_lists[i], &w->cursor, i);
+    }
+
+    return NULL;
+}
+
+static unsigned int analyse_tracks_parallel(struct disk *d, struct stream *s)
+{
+    struct worker *workers = memalloc(nr_jobs * sizeof(*workers));
+    unsigned int i, unidentified = 0;
+    int rc;
+
+    next_track = TRACK_START;
+
+    for (i = 0; i < nr_jobs; i++) {
+        struct worker *w = &workers[i];
+        w->d = d;
+        w->s = i ? open_stream() : s;
+        if ((rc = pthread_create(&w->thread, NULL, worker_fn, w)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    }
+
+    for (i = 0; i < nr_jobs; i++) {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        unidentified += w->unidentified;
+        if (i)
+            stream_close(w->s);
+    }
+
+    memfree(workers);
+    return unidentified;
+}
+
+/* Credit each identified track's format to the learned ordering. */
+static void learn_tracks(struct disk_info *di)
+{
+    struct format_list *list;
+    unsigned int i, j;
+
+    for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
+        if ((list = format_lists[i]) == NULL)
+            continue;
+        for (j = 0; j < list->nr; j++)
+            if (list->ent[j] == di->track[i].type)
+                break;
+        if (j != list->nr)
+            learn_update(i, di->track[i].type);
+    }
+
+    learn_save();
+}
+
+static void learn_open(const char *title)
+{
+    char *path = learn_file;
+
+    if (path == NULL) {
+        path = memalloc(strlen(config_path) + 7);
+        sprintf(path, "%s.order", config_path);
+    }
+    learn_load(path, title);
+    if (path != learn_file)
+        memfree(path);
+}
+
+/* Fingerprint tracks 0-1 as decoded by the default formats. Without a format
+ * specifier, a disk whose fingerprint is known is analysed as its title. */
+static void identify_title(struct disk *d, struct stream *s)
+{
+    struct format_list **lists, *list;
+    char *title;
+    unsigned int i;
+
+    /* A format specifier given other than by the user is not a title. */
+    if ((format && !ident_title) || (TRACK_START != 0) || (TRACK_STEP != 1)
+        || (TRACK_END(disk_get_info(d)) < 1))
+        return;
+
+    lists = format ? parse_config(config, NULL) : format_lists;
+    for (i = 0; i < 2; i++)
+        if ((list = lists[i]) != NULL)
+            (void)track_write_raw_from_stream_any(
+                d, i, list->ent, list->nr, 0, s, NULL, NULL);
+    if (lists != format_lists)
+        free_format_lists(lists);
+
+    if (ident_fingerprint(d, &ident_print) != 0) {
+        if (!quiet)
+            printf("Identify: Tracks 0-1 not decoded\n");
+        return;
+    }
+    ident_printed = 1;
+    if (format)
+        return;
+
+    if ((title = ident_lookup(ident_file, ident_print)) == NULL) {
+        if (!quiet)
+            printf("Identify: No title has fingerprint %08x\n", ident_print);
+        return;
+    }
+
+    if (!quiet)
+        printf("Identify: \"%s\" (fingerprint %08x)\n", title, ident_print);
+    free_format_lists(format_lists);
+    format_lists = parse_config(config, title);
+    if (learn)
+        learn_open(title);
+    memfree(title);
+}
+
+/* PLL settings tried by --pll-auto. Candidates are ordered nearest to the
+ * stream defaults first, so the earliest clean decode is the least exotic. */
+static const uint8_t pll_period_pcts[] = { 5, 3, 8, 1, 12, 0, 20 };
+static const uint8_t pll_phase_pcts[] = { 60, 40, 80, 20, 90 };
+#define MAX_PLL_CANDS (ARRAY_SIZE(pll_period_pcts) * ARRAY_SIZE(pll_phase_pcts))
+
+struct pll_cand {
+    uint8_t period, phase;
+    int score; /* valid sectors, or -1 if not identified */
+};
+
+/* Search state for the track being retried. Workers claim candidates from
+ * a shared counter, and stop once a lower-numbered candidate has decoded
+ * every sector: the result is the same as a sequential search. */
+struct pll_worker {
+    pthread_t thread;
     struct disk *d;
+    struct stream *s;
+};
+
+static pthread_mutex_t next_cand_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pll_cand pll_cands[MAX_PLL_CANDS];
+static unsigned int nr_pll_cands, next_cand, clean_cand;
+/* Candidates claimed at once by a worker, and decoded in PLL lanes. */
+static unsigned int pll_batch;
+static unsigned int pll_track, pll_type;
+
+/* The analysis pass has already tried the stream's current settings. */
+static void init_pll_cands(int period, int phase)
+{
+    unsigned int i, j, r;
+
+    nr_pll_cands = 0;
+    for (r = 0; r < MAX_PLL_CANDS; r++)
+        for (i = 0; i < ARRAY_SIZE(pll_period_pcts); i++)
+            for (j = 0; j < ARRAY_SIZE(pll_phase_pcts); j++)
+                if ((max(i, j) == r) && ((pll_period_pcts[i] != period)
+                                         || (pll_phase_pcts[j] != phase))) {
+                    pll_cands[nr_pll_cands].period = pll_period_pcts[i];
+                    pll_cands[nr_pll_cands].phase = pll_phase_pcts[j];
+                    nr_pll_cands++;
+                }
+}
+
+/* As analyse_track(), but starting from the format which matched during
+ * analysis and without disturbing the format list. */
+static int decode_track(
+    struct disk *d, struct stream *s, struct format_list *list,
+    unsigned int i, unsigned int type)
+{
+    unsigned int pos;
+
+    for (pos = 0; pos < list->nr; pos++)
+        if (list->ent[pos] == type)
+            break;
+    if (pos == list->nr)
+        pos = cursor.pos[list->idx];
+
+    return (track_write_raw_from_stream_any(
+                d, i, list->ent, list->nr, pos, s, NULL, NULL) >= 0) ? 0 : -1;
+}
+
+static void *pll_worker_fn(void *arg)
+{
+    struct pll_worker *w = arg;
+    struct track_info *ti = &disk_get_info(w->d)->track[pll_track];
+    uint8_t period[STREAM_PLL_LANES], phase[STREAM_PLL_LANES];
+    struct pll_cand *c;
+    unsigned int i, k, n;
+
+    for (;;) {
+        pthread_mutex_lock(&next_cand_lock);
+        k = next_cand;
+        n = (k < nr_pll_cands) ? min(pll_batch, nr_pll_cands - k) : 0;
+        next_cand += n;
+        pthread_mutex_unlock(&next_cand_lock);
+        if ((n == 0) || (k > clean_cand))
+            break;
+        for (i = 0; i < n; i++) {
+            period[i] = pll_cands[k+i].period;
+            phase[i] = pll_cands[k+i].phase;
+        }
+        (void)stream_set_pll_lanes(w->s, period, phase, n);
+        for (; (n != 0) && (k <= clean_cand); n--, k++) {
+            c = &pll_cands[k];
+            w->s->pll_period_adj_pct = c->period;
+            w->s->pll_phase_adj_pct = c->phase;
+            c->score = decode_track(w->d, w->s, format_lists[pll_track],
+                                    pll_track, pll_type) ? -1
+                : nr_valid_sectors(ti);
+            if ((c->score >= 0) && (c->score == ti->nr_sectors)) {
+                pthread_mutex_lock(&next_cand_lock);
+                clean_cand = min(clean_cand, k);
+                pthread_mutex_unlock(&next_cand_lock);
+            }
+        }
+    }
+
+    (void)stream_set_pll_lanes(w->s, NULL, NULL, 0);
+    return NULL;
+}
+
+/* Retry each track with bad sectors over a grid of PLL settings, reusing
+ * the track's loaded flux, and keep the setting which recovers most. */
+static void pll_search_tracks(struct disk *d, struct stream *s)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct pll_worker *workers;
+    struct track_info *ti;
+    uint64_t t0;
+    unsigned int i, j, k, best, nr, nr_threads;
+    int orig_period = s->pll_period_adj_pct, orig_phase = s->pll_phase_adj_pct;
+    int rc;
+
+    init_pll_cands(orig_period, orig_phase);
+    nr_threads = min(nr_jobs, nr_pll_cands);
+    workers = memalloc(nr_threads * sizeof(*workers));
+    for (j = 0; j < nr_threads; j++)
+        if ((workers[j].d = create_disk(
+                 out, DISKFL_read_only | DISKFL_rpm(data_rpm))) == NULL)
+            errx(1, "Unable to create scratch disk");
+
+    for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
+        ti = &di->track[i];
+        if ((format_lists[i] == NULL) ||
+            ((nr = nr_valid_sectors(ti)) == ti->nr_sectors) ||
+            (stream_select_track(s, i) != 0))
+            continue;
+        t0 = time_ns();
+
+        /* Each worker decodes from its own clone of the track's stream. */
+        for (j = 0; j < nr_threads; j++) {
+            workers[j].s = (nr_threads > 1) ? stream_clone(s) : s;
+            if (workers[j].s == NULL)
+                break;
+        }
+        if (j != nr_threads) {
+            while (j--)
+                stream_close(workers[j].s);
+            workers[0].s = s;
+        }
+        nr = (j == nr_threads) ? nr_threads : 1;
+
+        for (k = 0; k < nr_pll_cands; k++)
+            pll_cands[k].score = -1;
+        next_cand = 0;
+        clean_cand = ~0u;
+        pll_batch = min_t(unsigned int, STREAM_PLL_LANES,
+                          (nr_pll_cands + nr - 1) / nr);
+        pll_track = i;
+        pll_type = ti->type;
+
+        for (j = 0; j < nr; j++) {
+            /* Handlers may depend on tags found on earlier tracks. */
+            copy_tags(workers[j].d, d);
+            if (j && (rc = pthread_create(&workers[j].thread, NULL,
+                                          pll_worker_fn, &workers[j])) != 0)
+                errx(1, "Failed to create worker thread: %s", strerror(rc));
+        }
+        pll_worker_fn(&workers[0]);
+        for (j = 0; j < nr; j++) {
+            if (j)
+                pthread_join(workers[j].thread, NULL);
+            if (workers[j].s != s)
+                stream_close(workers[j].s);
+        }
+
+        for (k = best = 0; k < nr_pll_cands; k++)
+            if (pll_cands[k].score > pll_cands[best].score)
+                best = k;
+        if ((pll_cands[best].score < 0)
+            || (pll_cands[best].score <= nr_valid_sectors(ti)))
+            continue;
+
+        /* Redo the winning decode into the output disk. */
+        s->pll_period_adj_pct = pll_cands[best].period;
+        s->pll_phase_adj_pct = pll_cands[best].phase;
+        (void)decode_track(d, s, format_lists[i], i, ti->type);
+        report_track(d, i, s, 0, 0, time_ns() - t0);
+        track_settle(d, i);
+        if (verbose)
+            printf("T%u.%u: PLL period_adj=%d%% phase_adj=%d%% "
+                   "recovers %u/%u sectors\n", TRACK_ARG(i),
+                   s->pll_period_adj_pct, s->pll_phase_adj_pct,
+                   nr_valid_sectors(ti), ti->nr_sectors);
+    }
+
+    s->pll_period_adj_pct = orig_period;
+    s->pll_phase_adj_pct = orig_phase;
+    for (j = 0; j < nr_threads; j++)
+        disk_close(workers[j].d);
+    memfree(workers);
+}
+
+/* Every output after the first is a copy of the analysed disk. Writing the
+ * containers out is independent work, so is shared among --jobs threads. */
+static pthread_mutex_t next_out_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_out;
+
+static void *close_worker_fn(void *arg)
+{
+    struct disk **disks = arg;
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&next_out_lock);
+        i = next_out++;
+        pthread_mutex_unlock(&next_out_lock);
+        if (i >= nr_outs)
+            break;
+        disk_close(disks[i]);
+    }
+
+    return NULL;
+}
+
+/* --verify: each analysed track of @ref, read back from output @name as a
+ * stream and decoded again by its handler into scratch disk @d, must give the
+ * same data. Tracks are shared among --jobs threads, each with its own
+ * stream. */
+struct verify {
+    struct disk *ref, *d;
+    const char *name;
+    struct stream **s;
+    pthread_mutex_t lock;
+    unsigned int next, nr_threads, nr_bad;
+};
+
+static void *verify_worker_fn(void *arg)
+{
+    struct verify *v = arg;
+    struct disk_info *rdi = disk_get_info(v->ref), *di = disk_get_info(v->d);
+    struct track_info *rti, *ti;
+    struct stream *s;
+    unsigned int i, end = min_t(unsigned int, TRACK_END(rdi), di->nr_tracks-1);
+
+    pthread_mutex_lock(&v->lock);
+    s = v->s[v->nr_threads++];
+    pthread_mutex_unlock(&v->lock);
+
+    for (;;) {
+        pthread_mutex_lock(&v->lock);
+        i = v->next;
+        v->next += TRACK_STEP;
+        pthread_mutex_unlock(&v->lock);
+        if (i > end)
+            break;
+        rti = &rdi->track[i];
+        if ((rti->type == TRKTYP_unformatted)
+            || (disk_get_format(rti->type)->flags & TRKFMT_raw))
+            continue;
+        ti = &di->track[i];
+        if ((stream_select_track(s, i) == 0)
+            && (track_write_raw_from_stream(v->d, i, rti->type, s) == 0)
+            && (ti->nr_sectors == rti->nr_sectors)
+            && !memcmp(ti->valid_sectors, rti->valid_sectors,
+                       sizeof(ti->valid_sectors))
+            && (ti->len == rti->len) && !memcmp(ti->dat, rti->dat, ti->len))
+            continue;
+        printf("T%u.%u: %s: Verify failed: %s\n",
+               TRACK_ARG(i), v->name, rti->typename);
+        pthread_mutex_lock(&v->lock);
+        v->nr_bad++;
+        pthread_mutex_unlock(&v->lock);
+    }
+
+    return NULL;
+}
+
+static unsigned int verify_output(struct disk *ref, const char *name)
+{
+    struct verify v = { .ref = ref, .name = name, .next = TRACK_START };
+    pthread_t *threads;
+    unsigned int i, nr_threads = max(nr_jobs, 1u);
+    int rc;
+
+    /* Sector dumps cannot be read back without knowing their format. */
+    v.s = memalloc(nr_threads * sizeof(*v.s));
+    for (i = 0; i < nr_threads; i++) {
+        if ((v.s[i] = stream_open(name, data_rpm, data_rpm)) != NULL) {
+            v.s[i]->trace = trace;
+            continue;
+        }
+        if (i == 0) {
+            warnx("%s: Cannot be read back: not verified", name);
+            memfree(v.s);
+            return 0;
+        }
+        errx(1, "Unable to open disk file to verify: %s", name);
+    }
+
+    v.d = create_disk("verify.dsk", DISKFL_read_only | DISKFL_rpm(data_rpm));
+    if (v.d == NULL)
+        errx(1, "Unable to create scratch disk");
+
+    pthread_mutex_init(&v.lock, NULL);
+    threads = memalloc(nr_threads * sizeof(*threads));
+    for (i = 1; i < nr_threads; i++)
+        if ((rc = pthread_create(&threads[i], NULL,
+                                 verify_worker_fn, &v)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    verify_worker_fn(&v);
+    for (i = 1; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    memfree(threads);
+    pthread_mutex_destroy(&v.lock);
+
+    for (i = 0; i < nr_threads; i++)
+        stream_close(v.s[i]);
+    memfree(v.s);
+    disk_close(v.d);
+    return v.nr_bad;
+}
+
+static void close_outputs(struct disk *d)
+{
+    struct disk **disks = memalloc(nr_outs * sizeof(*disks));
+    struct disk *ref = NULL;
+    pthread_t *threads;
+    unsigned int i, nr_bad, nr_threads = min(nr_jobs, nr_outs);
+    int rc;
+
+    /* The analysed disk is gone once closed: verify against a copy. */
+    if (verify && ((ref = disk_create_copy(
+                        d, "verify.dsk", DISKFL_read_only)) == NULL))
+        errx(1, "Unable to create scratch disk");
+
+    disks[0] = d;
+    for (i = 1; i < nr_outs; i++)
+        if ((disks[i] = disk_create_copy(
+                 d, outs[i], disk_flags | DISKFL_rpm(data_rpm))) == NULL)
+            errx(1, "Unable to create new disk file: %s", outs[i]);
+
+    next_out = 0;
+    threads = memalloc(nr_threads * sizeof(*threads));
+    for (i = 1; i < nr_threads; i++)
+        if ((rc = pthread_create(&threads[i], NULL,
+                                 close_worker_fn, disks)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    close_worker_fn(disks);
+    for (i = 1; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    memfree(threads);
+    memfree(disks);
+
+    if (ref == NULL)
+        return;
+    for (i = nr_bad = 0; i < nr_outs; i++)
+        nr_bad += verify_output(ref, outs[i]);
+    disk_close(ref);
+    if (nr_bad)
+        errx(1, "** %u tracks failed verification", nr_bad);
+}
+
+/* Copy into @d each track of @old which its format list would accept again
+ * as it stands. Returns the number copied. */
+static unsigned int update_tracks(struct disk *d, struct disk *old)
+{
+    struct disk_info *di = disk_get_info(d), *odi = disk_get_info(old);
+    struct format_list *list;
+    unsigned int i, j, type, nr = 0;
+
+    updated = memalloc(di->nr_tracks);
+
+    for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
+        if (((list = format_lists[i]) == NULL) || (i >= odi->nr_tracks)
+            || (journal_replayed(i) >= 0))
+            continue;
+        type = odi->track[i].type;
+        if ((type == TRKTYP_unformatted)
+            || (disk_get_format(type)->flags & TRKFMT_raw))
+            continue;
+        for (j = 0; j < list->nr; j++)
+            if (list->ent[j] == type)
+                break;
+        if (j == list->nr)
+            continue;
+        track_copy(d, old, i);
+        updated[i] = 1;
+        nr++;
+    }
+
+    /* Handlers may depend on tags found on the copied tracks. */
+    copy_tags(d, old);
+    return nr;
+}
+
+static void handle_stream(void)
+{
+    struct stream *s;
+    struct disk *d, *old = NULL;
     struct disk_info *di;
     struct track_info *ti;
-    unsigned int i, unidentified = 0, bad_secs = 0;
+    unsigned int i, unidentified = 0, bad_secs = 0, nr_updated = 0;
 
-    if ((s = stream_open(in, drive_rpm, data_rpm)) == NULL)
-        errx(1, "Failed to probe input file: %s", in);
+    if (update_path) {
+        /* Its track data is read on demand, after the outputs are created. */
+        struct stat st, ost;
+        if (stat(update_path, &ost) != 0)
+            err(1, "%s", update_path);
+        for (i = 0; i < nr_outs; i++)
+            if ((stat(outs[i], &st) == 0) && (st.st_dev == ost.st_dev)
+                && (st.st_ino == ost.st_ino))
+                errx(1, "Cannot update %s in place", update_path);
+        if ((old = open_disk(update_path, DISKFL_read_only)) == NULL)
+            errx(1, "Unable to open disk file to update: %s", update_path);
+    }
 
-    if (pll_period_adj_pct >= 0)
-        s->pll_period_adj_pct = pll_period_adj_pct;
-    if (pll_phase_adj_pct >= 0)
-        s->pll_phase_adj_pct = pll_phase_adj_pct;
+    calibrate_drive();
+    s = open_stream();
     if (verbose)
         printf("PLL Parameters: period_adj=%d%% phase_adj=%d%%\n",
                s->pll_period_adj_pct, s->pll_phase_adj_pct);
 
-    if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
+    if ((d = create_disk(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
     di = disk_get_info(d);
+    if (mem_budget)
+        disk_set_mem_budget(d, mem_budget);
+    if (mem_compress)
+        disk_set_mem_compress(d, 1);
 
-    for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
-        struct format_list *list = format_lists[i];
-        unsigned int j;
-        if (list == NULL)
-            continue;
-        for (j = 0; j < list->nr; j++) {
-            if (track_write_raw_from_stream(
-                    d, i, list->ent[list->pos], s) == 0)
-                break;
-            if (++list->pos >= list->nr)
-                list->pos = 0;
-        }
-        if ((j == list->nr) &&
-            (track_write_raw_from_stream(d, i, TRKTYP_unformatted, s) != 0)) {
-            /* Tracks 160+ are expected to be unused. Don't warn about them. */
-            if (i < 160)
-                unidentified++;
-            else
-                track_mark_unformatted(d, i);
-        }
+    if (identify)
+        identify_title(d, s);
+
+    if (resume)
+        journal_open(d, out, in);
+    if (cache_path)
+        cache_open(cache_path, disk_flags, cal_clock_ns);
+    if (report_file)
+        report_open(report_file);
+    if (progress_file) {
+        unsigned int nr = 0;
+        for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP)
+            nr += (format_lists[i] != NULL);
+        if ((progress = progress_open(progress_file, "disk-analyse",
+                                      in, nr)) == NULL)
+            err(1, "Unable to open progress %s", progress_file);
+    }
+    if (old) {
+        nr_updated = update_tracks(d, old);
+        disk_close(old);
+        if (!quiet)
+            printf("Update: %u tracks copied from %s\n",
+                   nr_updated, update_path);
+    }
+
+    if (nr_jobs > 1) {
+        unidentified = analyse_tracks_parallel(d, s);
+    } else {
+        for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP)
+            unidentified += analyse_track(d, s, format_lists[i], &cursor, i);
     }
 
+    if (cache_path && !quiet)
+        printf("Cache: %u of %u tracks found in %s\n",
+               nr_cache_hits, nr_cache_lookups, cache_path);
+
+    if (pll_auto)
+        pll_search_tracks(d, s);
+
+    if (learn)
+        learn_tracks(di);
+
     for (i = TRACK_START; i <= TRACK_END(di); i += TRACK_STEP) {
         unsigned int j;
         ti = &di->track[i];
         if (index_align)
             ti->data_bitoff = 1024;
-        for (j = 0; j < ti->nr_sectors; j++)
-            if (!is_valid_sector(ti, j))
-                break;
-        if (j == ti->nr_sectors)
+        if ((j = next_invalid_sector(ti, 0)) == ti->nr_sectors)
             continue;
         unidentified++;
         printf("T%u.%u: sectors ", TRACK_ARG(i));
-        for (j = 0; j < ti->nr_sectors; j++) {
-            if (is_valid_sector(ti, j))
-                continue;
+        for (; j < ti->nr_sectors; j = next_invalid_sector(ti, j+1)) {
             printf("%u,", j);
             bad_secs++;
         }
@@ -252,9 +1303,17 @@ static void handle_stream(void)
     if (unidentified)
         fprintf(stderr,"** WARNING: %u track%s damaged or unidentified!\n",
                 unidentified, (unidentified > 1) ? "s are" : " is");
+    else if (ident_title && ident_printed)
+        ident_record(ident_file, ident_print, ident_title);
 
-    disk_close(d);
+    close_outputs(d);
     stream_close(s);
+    journal_close();
+    report_close();
+    progress_close(progress);
+    progress = NULL;
+    memfree(updated);
+    updated = NULL;
 }
 
 static void handle_img(void)
@@ -266,6 +1325,7 @@ static void handle_img(void)
     struct disk *d;
     struct disk_info *di;
     void *data;
+    bool_t mapped = 0;
 
     if ((fd = file_open(in, O_RDONLY)) == -1) {
         if (errno == ENOENT) {
@@ -277,17 +1337,28 @@ static void handle_img(void)
     sz = lseek(fd, 0, SEEK_END);
     lseek(fd, 0, SEEK_SET);
 
-    if ((d = disk_create(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
+    if ((d = create_disk(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
         errx(1, "Unable to create new disk file: %s", out);
     di = disk_get_info(d);
 
+    /* Each track's sectors are copied straight out of the mapped file. */
+#if !defined(__MINGW32__)
+    if (sz != 0) {
+        data = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ((mapped = (data != MAP_FAILED)))
+            (void)madvise(data, sz, MADV_SEQUENTIAL);
+    }
+#endif
+    if (!mapped) {
+        data = memalloc(sz);
+        read_exact(fd, data, sz);
+    }
+    close(fd);
+
     sectors = track_alloc_sector_buffer(d);
-    sectors->data = data = memalloc(sz);
+    sectors->data = data;
     sectors->nr_bytes = sz;
 
-    read_exact(fd, sectors->data, sz);
-    close(fd);
-
     for (i = TRACK_START;
          (i <= TRACK_END(di)) && sectors->nr_bytes;
          i += TRACK_STEP) {
@@ -308,20 +1379,78 @@ static void handle_img(void)
 
     dump_track_list(d);
 
-    disk_close(d);
+    close_outputs(d);
 
-    memfree(data);
+#if !defined(__MINGW32__)
+    if (mapped)
+        munmap(data, sz);
+    else
+#endif
+        memfree(data);
     sectors->data = NULL;
     sectors->nr_bytes = 0;
     track_free_sector_buffer(sectors);
 }
 
+/* Each output track is copied from the first of the partial outputs listed
+ * in @in to have it formatted. */
+static void handle_merge(void)
+{
+    struct disk *d, *part;
+    struct disk_info *di, *pdi;
+    char *names, *name, *p;
+    uint8_t *copied;
+    unsigned int i, nr;
+
+    if ((d = create_disk(out, disk_flags | DISKFL_rpm(data_rpm))) == NULL)
+        errx(1, "Unable to create new disk file: %s", out);
+    di = disk_get_info(d);
+    copied = memalloc(di->nr_tracks);
+
+    names = memalloc(strlen(in) + 1);
+    strcpy(names, in);
+    for (name = strtok_r(names, ",", &p); name != NULL;
+         name = strtok_r(NULL, ",", &p)) {
+        if ((part = open_disk(name, DISKFL_read_only)) == NULL)
+            errx(1, "Unable to open disk file to merge: %s", name);
+        pdi = disk_get_info(part);
+        nr = min(di->nr_tracks, pdi->nr_tracks);
+        for (i = 0; i < nr; i++) {
+            if (copied[i] || (pdi->track[i].type == TRKTYP_unformatted))
+                continue;
+            track_copy(d, part, i);
+            copied[i] = 1;
+        }
+        copy_tags(d, part);
+        disk_close(part);
+    }
+    memfree(names);
+    memfree(copied);
+
+    dump_track_list(d);
+
+    close_outputs(d);
+}
+
+int main(int argc, char **argv);
+
+/* A job sent to --serve or listed by --batch: it starts from the server's
+ * options. */
+static int serve_job(int argc, char **argv)
+{
+    serving_job = 1;
+    serve_path = batch_path = NULL;
+    nr_jobs = 1;
+    optind = 0;
+    return main(argc, argv);
+}
+
 int main(int argc, char **argv)
 {
-    char in_suffix[8], out_suffix[8], *config = NULL, *format = NULL;
+    char in_suffix[8], out_suffix[8], **args;
     int ch;
 
-    const static char sopts[] = "hqviCp:P:r:s:e:S::kf:c:";
+    const static char sopts[] = "hqviCp:P:Rar:s:e:S::kf:c:j:T::L::Y::JmVK:U:O:G:M:zI:W::A:t:D:X:B:";
     const static struct option lopts[] = {
         { "help", 0, NULL, 'h' },
         { "quiet", 0, NULL, 'q' },
@@ -330,6 +1459,8 @@ int main(int argc, char **argv)
         { "clear-bad-sectors", 0, NULL, 'C' },
         { "pll-period-adj", 1, NULL, 'p' },
         { "pll-phase-adj", 1, NULL, 'P' },
+        { "pll-reference", 0, NULL, 'R' },
+        { "pll-auto", 0, NULL, 'a' },
         { "rpm", 1, NULL, 'r' },
         { "start-cyl", 1, NULL, 's' },
         { "end-cyl", 1, NULL, 'e' },
@@ -337,9 +1468,34 @@ int main(int argc, char **argv)
         { "kryoflux-hack", 0, NULL, 'k' },
         { "format", 1, NULL, 'f' },
         { "config",  1, NULL, 'c' },
+        { "jobs", 1, NULL, 'j' },
+        { "stats", 2, NULL, 'T' },
+        { "learn", 2, NULL, 'L' },
+        { "identify", 2, NULL, 'Y' },
+        { "resume", 0, NULL, 'J' },
+        { "merge", 0, NULL, 'm' },
+        { "verify", 0, NULL, 'V' },
+        { "cache", 1, NULL, 'K' },
+        { "update", 1, NULL, 'U' },
+        { "report", 1, NULL, 'O' },
+        { "progress", 1, NULL, 'G' },
+        { "mem-budget", 1, NULL, 'M' },
+        { "compress", 0, NULL, 'z' },
+        { "idle-revs", 1, NULL, 'I' },
+        { "watch", 2, NULL, 'W' },
+        { "calibrate", 1, NULL, 'A' },
+        { "trace", 1, NULL, 't' },
+        { "serve", 1, NULL, 'D' },
+        { "connect", 1, NULL, 'X' },
+        { "batch", 1, NULL, 'B' },
         { 0, 0, 0, 0}
     };
 
+    /* Arguments are forwarded to a server as given, before getopt permutes
+     * them. */
+    args = memalloc(argc * sizeof(*args));
+    memcpy(args, argv, argc * sizeof(*args));
+
     while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
         switch (ch) {
         case 'h':
@@ -371,6 +1527,12 @@ int main(int argc, char **argv)
                 usage(1);
             }
             break;
+        case 'R':
+            pll_reference = 1;
+            break;
+        case 'a':
+            pll_auto = 1;
+            break;
         case 'r': {
             char *p;
             drive_rpm = strtol(optarg, &p, 10);
@@ -404,21 +1566,142 @@ int main(int argc, char **argv)
         case 'c':
             config = optarg;
             break;
+        case 'j':
+            nr_jobs = atoi(optarg);
+            if ((nr_jobs < 1) || (nr_jobs > 256)) {
+                warnx("Bad --jobs value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 'T':
+            if (!optarg || !strcmp(optarg, "text")) {
+                stats = STATS_text;
+            } else if (!strcmp(optarg, "json")) {
+                stats = STATS_json;
+            } else {
+                warnx("Bad --stats format '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 'L':
+            learn = 1;
+            learn_file = optarg;
+            break;
+        case 'Y':
+            identify = 1;
+            ident_file = optarg;
+            break;
+        case 'J':
+            resume = 1;
+            break;
+        case 'm':
+            merge = 1;
+            break;
+        case 'V':
+            verify = 1;
+            break;
+        case 'K':
+            cache_path = optarg;
+            break;
+        case 'U':
+            update_path = optarg;
+            break;
+        case 'O':
+            report_file = optarg;
+            break;
+        case 'G':
+            progress_file = optarg;
+            break;
+        case 'M': {
+            char *p;
+            mem_budget = (uint64_t)strtoul(optarg, &p, 10) << 20;
+            if ((*p != '\0') || (mem_budget == 0)) {
+                warnx("Bad --mem-budget value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        }
+        case 'z':
+            mem_compress = 1;
+            break;
+        case 'I': {
+            char *p;
+            idle_revs_sectored = strtoul(optarg, &p, 10);
+            idle_revs_track = (*p == ':') ? strtoul(p+1, &p, 10)
+                : idle_revs_sectored;
+            if ((*p != '\0') || !idle_revs_sectored || !idle_revs_track) {
+                warnx("Bad --idle-revs value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        }
+        case 'W': {
+            char *p = "";
+            watch_secs = optarg ? strtoul(optarg, &p, 10) : 30;
+            if ((*p != '\0') || (watch_secs == 0)) {
+                warnx("Bad --watch value '%s'", optarg);
+                usage(1);
+            }
+            break;
+        }
+        case 'A':
+            calibrate_file = optarg;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'D':
+            serve_path = optarg;
+            break;
+        case 'X':
+            connect_path = optarg;
+            break;
+        case 'B':
+            batch_path = optarg;
+            break;
         default:
             usage(1);
             break;
         }
     }
 
-    if (argc != (optind + 2))
+    if (connect_path && !serving_job)
+        return serve_connect(connect_path, argc, args);
+    memfree(args);
+
+    if (serve_path) {
+        config_preload(config);
+        stream_preload();
+        serve(serve_path, nr_jobs, serve_job);
+    }
+
+    if (batch_path) {
+        config_preload(config);
+        stream_preload();
+        return batch(batch_path, nr_jobs, serve_job);
+    }
+
+    if (argc < (optind + 2))
         usage(1);
 
     in = argv[optind];
     out = argv[optind+1];
+    outs = &argv[optind+1];
+    nr_outs = argc - optind - 1;
+
+    if (stats != STATS_none) {
+        stats_table = track_stats_alloc();
+        mem_enable_stats(1);
+    }
+    if (trace_file && ((trace = trace_open(trace_file)) == NULL))
+        err(1, "Unable to create trace %s", trace_file);
 
     filename_extension(in, in_suffix, sizeof(in_suffix));
     filename_extension(out, out_suffix, sizeof(out_suffix));
 
+    if (identify)
+        ident_title = format;
+
     /* Pick a sane default format for certain sector image formats. */
     if (!format) {
         if (!strcmp(in_suffix, "imd") || !strcmp(out_suffix, "imd"))
@@ -429,7 +1712,14 @@ int main(int argc, char **argv)
             format = "atari_st";
     }
 
-    if (format && !strcmp(format, "probe_all")) {
+    if (merge) {
+
+        handle_merge();
+
+    } else if (format && !strcmp(format, "probe_all")) {
+
+        if (nr_outs > 1)
+            errx(1, "Only one output file may be given with probe_all");
 
         /* Lists all wholly- and partially-matching formats. */
         probe_stream();
@@ -438,6 +1728,14 @@ int main(int argc, char **argv)
 
         format_lists = parse_config(config, format);
 
+        if (learn)
+            learn_open(format ? : "default");
+
+        if (identify && (ident_file == NULL)) {
+            ident_file = memalloc(strlen(config_path) + 7);
+            sprintf(ident_file, "%s.ident", config_path);
+        }
+
         if (!strcmp(in_suffix, "img") || !strcmp(in_suffix, "st"))
             handle_img();
         else
@@ -445,6 +1743,11 @@ int main(int argc, char **argv)
 
     }
 
+    if (stats != STATS_none)
+        dump_format_stats();
+
+    track_stats_free(stats_table);
+    trace_close(trace);
     return 0;
 }
 
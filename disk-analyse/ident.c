@@ -0,0 +1,135 @@
+/*
+ * disk-analyse/ident.c
+ *
+ * Title identification for --identify. A disk's fingerprint is taken from
+ * its first two tracks: the format each decoded as, its data length, and
+ * the first kilobyte of its data (on an AmigaDOS disk, the bootblock and the
+ * first sectors of track 1). The fingerprint of every disk analysed with a
+ * format specifier is kept across runs, so that a disk analysed without one
+ * can be analysed as the title it matches.
+ *
+ * The fingerprints are plain text, one per line:
+ *  <fingerprint> <title>
+ * where a title of "-" marks a fingerprint seen on more than one title.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+#define IDENT_BYTES 1024
+#define AMBIGUOUS   "-"
+
+int ident_fingerprint(struct disk *d, uint32_t *print)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct track_info *ti;
+    const struct track_format *fmt;
+    uint32_t crc = 0xffffffff, len;
+    unsigned int i;
+
+    if (di->nr_tracks < 2)
+        return -1;
+
+    for (i = 0; i < 2; i++) {
+        ti = &di->track[i];
+        fmt = disk_get_format(ti->type);
+        if ((ti->type == TRKTYP_unformatted) || (fmt == NULL)
+            || (fmt->flags & TRKFMT_raw)
+            || (next_invalid_sector(ti, 0) != ti->nr_sectors))
+            return -1;
+        crc = crc32_add(fmt->id_name, strlen(fmt->id_name) + 1, crc);
+        len = htobe32(ti->len);
+        crc = crc32_add(&len, sizeof(len), crc);
+        crc = crc32_add(ti->dat, min_t(uint32_t, ti->len, IDENT_BYTES), crc);
+    }
+
+    *print = crc;
+    return 0;
+}
+
+char *ident_lookup(const char *path, uint32_t print)
+{
+    char line[512], title[256], *p = NULL;
+    unsigned int f;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return NULL;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((line[0] == '#')
+            || (sscanf(line, "%x %255[^\n]", &f, title) != 2)
+            || (f != print))
+            continue;
+        if (strcmp(title, AMBIGUOUS)) {
+            p = memalloc(strlen(title) + 1);
+            strcpy(p, title);
+        }
+        break;
+    }
+
+    fclose(fp);
+    return p;
+}
+
+void ident_record(const char *path, uint32_t print, const char *title)
+{
+    char line[512], t[256], *tmp;
+    unsigned int f;
+    FILE *in, *out;
+    bool_t found = 0;
+
+    /* Write a temporary file and rename it into place, so that an
+     * interrupted run never leaves truncated fingerprints. */
+    tmp = memalloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    if ((out = fopen(tmp, "w")) == NULL) {
+        warn("Unable to write fingerprints to %s", tmp);
+        goto out;
+    }
+    fprintf(out, "# disk-analyse title fingerprints: fingerprint title\n");
+
+    if ((in = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if ((line[0] == '#')
+                || (sscanf(line, "%x %255[^\n]", &f, t) != 2))
+                continue;
+            if (!found && (f == print)) {
+                found = 1;
+                if (strcmp(t, title) && strcmp(t, AMBIGUOUS)) {
+                    warnx("Fingerprint %08x is of \"%s\" and \"%s\": "
+                          "not used to identify either", print, t, title);
+                    strcpy(t, AMBIGUOUS);
+                }
+            }
+            fprintf(out, "%08x %s\n", f, t);
+        }
+        fclose(in);
+    }
+
+    if (!found)
+        fprintf(out, "%08x %s\n", print, title);
+
+    if ((fclose(out) != 0) || (rename(tmp, path) != 0)) {
+        warn("Unable to write fingerprints to %s", path);
+        (void)remove(tmp);
+    }
+
+out:
+    memfree(tmp);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,282 @@
+/*
+ * disk-analyse/journal.c
+ *
+ * Checkpoint journal for --resume: each track's analysis result is appended
+ * to a sidecar file as soon as it is known, so that a run which is killed can
+ * be restarted without analysing those tracks again.
+ *
+ * The journal is scratch state for the machine that wrote it, so is kept in
+ * host byte order:
+ *  <magic> <input filename, NUL-terminated>
+ *  [<struct journal_rec> <track data> [<struct disktag> <tag data>]*]*
+ * A record whose CRC does not match (e.g., it was torn by the kill) ends the
+ * journal, and is overwritten by the resumed run. Entries of the --cache are
+ * single records.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+#define JOURNAL_MAGIC "DAJRNL1"
+
+struct journal_rec {
+    uint32_t crc; /* crc32 of the rest of the record */
+    uint32_t len, data_bitoff, total_bits;
+    uint16_t tracknr, type, flags, bytes_per_sector;
+    uint16_t nr_tags, tags_len;
+    uint8_t nr_sectors, unidentified;
+    uint8_t valid_sectors[8];
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *journal_fp;
+static char *journal_path;
+/* Per track: -1 if not replayed, else the journaled 'unidentified' flag. */
+static int8_t *replayed;
+static unsigned int nr_tracks;
+
+static uint32_t rec_crc(const struct journal_rec *rec, const void *body)
+{
+    uint32_t crc = crc32_add(&rec->crc + 1,
+                             sizeof(*rec) - sizeof(rec->crc), 0);
+    return crc32_add(body, rec->len + rec->tags_len, crc);
+}
+
+static void replay_rec(
+    struct disk *d, const struct journal_rec *rec, const uint8_t *body)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct track_info *ti = &di->track[rec->tracknr];
+    const struct disktag *tag;
+    const uint8_t *p = body + rec->len;
+    unsigned int i;
+
+    track_mark_unformatted(d, rec->tracknr);
+    ti->type = rec->type;
+    ti->typename = rec->unidentified ? "Unformatted*"
+        : disk_get_format_desc_name(rec->type);
+    ti->flags = rec->flags;
+    ti->bytes_per_sector = rec->bytes_per_sector;
+    ti->nr_sectors = rec->nr_sectors;
+    memcpy(ti->valid_sectors, rec->valid_sectors, sizeof(ti->valid_sectors));
+    ti->len = rec->len;
+    ti->data_bitoff = rec->data_bitoff;
+    ti->total_bits = rec->total_bits;
+    if (rec->len != 0) {
+        ti->dat = memalloc(rec->len);
+        memcpy(ti->dat, body, rec->len);
+    }
+
+    for (i = 0; i < rec->nr_tags; i++) {
+        tag = (const struct disktag *)p;
+        disk_set_tag(d, tag->id, tag->len, (void *)(tag+1));
+        p += sizeof(*tag) + tag->len;
+    }
+}
+
+/* Read back every complete record. Returns the offset just beyond the last. */
+static long journal_replay(struct disk *d, const char *in)
+{
+    struct journal_rec rec;
+    char magic[sizeof(JOURNAL_MAGIC)], *name;
+    uint8_t *body;
+    long off;
+    bool_t ok;
+
+    name = memalloc(strlen(in) + 1);
+    ok = ((fread(magic, sizeof(magic), 1, journal_fp) == 1)
+          && !memcmp(magic, JOURNAL_MAGIC, sizeof(magic))
+          && (fread(name, strlen(in) + 1, 1, journal_fp) == 1)
+          && !strcmp(name, in));
+    memfree(name);
+    if (!ok) {
+        warnx("Ignoring journal %s: not for input %s", journal_path, in);
+        return 0;
+    }
+
+    for (;;) {
+        off = ftell(journal_fp);
+        if ((fread(&rec, sizeof(rec), 1, journal_fp) != 1)
+            || (rec.tracknr >= nr_tracks))
+            break;
+        body = memalloc(rec.len + rec.tags_len + 1);
+        ok = ((fread(body, 1, rec.len + rec.tags_len, journal_fp)
+               == rec.len + rec.tags_len)
+              && (rec_crc(&rec, body) == rec.crc));
+        if (ok) {
+            replay_rec(d, &rec, body);
+            replayed[rec.tracknr] = rec.unidentified;
+        }
+        memfree(body);
+        if (!ok)
+            break;
+    }
+
+    return off;
+}
+
+void journal_open(struct disk *d, const char *out, const char *in)
+{
+    long off = 0;
+    unsigned int i;
+
+    nr_tracks = disk_get_info(d)->nr_tracks;
+    replayed = memalloc(nr_tracks);
+    for (i = 0; i < nr_tracks; i++)
+        replayed[i] = -1;
+
+    journal_path = memalloc(strlen(out) + 9);
+    sprintf(journal_path, "%s.journal", out);
+
+    if ((journal_fp = fopen(journal_path, "r+b")) != NULL)
+        off = journal_replay(d, in);
+    else if ((journal_fp = fopen(journal_path, "w+b")) == NULL)
+        err(1, "Unable to create journal %s", journal_path);
+
+    /* Start afresh, or after the last good record. */
+    fflush(journal_fp);
+    if (ftruncate(fileno(journal_fp), off) < 0)
+        err(1, "%s", journal_path);
+    fseek(journal_fp, off, SEEK_SET);
+    if (off == 0) {
+        fwrite(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC), 1, journal_fp);
+        fwrite(in, strlen(in) + 1, 1, journal_fp);
+    }
+    if (fflush(journal_fp) != 0)
+        err(1, "%s", journal_path);
+}
+
+int journal_replayed(unsigned int tracknr)
+{
+    return ((replayed == NULL) || (tracknr >= nr_tracks))
+        ? -1 : replayed[tracknr];
+}
+
+/* Marshal track @tracknr's result as a record: header, track data, tags. */
+static uint8_t *pack_rec(struct disk *d, unsigned int tracknr,
+                         int unidentified, struct journal_rec *rec)
+{
+    struct track_info *ti = &disk_get_info(d)->track[tracknr];
+    struct disktag *tag;
+    uint8_t *buf, *body, *p;
+    unsigned int i;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->len = ti->len;
+    rec->data_bitoff = ti->data_bitoff;
+    rec->total_bits = ti->total_bits;
+    rec->tracknr = tracknr;
+    rec->type = ti->type;
+    rec->flags = ti->flags;
+    rec->bytes_per_sector = ti->bytes_per_sector;
+    rec->nr_sectors = ti->nr_sectors;
+    rec->unidentified = !!unidentified;
+    memcpy(rec->valid_sectors, ti->valid_sectors, sizeof(rec->valid_sectors));
+
+    /* The disk's tags so far: they may be derived from this track. */
+    for (i = 0; (tag = disk_get_tag_by_idx(d, i)) != NULL; i++) {
+        if (tag->id == DSKTAG_end)
+            continue;
+        rec->nr_tags++;
+        rec->tags_len += sizeof(*tag) + tag->len;
+    }
+
+    buf = memalloc(sizeof(*rec) + rec->len + rec->tags_len);
+    body = p = buf + sizeof(*rec);
+    memcpy(p, ti->dat, rec->len);
+    p += rec->len;
+    rec->nr_tags = 0;
+    for (i = 0; (tag = disk_get_tag_by_idx(d, i)) != NULL; i++) {
+        if (tag->id == DSKTAG_end)
+            continue;
+        if (p + sizeof(*tag) + tag->len > body + rec->len + rec->tags_len)
+            break; /* tags added by another thread meanwhile */
+        memcpy(p, tag, sizeof(*tag) + tag->len);
+        p += sizeof(*tag) + tag->len;
+        rec->nr_tags++;
+    }
+    rec->tags_len = p - (body + rec->len);
+    rec->crc = rec_crc(rec, body);
+
+    memcpy(buf, rec, sizeof(*rec));
+    return buf;
+}
+
+void *journal_pack(struct disk *d, unsigned int tracknr, int unidentified,
+                   uint32_t *plen)
+{
+    struct journal_rec rec;
+    uint8_t *p = pack_rec(d, tracknr, unidentified, &rec);
+    *plen = sizeof(rec) + rec.len + rec.tags_len;
+    return p;
+}
+
+int journal_unpack(struct disk *d, unsigned int tracknr,
+                   const void *buf, uint32_t len)
+{
+    struct journal_rec rec;
+    const uint8_t *body = (const uint8_t *)buf + sizeof(rec);
+
+    if (len < sizeof(rec))
+        return -1;
+    memcpy(&rec, buf, sizeof(rec));
+    if ((rec.tracknr != tracknr)
+        || ((uint64_t)sizeof(rec) + rec.len + rec.tags_len != len)
+        || (rec_crc(&rec, body) != rec.crc))
+        return -1;
+
+    replay_rec(d, &rec, body);
+    return rec.unidentified;
+}
+
+void journal_track(struct disk *d, unsigned int tracknr, int unidentified)
+{
+    struct journal_rec rec;
+    uint8_t *p;
+
+    if (journal_fp == NULL)
+        return;
+
+    p = pack_rec(d, tracknr, unidentified, &rec);
+
+    /* Flushed per record: a killed process loses nothing already written. */
+    pthread_mutex_lock(&journal_lock);
+    if ((fwrite(p, 1, sizeof(rec) + rec.len + rec.tags_len, journal_fp)
+         != sizeof(rec) + rec.len + rec.tags_len)
+        || (fflush(journal_fp) != 0))
+        err(1, "%s", journal_path);
+    pthread_mutex_unlock(&journal_lock);
+
+    memfree(p);
+}
+
+void journal_close(void)
+{
+    if (journal_fp == NULL)
+        return;
+
+    fclose(journal_fp);
+    journal_fp = NULL;
+    if (remove(journal_path) != 0)
+        warn("Unable to remove journal %s", journal_path);
+    memfree(journal_path);
+    memfree(replayed);
+    replayed = NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,174 @@
+/*
+ * disk-analyse/learn.c
+ *
+ * Per-title, per-track format match counts, kept across runs in a sidecar
+ * file so that the most likely format for a track is tried first.
+ *
+ * The sidecar is plain text, one record per line:
+ *  <title> <track> <format> <count>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+struct learn_ent {
+    char title[128];
+    uint16_t track, type;
+    uint32_t count;
+};
+
+static struct learn_ent *ents;
+static unsigned int nr_ents, max_ents;
+static char *learn_path, *learn_title;
+
+static struct learn_ent *find_ent(
+    const char *title, unsigned int track, unsigned int type)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_ents; i++)
+        if ((ents[i].track == track) && (ents[i].type == type)
+            && !strcmp(ents[i].title, title))
+            return &ents[i];
+
+    return NULL;
+}
+
+static struct learn_ent *add_ent(
+    const char *title, unsigned int track, unsigned int type)
+{
+    struct learn_ent *e;
+
+    if (nr_ents == max_ents) {
+        struct learn_ent *old = ents;
+        max_ents = max_ents ? max_ents * 2 : 64;
+        ents = memalloc(max_ents * sizeof(*ents));
+        if (old != NULL) {
+            memcpy(ents, old, nr_ents * sizeof(*ents));
+            memfree(old);
+        }
+    }
+
+    e = &ents[nr_ents++];
+    snprintf(e->title, sizeof(e->title), "%s", title);
+    e->track = track;
+    e->type = type;
+    e->count = 0;
+    return e;
+}
+
+void learn_load(const char *path, const char *title)
+{
+    char line[256], t[128], f[128], *p;
+    unsigned int track, count;
+    int type;
+    FILE *fp;
+
+    /* Loaded again once a disk's title is identified. */
+    memfree(learn_path);
+    memfree(learn_title);
+    nr_ents = 0;
+
+    learn_path = memalloc(strlen(path) + 1);
+    strcpy(learn_path, path);
+    learn_title = memalloc(strlen(title) + 1);
+    strcpy(learn_title, title);
+    /* Quoted format specifiers may contain whitespace: not in the sidecar. */
+    for (p = learn_title; *p != '\0'; p++)
+        if (isspace((unsigned char)*p))
+            *p = '_';
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((line[0] == '#')
+            || (sscanf(line, "%127s %u %127s %u", t, &track, f, &count) != 4))
+            continue;
+        /* Formats unknown to this build are silently dropped. */
+        if ((type = disk_get_format_by_id_name(f)) < 0)
+            continue;
+        add_ent(t, track, type)->count = count;
+    }
+
+    fclose(fp);
+}
+
+void learn_reorder(
+    struct format_list *list, struct format_cursor *cur, unsigned int track)
+{
+    struct learn_ent *e;
+    uint32_t best = 0;
+    unsigned int i;
+
+    if (learn_path == NULL)
+        return;
+
+    for (i = 0; i < list->nr; i++) {
+        e = find_ent(learn_title, track, list->ent[i]);
+        if ((e != NULL) && (e->count > best)) {
+            best = e->count;
+            cur->pos[list->idx] = i;
+        }
+    }
+}
+
+void learn_update(unsigned int track, unsigned int type)
+{
+    struct learn_ent *e;
+
+    if (learn_path == NULL)
+        return;
+
+    if ((e = find_ent(learn_title, track, type)) == NULL)
+        e = add_ent(learn_title, track, type);
+    if (e->count != UINT32_MAX)
+        e->count++;
+}
+
+void learn_save(void)
+{
+    char *tmp;
+    unsigned int i;
+    FILE *fp;
+
+    if (learn_path == NULL)
+        return;
+
+    /* Write a temporary file and rename it into place, so that an
+     * interrupted run never leaves a truncated sidecar. */
+    tmp = memalloc(strlen(learn_path) + 5);
+    sprintf(tmp, "%s.tmp", learn_path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        warn("Unable to write learned format order to %s", tmp);
+        goto out;
+    }
+    fprintf(fp, "# disk-analyse learned format order: "
+            "title track format count\n");
+    for (i = 0; i < nr_ents; i++)
+        fprintf(fp, "%s %u %s %u\n", ents[i].title, ents[i].track,
+                disk_get_format_id_name(ents[i].type), ents[i].count);
+    if ((fclose(fp) != 0) || (rename(tmp, learn_path) != 0)) {
+        warn("Unable to write learned format order to %s", learn_path);
+        (void)remove(tmp);
+    }
+
+out:
+    memfree(tmp);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,174 @@
+/*
+ * disk-analyse/report.c
+ *
+ * Per-track report for --report: one JSON object per line (NDJSON), written
+ * as each track's analysis finishes, for consumption by other tools.
+ *
+ *  {"track": "<cyl>.<head>", "tracknr": N, "format": "<handler id>",
+ *   "name": "<format name>", "unidentified": bool, "journal": bool,
+ *   "nr_sectors": N, "valid_sectors": N, "sector_map": "<hex>",
+ *   "total_bits": N, "data_bitoff": N, "nsecs": N,
+ *   "pll": {"period_adj": PCT, "phase_adj": PCT},
+ *   "lock": [{"rev": N, "flux": N, "mean_phase_err": N, "max_phase_err": N,
+ *             "phase_hist": [N, N, N, N], "resyncs": N, "clamps": N,
+ *             "max_drift": N}, ...]}
+ *
+ * sector_map is the valid-sector bitmap, most significant bit of the first
+ * byte first: sector 0 is valid if the first hex digit is 8 or more. nsecs is
+ * the time taken to analyse the track. A track retried by --pll-auto is
+ * reported again, with the settings which improved it: the later line wins.
+ *
+ * lock is the PLL's lock quality over each revolution of the final decode of
+ * the track (see struct stream_pll_stats): phase errors and drift in ns, the
+ * histogram in eighths of a bitcell. It is empty for tracks which were not
+ * decoded (journal or cache replays) or have no flux. With --verbose, the
+ * revolutions are summarised on stdout.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <libdisk/stream.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#include "common.h"
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *report_fp;
+static const char *report_path;
+
+void report_open(const char *path)
+{
+    report_path = path;
+    if (!strcmp(path, "-"))
+        report_fp = stdout;
+    else if ((report_fp = fopen(path, "w")) == NULL)
+        err(1, "Unable to create report %s", path);
+}
+
+static void put_str(char *p, size_t size, const char *s)
+{
+    char *end = p + size - 1;
+
+    for (; *s && (p < end - 1); s++) {
+        if ((*s == '"') || (*s == '\\'))
+            *p++ = '\\';
+        else if ((uint8_t)*s < 0x20)
+            continue;
+        *p++ = *s;
+    }
+    *p = '\0';
+}
+
+/* PLL lock quality over the revolutions of the track's decode, as JSON into
+ * @p, and summarised on stdout if verbose. */
+static void put_lock(char *p, size_t size, const struct stream *s,
+                     unsigned int tracknr, int replayed)
+{
+    const struct stream_pll_rev *r;
+    struct stream_pll_rev t = { 0 };
+    unsigned int i, n = 0;
+    char *q = p;
+
+    q += snprintf(q, size, "[");
+    for (i = 0; !replayed && (i < STREAM_PLL_REVS); i++) {
+        r = &s->pll_stats->rev[i];
+        if (r->nr_flux == 0)
+            continue;
+        q += snprintf(q, size - (q - p),
+                      "%s{\"rev\": %u, \"flux\": %u, "
+                      "\"mean_phase_err\": %u, \"max_phase_err\": %u, "
+                      "\"phase_hist\": [%u, %u, %u, %u], "
+                      "\"resyncs\": %u, \"clamps\": %u, "
+                      "\"max_drift\": %u}",
+                      n++ ? ", " : "", i, r->nr_flux,
+                      r->phase_err / r->nr_flux, r->max_phase_err,
+                      r->phase_hist[0], r->phase_hist[1],
+                      r->phase_hist[2], r->phase_hist[3],
+                      r->resyncs, r->clamps, r->max_drift);
+        t.nr_flux += r->nr_flux;
+        t.phase_err += r->phase_err;
+        t.max_phase_err = max(t.max_phase_err, r->max_phase_err);
+        t.phase_hist[3] += r->phase_hist[3];
+        t.resyncs += r->resyncs;
+        t.clamps += r->clamps;
+        t.max_drift = max(t.max_drift, r->max_drift);
+    }
+    snprintf(q, size - (q - p), "]");
+
+    if (verbose && t.nr_flux)
+        printf("T%u.%u: PLL lock over %u revs: phase err mean %u max %u ns, "
+               "%u%% beyond 3/8 cell, %u resyncs, %u clamps, "
+               "drift %u ns\n", tracknr/2, tracknr&1, n,
+               t.phase_err / t.nr_flux, t.max_phase_err,
+               t.phase_hist[3] * 100 / t.nr_flux, t.resyncs, t.clamps,
+               t.max_drift);
+}
+
+void report_track(struct disk *d, unsigned int tracknr, struct stream *s,
+                  int unidentified, int replayed, uint64_t nsecs)
+{
+    struct track_info *ti = &disk_get_info(d)->track[tracknr];
+    char name[128], ename[2*sizeof(name)], map[2*sizeof(ti->valid_sectors)+1];
+    char lock[STREAM_PLL_REVS * 256 + 4];
+    unsigned int i, nr_valid;
+
+    if ((report_fp == NULL) && !verbose)
+        return;
+
+    put_lock(lock, sizeof(lock), s, tracknr, replayed);
+    if (report_fp == NULL)
+        return;
+
+    track_get_format_name(d, tracknr, name, sizeof(name));
+    put_str(ename, sizeof(ename), name);
+
+    nr_valid = nr_valid_sectors(ti);
+    for (i = 0; i < (ti->nr_sectors + 7) / 8; i++)
+        sprintf(&map[2*i], "%02x", ti->valid_sectors[i]);
+    map[2*i] = '\0';
+
+    /* One write per line, so that lines from workers do not interleave. */
+    pthread_mutex_lock(&report_lock);
+    fprintf(report_fp, "{\"track\": \"%u.%u\", \"tracknr\": %u, "
+            "\"format\": \"%s\", \"name\": \"%s\", "
+            "\"unidentified\": %s, \"journal\": %s, "
+            "\"nr_sectors\": %u, \"valid_sectors\": %u, "
+            "\"sector_map\": \"%s\", "
+            "\"total_bits\": %u, \"data_bitoff\": %u, "
+            "\"nsecs\": %"PRIu64", "
+            "\"pll\": {\"period_adj\": %d, \"phase_adj\": %d}, "
+            "\"lock\": %s}\n",
+            tracknr/2, tracknr&1, tracknr,
+            disk_get_format_id_name(ti->type), ename,
+            unidentified ? "true" : "false", replayed ? "true" : "false",
+            ti->nr_sectors, nr_valid, map,
+            ti->total_bits, ti->data_bitoff, nsecs,
+            s->pll_period_adj_pct, s->pll_phase_adj_pct, lock);
+    if (fflush(report_fp) != 0)
+        err(1, "%s", report_path);
+    pthread_mutex_unlock(&report_lock);
+}
+
+void report_close(void)
+{
+    if (report_fp == NULL)
+        return;
+
+    if (report_fp != stdout)
+        fclose(report_fp);
+    report_fp = NULL;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
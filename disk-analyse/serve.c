@@ -0,0 +1,275 @@
+/*
+ * disk-analyse/serve.c
+ *
+ * Server mode, for running many jobs without paying process startup for each:
+ * the server keeps the format database and support libraries loaded, and runs
+ * each job in a process forked from it.
+ *
+ * A job is a disk-analyse command line, run in a given directory. Its output
+ * is returned on the connection, followed by one byte of exit status:
+ *  Request:  <cwd>\0<arg>\0...<arg>\0\0
+ *  Response: <stdout and stderr of the job><status>
+ */
+
+#define _GNU_SOURCE /* struct ucred */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libdisk/disk.h>
+#include <libdisk/util.h>
+
+#if !defined(__MINGW32__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#include "common.h"
+
+#define MAX_REQUEST (64u << 10)
+
+#if !defined(__MINGW32__)
+
+static int socket_at(const char *path, struct sockaddr_un *addr)
+{
+    int fd;
+
+    if (strlen(path) >= sizeof(addr->sun_path))
+        errx(1, "Socket path too long: %s", path);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        err(1, "socket");
+    return fd;
+}
+
+/* Jobs run with the server's privileges: take them only from its own user.
+ * The socket is created private, but may be reached through a shared
+ * directory on systems which ignore socket permissions. */
+static int peer_is_owner(int conn)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return (getpeereid(conn, &uid, &gid) == 0) && (uid == geteuid());
+#endif
+}
+
+/* Finished jobs interrupt accept(), to be reaped without waiting for the next
+ * connection. */
+static void sigchld_handler(int signum)
+{
+}
+
+/* Read a request, and split it into the job's directory and arguments.
+ * argv[0] is left for the caller. Returns argc, or -1 on a bad request. */
+static int read_request(int fd, char **pcwd, char ***pargv)
+{
+    char *buf = memalloc(MAX_REQUEST), *p, **argv;
+    unsigned int len = 0, argc = 0;
+    ssize_t nr;
+
+    /* Up to and including the terminating empty string. */
+    while ((len < 2) || buf[len-1] || buf[len-2]) {
+        if (len == MAX_REQUEST)
+            goto fail;
+        if ((nr = read(fd, &buf[len], MAX_REQUEST - len)) <= 0)
+            goto fail;
+        len += nr;
+    }
+
+    for (p = buf; *p; p += strlen(p) + 1)
+        argc++;
+    if (argc < 1)
+        goto fail;
+
+    *pcwd = buf;
+    *pargv = argv = memalloc((argc + 1) * sizeof(*argv));
+    for (p = buf + strlen(buf) + 1, argc = 1; *p; p += strlen(p) + 1)
+        argv[argc++] = p;
+    return argc;
+
+fail:
+    memfree(buf);
+    return -1;
+}
+
+/* Connection handler, in its own process: runs the job in a child, so that
+ * it can report how the job exited. */
+static void serve_conn(int conn, int (*job)(int argc, char **argv))
+{
+    char *cwd, **argv;
+    uint8_t status = 0xff;
+    int argc, st;
+    pid_t pid;
+
+    if ((argc = read_request(conn, &cwd, &argv)) < 0)
+        goto out;
+    argv[0] = "disk-analyse";
+
+    if ((pid = fork()) < 0)
+        goto out;
+    if (pid == 0) {
+        if ((dup2(conn, 1) < 0) || (dup2(conn, 2) < 0))
+            _exit(0xff);
+        close(conn);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        if (chdir(cwd) != 0)
+            err(1, "%s", cwd);
+        exit(job(argc, argv));
+    }
+
+    if (waitpid(pid, &st, 0) == pid)
+        status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+
+out:
+    (void)write(conn, &status, 1);
+    close(conn);
+}
+
+void serve(const char *path, unsigned int nr_workers,
+           int (*job)(int argc, char **argv))
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    unsigned int nr_running = 0;
+    int fd, conn, rc;
+    mode_t mask;
+    pid_t pid;
+
+    fd = socket_at(path, &addr);
+
+    /* Replace a stale socket from an earlier server, but nothing else. */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            errx(1, "%s: Exists and is not a socket", path);
+        (void)unlink(path);
+    }
+
+    /* Only our own user may connect. */
+    mask = umask(077);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc != 0)
+        err(1, "%s", path);
+    if (listen(fd, 16) != 0)
+        err(1, "%s", path);
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NOCLDSTOP; /* no SA_RESTART: interrupt accept() */
+    if (sigaction(SIGCHLD, &sa, NULL) != 0)
+        err(1, "sigaction");
+    if (!quiet)
+        printf("Serving jobs on %s, up to %u at once\n", path, nr_workers);
+    fflush(stdout);
+
+    for (;;) {
+        /* Reap finished jobs, waiting for one if all workers are busy. */
+        while ((nr_running != 0)
+               && ((pid = waitpid(-1, NULL, (nr_running < nr_workers)
+                                  ? WNOHANG : 0)) > 0))
+            nr_running--;
+
+        if ((conn = accept(fd, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            err(1, "%s", path);
+        }
+
+        if (!peer_is_owner(conn)) {
+            warnx("%s: Refused a connection from another user", path);
+            close(conn);
+            continue;
+        }
+
+        if ((pid = fork()) < 0) {
+            warn("fork");
+            close(conn);
+            continue;
+        }
+        if (pid == 0) {
+            close(fd);
+            signal(SIGCHLD, SIG_DFL);
+            serve_conn(conn, job);
+            _exit(0);
+        }
+        nr_running++;
+        close(conn);
+    }
+}
+
+int serve_connect(const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char cwd[4096], buf[4096];
+    int fd, i, held = -1;
+    ssize_t nr;
+
+    fd = socket_at(path, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        err(1, "%s", path);
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        err(1, "getcwd");
+    write_exact(fd, cwd, strlen(cwd) + 1);
+    for (i = 1; i < argc; i++)
+        write_exact(fd, argv[i], strlen(argv[i]) + 1);
+    write_exact(fd, "", 1);
+
+    /* Relay the job's output, holding back the final (status) byte. */
+    while ((nr = read(fd, buf, sizeof(buf))) > 0) {
+        if (held >= 0)
+            putchar(held);
+        fwrite(buf, 1, nr - 1, stdout);
+        held = (uint8_t)buf[nr-1];
+    }
+    close(fd);
+
+    if (held < 0)
+        errx(1, "%s: Connection closed by server", path);
+    return held;
+}
+
+#else /* defined(__MINGW32__) */
+
+void serve(const char *path, unsigned int nr_workers,
+           int (*job)(int argc, char **argv))
+{
+    errx(1, "Server mode is not supported on this platform");
+}
+
+int serve_connect(const char *path, int argc, char **argv)
+{
+    errx(1, "Server mode is not supported on this platform");
+}
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,203 @@
+/*
+ * disk-diff.c
+ *
+ * Compare two disk images track by track, at the level of raw bitcells. Each
+ * pair of tracks is first aligned at its best rotation, so that images which
+ * differ only in where their tracks start relative to the index compare
+ * identical.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+
+#define DEFAULT_GAP 64
+
+static int quiet, verbose;
+static unsigned int gap = DEFAULT_GAP;
+
+/* Bitcell @i of mask @m. */
+static int mask_bit(const uint8_t *m, uint32_t i)
+{
+    return (m[i >> 3] >> (~i & 7)) & 1;
+}
+
+/* List the runs of differing bitcells in @diff, merging those less than @gap
+ * apart. Returns the number of runs. */
+static unsigned int list_regions(const uint8_t *diff, uint32_t len)
+{
+    uint32_t i, start = 0, end = 0, nr_bits = 0;
+    unsigned int nr = 0;
+    uint64_t w;
+
+    for (i = 0; i < len; i++) {
+        /* Whole words of matching bitcells are skipped at once. */
+        if (!(i & 63)) {
+            memcpy(&w, &diff[i >> 3], 8);
+            if (w == 0) {
+                i += 63;
+                continue;
+            }
+        }
+        if (!mask_bit(diff, i))
+            continue;
+        if (nr && (i - end < gap)) {
+            end = i + 1;
+            nr_bits++;
+            continue;
+        }
+        if (nr && verbose)
+            printf("  %u-%u: %u bits\n", start, end - 1, nr_bits);
+        nr++;
+        start = i;
+        end = i + 1;
+        nr_bits = 1;
+    }
+    if (nr && verbose)
+        printf("  %u-%u: %u bits\n", start, end - 1, nr_bits);
+
+    return nr;
+}
+
+/* Returns non-zero if the tracks differ. */
+static int diff_track(struct disk_info *ia, struct track_raw *a,
+                      struct disk_info *ib, struct track_raw *b,
+                      unsigned int tracknr)
+{
+    struct track_info *ta = &ia->track[tracknr], *tb = &ib->track[tracknr];
+    uint32_t nr_diff, rot, len, nr_regions;
+    uint8_t *diff;
+
+    if ((ta->type == TRKTYP_unformatted) && (tb->type == TRKTYP_unformatted)) {
+        if (!quiet)
+            printf("T%u.%u: Unformatted\n", tracknr/2, tracknr&1);
+        return 0;
+    }
+
+    track_read_raw(a, tracknr);
+    track_read_raw(b, tracknr);
+    nr_diff = track_raw_align(a, b, &rot, &diff);
+    len = min(a->bitlen, b->bitlen);
+
+    if ((nr_diff == 0) && (a->bitlen == b->bitlen)) {
+        if (!quiet)
+            printf("T%u.%u: Identical (%s, rotation %u)\n",
+                   tracknr/2, tracknr&1, ta->typename, rot);
+        memfree(diff);
+        return 0;
+    }
+
+    printf("T%u.%u: %u of %u bits differ", tracknr/2, tracknr&1,
+           nr_diff, len);
+    if (a->bitlen != b->bitlen)
+        printf(", lengths %u/%u", a->bitlen, b->bitlen);
+    printf(", rotation %u", rot);
+    if (ta->type != tb->type)
+        printf(", formats %s/%s", ta->typename, tb->typename);
+    else
+        printf(", %s", ta->typename);
+    if (a->has_weak_bits || b->has_weak_bits)
+        printf(", weak bits");
+    if (verbose)
+        printf("\n");
+    nr_regions = list_regions(diff, len);
+    if (!verbose)
+        printf(", %u region%s\n", nr_regions, (nr_regions == 1) ? "" : "s");
+
+    memfree(diff);
+    return 1;
+}
+
+static void usage(int rc)
+{
+    printf("Usage: disk-diff [options] <image_a> <image_b>\n");
+    printf("Options:\n");
+    printf("  -h, --help     Display this information\n");
+    printf("  -q, --quiet    Report only the tracks which differ\n");
+    printf("  -v, --verbose  List each region of differing bits\n");
+    printf("  -g, --gap=N    Merge regions less than N bits apart (%u)\n",
+           DEFAULT_GAP);
+    printf("Exits with status 1 if any track differs.\n");
+    exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+    struct disk *da, *db;
+    struct disk_info *ia, *ib;
+    struct track_raw *a, *b;
+    unsigned int i, nr_tracks, nr_differ = 0;
+    int ch, rc;
+
+    const static char sopts[] = "hqvg:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "quiet", 0, NULL, 'q' },
+        { "verbose", 0, NULL, 'v' },
+        { "gap", 1, NULL, 'g' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'g':
+            gap = atoi(optarg);
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (argc != optind + 2)
+        usage(1);
+
+    if ((da = disk_open(argv[optind], DISKFL_read_only)) == NULL)
+        errx(1, "Unable to open disk '%s'", argv[optind]);
+    if ((db = disk_open(argv[optind+1], DISKFL_read_only)) == NULL)
+        errx(1, "Unable to open disk '%s'", argv[optind+1]);
+    ia = disk_get_info(da);
+    ib = disk_get_info(db);
+    a = track_alloc_raw_buffer(da);
+    b = track_alloc_raw_buffer(db);
+
+    nr_tracks = min(ia->nr_tracks, ib->nr_tracks);
+    for (i = 0; i < nr_tracks; i++)
+        nr_differ += diff_track(ia, a, ib, b, i);
+    rc = (nr_differ != 0) || (ia->nr_tracks != ib->nr_tracks);
+    if (!quiet || rc)
+        printf("%u of %u tracks differ", nr_differ, nr_tracks);
+    if (ia->nr_tracks != ib->nr_tracks)
+        printf(", track counts %u/%u", ia->nr_tracks, ib->nr_tracks);
+    if (!quiet || rc)
+        printf("\n");
+
+    track_free_raw_buffer(a);
+    track_free_raw_buffer(b);
+    disk_close(da);
+    disk_close(db);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
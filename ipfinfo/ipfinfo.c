@@ -6,6 +6,7 @@
  * Written in 2011 by Keir Fraser
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,12 +15,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 #include <libdisk/util.h>
 
 /* read_exact, write_exact */
 #include "../libdisk/util.c"
 
-static int fd;
+static int summary;
 
 static int nr_blocks[256];
 
@@ -97,172 +102,274 @@ struct ipf_block {
     /* code is 0=end,1=sync,2=data,3=gap,4=raw,5=flakey */
 };
 
+/* Records are decoded in place from the mapped file, which is big endian and
+ * not necessarily longword aligned. */
+static uint32_t get_be32(const void *p)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return be32toh(x);
+}
+
+#define FIELD(p, type, field) \
+    get_be32((const char *)(p) + offsetof(struct type, field))
+
 static uint32_t encoder;
 
-static void decode_info(const void *_info, unsigned int size)
+static void decode_info(const void *info, unsigned int size)
 {
-    const struct ipf_info *info = _info;
-    if (size != sizeof(*info))
+    uint32_t date, time;
+    if (size != sizeof(struct ipf_info))
         errx(1, "INFO size mismatch");
-    encoder = info->encoder;
+    encoder = FIELD(info, ipf_info, encoder);
     if ((encoder < 1) || (encoder > 2))
         errx(1, "Unknown encoder type (%u)", encoder);
-    printf("Type:      %u\n", info->type);
-    printf("Encoder:   %u\n", info->encoder);
-    printf("EncRev:    %u\n", info->encrev);
-    printf("Release:   %u\n", info->release);
-    printf("Revision:  %u\n", info->revision);
-    printf("Origin:    %08x\n", info->origin);
-    printf("MinCyl:    %u\n", info->mincylinder);
-    printf("MaxCyl:    %u\n", info->maxcylinder);
-    printf("MinHead:   %u\n", info->minhead);
-    printf("MaxHead:   %u\n", info->maxhead);
-    printf("Date:      %u/%u/%u\n", info->date/10000,
-           (info->date/100)%100, (info->date)%100);
+    printf("Type:      %u\n", FIELD(info, ipf_info, type));
+    printf("Encoder:   %u\n", encoder);
+    printf("EncRev:    %u\n", FIELD(info, ipf_info, encrev));
+    printf("Release:   %u\n", FIELD(info, ipf_info, release));
+    printf("Revision:  %u\n", FIELD(info, ipf_info, revision));
+    printf("Origin:    %08x\n", FIELD(info, ipf_info, origin));
+    printf("MinCyl:    %u\n", FIELD(info, ipf_info, mincylinder));
+    printf("MaxCyl:    %u\n", FIELD(info, ipf_info, maxcylinder));
+    printf("MinHead:   %u\n", FIELD(info, ipf_info, minhead));
+    printf("MaxHead:   %u\n", FIELD(info, ipf_info, maxhead));
+    date = FIELD(info, ipf_info, date);
+    printf("Date:      %u/%u/%u\n", date/10000, (date/100)%100, date%100);
+    time = FIELD(info, ipf_info, time);
     printf("Time:      %u:%u:%u:%u\n",
-           (info->time)/10000000,
-           (info->time/100000)%100,
-           (info->time/1000)%100,
-           (info->time)%1000);
+           time/10000000,
+           (time/100000)%100,
+           (time/1000)%100,
+           time%1000);
     printf("Platform:  %u/%u/%u/%u\n",
-           info->platform[0],
-           info->platform[1],
-           info->platform[2],
-           info->platform[3]);
-    printf("DiskNum:   %u\n", info->disknum);
-    printf("UserId:    %u\n", info->userid);
+           FIELD(info, ipf_info, platform[0]),
+           FIELD(info, ipf_info, platform[1]),
+           FIELD(info, ipf_info, platform[2]),
+           FIELD(info, ipf_info, platform[3]));
+    printf("DiskNum:   %u\n", FIELD(info, ipf_info, disknum));
+    printf("UserId:    %u\n", FIELD(info, ipf_info, userid));
     printf("Rsvd:      %u/%u/%u\n",
-           info->reserved[0],
-           info->reserved[1],
-           info->reserved[2]);
+           FIELD(info, ipf_info, reserved[0]),
+           FIELD(info, ipf_info, reserved[1]),
+           FIELD(info, ipf_info, reserved[2]));
 }
 
-static void decode_img(const void *_img, unsigned int size)
+static void decode_img(const void *img, unsigned int size)
 {
-    const struct ipf_img *img = _img;
-    if (size != sizeof(*img))
+    if (size != sizeof(struct ipf_img))
         errx(1, "IMGE size mismatch");
-    printf("Cylinder:  %u\n", img->cylinder);
-    printf("Head:      %u\n", img->head);
-    printf("DensiTyp:  %u\n", img->dentype);
-    printf("SigTyp:    %u\n", img->sigtype);
-    printf("TrackSize: %u\n", img->trksize);
-    printf("StartPos:  %u\n", img->startpos);
-    printf("StartBit:  %u\n", img->startbit);
-    printf("DataBits:  %u\n", img->databits);
-    printf("GapBits:   %u\n", img->gapbits);
-    printf("TrkBits:   %u\n", img->trkbits);
-    printf("BlkCnt:    %u\n", img->blkcnt);
-    printf("Process:   %u\n", img->process);
-    printf("Flag:      %u\n", img->flag);
-    printf("DatChunk:  %u\n", img->dat_chunk);
+    printf("Cylinder:  %u\n", FIELD(img, ipf_img, cylinder));
+    printf("Head:      %u\n", FIELD(img, ipf_img, head));
+    printf("DensiTyp:  %u\n", FIELD(img, ipf_img, dentype));
+    printf("SigTyp:    %u\n", FIELD(img, ipf_img, sigtype));
+    printf("TrackSize: %u\n", FIELD(img, ipf_img, trksize));
+    printf("StartPos:  %u\n", FIELD(img, ipf_img, startpos));
+    printf("StartBit:  %u\n", FIELD(img, ipf_img, startbit));
+    printf("DataBits:  %u\n", FIELD(img, ipf_img, databits));
+    printf("GapBits:   %u\n", FIELD(img, ipf_img, gapbits));
+    printf("TrkBits:   %u\n", FIELD(img, ipf_img, trkbits));
+    printf("BlkCnt:    %u\n", FIELD(img, ipf_img, blkcnt));
+    printf("Process:   %u\n", FIELD(img, ipf_img, process));
+    printf("Flag:      %u\n", FIELD(img, ipf_img, flag));
+    printf("DatChunk:  %u\n", FIELD(img, ipf_img, dat_chunk));
     printf("Rsvd:      %u/%u/%u\n",
-           img->reserved[0],
-           img->reserved[1],
-           img->reserved[2]);
-    nr_blocks[img->dat_chunk] = img->blkcnt;
+           FIELD(img, ipf_img, reserved[0]),
+           FIELD(img, ipf_img, reserved[1]),
+           FIELD(img, ipf_img, reserved[2]));
+    nr_blocks[(uint8_t)FIELD(img, ipf_img, dat_chunk)] =
+        FIELD(img, ipf_img, blkcnt);
 }
 
-static void decode_data(unsigned char *data, const char *name, uint32_t off)
+static void decode_data(
+    const unsigned char *data, uint32_t size, const char *name, uint32_t off)
 {
     unsigned int i;
     if (!off)
         return;
+    if ((off > size) || (size - off < 16))
+        errx(1, "%s offset %u beyond data area", name, off);
     printf("%s: ", name);
     for (i = off; i < (off+16); i++)
         printf("%02x ", data[i]);
     printf("\n");
 }
 
-static void decode_block(void *_blk, void *data)
+static void decode_block(
+    const void *blk, const unsigned char *data, uint32_t size)
 {
-    struct ipf_block *blk = _blk;
-    unsigned int i;
-    for (i = 0; i < sizeof(struct ipf_block)/4; i++)
-        ((uint32_t *)blk)[i] = be32toh(((uint32_t *)blk)[i]);
-    printf("BlockBits: %u\n", blk->blockbits);
-    printf("GapBits:   %u\n", blk->gapbits);
+    uint32_t flag = FIELD(blk, ipf_block, flag);
+    uint32_t dataoffset = FIELD(blk, ipf_block, dataoffset);
+    printf("BlockBits: %u\n", FIELD(blk, ipf_block, blockbits));
+    printf("GapBits:   %u\n", FIELD(blk, ipf_block, gapbits));
     if (encoder == 1) { /* CAPS */
-        printf("BlockSize: %u\n", blk->u.caps.blocksize);
-        printf("GapSize:   %u\n", blk->u.caps.gapsize);
+        printf("BlockSize: %u\n", FIELD(blk, ipf_block, u.caps.blocksize));
+        printf("GapSize:   %u\n", FIELD(blk, ipf_block, u.caps.gapsize));
     } else { /* SPS */
-        printf("GapOffset: %u\n", blk->u.sps.gapoffset);
-        printf("CellType:  %u\n", blk->u.sps.celltype);
+        printf("GapOffset: %u\n", FIELD(blk, ipf_block, u.sps.gapoffset));
+        printf("CellType:  %u\n", FIELD(blk, ipf_block, u.sps.celltype));
     }
-    printf("EncType:   %u\n", blk->enctype);
-    printf("BlkFlag:   %u\n", blk->flag);
-    printf("GapValue:  %u\n", blk->gapvalue);
-    printf("DataOffs:  %u\n", blk->dataoffset);
-    if ((encoder == 2) && (blk->flag & 3))
-        decode_data(data, "GAP", blk->u.sps.gapoffset);
-    decode_data(data, "DAT", blk->dataoffset);
+    printf("EncType:   %u\n", FIELD(blk, ipf_block, enctype));
+    printf("BlkFlag:   %u\n", flag);
+    printf("GapValue:  %u\n", FIELD(blk, ipf_block, gapvalue));
+    printf("DataOffs:  %u\n", dataoffset);
+    if ((encoder == 2) && (flag & 3))
+        decode_data(data, size, "GAP", FIELD(blk, ipf_block, u.sps.gapoffset));
+    decode_data(data, size, "DAT", dataoffset);
 }
 
-static void decode_dat(void *_dat, unsigned int size)
+/* The data area follows the DATA record: @data is the rest of the file, of
+ * which @avail bytes are mapped. Returns the size of the data area. */
+static uint32_t decode_dat(
+    const void *dat, unsigned int size,
+    const unsigned char *data, size_t avail)
 {
-    uint32_t crc;
-    unsigned char *data;
+    uint32_t dsize, dcrc, dat_chunk;
     unsigned int i;
-    struct ipf_data *dat = _dat;
-    if (size != sizeof(*dat))
+    if (size != sizeof(struct ipf_data))
         errx(1, "DATA size mismatch");
-    printf("Size:      %u\n", dat->size);
-    printf("BSize:     %u\n", dat->bsize);
-    printf("DCRC:      %08x\n", dat->dcrc);
-    printf("DatChunk:  %u\n", dat->dat_chunk);
-    data = malloc(dat->size);
-    read_exact(fd, data, dat->size);
-    crc = crc32(data, dat->size);
-    if (dat->dcrc != crc)
+    dsize = FIELD(dat, ipf_data, size);
+    if (dsize > avail)
+        errx(1, "DATA area beyond end of file");
+    if (summary)
+        return dsize;
+    dcrc = FIELD(dat, ipf_data, dcrc);
+    dat_chunk = FIELD(dat, ipf_data, dat_chunk);
+    printf("Size:      %u\n", dsize);
+    printf("BSize:     %u\n", FIELD(dat, ipf_data, bsize));
+    printf("DCRC:      %08x\n", dcrc);
+    printf("DatChunk:  %u\n", dat_chunk);
+    if (dcrc != crc32(data, dsize))
         errx(1, "Data CRC mismatch");
-    for (i = 0; i < nr_blocks[dat->dat_chunk]; i++) {
+    dat_chunk = (uint8_t)dat_chunk;
+    if (nr_blocks[dat_chunk] > dsize / sizeof(struct ipf_block))
+        errx(1, "Block descriptors beyond data area");
+    for (i = 0; i < nr_blocks[dat_chunk]; i++) {
         printf("BLK %u\n", i);
-        decode_block((char *)data + i*32, data);
+        decode_block(data + i*sizeof(struct ipf_block), data, dsize);
+    }
+    return dsize;
+}
+
+struct file_map {
+    unsigned char *dat;
+    size_t len;
+    int mapped;
+};
+
+static void map_file(struct file_map *m, const char *name)
+{
+    off_t sz;
+    int fd;
+
+    fd = file_open(name, O_RDONLY);
+    if (fd == -1)
+        err(1, "%s", name);
+    if ((sz = lseek(fd, 0, SEEK_END)) < 0)
+        err(1, NULL);
+    m->len = sz;
+
+#if !defined(__MINGW32__)
+    if (m->len != 0) {
+        m->dat = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m->dat != MAP_FAILED) {
+            m->mapped = 1;
+            close(fd);
+            return;
+        }
     }
-    free(data);
+#endif
+
+    m->dat = memalloc(m->len);
+    m->mapped = 0;
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        err(1, NULL);
+    read_exact(fd, m->dat, m->len);
+    close(fd);
+}
+
+static void unmap_file(struct file_map *m)
+{
+#if !defined(__MINGW32__)
+    if (m->mapped)
+        munmap(m->dat, m->len);
+    else
+#endif
+        memfree(m->dat);
+}
+
+static void usage(int rc)
+{
+    printf("Usage: ipfinfo [options] <filename>\n");
+    printf("Options:\n");
+    printf("  -h, --help     Display this information\n");
+    printf("  -s, --summary  Skip decode of DATA records and their blocks\n");
+    exit(rc);
 }
 
 int main(int argc, char **argv)
 {
-    struct ipf_header hdr;
-    char *payload;
+    static const uint8_t zero[4];
+    struct file_map m;
+    const unsigned char *p;
     char name[5] = { 0 };
-    uint32_t crc, i, plen;
+    uint32_t crc, hcrc, len, plen;
+    size_t off = 0;
+    int ch;
 
-    if (argc != 2)
-        errx(1, "Usage: ipfinfo <filename>");
+    const static char sopts[] = "hs";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "summary", 0, NULL, 's' },
+        { 0, 0, 0, 0 }
+    };
 
-    fd = file_open(argv[1], O_RDONLY);
-    if (fd == -1)
-        err(1, "%s", argv[1]);
-
-    for (;;) {
-        read_exact(fd, &hdr, sizeof(hdr));
-        if (hdr.id[0] == '\0')
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 's':
+            summary = 1;
             break;
-        crc = be32toh(hdr.crc);
-        hdr.crc = 0;
-        hdr.crc = crc32(&hdr, sizeof(hdr));
-        hdr.len = be32toh(hdr.len);
-        payload = malloc(hdr.len);
-        plen = hdr.len - sizeof(hdr);
-        read_exact(fd, payload, plen);
-        hdr.crc = crc32_add(payload, plen, hdr.crc);
-        strncpy(name, (char *)hdr.id, 4);
-        printf("ID=%s len=%u crc=%08x\n", name, hdr.len, hdr.crc);
-        if (hdr.crc != crc)
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (argc != optind + 1)
+        usage(1);
+
+    map_file(&m, argv[optind]);
+
+    /* A truncated header reads as zeroes, ending the walk. */
+    while ((m.len - off >= sizeof(struct ipf_header)) && m.dat[off]) {
+        p = m.dat + off;
+        len = FIELD(p, ipf_header, len);
+        if ((len < sizeof(struct ipf_header)) || (len > m.len - off))
+            errx(1, "Bad record length %u", len);
+        plen = len - sizeof(struct ipf_header);
+        /* The header CRC field counts as zero. */
+        hcrc = FIELD(p, ipf_header, crc);
+        crc = crc32(p, offsetof(struct ipf_header, crc));
+        crc = crc32_add(zero, sizeof(zero), crc);
+        crc = crc32_add(p + sizeof(struct ipf_header), plen, crc);
+        memcpy(name, p, 4);
+        printf("ID=%s len=%u crc=%08x\n", name, len, crc);
+        if (hcrc != crc)
             errx(1, "CRC mismatch");
-        for (i = 0; i < plen/4; i++)
-            ((uint32_t *)payload)[i] = be32toh(((uint32_t *)payload)[i]);
+        p += sizeof(struct ipf_header);
+        off += len;
         if (!strcmp(name, "INFO"))
-            decode_info(payload, plen);
+            decode_info(p, plen);
         if (!strcmp(name, "IMGE"))
-            decode_img(payload, plen);
+            decode_img(p, plen);
         if (!strcmp(name, "DATA"))
-            decode_dat(payload, plen);
-        free(payload);
+            off += decode_dat(p, plen, m.dat + off, m.len - off);
     }
 
+    unmap_file(&m);
     return 0;
 }
 
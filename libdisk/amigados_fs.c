@@ -0,0 +1,508 @@
+/*
+ * libdisk/amigados_fs.c
+ *
+ * Read-only AmigaDOS (OFS/FFS) filesystem access.
+ */
+
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <libdisk/amigados_fs.h>
+#include <stdarg.h>
+
+#define BYTES_PER_BLOCK  ADOS_BLOCK_SIZE
+#define BLOCKS_PER_TRACK 11
+#define TRACKS_PER_DISK  160
+#define HASH_SIZE        (BYTES_PER_BLOCK/4-56)
+
+struct ffs_datestamp {
+    uint32_t days, mins, ticks;
+};
+
+struct ffs_root_block {
+    uint32_t type;
+    uint32_t header_key;
+    uint32_t max_seq;
+    uint32_t hash_size;
+    uint32_t mbz_0;
+    uint32_t checksum;
+    uint32_t hash[HASH_SIZE];
+    uint32_t bitmap_flag;
+    uint32_t bitmap_keys[25];
+    uint32_t bitmap_extended;
+    struct ffs_datestamp root_altered_datestamp;
+    uint8_t disk_name[40];
+    struct ffs_datestamp disk_altered_datestamp;
+    struct ffs_datestamp disk_made_datestamp;
+    uint32_t mbz_1[3];
+    uint32_t subtype;
+};
+
+struct ffs_dir {
+    uint32_t type;
+    uint32_t header_key;
+    uint32_t mbz_0[3];
+    uint32_t checksum;
+    uint32_t hash[HASH_SIZE];
+    uint32_t mbz_1[2];
+    uint32_t protection_bits;
+    uint32_t mbz_2[1];
+    uint8_t dir_comment[92];
+    struct ffs_datestamp datestamp;
+    uint8_t dir_name[36];
+    uint32_t mbz_3[7];
+    uint32_t hash_chain;
+    uint32_t parent;
+    uint32_t mbz_4[1];
+    uint32_t subtype;
+};
+
+struct ffs_fileheader {
+    uint32_t type;
+    uint32_t header_key;
+    uint32_t max_seq;
+    uint32_t mbz_0[1];
+    uint32_t first_data;
+    uint32_t checksum;
+    uint32_t data[HASH_SIZE];
+    uint32_t mbz_1[2];
+    uint32_t protection_bits;
+    uint32_t file_size;
+    uint8_t dir_comment[92];
+    struct ffs_datestamp datestamp;
+    uint8_t file_name[36];
+    uint32_t mbz_3[7];
+    uint32_t hash_chain;
+    uint32_t parent;
+    uint32_t extension;
+    uint32_t subtype;
+};
+
+#define T_HEADER     2
+#define T_LIST      16
+
+#define ST_ROOT      1
+#define ST_USERDIR   2
+#define ST_FILE     -3
+
+/* Longwords of allocation bitmap per bitmap block, after its checksum. */
+#define BITMAP_LONGS (BYTES_PER_BLOCK/4-1)
+
+struct ados_fs {
+    const uint8_t *image;
+    uint8_t *priv;      /* image copied from a disk, freed on close */
+    uint8_t *bad;       /* per-block flag: did not decode (or NULL) */
+    unsigned int nr_blocks, root;
+    bool_t is_ffs, is_intl;
+    char err[96];
+};
+
+static int fs_fail(struct ados_fs *fs, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(fs->err, sizeof(fs->err), fmt, ap);
+    va_end(ap);
+
+    errno = EINVAL;
+    return -1;
+}
+
+static const void *get_block(struct ados_fs *fs, uint32_t block)
+{
+    if (block >= fs->nr_blocks) {
+        fs_fail(fs, "Block index %u out of range", block);
+        return NULL;
+    }
+    if (fs->bad && fs->bad[block]) {
+        fs_fail(fs, "Block %u is unreadable", block);
+        return NULL;
+    }
+    return &fs->image[block * BYTES_PER_BLOCK];
+}
+
+static int checksum_block(struct ados_fs *fs, uint32_t block, const void *dat)
+{
+    const uint32_t *blk = dat;
+    uint32_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < BYTES_PER_BLOCK/4; i++)
+        sum += be32toh(blk[i]);
+
+    return sum ? fs_fail(fs, "Block %u: Bad block checksum %08x", block, sum)
+        : 0;
+}
+
+/* A checksummed header block of the given type, or NULL. */
+static const void *get_header(
+    struct ados_fs *fs, uint32_t block, uint32_t type)
+{
+    const struct ffs_dir *hdr = get_block(fs, block);
+
+    if (hdr == NULL)
+        return NULL;
+    if (be32toh(hdr->type) != type) {
+        fs_fail(fs, "Block %u: Not a %s block (type %08x)", block,
+                (type == T_HEADER) ? "header" : "list", be32toh(hdr->type));
+        return NULL;
+    }
+    return checksum_block(fs, block, hdr) ? NULL : hdr;
+}
+
+static time_t time_from_datestamp(const struct ffs_datestamp *stamp)
+{
+    time_t time = (time_t)(8*365+2)*24*60*60;
+    time += (time_t)be32toh(stamp->days)*24*60*60;
+    time += (time_t)be32toh(stamp->mins)*60;
+    time += (time_t)be32toh(stamp->ticks)/50;
+    return time;
+}
+
+static int get_name(struct ados_fs *fs, uint32_t block,
+                    const uint8_t *bcpl, char *name)
+{
+    if (bcpl[0] > ADOS_NAME_LEN)
+        return fs_fail(fs, "Block %u: Name too long", block);
+    memcpy(name, &bcpl[1], bcpl[0]);
+    name[bcpl[0]] = '\0';
+    return 0;
+}
+
+/* Fill in @ent from header block @block. */
+static int get_entry(struct ados_fs *fs, uint32_t block,
+                     struct ados_entry *ent)
+{
+    const struct ffs_fileheader *hdr = get_header(fs, block, T_HEADER);
+
+    if (hdr == NULL)
+        return -1;
+
+    memset(ent, 0, sizeof(*ent));
+    ent->block = block;
+    switch ((int)be32toh(hdr->subtype)) {
+    case ST_ROOT:
+    case ST_USERDIR:
+        ent->type = ADOS_DIR;
+        break;
+    case ST_FILE:
+        ent->type = ADOS_FILE;
+        ent->size = be32toh(hdr->file_size);
+        break;
+    default:
+        return fs_fail(fs, "Block %u: Unrecognised subtype %08x",
+                       block, be32toh(hdr->subtype));
+    }
+    ent->protection = be32toh(hdr->protection_bits);
+    ent->mtime = time_from_datestamp(&hdr->datestamp);
+    return get_name(fs, block, hdr->file_name, ent->name);
+}
+
+static int fs_toupper(struct ados_fs *fs, int c)
+{
+    c &= 0xff;
+    if (fs->is_intl && (c >= 0xe0) && (c <= 0xfe) && (c != 0xf7))
+        return c - 0x20;
+    return ((c >= 'a') && (c <= 'z')) ? c - 0x20 : c;
+}
+
+static unsigned int name_hash(
+    struct ados_fs *fs, const char *name, unsigned int len)
+{
+    uint32_t hash = len;
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash * 13 + fs_toupper(fs, name[i])) & 0x7ff;
+    return hash % HASH_SIZE;
+}
+
+static bool_t name_match(struct ados_fs *fs, const char *name,
+                         const char *p, unsigned int len)
+{
+    unsigned int i;
+
+    if (strlen(name) != len)
+        return 0;
+    for (i = 0; i < len; i++)
+        if (fs_toupper(fs, name[i]) != fs_toupper(fs, p[i]))
+            return 0;
+    return 1;
+}
+
+static struct ados_fs *fs_open(struct ados_fs *fs)
+{
+    const struct ffs_root_block *root;
+    const uint8_t *boot;
+
+    fs->root = fs->nr_blocks / 2;
+    if ((boot = get_block(fs, 0)) == NULL)
+        goto fail;
+    if (strncmp((const char *)boot, "DOS", 3) || (boot[3] > 7))
+        goto fail;
+    fs->is_ffs = boot[3] & 1;
+    fs->is_intl = (boot[3] & 6) != 0;
+
+    root = get_header(fs, fs->root, T_HEADER);
+    if ((root == NULL) ||
+        (be32toh(root->subtype) != ST_ROOT) ||
+        (be32toh(root->hash_size) != HASH_SIZE))
+        goto fail;
+
+    return fs;
+
+fail:
+    ados_fs_close(fs);
+    return NULL;
+}
+
+struct ados_fs *ados_fs_open_image(const void *dat, size_t len)
+{
+    struct ados_fs *fs;
+
+    if ((len < 4 * BYTES_PER_BLOCK) || (len % BYTES_PER_BLOCK))
+        return NULL;
+
+    fs = memalloc(sizeof(*fs));
+    fs->image = dat;
+    fs->nr_blocks = len / BYTES_PER_BLOCK;
+    return fs_open(fs);
+}
+
+struct ados_fs *ados_fs_open_disk(struct disk *d)
+{
+    struct disk_info *di = disk_get_info(d);
+    struct track_sectors *sectors;
+    struct ados_fs *fs;
+    unsigned int i, j;
+
+    fs = memalloc(sizeof(*fs));
+    fs->nr_blocks = TRACKS_PER_DISK * BLOCKS_PER_TRACK;
+    fs->image = fs->priv = memalloc(fs->nr_blocks * BYTES_PER_BLOCK);
+    fs->bad = memalloc(fs->nr_blocks);
+    memset(fs->bad, 1, fs->nr_blocks);
+
+    sectors = track_alloc_sector_buffer(d);
+    for (i = 0; i < min_t(unsigned int, di->nr_tracks, TRACKS_PER_DISK); i++) {
+        if ((track_read_sectors(sectors, i) != 0) ||
+            (sectors->nr_bytes != BLOCKS_PER_TRACK * BYTES_PER_BLOCK))
+            continue;
+        memcpy(&fs->priv[i * BLOCKS_PER_TRACK * BYTES_PER_BLOCK],
+               sectors->data, sectors->nr_bytes);
+        for (j = 0; j < BLOCKS_PER_TRACK; j++)
+            fs->bad[i * BLOCKS_PER_TRACK + j] =
+                !is_valid_sector(&di->track[i], j);
+    }
+    track_free_sector_buffer(sectors);
+
+    return fs_open(fs);
+}
+
+void ados_fs_close(struct ados_fs *fs)
+{
+    memfree(fs->priv);
+    memfree(fs->bad);
+    memfree(fs);
+}
+
+const char *ados_fs_error(struct ados_fs *fs)
+{
+    return fs->err;
+}
+
+int ados_fs_get_volume(struct ados_fs *fs, struct ados_volume *vol)
+{
+    const struct ffs_root_block *root = get_header(fs, fs->root, T_HEADER);
+
+    if (root == NULL)
+        return -1;
+
+    memset(vol, 0, sizeof(*vol));
+    vol->is_ffs = fs->is_ffs;
+    vol->is_intl = fs->is_intl;
+    vol->created = time_from_datestamp(&root->disk_made_datestamp);
+    vol->altered = time_from_datestamp(&root->disk_altered_datestamp);
+    return get_name(fs, fs->root, root->disk_name, vol->name);
+}
+
+int ados_fs_root(struct ados_fs *fs, struct ados_entry *ent)
+{
+    return get_entry(fs, fs->root, ent);
+}
+
+int ados_fs_lookup(struct ados_fs *fs, const char *path,
+                   struct ados_entry *ent)
+{
+    const struct ffs_dir *dir;
+    const char *p;
+    unsigned int len, steps;
+    uint32_t idx;
+
+    if (ados_fs_root(fs, ent))
+        return -1;
+
+    for (; *path != '\0'; path = p) {
+        if ((p = strchr(path, '/')) == NULL)
+            p = path + strlen(path);
+        len = p - path;
+        if (*p == '/')
+            p++;
+        if (len == 0)
+            continue;
+
+        if (ent->type != ADOS_DIR)
+            goto not_found;
+        if ((dir = get_header(fs, ent->block, T_HEADER)) == NULL)
+            return -1;
+
+        idx = be32toh(dir->hash[name_hash(fs, path, len)]);
+        for (steps = 0; idx != 0; steps++) {
+            const struct ffs_fileheader *hdr;
+            if (steps == fs->nr_blocks)
+                return fs_fail(fs, "Block %u: Hash chain loop", ent->block);
+            if (get_entry(fs, idx, ent))
+                return -1;
+            if (name_match(fs, ent->name, path, len))
+                break;
+            hdr = get_block(fs, idx);
+            idx = be32toh(hdr->hash_chain);
+        }
+        if (idx == 0)
+            goto not_found;
+    }
+
+    return 0;
+
+not_found:
+    snprintf(fs->err, sizeof(fs->err), "Not found");
+    errno = ENOENT;
+    return -1;
+}
+
+int ados_fs_read_dir(
+    struct ados_fs *fs, const struct ados_entry *dir,
+    int (*fn)(void *opaque, const struct ados_entry *), void *opaque)
+{
+    const struct ffs_dir *hdr;
+    const struct ffs_fileheader *file;
+    struct ados_entry ent;
+    unsigned int i, steps;
+    uint32_t idx;
+    int rc;
+
+    if (dir->type != ADOS_DIR)
+        return fs_fail(fs, "Block %u: Not a directory", dir->block);
+    if ((hdr = get_header(fs, dir->block, T_HEADER)) == NULL)
+        return -1;
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        idx = be32toh(hdr->hash[i]);
+        for (steps = 0; idx != 0; steps++) {
+            if (steps == fs->nr_blocks)
+                return fs_fail(fs, "Block %u: Hash chain loop", dir->block);
+            if (get_entry(fs, idx, &ent))
+                return -1;
+            file = get_block(fs, idx);
+            idx = be32toh(file->hash_chain);
+            if ((rc = (*fn)(opaque, &ent)) != 0)
+                return rc;
+        }
+    }
+
+    return 0;
+}
+
+int ados_fs_read_file(
+    struct ados_fs *fs, const struct ados_entry *file, void *buf)
+{
+    const struct ffs_fileheader *hdr;
+    const uint8_t *dat;
+    unsigned int todo, nxtblk, data_per_block, this_todo;
+    uint32_t idx = file->block;
+    uint8_t *p = buf;
+
+    if (file->type != ADOS_FILE)
+        return fs_fail(fs, "Block %u: Not a file", file->block);
+    if ((hdr = get_header(fs, idx, T_HEADER)) == NULL)
+        return -1;
+
+    data_per_block = fs->is_ffs ? BYTES_PER_BLOCK : BYTES_PER_BLOCK-24;
+
+    todo = file->size;
+    if (todo > fs->nr_blocks * data_per_block)
+        return fs_fail(fs, "Block %u: Bad file size %u", idx, todo);
+
+    for (nxtblk = 0; todo != 0; nxtblk++) {
+        if (nxtblk == HASH_SIZE) {
+            idx = be32toh(hdr->extension);
+            if ((hdr = get_header(fs, idx, T_LIST)) == NULL)
+                return -1;
+            if ((int)be32toh(hdr->subtype) != ST_FILE)
+                return fs_fail(fs, "Block %u: Bad file-ext block", idx);
+            nxtblk = 0;
+        }
+        idx = be32toh(hdr->data[HASH_SIZE-nxtblk-1]);
+        if ((dat = get_block(fs, idx)) == NULL)
+            return -1;
+        if (!fs->is_ffs && checksum_block(fs, idx, dat))
+            return -1;
+        this_todo = min(todo, data_per_block);
+        memcpy(p, &dat[fs->is_ffs ? 0 : 24], this_todo);
+        p += this_todo;
+        todo -= this_todo;
+    }
+
+    return 0;
+}
+
+int ados_fs_block_is_free(struct ados_fs *fs, unsigned int block)
+{
+    const struct ffs_root_block *root;
+    const uint32_t *map;
+    unsigned int idx, key;
+    uint32_t mapblk;
+
+    if ((block < 2) || (block >= fs->nr_blocks))
+        return fs_fail(fs, "Block index %u out of range", block);
+    idx = block - 2;
+    key = idx / (BITMAP_LONGS * 32);
+    idx %= BITMAP_LONGS * 32;
+
+    if ((root = get_header(fs, fs->root, T_HEADER)) == NULL)
+        return -1;
+    if (be32toh(root->bitmap_flag) != ~0u)
+        return fs_fail(fs, "Allocation bitmap is not valid");
+    if (key >= ARRAY_SIZE(root->bitmap_keys))
+        return fs_fail(fs, "Block %u: Beyond the allocation bitmap", block);
+
+    mapblk = be32toh(root->bitmap_keys[key]);
+    if (((map = get_block(fs, mapblk)) == NULL) ||
+        checksum_block(fs, mapblk, map))
+        return -1;
+
+    return (be32toh(map[1 + idx/32]) >> (idx & 31)) & 1;
+}
+
+int ados_fs_nr_free_blocks(struct ados_fs *fs)
+{
+    unsigned int block;
+    int rc, nr = 0;
+
+    for (block = 2; block < fs->nr_blocks; block++) {
+        if ((rc = ados_fs_block_is_free(fs, block)) < 0)
+            return -1;
+        nr += rc;
+    }
+
+    return nr;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
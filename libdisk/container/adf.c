@@ -14,30 +14,66 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-static void adf_init_track(struct disk *d, struct track_info *ti)
+/* An unwritten sector is filled with "NDOS". */
+static uint8_t ndos_fill[512];
+
+static void __initcall adf_fill_init(void)
 {
     unsigned int i;
 
+    for (i = 0; i < sizeof(ndos_fill); i += 4)
+        memcpy(&ndos_fill[i], "NDOS", 4);
+}
+
+static bool_t adf_is_fill(const uint8_t *p, unsigned int len)
+{
+    unsigned int n;
+
+    for (; len != 0; p += n, len -= n) {
+        n = min(len, (unsigned int)sizeof(ndos_fill));
+        if (memcmp(p, ndos_fill, n))
+            return 0;
+    }
+    return 1;
+}
+
+static void adf_setup_track(struct disk *d, struct track_info *ti)
+{
     init_track_info(ti, TRKTYP_amigados);
-    ti->dat = memalloc(ti->len);
     ti->data_bitoff = 1024;
     ti->total_bits = DEFAULT_BITS_PER_TRACK(d);
 
     set_all_sectors_invalid(ti);
+}
+
+static void adf_init_track(struct disk *d, struct track_info *ti)
+{
+    unsigned int i, n;
 
-    for (i = 0; i < ti->len/4; i++)
-        memcpy(ti->dat+i*4, "NDOS", 4);
+    adf_setup_track(d, ti);
+    ti->dat = memalloc_nz(ti->len);
+
+    for (i = 0; i < ti->len; i += n) {
+        n = min(ti->len - i, (unsigned int)sizeof(ndos_fill));
+        memcpy(ti->dat + i, ndos_fill, n);
+    }
 }
 
-static void adf_init(struct disk *d)
+static struct disk_info *adf_alloc_info(struct disk *d)
 {
     struct disk_info *di;
-    unsigned int i;
 
     d->di = di = memalloc(sizeof(*di));
     di->nr_tracks = 160;
     di->flags = 0;
     di->track = memalloc(di->nr_tracks * sizeof(struct track_info));
+    return di;
+}
+
+static void adf_init(struct disk *d)
+{
+    struct disk_info *di = adf_alloc_info(d);
+    unsigned int i;
 
     for (i = 0; i < di->nr_tracks; i++)
         adf_init_track(d, &di->track[i]);
@@ -47,7 +83,8 @@ static struct container *adf_open(struct disk *d)
 {
     struct track_info *ti;
     struct disk_info *di;
-    unsigned int i, j, k;
+    unsigned int i, j;
+    uint8_t *map = NULL;
     char sig[8];
     off_t sz;
 
@@ -63,20 +100,27 @@ static struct container *adf_open(struct disk *d)
     }
     lseek(d->fd, 0, SEEK_SET);
 
-    adf_init(d);
-    di = d->di;
+    /* A read-only image is never rewritten: its tracks can point straight
+     * into a mapping of the file. A writable image is truncated on close, so
+     * keeps its own copy. */
+    if (d->read_only)
+        map = (uint8_t *)stream_map(&d->map, d->fd, 0, sz);
+
+    di = adf_alloc_info(d);
 
     for (i = 0; i < di->nr_tracks; i++) {
         ti = &di->track[i];
-        read_exact(d->fd, ti->dat, ti->len);
-        for (j = 0; j < ti->nr_sectors; j++) {
-            unsigned char *p = ti->dat + j*ti->bytes_per_sector;
-            for (k = 0; k < ti->bytes_per_sector/4; k++)
-                if (memcmp(p+k*4, "NDOS", 4))
-                    break;
-            if (k != ti->bytes_per_sector/4)
-                set_sector_valid(ti, j);
+        if (map != NULL) {
+            adf_setup_track(d, ti);
+            ti->dat = map + i*ti->len;
+        } else {
+            adf_init_track(d, ti);
+            read_exact(d->fd, ti->dat, ti->len);
         }
+        for (j = 0; j < ti->nr_sectors; j++)
+            if (!adf_is_fill(ti->dat + j*ti->bytes_per_sector,
+                             ti->bytes_per_sector))
+                set_sector_valid(ti, j);
     }
 
     return &container_adf;
@@ -87,12 +131,19 @@ static void adf_close(struct disk *d)
     struct disk_info *di = d->di;
     unsigned int i;
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    sink_rewind(d);
+    sink_reserve(d, di->nr_tracks * 11*512);
 
-    for (i = 0; i < di->nr_tracks; i++)
-        write_exact(d->fd, di->track[i].dat, 11*512);
+    for (i = 0; i < di->nr_tracks; i++) {
+        struct track_info *ti = &di->track[i];
+        /* Tracks copied from another disk (disk_create_copy()) may be of any
+         * type. As in adf_write_raw(), all but AmigaDOS read as blank. */
+        if (ti->type != TRKTYP_amigados) {
+            track_free_data(d, ti);
+            adf_init_track(d, ti);
+        }
+        sink_write(d, ti->dat, 11*512);
+    }
 }
 
 static int adf_write_raw(
@@ -107,10 +158,8 @@ static int adf_write_raw(
 
     dsk_write_raw(d, tracknr, type, s);
 
-    if (ti->type != TRKTYP_amigados) {
-        memfree(ti->dat);
-        ti->dat = NULL;
-    }
+    if (ti->type != TRKTYP_amigados)
+        track_free_data(d, ti);
 
     if (ti->dat == NULL)
         adf_init_track(d, ti);
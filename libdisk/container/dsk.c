@@ -11,6 +11,24 @@
  *  [<struct tag_header> tag data...]+
  *  <track data...>
  * All fields are big endian (network ordering).
+ *
+ * Version 0 images hold raw tracks as a speed per byte. Version 1 images may
+ * also hold them as runs of constant speed (see format/raw.c), and are
+ * written whenever there is a raw track, so that older readers refuse them.
+ *
+ * A newly-created image file is written incrementally: each track's data is
+ * appended as soon as it is analysed, and its track header is updated in
+ * place. dsk_close() then need only back-patch the headers and tags, unless
+ * the streamed data is not in final layout, in which case the image is
+ * rewritten in full. Other sinks are written once, in order, by dsk_close().
+ *
+ * An opened image reads only its headers and tags up front: track data is
+ * loaded on first use. If opened for writing, dsk_close() updates it in
+ * place: tracks whose data is unchanged keep it where it lies, others have
+ * theirs appended to the file, and the headers and tags are rewritten. The
+ * image is instead rewritten in full (compacted) if disk_compact() asks, if
+ * the tags outgrow their space, or if more of the file would be dead than
+ * live.
  */
 
 #include <libdisk/util.h>
@@ -64,6 +82,29 @@ struct tag_header {
     uint16_t len;
 };
 
+/* Where each track's data lies in the image file: for an opened image, data
+ * still to be loaded; for a created image, data streamed so far. A single
+ * allocation, so that disk_close() can free it for a read-only image. */
+struct dsk_file {
+    bool_t streaming;      /* created image: tracks are streamed out */
+    uint32_t end;          /* end of streamed data, or of the opened file */
+    uint32_t data_start;   /* opened image: where its first track data lies */
+    uint32_t *off, *len;
+};
+
+/* Serialises file access by loads and streamed writes. */
+static pthread_mutex_t dsk_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dsk_file *dsk_file_alloc(unsigned int nr_tracks)
+{
+    struct dsk_file *df;
+
+    df = memalloc(sizeof(*df) + 2 * nr_tracks * sizeof(uint32_t));
+    df->off = (uint32_t *)(df + 1);
+    df->len = df->off + nr_tracks;
+    return df;
+}
+
 static void tag_swizzle(struct disktag *dtag)
 {
     switch (dtag->id) {
@@ -77,6 +118,12 @@ static void tag_swizzle(struct disktag *dtag)
         t->disk_nr = be32toh(t->disk_nr);
         break;
     }
+    case DSKTAG_copylock_key: {
+        struct disktag_copylock_key *t = (struct disktag_copylock_key *)dtag;
+        t->key = be32toh(t->key);
+        t->tracknr = be32toh(t->tracknr);
+        break;
+    }
     }
 }
 
@@ -103,6 +150,253 @@ void dsk_init(struct disk *d)
     _dsk_init(d, 168);
 }
 
+static void track_header_init(
+    struct track_header *th, const struct track_info *ti, uint32_t off)
+{
+    th->type = htobe16(ti->type);
+    th->flags = htobe16(ti->flags);
+    th->nr_sectors = htobe16(ti->nr_sectors);
+    th->bytes_per_sector = htobe16(ti->bytes_per_sector);
+    memcpy(th->valid_sectors, ti->valid_sectors, sizeof(th->valid_sectors));
+    th->off = htobe32(off);
+    th->len = htobe32(ti->len);
+    th->data_bitoff = htobe32(ti->data_bitoff);
+    th->total_bits = htobe32(ti->total_bits);
+}
+
+/* Size of disk header, track headers and tags: the offset of track data
+ * laid out contiguously in track order. */
+static uint32_t dsk_headers_size(struct disk *d)
+{
+    struct disk_list_tag *dltag;
+    uint32_t datoff;
+
+    datoff = sizeof(struct disk_header)
+        + d->di->nr_tracks * sizeof(struct track_header);
+    for (dltag = d->tags; dltag != NULL; dltag = dltag->next)
+        datoff += sizeof(struct tag_header) + dltag->tag.len;
+    return datoff;
+}
+
+#define DSK_VERSION 1
+
+static bool_t is_raw_type(enum track_type type)
+{
+    return ((type == TRKTYP_raw_sd) || (type == TRKTYP_raw_dd)
+            || (type == TRKTYP_raw_hd) || (type == TRKTYP_raw_ed));
+}
+
+static uint16_t dsk_version(struct disk *d)
+{
+    unsigned int i;
+
+    for (i = 0; i < d->di->nr_tracks; i++)
+        if (is_raw_type(d->di->track[i].type))
+            return DSK_VERSION;
+    return 0;
+}
+
+/* Write disk header, track headers and tags from the start of the file. Track
+ * data lies at @off[], or if NULL contiguously in track order after the tags.
+ * Returns the offset of the end of the tags. */
+static uint32_t dsk_write_headers(struct disk *d, const uint32_t *off)
+{
+    struct disk_header dh;
+    struct track_header th;
+    struct disk_info *di = d->di;
+    struct disk_list_tag *dltag;
+    struct disktag *dtag;
+    unsigned int i;
+    uint32_t datoff, pos;
+
+    sink_seek(d, 0);
+
+    memcpy(dh.signature, "DSK\0", 4);
+    dh.version = htobe16(dsk_version(d));
+    dh.nr_tracks = htobe16(di->nr_tracks);
+    dh.bytes_per_thdr = htobe16(sizeof(th));
+    dh.flags = htobe16(di->flags);
+    sink_write(d, &dh, sizeof(dh));
+
+    datoff = dsk_headers_size(d);
+
+    for (i = 0, pos = datoff; i < di->nr_tracks; i++) {
+        track_header_init(&th, &di->track[i], off ? off[i] : pos);
+        sink_write(d, &th, sizeof(th));
+        pos += di->track[i].len;
+    }
+
+    for (dltag = d->tags; dltag != NULL; dltag = dltag->next) {
+        struct tag_header tagh;
+        dtag = &dltag->tag;
+        tagh.id = htobe16(dtag->id);
+        tagh.len = htobe16(dtag->len);
+        tag_swizzle(dtag);
+        sink_write(d, &tagh, sizeof(tagh));
+        sink_write(d, dtag+1, dtag->len);
+        tag_swizzle(dtag);
+    }
+
+    return datoff;
+}
+
+static void dsk_create_init(struct disk *d)
+{
+    struct dsk_file *df;
+
+    dsk_init(d);
+    if ((d->sink.fd == -1) || !sink_seekable(d))
+        return;
+
+    d->container_priv = df = dsk_file_alloc(d->di->nr_tracks);
+    df->streaming = 1;
+
+    /* A valid (all-unformatted) image from the outset. */
+    df->end = dsk_write_headers(d, NULL);
+}
+
+/* Append a newly-analysed track to the image, and point its header at it. */
+static void dsk_stream_track(struct disk *d, unsigned int tracknr)
+{
+    struct dsk_file *df = d->container_priv;
+    struct track_info *ti = &d->di->track[tracknr];
+    struct track_header th;
+
+    pthread_mutex_lock(&dsk_file_lock);
+    sink_seek(d, df->end);
+    sink_write(d, ti->dat, ti->len);
+    df->off[tracknr] = df->end;
+    df->len[tracknr] = ti->len;
+    df->end += ti->len;
+    track_header_init(&th, ti, df->off[tracknr]);
+    sink_seek(d, sizeof(struct disk_header) + tracknr * sizeof(th));
+    sink_write(d, &th, sizeof(th));
+    pthread_mutex_unlock(&dsk_file_lock);
+}
+
+/* Load a track's data from the file, if it has not been loaded (or since
+ * replaced). */
+static void dsk_load(struct disk *d, unsigned int tracknr)
+{
+    struct dsk_file *df = d->container_priv;
+    struct track_info *ti = &d->di->track[tracknr];
+    uint8_t *dat;
+    int fd;
+
+    if (df == NULL)
+        return;
+
+    /* A created image is read back from where it is streamed. */
+    fd = df->streaming ? d->sink.fd : d->fd;
+
+    pthread_mutex_lock(&dsk_file_lock);
+    if ((ti->dat == NULL) && (ti->len != 0) && (ti->len == df->len[tracknr])) {
+        dat = memalloc(ti->len);
+        lseek(fd, df->off[tracknr], SEEK_SET);
+        read_exact(fd, dat, ti->len);
+        ti->dat = dat;
+    }
+    pthread_mutex_unlock(&dsk_file_lock);
+}
+
+/* Is the streamed data exactly what a full rewrite would produce at
+ * @datoff onwards? */
+static bool_t dsk_stream_in_place(struct disk *d, uint32_t datoff)
+{
+    struct dsk_file *df = d->container_priv;
+    struct disk_info *di = d->di;
+    struct track_info *ti;
+    unsigned int i;
+    bool_t ok = 1;
+    void *buf;
+
+    for (i = 0; ok && (i < di->nr_tracks); i++) {
+        ti = &di->track[i];
+        if (ti->len == 0)
+            continue;
+        if ((df->off[i] != datoff) || (df->len[i] != ti->len))
+            return 0;
+        /* Track data may have been updated since it was streamed. */
+        buf = memalloc(ti->len);
+        lseek(d->sink.fd, datoff, SEEK_SET);
+        read_exact(d->sink.fd, buf, ti->len);
+        ok = !memcmp(buf, ti->dat, ti->len);
+        memfree(buf);
+        datoff += ti->len;
+    }
+
+    return ok && (datoff == df->end);
+}
+
+/* Is track @i's data in the opened image file current? */
+static bool_t dsk_track_current(struct disk *d, unsigned int i)
+{
+    struct dsk_file *df = d->container_priv;
+    struct track_info *ti = &d->di->track[i];
+    bool_t ok;
+    void *buf;
+
+    if ((ti->len == 0) || (ti->len != df->len[i]))
+        return 0;
+    if (ti->dat == NULL)
+        return 1;
+
+    /* Loaded, and perhaps modified since. */
+    buf = memalloc(ti->len);
+    lseek(d->fd, df->off[i], SEEK_SET);
+    read_exact(d->fd, buf, ti->len);
+    ok = !memcmp(buf, ti->dat, ti->len);
+    memfree(buf);
+    return ok;
+}
+
+/* Update an opened image in place. Returns 0, having written nothing, if it
+ * must instead be rewritten in full. */
+static bool_t dsk_update_in_place(struct disk *d)
+{
+    struct dsk_file *df = d->container_priv;
+    struct disk_info *di = d->di;
+    struct track_info *ti;
+    uint32_t *off, end, live = 0;
+    unsigned int i;
+
+    if (d->compact || (dsk_headers_size(d) > df->data_start))
+        return 0;
+
+    /* Offset of each track's data: 0 marks data to be appended. Empty
+     * tracks keep their offset, so that an unmodified image is unchanged. */
+    off = memalloc(di->nr_tracks * sizeof(*off));
+    for (i = 0; i < di->nr_tracks; i++) {
+        live += di->track[i].len;
+        if ((di->track[i].len == 0) || dsk_track_current(d, i))
+            off[i] = df->off[i];
+    }
+
+    end = df->end;
+    for (i = 0; i < di->nr_tracks; i++)
+        if (off[i] == 0)
+            end += di->track[i].len;
+
+    if ((end - df->data_start) > 2 * (uint64_t)live) {
+        memfree(off);
+        return 0;
+    }
+
+    sink_seek(d, end = df->end);
+    for (i = 0; i < di->nr_tracks; i++) {
+        ti = &di->track[i];
+        if ((off[i] != 0) || (ti->len == 0))
+            continue;
+        sink_write(d, ti->dat, ti->len);
+        off[i] = end;
+        end += ti->len;
+    }
+
+    dsk_write_headers(d, off);
+    memfree(off);
+    return 1;
+}
+
 static struct container *dsk_open(struct disk *d)
 {
     struct disk_header dh;
@@ -112,12 +406,12 @@ static struct container *dsk_open(struct disk *d)
     struct disktag *dtag;
     struct disk_info *di;
     struct track_info *ti;
+    struct dsk_file *df;
     unsigned int i, bytes_per_th, read_bytes_per_th;
-    off_t off;
 
     read_exact(d->fd, &dh, sizeof(dh));
     if (strncmp(dh.signature, "DSK\0", 4) ||
-        (be16toh(dh.version) != 0))
+        (be16toh(dh.version) > DSK_VERSION))
         return NULL;
 
     di = memalloc(sizeof(*di));
@@ -125,8 +419,9 @@ static struct container *dsk_open(struct disk *d)
     di->flags = be16toh(dh.flags);
     di->track = memalloc(di->nr_tracks * sizeof(*ti));
     read_bytes_per_th = bytes_per_th = be16toh(dh.bytes_per_thdr);
-    if (read_bytes_per_th > sizeof(*ti))
-        read_bytes_per_th = sizeof(*ti);
+    if (read_bytes_per_th > sizeof(th))
+        read_bytes_per_th = sizeof(th);
+    df = dsk_file_alloc(di->nr_tracks);
 
     for (i = 0; i < di->nr_tracks; i++) {
         memset(&th, 0, sizeof(th));
@@ -140,11 +435,9 @@ static struct container *dsk_open(struct disk *d)
         ti->len = be32toh(th.len);
         ti->data_bitoff = be32toh(th.data_bitoff);
         ti->total_bits = be32toh(th.total_bits);
-        off = lseek(d->fd, bytes_per_th-read_bytes_per_th, SEEK_CUR);
-        lseek(d->fd, be32toh(th.off), SEEK_SET);
-        ti->dat = memalloc(ti->len);
-        read_exact(d->fd, ti->dat, ti->len);
-        lseek(d->fd, off, SEEK_SET);
+        df->off[i] = be32toh(th.off);
+        df->len[i] = ti->len;
+        lseek(d->fd, bytes_per_th-read_bytes_per_th, SEEK_CUR);
     }
 
     pprevtag = &d->tags;
@@ -160,69 +453,295 @@ static struct container *dsk_open(struct disk *d)
         pprevtag = &dltag->next;
     } while (dtag->id != DSKTAG_end);
     *pprevtag = NULL;
+    disk_index_tags(d);
+
+    df->data_start = df->end = lseek(d->fd, 0, SEEK_END);
+    for (i = 0; i < di->nr_tracks; i++)
+        if (df->len[i] != 0)
+            df->data_start = min(df->data_start, df->off[i]);
 
     d->di = di;
+    d->container_priv = df;
     return &container_dsk;
 }
 
 static void dsk_close(struct disk *d)
 {
-    struct disk_header dh;
-    struct track_header th;
+    struct dsk_file *df = d->container_priv;
     struct disk_info *di = d->di;
     struct track_info *ti;
-    struct disk_list_tag *dltag;
-    struct disktag *dtag;
-    unsigned int i, datoff;
+    unsigned int i;
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    if ((df != NULL) && df->streaming) {
+        if (dsk_stream_in_place(d, dsk_headers_size(d))) {
+            dsk_write_headers(d, NULL);
+            goto out;
+        }
+    } else if (df != NULL) {
+        if (dsk_update_in_place(d))
+            goto out;
+    }
 
-    memcpy(dh.signature, "DSK\0", 4);
-    dh.version = 0;
-    dh.nr_tracks = htobe16(di->nr_tracks);
-    dh.bytes_per_thdr = htobe16(sizeof(th));
-    dh.flags = htobe16(di->flags);
-    write_exact(d->fd, &dh, sizeof(dh));
+    /* Everything must be in memory before the file is truncated. */
+    for (i = 0; i < di->nr_tracks; i++)
+        dsk_load(d, i);
 
-    datoff = sizeof(dh) + di->nr_tracks * sizeof(th);
-    for (dltag = d->tags; dltag != NULL; dltag = dltag->next)
-        datoff += sizeof(struct tag_header) + dltag->tag.len;
+    sink_rewind(d);
+    dsk_write_headers(d, NULL);
 
     for (i = 0; i < di->nr_tracks; i++) {
         ti = &di->track[i];
-        th.type = htobe16(ti->type);
-        th.flags = htobe16(ti->flags);
-        th.nr_sectors = htobe16(ti->nr_sectors);
-        th.bytes_per_sector = htobe16(ti->bytes_per_sector);
-        memcpy(th.valid_sectors, ti->valid_sectors, sizeof(th.valid_sectors));
-        th.off = htobe32(datoff);
-        th.len = htobe32(ti->len);
-        th.data_bitoff = htobe32(ti->data_bitoff);
-        th.total_bits = htobe32(ti->total_bits);
-        write_exact(d->fd, &th, sizeof(th));
-        datoff += ti->len;
+        if (ti->len != 0)
+            sink_write(d, ti->dat, ti->len);
     }
 
-    for (dltag = d->tags; dltag != NULL; dltag = dltag->next) {
-        struct tag_header tagh;
-        dtag = &dltag->tag;
-        tagh.id = htobe16(dtag->id);
-        tagh.len = htobe16(dtag->len);
-        tag_swizzle(dtag);
-        write_exact(d->fd, &tagh, sizeof(tagh));
-        write_exact(d->fd, dtag+1, dtag->len);
-        tag_swizzle(dtag);
+out:
+    memfree(df);
+    d->container_priv = NULL;
+}
+
+/* Bitcell period for a handler expecting @ns_per_cell, given the flux
+ * histogram of the selected track: the measured period if the drive or data
+ * RPM guess is off, else @ns_per_cell. Returns 0 if the track's flux rules
+ * out this density altogether. */
+static unsigned int measured_ns_per_cell(
+    struct stream *s, enum track_type type, unsigned int ns_per_cell)
+{
+    unsigned int cell, t = s->flux_min_ns;
+
+#define near(x, pct) ((x) * 100 >= ns_per_cell * (100 - (pct)) &&   \
+                      (x) * 100 <= ns_per_cell * (100 + (pct)))
+    /* Raw handlers accept anything, and unformatted tracks have no clock. */
+    if ((t == 0) || (type == TRKTYP_unformatted) ||
+        ((type >= TRKTYP_raw_sd) && (type <= TRKTYP_raw_ed)))
+        return ns_per_cell;
+
+    /* The shortest interval is two bitcells for MFM, else one or two. */
+    cell = t / 2;
+    if (!near(cell, 25)) {
+        if (s->flux_mfm || !near(t, 25))
+            return 0;
+        cell = t;
     }
 
-    for (i = 0; i < di->nr_tracks; i++) {
-        ti = &di->track[i];
-        if (ti->len != 0)
-            write_exact(d->fd, ti->dat, ti->len);
+    /* Within the PLL's reach of the nominal period: leave it be. */
+    return near(cell, 5) ? ns_per_cell : cell;
+#undef near
+}
+
+/* Is the selected track noise in every window of its flux (see
+ * stream_flux_noise())? Too short a track is given the benefit of the doubt. */
+#define NOISE_MIN_WINDOWS 16
+static bool_t track_is_noise(struct stream *s)
+{
+    uint32_t nr_noisy;
+    int nr = stream_flux_noise(s, &nr_noisy);
+    return (nr >= NOISE_MIN_WINDOWS) && (nr_noisy == nr);
+}
+
+static unsigned int density_ns_per_cell(enum track_density density)
+{
+    switch (density) {
+    case trkden_single: return 4000u;
+    case trkden_double: return 2000u;
+    case trkden_high: return 1000u;
+    case trkden_extra: return 500u;
+    default: BUG();
     }
 }
 
+/* Select @tracknr at the bitcell period its flux shows for a handler of
+ * @type, unless the flux rules out @type's density. */
+static int select_density(
+    unsigned int tracknr, enum track_type type, struct stream *s)
+{
+    unsigned int ns_per_cell;
+
+    if (stream_select_track(s, tracknr) != 0)
+        return -1;
+    ns_per_cell = measured_ns_per_cell(s, type, s->clock_centre);
+    if (ns_per_cell == 0)
+        return -1;
+    if (ns_per_cell != s->clock_centre) {
+        stream_set_density(s, ns_per_cell);
+        stream_reset(s);
+    }
+    /* Noise throughout can match only a handler which accepts anything. */
+    if ((type != TRKTYP_unformatted) &&
+        ((type < TRKTYP_raw_sd) || (type > TRKTYP_raw_ed)) &&
+        track_is_noise(s))
+        return -1;
+    return 0;
+}
+
+/* Bitcells decoded at once, and fed to every scanner still undecided. */
+#define SCAN_CHUNK 4096
+
+/* Feed the track as selected to the scanners of those of @types at density
+ * @den which are yet undecided. */
+static void scan_types(
+    struct disk *d, unsigned int tracknr, const uint16_t *types,
+    unsigned int nr, enum track_density den, struct stream *s,
+    uint8_t *verdict)
+{
+    const struct track_scanner *sc;
+    uint8_t bits[SCAN_CHUNK / 8];
+    void **state = memalloc(nr * sizeof(*state));
+    unsigned int i, n, live = 0;
+
+    for (i = 0; i < nr; i++) {
+        sc = handlers[types[i]]->scanner;
+        if ((sc == NULL) || (handlers[types[i]]->density != den)
+            || (verdict[i] != SCAN_more))
+            continue;
+        state[i] = memalloc(sc->state_size);
+        if (sc->init != NULL)
+            sc->init(d, tracknr, types[i], state[i]);
+        live++;
+    }
+
+    while (live != 0) {
+        n = stream_next_bitcells(s, bits, NULL, NULL, SCAN_CHUNK);
+        for (i = 0; i < nr; i++) {
+            if ((state[i] == NULL) || (verdict[i] != SCAN_more))
+                continue;
+            sc = handlers[types[i]]->scanner;
+            verdict[i] = (n == 0) ? SCAN_reject
+                : sc->feed(state[i], bits, n);
+            if (verdict[i] != SCAN_more)
+                live--;
+        }
+    }
+
+    for (i = 0; i < nr; i++)
+        memfree(state[i]);
+    memfree(state);
+}
+
+void dsk_scan(
+    struct disk *d, unsigned int tracknr, const uint16_t *types,
+    unsigned int nr, struct stream *s, uint8_t *verdict)
+{
+    uint32_t word = s->word, prng_seed = s->prng_seed;
+    unsigned int i, den;
+
+    memset(verdict, SCAN_more, nr);
+
+    for (den = 0; den <= trkden_extra; den++) {
+        for (i = 0; i < nr; i++)
+            if ((handlers[types[i]]->scanner != NULL)
+                && (handlers[types[i]]->density == den))
+                break;
+        if (i == nr)
+            continue;
+        stream_set_density(s, density_ns_per_cell(den));
+        if (select_density(tracknr, types[i], s) == 0)
+            scan_types(d, tracknr, types, nr, den, s, verdict);
+    }
+
+    s->word = word;
+    s->prng_seed = prng_seed;
+}
+
+/* Select @tracknr for the handler's write_raw(), unless the track's flux
+ * density or the handler's probe hook (or scanner) rules the track out. The stream is
+ * rewound after probing, so that write_raw() sees exactly what it would have
+ * seen without the probe. */
+static int select_track(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s)
+{
+    const struct track_handler *thnd = handlers[type];
+    uint32_t word = s->word, prng_seed = s->prng_seed;
+    uint16_t t = type;
+    uint8_t verdict = SCAN_more;
+
+    if (select_density(tracknr, type, s) != 0)
+        return -1;
+    if (thnd->scanner != NULL) {
+        scan_types(d, tracknr, &t, 1, thnd->density, s, &verdict);
+        if (verdict == SCAN_reject)
+            return -1;
+    } else if (thnd->probe == NULL) {
+        return 0;
+    } else if (!thnd->probe(d, tracknr, s)) {
+        return -1;
+    }
+
+    s->word = word;
+    s->prng_seed = prng_seed;
+    stream_reset(s);
+    return 0;
+}
+
+int dsk_density_ruled_out(
+    unsigned int tracknr, enum track_type type, struct stream *s)
+{
+    uint32_t word = s->word, prng_seed = s->prng_seed;
+    int rc;
+
+    stream_set_density(s, density_ns_per_cell(handlers[type]->density));
+    rc = select_density(tracknr, type, s);
+    s->word = word;
+    s->prng_seed = prng_seed;
+    return rc != 0;
+}
+
+/* Keep the result of @type's write_raw() on @tracknr for its variants. */
+static void parent_memo_save(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *dat)
+{
+    struct parent_memo *m = s->parent_memo;
+    struct track_info *ti = &d->di->track[tracknr];
+
+    if ((m == NULL) || (m->type != type))
+        return;
+
+    memfree(m->ti.dat);
+    m->ti = *ti;
+    m->ti.dat = NULL;
+    m->valid = (s->nr_index != 0);
+    m->tracknr = tracknr;
+    m->rev = s->nr_index - 1;
+    m->bc = s->index_offset_bc;
+    if (dat != NULL) {
+        m->ti.dat = memalloc_nz(ti->len);
+        memcpy(m->ti.dat, dat, ti->len);
+    }
+}
+
+/* Decode @tracknr as variant @type's parent, reusing the parent's earlier
+ * decode if there is one, and pass the result to write_variant(). */
+static void *variant_write_raw(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s)
+{
+    const struct track_handler *thnd = handlers[type];
+    struct parent_memo *m = s->parent_memo;
+    struct track_info *ti = &d->di->track[tracknr];
+    void *dat;
+
+    if ((m != NULL) && m->valid && (m->type == thnd->parent) &&
+        (m->tracknr == tracknr)) {
+        *ti = m->ti;
+        ti->dat = NULL;
+        if (m->ti.dat == NULL)
+            return NULL;
+        dat = memalloc_nz(ti->len);
+        memcpy(dat, m->ti.dat, ti->len);
+        stream_seek_bc(s, m->rev, m->bc);
+    } else {
+        init_track_info(ti, thnd->parent);
+        dat = handlers[thnd->parent]->write_raw(d, tracknr, s);
+        parent_memo_save(d, tracknr, thnd->parent, s, dat);
+        if (dat == NULL)
+            return NULL;
+    }
+
+    return thnd->write_variant(d, tracknr, type, s, dat);
+}
+
 int dsk_write_raw(
     struct disk *d, unsigned int tracknr, enum track_type type,
     struct stream *s)
@@ -230,23 +749,31 @@ int dsk_write_raw(
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
     unsigned int ns_per_cell = 0, default_len;
+    uint32_t track_len;
 
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, type);
 
-    switch (handlers[type]->density) {
-    case trkden_single: ns_per_cell = 4000u; break;
-    case trkden_double: ns_per_cell = 2000u; break;
-    case trkden_high: ns_per_cell = 1000u; break;
-    case trkden_extra: ns_per_cell = 500u; break;
-    default: BUG();
-    }
+    ns_per_cell = density_ns_per_cell(handlers[type]->density);
     stream_set_density(s, ns_per_cell);
     default_len = (DEFAULT_BITS_PER_TRACK(d) * 2000u) / ns_per_cell;
     ti->total_bits = default_len;
 
-    if (stream_select_track(s, tracknr) == 0)
-        ti->dat = handlers[type]->write_raw(d, tracknr, s);
+    s->idle_revolutions = (handlers[type]->nr_sectors > 1)
+        ? s->idle_revs_sectored : s->idle_revs_track;
+    if (s->idle_revolutions)
+        track_watch_progress(ti, s);
+    if (select_track(d, tracknr, type, s) == 0) {
+        if (handlers[type]->write_variant != NULL) {
+            ti->dat = variant_write_raw(d, tracknr, type, s);
+        } else {
+            ti->dat = handlers[type]->write_raw(d, tracknr, s);
+            parent_memo_save(d, tracknr, type, s, ti->dat);
+        }
+    }
+    track_watch_progress(NULL, NULL);
+    s->idle_revolutions = 0;
+    track_scratch_reset();
 
     if (ti->dat == NULL) {
         track_mark_unformatted(d, tracknr);
@@ -254,18 +781,22 @@ int dsk_write_raw(
         return -1;
     }
 
-    stream_reset(s);
-    stream_next_index(s);
+    /* The handler's own pass usually measured the first revolution. Else
+     * rewind and measure it now, unless the length is of no interest. */
+    if (((track_len = s->rev_len_bc) == 0) && (ti->total_bits != TRK_WEAK)) {
+        stream_seek_bc(s, 1, 0);
+        track_len = s->track_len_bc;
+    }
 
     if (ti->total_bits == 0) {
-        ti->total_bits = s->track_len_bc ? : default_len;
+        ti->total_bits = track_len ? : default_len;
     } else if (ti->total_bits == TRK_WEAK) {
         /* nothing */
-    } else if (((s->track_len_bc - (s->track_len_bc/50)) > ti->total_bits) ||
-               ((s->track_len_bc + (s->track_len_bc/50)) < ti->total_bits)) {
+    } else if (((track_len - (track_len/50)) > ti->total_bits) ||
+               ((track_len + (track_len/50)) < ti->total_bits)) {
         fprintf(stderr, "*** T%u.%u: Unexpected track length (seen %u, "
                 "expected %u)\n", cyl(tracknr), hd(tracknr),
-                s->track_len_bc, ti->total_bits);
+                track_len, ti->total_bits);
     }
 
     ti->data_bitoff = (int32_t)ti->data_bitoff % (int32_t)ti->total_bits;
@@ -275,11 +806,34 @@ int dsk_write_raw(
     return 0;
 }
 
+static int dsk_stream_write_raw(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s)
+{
+    struct dsk_file *df = d->container_priv;
+    int rc;
+
+    /* Any copy of this track in the file is now stale. */
+    if (df != NULL) {
+        pthread_mutex_lock(&dsk_file_lock);
+        df->len[tracknr] = 0;
+        pthread_mutex_unlock(&dsk_file_lock);
+    }
+
+    rc = dsk_write_raw(d, tracknr, type, s);
+
+    if ((rc == 0) && (df != NULL) && df->streaming)
+        dsk_stream_track(d, tracknr);
+
+    return rc;
+}
+
 struct container container_dsk = {
-    .init = dsk_init,
+    .init = dsk_create_init,
     .open = dsk_open,
     .close = dsk_close,
-    .write_raw = dsk_write_raw
+    .write_raw = dsk_stream_write_raw,
+    .load = dsk_load
 };
 
 /*
@@ -13,6 +13,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if !defined(__MINGW32__)
+#include <sys/uio.h>
+#else
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
 
 struct disk_header {
     char sig[8];
@@ -29,25 +37,46 @@ static void eadf_init(struct disk *d)
     _dsk_init(d, 166);
 }
 
+/* Copy @len bytes at @off of the mapped file, zero-filling past its end. */
+static void eadf_copy(void *dst, const uint8_t *map, off_t sz,
+                      off_t off, size_t len)
+{
+    size_t n = (off >= sz) ? 0 : min((off_t)len, sz - off);
+
+    memcpy(dst, map + off, n);
+    memset((uint8_t *)dst + n, 0, len - n);
+}
+
 static struct container *eadf_open(struct disk *d)
 {
+    struct stream_map map = { 0 };
     struct disk_header dhdr;
     struct track_header thdr;
     struct disk_info *di;
     struct track_info *ti;
-    unsigned int i, off, ext_type;
+    const uint8_t *base;
+    unsigned int i, ext_type, thdr_len;
+    off_t sz, off, dat_off;
+    uint8_t *bits;
 
-    lseek(d->fd, 0, SEEK_SET);
+    sz = lseek(d->fd, 0, SEEK_END);
+    if (sz < (off_t)sizeof(dhdr.sig))
+        return NULL;
+    base = stream_map(&map, d->fd, 0, sz);
 
-    read_exact(d->fd, dhdr.sig, sizeof(dhdr.sig));
-    if (!strncmp(dhdr.sig, "UAE--ADF", sizeof(dhdr.sig))) {
+    if (!strncmp((const char *)base, "UAE--ADF", sizeof(dhdr.sig))) {
         ext_type = 1;
         dhdr.nr_tracks = 160;
-    } else if (!strncmp(dhdr.sig, "UAE-1ADF", sizeof(dhdr.sig))) {
+        off = 8;
+        thdr_len = 4;
+    } else if (!strncmp((const char *)base, "UAE-1ADF", sizeof(dhdr.sig))) {
         ext_type = 2;
-        read_exact(d->fd, &dhdr.rsvd, 4);
+        eadf_copy(&dhdr, base, sz, 0, sizeof(dhdr));
         dhdr.nr_tracks = be16toh(dhdr.nr_tracks);
+        off = sizeof(dhdr);
+        thdr_len = sizeof(thdr);
     } else {
+        stream_unmap(&map);
         return NULL;
     }
 
@@ -55,15 +84,17 @@ static struct container *eadf_open(struct disk *d)
     di->nr_tracks = dhdr.nr_tracks;
     di->track = memalloc(di->nr_tracks * sizeof(struct track_info));
 
-    for (i = 0; i < di->nr_tracks; i++) {
+    /* Track data follows the track headers, in track order. Each track is
+     * copied once, straight into its final layout. */
+    dat_off = off + di->nr_tracks * thdr_len;
+    for (i = 0; i < di->nr_tracks; i++, off += thdr_len) {
         ti = &di->track[i];
+        eadf_copy(&thdr, base, sz, off, thdr_len);
         if (ext_type == 1) {
-            read_exact(d->fd, &thdr, 4);
             thdr.len = be16toh(thdr.type);
             thdr.type = !!thdr.rsvd;
             thdr.bitlen = thdr.len * 8;
         } else {
-            read_exact(d->fd, &thdr, sizeof(thdr));
             thdr.type = be16toh(thdr.type);
             thdr.len = be32toh(thdr.len);
             thdr.bitlen = be32toh(thdr.bitlen);
@@ -71,7 +102,7 @@ static struct container *eadf_open(struct disk *d)
         switch (thdr.type) {
         case 0:
             if (thdr.len < 11*512) {
-                warnx("Bad ADOS track len %u in Ext-ADF", ti->len);
+                warnx("Bad ADOS track len %u in Ext-ADF", thdr.len);
                 goto cleanup_error;
             }
             init_track_info(ti, TRKTYP_amigados);
@@ -79,46 +110,46 @@ static struct container *eadf_open(struct disk *d)
             ti->data_bitoff = 1024;
             ti->total_bits = DEFAULT_BITS_PER_TRACK(d);
             set_all_sectors_valid(ti);
+            ti->dat = memalloc_nz(ti->len);
+            eadf_copy(ti->dat, base, sz, dat_off, ti->len);
             break;
         case 1:
-            init_track_info(
-                ti, thdr.bitlen ? TRKTYP_raw_dd : TRKTYP_unformatted);
-            ti->len = thdr.len;
-            ti->total_bits = thdr.bitlen;
-            ti->data_bitoff = (ext_type == 1) ? 1024 : 0;
+            if (thdr.len == 0) {
+                init_track_info(ti, TRKTYP_unformatted);
+                ti->total_bits = TRK_WEAK;
+                break;
+            }
+            if (thdr.bitlen == 0) {
+                init_track_info(ti, TRKTYP_unformatted);
+                ti->len = thdr.len;
+                ti->total_bits = 0;
+                ti->dat = memalloc_nz(ti->len);
+                eadf_copy(ti->dat, base, sz, dat_off, ti->len);
+                break;
+            }
+            if (ext_type == 1) {
+                /* RAW EXT1 tracks require the sync word to be patched in */
+                bits = setup_uniform_raw_track(d, i, TRKTYP_raw_dd,
+                                               thdr.bitlen + 16, NULL);
+                memcpy(bits, &thdr.rsvd, 2);
+                eadf_copy(bits + 2, base, sz, dat_off,
+                          min(thdr.len, (thdr.bitlen + 7) / 8));
+                ti->data_bitoff = 1024;
+            } else {
+                bits = setup_uniform_raw_track(d, i, TRKTYP_raw_dd,
+                                               thdr.bitlen, NULL);
+                eadf_copy(bits, base, sz, dat_off,
+                          min(thdr.len, (thdr.bitlen + 7) / 8));
+            }
             break;
         default:
             warnx("Bad track type %u in Ext-ADF", thdr.type);
             goto cleanup_error;
         }
-        if (ti->len == 0) {
-            init_track_info(ti, TRKTYP_unformatted);
-            ti->total_bits = TRK_WEAK;
-        } else if ((ext_type == 1) && (ti->type == TRKTYP_raw_dd)) {
-            /* RAW EXT1 tracks require the sync word to be patched in */
-            ti->len += 2;
-            ti->total_bits += 16;
-            ti->dat = memalloc(ti->len);
-            memcpy(ti->dat, &thdr.rsvd, 2);
-        } else {
-            ti->dat = memalloc(ti->len);
-        }
-    }
-
-    for (i = 0; i < di->nr_tracks; i++) {
-        ti = &di->track[i];
-        off = (ext_type == 1) && (ti->type == TRKTYP_raw_dd) ? 2 : 0;
-        read_exact(d->fd, &ti->dat[off], ti->len-off);
-        if (ti->type == TRKTYP_raw_dd) {
-            /* Raw data has a proper marshalling API we must use. */
-            struct track_info _ti = *ti;
-            memset(ti, 0, sizeof(*ti));
-            setup_uniform_raw_track(d, i, _ti.type, _ti.total_bits, _ti.dat);
-            ti->data_bitoff = _ti.data_bitoff;
-            memfree(_ti.dat);
-        }
+        dat_off += thdr.len;
     }
 
+    stream_unmap(&map);
     return &container_eadf;
 
 cleanup_error:
@@ -127,56 +158,127 @@ cleanup_error:
     memfree(di->track);
     memfree(di);
     d->di = NULL;
+    stream_unmap(&map);
     return NULL;
 }
 
+/* Every track is read raw up front, in parallel. The file is then written
+ * in one gathered write. */
+struct eadf_encode {
+    struct disk *d;
+    struct track_raw **raw;
+    bool_t *variable;
+};
+
+static void eadf_encode_track(void *arg, unsigned int i)
+{
+    struct eadf_encode *enc = arg;
+    struct disk *d = enc->d;
+    struct track_raw *raw;
+    unsigned int j;
+
+    if (d->di->track[i].type == TRKTYP_unformatted)
+        return;
+
+    enc->raw[i] = raw = track_alloc_raw_buffer(d);
+    track_read_raw(raw, i);
+    for (j = 0; j < raw->nr_speed_runs; j++)
+        if (raw->speed_runs[j].speed != 1000)
+            enc->variable[i] = 1;
+}
+
+#if !defined(__MINGW32__)
+/* A file sink is written directly, past its accounting: this must be the
+ * image's last write. */
+static void eadf_writev(struct disk *d, struct iovec *iov, unsigned int nr)
+{
+    long max = sysconf(_SC_IOV_MAX);
+    ssize_t done;
+
+    if (d->sink.fd == -1) {
+        for (; nr != 0; iov++, nr--)
+            sink_write(d, iov->iov_base, iov->iov_len);
+        return;
+    }
+
+    if (max <= 0)
+        max = 16; /* POSIX minimum */
+    while (nr != 0) {
+        done = writev(d->sink.fd, iov, (nr < max) ? nr : max);
+        if (done < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            err(1, NULL);
+        }
+        /* Skip what was written, resuming part way through an element. */
+        for (; (nr != 0) && (done >= (ssize_t)iov->iov_len); iov++, nr--)
+            done -= iov->iov_len;
+        if (nr != 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+#else
+static void eadf_writev(struct disk *d, struct iovec *iov, unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++)
+        sink_write(d, iov[i].iov_base, iov[i].iov_len);
+}
+#endif
+
 static void eadf_close(struct disk *d)
 {
     struct disk_info *di = d->di;
-    struct track_info *ti;
     struct disk_header dhdr;
-    struct track_header thdr;
-    struct track_raw *raw[di->nr_tracks];
-    unsigned int i, j;
+    struct track_header *thdr;
+    struct eadf_encode enc;
+    struct iovec *iov;
+    unsigned int i, nr_iov = 0;
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    enc.d = d;
+    enc.raw = memalloc(di->nr_tracks * sizeof(*enc.raw));
+    enc.variable = memalloc(di->nr_tracks * sizeof(*enc.variable));
+    disk_parallel(d, di->nr_tracks, eadf_encode_track, &enc);
+
+    for (i = 0; i < di->nr_tracks; i++)
+        if (enc.variable[i])
+            fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
+                    "correctly written to an Ext-ADF file\n", i/2, i&1);
 
     memset(&dhdr, 0, sizeof(dhdr));
     memcpy(dhdr.sig, "UAE-1ADF", sizeof(dhdr.sig));
     dhdr.nr_tracks = htobe16(di->nr_tracks);
-    write_exact(d->fd, &dhdr, sizeof(dhdr));
 
-    memset(raw, 0, sizeof(raw));
-    memset(&thdr, 0, sizeof(thdr));
-    thdr.type = htobe16(1);
+    thdr = memalloc(di->nr_tracks * sizeof(*thdr));
+    iov = memalloc((di->nr_tracks + 2) * sizeof(*iov));
+    iov[nr_iov].iov_base = &dhdr;
+    iov[nr_iov++].iov_len = sizeof(dhdr);
+    iov[nr_iov].iov_base = thdr;
+    iov[nr_iov++].iov_len = di->nr_tracks * sizeof(*thdr);
     for (i = 0; i < di->nr_tracks; i++) {
-        ti = &di->track[i];
-        if (ti->type == TRKTYP_unformatted) {
-            thdr.len = thdr.bitlen = 0;
-        } else {
-            raw[i] = track_alloc_raw_buffer(d);
-            track_read_raw(raw[i], i);
-            thdr.len = htobe32((raw[i]->bitlen+7)/8);
-            thdr.bitlen = htobe32(raw[i]->bitlen);
-            for (j = 0; j < raw[i]->bitlen; j++) {
-                if (raw[i]->speed[j] == 1000)
-                    continue;
-                fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
-                        "correctly written to an Ext-ADF file\n", i/2, i&1);
-                break;
-            }
-        }
-        write_exact(d->fd, &thdr, sizeof(thdr));
-    }
-
-    for (i = 0; i < di->nr_tracks; i++) {
-        if (raw[i] == NULL)
+        struct track_raw *raw = enc.raw[i];
+        thdr[i].type = htobe16(1);
+        if (raw == NULL)
             continue;
-        write_exact(d->fd, raw[i]->bits, (raw[i]->bitlen+7)/8);
-        track_free_raw_buffer(raw[i]);
+        thdr[i].len = htobe32((raw->bitlen+7)/8);
+        thdr[i].bitlen = htobe32(raw->bitlen);
+        iov[nr_iov].iov_base = raw->bits;
+        iov[nr_iov++].iov_len = (raw->bitlen+7)/8;
     }
+
+    sink_rewind(d);
+    eadf_writev(d, iov, nr_iov);
+
+    for (i = 0; i < di->nr_tracks; i++)
+        if (enc.raw[i] != NULL)
+            track_free_raw_buffer(enc.raw[i]);
+    memfree(iov);
+    memfree(thdr);
+    memfree(enc.variable);
+    memfree(enc.raw);
 }
 
 struct container container_eadf = {
@@ -79,156 +79,343 @@ static void hfe_init(struct disk *d)
 }
 
 /* HFE dat bit order is LSB first. Switch to/from MSB first.  */
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+static const uint8_t bit_reverse_tab[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R2
+#undef R4
+#undef R6
+
 static void bit_reverse(uint8_t *block, unsigned int len)
 {
     while (len--) {
-        uint8_t x = *block, y, k;
-        for (k = y = 0; k < 8; k++) {
-            y <<= 1;
-            y |= x&1;
-            x >>= 1;
-        }
-        *block++ = y;
+        *block = bit_reverse_tab[*block];
+        block++;
     }
 }
 
+/* OR @nr bits from @src into @dst, MSB first. Copies forward a byte at a
+ * time, so @dst may overlap @src provided it starts at least 16 bits later. */
 static void bit_copy(void *dst, unsigned int dst_off,
-                     void *src, unsigned int src_off,
+                     const void *src, unsigned int src_off,
                      unsigned int nr)
 {
-    uint8_t *s = src, *d = dst;
-    unsigned int i;
-    for (i = 0; i < nr; i++) {
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    unsigned int i, sh, nr_bytes;
+
+    /* Single bits until @dst is byte aligned. */
+    for (; nr && (dst_off & 7); nr--) {
+        uint8_t x = (s[src_off/8] >> (7-(src_off&7))) & 1;
+        d[dst_off/8] |= x << (7-(dst_off&7));
+        src_off++; dst_off++;
+    }
+
+    /* Whole bytes, shifting the source into alignment. */
+    s += src_off/8; d += dst_off/8;
+    sh = src_off & 7;
+    nr_bytes = nr/8;
+    if (sh == 0) {
+        for (i = 0; i < nr_bytes; i++)
+            d[i] |= s[i];
+    } else {
+        for (i = 0; i < nr_bytes; i++)
+            d[i] |= (s[i] << sh) | (s[i+1] >> (8-sh));
+    }
+
+    /* Trailing bits. */
+    src_off = sh; dst_off = 0;
+    s += nr_bytes; d += nr_bytes;
+    for (nr &= 7; nr; nr--) {
         uint8_t x = (s[src_off/8] >> (7-(src_off&7))) & 1;
         d[dst_off/8] |= x << (7-(dst_off&7));
         src_off++; dst_off++;
     }
 }
 
-static struct container *hfe_open(struct disk *d)
+/* The track LUT is parsed at open. Each track is demuxed, bit-reversed and
+ * (for HFEv3) has its opcodes interpreted only when its data is first needed
+ * (hfe_load()), directly from the mapped image file. */
+struct hfe_file {
+    bool_t v3;
+    struct hfe_trk {
+        uint32_t off;      /* of the cylinder in the file; 0 if stale */
+        uint32_t len;      /* bytes per side, padded to 256-byte blocks */
+        uint32_t index_bc; /* HFEv3: bitcell offset of the index mark */
+    } trk[0];
+};
+
+/* Serialises installation of decoded tracks. */
+static pthread_mutex_t hfe_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Byte @i of a side's data, interleaved with the other side's in 256-byte
+ * halves of each 512-byte block, switched to MSB first. */
+static uint8_t hfe_byte(const uint8_t *side, unsigned int i)
 {
-    struct disk_header dhdr;
-    struct track_header thdr;
-    struct disk_info *di;
-    unsigned int i, j, len;
-    uint8_t *tbuf, *raw_dat[2];
-    bool_t v3 = 0;
+    return bit_reverse_tab[side[(i & ~255u) * 2 + (i & 255)]];
+}
 
-    lseek(d->fd, 0, SEEK_SET);
+/* Number of literal (non-opcode) bytes of a side from byte @i, up to the end
+ * of its 256-byte half-block. Opcodes are 0xFx, so 0xF in the low nibble of
+ * the LSB-first file byte: search for them a word at a time. */
+static unsigned int hfe_v3_literals(const uint8_t *side, unsigned int i,
+                                    unsigned int len)
+{
+    const uint64_t lo = 0x0101010101010101ull, nib = lo * 0x0f;
+    const uint8_t *p = &side[(i & ~255u) * 2 + (i & 255)];
+    unsigned int n = 0, max = min(len, (i | 255u) + 1) - i;
+    uint64_t w;
+
+    for (; n + 8 <= max; n += 8) {
+        memcpy(&w, &p[n], 8);
+        w = (w & nib) ^ nib; /* zero byte <=> opcode */
+        if ((w - lo) & ~w & (lo << 7))
+            break;
+    }
+    while ((n < max) && ((p[n] & 0x0f) != 0x0f))
+        n++;
+    return n;
+}
 
-    read_exact(d->fd, &dhdr, sizeof(dhdr));
-    if (dhdr.formatrevision != 0)
-        return NULL;
-    if (!strncmp(dhdr.sig, "HXCHFEV3", sizeof(dhdr.sig))) {
-        v3 = 1;
-    } else if (strncmp(dhdr.sig, "HXCPICFE", sizeof(dhdr.sig))) {
-        return NULL;
+/* Walk the opcodes of an HFEv3 side to find its length and index offset. */
+static unsigned int hfe_v3_scan(const uint8_t *side, unsigned int len,
+                                uint32_t *index_bc)
+{
+    unsigned int inb = 0, outb = 0, opc, n;
+
+    *index_bc = 0;
+    while (inb < len) {
+        if ((n = hfe_v3_literals(side, inb, len)) != 0) {
+            inb += n; outb += n*8;
+            continue;
+        }
+        opc = hfe_byte(side, inb);
+        switch (opc & 0x0f) {
+        case OP_nop:
+            inb++;
+            break;
+        case OP_index:
+            inb++;
+            *index_bc = outb;
+            break;
+        case OP_bitrate:
+            inb += 2;
+            break;
+        case OP_skip: {
+            uint8_t skip = (inb+1 < len) ? hfe_byte(side, inb+1) : 0;
+            BUG_ON(skip > 8);
+            inb += 3; outb += 8-skip;
+            break;
+        }
+        default:
+            fprintf(stderr, "Unknown HFEv3 opcode %02x\n", opc);
+            BUG();
+        }
     }
 
-    dhdr.track_list_offset = le16toh(dhdr.track_list_offset);
+    return outb;
+}
 
-    d->di = di = memalloc(sizeof(*di));
-    di->nr_tracks = dhdr.nr_tracks * 2;
-    di->track = memalloc(di->nr_tracks * sizeof(struct track_info));
+/* Copy @nr bits from @src, at bit @pos of the track rotated so that the
+ * index mark is at bit 0. */
+static void hfe_v3_put(uint8_t *bits, unsigned int pos, unsigned int index_bc,
+                       unsigned int len_bc, const uint8_t *src,
+                       unsigned int src_off, unsigned int nr)
+{
+    unsigned int first;
 
-    for (i = 0; i < dhdr.nr_tracks; i++) {
-        lseek(d->fd, dhdr.track_list_offset*512 + i*4, SEEK_SET);
-        read_exact(d->fd, &thdr, 4);
-        thdr.offset = le16toh(thdr.offset);
-        thdr.len = le16toh(thdr.len);
-
-        /* Read into track buffer, padded up to 512-byte boundary. */
-        len = (thdr.len + 0x1ff) & ~0x1ff;
-        tbuf = memalloc(len);
-        lseek(d->fd, thdr.offset*512, SEEK_SET);
-        read_exact(d->fd, tbuf, len);
-        bit_reverse(tbuf, len);
-
-        /* Allocate track buffers and demux the data. */
-        raw_dat[0] = memalloc(len/2);
-        raw_dat[1] = memalloc(len/2);
-        for (j = 0; j < len; j += 512) {
-            memcpy(&raw_dat[0][j/2], &tbuf[j+  0], 256);
-            memcpy(&raw_dat[1][j/2], &tbuf[j+256], 256);
+    pos = (pos >= index_bc) ? pos - index_bc : pos + len_bc - index_bc;
+    first = min(len_bc - pos, nr);
+    bit_copy(bits, pos, src, src_off, first);
+    bit_copy(bits, 0, src, src_off + first, nr - first);
+}
+
+/* Set the speed of output bytes [@from,@to) from bitrate @br, rotated as the
+ * bitcells are. */
+static void hfe_v3_speed(uint16_t *speed, unsigned int nr_bytes,
+                         unsigned int rot, unsigned int from, unsigned int to,
+                         unsigned int br, unsigned int av_br)
+{
+    uint16_t v = br ? (br*SPEED_AVG + av_br/2) / av_br : SPEED_AVG;
+
+    for (to = min(to, nr_bytes); from < to; from++)
+        speed[(from + nr_bytes - rot) % nr_bytes] = v;
+}
+
+/* HFEv3: interpret opcodes into the track's bitcells and per-byte speeds.
+ * Runs of literal bytes are copied in bulk, and speeds are filled per run of
+ * constant bitrate. */
+static void hfe_v3_decode(const uint8_t *side, unsigned int len,
+                          unsigned int index_bc, unsigned int len_bc,
+                          uint16_t *speed, uint8_t *bits)
+{
+    unsigned int inb = 0, outb = 0, opc, n, i, nr_bytes = (len_bc + 7) / 8;
+    unsigned int rot = index_bc / 8, av_br, br = 0, br_from = 0;
+    uint8_t lit[256];
+
+    av_br = (7200000 + len_bc/2) / len_bc;
+
+    while (inb < len) {
+        if ((n = hfe_v3_literals(side, inb, len)) != 0) {
+            for (i = 0; i < n; i++)
+                lit[i] = hfe_byte(side, inb + i);
+            hfe_v3_put(bits, outb, index_bc, len_bc, lit, 0, n*8);
+            inb += n; outb += n*8;
+            continue;
         }
-        if (v3) {
-            /* HFEv3: process opcodes in the input byte stream. */
-            for (j = 0; j < 2; j++) {
-                uint8_t *new_dat = memalloc(len/2);
-                uint8_t br = 0, *brs = memalloc(len/2+1);
-                unsigned int inb = 0, outb = 0, opc, index_bc = 0, len_bc;
-                while (inb/8 < len/2) {
-                    brs[outb/8] = br;
-                    BUG_ON(inb & 7);
-                    opc = raw_dat[j][inb/8]; 
-                    if ((opc & 0xf0) == 0xf0) {
-                        switch (opc & 0x0f) {
-                        case OP_nop:
-                            inb += 8;
-                            break;
-                        case OP_index:
-                            inb += 8;
-                            index_bc = outb;
-                            break;
-                        case OP_bitrate:
-                            br = raw_dat[j][inb/8+1];
-                            inb += 2*8;
-                            break;
-                        case OP_skip: {
-                            uint8_t skip = raw_dat[j][inb/8+1];
-                            inb += 2*8 + skip;
-                            BUG_ON(skip > 8);
-                            bit_copy(new_dat, outb, raw_dat[j], inb, 8-skip);
-                            inb += 8-skip; outb += 8-skip;
-                            break;
-                        }
-                        default:
-                            fprintf(stderr,
-                                    "Unknown HFEv3 opcode %02x\n", opc);
-                            BUG();
-                        }
-                    } else {
-                        bit_copy(new_dat, outb, raw_dat[j], inb, 8);
-                        inb += 8; outb += 8;
-                    }
-                }
-                /* Rotate track so index pulse is at bit 0. */
-                brs[outb/8] = br;
-                len_bc = outb;
-                memset(raw_dat[j], 0, len/2);
-                bit_copy(raw_dat[j], 0, new_dat, index_bc, len_bc-index_bc);
-                bit_copy(raw_dat[j], len_bc-index_bc, new_dat, 0, index_bc); 
-                memfree(new_dat);
-                /* Set up the track. */
-                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
-                                        len_bc, raw_dat[j]);
-                /* HACK: Poke the non-uniform speed values. */
-                {
-                    uint16_t *s = (uint16_t *)d->di->track[i*2+j].dat;
-                    unsigned int k, av_br, cur_br;
-                    av_br = (7200000 + len_bc/2) / len_bc;
-                    for (k = 0; k < (outb+7)/8; k++) {
-                        cur_br = brs[(k+index_bc/8) % ((outb+7)/8)];
-                        s[k] = cur_br ? (cur_br*SPEED_AVG + av_br/2) / av_br
-                            : SPEED_AVG;
-                    }
-                }
-                memfree(raw_dat[j]);
-                memfree(brs);
-            }
-        } else {
-            /* Original HFE */
-            for (j = 0; j < 2; j++) {
-                setup_uniform_raw_track(d, i*2+j, TRKTYP_raw_dd,
-                                        thdr.len*4, raw_dat[j]);
-                memfree(raw_dat[j]);
+        opc = hfe_byte(side, inb);
+        switch (opc & 0x0f) {
+        case OP_bitrate:
+            /* The new bitrate applies from the current output byte. */
+            hfe_v3_speed(speed, nr_bytes, rot, br_from, outb/8, br, av_br);
+            br = (inb+1 < len) ? hfe_byte(side, inb+1) : 0;
+            br_from = outb/8;
+            inb += 2;
+            break;
+        case OP_skip: {
+            uint8_t skip = hfe_byte(side, inb+1);
+            if (inb+2 < len) {
+                lit[0] = hfe_byte(side, inb+2);
+                hfe_v3_put(bits, outb, index_bc, len_bc, lit, skip, 8-skip);
             }
+            inb += 3; outb += 8-skip;
+            break;
+        }
+        default: /* OP_nop, OP_index */
+            inb++;
+            break;
+        }
+    }
+
+    hfe_v3_speed(speed, nr_bytes, rot, br_from, nr_bytes, br, av_br);
+}
+
+static void hfe_load(struct disk *d, unsigned int tracknr)
+{
+    struct hfe_file *hfe = d->container_priv;
+    struct hfe_trk *trk;
+    struct track_info *ti = &d->di->track[tracknr];
+    const uint8_t *side;
+    unsigned int i, nr_bytes;
+    uint16_t *speed;
+    uint8_t *dat, *bits;
+
+    /* Only tracks as parsed at open: not those since rewritten. */
+    if ((hfe == NULL) || (hfe->trk[tracknr].off == 0) ||
+        (ti->type != TRKTYP_raw_dd))
+        return;
+
+    trk = &hfe->trk[tracknr];
+    side = (const uint8_t *)d->map.base + trk->off + (tracknr & 1) * 256;
+    nr_bytes = (ti->total_bits + 7) / 8;
+    dat = memalloc(ti->len);
+    speed = (uint16_t *)dat;
+    bits = dat + nr_bytes * 2;
+
+    if (hfe->v3 && ti->total_bits) {
+        hfe_v3_decode(side, trk->len, trk->index_bc, ti->total_bits,
+                      speed, bits);
+    } else {
+        for (i = 0; i < nr_bytes; i++) {
+            speed[i] = SPEED_AVG;
+            bits[i] = hfe_byte(side, i);
         }
+    }
+
+    pthread_mutex_lock(&hfe_load_lock);
+    if (ti->dat == NULL) {
+        ti->dat = dat;
+        dat = NULL;
+    }
+    pthread_mutex_unlock(&hfe_load_lock);
+
+    memfree(dat);
+}
+
+static struct container *hfe_open(struct disk *d)
+{
+    const struct disk_header *dhdr;
+    const struct track_header *thdr;
+    struct hfe_file *hfe;
+    struct disk_info *di;
+    struct track_info *ti;
+    const uint8_t *map;
+    unsigned int i, j, off, len, nr_bits;
+    off_t sz;
 
-        memfree(tbuf);
+    if ((sz = lseek(d->fd, 0, SEEK_END)) < (off_t)sizeof(*dhdr))
+        return NULL;
+    map = stream_map(&d->map, d->fd, 0, sz);
+    dhdr = (const struct disk_header *)map;
+
+    if ((dhdr->formatrevision != 0)
+        || (strncmp(dhdr->sig, "HXCHFEV3", sizeof(dhdr->sig))
+            && strncmp(dhdr->sig, "HXCPICFE", sizeof(dhdr->sig))))
+        goto fail;
+
+    off = le16toh(dhdr->track_list_offset) * 512;
+    if (off + dhdr->nr_tracks * sizeof(*thdr) > sz)
+        goto bad;
+    thdr = (const struct track_header *)(map + off);
+
+    d->di = di = memalloc(sizeof(*di));
+    di->nr_tracks = dhdr->nr_tracks * 2;
+    di->track = memalloc(di->nr_tracks * sizeof(struct track_info));
+    hfe = memalloc(sizeof(*hfe) + di->nr_tracks * sizeof(hfe->trk[0]));
+    hfe->v3 = !strncmp(dhdr->sig, "HXCHFEV3", sizeof(dhdr->sig));
+    d->container_priv = hfe;
+
+    for (i = 0; i < dhdr->nr_tracks; i++) {
+        off = le16toh(thdr[i].offset) * 512;
+        len = (le16toh(thdr[i].len) + 0x1ff) & ~0x1ff;
+        if ((off == 0) || (off + len > sz))
+            goto bad;
+        for (j = 0; j < 2; j++) {
+            struct hfe_trk *trk = &hfe->trk[i*2+j];
+            trk->off = off;
+            trk->len = len / 2;
+            nr_bits = hfe->v3
+                ? hfe_v3_scan(map + off + j*256, trk->len, &trk->index_bc)
+                : le16toh(thdr[i].len) * 4;
+            ti = &di->track[i*2+j];
+            init_track_info(ti, TRKTYP_raw_dd);
+            ti->len = ((nr_bits + 7) / 8) * 3;
+            ti->total_bits = nr_bits;
+            ti->data_bitoff = 0;
+        }
     }
 
     return &container_hfe;
+
+bad:
+    warnx("HFE: Bad track list");
+    if (d->di != NULL) {
+        memfree(d->container_priv);
+        d->container_priv = NULL;
+        memfree(d->di->track);
+        memfree(d->di);
+        d->di = NULL;
+    }
+fail:
+    stream_unmap(&d->map);
+    return NULL;
+}
+
+static int hfe_write_raw(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s)
+{
+    struct hfe_file *hfe = d->container_priv;
+
+    /* The track's data in the file is now stale. */
+    if (hfe != NULL) {
+        pthread_mutex_lock(&hfe_load_lock);
+        hfe->trk[tracknr].off = 0;
+        pthread_mutex_unlock(&hfe_load_lock);
+    }
+
+    return dsk_write_raw(d, tracknr, type, s);
 }
 
 static void write_bits(
@@ -236,35 +423,82 @@ static void write_bits(
     uint8_t *dst,
     unsigned int len)
 {
-    unsigned int i, bit;
-    uint8_t x;
+    unsigned int i, bit, nr, first;
+    uint8_t *lin = memalloc(len);
 
     /* Rotate the track so gap is at index. */
     bit = raw->write_splice_bc;
     if (bit > raw->data_start_bc)
         bit = 0; /* don't mess with an already-aligned track */
 
-    i = x = 0;
-    while (i < len*8) {
-        /* Consume a bit. */
-        x <<= 1;
-        x |= !!(raw->bits[bit>>3] & (0x80 >> (bit & 7)));
-        /* Deal with byte and block boundaries. */
-        if (!(++i & 7)) {
-            *dst++ = x;
-            /* Only half of each 512-byte block belongs to this track. */
-            if (!(i & (256*8-1)))
-                dst += 256;
+    nr = min(raw->bitlen, len*8);
+    first = min(raw->bitlen - bit, nr);
+    bit_copy(lin, 0, raw->bits, bit, first);
+    bit_copy(lin, first, raw->bits, 0, nr - first);
+
+    /* If we consumed all bits then repeat last 16 bits as extra gap. */
+    if ((nr >= 16) && (nr < len*8))
+        bit_copy(lin, nr, lin, nr - 16, len*8 - nr);
+
+    /* Only half of each 512-byte block belongs to this track. */
+    for (i = 0; i < len; i += 256)
+        memcpy(&dst[i*2], &lin[i], min(len - i, 256u));
+
+    memfree(lin);
+}
+
+/* Each cylinder is encoded independently into its own file blocks. */
+struct hfe_cyl {
+    uint8_t *dat;
+    unsigned int bytelen, len;
+    /* First non-uniform speed seen on each side, else 0. */
+    uint16_t bad_speed[2];
+};
+
+struct hfe_encode {
+    struct disk *d;
+    struct hfe_cyl *cyls;
+};
+
+static void hfe_encode_cyl(void *arg, unsigned int i)
+{
+    struct hfe_encode *enc = arg;
+    struct disk *d = enc->d;
+    struct hfe_cyl *cyl = &enc->cyls[i];
+    struct track_raw *raw[2];
+    unsigned int j, k, bitlen;
+
+    for (j = 0; j < 2; j++) {
+        raw[j] = track_alloc_raw_buffer(d);
+        track_read_raw(raw[j], i*2+j);
+        /* Unformatted tracks are random density, so skip speed check. 
+         * Also they are random length so do not share the track buffer 
+         * well with their neighbouring track on the same cylinder. Truncate 
+         * the random data to a default length. */
+        if (d->di->track[i*2+j].type == TRKTYP_unformatted) {
+            raw[j]->bitlen = min(raw[j]->bitlen, DEFAULT_BITS_PER_TRACK(d));
+            continue;
         }
-        /* Deal with wrap. */
-        if (++bit >= raw->bitlen)
-            bit = 0;
-        /* If we consumed all bits then repeat last 16 bits as extra gap. */
-        if ((i >= raw->bitlen) && !((i - raw->bitlen) & 15)) {
-            int new_bit = (int)bit - 16;
-            bit = (new_bit < 0) ? new_bit + raw->bitlen : new_bit;
+        /* HFE tracks are uniform density. */
+        for (k = 0; k < raw[j]->nr_speed_runs; k++) {
+            if (raw[j]->speed_runs[k].speed == 1000)
+                continue;
+            cyl->bad_speed[j] = raw[j]->speed_runs[k].speed;
+            break;
         }
     }
+
+    bitlen = max(raw[0]->bitlen, raw[1]->bitlen);
+    cyl->bytelen = ((bitlen + 7) / 8) * 2;
+    cyl->len = (cyl->bytelen + 0x1ff) & ~0x1ff;
+    cyl->dat = memalloc(cyl->len);
+
+    write_bits(raw[0], &cyl->dat[0], cyl->len/2);
+    write_bits(raw[1], &cyl->dat[256], cyl->len/2);
+    bit_reverse(cyl->dat, cyl->len);
+
+    track_free_raw_buffer(raw[0]);
+    track_free_raw_buffer(raw[1]);
 }
 
 static void hfe_close(struct disk *d)
@@ -273,43 +507,34 @@ static void hfe_close(struct disk *d)
     struct disk_info *di = d->di;
     struct disk_header *dhdr;
     struct track_header *thdr;
-    struct track_raw *_raw[di->nr_tracks], **raw = _raw;
-    unsigned int i, j, off, bitlen, bytelen, len;
+    struct hfe_encode enc;
+    unsigned int i, j, off, nr_cyls = di->nr_tracks / 2;
     bool_t is_st = di->nr_tracks && (di->track[0].type == TRKTYP_atari_st);
-    uint8_t *tbuf;
 
-    for (i = 0; i < di->nr_tracks; i++) {
-        raw[i] = track_alloc_raw_buffer(d);
-        track_read_raw(raw[i], i);
-        /* Unformatted tracks are random density, so skip speed check. 
-         * Also they are random length so do not share the track buffer 
-         * well with their neighbouring track on the same cylinder. Truncate 
-         * the random data to a default length. */
-        if (di->track[i].type == TRKTYP_unformatted) {
-            raw[i]->bitlen = min(raw[i]->bitlen, DEFAULT_BITS_PER_TRACK(d));
+    /* Synthesise and bit-pack every cylinder up front, in parallel. The file
+     * is then laid out in order. */
+    enc.d = d;
+    enc.cyls = memalloc(nr_cyls * sizeof(*enc.cyls));
+    disk_parallel(d, nr_cyls, hfe_encode_cyl, &enc);
+
+    for (i = 0; i < nr_cyls*2; i++) {
+        if ((j = enc.cyls[i/2].bad_speed[i&1]) == 0)
             continue;
-        }
-        /* HFE tracks are uniform density. */
-        for (j = 0; j < raw[i]->bitlen; j++) {
-            if (raw[i]->speed[j] == 1000)
-                continue;
-            fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
-                    "correctly written to an HFE file %u\n",
-                    i/2, i&1, raw[i]->speed[j]);
-            break;
-        }
+        fprintf(stderr, "*** T%u.%u: Variable-density track cannot be "
+                "correctly written to an HFE file %u\n", i/2, i&1, j);
     }
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    sink_rewind(d);
+    for (i = 0, off = 2*512; i < nr_cyls; i++)
+        off += enc.cyls[i].len;
+    sink_reserve(d, off);
 
     /* Block 0: Disk info. */
     memset(block, 0xff, 512);
     dhdr = (struct disk_header *)block;
     memcpy(dhdr->sig, "HXCPICFE", sizeof(dhdr->sig));
     dhdr->formatrevision = 0;
-    dhdr->nr_tracks = di->nr_tracks / 2;
+    dhdr->nr_tracks = nr_cyls;
     dhdr->nr_sides = 2;
     dhdr->track_encoding = is_st ? ENC_ISOIBM_MFM : ENC_Amiga_MFM;
     dhdr->bitrate = htole16(250);
@@ -317,46 +542,34 @@ static void hfe_close(struct disk *d)
     dhdr->interface_mode = is_st ? IFM_AtariST_DD : IFM_Amiga_DD;
     dhdr->rsvd = 1;
     dhdr->track_list_offset = htole16(1);
-    write_exact(d->fd, block, 512);
+    sink_write(d, block, 512);
 
     /* Block 1: Track LUT. */
     memset(block, 0xff, 512);
     thdr = (struct track_header *)block;
     off = 2;
-    for (i = 0; i < di->nr_tracks/2; i++) {
-        bitlen = max(raw[i*2]->bitlen, raw[i*2+1]->bitlen);
-        bytelen = ((bitlen + 7) / 8) * 2;
+    for (i = 0; i < nr_cyls; i++) {
         thdr->offset = htole16(off);
-        thdr->len = htole16(bytelen);
-        off += (bytelen + 0x1ff) >> 9;
+        thdr->len = htole16(enc.cyls[i].bytelen);
+        off += (enc.cyls[i].bytelen + 0x1ff) >> 9;
         thdr++;
     }
-    write_exact(d->fd, block, 512);
-
-    for (i = 0; i < di->nr_tracks/2; i++) {
-        bitlen = max(raw[0]->bitlen, raw[1]->bitlen);
-        bytelen = ((bitlen + 7) / 8) * 2;
-        len = (bytelen + 0x1ff) & ~0x1ff;
-        tbuf = memalloc(len);
+    sink_write(d, block, 512);
 
-        write_bits(raw[0], &tbuf[0], len/2);
-        write_bits(raw[1], &tbuf[256], len/2);
-
-        bit_reverse(tbuf, len);
-        write_exact(d->fd, tbuf, len);
-        memfree(tbuf);
-
-        track_free_raw_buffer(raw[0]);
-        track_free_raw_buffer(raw[1]);
-        raw += 2;
+    for (i = 0; i < nr_cyls; i++) {
+        sink_write(d, enc.cyls[i].dat, enc.cyls[i].len);
+        memfree(enc.cyls[i].dat);
     }
+
+    memfree(enc.cyls);
 }
 
 struct container container_hfe = {
     .init = hfe_init,
     .open = hfe_open,
     .close = hfe_close,
-    .write_raw = dsk_write_raw
+    .write_raw = hfe_write_raw,
+    .load = hfe_load
 };
 
 /*
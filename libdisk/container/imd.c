@@ -29,31 +29,50 @@ enum {
     MODE_mfm_250kbps = 5
 };
 
+/* Cursor over an image file mapped in full. */
+struct imd_in {
+    const uint8_t *p, *end;
+};
+
+static const uint8_t *imd_take(struct imd_in *in, size_t n)
+{
+    const uint8_t *p = in->p;
+    if (n > (size_t)(in->end - p))
+        return NULL;
+    in->p += n;
+    return p;
+}
+
 static struct container *imd_open(struct disk *d)
 {
-    char hdr[1024], *p;
+    struct stream_map map = { 0 };
+    struct imd_in in;
+    const uint8_t *base, *p, *q;
     uint8_t secs[256], cyls[256], heads[256], marks[256], c, *dat = NULL;
     struct track_header thdr;
-    struct disk_info *di;
-    unsigned int i, off, trk, sec_sz, type;
+    struct disk_info *di = NULL;
+    unsigned int i, trk, sec_sz, type;
     off_t sz;
 
     sz = lseek(d->fd, 0, SEEK_END);
     lseek(d->fd, 0, SEEK_SET);
-
-    read_exact(d->fd, hdr, sizeof(hdr));
-    if (strncmp(hdr, "IMD ", 4))
+    if (sz < 4)
         return NULL;
 
-    for (i = 0; !(p = memchr(hdr, 0x1a, sizeof(hdr))) && (i < 5); i++)
-        read_exact(d->fd, hdr, sizeof(hdr));
+    /* Parse the whole image from memory, rather than a record at a time. */
+    base = stream_map(&map, d->fd, 0, sz);
+    in.p = base;
+    in.end = base + sz;
+
+    if (strncmp((const char *)base, "IMD ", 4))
+        goto out;
+
+    p = memchr(base, 0x1a, min_t(size_t, sz, 6*1024));
     if (!p) {
         warnx("IMD: Cannot find comment terminator char");
-        return NULL;
+        goto out;
     }
-
-    off = i*sizeof(hdr) + (p-hdr) + 1;
-    lseek(d->fd, off, SEEK_SET);
+    in.p = p + 1;
 
     d->di = di = memalloc(sizeof(*di));
     di->nr_tracks = 168;
@@ -65,9 +84,10 @@ static struct container *imd_open(struct disk *d)
         ti->total_bits = TRK_WEAK;
     }
 
-    while (off < sz) {
-        read_exact(d->fd, &thdr, sizeof(thdr));
-        off += sizeof(thdr);
+    while (in.p != in.end) {
+        if (!(p = imd_take(&in, sizeof(thdr))))
+            goto eof;
+        memcpy(&thdr, p, sizeof(thdr));
 
         switch (thdr.mode) {
         case MODE_fm_500kbps:
@@ -103,8 +123,9 @@ static struct container *imd_open(struct disk *d)
         }
         sec_sz = 128u << thdr.sec_sz;
 
-        read_exact(d->fd, secs, thdr.nr_secs);
-        off += thdr.nr_secs;
+        if (!(p = imd_take(&in, thdr.nr_secs)))
+            goto eof;
+        memcpy(secs, p, thdr.nr_secs);
 
         if (thdr.head & 0x3e) {
             warnx("IMD: Unexpected track head value 0x%02x", thdr.head);
@@ -113,20 +134,23 @@ static struct container *imd_open(struct disk *d)
 
         memset(cyls, thdr.cyl, thdr.nr_secs);
         if (thdr.head & 0x80) {
-            read_exact(d->fd, cyls, thdr.nr_secs);
-            off += thdr.nr_secs;
+            if (!(p = imd_take(&in, thdr.nr_secs)))
+                goto eof;
+            memcpy(cyls, p, thdr.nr_secs);
         }
 
         memset(heads, thdr.head&1, thdr.nr_secs);
         if (thdr.head & 0x40) {
-            read_exact(d->fd, heads, thdr.nr_secs);
-            off += thdr.nr_secs;
+            if (!(p = imd_take(&in, thdr.nr_secs)))
+                goto eof;
+            memcpy(heads, p, thdr.nr_secs);
         }
 
         dat = memalloc(thdr.nr_secs * sec_sz);
         for (i = 0; i < thdr.nr_secs; i++) {
-            read_exact(d->fd, &c, 1);
-            off += 1;
+            if (!(p = imd_take(&in, 1)))
+                goto eof;
+            c = *p;
             if (c > 8) {
                 warnx("IMD: trk %u, sec %u: Bad data tag 0x%02x", trk, i, c);
                 goto cleanup_error;
@@ -143,16 +167,16 @@ static struct container *imd_open(struct disk *d)
             switch (c) {
             case 0:
                 warnx("IMD: trk %u, sec %u: Sector data unavailable", trk, i);
-                memset(&dat[i*sec_sz], 0, sec_sz);
                 break;
             case 1:
-                read_exact(d->fd, &dat[i*sec_sz], sec_sz);
-                off += sec_sz;
+                if (!(q = imd_take(&in, sec_sz)))
+                    goto eof;
+                memcpy(&dat[i*sec_sz], q, sec_sz);
                 break;
             case 2:
-                read_exact(d->fd, &c, 1);
-                off += 1;
-                memset(&dat[i*sec_sz], c, sec_sz);
+                if (!(q = imd_take(&in, 1)))
+                    goto eof;
+                memset(&dat[i*sec_sz], *q, sec_sz);
                 break;
             default:
                 BUG();
@@ -166,13 +190,11 @@ static struct container *imd_open(struct disk *d)
         dat = NULL;
     }
 
-    if (off != sz) {
-        warnx("IMD: Unexpected EOF");
-        goto cleanup_error;
-    }
-
+    stream_unmap(&map);
     return &container_imd;
 
+eof:
+    warnx("IMD: Unexpected EOF");
 cleanup_error:
     memfree(dat);
     for (i = 0; i < di->nr_tracks; i++)
@@ -180,24 +202,58 @@ cleanup_error:
     memfree(di->track);
     memfree(di);
     d->di = NULL;
+out:
+    stream_unmap(&map);
     return NULL;
 }
 
+/* The output image is accumulated in memory and written in one go. */
+struct imd_out {
+    uint8_t *p;
+    size_t len, size;
+};
+
+static uint8_t *imd_reserve(struct imd_out *out, size_t n)
+{
+    uint8_t *p;
+    if ((out->len + n) > out->size) {
+        out->size = max_t(size_t, out->size * 2, out->len + n);
+        p = memalloc(out->size);
+        if (out->p != NULL)
+            memcpy(p, out->p, out->len);
+        memfree(out->p);
+        out->p = p;
+    }
+    return out->p + out->len;
+}
+
+static void imd_put(struct imd_out *out, const void *p, size_t n)
+{
+    memcpy(imd_reserve(out, n), p, n);
+    out->len += n;
+}
+
+/* Are all @n bytes at @p the same? Comparing the buffer against itself, one
+ * byte along, lets memcmp() do the work a vector at a time. */
+static bool_t is_uniform(const uint8_t *p, unsigned int n)
+{
+    return !memcmp(p, p+1, n-1);
+}
+
 static void imd_close(struct disk *d)
 {
     struct disk_info *di = d->di;
     struct track_info *ti;
     struct track_header thdr;
-    uint8_t *secs, *cyls, *heads, *nos, *marks, *dat, c;
-    uint16_t *crcs;
+    struct imd_out out = { 0 };
+    const struct ibm_sector_view *v;
+    uint8_t c;
     char timestr[30], sig[128];
     struct tm tm;
     time_t t;
-    unsigned int i, trk, sec, sec_sz;
+    unsigned int trk, sec, sec_sz;
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    sink_rewind(d);
 
     t = time(NULL);
     localtime_r(&t, &tm);
@@ -206,7 +262,7 @@ static void imd_close(struct disk *d)
              "IMD 1.16: %s\r\nCreated by "
              "https://github.com/keirf/Disk-Utilities\r\n\x1a",
              timestr);
-    write_exact(d->fd, sig, strlen(sig));
+    imd_put(&out, sig, strlen(sig));
 
     for (trk = 0; trk < di->nr_tracks; trk++) {
         ti = &di->track[trk];
@@ -241,61 +297,51 @@ static void imd_close(struct disk *d)
             continue;
         }
 
-        retrieve_ibm_mfm_track(
-            d, trk, &secs, &cyls, &heads, &nos, &marks, &crcs, &dat);
+        v = ibm_sector_view(d, trk);
 
         thdr.cyl = cyl(trk);
         thdr.head = hd(trk);
         thdr.nr_secs = ti->nr_sectors;
-        thdr.sec_sz = nos[0];
+        thdr.sec_sz = v->nos[0];
         sec_sz = 128u << thdr.sec_sz;
         
         for (sec = 0; sec < ti->nr_sectors; sec++) {
-            if (nos[sec] != thdr.sec_sz) {
+            if (v->nos[sec] != thdr.sec_sz) {
                 warnx("T%u.%u: Cannot write mixed-sized sectors to IMD file",
                       cyl(trk), hd(trk));
                 break;
             }
-            if (cyls[sec] != thdr.cyl)
+            if (v->cyls[sec] != thdr.cyl)
                 thdr.head |= 0x80;
-            if (heads[sec] != (thdr.head&1))
+            if (v->heads[sec] != (thdr.head&1))
                 thdr.head |= 0x40;
         }
 
         if (sec == ti->nr_sectors) {
-            write_exact(d->fd, &thdr, sizeof(thdr));
-            write_exact(d->fd, secs, ti->nr_sectors);
+            imd_put(&out, &thdr, sizeof(thdr));
+            imd_put(&out, v->secs, ti->nr_sectors);
             if (thdr.head & 0x80)
-                write_exact(d->fd, cyls, ti->nr_sectors);
+                imd_put(&out, v->cyls, ti->nr_sectors);
             if (thdr.head & 0x40)
-                write_exact(d->fd, heads, ti->nr_sectors);
+                imd_put(&out, v->heads, ti->nr_sectors);
             for (sec = 0; sec < ti->nr_sectors; sec++) {
-                c = (marks[sec] == IBM_MARK_DAM) ? 1 : 3;
-                /* Check for identical bytes throughout sector. */
-                for (i = 0; i < sec_sz; i++)
-                    if (dat[sec*sec_sz+i] != dat[sec*sec_sz])
-                        break;
-                if (i == sec_sz) {
+                c = (v->marks[sec] == IBM_MARK_DAM) ? 1 : 3;
+                if (is_uniform(&v->dat[sec*sec_sz], sec_sz)) {
                     /* All bytes match: write compressed sector. */
                     c += 1;
-                    write_exact(d->fd, &c, 1);
-                    write_exact(d->fd, &dat[sec*sec_sz], 1);
+                    imd_put(&out, &c, 1);
+                    imd_put(&out, &v->dat[sec*sec_sz], 1);
                 } else {
                     /* Mismatching bytes found: write ordinary sector. */
-                    write_exact(d->fd, &c, 1);
-                    write_exact(d->fd, &dat[sec*sec_sz], sec_sz);
+                    imd_put(&out, &c, 1);
+                    imd_put(&out, &v->dat[sec*sec_sz], sec_sz);
                 }
             }
         }
-
-        memfree(secs);
-        memfree(cyls);
-        memfree(heads);
-        memfree(nos);
-        memfree(marks);
-        memfree(crcs);
-        memfree(dat);
     }
+
+    sink_write(d, out.p, out.len);
+    memfree(out.p);
 }
 
 struct container container_imd = {
@@ -26,15 +26,13 @@ static void img_close(struct disk *d)
     struct disk_info *di = d->di;
     struct track_sectors *sectors;
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    sink_rewind(d);
 
     sectors = track_alloc_sector_buffer(d);
     for (i = 0; i < di->nr_tracks; i++) {
         if (track_read_sectors(sectors, i) != 0)
             continue;
-        write_exact(d->fd, sectors->data, sectors->nr_bytes);
+        sink_write(d, sectors->data, sectors->nr_bytes);
     }
     track_free_sector_buffer(sectors);
 }
@@ -1,7 +1,8 @@
 /*
  * libdisk/container_ipf.c
  * 
- * Write-only SPS/CAPS IPF support.
+ * Read/write SPS/CAPS IPF support. Images are read natively: the IPF decoder
+ * library is not needed.
  * 
  * Written in 2011 by Keir Fraser
  */
@@ -128,6 +129,10 @@ struct ipf_tbuf {
     unsigned int decoded_bits;
     unsigned int blockstart;
     unsigned int chunkstart, chunktype;
+    /* Header bytes reserved at chunkstart, sized by the count length of the
+     * previous chunk of each type. */
+    unsigned int chunkhdr;
+    uint8_t cntlen_hint[chkFlaky+1];
     unsigned int nr_blks, nr_sync;
     uint32_t encoder;
     bool_t need_sps_encoder;
@@ -141,9 +146,10 @@ struct ipf_tbuf {
 static void ipf_tbuf_finish_chunk(
     struct ipf_tbuf *ibuf, unsigned int new_chunktype)
 {
-    unsigned int chunklen, cntlen, i, j;
+    unsigned int body, chunklen, cntlen, hdrlen, i, j;
 
-    chunklen = ibuf->len - ibuf->chunkstart;
+    body = ibuf->chunkstart + ibuf->chunkhdr;
+    chunklen = ibuf->len - body;
     if (ibuf->encoder == ENC_SPS)
         chunklen = chunklen*8 + ibuf->bits;
     else if (ibuf->bits != 0)
@@ -154,20 +160,34 @@ static void ipf_tbuf_finish_chunk(
         ibuf->bits = 0;
     }
 
-    if (chunklen == 0)
+    if (chunklen == 0) {
+        /* Give back the unused header reservation. */
+        memmove(&ibuf->dat[ibuf->chunkstart], &ibuf->dat[body],
+                ibuf->len - body);
+        ibuf->len -= ibuf->chunkhdr;
+        memset(&ibuf->dat[ibuf->len], 0, ibuf->chunkhdr);
         goto out;
+    }
 
     if (ibuf->chunktype == chkFlaky)
-        ibuf->len = ibuf->chunkstart;
+        ibuf->len = body;
 
     for (i = chunklen, cntlen = 0; i > 0; i >>= 8)
         cntlen++;
-    memmove(&ibuf->dat[ibuf->chunkstart + 1 + cntlen],
-            &ibuf->dat[ibuf->chunkstart], ibuf->len - ibuf->chunkstart);
+    ibuf->cntlen_hint[ibuf->chunktype] = cntlen;
+
+    /* The body only moves if the reserved header was the wrong size. */
+    hdrlen = 1 + cntlen;
+    if (hdrlen != ibuf->chunkhdr) {
+        memmove(&ibuf->dat[ibuf->chunkstart + hdrlen], &ibuf->dat[body],
+                ibuf->len - body);
+        ibuf->len = ibuf->len + hdrlen - ibuf->chunkhdr;
+        if (hdrlen < ibuf->chunkhdr)
+            memset(&ibuf->dat[ibuf->len], 0, ibuf->chunkhdr - hdrlen);
+    }
     ibuf->dat[ibuf->chunkstart] = ibuf->chunktype | (cntlen << 5);
     for (i = chunklen, j = 0; i > 0; i >>= 8, j++)
         ibuf->dat[ibuf->chunkstart + cntlen - j] = (uint8_t)i;
-    ibuf->len += 1 + cntlen;
 
     if ((new_chunktype == chkEnd) ||
         ((new_chunktype == chkSync) && ibuf->nr_sync++ &&
@@ -192,6 +212,10 @@ static void ipf_tbuf_finish_chunk(
 out:
     ibuf->chunkstart = ibuf->len;
     ibuf->chunktype = new_chunktype;
+    /* Nothing is written into an end chunk: the next chunk replaces it. */
+    ibuf->chunkhdr = (new_chunktype == chkEnd)
+        ? 0 : 1 + (ibuf->cntlen_hint[new_chunktype] ?: 1);
+    ibuf->len += ibuf->chunkhdr;
 }
 
 static void ipf_tbuf_bit(
@@ -245,12 +269,340 @@ static void ipf_tbuf_weak(
     ibuf->bits = bits&7;
 }
 
+/* Tracks are parsed at open, and their DATA areas are checked against their
+ * CRCs. Each track is decoded to raw bitcells only when its data is first
+ * needed (ipf_load()), directly from the mapped image file. */
+struct ipf_file {
+    uint32_t encoder;
+    struct ipf_trk {
+        uint32_t dat_chunk;
+        uint32_t off;  /* of the DATA area in the file; 0 if none */
+        uint32_t size; /* of the DATA area */
+        uint32_t blkcnt;
+    } trk[0];
+};
+
+/* Serialises installation of decoded tracks. */
+static pthread_mutex_t ipf_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t ipf_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Field @f of the big-endian structure of type @t at @p. */
+#define ipf_field(p, t, f) ipf_be32((const uint8_t *)(p) + offsetof(t, f))
+
+/* Raw track under construction, in the layout of TRKTYP_raw_dd: a speed per
+ * byte, then the bitcells. */
+struct ipf_cells {
+    uint16_t *speed;
+    uint8_t *bits;
+    uint32_t pos, nr;
+    uint8_t prev; /* previous bitcell */
+};
+
+/* Append the @n (at most 32) least significant bits of @x, MSB first. */
+static void ipf_cells(struct ipf_cells *c, uint32_t x, unsigned int n)
+{
+    unsigned int k, off;
+
+    if (n > c->nr - c->pos) {
+        x >>= n - (c->nr - c->pos);
+        n = c->nr - c->pos;
+    }
+    if (n == 0)
+        return;
+    c->prev = x & 1;
+
+    while (n != 0) {
+        off = c->pos & 7;
+        k = min(8 - off, n);
+        c->bits[c->pos >> 3] |= ((x >> (n - k)) & ((1u << k) - 1))
+            << (8 - off - k);
+        c->pos += k;
+        n -= k;
+    }
+}
+
+/* MFM-encode the @n most significant bits of byte @b: each clock bit is set
+ * only between two zero data bits. */
+static void ipf_data_bits(struct ipf_cells *c, uint8_t b, unsigned int n)
+{
+    uint32_t x = mfm_encode_word((c->prev << 16) | (b << 8)) >> 16;
+    ipf_cells(c, x >> (16 - 2*n), 2*n);
+}
+
+static void ipf_weak_bits(struct ipf_cells *c, uint32_t n)
+{
+    uint32_t pos = c->pos;
+
+    for (; n >= 8; n -= 8)
+        ipf_data_bits(c, 0, 8);
+    ipf_data_bits(c, 0, n);
+    for (; pos < c->pos; pos += 8)
+        c->speed[pos >> 3] = SPEED_WEAK;
+    if (c->pos & 7)
+        c->speed[(c->pos - 1) >> 3] = SPEED_WEAK;
+}
+
+/* Decode one block's chunks, from @p up to at most @end. Returns -1 if the
+ * stream is malformed. */
+static int ipf_decode_block(
+    struct ipf_cells *c, const uint8_t *p, const uint8_t *end,
+    bool_t count_bits)
+{
+    unsigned int code, cntlen, i;
+    uint32_t count;
+
+    for (;;) {
+        if (p >= end)
+            return -1;
+        code = *p & 0x1f;
+        cntlen = *p++ >> 5;
+        if (code == chkEnd)
+            return 0;
+        if ((cntlen > 4) || (end - p < cntlen))
+            return -1;
+        for (count = i = 0; i < cntlen; i++)
+            count = (count << 8) | *p++;
+        if (!count_bits)
+            count *= 8;
+        /* Flaky data has no stream bytes: it reads differently every time. */
+        if ((code != chkFlaky) && ((end - p) < ceil_bits_to_bytes(count)))
+            return -1;
+        switch (code) {
+        case chkSync: case chkRaw:
+            for (i = 0; i < count/8; i++)
+                ipf_cells(c, p[i], 8);
+            if (count % 8)
+                ipf_cells(c, p[i] >> (8 - count%8), count%8);
+            break;
+        case chkData: case chkGap:
+            for (i = 0; i < count/8; i++)
+                ipf_data_bits(c, p[i], 8);
+            if (count % 8)
+                ipf_data_bits(c, p[i], count%8);
+            break;
+        case chkFlaky:
+            ipf_weak_bits(c, count);
+            continue;
+        default:
+            return -1;
+        }
+        p += ceil_bits_to_bytes(count);
+    }
+}
+
+/* Decode a track to raw bitcells, starting at its data_bitoff. Each block's
+ * data is padded or cut to its blockbits, and followed by its gap, filled
+ * with its gap value. */
+static void *ipf_decode_track(struct disk *d, unsigned int tracknr)
+{
+    struct ipf_file *ipf = d->container_priv;
+    struct ipf_trk *trk = &ipf->trk[tracknr];
+    struct track_info *ti = &d->di->track[tracknr];
+    const uint8_t *area = (const uint8_t *)d->map.base + trk->off;
+    const uint8_t *blk, *end = area + trk->size;
+    struct ipf_cells c = { 0 };
+    unsigned int i, nr_bytes = ceil_bits_to_bytes(ti->total_bits);
+    uint32_t target, off, gapbits, gapvalue;
+    bool_t bad = 0;
+
+    c.speed = memalloc(ti->len);
+    c.bits = (uint8_t *)(c.speed + nr_bytes);
+    c.nr = ti->total_bits;
+    for (i = 0; i < nr_bytes; i++)
+        c.speed[i] = SPEED_AVG;
+
+    for (i = 0; i < trk->blkcnt; i++) {
+        blk = area + i * sizeof(struct ipf_block);
+        target = c.pos + ipf_field(blk, struct ipf_block, blockbits);
+        off = ipf_field(blk, struct ipf_block, dataoffset);
+        c.nr = min(target, ti->total_bits);
+        if ((off >= trk->size) ||
+            ipf_decode_block(&c, area + off, end,
+                             !!(ipf_field(blk, struct ipf_block, flag) & 4)))
+            bad = 1;
+        c.pos = c.nr;
+        c.nr = ti->total_bits;
+        gapbits = ipf_field(blk, struct ipf_block, gapbits) / 2;
+        gapvalue = ipf_field(blk, struct ipf_block, gapvalue);
+        for (; gapbits >= 8; gapbits -= 8)
+            ipf_data_bits(&c, gapvalue, 8);
+        ipf_data_bits(&c, gapvalue, gapbits);
+    }
+
+    if (bad)
+        trk_warn(ti, tracknr, "IPF: Bad data stream");
+
+    return c.speed;
+}
+
+static void ipf_load(struct disk *d, unsigned int tracknr)
+{
+    struct ipf_file *ipf = d->container_priv;
+    struct track_info *ti = &d->di->track[tracknr];
+    void *dat;
+
+    /* Only tracks as parsed at open: not those since rewritten. */
+    if ((ipf == NULL) || (ipf->trk[tracknr].off == 0) ||
+        (ti->type != TRKTYP_raw_dd))
+        return;
+
+    dat = ipf_decode_track(d, tracknr);
+
+    pthread_mutex_lock(&ipf_load_lock);
+    if (ti->dat == NULL) {
+        ti->dat = dat;
+        dat = NULL;
+    }
+    pthread_mutex_unlock(&ipf_load_lock);
+
+    memfree(dat);
+}
+
 static struct container *ipf_open(struct disk *d)
 {
-    /* not supported */
+    struct ipf_file *ipf = NULL;
+    struct ipf_trk *trk;
+    struct track_info *ti;
+    const uint8_t *map, *p, *rec;
+    uint8_t zero[4] = { 0 };
+    uint32_t len, crc, dsize, chunk, bits, maxcyl = 0, nr_tracks;
+    unsigned int i, cyl, head;
+    size_t off;
+    off_t sz;
+
+    if ((sz = lseek(d->fd, 0, SEEK_END)) < (off_t)sizeof(struct ipf_header))
+        return NULL;
+    map = stream_map(&d->map, d->fd, 0, sz);
+    if (memcmp(map, "CAPS", 4))
+        goto fail;
+
+    /* Walk the records, checking each one's CRC. The INFO record precedes
+     * the IMGE and DATA records, and sizes the disk. */
+    for (off = 0; sz - off >= sizeof(struct ipf_header); off += len) {
+        rec = map + off;
+        p = rec + sizeof(struct ipf_header);
+        len = ipf_field(rec, struct ipf_header, len);
+        if ((len < sizeof(struct ipf_header)) || (len > sz - off))
+            goto bad;
+        crc = crc32(rec, offsetof(struct ipf_header, crc));
+        crc = crc32_add(zero, sizeof(zero), crc);
+        crc = crc32_add(p, len - sizeof(struct ipf_header), crc);
+        if (crc != ipf_field(rec, struct ipf_header, crc))
+            goto bad;
+
+        if (!memcmp(rec, "INFO", 4)) {
+            if ((ipf != NULL) || (len - sizeof(struct ipf_header)
+                                  != sizeof(struct ipf_info)))
+                goto bad;
+            maxcyl = ipf_field(p, struct ipf_info, maxcyl);
+            if (maxcyl > 255)
+                goto bad;
+            nr_tracks = (maxcyl + 1) * 2;
+            _dsk_init(d, nr_tracks);
+            ipf = memalloc(sizeof(*ipf) + nr_tracks * sizeof(*trk));
+            ipf->encoder = ipf_field(p, struct ipf_info, encoder);
+            if ((ipf->encoder != ENC_CAPS) && (ipf->encoder != ENC_SPS))
+                goto bad;
+        } else if (!memcmp(rec, "IMGE", 4)) {
+            if ((ipf == NULL) || (len - sizeof(struct ipf_header)
+                                  != sizeof(struct ipf_img)))
+                goto bad;
+            cyl = ipf_field(p, struct ipf_img, cyl);
+            head = ipf_field(p, struct ipf_img, head);
+            if ((cyl > maxcyl) || (head > 1))
+                goto bad;
+            i = cyl*2 + head;
+            trk = &ipf->trk[i];
+            ti = &d->di->track[i];
+            /* Variable-density tracks (Copylock, Speedlock) need their
+             * density map: leave the whole image to the CAPS stream. */
+            if (ipf_field(p, struct ipf_img, dentype) > denUniform)
+                goto fail;
+            trk->dat_chunk = ipf_field(p, struct ipf_img, dat_chunk);
+            trk->blkcnt = ipf_field(p, struct ipf_img, blkcnt);
+            bits = ipf_field(p, struct ipf_img, trkbits);
+            if ((trk->blkcnt == 0) || (bits == 0) || (bits > 8*256*1024)) {
+                /* Noise, or no data: leave the track unformatted. */
+                trk->blkcnt = 0;
+            } else {
+                init_track_info(ti, TRKTYP_raw_dd);
+                ti->total_bits = bits;
+                ti->len = ceil_bits_to_bytes(bits) * 3;
+                ti->data_bitoff = ipf_field(p, struct ipf_img, startbit)
+                    % bits;
+            }
+        } else if (!memcmp(rec, "DATA", 4)) {
+            if ((ipf == NULL) || (len - sizeof(struct ipf_header)
+                                  != sizeof(struct ipf_data)))
+                goto bad;
+            /* The data area follows the record. */
+            dsize = ipf_field(p, struct ipf_data, size);
+            if (dsize > sz - off - len)
+                goto bad;
+            if (crc32(map + off + len, dsize)
+                != ipf_field(p, struct ipf_data, dcrc))
+                goto bad;
+            chunk = ipf_field(p, struct ipf_data, dat_chunk);
+            for (i = 0; i < d->di->nr_tracks; i++) {
+                trk = &ipf->trk[i];
+                if (!trk->blkcnt || (trk->dat_chunk != chunk))
+                    continue;
+                if (trk->blkcnt > dsize / sizeof(struct ipf_block))
+                    goto bad;
+                trk->off = off + len;
+                trk->size = dsize;
+            }
+            len += dsize;
+        }
+    }
+
+    if (ipf == NULL)
+        goto fail;
+
+    /* Tracks described but with no data area read as unformatted. */
+    for (i = 0; i < d->di->nr_tracks; i++)
+        if ((ipf->trk[i].off == 0) &&
+            (d->di->track[i].type != TRKTYP_unformatted))
+            track_mark_unformatted(d, i);
+
+    d->container_priv = ipf;
+    return &container_ipf;
+
+bad:
+    warnx("IPF: Bad record at offset %lu", (unsigned long)off);
+fail:
+    if (ipf != NULL) {
+        memfree(ipf);
+        for (i = 0; i < d->di->nr_tracks; i++)
+            track_free_data(d, &d->di->track[i]);
+        memfree(d->di->track);
+        memfree(d->di);
+        d->di = NULL;
+    }
+    stream_unmap(&d->map);
     return NULL;
 }
 
+static int ipf_write_raw(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s)
+{
+    struct ipf_file *ipf = d->container_priv;
+
+    /* The track's data in the file is now stale. */
+    if (ipf != NULL) {
+        pthread_mutex_lock(&ipf_load_lock);
+        ipf->trk[tracknr].off = 0;
+        pthread_mutex_unlock(&ipf_load_lock);
+    }
+
+    return dsk_write_raw(d, tracknr, type, s);
+}
+
 static void ipf_write_chunk(
     struct disk *d, const char *id, const void *dat, size_t dat_len)
 {
@@ -267,29 +619,142 @@ static void ipf_write_chunk(
     crc = crc32_add(_dat, dat_len, crc);
     ipf_header.crc = htobe32(crc);
 
-    write_exact(d->fd, &ipf_header, sizeof(ipf_header));
-    write_exact(d->fd, _dat, dat_len);
+    sink_write(d, &ipf_header, sizeof(ipf_header));
+    sink_write(d, _dat, dat_len);
 
     memfree(_dat);
 }
 
+/* Tracks are encoded independently, each into its own fixed-size slot of
+ * the block and data arrays. The file is then laid out in track order. */
+struct ipf_encode {
+    struct disk *d;
+    uint32_t encoder;
+    struct ipf_img *img;
+    struct ipf_data *idata;
+    struct ipf_block *blk;
+    uint8_t *dat;
+    struct ipf_track {
+        unsigned int len;
+        unsigned int src; /* track whose blocks and data are written */
+        bool_t is_var_density;
+        bool_t need_sps_encoder;
+    } *trk;
+    /* Tracks beyond the first which needs the SPS encoder are not needed. */
+    pthread_mutex_t lock;
+    unsigned int first_sps;
+};
+
+static void ipf_encode_track(void *arg, unsigned int i)
+{
+    struct ipf_encode *enc = arg;
+    struct disk *d = enc->d;
+    struct track_info *ti = &d->di->track[i];
+    struct ipf_img *img = &enc->img[i];
+    struct ipf_data *idata = &enc->idata[i];
+    struct ipf_block *blk = &enc->blk[i * MAX_BLOCKS_PER_TRACK];
+    uint8_t *dat = &enc->dat[i * MAX_DATA_PER_TRACK];
+    struct ipf_track *trk = &enc->trk[i];
+    struct ipf_tbuf ibuf;
+    unsigned int j;
+
+    /* Unformatted tracks are handled by the IPF decoder library. */
+    if ((int)ti->total_bits < 0)
+        return;
+
+    pthread_mutex_lock(&enc->lock);
+    j = enc->first_sps;
+    pthread_mutex_unlock(&enc->lock);
+    if (i > j)
+        return;
+
+    memset(&ibuf, 0, sizeof(ibuf));
+    ibuf.encoder = enc->encoder;
+
+    /* Basic track metadata. */
+    img->dentype = 
+        track_is_copylock(ti) ? denCopylock :
+        (ti->type == TRKTYP_speedlock) ? denSpeedlock :
+        denUniform;
+    img->startbit = ti->data_bitoff - PREPEND_BITS;
+    if ((int)img->startbit < 0)
+        img->startbit += ti->total_bits;
+    img->startpos = floor_bits_to_bytes(img->startbit);
+    img->trkbits = ti->total_bits;
+    img->trksize = ceil_bits_to_bytes(img->trkbits);
+
+    /* Go get the encoded track data. */
+    ibuf.tbuf.prng_seed = TBUF_PRNG_INIT;
+    ibuf.tbuf.bit = ipf_tbuf_bit;
+    ibuf.tbuf.gap = ipf_tbuf_gap;
+    ibuf.tbuf.weak = ipf_tbuf_weak;
+    ibuf.dat = dat;
+    ibuf.blk = blk;
+    ibuf.chunktype = chkGap;
+    ibuf.decoded_bits = PREPEND_BITS;
+    ibuf.len = ibuf.decoded_bits / 16;
+    ibuf.bits = (ibuf.decoded_bits / 2) & 7;
+    handlers[ti->type]->read_raw(d, i, &ibuf.tbuf);
+
+    ipf_tbuf_finish_chunk(&ibuf, chkEnd);
+
+    BUG_ON(ibuf.nr_blks > MAX_BLOCKS_PER_TRACK);
+    BUG_ON(ibuf.len > MAX_DATA_PER_TRACK);
+
+    trk->is_var_density = ibuf.is_var_density;
+
+    if (ibuf.need_sps_encoder) {
+        BUG_ON(enc->encoder != ENC_CAPS);
+        trk->need_sps_encoder = 1;
+        pthread_mutex_lock(&enc->lock);
+        enc->first_sps = min(enc->first_sps, i);
+        pthread_mutex_unlock(&enc->lock);
+        return;
+    }
+
+    /* Sum the per-block data & gap sizes. */
+    for (j = 0; j < ibuf.nr_blks; j++) {
+        img->databits += blk[j].blockbits;
+        img->gapbits += blk[j].gapbits;
+        blk[j].dataoffset += ibuf.nr_blks * sizeof(*blk);
+    }
+
+    /* Track gap is appended to final block. */
+    blk[j-1].gapbits += img->trkbits - img->databits - img->gapbits;
+    if (enc->encoder == ENC_CAPS)
+        blk[j-1].u.caps.gapsize = ceil_bits_to_bytes(blk[j-1].gapbits);
+
+    /* Finish the IMGE chunk. */
+    img->gapbits = img->trkbits - img->databits;
+    img->blkcnt = ibuf.nr_blks;
+    if (ibuf.tbuf.raw.has_weak_bits)
+        img->flags |= IMGF_FLAKEY;
+
+    /* Convert endianness of all block descriptors. */
+    for (j = 0; j < img->blkcnt * sizeof(*blk) / 4; j++)
+        ((uint32_t *)blk)[j] = htobe32(((uint32_t *)blk)[j]);
+
+    /* Finally, compute DATA CRC. */
+    idata->size = ibuf.len + ibuf.nr_blks * sizeof(*blk);
+    idata->bsize = idata->size * 8;
+    idata->dcrc = crc32(blk, ibuf.nr_blks * sizeof(*blk));
+    idata->dcrc = crc32_add(dat, ibuf.len, idata->dcrc);
+    trk->len = ibuf.len;
+}
+
 static bool_t __ipf_close(struct disk *d, uint32_t encoder)
 {
     time_t t;
     struct tm tm;
     struct ipf_info info;
-    struct ipf_img *_img, *img;
-    struct ipf_block *_blk, *blk;
-    struct ipf_data *_idata, *idata;
-    uint8_t *_dat, *dat;
+    struct ipf_img *img;
+    struct ipf_data *idata;
     struct disk_info *di = d->di;
     struct track_info *ti;
-    struct ipf_tbuf ibuf;
+    struct ipf_encode enc;
     unsigned int i, j;
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    sink_rewind(d);
 
     ipf_write_chunk(d, "CAPS", NULL, 0);
 
@@ -314,25 +779,34 @@ static bool_t __ipf_close(struct disk *d, uint32_t encoder)
     info.platform[0] = 1; /* Amiga */
     ipf_write_chunk(d, "INFO", &info, sizeof(info));
 
-    _img = img = memalloc(di->nr_tracks * sizeof(*img));
-    _idata = idata = memalloc(di->nr_tracks * sizeof(*idata));
-    _blk = blk = memalloc(di->nr_tracks * MAX_BLOCKS_PER_TRACK * sizeof(*blk));
-    _dat = dat = memalloc(di->nr_tracks * MAX_DATA_PER_TRACK);
+    enc.d = d;
+    enc.encoder = encoder;
+    enc.img = memalloc(di->nr_tracks * sizeof(*enc.img));
+    enc.idata = memalloc(di->nr_tracks * sizeof(*enc.idata));
+    enc.blk = memalloc(di->nr_tracks * MAX_BLOCKS_PER_TRACK
+                       * sizeof(*enc.blk));
+    enc.dat = memalloc(di->nr_tracks * MAX_DATA_PER_TRACK);
+    enc.trk = memalloc(di->nr_tracks * sizeof(*enc.trk));
+    pthread_mutex_init(&enc.lock, NULL);
+    enc.first_sps = ~0u;
+
+    disk_parallel(d, di->nr_tracks, ipf_encode_track, &enc);
 
     for (i = 0; i < di->nr_tracks; i++) {
         ti = &di->track[i];
-
-        memset(&ibuf, 0, sizeof(ibuf));
-        ibuf.encoder = encoder;
+        img = &enc.img[i];
+        idata = &enc.idata[i];
+        enc.trk[i].src = i;
 
         if (((int)ti->total_bits < 0) && (i != 0) && d->kryoflux_hack) {
             /* Fill empty track from previous track. Fixes writeback to floppy
-             * using DTC, which ignore single-sided and max-cyl parameters. */
+             * using DTC, which ignore single-sided and max-cyl parameters.
+             * The previous track's encoding is written again, under this
+             * track's own DATA record. */
             memcpy(img, img-1, sizeof(*img));
             memcpy(idata, idata-1, sizeof(*idata));
-            ibuf.len = idata->size - img->blkcnt * sizeof(*blk);
-            memcpy(dat, dat - ibuf.len, ibuf.len * sizeof(*dat));
-            memcpy(blk, blk - img->blkcnt, img->blkcnt * sizeof(*blk));
+            enc.trk[i].len = enc.trk[i-1].len;
+            enc.trk[i].src = enc.trk[i-1].src;
         }
 
         img->cyl = i / 2;
@@ -341,108 +815,48 @@ static bool_t __ipf_close(struct disk *d, uint32_t encoder)
         idata->dat_chunk = img->dat_chunk = i + 1;
 
         if ((int)ti->total_bits < 0) {
-            /* Unformatted tracks are handled by the IPF decoder library. */
             img->dentype = img->dentype ?: denNoise;
         } else {
-            /* Basic track metadata. */
-            img->dentype = 
-                track_is_copylock(ti) ? denCopylock :
-                (ti->type == TRKTYP_speedlock) ? denSpeedlock :
-                denUniform;
-            img->startbit = ti->data_bitoff - PREPEND_BITS;
-            if ((int)img->startbit < 0)
-                img->startbit += ti->total_bits;
-            img->startpos = floor_bits_to_bytes(img->startbit);
-            img->trkbits = ti->total_bits;
-            img->trksize = ceil_bits_to_bytes(img->trkbits);
-
-            /* Go get the encoded track data. */
-            ibuf.tbuf.prng_seed = TBUF_PRNG_INIT;
-            ibuf.tbuf.bit = ipf_tbuf_bit;
-            ibuf.tbuf.gap = ipf_tbuf_gap;
-            ibuf.tbuf.weak = ipf_tbuf_weak;
-            ibuf.dat = dat;
-            ibuf.blk = blk;
-            ibuf.chunktype = chkGap;
-            ibuf.decoded_bits = PREPEND_BITS;
-            ibuf.len = ibuf.decoded_bits / 16;
-            ibuf.bits = (ibuf.decoded_bits / 2) & 7;
-            handlers[ti->type]->read_raw(d, i, &ibuf.tbuf);
-
-            ipf_tbuf_finish_chunk(&ibuf, chkEnd);
-
-            BUG_ON(ibuf.nr_blks > MAX_BLOCKS_PER_TRACK);
-            BUG_ON(ibuf.len > MAX_DATA_PER_TRACK);
-
-            if (ibuf.is_var_density && img->dentype == denUniform)
+            if (enc.trk[i].is_var_density && img->dentype == denUniform)
                 trk_warn(ti, i, "IPF: unsupported variable density!");
-
-            if (ibuf.need_sps_encoder) {
-                BUG_ON(encoder != ENC_CAPS);
+            if (enc.trk[i].need_sps_encoder) {
                 warnx("IPF: Switching to SPS encoder.");
                 goto out;
             }
-
-            /* Sum the per-block data & gap sizes. */
-            for (j = 0; j < ibuf.nr_blks; j++) {
-                img->databits += blk[j].blockbits;
-                img->gapbits += blk[j].gapbits;
-                blk[j].dataoffset += ibuf.nr_blks * sizeof(*blk);
-            }
-
-            /* Track gap is appended to final block. */
-            blk[j-1].gapbits += img->trkbits - img->databits - img->gapbits;
-            if (encoder == ENC_CAPS)
-                blk[j-1].u.caps.gapsize = ceil_bits_to_bytes(blk[j-1].gapbits);
-
-            /* Finish the IMGE chunk. */
-            img->gapbits = img->trkbits - img->databits;
-            img->blkcnt = ibuf.nr_blks;
-            if (ibuf.tbuf.raw.has_weak_bits)
-                img->flags |= IMGF_FLAKEY;
-
-            /* Convert endianness of all block descriptors. */
-            for (j = 0; j < img->blkcnt * sizeof(*blk) / 4; j++)
-                ((uint32_t *)blk)[j] = htobe32(((uint32_t *)blk)[j]);
-
-            /* Finally, compute DATA CRC. */
-            idata->size = ibuf.len + ibuf.nr_blks * sizeof(*blk);
-            idata->bsize = idata->size * 8;
-            idata->dcrc = crc32(blk, ibuf.nr_blks * sizeof(*blk));
-            idata->dcrc = crc32_add(dat, ibuf.len, idata->dcrc);
         }
 
         /* We write the IMGE chunks back-to-back; defer DATA until after. */
         ipf_write_chunk(d, "IMGE", img, sizeof(*img));
-
-        dat += ibuf.len;
-        blk += img->blkcnt;
-        idata++; img++;
     }
 
-    idata = _idata;
-    img = _img;
-    blk = _blk;
-    dat = _dat;
     for (i = 0; i < di->nr_tracks; i++) {
+        img = &enc.img[i];
+        idata = &enc.idata[i];
+        j = enc.trk[i].src;
         ipf_write_chunk(d, "DATA", idata, sizeof(*idata));
-        write_exact(d->fd, blk, img->blkcnt * sizeof(*blk));
-        write_exact(d->fd, dat, idata->size - img->blkcnt * sizeof(*blk));
-        dat += idata->size - img->blkcnt * sizeof(*blk);
-        blk += img->blkcnt;
-        idata++; img++;
+        sink_write(d, &enc.blk[j * MAX_BLOCKS_PER_TRACK],
+                   img->blkcnt * sizeof(*enc.blk));
+        sink_write(d, &enc.dat[j * MAX_DATA_PER_TRACK], enc.trk[i].len);
     }
 
 out:
-    memfree(_img);
-    memfree(_idata);
-    memfree(_blk);
-    memfree(_dat);
+    pthread_mutex_destroy(&enc.lock);
+    memfree(enc.img);
+    memfree(enc.idata);
+    memfree(enc.blk);
+    memfree(enc.dat);
+    memfree(enc.trk);
     return i == di->nr_tracks; /* success? */
 }
 
 static void ipf_close(struct disk *d)
 {
+    unsigned int i;
+
+    /* Everything must be decoded before the file is rewritten. */
+    for (i = 0; i < d->di->nr_tracks; i++)
+        ipf_load(d, i);
+
     /* Try the older CAPS encoding, and use the newer SPS encoding only when we
      * discover it is necessary. Note that the new encoding does not work with
      * v2 of the IPF decoder library (e.g., libcapsimage.so.2 on Linux). An
@@ -456,7 +870,8 @@ struct container container_ipf = {
     .init = dsk_init,
     .open = ipf_open,
     .close = ipf_close,
-    .write_raw = dsk_write_raw
+    .write_raw = ipf_write_raw,
+    .load = ipf_load
 };
 
 /*
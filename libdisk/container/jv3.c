@@ -42,7 +42,7 @@
 #endif
 
 /* Support various levels of debugging information */
-static int jv3_debug = JV3_DEBUG;
+static const int jv3_debug = JV3_DEBUG;
 
 #define JV3_LOG(l, f, a...) do {                    \
     if (jv3_debug >= (l)) fprintf(stderr, f, ##a);  \
@@ -89,8 +89,6 @@ static int jv3_debug = JV3_DEBUG;
 /* exact jv3 header size includes one byte flags at the end */
 #define JV3_HEADER_SIZE (JV3_ENTRIES*3+1)
 
-static unsigned char jv3_buf[JV3_HEADER_SIZE+3]; /* add a few bytes of overflow */
-
 static struct container *jv3_open(struct disk *d)
 {
     /* not supported */
@@ -225,42 +223,6 @@ char *type_to_encoding(int type)
     return ptr;
 }
 
-/**
-   @brief TEST bit in byte array
-   @param[in] *ptr: byte array
-   @param[in] off: bit offset
-   @return  1 if bit is set, 0 if not
-*/
-static uint8_t  bittest(uint8_t *ptr, int off)
-{
-    return( (ptr[off>>3] & (0x80 >> (off&7))) ? 1 : 0 );
-}
-
-/**
-   @brief SET bit in byte array
-   @param[in] *ptr: byte array
-   @param[in] off: bit offset
-   @return  void
-*/
-static void bitset(unsigned char *ptr, int off)
-{
-
-    ptr[off>>3] |= (0x80 >> (off & 7));
-}
-
-/**
-   @brief CLEAR bit in byte array
-   @param[in] *ptr: byte array
-   @param[in] off: bit offset
-   @return  void
-*/
-static void bitclr(unsigned char *ptr, int off )
-{
-
-    ptr[off>>3] &= ~(0x80 >> (off & 7));
-}
-
-
 /* ===================================================== */
 /* ===================================================== */
 /* ===================================================== */
@@ -278,10 +240,10 @@ static void bitclr(unsigned char *ptr, int off )
 
 /* information from all tracks and sectors */
 typedef struct {
-    uint8_t     track[((MAX_TRACKS+7)>>3) ];
-    uint8_t     reject_track[((MAX_TRACKS+7)>>3) ];
-    uint8_t     cyl[ ((MAX_CYLINDERS+7)>>3) ];
-    uint8_t     sec[ ((MAX_SECTORS+7)>>3) ];
+    bool_t      track[MAX_TRACKS];
+    bool_t      reject_track[MAX_TRACKS];
+    bool_t      cyl[MAX_CYLINDERS];
+    bool_t      sec[MAX_SECTORS];
     uint8_t        side_40;
     uint8_t        side_80;
     uint8_t        tracks;
@@ -299,30 +261,15 @@ typedef struct {
     int         reject_side;
 } all_t;
 
-static all_t all[MAX_SIDES];
-
-static void init_trs80_used()
+/* Per-side layout state is allocated, zeroed, per jv3_close() call, so that
+ * separate disks may be closed concurrently. */
+static void init_trs80_used(all_t *all)
 {
-    int i,j;
+    int j;
 
     for(j=0;j<MAX_SIDES;++j) {
-        for(i=0;i<MAX_TRACKS;++i)
-            bitclr(all[j].track,i);
-        for(i=0;i<MAX_TRACKS;++i)
-            bitclr(all[j].reject_track,i);
-        for(i=0;i<MAX_CYLINDERS;++i)
-            bitclr(all[j].cyl,i);
-        for(i=0;i<MAX_SECTORS;++i)
-            bitclr(all[j].sec,i);
-        all[j].tracks = 0;
-        all[j].first = 0;
-        all[j].sectors = 0;
         all[j].size = -1;
         all[j].density = -1;
-        all[j].tracks = 0;
-        all[j].side_80 = 0;
-        all[j].side_40 = 0;
-        all[j].reject_side= 0;
 
         /* FIXME just these value rater then autodetect */
         all[j].test_encoding = -1;
@@ -347,9 +294,8 @@ static void jv3_close(struct disk *d)
 {
     struct disk_info *di = d->di;
     struct track_info *ti;
-
-    uint8_t *secs, *cyls, *heads, *nos, *marks, *dat;
-    uint16_t *crcs;
+    const struct ibm_sector_view **trks, *t;
+    bool_t used[MAX_SECTORS];
 
 
 
@@ -362,13 +308,14 @@ static void jv3_close(struct disk *d)
 
     int save_density,save_size,save_first,save_sectors;
 
-    unsigned int jv3_state;
     int jv3_ind;
-    long jv3_pos;
     unsigned int flags;
 
-    int i;
-    char *zeros;
+    int i, nr_out;
+    size_t len;
+
+    all_t *all;
+    unsigned char *jv3_buf, *p;
 
 
     /* FIXME int missing; */
@@ -403,7 +350,9 @@ static void jv3_close(struct disk *d)
     size = 0;
     crc_errors = 0;
 
-    init_trs80_used();
+    all = memalloc(MAX_SIDES * sizeof(*all));
+    trks = memalloc(di->nr_tracks * sizeof(*trks));
+    init_trs80_used(all);
 
     
 
@@ -486,19 +435,18 @@ static void jv3_close(struct disk *d)
 
         reject_track = 0;
 
-        retrieve_ibm_mfm_track(
-            d, track, &secs, &cyls, &heads, &nos, &marks, &crcs, &dat);
+        t = ibm_sector_view(d, track);
 
-        if (cyl(track) != cyls[0] && cyl(track)/2 != cyls[0]) {
+        if (cyl(track) != t->cyls[0] && cyl(track)/2 != t->cyls[0]) {
             JV3_INFO("JV3: C%02u.%02u Cylinder mismatch for track(%d)\n",
-                     cyls[0], heads[0],
+                     t->cyls[0], t->heads[0],
                      cyl(track));
             reject_track++;
         }
 
-        if (hd(track) != heads[0]) {
+        if (hd(track) != t->heads[0]) {
             JV3_INFO("JV3: C%02u %02u Head mismatch for track(%d)\n",
-                     cyls[0], heads[0],
+                     t->cyls[0], t->heads[0],
                      hd(track));
             reject_track++;
         }
@@ -511,60 +459,51 @@ static void jv3_close(struct disk *d)
              * Check for Cylinder mismatch, logical vs physical 
              * Check for 80 or 40 track formats 
              * Cylinder mismatch, logical vs physical ? */
-            if (cyls[0] != cyls[sector]) {
+            if (t->cyls[0] != t->cyls[sector]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u Unexpected cylinder (%d)\n",
-                         cyls[0], heads[0], secs[sector], 
-                         cyls[sector] );
+                         t->cyls[0], t->heads[0], t->secs[sector], 
+                         t->cyls[sector] );
                 reject_track++;
                 continue;
             }
 
             /* Head mismatch ? */
-            if (heads[0] != heads[sector]) {
+            if (t->heads[0] != t->heads[sector]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u Unexpected head (%d)\n",
-                         cyls[0], heads[0], secs[sector], 
-                         heads[sector] );
+                         t->cyls[0], t->heads[0], t->secs[sector], 
+                         t->heads[sector] );
                 reject_track++;
                 continue;
             } 
 
-            if (nos[0] != nos[sector]) {
+            if (t->nos[0] != t->nos[sector]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u Unexpected size (%d)\n",
-                         cyls[0], heads[0], secs[sector], 
-                         128u<<nos[sector] );
+                         t->cyls[0], t->heads[0], t->secs[sector], 
+                         128u<<t->nos[sector] );
                 reject_track++;
                 continue;
             }
 
-            if (all[hd(track)].first > secs[sector])
-                all[hd(track)].first = secs[sector];
-            bitset(all[hd(track)].sec,secs[sector]);
+            if (all[hd(track)].first > t->secs[sector])
+                all[hd(track)].first = t->secs[sector];
+            all[hd(track)].sec[t->secs[sector]] = 1;
         }
         if (!reject_track) {
-            if (cyl(track) == cyls[0] )
+            if (cyl(track) == t->cyls[0] )
                 all[hd(track)].side_80++;
-            else if (cyl(track) / 2 == cyls[0])
+            else if (cyl(track) / 2 == t->cyls[0])
                 all[hd(track)].side_40++;    
             /* The first size we see is the correct one */
             if (all[hd(track)].size == -1)
-                all[hd(track)].size = nos[0];
+                all[hd(track)].size = t->nos[0];
 
             /* Get maximum sector count for all tracks */
             if (ti->nr_sectors > all[hd(track)].sectors)
                 all[hd(track)].sectors = ti->nr_sectors;
         } else {
-            bitset(all[hd(track)].reject_track,track);
+            all[hd(track)].reject_track[track] = 1;
             all[hd(track)].reject_side++;
         }
-
-        
-        memfree(secs);
-        memfree(cyls);
-        memfree(heads);
-        memfree(nos);
-        memfree(marks);
-        memfree(crcs);
-        memfree(dat);
     }
 
     /* ============================================================ 
@@ -585,8 +524,6 @@ static void jv3_close(struct disk *d)
     save_first = all[0].first;
     save_size = all[0].size;
 
-    uint8_t     used[ ((MAX_SECTORS+7)>>3) ];
-
     if (size_to_jv3_flags(128u << save_size) & 0x100) {
         JV3_WARN("JV3: size (%d) is not valid for JV3 format\n", 128u << save_size);
         exit(1);
@@ -605,7 +542,7 @@ static void jv3_close(struct disk *d)
     /* Verify that sector use is consistant on side 0 */
     count = 0;
     for (i = 0; i < MAX_SECTORS; ++i)
-        if (bittest(all[0].sec, i))
+        if (all[0].sec[i])
             count++;
 
     if (count != all[0].sectors ) {
@@ -631,9 +568,9 @@ static void jv3_close(struct disk *d)
     /* compare sector use on each side */
     count = 0;
     for (i = 0; i < MAX_SECTORS; ++i) {
-        if (bittest(all[0].sec,i))
+        if (all[0].sec[i])
             count++;
-        if (bittest(all[1].sec,i))
+        if (all[1].sec[i])
             count--;
     }
 
@@ -691,107 +628,98 @@ static void jv3_close(struct disk *d)
         density = type_to_density(ti->type);
         if (density & 0xfffe || save_density != density ||
             !ti->nr_sectors || ti->nr_sectors > save_sectors) {
-            bitset(all[hd(track)].reject_track,track);
-            bitclr(all[hd(track)].track,track);
+            all[hd(track)].reject_track[track] = 1;
+            all[hd(track)].track[track] = 0;
             continue;
         }
 
         reject_track = 0;
 
-        retrieve_ibm_mfm_track(
-            d, track, &secs, &cyls, &heads, &nos, &marks, &crcs, &dat);
+        t = trks[track] = ibm_sector_view(d, track);
 
-        if (cyl(track) != cyls[0]  && cyl(track)/2 != cyls[0]) {
+        if (cyl(track) != t->cyls[0]  && cyl(track)/2 != t->cyls[0]) {
             JV3_INFO("JV3: C%02u.%02u Cylinder mismatch for track(%d)\n",
-                     cyls[0], heads[0],
+                     t->cyls[0], t->heads[0],
                      cyl(track));
             reject_track++;
         }
             
-        if (hd(track) != heads[0]) {
+        if (hd(track) != t->heads[0]) {
             JV3_INFO("JV3: C%02u.%02u Head mismatch for track(%d)\n",
-                     cyls[0], heads[0],
+                     t->cyls[0], t->heads[0],
                      hd(track));
             reject_track++;
         }
 
         /* size mismatch ? */
-        if (save_size != nos[0]) {
+        if (save_size != t->nos[0]) {
             JV3_INFO("JV3: C%02u.%02u Unexpected size (%d)\n",
-                     cyls[0],heads[0], 
-                     128u<<nos[0]);
+                     t->cyls[0],t->heads[0], 
+                     128u<<t->nos[0]);
             reject_track++;
         }
 
         if (reject_track) {
-            memfree(secs);
-            memfree(cyls);
-            memfree(heads);
-            memfree(nos);
-            memfree(marks);
-            memfree(crcs);
-            memfree(dat);
-    
-            bitclr(all[hd(track)].track,track);
-            bitset(all[hd(track)].reject_track,track);
+            all[hd(track)].track[track] = 0;
+            all[hd(track)].reject_track[track] = 1;
             continue;
         }
 
         /* Make sure that properties of each sector matches 
            within the same Physical track and head */
 
-        JV3_TRACE("JV3 DEBUG: C%02u.%02u\n", cyls[0], heads[0]);
+        JV3_TRACE("JV3 DEBUG: C%02u.%02u\n", t->cyls[0], t->heads[0]);
 
         /* used sectors for this track */
         for (i = 0;i < MAX_SECTORS; ++i)
-            bitclr(used,i);
+            used[i] = 0;
 
         /* Check Logical values for consistancy accross all 
            sectors in this physical track */
 
         for (sector = 0; !reject_track && sector < ti->nr_sectors; sector++) {
             /* Cylinder mismatch, logical vs physical ? */
-            if( cyls[0] != cyls[sector] ) {
+            if( t->cyls[0] != t->cyls[sector] ) {
                 JV3_INFO("JV3: C%02u.%02u.%02u Unexpected cylinder (%d)\n",
-                         cyls[0], heads[0], secs[sector], 
-                         cyls[sector] );
+                         t->cyls[0], t->heads[0], t->secs[sector], 
+                         t->cyls[sector] );
                 reject_track++;
                 break;
             }
 
             /* Head mismatch ? */
-            if (heads[0] != heads[sector]) {
+            if (t->heads[0] != t->heads[sector]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u Unexpected head (%d)\n",
-                         cyls[0], heads[0], secs[sector], 
-                         heads[sector] );
+                         t->cyls[0], t->heads[0], t->secs[sector], 
+                         t->heads[sector] );
                 reject_track++;
                 break;
             } 
 
             /* Is sector valid based information from first 35 sectors */
-            if (!bittest(all[hd(track)].sec,secs[sector])) {
+            if (!all[hd(track)].sec[t->secs[sector]]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u Unexpected Sector (%d)\n",
-                         realcyl(track,track_80), hd(track), secs[sector], 
-                         secs[sector] );
+                         realcyl(track,track_80), hd(track), t->secs[sector], 
+                         t->secs[sector] );
                 ++reject_track;
                 break;
             }
 
             /* Is this sector duplicated ?*/
-            if (bittest(used,secs[sector])) {
+            if (used[t->secs[sector]]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u.Duplicate Sector (%d)\n",
-                         realcyl(track,track_80), hd(track), secs[sector], 
-                         secs[sector] );
+                         realcyl(track,track_80), hd(track), t->secs[sector], 
+                         t->secs[sector] );
                 ++reject_track;
                 break;
             }
 
 
             /* size mismatch ? */
-            if (nos[0] != nos[sector]) {
+            if (t->nos[0] != t->nos[sector]) {
                 JV3_INFO("JV3: C%02u.%02u.%02u.Unexpected size (%d)\n",
-                         realcyl(track,track_80), hd(track), secs[sector], 
-                         128u<<nos[sector] );
+                         realcyl(track,track_80), hd(track), t->secs[sector], 
+                         128u<<t->nos[sector] );
                 reject_track++;
                 break;
             }
@@ -799,22 +727,22 @@ static void jv3_close(struct disk *d)
 
             if (!reject_track) {
                 /* Track CRC Errors */
-                if(crcs[sector]) {
+                if(t->crcs[sector]) {
                     JV3_WARN("JV3: C%02u.%02u.%02u CRC(%4x) error\n",
-                             cyls[sector],heads[sector], secs[sector], crcs[sector]);
+                             t->cyls[sector],t->heads[sector], t->secs[sector], t->crcs[sector]);
                     ++crc_errors;
                     /* crc errors are not fatal */
                 }
                 JV3_TRACE("JV3 DEBUG: C%02u.%02u.%02u: mark:%02x\n",
-                          cyls[0], heads[0], secs[sector], marks[sector]);
-                bitset(used, secs[sector]);
+                          t->cyls[0], t->heads[0], t->secs[sector], t->marks[sector]);
+                used[t->secs[sector]] = 1;
             }
         }    /* for(sector=0 ....) */
 
         if (!reject_track) {
-            bitclr(all[hd(track)].reject_track,track);
-            bitset(all[hd(track)].track,track);
-            bitset(all[hd(track)].cyl, cyls[0] );
+            all[hd(track)].reject_track[track] = 0;
+            all[hd(track)].track[track] = 1;
+            all[hd(track)].cyl[t->cyls[0]] = 1;
             /* save cylinder attributes */
             /* Save density for this track */
             if (hd(track) == 0)
@@ -822,20 +750,11 @@ static void jv3_close(struct disk *d)
         }
 
         if (reject_track) {
-            bitset(all[hd(track)].reject_track,track);
-            bitclr(all[hd(track)].track,track);
+            all[hd(track)].reject_track[track] = 1;
+            all[hd(track)].track[track] = 0;
             JV3_INFO("JV3: T%u.%u track rejected\n",
                      cyl(track), hd(track));
         }
-
-        /* Free data from retrieve() */
-        memfree(secs);
-        memfree(cyls);
-        memfree(heads);
-        memfree(nos);
-        memfree(marks);
-        memfree(crcs);
-        memfree(dat);
     } /* for (track = 0; track < di->nr_tracks; track++) */
     /* ============================================================ */
 
@@ -851,12 +770,12 @@ static void jv3_close(struct disk *d)
             break;
 
         /* FIXME */
-        if (!bittest(all[hd(track)].track,track)) {
+        if (!all[hd(track)].track[track]) {
             JV3_TRACE("DEBUG: track:%d.%d bad\n",
                       realcyl(track,track_80) , hd(track));
         }
 
-        if (bittest(all[hd(track)].reject_track,track)) {
+        if (all[hd(track)].reject_track[track]) {
             JV3_TRACE("DEBUG: track:%d.%d reject\n",
                       realcyl(track,track_80) , hd(track));
         }
@@ -884,11 +803,29 @@ static void jv3_close(struct disk *d)
     
     /* =========================================================== */
 
-    /* truncate to 0 bytes */
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    /* start the image afresh */
+    sink_rewind(d);
 
+    size = 128u << save_size;
+
+    /* Count the tracks to be written, to size the image. */
+    nr_out = 0;
+    for (track = 0; track < di->nr_tracks; track++) {
+        if (single && hd(track))
+            continue;
+        if (!track_80 && (track & 2))
+            continue;
+        if (realcyl(track,track_80) >= tracks)
+            break;
+        if (all[hd(track)].track[track] && !all[hd(track)].reject_track[track])
+            nr_out++;
+    }
+
+    /* The whole image is built in one buffer: the header, then the sector
+     * data in header order. Missing sectors are left zero-filled. */
+    len = JV3_HEADER_SIZE + (size_t)nr_out * save_sectors * size;
+    jv3_buf = memalloc(len);
+    p = jv3_buf + JV3_HEADER_SIZE;
 
     /* PAD and WRITE PROTECT BYTE */
     jv3_ind = 0;
@@ -897,192 +834,114 @@ static void jv3_close(struct disk *d)
         jv3_buf[jv3_ind++] = JV3_FREE;  /* SECTOR */
         jv3_buf[jv3_ind++] = JV3_FREEF; /* FLAGS */
     }
-                
-    /* Loop twice - first pass dumps headers - second pass sectors
-     * Fill jv3_buf in jv3_state 0
-     * Write jv3_buf at state 1, data at state 2
-     */
-
-    /*
-     * FIXME FIXME
-     * We should look trough the trs80 structure NOT THIS
-     */
-
-    count = 128u << 7;
-
-    zeros = calloc(count,1);
-
-    if (!zeros) {
-        JV3_WARN("JV3: memory calloc failed\n");
-        exit(1);
-    }
 
-    jv3_pos = 0;
+    jv3_ind = 0;
+    for (track = 0; track < di->nr_tracks; track++) {
 
-    for (jv3_state = 0; jv3_state < 3; jv3_state++) {
-        if (jv3_state == 0 ) {
-            jv3_pos = 0;
-            jv3_ind = 0;
-        }
-        /* Are we done with the header? */
-        if (jv3_state == 1) {
-            lseek(d->fd, 0, SEEK_SET);
-            write_exact(d->fd, jv3_buf, JV3_HEADER_SIZE);
+        if (single && hd(track))
             continue;
-        }
-        if (jv3_state == 2) {
-            lseek(d->fd, ((long) JV3_HEADER_SIZE),  SEEK_SET);
-            jv3_pos = JV3_HEADER_SIZE;
-            jv3_ind = 0;
-        }
 
-        /* Look at the imd.c container for data access examples */
-
-        /* Reset sector count, first sector, size etc fro invalid tracks */
-        jv3_ind = 0;
-        for (track = 0; track < di->nr_tracks; track++) {
+        /* 40 tracks ? */
+        if (!track_80 && (track & 2))
+            continue;
 
-            if (single && hd(track))
-                continue;
+        if (realcyl(track,track_80) >= tracks)
+            break;
 
-            /* 40 tracks ? */
-            if (!track_80 && (track & 2))
-                continue;
+        /* FIXME */
+        if (!all[hd(track)].track[track])
+            continue;
 
-            if (realcyl(track,track_80) >= tracks)
-                break;
+        if (all[hd(track)].reject_track[track])
+            continue;
 
-            /* FIXME */
-            if (!bittest(all[hd(track)].track,track))
-                continue;
+        ti = &di->track[track];
+        t = trks[track];
 
-            if (bittest(all[hd(track)].reject_track,track))
-                continue;
+        if (!ti->nr_sectors) {
+            JV3_WARN("JV3: T%u.%u: FATAL expected (%d) sectors got ZERO\n",
+                     cyl(track), hd(track), save_sectors);
+            exit(1);
+        }
 
-            ti = &di->track[track];
+        for (sector = 0; sector < save_sectors; ++sector) {
 
-            if (!ti->nr_sectors) {
-                JV3_WARN("JV3: T%u.%u: FATAL expected (%d) sectors got ZERO\n",
-                         cyl(track), hd(track), save_sectors);
+            if (jv3_ind >= ((JV3_ENTRIES) - 1)) {
+                JV3_WARN("JV3: header index exceeded:%04x\n",jv3_ind);
                 exit(1);
             }
 
+            /* Convert sector size to JV3 flags */
+            flags = size_to_jv3_flags(size);
+
+            if (ti->nr_sectors <= sector) {
+                JV3_TRACE("DEBUG: C%02u.%u %u: mark:%02x, "
+                          "ind:%d FILL\n", 
+                          t->cyls[0],
+                          t->heads[0],
+                          0xff,
+                          t->marks[0],
+                          jv3_ind);
 
-            retrieve_ibm_mfm_track(
-                d, track, &secs, &cyls, &heads, &nos, &marks, &crcs, &dat);
-
-            size = 128u << save_size;
-
-            for (sector = 0; sector < save_sectors; ++sector) {
-
-                /* Write sectors in state 0 */
-                if (jv3_state == 2) {
-                    if (ti->nr_sectors <= sector) {
-                        JV3_TRACE("JV3: DEBUG: C%02u.%02u.%02u: mark:%02x, pos:%ld FILL\n", 
-                                  cyls[0],
-                                  heads[0],
-                                  0xff,
-                                  marks[0],
-                                  jv3_pos);
-                        write_exact(d->fd, zeros, size);
-                    } else {
-                        JV3_TRACE("DEBUG: C%02u.%02u.%02u: mark:%02x, pos:%ld\n", 
-                                  cyls[sector],
-                                  heads[sector],
-                                  secs[sector],
-                                  marks[sector],
-                                  jv3_pos);
-                        /* data */
-                        write_exact(d->fd, &dat[sector * size], size);
-                    }
-                    jv3_pos += size;
-
-                } /* if(jv3_state == 2) */
-
-
-                /* Write headers in state 0 */
-                if (jv3_state == 0) {
-                    if (jv3_ind >= ((JV3_ENTRIES) - 1)) {
-                        JV3_WARN("JV3: header index exceeded:%04x\n",jv3_ind);
-                        exit(1);
-                    }
-
-                    /* Convert sector size to JV3 flags */
-
-                    if (ti->nr_sectors <= sector) {
-                        JV3_TRACE("DEBUG: C%02u.%u %u: mark:%02x, "
-                                  "ind:%d FILL\n", 
-                                  cyls[0],
-                                  heads[0],
-                                  0xff,
-                                  marks[0],
-                                  jv3_ind);
-                        /* JV3 flags */
-                        flags = size_to_jv3_flags(size);
-
-                        /* Convert address mark and density to JV3 flags */
-                        flags |=  mark_to_jv3_flags(marks[0], save_density);
-                        /* Encode side */
-                        flags |= heads[0] ? JV3_SIDE : 0;
+                /* Convert address mark and density to JV3 flags */
+                flags |=  mark_to_jv3_flags(t->marks[0], save_density);
+                /* Encode side */
+                flags |= t->heads[0] ? JV3_SIDE : 0;
 
 #ifdef JV3_CRC
-                        flags |= JV3_ERROR;
+                flags |= JV3_ERROR;
 #endif
-                        /* map cylinder */
-                        jv3_buf[jv3_ind*3] = cyls[0];
-                        /* map sector number */
+                /* map cylinder */
+                jv3_buf[jv3_ind*3] = t->cyls[0];
+                /* map sector number */
 
-                        /* FIXME - fill in missing with bit mask */
-                        jv3_buf[jv3_ind*3+1] = 0xff;
+                /* FIXME - fill in missing with bit mask */
+                jv3_buf[jv3_ind*3+1] = 0xff;
 
-                        jv3_buf[jv3_ind*3+2] = flags & 0xff;
-                        jv3_ind++;
+                jv3_buf[jv3_ind*3+2] = flags & 0xff;
+                jv3_ind++;
 
-                    } else {
+            } else {
 
-                        JV3_TRACE("DEBUG: C%02u.%02u.%02u: mark:%02x, "
-                                  "ind:%d\n", 
-                                  cyls[sector],
-                                  heads[sector],
-                                  secs[sector],
-                                  marks[sector],
-                                  jv3_ind);
+                JV3_TRACE("DEBUG: C%02u.%02u.%02u: mark:%02x, "
+                          "ind:%d\n", 
+                          t->cyls[sector],
+                          t->heads[sector],
+                          t->secs[sector],
+                          t->marks[sector],
+                          jv3_ind);
 
-                        /* Error testing has already been done */
-                        flags = size_to_jv3_flags(size);
+                /* Convert address mark and density into JV3 flags */
+                flags |= mark_to_jv3_flags(t->marks[sector], save_density);
+                /* Encode side */
+                flags |= t->heads[sector] ? JV3_SIDE : 0;
 
-                        /* Convert address mark and density into JV3 flags */
-                        flags |= mark_to_jv3_flags(marks[sector], save_density);
-                        /* Encode side */
-                        flags |= heads[sector] ? JV3_SIDE : 0;
-
-                        /* Encode CRC Error */
-                        if (crcs[sector]) {
+                /* Encode CRC Error */
+                if (t->crcs[sector]) {
 #ifdef JV3_CRC_HIDE
-                            flags |= JV3_ERROR;
+                    flags |= JV3_ERROR;
 #endif
-                        }
-
-                        /* map cylinder */
-                        jv3_buf[jv3_ind*3] = cyls[sector];
-                        /* map sector number */
-                        jv3_buf[jv3_ind*3+1] = secs[sector];
-                        jv3_buf[jv3_ind*3+2] = flags & 0xff;
-                        jv3_ind++;
-                    }
-
-                }    /* if(jv3_state == 0) */
-            } /* for(sector ...) */
-            /* Free data from retrieve() */
-            memfree(secs);
-            memfree(cyls);
-            memfree(heads);
-            memfree(nos);
-            memfree(marks);
-            memfree(crcs);
-            memfree(dat);
-        } /* for (track = 0; track < di->nr_tracks; track++) */
-    } /* for(jv3_state ..) */
+                }
+
+                /* map cylinder */
+                jv3_buf[jv3_ind*3] = t->cyls[sector];
+                /* map sector number */
+                jv3_buf[jv3_ind*3+1] = t->secs[sector];
+                jv3_buf[jv3_ind*3+2] = flags & 0xff;
+                jv3_ind++;
+
+                /* data */
+                memcpy(p, &t->dat[sector * size], size);
+            }
+            p += size;
+        } /* for(sector ...) */
+    } /* for (track = 0; track < di->nr_tracks; track++) */
+
+    sink_write(d, jv3_buf, len);
+
+    memfree(trks);
+    memfree(jv3_buf);
+    memfree(all);
 }
 
 struct container container_jv3 = {
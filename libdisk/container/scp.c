@@ -73,9 +73,38 @@ static struct container *scp_open(struct disk *d)
     return NULL;
 }
 
-static void emit(uint16_t *dat, unsigned int *p_j, uint32_t cell)
+static void checksum(uint32_t *p_csum, const void *dat, size_t len)
+{
+    uint32_t csum = *p_csum;
+    const uint8_t *p = dat;
+    while (len--)
+        csum += *p++;
+    *p_csum = csum;
+}
+
+/* Flux samples for one track, built in memory in host byte order. */
+struct sample_buf {
+    uint16_t *dat;
+    uint32_t nr, max;
+};
+
+static uint16_t push_sample(struct sample_buf *sb, uint16_t x)
+{
+    uint16_t *dat;
+
+    if (sb->nr == sb->max) {
+        sb->max = sb->max ? sb->max * 2 : 4096;
+        dat = memalloc_nz(sb->max * sizeof(*dat));
+        memcpy(dat, sb->dat, sb->nr * sizeof(*dat));
+        memfree(sb->dat);
+        sb->dat = dat;
+    }
+    sb->dat[sb->nr++] = x;
+    return x;
+}
+
+static void emit(struct sample_buf *sb, uint32_t cell)
 {
-    unsigned int j = *p_j;
     const uint32_t one_us = 1000 / SCK_NS_PER_TICK;
 
     /* A long pattern which transitions between 000101 and 010001. */
@@ -84,8 +113,8 @@ static void emit(uint16_t *dat, unsigned int *p_j, uint32_t cell)
         uint32_t max = 78 * one_us/10;
         uint32_t delta = 0;
         while (max*2 < cell) {
-            cell -= dat[j++] = max - delta;
-            cell -= dat[j++] = min + delta;
+            cell -= push_sample(sb, max - delta);
+            cell -= push_sample(sb, min + delta);
             delta += 2 * one_us/10;
             if (delta > max-min)
                 delta = 0;
@@ -100,51 +129,223 @@ static void emit(uint16_t *dat, unsigned int *p_j, uint32_t cell)
         int delta = 0;
         while (32*one_us < cell) {
             delta = !delta;
-            cell -= dat[j++] = (19 + delta*6) * one_us;
+            cell -= push_sample(sb, (19 + delta*6) * one_us);
             for (int i = 0; i < (delta ? 6 : 4); i++)
-                cell -= dat[j++] = 5*one_us/10;
+                cell -= push_sample(sb, 5*one_us/10);
         }
     }
 
     /* Handle 16-bit overflow (should never happen, since we subdivide long
      * empty regions with weak bits). */
     while (cell >= 0x10000u) {
-        dat[j++] = 0;
+        push_sample(sb, 0);
         cell -= 0x10000u;
     }
 
     /* Final sample: everything else; mbnz (zero is special). */
-    dat[j++] = cell ?: 1;
+    push_sample(sb, cell ?: 1);
+}
+
+uint16_t *track_raw_scp_flux(
+    struct track_raw *raw, uint32_t *nr_samples, uint32_t *duration)
+{
+    struct tbuf *tbuf = container_of(raw, struct tbuf, raw);
+    struct sample_buf sb = { 0 };
+    unsigned int i, bit;
+    uint32_t av_cell, cell, run, end, pos, nxt, step;
+    uint16_t speed;
+
+    /* Rotate the track so gap is at index. */
+    bit = raw->write_splice_bc;
+    if (bit > raw->data_start_bc)
+        bit = 0; /* don't mess with an already-aligned track */
+
+    av_cell = track_nsecs_from_rpm(tbuf->disk->rpm) / raw->bitlen;
+    cell = run = 0;
+
+    /* Each span of constant speed at once: a weak span is all gap; else
+     * skip from one 1 bitcell to the next. */
+    for (i = 0; i < raw->bitlen; i += end - bit, bit = end) {
+        if (bit >= raw->bitlen)
+            bit = 0;
+        speed = track_raw_speed_at(raw, bit, &run);
+        end = (run + 1 < raw->nr_speed_runs)
+            ? raw->speed_runs[run+1].start : raw->bitlen;
+        end = min(end, bit + raw->bitlen - i);
+        if (speed == SPEED_WEAK) {
+            cell += (end - bit) * av_cell;
+            continue;
+        }
+        step = (av_cell * speed) / SPEED_AVG;
+        for (pos = bit;
+             (nxt = next_set_bit(raw->bits, pos, end)) < end;
+             pos = nxt + 1) {
+            cell += (nxt - pos + 1) * step;
+            emit(&sb, cell / SCK_NS_PER_TICK);
+            cell %= SCK_NS_PER_TICK;
+        }
+        cell += (end - pos) * step;
+    }
 
-    *p_j = j;
+    cell /= SCK_NS_PER_TICK;
+    if (sb.nr && sb.dat[0]
+        && (cell < SHORT_WEAK_THRESH)
+        && ((sb.dat[0] + cell) < 0x10000u)) {
+        /* Place remainder in first bitcell if the result is small. */
+        sb.dat[0] += cell;
+    } else if (cell) {
+        /* Place remainder in its own final bitcell. It may be too
+         * significant to merge with first bitcell (eg. a weak region). */
+        emit(&sb, cell);
+    }
+
+    *duration = 0;
+    for (i = 0; i < sb.nr; i++) {
+        *duration += sb.dat[i] ?: 0x10000u;
+        sb.dat[i] = htobe16(sb.dat[i]);
+    }
+    *nr_samples = sb.nr;
+    return sb.dat;
 }
 
 static void checksum_and_write(
-    int fd, uint32_t *p_csum, const void *dat, size_t len)
+    struct disk *d, uint32_t *p_csum, const void *dat, size_t len)
 {
-    uint32_t csum = *p_csum;
-    const uint8_t *p = dat;
-    write_exact(fd, dat, len);
-    while (len--)
-        csum += *p++;
-    *p_csum = csum;
+    sink_write(d, dat, len);
+    checksum(p_csum, dat, len);
+}
+
+/*
+ * The header's checksum covers the track offsets, the tracks and the footer.
+ * Flux identical to an earlier track's is stored once: each track keeps its
+ * own TRK header, and the headers of such a group are placed together, ahead
+ * of the flux which they all point at.
+ *
+ * A seekable image is written a group at a time, and its header and offsets
+ * are back-patched: only hashes of the flux are kept from a first pass, and
+ * a track's flux is synthesised again (identically) when it is written. Else
+ * every track's flux is held until all are known, and the image is written in
+ * order.
+ */
+struct scp_track {
+    uint16_t *dat;
+    uint32_t nr_samples, duration;
+    uint64_t hash;
+    int next;    /* next track of this track's group, or -1 */
+    bool_t dup;  /* stored with an earlier track's group */
+};
+
+struct scp_encode {
+    struct disk *d;
+    struct scp_track *trks;
+    bool_t hash_only; /* keep only the hash of each track's flux */
+};
+
+static void scp_encode_track(void *arg, unsigned int trk)
+{
+    struct scp_encode *enc = arg;
+    struct scp_track *t = &enc->trks[trk];
+    struct track_raw *raw = track_alloc_raw_buffer(enc->d);
+
+    /* Each track draws its own random bitcells (e.g., unformatted noise),
+     * rather than the same as every other track from a fresh buffer. */
+    container_of(raw, struct tbuf, raw)->prng_seed = TBUF_PRNG_INIT + trk;
+    track_read_raw(raw, trk);
+    t->dat = track_raw_scp_flux(raw, &t->nr_samples, &t->duration);
+    t->hash = hash64_add(t->dat, t->nr_samples * sizeof(*t->dat),
+                         t->nr_samples);
+    track_free_raw_buffer(raw);
+
+    if (enc->hash_only) {
+        memfree(t->dat);
+        t->dat = NULL;
+    }
+}
+
+/* Add each track whose flux matches an earlier track's to that track's
+ * group. Without the flux at hand, matches are by hash alone. */
+static void scp_find_dups(struct scp_track *trks, unsigned int nr)
+{
+    struct scp_track *t;
+    unsigned int trk, i;
+    int j;
+
+    for (trk = 0; trk < nr; trk++) {
+        t = &trks[trk];
+        t->next = -1;
+        for (i = 0; i < trk; i++) {
+            if (trks[i].dup || (trks[i].hash != t->hash)
+                || (trks[i].nr_samples != t->nr_samples)
+                || ((t->dat != NULL)
+                    && memcmp(trks[i].dat, t->dat,
+                              t->nr_samples * sizeof(*t->dat))))
+                continue;
+            for (j = i; trks[j].next >= 0; j = trks[j].next)
+                continue;
+            trks[j].next = trk;
+            t->dup = 1;
+            memfree(t->dat);
+            t->dat = NULL;
+            break;
+        }
+    }
+}
+
+/* Fill in the TRK headers of @trk's group, which lies at @file_off. Returns
+ * the offset of the group's flux. */
+static uint32_t scp_group_headers(
+    struct scp_track *trks, unsigned int trk, struct track_header *thdrs,
+    uint32_t *th_offs, uint32_t file_off)
+{
+    struct scp_track *t = &trks[trk];
+    unsigned int n;
+    int j;
+
+    for (n = 0, j = trk; j >= 0; j = trks[j].next)
+        n++;
+    for (j = trk; j >= 0; j = trks[j].next, n--) {
+        th_offs[j] = htole32(file_off);
+        memset(&thdrs[j], 0, sizeof(thdrs[j]));
+        memcpy(thdrs[j].sig, "TRK", sizeof(thdrs[j].sig));
+        thdrs[j].tracknr = j;
+        thdrs[j].offset = htole32(n * sizeof(*thdrs));
+        thdrs[j].duration = htole32(t->duration);
+        thdrs[j].nr_samples = htole32(t->nr_samples);
+        file_off += sizeof(*thdrs);
+    }
+
+    return file_off;
+}
+
+static void scp_footer(
+    struct footer *ftr, uint16_t *app_name_len, const char *app_name,
+    uint32_t file_off)
+{
+    memset(ftr, 0, sizeof(*ftr));
+    memcpy(ftr->sig, "FPCS", sizeof(ftr->sig));
+    ftr->application_offset = htole32(file_off);
+    ftr->creation_time = ftr->modification_time = htole64(time(NULL));
+    ftr->application_version = 0x10; /* should be moved to a general include? */
+    ftr->format_revision = 0x16; /* last specification used, 1.6 */
+    *app_name_len = htole16(strlen(app_name));
 }
 
 static void scp_close(struct disk *d)
 {
     struct disk_info *di = d->di;
     struct disk_header dhdr;
-    struct track_header thdr;
+    struct track_header *thdrs;
+    struct scp_track *trks, *t, *m;
+    struct scp_encode enc;
     struct footer ftr;
-    struct track_raw *raw;
-    unsigned int trk, i, j, bit;
-    uint32_t av_cell, cell, *th_offs, file_off, csum = 0;
-    uint16_t *dat, app_name_len;
+    unsigned int trk;
+    int j, *pj;
+    uint32_t *th_offs, file_off, csum = 0, bytes;
+    uint16_t app_name_len;
+    bool_t seekable = sink_seekable(d);
     const static char app_name[] = "libdisk (keirf)";
 
-    lseek(d->fd, 0, SEEK_SET);
-    if (ftruncate(d->fd, 0) < 0)
-        err(1, NULL);
+    sink_rewind(d);
 
     memset(&dhdr, 0, sizeof(dhdr));
     memcpy(dhdr.sig, "SCP", sizeof(dhdr.sig));
@@ -152,99 +353,106 @@ static void scp_close(struct disk *d)
     dhdr.nr_revolutions = 1;
     dhdr.end_track = di->nr_tracks - 1;
     dhdr.flags = (1u<<_FLAG_footer);
-    write_exact(d->fd, &dhdr, sizeof(dhdr));
+
+    /* Synthesise every track's flux up front, in parallel. Duplicates are
+     * then found in order. */
+    trks = memalloc(di->nr_tracks * sizeof(*trks));
+    enc.d = d;
+    enc.trks = trks;
+    enc.hash_only = seekable;
+    disk_parallel(d, di->nr_tracks, scp_encode_track, &enc);
+    scp_find_dups(trks, di->nr_tracks);
 
     th_offs = memalloc(di->nr_tracks * sizeof(uint32_t));
-    write_exact(d->fd, th_offs, di->nr_tracks * sizeof(uint32_t));
+    thdrs = memalloc(di->nr_tracks * sizeof(*thdrs));
     file_off = sizeof(dhdr) + di->nr_tracks * sizeof(uint32_t);
 
-    raw = track_alloc_raw_buffer(d);
-    dat = memalloc(1024*1024); /* big enough */
-
-    for (trk = 0; trk < di->nr_tracks; trk++) {
-
-        th_offs[trk] = htole32(file_off);
-
-        memset(&thdr, 0, sizeof(thdr));
-        memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
-        thdr.tracknr = trk;
-        thdr.offset = htole32(sizeof(thdr));
-        write_exact(d->fd, &thdr, sizeof(thdr)); /* placeholder write */
-        file_off += sizeof(thdr);
-
-        track_read_raw(raw, trk);
-
-        /* Rotate the track so gap is at index. */
-        bit = raw->write_splice_bc;
-        if (bit > raw->data_start_bc)
-            bit = 0; /* don't mess with an already-aligned track */
-
-        av_cell = track_nsecs_from_rpm(d->rpm) / raw->bitlen;
-        j = cell = 0;
-
-        for (i = 0; i < raw->bitlen; i++) {
-            if (raw->speed[bit] == SPEED_WEAK) {
-                cell += av_cell;
-            } else {
-                cell += (av_cell * raw->speed[bit]) / SPEED_AVG;
-                if (raw->bits[bit>>3] & (0x80 >> (bit & 7))) {
-                    emit(dat, &j, cell / SCK_NS_PER_TICK);
-                    cell %= SCK_NS_PER_TICK;
+    if (seekable) {
+        sink_write(d, &dhdr, sizeof(dhdr));
+        sink_write(d, th_offs, di->nr_tracks * sizeof(uint32_t));
+        enc.hash_only = 0;
+        for (trk = 0; trk < di->nr_tracks; trk++) {
+            t = &trks[trk];
+            if (t->dup)
+                continue;
+            scp_encode_track(&enc, trk);
+            /* A group member whose flux differs after all is written in its
+             * own right, in its turn. */
+            for (pj = &t->next; (j = *pj) >= 0; ) {
+                m = &trks[j];
+                scp_encode_track(&enc, j);
+                bytes = t->nr_samples * sizeof(*t->dat);
+                if ((m->nr_samples == t->nr_samples)
+                    && !memcmp(m->dat, t->dat, bytes)) {
+                    pj = &m->next;
+                } else {
+                    *pj = m->next;
+                    m->next = -1;
+                    m->dup = 0;
                 }
+                memfree(m->dat);
+                m->dat = NULL;
             }
-            if (++bit >= raw->bitlen)
-                bit = 0;
-        }
-
-        cell /= SCK_NS_PER_TICK;
-        if (dat[0]
-            && (cell < SHORT_WEAK_THRESH)
-            && ((dat[0] + cell) < 0x10000u)) {
-            /* Place remainder in first bitcell if the result is small. */
-            dat[0] += cell;
-        } else if (cell) {
-            /* Place remainder in its own final bitcell. It may be too
-             * significant to merge with first bitcell (eg. a weak region). */
-            emit(dat, &j, cell);
+            file_off = scp_group_headers(trks, trk, thdrs, th_offs, file_off);
+            for (j = trk; j >= 0; j = trks[j].next)
+                checksum_and_write(d, &csum, &thdrs[j], sizeof(*thdrs));
+            bytes = t->nr_samples * sizeof(*t->dat);
+            checksum_and_write(d, &csum, t->dat, bytes);
+            file_off += bytes;
+            memfree(t->dat);
+            t->dat = NULL;
         }
-
-        for (i = 0; i < j; i++) {
-            thdr.duration += dat[i] ?: 0x10000u;
-            dat[i] = htobe16(dat[i]);
+    } else {
+        for (trk = 0; trk < di->nr_tracks; trk++) {
+            t = &trks[trk];
+            if (t->dup)
+                continue;
+            file_off = scp_group_headers(trks, trk, thdrs, th_offs, file_off);
+            for (j = trk; j >= 0; j = trks[j].next)
+                checksum(&csum, &thdrs[j], sizeof(*thdrs));
+            bytes = t->nr_samples * sizeof(*t->dat);
+            checksum(&csum, t->dat, bytes);
+            file_off += bytes;
         }
-
-        checksum_and_write(d->fd, &csum, dat, j * sizeof(uint16_t));
-        file_off += j * sizeof(uint16_t);
-
-        thdr.duration = htole32(thdr.duration);
-        thdr.nr_samples = htole32(j);
-        lseek(d->fd, le32toh(th_offs[trk]), SEEK_SET);
-        checksum_and_write(d->fd, &csum, &thdr, sizeof(thdr));
-        lseek(d->fd, 0, SEEK_END);
     }
 
-    memfree(dat);
-    track_free_raw_buffer(raw);
+    scp_footer(&ftr, &app_name_len, app_name, file_off);
+    checksum(&csum, th_offs, di->nr_tracks * sizeof(uint32_t));
+    checksum(&csum, &app_name_len, sizeof(app_name_len));
+    checksum(&csum, app_name, sizeof(app_name));
+    checksum(&csum, &ftr, sizeof(ftr));
+    dhdr.checksum = htole32(csum);
 
-    memset(&ftr, 0, sizeof(ftr));
-    memcpy(ftr.sig, "FPCS", sizeof(ftr.sig));
-    ftr.application_offset = htole32(lseek(d->fd, 0, SEEK_CUR));
-    ftr.creation_time = ftr.modification_time = htole64(time(NULL));
-    ftr.application_version = 0x10; /* should be moved to a general include? */
-    ftr.format_revision = 0x16; /* last specification used, 1.6 */
+    if (!seekable) {
+        sink_reserve(d, file_off + sizeof(app_name_len) + sizeof(app_name)
+                     + sizeof(ftr));
+        sink_write(d, &dhdr, sizeof(dhdr));
+        sink_write(d, th_offs, di->nr_tracks * sizeof(uint32_t));
+        for (trk = 0; trk < di->nr_tracks; trk++) {
+            t = &trks[trk];
+            if (t->dup)
+                continue;
+            for (j = trk; j >= 0; j = trks[j].next)
+                sink_write(d, &thdrs[j], sizeof(*thdrs));
+            sink_write(d, t->dat, t->nr_samples * sizeof(*t->dat));
+            memfree(t->dat);
+        }
+    }
 
-    app_name_len = htole16(strlen(app_name));
-    checksum_and_write(d->fd, &csum, &app_name_len, sizeof(app_name_len));
-    checksum_and_write(d->fd, &csum, app_name, sizeof(app_name));
-    checksum_and_write(d->fd, &csum, &ftr, sizeof(ftr));
+    sink_write(d, &app_name_len, sizeof(app_name_len));
+    sink_write(d, app_name, sizeof(app_name));
+    sink_write(d, &ftr, sizeof(ftr));
 
-    lseek(d->fd, sizeof(dhdr), SEEK_SET);
-    checksum_and_write(d->fd, &csum, th_offs,
-                       di->nr_tracks * sizeof(uint32_t));
+    if (seekable) {
+        sink_seek(d, sizeof(dhdr));
+        sink_write(d, th_offs, di->nr_tracks * sizeof(uint32_t));
+        sink_seek(d, 0);
+        sink_write(d, &dhdr, sizeof(dhdr));
+    }
 
-    dhdr.checksum = htole32(csum);
-    lseek(d->fd, 0, SEEK_SET);
-    write_exact(d->fd, &dhdr, sizeof(dhdr));
+    memfree(trks);
+    memfree(thdrs);
+    memfree(th_offs);
 }
 
 struct container container_scp = {
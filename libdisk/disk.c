@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #define X(a,b) extern struct track_handler a##_handler;
@@ -25,24 +26,92 @@ const struct track_handler *handlers[] = {
     NULL
 };
 
-static struct track_format_names {
-    const char *id_name;
-    const char *desc_name;
-} track_format_names[] = {
-#define X(a,b) {#a,b},
+/* Names are fixed at compile time; flags and parent are filled in from the
+ * handlers, along with the name index, before any caller can see them. */
+static struct track_format track_formats[] = {
+#define X(a,b) { .id_name = #a, .desc_name = b, .parent = TRKTYP_##a },
 #include <libdisk/track_types.h>
 #undef X
 };
 
-static void tbuf_finalise(struct tbuf *tbuf);
+/* Open-addressed hash index from id name to track type. */
+#define FORMAT_HASH_SIZE 512
+static uint16_t format_hash[FORMAT_HASH_SIZE];
 
-static struct container *container_from_filename(
-    const char *name)
+static unsigned int format_name_hash(const char *name)
 {
-    char suffix[8];
+    uint32_t h = 2166136261u;
+    while (*name != '\0')
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h & (FORMAT_HASH_SIZE - 1);
+}
 
-    filename_extension(name, suffix, sizeof(suffix));
+static void __initcall track_formats_init(void)
+{
+    struct track_format *f;
+    unsigned int type, h;
+
+    BUG_ON(ARRAY_SIZE(track_formats) >= FORMAT_HASH_SIZE/2);
+
+    for (type = 0; type < ARRAY_SIZE(track_formats); type++) {
+        f = &track_formats[type];
+        if (!strncmp(f->id_name, "raw_", 4))
+            f->flags |= TRKFMT_raw;
+        if (handlers[type]->write_variant != NULL) {
+            f->flags |= TRKFMT_variant;
+            f->parent = handlers[type]->parent;
+        }
+        switch (handlers[type]->density) {
+        case trkden_single:
+            f->flags |= TRKFMT_single_density;
+            break;
+        case trkden_high:
+            f->flags |= TRKFMT_high_density;
+            break;
+        case trkden_extra:
+            f->flags |= TRKFMT_extra_density;
+            break;
+        default:
+            break;
+        }
+        /* Slots hold type+1, so that zero is empty. */
+        for (h = format_name_hash(f->id_name); format_hash[h] != 0;
+             h = (h + 1) & (FORMAT_HASH_SIZE - 1))
+            continue;
+        format_hash[h] = type + 1;
+    }
+}
+
+/* Format statistics are updated once per handler call, so a single lock per
+ * table is cheap enough. */
+struct track_stats_table {
+    pthread_mutex_t lock;
+    struct track_stats st[ARRAY_SIZE(track_formats)];
+};
 
+/* Raw tracks are cached per disk so that reading a track again, or writing
+ * it to several containers, does not re-run its handler. Enough for a few
+ * copies of an 84-cylinder double-sided disk. */
+#define RAW_CACHE_MAX_BYTES (8u << 20)
+
+struct raw_cache_ent {
+    struct raw_cache_ent *next;
+    unsigned int tracknr;
+    uint32_t bytes;
+    struct track_raw raw;
+};
+
+static void raw_cache_invalidate(struct disk *d, unsigned int tracknr);
+static void spill_reload(struct disk *d, unsigned int tracknr);
+static void spill_free(struct disk *d);
+static void track_share_data(struct disk *d, unsigned int tracknr);
+static void share_free(struct disk *d);
+
+static void tbuf_finalise(struct tbuf *tbuf);
+static void tbuf_speed_to_runs(struct tbuf *tbuf);
+
+static struct container *container_from_suffix(const char *suffix)
+{
     if (!strcmp(suffix, "adf"))
         return &container_adf;
     if (!strcmp(suffix, "eadf"))
@@ -61,42 +130,243 @@ static struct container *container_from_filename(
         return &container_scp;
     if (!strcmp(suffix, "jv3"))
         return &container_jv3;
-
-    warnx("Unknown file suffix: %s", name);
     return NULL;
 }
 
+static struct container *container_from_filename(
+    const char *name)
+{
+    struct container *c;
+    char suffix[8];
+
+    filename_extension(name, suffix, sizeof(suffix));
+    if ((c = container_from_suffix(suffix)) == NULL)
+        warnx("Unknown file suffix: %s", name);
+    return c;
+}
+
+static void sink_init_fd(struct disk_sink *sink, int fd)
+{
+    sink->fd = fd;
+    sink->seekable = (fd != -1) && (lseek(fd, 0, SEEK_CUR) != (off_t)-1);
+}
+
+/* A new disk of container @c, whose image is written to @d->sink (which the
+ * caller has set up) when it is closed. */
+static struct disk *disk_alloc_created(
+    struct disk *d, struct container *c, unsigned int flags)
+{
+    unsigned int rpm = flags >> DISKFL_rpm_shift;
+
+    pthread_mutex_init(&d->tags_lock, NULL);
+    pthread_mutex_init(&d->raw_cache_lock, NULL);
+    pthread_mutex_init(&d->share_lock, NULL);
+    pthread_cond_init(&d->data_unpinned, NULL);
+    d->read_only = !!(flags & DISKFL_read_only);
+    d->kryoflux_hack = !!(flags & DISKFL_kryoflux_hack);
+    d->rpm = rpm ?: DEFAULT_RPM;
+    d->nr_jobs = 1;
+    d->container = c;
+
+    c->init(d);
+
+    return d;
+}
+
 struct disk *disk_create(const char *name, unsigned int flags)
 {
     struct disk *d;
     struct container *c;
     int fd;
-    unsigned int rpm = flags >> DISKFL_rpm_shift;
 
     if ((c = container_from_filename(name)) == NULL)
         return NULL;
 
-    if ((fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1) {
+    if (flags & DISKFL_read_only) {
+        fd = -1;
+    } else if ((fd = file_open(name, O_RDWR|O_CREAT|O_TRUNC, 0666)) == -1) {
         warn("%s", name);
         return NULL;
     }
 
     d = memalloc(sizeof(*d));
     d->fd = fd;
-    d->read_only = 0;
-    d->kryoflux_hack = !!(flags & DISKFL_kryoflux_hack);
-    d->rpm = rpm ?: DEFAULT_RPM;
-    d->container = c;
+    sink_init_fd(&d->sink, fd);
+    return disk_alloc_created(d, c, flags);
+}
 
-    c->init(d);
+static struct container *container_from_type(const char *type)
+{
+    struct container *c;
 
-    return d;
+    if ((c = container_from_suffix(type)) == NULL)
+        warnx("Unknown container type: %s", type);
+    return c;
+}
+
+struct disk *disk_create_fd(const char *type, int fd, unsigned int flags)
+{
+    struct disk *d;
+    struct container *c;
+
+    if ((c = container_from_type(type)) == NULL)
+        return NULL;
+
+    d = memalloc(sizeof(*d));
+    d->fd = -1;
+    sink_init_fd(&d->sink, fd);
+    return disk_alloc_created(d, c, flags);
+}
+
+struct disk *disk_create_mem(
+    const char *type, void **pdat, size_t *plen, unsigned int flags)
+{
+    struct disk *d;
+    struct container *c;
+
+    if ((c = container_from_type(type)) == NULL)
+        return NULL;
+
+    d = memalloc(sizeof(*d));
+    d->fd = d->sink.fd = -1;
+    d->sink.seekable = 1;
+    d->sink.pdat = pdat;
+    d->sink.plen = plen;
+    *pdat = NULL;
+    *plen = 0;
+    return disk_alloc_created(d, c, flags);
+}
+
+struct disk *disk_create_writer(
+    const char *type, int (*write)(void *opaque, const void *dat, size_t len),
+    void *opaque, unsigned int flags)
+{
+    struct disk *d;
+    struct container *c;
+
+    if ((c = container_from_type(type)) == NULL)
+        return NULL;
+
+    d = memalloc(sizeof(*d));
+    d->fd = d->sink.fd = -1;
+    d->sink.write = write;
+    d->sink.opaque = opaque;
+    return disk_alloc_created(d, c, flags);
+}
+
+bool_t sink_seekable(struct disk *d)
+{
+    return d->sink.seekable;
+}
+
+/* Give back any reservation beyond the extent written. */
+static void sink_trim(struct disk_sink *sink)
+{
+    if (sink->reserved > sink->len) {
+        if (ftruncate(sink->fd, sink->len) < 0)
+            err(1, NULL);
+    }
+    sink->reserved = 0;
+}
+
+void sink_rewind(struct disk *d)
+{
+    struct disk_sink *sink = &d->sink;
+
+    if (!sink->seekable) {
+        if (sink->len != 0)
+            errx(1, "Image cannot be rewritten: output is not seekable");
+        return;
+    }
+
+    if (sink->fd != -1) {
+        lseek(sink->fd, 0, SEEK_SET);
+        if (ftruncate(sink->fd, 0) < 0)
+            err(1, NULL);
+    }
+    sink->pos = sink->len = sink->reserved = 0;
+}
+
+void sink_reserve(struct disk *d, size_t len)
+{
+    struct disk_sink *sink = &d->sink;
+
+    if (!sink->seekable || (len == 0))
+        return;
+
+    if (sink->fd == -1) {
+        if ((sink->write == NULL) && (len > sink->max)) {
+            sink->buf = memrealloc(sink->buf, len);
+            sink->max = len;
+        }
+        return;
+    }
+
+    /* Only a file opened by name: a caller's descriptor may be a pipe, or
+     * a device. The space is allocated, rather than the file merely
+     * extended, so that it is contiguous where the filesystem can make it
+     * so, and a full disk fails here rather than part way through. */
+#if defined(__linux__)
+    if ((sink->fd == d->fd) && (posix_fallocate(sink->fd, 0, len) == 0))
+        sink->reserved = len;
+#endif
+}
+
+void sink_seek(struct disk *d, off_t off)
+{
+    struct disk_sink *sink = &d->sink;
+
+    if (!sink->seekable) {
+        if (off != sink->pos)
+            errx(1, "Image cannot be back-patched: output is not seekable");
+        return;
+    }
+
+    if (sink->fd != -1)
+        lseek(sink->fd, off, SEEK_SET);
+    sink->pos = off;
+}
+
+off_t sink_tell(struct disk *d)
+{
+    struct disk_sink *sink = &d->sink;
+
+    /* A file's offset is also moved by containers reading it back. */
+    if (sink->seekable && (sink->fd != -1))
+        return lseek(sink->fd, 0, SEEK_CUR);
+    return sink->pos;
+}
+
+void sink_write(struct disk *d, const void *dat, size_t len)
+{
+    struct disk_sink *sink = &d->sink;
+    size_t end;
+
+    if (sink->fd != -1) {
+        write_exact(sink->fd, dat, len);
+    } else if (sink->write != NULL) {
+        if ((len != 0) && sink->write(sink->opaque, dat, len))
+            errx(1, "Image writer failed");
+    } else {
+        end = sink->pos + len;
+        if (end > sink->max) {
+            sink->max = max_t(size_t, end, sink->max * 2);
+            sink->buf = memrealloc(sink->buf, sink->max);
+        }
+        if (sink->pos > sink->len)
+            memset(sink->buf + sink->len, 0, sink->pos - sink->len);
+        memcpy(sink->buf + sink->pos, dat, len);
+    }
+
+    sink->pos += len;
+    sink->len = max_t(off_t, sink->len, sink->pos);
 }
 
 struct disk *disk_open(const char *name, unsigned int flags)
 {
     struct disk *d;
     struct container *c;
+    enum mem_tag tag;
     int fd, read_only = !!(flags & DISKFL_read_only);
     unsigned int rpm = flags >> DISKFL_rpm_shift;
 
@@ -109,14 +379,26 @@ struct disk *disk_open(const char *name, unsigned int flags)
     }
 
     d = memalloc(sizeof(*d));
+    pthread_mutex_init(&d->tags_lock, NULL);
+    pthread_mutex_init(&d->raw_cache_lock, NULL);
+    pthread_mutex_init(&d->share_lock, NULL);
+    pthread_cond_init(&d->data_unpinned, NULL);
     d->fd = fd;
+    sink_init_fd(&d->sink, fd);
     d->read_only = read_only;
     d->kryoflux_hack = !!(flags & DISKFL_kryoflux_hack);
     d->rpm = rpm ?: DEFAULT_RPM;
+    d->nr_jobs = 1;
+    tag = mem_set_tag(MEMTAG_container);
     d->container = c->open(d);
+    mem_set_tag(tag);
 
     if (!d->container) {
         warnx("%s: Bad disk image", name);
+        pthread_mutex_destroy(&d->tags_lock);
+        pthread_mutex_destroy(&d->raw_cache_lock);
+        pthread_mutex_destroy(&d->share_lock);
+        pthread_cond_destroy(&d->data_unpinned);
         memfree(d);
         return NULL;
     }
@@ -124,14 +406,68 @@ struct disk *disk_open(const char *name, unsigned int flags)
     return d;
 }
 
+void track_copy(struct disk *dst, struct disk *src, unsigned int tracknr)
+{
+    struct track_info *ti = &dst->di->track[tracknr];
+    struct track_info *sti = &src->di->track[tracknr];
+
+    track_free_data(dst, ti);
+    track_load_data(src, tracknr);
+    *ti = *sti;
+    if (sti->dat != NULL) {
+        ti->dat = memalloc(ti->len);
+        memcpy(ti->dat, sti->dat, ti->len);
+        track_share_data(dst, tracknr);
+        ibm_sector_view_copy(dst, src, tracknr);
+    }
+}
+
+struct disk *disk_create_copy(
+    struct disk *src, const char *name, unsigned int flags)
+{
+    struct disk *d;
+    struct disk_list_tag *dltag;
+    unsigned int i, nr;
+
+    if ((d = disk_create(name, flags)) == NULL)
+        return NULL;
+    d->nr_jobs = src->nr_jobs;
+    d->stats = src->stats;
+    d->trace = src->trace;
+
+    nr = min(d->di->nr_tracks, src->di->nr_tracks);
+    for (i = 0; i < nr; i++)
+        track_copy(d, src, i);
+
+    pthread_mutex_lock(&src->tags_lock);
+    for (dltag = src->tags; dltag != NULL; dltag = dltag->next)
+        disk_set_tag(d, dltag->tag.id, dltag->tag.len, &dltag->tag + 1);
+    pthread_mutex_unlock(&src->tags_lock);
+
+    return d;
+}
+
 void disk_close(struct disk *d)
 {
     struct disk_list_tag *dltag;
+    enum mem_tag tag;
     struct disk_info *di = d->di;
     unsigned int i;
+    uint64_t t;
+
+    /* Containers write out track data as they find it in memory. */
+    for (i = 0; (d->spill != NULL) && (i < di->nr_tracks); i++)
+        spill_reload(d, i);
 
-    if (!d->read_only)
+    if (!d->read_only) {
+        t = trace_begin(d->trace);
+        tag = mem_set_tag(MEMTAG_container);
         d->container->close(d);
+        mem_set_tag(tag);
+        trace_end(d->trace, "container", "close", TRACE_NO_TRACK, t);
+    }
+    sink_trim(&d->sink);
+    memfree(d->container_priv);
 
     dltag = d->tags;
     while (dltag != NULL) {
@@ -139,20 +475,486 @@ void disk_close(struct disk *d)
         memfree(dltag);
         dltag = nxt;
     }
+    dltag = d->retired_tags;
+    while (dltag != NULL) {
+        struct disk_list_tag *nxt = dltag->next;
+        memfree(dltag);
+        dltag = nxt;
+    }
+    pthread_mutex_destroy(&d->tags_lock);
 
     for (i = 0; i < di->nr_tracks; i++)
-        memfree(di->track[i].dat);
+        track_free_data(d, &di->track[i]);
+    raw_cache_flush(d);
+    ibm_sector_views_free(d);
+    spill_free(d);
+    share_free(d);
+    pthread_mutex_destroy(&d->raw_cache_lock);
+    stream_unmap(&d->map);
     memfree(di->track);
     memfree(di);
-    close(d->fd);
+    if (d->fd != -1)
+        close(d->fd);
+    if (d->sink.pdat != NULL) {
+        *d->sink.pdat = d->sink.buf;
+        *d->sink.plen = d->sink.len;
+    } else {
+        memfree(d->sink.buf);
+    }
     memfree(d);
 }
 
+void disk_compact(struct disk *d)
+{
+    d->compact = 1;
+}
+
 struct disk_info *disk_get_info(struct disk *d)
 {
     return d->di;
 }
 
+static uint32_t raw_cache_bytes(const struct track_raw *raw)
+{
+    return (raw->bitlen + 7) / 8
+        + raw->nr_speed_runs * sizeof(*raw->speed_runs)
+        + raw->nr_weak_runs * sizeof(*raw->weak_runs);
+}
+
+static void raw_copy(struct track_raw *dst, const struct track_raw *src)
+{
+    *dst = *src;
+    dst->speed = NULL;
+    dst->bits = memalloc((src->bitlen + 7) / 8);
+    memcpy(dst->bits, src->bits, (src->bitlen + 7) / 8);
+    dst->speed_runs = memalloc(
+        src->nr_speed_runs * sizeof(*src->speed_runs));
+    memcpy(dst->speed_runs, src->speed_runs,
+           src->nr_speed_runs * sizeof(*src->speed_runs));
+    if (src->weak_runs != NULL) {
+        dst->weak_runs = memalloc(
+            src->nr_weak_runs * sizeof(*src->weak_runs));
+        memcpy(dst->weak_runs, src->weak_runs,
+               src->nr_weak_runs * sizeof(*src->weak_runs));
+    }
+}
+
+static void raw_cache_free_ent(struct disk *d, struct raw_cache_ent *e)
+{
+    d->raw_cache_bytes -= e->bytes;
+    track_purge_raw_buffer(&e->raw);
+    memfree(e);
+}
+
+static bool_t raw_cache_get(
+    struct disk *d, unsigned int tracknr, struct track_raw *raw)
+{
+    struct raw_cache_ent *e, **pprev;
+
+    pthread_mutex_lock(&d->raw_cache_lock);
+    for (pprev = &d->raw_cache; (e = *pprev) != NULL; pprev = &e->next) {
+        if (e->tracknr != tracknr)
+            continue;
+        /* Move to front. */
+        *pprev = e->next;
+        e->next = d->raw_cache;
+        d->raw_cache = e;
+        raw_copy(raw, &e->raw);
+        break;
+    }
+    pthread_mutex_unlock(&d->raw_cache_lock);
+
+    return e != NULL;
+}
+
+static void raw_cache_put(
+    struct disk *d, unsigned int tracknr, const struct track_raw *raw)
+{
+    struct raw_cache_ent *e, **pprev;
+    uint32_t bytes = raw_cache_bytes(raw);
+
+    if ((raw->bits == NULL) || (bytes > RAW_CACHE_MAX_BYTES))
+        return;
+
+    e = memalloc(sizeof(*e));
+    e->tracknr = tracknr;
+    e->bytes = bytes;
+    raw_copy(&e->raw, raw);
+
+    pthread_mutex_lock(&d->raw_cache_lock);
+    /* A concurrent reader may have beaten us to it. */
+    for (pprev = &d->raw_cache; *pprev != NULL; pprev = &(*pprev)->next) {
+        if ((*pprev)->tracknr == tracknr) {
+            struct raw_cache_ent *old = *pprev;
+            *pprev = old->next;
+            raw_cache_free_ent(d, old);
+            break;
+        }
+    }
+    e->next = d->raw_cache;
+    d->raw_cache = e;
+    d->raw_cache_bytes += bytes;
+    /* Evict least recently used entries from the tail. */
+    while (d->raw_cache_bytes > RAW_CACHE_MAX_BYTES) {
+        for (pprev = &d->raw_cache; (*pprev)->next != NULL;
+             pprev = &(*pprev)->next)
+            continue;
+        raw_cache_free_ent(d, *pprev);
+        *pprev = NULL;
+    }
+    pthread_mutex_unlock(&d->raw_cache_lock);
+}
+
+static void raw_cache_invalidate(struct disk *d, unsigned int tracknr)
+{
+    struct raw_cache_ent *e, **pprev;
+
+    pthread_mutex_lock(&d->raw_cache_lock);
+    for (pprev = &d->raw_cache; (e = *pprev) != NULL; pprev = &e->next) {
+        if (e->tracknr == tracknr) {
+            *pprev = e->next;
+            raw_cache_free_ent(d, e);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&d->raw_cache_lock);
+}
+
+void raw_cache_flush(struct disk *d)
+{
+    struct raw_cache_ent *e;
+
+    pthread_mutex_lock(&d->raw_cache_lock);
+    while ((e = d->raw_cache) != NULL) {
+        d->raw_cache = e->next;
+        raw_cache_free_ent(d, e);
+    }
+    pthread_mutex_unlock(&d->raw_cache_lock);
+}
+
+/* Track data spilled under a memory budget, or compressed. A track's data is
+ * appended to the spill file each time it is spilled, and is read back from
+ * there until the track is next freed. Compressed data is kept, and
+ * decompressed again as needed, until the track is next freed. */
+struct disk_spill {
+    pthread_mutex_t lock;
+    uint64_t budget;
+    bool_t compress;
+    FILE *fp;
+    long end;
+    long *off; /* per track: offset of its spilled data, or -1 */
+    uint8_t **lz; /* per track: its compressed data, or NULL */
+    uint32_t *lz_len;
+};
+
+/* Whether @ti's data points into the image file mapping. */
+static bool_t track_data_mapped(struct disk *d, struct track_info *ti)
+{
+    uint8_t *base = d->map.base;
+    return ((base != NULL) && (ti->dat >= base)
+            && (ti->dat < base + d->map.len));
+}
+
+static struct disk_spill *spill_init(struct disk *d)
+{
+    struct disk_spill *sp = d->spill;
+    unsigned int i;
+
+    if (sp == NULL) {
+        sp = memalloc(sizeof(*sp));
+        pthread_mutex_init(&sp->lock, NULL);
+        sp->off = memalloc(d->di->nr_tracks * sizeof(*sp->off));
+        for (i = 0; i < d->di->nr_tracks; i++)
+            sp->off[i] = -1;
+        sp->lz = memalloc(d->di->nr_tracks * sizeof(*sp->lz));
+        sp->lz_len = memalloc(d->di->nr_tracks * sizeof(*sp->lz_len));
+        d->spill = sp;
+    }
+    return sp;
+}
+
+void disk_set_mem_budget(struct disk *d, uint64_t bytes)
+{
+    spill_init(d)->budget = bytes;
+}
+
+void disk_set_mem_compress(struct disk *d, bool_t compress)
+{
+    spill_init(d)->compress = compress;
+}
+
+/* Tracks of identical data share one buffer, which is freed with its last
+ * reference. Tracks are compared as they are settled, by a hash of their
+ * data: @hash[i] is 0 while track i has not been settled since it was last
+ * written. Buffers in @ent are referenced by more than one track; any other
+ * buffer belongs to its track alone. */
+struct track_share {
+    uint64_t *hash;
+    unsigned int nr_ent;
+    struct shared_dat {
+        uint8_t *dat;
+        uint32_t len;
+        unsigned int refs;
+    } *ent;
+};
+
+static struct shared_dat *share_find(struct track_share *sh, const void *dat)
+{
+    unsigned int i;
+
+    for (i = 0; (sh != NULL) && (i < sh->nr_ent); i++)
+        if (sh->ent[i].dat == dat)
+            return &sh->ent[i];
+    return NULL;
+}
+
+/* Is @tracknr's data held in place by a reader? Called with share_lock
+ * held. */
+static bool_t track_data_pinned(struct disk *d, unsigned int tracknr)
+{
+    return (d->data_pins != NULL) && (d->data_pins[tracknr] != 0);
+}
+
+/* Drop a reference to track data @dat. Called with share_lock held. */
+static void share_put(struct disk *d, void *dat)
+{
+    struct track_share *sh = d->share;
+    struct shared_dat *e = share_find(sh, dat);
+
+    if (e != NULL) {
+        if (--e->refs != 0)
+            return;
+        *e = sh->ent[--sh->nr_ent];
+    }
+    memfree(dat);
+}
+
+static void track_share_data(struct disk *d, unsigned int tracknr)
+{
+    struct disk_info *di = d->di;
+    struct track_info *t, *ti = &di->track[tracknr];
+    struct track_share *sh;
+    struct shared_dat *e;
+    unsigned int i;
+    uint64_t h;
+
+    if ((ti->dat == NULL) || (ti->len == 0) || track_data_mapped(d, ti))
+        return;
+
+    h = hash64_add(ti->dat, ti->len, ti->len) | 1;
+
+    pthread_mutex_lock(&d->share_lock);
+
+    if ((sh = d->share) == NULL) {
+        sh = d->share = memalloc(sizeof(*sh));
+        sh->hash = memalloc(di->nr_tracks * sizeof(*sh->hash));
+        sh->ent = memalloc(di->nr_tracks * sizeof(*sh->ent));
+    }
+    sh->hash[tracknr] = h;
+
+    /* A pinned buffer stays where it is, though others may share it. */
+    for (i = 0; !track_data_pinned(d, tracknr) && (i < di->nr_tracks); i++) {
+        t = &di->track[i];
+        if ((i == tracknr) || (sh->hash[i] != h) || (t->dat == NULL)
+            || (t->len != ti->len))
+            continue;
+        if (t->dat == ti->dat)
+            break;
+        if (memcmp(t->dat, ti->dat, ti->len))
+            continue;
+        if ((e = share_find(sh, t->dat)) == NULL) {
+            e = &sh->ent[sh->nr_ent++];
+            e->dat = t->dat;
+            e->len = t->len;
+            e->refs = 1;
+        }
+        e->refs++;
+        share_put(d, ti->dat);
+        ti->dat = t->dat;
+        break;
+    }
+
+    pthread_mutex_unlock(&d->share_lock);
+}
+
+static void share_free(struct disk *d)
+{
+    struct track_share *sh = d->share;
+
+    pthread_mutex_destroy(&d->share_lock);
+    pthread_cond_destroy(&d->data_unpinned);
+    memfree(d->data_pins);
+    d->data_pins = NULL;
+    if (sh == NULL)
+        return;
+    memfree(sh->hash);
+    memfree(sh->ent);
+    memfree(sh);
+    d->share = NULL;
+}
+
+/* Release @tracknr's data in favour of a compressed copy, unless it is
+ * shared or does not shrink. Returns TRUE if ti->dat has been released. */
+static bool_t spill_compress(struct disk *d, unsigned int tracknr)
+{
+    struct disk_spill *sp = d->spill;
+    struct track_info *ti = &d->di->track[tracknr];
+    uint8_t *buf = NULL, *lz = NULL;
+    uint32_t len = 0;
+    bool_t shared, done = 0;
+
+    pthread_mutex_lock(&d->share_lock);
+    shared = (share_find(d->share, ti->dat) != NULL);
+    pthread_mutex_unlock(&d->share_lock);
+    if (shared)
+        return 0;
+
+    /* Data decompressed earlier is unchanged: its compressed copy stands. */
+    if (sp->lz[tracknr] == NULL) {
+        buf = memalloc_nz(lz4_bound(ti->len));
+        len = lz4_compress(ti->dat, ti->len, buf);
+        if (len < ti->len) {
+            lz = memalloc_nz(len);
+            memcpy(lz, buf, len);
+        }
+        memfree(buf);
+        if (lz == NULL)
+            return 0;
+    }
+
+    pthread_mutex_lock(&sp->lock);
+    pthread_mutex_lock(&d->share_lock);
+    if ((share_find(d->share, ti->dat) == NULL)
+        && !track_data_pinned(d, tracknr)) {
+        if (lz != NULL) {
+            sp->lz[tracknr] = lz;
+            sp->lz_len[tracknr] = len;
+            lz = NULL;
+        }
+        memfree(ti->dat);
+        ti->dat = NULL;
+        done = 1;
+    }
+    pthread_mutex_unlock(&d->share_lock);
+    pthread_mutex_unlock(&sp->lock);
+
+    memfree(lz);
+    return done;
+}
+
+void track_settle(struct disk *d, unsigned int tracknr)
+{
+    struct disk_spill *sp = d->spill;
+    struct disk_info *di = d->di;
+    struct track_info *ti = &di->track[tracknr];
+    struct track_share *sh;
+    uint64_t held = 0;
+    unsigned int i;
+
+    track_share_data(d, tracknr);
+
+    if ((sp == NULL) || (ti->dat == NULL) || (ti->len == 0)
+        || track_data_mapped(d, ti))
+        return;
+
+    if (sp->compress && spill_compress(d, tracknr))
+        return;
+
+    if (sp->budget == 0)
+        return;
+
+    pthread_mutex_lock(&sp->lock);
+    pthread_mutex_lock(&d->share_lock);
+
+    /* Shared data is counted once, and is not spilled. */
+    sh = d->share;
+    for (i = 0; i < di->nr_tracks; i++) {
+        if ((di->track[i].dat != NULL) && !track_data_mapped(d, &di->track[i]))
+            held += di->track[i].len;
+        else if (sp->lz[i] != NULL)
+            held += sp->lz_len[i];
+    }
+    for (i = 0; (sh != NULL) && (i < sh->nr_ent); i++)
+        held -= (uint64_t)(sh->ent[i].refs - 1) * sh->ent[i].len;
+    if ((held <= sp->budget) || (share_find(sh, ti->dat) != NULL)
+        || track_data_pinned(d, tracknr))
+        goto out;
+
+    if ((sp->fp == NULL) && ((sp->fp = tmpfile()) == NULL)) {
+        warn("Unable to create spill file");
+        sp->budget = 0;
+        goto out;
+    }
+    if ((fseek(sp->fp, sp->end, SEEK_SET) != 0)
+        || (fwrite(ti->dat, ti->len, 1, sp->fp) != 1)) {
+        warn("Unable to spill track data");
+        sp->budget = 0;
+        goto out;
+    }
+    sp->off[tracknr] = sp->end;
+    sp->end += ti->len;
+    memfree(ti->dat);
+    ti->dat = NULL;
+
+out:
+    pthread_mutex_unlock(&d->share_lock);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+static void spill_reload(struct disk *d, unsigned int tracknr)
+{
+    struct disk_spill *sp = d->spill;
+    struct track_info *ti = &d->di->track[tracknr];
+    void *dat;
+
+    pthread_mutex_lock(&sp->lock);
+    if ((ti->dat == NULL) && (sp->lz[tracknr] != NULL)) {
+        dat = memalloc_nz(ti->len);
+        if (lz4_decompress(sp->lz[tracknr], sp->lz_len[tracknr],
+                           dat, ti->len) != 0)
+            errx(1, "Unable to decompress track data");
+        ti->dat = dat;
+    } else if ((ti->dat == NULL) && (sp->off[tracknr] >= 0)) {
+        dat = memalloc(ti->len);
+        if ((fseek(sp->fp, sp->off[tracknr], SEEK_SET) != 0)
+            || (fread(dat, ti->len, 1, sp->fp) != 1))
+            err(1, "Unable to read back spilled track data");
+        ti->dat = dat;
+    }
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/* Forget any spilled or compressed copy of @tracknr's data. */
+static void spill_drop(struct disk *d, unsigned int tracknr)
+{
+    struct disk_spill *sp = d->spill;
+
+    pthread_mutex_lock(&sp->lock);
+    sp->off[tracknr] = -1;
+    memfree(sp->lz[tracknr]);
+    sp->lz[tracknr] = NULL;
+    pthread_mutex_unlock(&sp->lock);
+}
+
+static void spill_free(struct disk *d)
+{
+    struct disk_spill *sp = d->spill;
+    unsigned int i;
+
+    if (sp == NULL)
+        return;
+    if (sp->fp != NULL)
+        fclose(sp->fp);
+    pthread_mutex_destroy(&sp->lock);
+    for (i = 0; i < d->di->nr_tracks; i++)
+        memfree(sp->lz[i]);
+    memfree(sp->lz);
+    memfree(sp->lz_len);
+    memfree(sp->off);
+    memfree(sp);
+    d->spill = NULL;
+}
+
 struct track_raw *track_alloc_raw_buffer(struct disk *d)
 {
     struct tbuf *tbuf = memalloc(sizeof(*tbuf));
@@ -166,6 +968,8 @@ void track_free_raw_buffer(struct track_raw *track_raw)
     struct tbuf *tbuf = container_of(track_raw, struct tbuf, raw);
 
     track_purge_raw_buffer(track_raw);
+    memfree(tbuf->spare_bits);
+    memfree(tbuf->spare_speed);
     memfree(tbuf);
 }
 
@@ -173,6 +977,8 @@ void track_purge_raw_buffer(struct track_raw *track_raw)
 {
     memfree(track_raw->bits);
     memfree(track_raw->speed);
+    memfree(track_raw->speed_runs);
+    memfree(track_raw->weak_runs);
     memset(track_raw, 0, sizeof(*track_raw));
 }
 
@@ -183,20 +989,142 @@ void track_read_raw(struct track_raw *track_raw, unsigned int tracknr)
     struct disk_info *di = d->di;
     struct track_info *ti;
     const struct track_handler *thnd;
-
+    enum mem_tag tag;
+    uint64_t t;
+    uint32_t prng_seed;
+
+    /* Keep the previous track's bitcell buffer, for tbuf_init() to reuse. */
+    if ((track_raw->bits != NULL) && (tbuf->bits_max > tbuf->spare_bits_max)) {
+        memfree(tbuf->spare_bits);
+        tbuf->spare_bits = track_raw->bits;
+        tbuf->spare_bits_max = tbuf->bits_max;
+        track_raw->bits = NULL;
+    }
     track_purge_raw_buffer(track_raw);
 
     if (tracknr >= di->nr_tracks)
         return;
     ti = &di->track[tracknr];
 
+    if (raw_cache_get(d, tracknr, track_raw)) {
+        tbuf->bits_max = (track_raw->bitlen + 7) / 8;
+        /* Weak bits are generated afresh, as the handler would. */
+        if (track_raw->weak_runs != NULL)
+            track_raw_regen_weak(track_raw);
+        return;
+    }
+
     if ((int32_t)ti->total_bits > 0)
         tbuf_init(tbuf, ti->data_bitoff, ti->total_bits);
 
+    track_load_data(d, tracknr);
+    t = trace_begin(d->trace);
     thnd = handlers[ti->type];
+    prng_seed = tbuf->prng_seed;
+    tbuf->nr_rnd = tbuf->nr_weak_rnd = 0;
+    tbuf->weak_exact = 1;
+    tag = mem_set_tag(MEMTAG_tbuf);
     thnd->read_raw(d, tracknr, tbuf);
+    mem_set_tag(tag);
 
     tbuf_finalise(tbuf);
+    tbuf_speed_to_runs(tbuf);
+    trace_end(d->trace, "read_raw", disk_get_format_id_name(ti->type), tracknr, t);
+
+    if (!tbuf->weak_exact || (tbuf->nr_rnd != tbuf->nr_weak_rnd)) {
+        memfree(track_raw->weak_runs);
+        track_raw->weak_runs = NULL;
+        track_raw->nr_weak_runs = 0;
+    }
+
+    /* Tracks which drew on the PRNG differ from one read to the next, unless
+     * it was only for weak regions, which are regenerated on a cache hit. */
+    if ((!track_raw->has_weak_bits && (tbuf->prng_seed == prng_seed))
+        || (track_raw->weak_runs != NULL))
+        raw_cache_put(d, tracknr, track_raw);
+}
+
+static bool_t test_bit(const uint8_t *map, unsigned int bit)
+{
+    return (map[bit>>3] >> (~bit & 7)) & 1;
+}
+
+static void change_bit(uint8_t *map, unsigned int bit, bool_t on);
+
+void track_raw_regen_weak(struct track_raw *raw)
+{
+    struct tbuf *tbuf = container_of(raw, struct tbuf, raw);
+    struct track_weak_run *w;
+    uint32_t i, j, pos;
+    uint16_t rnd[64];
+    uint8_t prev, dat;
+
+    for (i = 0; i < raw->nr_weak_runs; i++) {
+        w = &raw->weak_runs[i];
+        pos = w->start;
+        /* The data bit before the region, as the encoder last saw it. */
+        prev = (pos == raw->data_start_bc) ? 0
+            : test_bit(raw->bits, (pos ?: raw->bitlen) - 1);
+        for (j = 0; j < w->bits; j++) {
+            if ((j & 63) == 0)
+                tbuf_rnd16_bulk(tbuf, rnd, min_t(uint32_t, w->bits - j, 64));
+            dat = rnd[j & 63] & 1;
+            change_bit(raw->bits, pos, !(prev | dat));
+            if (++pos >= raw->bitlen)
+                pos = 0;
+            change_bit(raw->bits, pos, dat);
+            if (++pos >= raw->bitlen)
+                pos = 0;
+            prev = dat;
+        }
+        if (w->clk_after)
+            change_bit(raw->bits, pos, !(prev | test_bit(
+                           raw->bits, (pos + 1 < raw->bitlen) ? pos + 1 : 0)));
+    }
+}
+
+uint16_t track_raw_speed_at(
+    const struct track_raw *raw, uint32_t bc, uint32_t *run)
+{
+    const struct track_speed_run *r = raw->speed_runs;
+    uint32_t i = *run, lo, hi;
+
+    if ((i >= raw->nr_speed_runs) || (r[i].start > bc)) {
+        /* Out of order: binary search for the last run starting <= @bc. */
+        lo = 0; hi = raw->nr_speed_runs;
+        while (hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            if (r[mid].start <= bc)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        i = lo;
+    }
+
+    while ((i + 1 < raw->nr_speed_runs) && (r[i+1].start <= bc))
+        i++;
+
+    *run = i;
+    return r[i].speed;
+}
+
+uint16_t *track_raw_speed(struct track_raw *raw)
+{
+    uint32_t i, j, end;
+
+    if ((raw->speed != NULL) || (raw->bitlen == 0))
+        return raw->speed;
+
+    raw->speed = memalloc(2*raw->bitlen);
+    for (i = 0; i < raw->nr_speed_runs; i++) {
+        end = (i + 1 < raw->nr_speed_runs)
+            ? raw->speed_runs[i+1].start : raw->bitlen;
+        for (j = raw->speed_runs[i].start; j < end; j++)
+            raw->speed[j] = raw->speed_runs[i].speed;
+    }
+
+    return raw->speed;
 }
 
 int track_write_raw(
@@ -205,7 +1133,7 @@ int track_write_raw(
 {
     struct tbuf *tbuf = container_of(raw, struct tbuf, raw);
     struct stream *s = stream_soft_open(
-        raw->bits, raw->speed, raw->bitlen, rpm);
+        raw->bits, track_raw_speed(raw), raw->bitlen, rpm);
     int rc = track_write_raw_from_stream(tbuf->disk, tracknr, type, s);
     stream_close(s);
     return rc;
@@ -217,11 +1145,268 @@ int track_write_raw_from_stream(
 {
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
-
-    memfree(ti->dat);
+    struct track_stats *st;
+    struct timespec t0, t1;
+    enum mem_tag tag;
+    uint64_t t = trace_begin(d->trace);
+    int64_t bc;
+    int rc;
+
+    track_free_data(d, ti);
     ti->dat = NULL;
 
-    return d->container->write_raw(d, tracknr, type, s);
+    if (!d->stats || (type >= ARRAY_SIZE(d->stats->st))) {
+        tag = mem_set_tag(MEMTAG_handler);
+        rc = d->container->write_raw(d, tracknr, type, s);
+        mem_set_tag(tag);
+        trace_end(d->trace, "write_raw", disk_get_format_id_name(type), tracknr, t);
+        return rc;
+    }
+
+    bc = s->bc_read_base + s->index_offset_bc;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    tag = mem_set_tag(MEMTAG_handler);
+    rc = d->container->write_raw(d, tracknr, type, s);
+    mem_set_tag(tag);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    trace_end(d->trace, "write_raw", disk_get_format_id_name(type), tracknr, t);
+    bc = s->bc_read_base + s->index_offset_bc - bc;
+
+    st = &d->stats->st[type];
+    pthread_mutex_lock(&d->stats->lock);
+    st->calls++;
+    st->matches += (rc == 0);
+    st->bitcells += bc;
+    st->nsecs += (t1.tv_sec - t0.tv_sec) * 1000000000ll
+        + (t1.tv_nsec - t0.tv_nsec);
+    pthread_mutex_unlock(&d->stats->lock);
+
+    return rc;
+}
+
+int track_write_raw_from_stream_any(
+    struct disk *d, unsigned int tracknr, const uint16_t *types,
+    unsigned int nr, unsigned int start, struct stream *s,
+    int (*match)(void *arg, unsigned int i), void *arg)
+{
+    /* Per density: 0 = not yet checked, 1 = possible, 2 = ruled out. */
+    uint8_t ruled[trkden_extra + 1] = { 0 }, *verdict;
+    struct parent_memo memo = { 0 }, *outer = s->parent_memo;
+    unsigned int i, j, type, den;
+    int last = -1;
+
+    /* Scanners reject what they can in one pass over the track. */
+    verdict = memalloc(nr);
+    dsk_scan(d, tracknr, types, nr, s, verdict);
+
+    /* Decode once for all the listed variants of the first parent type. */
+    for (j = 0; j < nr; j++) {
+        if (handlers[types[j]]->write_variant != NULL) {
+            memo.type = handlers[types[j]]->parent;
+            s->parent_memo = &memo;
+            break;
+        }
+    }
+
+    for (j = 0, i = start; j < nr; j++, i = (i + 1 < nr) ? i + 1 : 0) {
+        type = types[i];
+        /* The last type is always tried, so that the track is left as a
+         * failed handler pass leaves it. */
+        if ((type != TRKTYP_unformatted) &&
+            ((type < TRKTYP_raw_sd) || (type > TRKTYP_raw_ed)) &&
+            (j + 1 < nr)) {
+            if (verdict[i] == SCAN_reject)
+                continue;
+            den = handlers[type]->density;
+            if (ruled[den] == 0)
+                ruled[den] = 1 + dsk_density_ruled_out(tracknr, type, s);
+            if (ruled[den] == 2)
+                continue;
+        }
+        if (track_write_raw_from_stream(d, tracknr, type, s) != 0)
+            continue;
+        last = i;
+        if ((match == NULL) || !match(arg, i))
+            break;
+    }
+
+    s->parent_memo = outer;
+    memfree(memo.ti.dat);
+    memfree(verdict);
+    return last;
+}
+
+void disk_set_jobs(struct disk *d, unsigned int nr)
+{
+    d->nr_jobs = max(nr, 1u);
+}
+
+struct parallel {
+    pthread_mutex_t lock;
+    unsigned int next, nr;
+    void (*fn)(void *, unsigned int);
+    void *arg;
+};
+
+static void *parallel_worker_fn(void *_p)
+{
+    struct parallel *p = _p;
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (i >= p->nr)
+            break;
+        p->fn(p->arg, i);
+    }
+
+    return NULL;
+}
+
+void disk_parallel(
+    struct disk *d, unsigned int nr, void (*fn)(void *arg, unsigned int i),
+    void *arg)
+{
+    struct parallel p = { .nr = nr, .fn = fn, .arg = arg };
+    unsigned int i, nr_threads = min(d->nr_jobs, nr);
+    pthread_t *threads;
+    int rc;
+
+    if (nr_threads <= 1) {
+        for (i = 0; i < nr; i++)
+            fn(arg, i);
+        return;
+    }
+
+    pthread_mutex_init(&p.lock, NULL);
+    threads = memalloc(nr_threads * sizeof(*threads));
+    /* The calling thread is worker 0. */
+    for (i = 1; i < nr_threads; i++)
+        if ((rc = pthread_create(&threads[i], NULL,
+                                 parallel_worker_fn, &p)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    parallel_worker_fn(&p);
+    for (i = 1; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    memfree(threads);
+    pthread_mutex_destroy(&p.lock);
+}
+
+/* Per-thread scratch arena for track_scratch(). A request which does not fit
+ * is allocated separately, and the arena is regrown at the next reset to the
+ * attempt's total demand, so that steady-state attempts never call malloc. */
+struct scratch_overflow {
+    struct scratch_overflow *next;
+} __attribute__((aligned(16)));
+
+struct scratch {
+    uint8_t *base;
+    size_t size, used;
+    struct scratch_overflow *overflow;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_destroy(void *p)
+{
+    struct scratch *sc = p;
+    struct scratch_overflow *o;
+
+    while ((o = sc->overflow) != NULL) {
+        sc->overflow = o->next;
+        memfree(o);
+    }
+    memfree(sc->base);
+    memfree(sc);
+}
+
+static void scratch_key_init(void)
+{
+    int rc = pthread_key_create(&scratch_key, scratch_destroy);
+    if (rc != 0)
+        errx(1, "Failed to create scratch arena key: %s", strerror(rc));
+}
+
+void *track_scratch(size_t size)
+{
+    struct scratch *sc;
+    struct scratch_overflow *o;
+
+    pthread_once(&scratch_once, scratch_key_init);
+    if ((sc = pthread_getspecific(scratch_key)) == NULL) {
+        sc = memalloc(sizeof(*sc));
+        pthread_setspecific(scratch_key, sc);
+    }
+
+    size = (size + 15) & ~(size_t)15;
+    sc->used += size;
+    if (sc->used <= sc->size)
+        return sc->base + sc->used - size;
+
+    o = memalloc_nz(sizeof(*o) + size);
+    o->next = sc->overflow;
+    sc->overflow = o;
+    return o + 1;
+}
+
+void track_scratch_reset(void)
+{
+    struct scratch *sc;
+    struct scratch_overflow *o;
+
+    pthread_once(&scratch_once, scratch_key_init);
+    if ((sc = pthread_getspecific(scratch_key)) == NULL)
+        return;
+
+    while ((o = sc->overflow) != NULL) {
+        sc->overflow = o->next;
+        memfree(o);
+    }
+    if (sc->used > sc->size) {
+        memfree(sc->base);
+        sc->base = memalloc_nz(sc->used);
+        sc->size = sc->used;
+    }
+    sc->used = 0;
+}
+
+struct track_stats_table *track_stats_alloc(void)
+{
+    struct track_stats_table *table = memalloc(sizeof(*table));
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+void track_stats_free(struct track_stats_table *table)
+{
+    if (table == NULL)
+        return;
+    pthread_mutex_destroy(&table->lock);
+    memfree(table);
+}
+
+int track_get_stats(struct track_stats_table *table, enum track_type type,
+                    struct track_stats *stats)
+{
+    if (type >= ARRAY_SIZE(table->st))
+        return -1;
+    pthread_mutex_lock(&table->lock);
+    *stats = table->st[type];
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+}
+
+void disk_set_stats(struct disk *d, struct track_stats_table *table)
+{
+    d->stats = table;
+}
+
+void disk_set_trace(struct disk *d, struct trace *trace)
+{
+    d->trace = trace;
 }
 
 struct sbuf {
@@ -269,6 +1454,7 @@ int track_read_sectors(
     if (thnd->read_sectors == NULL)
         return -1;
 
+    track_load_data(d, tracknr);
     thnd->read_sectors(d, tracknr, track_sectors);
     return track_sectors->data ? 0 : -1;
 }
@@ -288,7 +1474,7 @@ int track_write_sectors(
         return -1;
     ti = &di->track[tracknr];
 
-    memfree(ti->dat);
+    track_free_data(d, ti);
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, type);
 
@@ -323,70 +1509,145 @@ void track_mark_unformatted(
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
 
-    memfree(ti->dat);
+    track_free_data(d, ti);
     memset(ti, 0, sizeof(*ti));
     init_track_info(ti, TRKTYP_unformatted);
     ti->total_bits = TRK_WEAK;
 }
 
-struct disktag *disk_get_tag_by_id(struct disk *d, uint16_t id)
+void disk_index_tags(struct disk *d)
 {
     struct disk_list_tag *dltag;
+    pthread_mutex_lock(&d->tags_lock);
+    memset(d->tag_by_id, 0, sizeof(d->tag_by_id));
     for (dltag = d->tags; dltag != NULL; dltag = dltag->next)
-        if (dltag->tag.id == id)
-            return &dltag->tag;
-    return NULL;
+        if (dltag->tag.id < NR_INDEXED_TAGS)
+            d->tag_by_id[dltag->tag.id] = &dltag->tag;
+    pthread_mutex_unlock(&d->tags_lock);
+}
+
+struct disktag *disk_get_tag_by_id(struct disk *d, uint16_t id)
+{
+    struct disk_list_tag *dltag;
+    struct disktag *tag;
+    pthread_mutex_lock(&d->tags_lock);
+    if (id < NR_INDEXED_TAGS) {
+        tag = d->tag_by_id[id];
+    } else {
+        for (dltag = d->tags; dltag != NULL; dltag = dltag->next)
+            if (dltag->tag.id == id)
+                break;
+        tag = dltag ? &dltag->tag : NULL;
+    }
+    pthread_mutex_unlock(&d->tags_lock);
+    return tag;
 }
 
 struct disktag *disk_get_tag_by_idx(struct disk *d, unsigned int idx)
 {
     struct disk_list_tag *dltag;
     unsigned int i;
+    pthread_mutex_lock(&d->tags_lock);
     for (dltag = d->tags, i = 0;
          (dltag != NULL) && (i < idx);
          dltag = dltag->next, i++)
         continue;
+    pthread_mutex_unlock(&d->tags_lock);
     return dltag ? &dltag->tag : NULL;
 }
 
+/* Insert @dltag into the disk's sorted tag list. An existing tag of the same
+ * id is retired if @replace, else it stays and is returned. */
+static struct disktag *insert_tag(
+    struct disk *d, struct disk_list_tag *dltag, bool_t replace)
+{
+    struct disk_list_tag **pprev, *cur;
+    uint16_t id = dltag->tag.id;
+
+    pthread_mutex_lock(&d->tags_lock);
+    for (pprev = &d->tags; (cur = *pprev) != NULL; pprev = &cur->next)
+        if (cur->tag.id >= id)
+            break;
+    if ((cur != NULL) && (cur->tag.id == id)) {
+        if (!replace) {
+            pthread_mutex_unlock(&d->tags_lock);
+            memfree(dltag);
+            return &cur->tag;
+        }
+        dltag->next = cur->next;
+        cur->next = d->retired_tags;
+        d->retired_tags = cur;
+    } else {
+        dltag->next = cur;
+    }
+    *pprev = dltag;
+    if (id < NR_INDEXED_TAGS)
+        d->tag_by_id[id] = &dltag->tag;
+    pthread_mutex_unlock(&d->tags_lock);
+
+    /* Handlers may consult tags when building a raw track. */
+    raw_cache_flush(d);
+
+    return &dltag->tag;
+}
+
+static struct disktag *set_tag(
+    struct disk *d, uint16_t id, uint16_t len, void *dat, bool_t replace)
+{
+    struct disk_list_tag *dltag;
+
+    dltag = memalloc(sizeof(*dltag) + len);
+    dltag->tag.id = id;
+    dltag->tag.len = len;
+    memcpy(&dltag->tag + 1, dat, len);
+
+    return insert_tag(d, dltag, replace);
+}
+
 struct disktag *disk_set_tag(
     struct disk *d, uint16_t id, uint16_t len, void *dat)
 {
-    struct disk_list_tag *dltag, **pprev;
+    return set_tag(d, id, len, dat, 1);
+}
 
-    dltag = memalloc(sizeof(*dltag) + len);
-    dltag->tag.id = id;
-    dltag->tag.len = len;
-    memcpy(&dltag->tag + 1, dat, len);
+struct disktag *disk_set_tag_once(
+    struct disk *d, uint16_t id, uint16_t len, void *dat)
+{
+    struct disktag *tag = disk_get_tag_by_id(d, id);
+    return tag ?: set_tag(d, id, len, dat, 0);
+}
 
-    for (pprev = &d->tags; *pprev != NULL; pprev = &(*pprev)->next) {
-        struct disk_list_tag *cur = *pprev;
-        if (cur->tag.id < id)
-            continue;
-        dltag->next = cur;
-        *pprev = dltag;
-        if (cur->tag.id == id) {
-            dltag->next = cur->next;
-            memfree(cur);
-        }
-        break;
-    }
+const struct track_format *disk_get_format(enum track_type type)
+{
+    if (type >= ARRAY_SIZE(track_formats))
+        return NULL;
+    return &track_formats[type];
+}
 
-    return &dltag->tag;
+int disk_get_format_by_id_name(const char *name)
+{
+    unsigned int h, type;
+
+    for (h = format_name_hash(name); (type = format_hash[h]) != 0;
+         h = (h + 1) & (FORMAT_HASH_SIZE - 1))
+        if (!strcmp(track_formats[type-1].id_name, name))
+            return type - 1;
+
+    return -1;
 }
 
 const char *disk_get_format_id_name(enum track_type type)
 {
-    if (type >= ARRAY_SIZE(track_format_names))
+    if (type >= ARRAY_SIZE(track_formats))
         return NULL;
-    return track_format_names[type].id_name;
+    return track_formats[type].id_name;
 }
 
 const char *disk_get_format_desc_name(enum track_type type)
 {
-    if (type >= ARRAY_SIZE(track_format_names))
+    if (type >= ARRAY_SIZE(track_formats))
         return NULL;
-    return track_format_names[type].desc_name;
+    return track_formats[type].desc_name;
 }
 
 void track_get_format_name(
@@ -404,10 +1665,12 @@ void track_get_format_name(
     ti = &di->track[tracknr];
     thnd = handlers[ti->type];
 
-    if (thnd->get_name)
+    if (thnd->get_name) {
+        track_load_data(d, tracknr);
         thnd->get_name(d, tracknr, str, size);
-    else
+    } else {
         snprintf(str, size, "%s", ti->typename ?: "???");
+    }
 }
 
 int is_valid_sector(struct track_info *ti, unsigned int sector)
@@ -416,10 +1679,57 @@ int is_valid_sector(struct track_info *ti, unsigned int sector)
     return (ti->valid_sectors[sector>>3] >> (~sector&7)) & 1;
 }
 
+/* Sector 0 in the most significant bit. Bits past the last sector are 0. */
+static uint64_t valid_sector_map(const struct track_info *ti)
+{
+    uint64_t map;
+    if (ti->nr_sectors == 0)
+        return 0;
+    memcpy(&map, ti->valid_sectors, sizeof(map));
+    return be64toh(map) & (~0ull << (64 - ti->nr_sectors));
+}
+
+unsigned int nr_valid_sectors(const struct track_info *ti)
+{
+    return __builtin_popcountll(valid_sector_map(ti));
+}
+
+unsigned int next_valid_sector(
+    const struct track_info *ti, unsigned int sector)
+{
+    uint64_t map;
+    if (sector >= ti->nr_sectors)
+        return ti->nr_sectors;
+    map = valid_sector_map(ti) << sector;
+    return map ? sector + __builtin_clzll(map) : ti->nr_sectors;
+}
+
+unsigned int next_invalid_sector(
+    const struct track_info *ti, unsigned int sector)
+{
+    uint64_t map;
+    if (sector >= ti->nr_sectors)
+        return ti->nr_sectors;
+    /* Bits past the last sector read as invalid, so the search ends. */
+    map = ~valid_sector_map(ti) << sector;
+    return min_t(unsigned int, sector + __builtin_clzll(map), ti->nr_sectors);
+}
+
+static __thread struct track_info *progress_ti;
+static __thread struct stream *progress_s;
+
+void track_watch_progress(struct track_info *ti, struct stream *s)
+{
+    progress_ti = ti;
+    progress_s = s;
+}
+
 void set_sector_valid(struct track_info *ti, unsigned int sector)
 {
     BUG_ON(sector >= ti->nr_sectors);
     ti->valid_sectors[sector>>3] |= 1u << (~sector&7);
+    if (ti == progress_ti)
+        stream_progress(progress_s);
 }
 
 void set_sector_invalid(struct track_info *ti, unsigned int sector)
@@ -430,10 +1740,10 @@ void set_sector_invalid(struct track_info *ti, unsigned int sector)
 
 void set_all_sectors_valid(struct track_info *ti)
 {
-    unsigned int sector;
-    set_all_sectors_invalid(ti);
-    for (sector = 0; sector < ti->nr_sectors; sector++)
-        set_sector_valid(ti, sector);
+    uint64_t map = 0;
+    if (ti->nr_sectors != 0)
+        map = htobe64(~0ull << (64 - ti->nr_sectors));
+    memcpy(ti->valid_sectors, &map, sizeof(map));
 }
 
 void set_all_sectors_invalid(struct track_info *ti)
@@ -448,13 +1758,157 @@ void init_track_info(struct track_info *ti, enum track_type type)
 {
     const struct track_handler *thnd = handlers[type];
     ti->type = type;
-    ti->typename = track_format_names[type].desc_name;
+    ti->typename = track_formats[type].desc_name;
     ti->bytes_per_sector = thnd->bytes_per_sector;
     ti->nr_sectors = thnd->nr_sectors;
     BUG_ON(ti->nr_sectors >= sizeof(ti->valid_sectors)*8);
     ti->len = ti->bytes_per_sector * ti->nr_sectors;
 }
 
+void track_free_data(struct disk *d, struct track_info *ti)
+{
+    pthread_mutex_lock(&d->share_lock);
+    while (track_data_pinned(d, ti - d->di->track))
+        pthread_cond_wait(&d->data_unpinned, &d->share_lock);
+    if (d->share != NULL)
+        d->share->hash[ti - d->di->track] = 0;
+    if (!track_data_mapped(d, ti))
+        share_put(d, ti->dat);
+    ti->dat = NULL;
+    pthread_mutex_unlock(&d->share_lock);
+    if (d->spill != NULL)
+        spill_drop(d, ti - d->di->track);
+    raw_cache_invalidate(d, ti - d->di->track);
+    ibm_sector_view_put(d, ti - d->di->track);
+}
+
+void track_load_data(struct disk *d, unsigned int tracknr)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+
+    if (ti->dat != NULL)
+        return;
+    if ((d->spill != NULL) && ((d->spill->off[tracknr] >= 0)
+                               || (d->spill->lz[tracknr] != NULL)))
+        spill_reload(d, tracknr);
+    else if (d->container->load != NULL) {
+        enum mem_tag tag = mem_set_tag(MEMTAG_container);
+        d->container->load(d, tracknr);
+        mem_set_tag(tag);
+    }
+}
+
+const uint8_t *track_get_data(struct disk *d, unsigned int tracknr)
+{
+    pthread_mutex_lock(&d->share_lock);
+    if (d->data_pins == NULL)
+        d->data_pins = memalloc(d->di->nr_tracks * sizeof(*d->data_pins));
+    d->data_pins[tracknr]++;
+    pthread_mutex_unlock(&d->share_lock);
+
+    track_load_data(d, tracknr);
+    return d->di->track[tracknr].dat;
+}
+
+void track_put_data(struct disk *d, unsigned int tracknr)
+{
+    pthread_mutex_lock(&d->share_lock);
+    if (--d->data_pins[tracknr] == 0)
+        pthread_cond_broadcast(&d->data_unpinned);
+    pthread_mutex_unlock(&d->share_lock);
+}
+
+int probe_sync(struct stream *s, uint32_t sync, unsigned int bits)
+{
+    return stream_next_sync(s, sync, bits, ~0u) == 0;
+}
+
+uint32_t probe_track_len(struct stream *s)
+{
+    uint32_t nr, len = 0;
+
+    stream_reset(s);
+    for (;;) {
+        nr = s->nr_index;
+        stream_next_index(s);
+        if (s->nr_index == nr)
+            break;
+        len = max(len, s->track_len_bc);
+    }
+
+    return len;
+}
+
+bool_t check_track_len(struct stream *s, uint32_t min_bits)
+{
+    bool_t exact;
+    uint32_t len = stream_estimate_track_len(s, &exact);
+    uint32_t margin = exact ? 0 : min_bits / 50;
+
+    if (len != 0) {
+        if (len + margin < min_bits)
+            return 0;
+        if (len >= min_bits + margin)
+            return 1;
+    }
+
+    stream_next_index(s);
+    return (s->track_len_bc >= min_bits);
+}
+
+void scan_sync_add(struct scan_sync *ss, uint32_t sync, unsigned int bits)
+{
+    BUG_ON(ss->nr >= SCAN_MAX_SYNCS);
+    ss->sync[ss->nr].mask = (bits >= 32) ? ~0u : (1u << bits) - 1;
+    ss->sync[ss->nr].sync = sync & ss->sync[ss->nr].mask;
+    ss->sync[ss->nr].bits = bits;
+    ss->nr++;
+}
+
+enum scan_verdict scan_sync_feed(
+    void *state, const uint8_t *bits, unsigned int nr)
+{
+    struct scan_sync *ss = state;
+    uint32_t word = ss->word;
+    unsigned int i, j;
+
+    for (i = 0; i < nr; i++) {
+        word = (word << 1) | ((bits[i>>3] >> (~i & 7)) & 1);
+        for (j = 0; j < ss->nr; j++)
+            if (((word & ss->sync[j].mask) == ss->sync[j].sync)
+                && (ss->fed + i + 1 >= ss->sync[j].bits))
+                return SCAN_match;
+    }
+
+    ss->word = word;
+    ss->fed += nr;
+    return SCAN_more;
+}
+
+static void scan_44894489_init(
+    struct disk *d, unsigned int tracknr, enum track_type type, void *state)
+{
+    scan_sync_add(state, 0x44894489, 32);
+}
+
+static void scan_4489_init(
+    struct disk *d, unsigned int tracknr, enum track_type type, void *state)
+{
+    scan_sync_add(state, 0x4489, 16);
+}
+
+const struct track_scanner scan_sync_44894489 = {
+    .state_size = sizeof(struct scan_sync),
+    .init = scan_44894489_init,
+    .feed = scan_sync_feed
+};
+
+const struct track_scanner scan_sync_4489 = {
+    .state_size = sizeof(struct scan_sync),
+    .init = scan_4489_init,
+    .feed = scan_sync_feed
+};
+
 static void change_bit(uint8_t *map, unsigned int bit, bool_t on)
 {
     if (on)
@@ -463,6 +1917,9 @@ static void change_bit(uint8_t *map, unsigned int bit, bool_t on)
         map[bit>>3] &= ~(0x80 >> (bit & 7));
 }
 
+static inline uint32_t mfm_gather(uint64_t x);
+static inline uint64_t mfm_spread(uint32_t w);
+
 static void append_bit(struct tbuf *tbuf, uint16_t speed, uint8_t x)
 {
     change_bit(tbuf->raw.bits, tbuf->pos, x);
@@ -471,6 +1928,36 @@ static void append_bit(struct tbuf *tbuf, uint16_t speed, uint8_t x)
         tbuf->pos = 0;
 }
 
+/* Append the @n (<= 64) least significant bits of @x, most significant
+ * first, a byte's worth at a time. */
+static void append_bits(
+    struct tbuf *tbuf, uint16_t speed, uint64_t x, unsigned int n)
+{
+    uint8_t *map = tbuf->raw.bits;
+    uint16_t *sp;
+    unsigned int k, j, shift, seg;
+    uint8_t mask;
+
+    while (n != 0) {
+        /* Bitcells up to the end of the buffer: speeds in one run. */
+        seg = min_t(unsigned int, n, tbuf->raw.bitlen - tbuf->pos);
+        sp = &tbuf->raw.speed[tbuf->pos];
+        for (j = 0; j < seg; j++)
+            sp[j] = speed;
+        for (; seg != 0; seg -= k) {
+            k = min_t(unsigned int, 8 - (tbuf->pos & 7), seg);
+            n -= k;
+            shift = 8 - (tbuf->pos & 7) - k;
+            mask = ((1u << k) - 1) << shift;
+            map[tbuf->pos>>3] = (map[tbuf->pos>>3] & ~mask)
+                | (((x >> n) << shift) & mask);
+            tbuf->pos += k;
+        }
+        if (tbuf->pos >= tbuf->raw.bitlen)
+            tbuf->pos = 0;
+    }
+}
+
 static void tbuf_bit(
     struct tbuf *tbuf, uint16_t speed,
     enum bitcell_encoding enc, uint8_t dat)
@@ -486,8 +1973,63 @@ static void tbuf_bit(
     tbuf->prev_data_bit = dat;
 }
 
+/* Encode and append @bits (1-32) bits of @x, as the default encoder would. */
+static void tbuf_append(struct tbuf *tbuf, uint16_t speed,
+                        enum bitcell_encoding enc, unsigned int bits, uint32_t x)
+{
+    uint64_t y;
+
+    if (bits < 32)
+        x &= (1u << bits) - 1;
+
+    if (enc == bc_mfm) {
+        /* Clock bit precedes each data bit, and is set only between two
+         * zero data bits. */
+        y = mfm_spread(x);
+        y |= ~((y >> 1) | (y << 1) |
+               ((uint64_t)tbuf->prev_data_bit << (2*bits-1)))
+            & 0xaaaaaaaaaaaaaaaaull;
+        if (bits < 32)
+            y &= (1ull << (2*bits)) - 1;
+        append_bits(tbuf, speed, y, 2*bits);
+    } else {
+        append_bits(tbuf, speed, x, bits);
+    }
+
+    tbuf->prev_data_bit = x & 1;
+}
+
+/* Emit the @bits (<= 32) least significant bits of @x, most significant
+ * first, via the tbuf's bit encoder. The default encoder is bypassed in favour
+ * of encoding and appending all the bitcells at once. */
+static void tbuf_emit(struct tbuf *tbuf, uint16_t speed,
+                      enum bitcell_encoding enc, unsigned int bits, uint32_t x)
+{
+    int i;
+
+    if (tbuf->bit != tbuf_bit) {
+        for (i = bits-1; i >= 0; i--)
+            tbuf->bit(tbuf, speed, enc, (x >> i) & 1);
+        return;
+    }
+
+    if (bits == 0)
+        return;
+
+    if (tbuf->weak_pending) {
+        tbuf->raw.weak_runs[tbuf->raw.nr_weak_runs-1].clk_after =
+            (enc == bc_mfm);
+        tbuf->weak_pending = 0;
+    }
+
+    tbuf_append(tbuf, speed, enc, bits, x);
+}
+
+
 void tbuf_init(struct tbuf *tbuf, uint32_t bitstart, uint32_t bitlen)
 {
+    uint32_t bytes = (bitlen + 7) / 8;
+
     tbuf->start = tbuf->pos = bitstart;
     tbuf->prev_data_bit = 0;
     tbuf->crc16_ccitt = 0;
@@ -495,11 +2037,36 @@ void tbuf_init(struct tbuf *tbuf, uint32_t bitstart, uint32_t bitlen)
     tbuf->bit = tbuf_bit;
     tbuf->gap = NULL;
     tbuf->weak = NULL;
+    tbuf->weak_max = 0;
+    tbuf->weak_pending = 0;
 
     memset(&tbuf->raw, 0, sizeof(tbuf->raw));
     tbuf->raw.bitlen = bitlen;
-    tbuf->raw.bits = memalloc(bitlen+7/8);
-    tbuf->raw.speed = memalloc(2*bitlen);
+
+    /* Neither buffer is zeroed: the handler and tbuf_finalise() between them
+     * write every bitcell. Only the padding of the final byte is cleared. */
+    if ((tbuf->spare_bits != NULL) && (tbuf->spare_bits_max >= bytes)) {
+        tbuf->raw.bits = tbuf->spare_bits;
+        tbuf->bits_max = tbuf->spare_bits_max;
+        tbuf->spare_bits = NULL;
+        tbuf->spare_bits_max = 0;
+    } else {
+        tbuf->raw.bits = memalloc_nz(bytes);
+        tbuf->bits_max = bytes;
+    }
+    if (bytes != 0)
+        tbuf->raw.bits[bytes-1] = 0;
+
+    if ((tbuf->spare_speed != NULL) && (tbuf->spare_speed_max >= bitlen)) {
+        tbuf->raw.speed = tbuf->spare_speed;
+        tbuf->speed_max = tbuf->spare_speed_max;
+    } else {
+        memfree(tbuf->spare_speed);
+        tbuf->raw.speed = memalloc_nz(2*bitlen);
+        tbuf->speed_max = bitlen;
+    }
+    tbuf->spare_speed = NULL;
+    tbuf->spare_speed_max = 0;
 }
 
 static uint32_t fix_bc(struct tbuf *tbuf, int32_t bc)
@@ -509,10 +2076,93 @@ static uint32_t fix_bc(struct tbuf *tbuf, int32_t bc)
     return bc;
 }
 
+/* Index of the first speed from @i which differs from its predecessor, or
+ * @len if none. Speeds come in long runs: skip them four at a time. */
+static uint32_t next_speed_change(const uint16_t *speed, uint32_t i,
+                                  uint32_t len)
+{
+    uint64_t x, rep;
+
+    for (; i + 4 <= len; i += 4) {
+        rep = speed[i-1] * 0x0001000100010001ull;
+        memcpy(&x, &speed[i], 8);
+        if (x != rep)
+            break;
+    }
+    for (; i < len; i++)
+        if (speed[i] != speed[i-1])
+            break;
+    return i;
+}
+
+/* Replace the per-bitcell speed array built up by the tbuf with runs. */
+static void tbuf_speed_to_runs(struct tbuf *tbuf)
+{
+    struct track_raw *raw = &tbuf->raw;
+    uint32_t i, n;
+
+    if (raw->speed == NULL)
+        return;
+
+    for (i = n = 0; i < raw->bitlen; i = next_speed_change(
+             raw->speed, i + 1, raw->bitlen))
+        n++;
+
+    raw->speed_runs = memalloc(n * sizeof(*raw->speed_runs));
+    raw->nr_speed_runs = n;
+    for (i = n = 0; i < raw->bitlen; i = next_speed_change(
+             raw->speed, i + 1, raw->bitlen)) {
+        raw->speed_runs[n].start = i;
+        raw->speed_runs[n].speed = raw->speed[i];
+        n++;
+    }
+
+    /* Keep the speed array for the next track, as tbuf_init() would have. */
+    if (tbuf->spare_speed == NULL) {
+        tbuf->spare_speed = raw->speed;
+        tbuf->spare_speed_max = tbuf->speed_max;
+    } else {
+        memfree(raw->speed);
+    }
+    raw->speed = NULL;
+}
+
+/* Fill @nr bitcells from @pos, wrapping at the end of the track, with
+ * alternating ones and zeroes starting with @first: whole bytes at a time. */
+static void fill_alternating(
+    struct tbuf *tbuf, uint32_t pos, uint32_t nr, uint8_t first)
+{
+    uint8_t *map = tbuf->raw.bits, pat, mask;
+    uint32_t i, seg, end;
+
+    while (nr != 0) {
+        seg = min_t(uint32_t, nr, tbuf->raw.bitlen - pos);
+        for (i = 0; i < seg; i++)
+            tbuf->raw.speed[pos + i] = SPEED_AVG;
+        /* Ones fall on even bitcells (0xaa) or on odd (0x55). */
+        pat = ((pos + !first) & 1) ? 0x55 : 0xaa;
+        end = pos + seg;
+        if ((pos >> 3) == ((end - 1) >> 3)) {
+            mask = (0xff >> (pos & 7)) & (0xff << (7 - ((end - 1) & 7)));
+            map[pos>>3] = (map[pos>>3] & ~mask) | (pat & mask);
+        } else {
+            mask = 0xff >> (pos & 7);
+            map[pos>>3] = (map[pos>>3] & ~mask) | (pat & mask);
+            memset(&map[(pos>>3) + 1], pat, (end >> 3) - (pos >> 3) - 1);
+            if (end & 7) {
+                mask = 0xff << (8 - (end & 7));
+                map[end>>3] = (map[end>>3] & ~mask) | (pat & mask);
+            }
+        }
+        first ^= seg & 1;
+        nr -= seg;
+        pos = 0;
+    }
+}
+
 static void tbuf_finalise(struct tbuf *tbuf)
 {
-    int32_t pos, nr_bits;
-    uint8_t b = 0;
+    int32_t nr_bits;
 
     tbuf->raw.data_start_bc = tbuf->start;
     tbuf->raw.data_end_bc = fix_bc(tbuf, tbuf->pos - 1);
@@ -526,8 +2176,25 @@ static void tbuf_finalise(struct tbuf *tbuf)
     /* Forward fill half the gap */
     nr_bits = fix_bc(tbuf, tbuf->start - tbuf->pos);
     nr_bits /= 4; /* /2 to halve the gap, /2 to count data bits only */
-    while (nr_bits--)
-        tbuf_bits(tbuf, SPEED_AVG, bc_mfm, 1, 0);
+    if (tbuf->bit != tbuf_bit) {
+        while (nr_bits > 0) {
+            tbuf_bits(tbuf, SPEED_AVG, bc_mfm, min(nr_bits, 32), 0);
+            nr_bits -= 32;
+        }
+    } else if (nr_bits > 0) {
+        /* MFM-encoded zeroes: 1010..., bar a clock after a one. */
+        fill_alternating(tbuf, tbuf->pos, 2*nr_bits, 1);
+        if (tbuf->prev_data_bit)
+            change_bit(tbuf->raw.bits, tbuf->pos, 0);
+        tbuf->pos += 2*nr_bits;
+        if (tbuf->pos >= tbuf->raw.bitlen)
+            tbuf->pos -= tbuf->raw.bitlen;
+        tbuf->prev_data_bit = 0;
+        if (tbuf->weak_pending) {
+            tbuf->raw.weak_runs[tbuf->raw.nr_weak_runs-1].clk_after = 1;
+            tbuf->weak_pending = 0;
+        }
+    }
 
     /* Write splice. Write an MFM-illegal string of zeroes. */
     nr_bits = fix_bc(tbuf, tbuf->start - tbuf->pos);
@@ -535,21 +2202,15 @@ static void tbuf_finalise(struct tbuf *tbuf)
     tbuf_bits(tbuf, SPEED_AVG, bc_raw, nr_bits, 0);
     tbuf->raw.write_splice_bc = fix_bc(tbuf, tbuf->pos - 1 - nr_bits/2);
 
-    /* Reverse fill the remainder */
-    for (pos = tbuf->start; pos != tbuf->pos; ) {
-        if (--pos < 0)
-            pos += tbuf->raw.bitlen;
-        change_bit(tbuf->raw.bits, pos, b);
-        tbuf->raw.speed[pos] = SPEED_AVG;
-        b = !b;
-    }
+    /* Fill the remainder, ending 0 at the start of data. */
+    nr_bits = fix_bc(tbuf, tbuf->start - tbuf->pos);
+    if (nr_bits > 0)
+        fill_alternating(tbuf, tbuf->pos, nr_bits, (nr_bits - 1) & 1);
 }
 
 void tbuf_bits(struct tbuf *tbuf, uint16_t speed,
                enum bitcell_encoding enc, unsigned int bits, uint32_t x)
 {
-    int i;
-
     if (enc == bc_mfm_even_odd) {
         tbuf_bits(tbuf, speed, bc_mfm_even, bits, x);
         enc = bc_mfm_odd;
@@ -559,22 +2220,58 @@ void tbuf_bits(struct tbuf *tbuf, uint16_t speed,
     }
 
     if ((enc == bc_mfm_even) || (enc == bc_mfm_odd)) {
-        uint32_t y = 0;
         if (enc == bc_mfm_even)
             x >>= 1;
         bits >>= 1;
-        for (i = 0; i < bits; i++)
-            y |= (x >> i) & (1u << i);
-        x = y;
+        x = mfm_gather(x) & ((1u << bits) - 1);
         enc = bc_mfm;
     }
 
-    for (i = bits-1; i >= 0; i--) {
-        uint8_t b = (x >> i) & 1;
-        if ((enc != bc_raw) || !(i & 1))
-            tbuf->crc16_ccitt = crc16_ccitt_bit(b, tbuf->crc16_ccitt);
-        tbuf->bit(tbuf, speed, enc, b);
+    if (enc != bc_raw) {
+        tbuf->crc16_ccitt = crc16_ccitt_bits(x, bits, tbuf->crc16_ccitt);
+    } else if (bits != 0) {
+        /* Raw bitcells: only the data bits (even-numbered) count. */
+        tbuf->crc16_ccitt = crc16_ccitt_bits(
+            mfm_gather((bits < 32) ? x & ((1u << bits) - 1) : x),
+            (bits + 1) / 2, tbuf->crc16_ccitt);
+    }
+
+    tbuf_emit(tbuf, speed, enc, bits, x);
+}
+
+/* tbuf_bytes() for the default bit encoder: MFM-encode the whole block with
+ * one mfm_encode_bytes(), then append its bitcells 64 at a time. */
+#define TBUF_BULK_MAX 2048
+static void tbuf_bytes_bulk(struct tbuf *tbuf, uint16_t speed,
+                            enum bitcell_encoding enc, unsigned int bytes,
+                            void *data)
+{
+    uint8_t raw[2*TBUF_BULK_MAX];
+    unsigned int i, n = 2*bytes;
+    uint64_t x;
+
+    mfm_encode_bytes(enc, bytes, data, raw, tbuf->prev_data_bit);
+
+    if (tbuf->weak_pending) {
+        tbuf->raw.weak_runs[tbuf->raw.nr_weak_runs-1].clk_after = 1;
+        tbuf->weak_pending = 0;
+    }
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        memcpy(&x, &raw[i], 8);
+        x = be64toh(x);
+        tbuf->crc16_ccitt = crc16_ccitt_bits(
+            mfm_gather(x), 32, tbuf->crc16_ccitt);
+        append_bits(tbuf, speed, x, 64);
     }
+    for (; i < n; i += 2) {
+        x = (raw[i] << 8) | raw[i+1];
+        tbuf->crc16_ccitt = crc16_ccitt_bits(
+            mfm_gather(x), 8, tbuf->crc16_ccitt);
+        append_bits(tbuf, speed, x, 16);
+    }
+
+    tbuf->prev_data_bit = raw[n-1] & 1;
 }
 
 void tbuf_bytes(struct tbuf *tbuf, uint16_t speed,
@@ -583,6 +2280,23 @@ void tbuf_bytes(struct tbuf *tbuf, uint16_t speed,
     unsigned int i;
     uint8_t *p;
 
+    if ((tbuf->bit == tbuf_bit) && (bytes != 0)
+        && ((enc == bc_mfm) || (enc == bc_mfm_even_odd)
+            || (enc == bc_mfm_odd_even))) {
+        /* Plain MFM is encoded in chunks; even/odd needs the whole block. */
+        p = (uint8_t *)data;
+        if (enc == bc_mfm) {
+            for (; bytes > TBUF_BULK_MAX; bytes -= TBUF_BULK_MAX) {
+                tbuf_bytes_bulk(tbuf, speed, enc, TBUF_BULK_MAX, p);
+                p += TBUF_BULK_MAX;
+            }
+        }
+        if (bytes <= TBUF_BULK_MAX) {
+            tbuf_bytes_bulk(tbuf, speed, enc, bytes, p);
+            return;
+        }
+    }
+
     if (enc == bc_mfm_even_odd) {
         tbuf_bytes(tbuf, speed, bc_mfm_even, bytes, data);
         enc = bc_mfm_odd;
@@ -591,30 +2305,127 @@ void tbuf_bytes(struct tbuf *tbuf, uint16_t speed,
         enc = bc_mfm_even;
     }
 
+    /* Up to four bytes at a time. */
     p = (uint8_t *)data;
-    for (i = 0; i < bytes; i++)
+    for (i = 0; i + 4 <= bytes; i += 4) {
+        uint32_t x = ((uint32_t)p[i] << 24) | (p[i+1] << 16)
+            | (p[i+2] << 8) | p[i+3];
+        if ((enc == bc_mfm) || (enc == bc_raw))
+            tbuf_bits(tbuf, speed, enc, 32, x);
+        else
+            tbuf_bits(tbuf, speed, bc_mfm, 16,
+                      mfm_gather((enc == bc_mfm_even) ? x >> 1 : x));
+    }
+    for (; i < bytes; i++)
         tbuf_bits(tbuf, speed, enc, 8, p[i]);
 }
 
+int tbuf_raw(struct tbuf *tbuf, uint16_t speed, unsigned int bytes,
+             const void *data)
+{
+    const uint8_t *p = data;
+    unsigned int i;
+    uint64_t x;
+
+    if ((tbuf->bit != tbuf_bit) || (bytes & 1))
+        return -1;
+
+    if (bytes == 0)
+        return 0;
+
+    if (tbuf->weak_pending) {
+        tbuf->raw.weak_runs[tbuf->raw.nr_weak_runs-1].clk_after = 0;
+        tbuf->weak_pending = 0;
+    }
+
+    for (i = 0; i + 8 <= bytes; i += 8) {
+        memcpy(&x, &p[i], 8);
+        x = be64toh(x);
+        tbuf->crc16_ccitt = crc16_ccitt_bits(
+            mfm_gather(x), 32, tbuf->crc16_ccitt);
+        append_bits(tbuf, speed, x, 64);
+    }
+    for (; i < bytes; i += 2) {
+        x = (p[i] << 8) | p[i+1];
+        tbuf->crc16_ccitt = crc16_ccitt_bits(
+            mfm_gather(x), 8, tbuf->crc16_ccitt);
+        append_bits(tbuf, speed, x, 16);
+    }
+
+    tbuf->prev_data_bit = p[bytes-1] & 1;
+    return 0;
+}
+
 void tbuf_gap(struct tbuf *tbuf, uint16_t speed, unsigned int bits)
 {
     if (tbuf->gap != NULL) {
         tbuf->gap(tbuf, speed, bits);
     } else {
-        while (bits--)
-            tbuf->bit(tbuf, speed, bc_mfm, 0);
+        for (; bits > 32; bits -= 32)
+            tbuf_emit(tbuf, speed, bc_mfm, 32, 0);
+        tbuf_emit(tbuf, speed, bc_mfm, bits, 0);
+    }
+}
+
+/* Record a weak region for track_raw_regen_weak(). */
+static void tbuf_weak_run(struct tbuf *tbuf, unsigned int bits)
+{
+    struct track_raw *raw = &tbuf->raw;
+    struct track_weak_run *w = raw->nr_weak_runs
+        ? &raw->weak_runs[raw->nr_weak_runs-1] : NULL;
+
+    tbuf->nr_weak_rnd += bits;
+
+    /* Extend the previous region if this one directly follows it. */
+    if (tbuf->weak_pending
+        && ((w->start + 2*w->bits) % raw->bitlen == tbuf->pos)) {
+        w->bits += bits;
+        return;
+    }
+
+    if (raw->nr_weak_runs == tbuf->weak_max) {
+        tbuf->weak_max = tbuf->weak_max ? tbuf->weak_max * 2 : 8;
+        w = memalloc(tbuf->weak_max * sizeof(*w));
+        if (raw->nr_weak_runs)
+            memcpy(w, raw->weak_runs, raw->nr_weak_runs * sizeof(*w));
+        memfree(raw->weak_runs);
+        raw->weak_runs = w;
     }
+
+    w = &raw->weak_runs[raw->nr_weak_runs++];
+    w->start = tbuf->pos;
+    w->bits = bits;
+    w->clk_after = 0;
+    tbuf->weak_pending = 1;
 }
 
 void tbuf_weak(struct tbuf *tbuf, unsigned int bits)
 {
+    uint16_t rnd[32];
+    unsigned int i, n;
+    uint32_t x;
+
     tbuf->raw.has_weak_bits = 1;
-    if (tbuf->weak != NULL) {
-        tbuf->weak(tbuf, bits);
-    } else {
-        while (bits--)
-            tbuf->bit(tbuf, SPEED_WEAK, bc_mfm, tbuf_rnd16(tbuf) & 1);
+    if ((tbuf->weak != NULL) || (tbuf->bit != tbuf_bit)) {
+        tbuf->weak_exact = 0;
+        if (tbuf->weak != NULL) {
+            tbuf->weak(tbuf, bits);
+            return;
+        }
+    } else if (bits != 0) {
+        tbuf_weak_run(tbuf, bits);
+        /* Not via tbuf_emit(): the region's clock-after is left pending. */
+        for (; bits != 0; bits -= n) {
+            n = min_t(unsigned int, bits, 32);
+            tbuf_rnd16_bulk(tbuf, rnd, n);
+            for (i = x = 0; i < n; i++)
+                x = (x << 1) | (rnd[i] & 1);
+            tbuf_append(tbuf, SPEED_WEAK, bc_mfm, n, x);
+        }
+        return;
     }
+    while (bits--)
+        tbuf->bit(tbuf, SPEED_WEAK, bc_mfm, tbuf_rnd16(tbuf) & 1);
 }
 
 void tbuf_start_crc(struct tbuf *tbuf)
@@ -634,33 +2445,51 @@ void tbuf_disable_auto_sector_split(struct tbuf *tbuf)
 
 uint16_t tbuf_rnd16(struct tbuf *tbuf)
 {
+    tbuf->nr_rnd++;
     return rnd16(&tbuf->prng_seed);
 }
 
+void tbuf_rnd16_bulk(struct tbuf *tbuf, uint16_t *out, unsigned int nr)
+{
+    tbuf->nr_rnd += nr;
+    rnd16_bulk(&tbuf->prng_seed, out, nr);
+}
+
+/* MFM data bits occupy the even-numbered bit positions (0x5555...) of the
+ * encoded stream. Gather them into the low half of a word, or spread them back
+ * out, by moving successively larger groups of bits at once. */
+static inline uint32_t mfm_gather(uint64_t x)
+{
+    x &= 0x5555555555555555ull;
+    x = (x | (x >>  1)) & 0x3333333333333333ull;
+    x = (x | (x >>  2)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x >>  4)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x >>  8)) & 0x0000ffff0000ffffull;
+    x = (x | (x >> 16)) & 0x00000000ffffffffull;
+    return x;
+}
+
+static inline uint64_t mfm_spread(uint32_t w)
+{
+    uint64_t x = w;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+    x = (x | (x <<  8)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x <<  4)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x <<  2)) & 0x3333333333333333ull;
+    x = (x | (x <<  1)) & 0x5555555555555555ull;
+    return x;
+}
+
 uint16_t mfm_decode_word(uint32_t w)
 {
-    return (((w & 0x40000000u) >> 15) | ((w & 0x10000000u) >> 14) |
-            ((w & 0x04000000u) >> 13) | ((w & 0x01000000u) >> 12) |
-            ((w & 0x00400000u) >> 11) | ((w & 0x00100000u) >> 10) |
-            ((w & 0x00040000u) >>  9) | ((w & 0x00010000u) >>  8) |
-            ((w & 0x00004000u) >>  7) | ((w & 0x00001000u) >>  6) |
-            ((w & 0x00000400u) >>  5) | ((w & 0x00000100u) >>  4) |
-            ((w & 0x00000040u) >>  3) | ((w & 0x00000010u) >>  2) |
-            ((w & 0x00000004u) >>  1) | ((w & 0x00000001u) >>  0));
+    return mfm_gather(w);
 }
 
 uint32_t mfm_encode_word(uint32_t w)
 {
     uint32_t x;
     /* Place data bits in their encoded locations. */
-    x = (((w & 0x8000u) << 15) | ((w & 0x4000u) << 14) |
-         ((w & 0x2000u) << 13) | ((w & 0x1000u) << 12) |
-         ((w & 0x0800u) << 11) | ((w & 0x0400u) << 10) |
-         ((w & 0x0200u) <<  9) | ((w & 0x0100u) <<  8) |
-         ((w & 0x0080u) <<  7) | ((w & 0x0040u) <<  6) |
-         ((w & 0x0020u) <<  5) | ((w & 0x0010u) <<  4) |
-         ((w & 0x0008u) <<  3) | ((w & 0x0004u) <<  2) |
-         ((w & 0x0002u) <<  1) | ((w & 0x0001u) <<  0));
+    x = mfm_spread(w & 0xffffu);
     /* Calculate the clock bits. */
     x |= ~((x>>1)|(x<<1)) & 0xaaaaaaaau;
     /* First clock bit is always 0 if preceding data bit was 1. */
@@ -673,73 +2502,197 @@ void mfm_decode_bytes(
     enum bitcell_encoding enc, unsigned int bytes, void *in, void *out)
 {
     uint8_t *in_b = in, *out_b = out;
-    unsigned int i;
-
-    for (i = 0; i < bytes; i++) {
-        if (enc == bc_mfm) {
-            uint8_t x = in_b[2*i+0], y = in_b[2*i+1];
-            out_b[i] = (((x & 0x40) << 1) | ((x & 0x10) << 2) |
-                        ((x & 0x04) << 3) | ((x & 0x01) << 4) |
-                        ((y & 0x40) >> 3) | ((y & 0x10) >> 2) |
-                        ((y & 0x04) >> 1) | ((y & 0x01) >> 0));
-        } else if (enc == bc_mfm_even_odd) {
+    unsigned int i = 0;
+    uint64_t x, e;
+    uint32_t y;
+
+    switch (enc) {
+    case bc_mfm:
+        /* Eight MFM bytes at a time, then any odd bytes at the end. */
+        for (; i + 4 <= bytes; i += 4) {
+            memcpy(&x, &in_b[2*i], 8);
+            y = htobe32(mfm_gather(be64toh(x)));
+            memcpy(&out_b[i], &y, 4);
+        }
+        for (; i < bytes; i++)
+            out_b[i] = mfm_gather((in_b[2*i+0] << 8) | in_b[2*i+1]);
+        break;
+    case bc_mfm_even_odd:
+        /* Eight bytes of each half at a time. Output never overtakes the
+         * input still to be read, so @out may be @in. */
+        for (; i + 8 <= bytes; i += 8) {
+            memcpy(&x, &in_b[i], 8);
+            memcpy(&e, &in_b[i + bytes], 8);
+            x = ((x & 0x5555555555555555ull) << 1)
+                | (e & 0x5555555555555555ull);
+            memcpy(&out_b[i], &x, 8);
+        }
+        for (; i < bytes; i++)
             out_b[i] = ((in_b[i] & 0x55) << 1) | (in_b[i + bytes] & 0x55);
-        } else if (enc == bc_mfm_odd_even) {
+        break;
+    case bc_mfm_odd_even:
+        for (; i + 8 <= bytes; i += 8) {
+            memcpy(&x, &in_b[i], 8);
+            memcpy(&e, &in_b[i + bytes], 8);
+            x = (x & 0x5555555555555555ull)
+                | ((e & 0x5555555555555555ull) << 1);
+            memcpy(&out_b[i], &x, 8);
+        }
+        for (; i < bytes; i++)
             out_b[i] = (in_b[i] & 0x55) | ((in_b[i + bytes] & 0x55) << 1);
-        } else {
-            BUG();
+        break;
+    default:
+        BUG();
+    }
+}
+
+uint32_t mfm_decode_csum(
+    enum bitcell_encoding enc, enum mfm_csum csum, unsigned int bytes,
+    unsigned int chunk, void *in, void *out)
+{
+    uint8_t *in_b = in, *out_b = out;
+    unsigned int i, j;
+    uint32_t x, sum = 0;
+
+    if (chunk == 4) {
+        /* Alternating longs: decode each without a call. */
+        uint32_t e, o, m = 0x55555555u;
+        for (i = 0; i < bytes; i += 4) {
+            memcpy(&e, &in_b[2*i], 4);
+            memcpy(&o, &in_b[2*i + 4], 4);
+            x = (enc == bc_mfm_even_odd)
+                ? ((e & m) << 1) | (o & m) : (e & m) | ((o & m) << 1);
+            memcpy(&out_b[i], &x, 4);
+            sum = (csum == MFM_CSUM_add) ? sum + be32toh(x) : sum ^ x;
         }
+        goto out;
     }
+
+    for (i = 0; i < bytes; i += chunk) {
+        mfm_decode_bytes(enc, chunk, &in_b[2*i], &out_b[i]);
+        if (csum == MFM_CSUM_none)
+            continue;
+        for (j = i; j + 4 <= i + chunk; j += 4) {
+            memcpy(&x, &out_b[j], 4);
+            sum = (csum == MFM_CSUM_add) ? sum + be32toh(x) : sum ^ x;
+        }
+    }
+
+out:
+    switch (csum) {
+    case MFM_CSUM_none:
+        sum = 0;
+        break;
+    case MFM_CSUM_xor:
+        sum = be32toh(sum);
+        break;
+    case MFM_CSUM_amigados:
+        sum = be32toh(sum);
+        sum = (sum ^ (sum >> 1)) & 0x55555555u;
+        break;
+    default:
+        break;
+    }
+
+    return sum;
 }
 
 void mfm_encode_bytes(
     enum bitcell_encoding enc, unsigned int bytes, void *in, void *out,
     uint8_t prev_bit)
 {
-    uint16_t x;
     uint8_t *in_b = in, *out_b = out;
-    unsigned int i;
+    unsigned int i = 0;
+    uint64_t x, prev;
+    uint32_t y;
+    uint16_t z;
 
     /* Extract the data bits into correct output locations. */
-    for (i = 0; i < bytes; i++) {
-        x = in_b[i];
-        if (enc == bc_mfm) {
-            out_b[2*i+0] = (((x & 0x80) >> 1) | ((x & 0x40) >> 2) |
-                            ((x & 0x20) >> 3) | ((x & 0x10) >> 4));
-            out_b[2*i+1] = (((x & 0x08) << 3) | ((x & 0x04) << 2) |
-                            ((x & 0x02) << 1) | ((x & 0x01) << 0));
-        } else if (enc == bc_mfm_even_odd) {
-            out_b[i] = x >> 1;
-            out_b[i + bytes] = x;
-        } else if (enc == bc_mfm_odd_even) {
-            out_b[i] = x;
-            out_b[i + bytes] = x >> 1;
-        } else {
-            BUG();
+    switch (enc) {
+    case bc_mfm:
+        for (; i + 4 <= bytes; i += 4) {
+            memcpy(&y, &in_b[i], 4);
+            x = htobe64(mfm_spread(be32toh(y)));
+            memcpy(&out_b[2*i], &x, 8);
+        }
+        for (; i < bytes; i++) {
+            z = mfm_spread(in_b[i]);
+            out_b[2*i+0] = z >> 8;
+            out_b[2*i+1] = z;
+        }
+        break;
+    case bc_mfm_even_odd:
+        for (; i < bytes; i++) {
+            out_b[i] = in_b[i] >> 1;
+            out_b[i + bytes] = in_b[i];
+        }
+        break;
+    case bc_mfm_odd_even:
+        for (; i < bytes; i++) {
+            out_b[i] = in_b[i];
+            out_b[i + bytes] = in_b[i] >> 1;
         }
+        break;
+    default:
+        BUG();
     }
 
-    /* Calculate and insert the clock bits. */
-    x = prev_bit;
-    for (i = 0; i < 2*bytes; i++) {
-        x = (x << 8) | out_b[i];
-        x &= 0x5555u;
-        x |= ~((x>>1)|(x<<1)) & 0xaaaa;
-        out_b[i] = x;
+    /* Calculate and insert the clock bits, 64 bitcells at a time. Each clock
+     * bit depends on the data bits either side, so carry the last data bit
+     * of each word into the next. */
+    prev = prev_bit & 1;
+    for (i = 0; i + 8 <= 2*bytes; i += 8) {
+        memcpy(&x, &out_b[i], 8);
+        x = be64toh(x) & 0x5555555555555555ull;
+        x |= ~((x>>1)|(x<<1)|(prev<<63)) & 0xaaaaaaaaaaaaaaaaull;
+        prev = x & 1;
+        x = htobe64(x);
+        memcpy(&out_b[i], &x, 8);
+    }
+    z = prev;
+    for (; i < 2*bytes; i++) {
+        z = (z << 8) | out_b[i];
+        z &= 0x5555u;
+        z |= ~((z>>1)|(z<<1)) & 0xaaaa;
+        out_b[i] = z;
+    }
+}
+
+/* XOR of the big-endian longs in @dat, eight bytes at a time. */
+static uint32_t xor_longs(const void *dat, unsigned int bytes)
+{
+    const uint8_t *p = dat;
+    uint64_t x = 0, y;
+    uint32_t z, w;
+
+    for (; bytes >= 8; bytes -= 8, p += 8) {
+        memcpy(&y, p, 8);
+        x ^= y;
     }
+    z = (uint32_t)x ^ (uint32_t)(x >> 32);
+    if (bytes >= 4) {
+        memcpy(&w, p, 4);
+        z ^= w;
+    }
+
+    return be32toh(z);
 }
 
 uint32_t amigados_checksum(void *dat, unsigned int bytes)
 {
-    uint32_t *p = dat, csum = 0;
-    unsigned int i;
-    for (i = 0; i < bytes/4; i++)
-        csum ^= be32toh(p[i]);
+    uint32_t csum = xor_longs(dat, bytes);
     csum ^= csum >> 1;
     csum &= 0x55555555u;
     return csum;
 }
 
+uint32_t amigados_checksum_mfm(void *raw, unsigned int bytes)
+{
+    /* Decoded long i is (even[i] & 0x55555555) << 1 | (odd[i] & 0x55555555),
+     * so the folded XOR of decoded longs is the XOR of the raw data bits. */
+    return xor_longs(raw, 2*bytes) & 0x55555555u;
+}
+
 /*
  * Local variables:
  * mode: C
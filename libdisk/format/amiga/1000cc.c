@@ -25,15 +25,12 @@ static void *turbo1000cc_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t craw[2], raw[2*512], dat[0x581], csum, sum, chk;
         unsigned int i, sec;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bits(s, 32) == -1)
@@ -87,7 +87,7 @@ static void *albedo_protection_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
@@ -123,14 +123,11 @@ static void *albedo_data_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     uint8_t *block;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x5122, 16, ~0u) != -1) {
 
         uint8_t raw[0x18c8*2];
         uint32_t csum, i;
 
-        if ((uint16_t)s->word != 0x5122)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 32) == -1)
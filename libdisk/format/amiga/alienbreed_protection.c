@@ -30,9 +30,7 @@ static void *alienbreed_protection_write_raw(
     uint32_t x[2];
     unsigned int i;
 
-    while (stream_next_bit(s) != -1) {
-        if (s->word != 0x89248924)
-            continue;
+    while (stream_next_sync(s, 0x89248924, 32, ~0u) != -1) {
 
         ti->data_bitoff = s->index_offset_bc - 31;
 
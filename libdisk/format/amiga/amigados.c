@@ -71,72 +71,202 @@ struct ados_ext {
     uint8_t dat[0];
 };
 
+static void ados_scan_init(
+    struct disk *d, unsigned int tracknr, enum track_type type, void *state)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(syncs); i++)
+        scan_sync_add(state, syncs[i], 32);
+}
+
+static const struct track_scanner ados_scanner = {
+    .state_size = sizeof(struct scan_sync),
+    .init = ados_scan_init,
+    .feed = scan_sync_feed
+};
+
+/* Per-revolution decodes of a sector whose data checksum failed. */
+#define MAX_CANDS 8
+struct ados_cand {
+    uint32_t sync, idx_off;
+    uint64_t lat;
+    struct ados_hdr hdr;
+    uint8_t dat[STD_SEC];
+};
+
+/* Fused recovery flips at most this many of the least certain bits. */
+#define MAX_WEAK  64
+#define MAX_FLIPS 3
+
+/* Checksum bit toggled by flipping bit @i of a sector's data. */
+static uint32_t csum_bit(unsigned int i)
+{
+    unsigned int p = 31 - (i & 31);
+    return 1u << (p & ~1u);
+}
+
+static void flip_bit(uint8_t *dat, unsigned int i)
+{
+    dat[i >> 3] ^= 0x80u >> (i & 7);
+}
+
+/* Recover a sector which is bad in every revolution: majority-vote each bit
+ * across the candidate decodes, then flip up to MAX_FLIPS of the bits on
+ * which the revolutions disagree until the data checksum matches. */
+static bool_t ados_fuse_sector(
+    const struct ados_cand *cand, unsigned int nr, uint8_t *dat)
+{
+    uint8_t margin[STD_SEC*8];
+    uint16_t weak[MAX_WEAK];
+    uint32_t syn, c[MAX_WEAK];
+    unsigned int i, j, k, m, votes, nr_weak = 0;
+
+    memset(dat, 0, STD_SEC);
+    for (i = 0; i < STD_SEC*8; i++) {
+        for (j = votes = 0; j < nr; j++)
+            votes += (cand[j].dat[i >> 3] >> (7 - (i & 7))) & 1;
+        /* Ties go to the first revolution. */
+        if ((votes*2 > nr) || ((votes*2 == nr) &&
+                               ((cand[0].dat[i >> 3] << (i & 7)) & 0x80)))
+            flip_bit(dat, i);
+        margin[i] = (votes*2 > nr) ? votes*2 - nr : nr - votes*2;
+    }
+
+    syn = amigados_checksum(dat, STD_SEC) ^ cand[0].hdr.dat_checksum;
+    if (syn == 0)
+        return 1;
+
+    /* Unanimous bits (margin == nr) are never candidates for flipping. */
+    for (m = 0; m < nr; m++)
+        for (i = 0; (i < STD_SEC*8) && (nr_weak < MAX_WEAK); i++)
+            if (margin[i] == m) {
+                c[nr_weak] = csum_bit(i);
+                weak[nr_weak++] = i;
+            }
+
+    for (i = 0; i < nr_weak; i++) {
+        if (c[i] == syn)
+            goto flip1;
+        for (j = i+1; (j < nr_weak) && (MAX_FLIPS >= 2); j++) {
+            if ((c[i] ^ c[j]) == syn)
+                goto flip2;
+            for (k = j+1; (k < nr_weak) && (MAX_FLIPS >= 3); k++)
+                if ((c[i] ^ c[j] ^ c[k]) == syn)
+                    goto flip3;
+        }
+    }
+
+    return 0;
+
+flip3:
+    flip_bit(dat, weak[k]);
+flip2:
+    flip_bit(dat, weak[j]);
+flip1:
+    flip_bit(dat, weak[i]);
+    return 1;
+}
+
+/* Store a good sector; returns TRUE if it needs the extended track type. */
+static bool_t ados_set_sector(
+    struct track_info *ti, unsigned int tracknr, char *block,
+    uint32_t sync, const struct ados_hdr *ados_hdr, const void *dat)
+{
+    struct ados_ext *ext;
+    bool_t extended = 0;
+    unsigned int i;
+
+    /* Detect non-standard header info. */
+    if ((ados_hdr->format != 0xffu) ||
+        (ados_hdr->track != tracknr) ||
+        (sync != syncs[0]))
+        extended = 1;
+    for (i = 0; i < 16; i++)
+        if (ados_hdr->lbl[i] != 0)
+            extended = 1;
+
+    ext = (struct ados_ext *)(block + ados_hdr->sector * EXT_SEC);
+    ext->sync = htobe32(sync);
+    memcpy(ext->hdr, ados_hdr, sizeof(ext->hdr));
+    memcpy(ext->dat, dat, STD_SEC);
+
+    set_sector_valid(ti, ados_hdr->sector);
+    return extended;
+}
+
 static void *ados_write_raw(
     struct disk *d, unsigned int tracknr, struct stream *s)
 {
     struct track_info *ti = &d->di->track[tracknr];
     char *block;
     struct ados_ext *ext;
+    struct ados_cand *cand = NULL, *c;
     unsigned int i, nr_valid_blocks = 0, has_extended_blocks = 0;
     unsigned int least_block = ~0u;
     uint64_t lat, latency[ti->nr_sectors];
+    uint8_t nr_cands[ti->nr_sectors];
 
     block = memalloc(EXT_SEC * ti->nr_sectors);
     for (i = 0; i < EXT_SEC * ti->nr_sectors / 4; i++)
         memcpy((uint32_t *)block + i, "NDOS", 4);
+    memset(nr_cands, 0, sizeof(nr_cands));
 
-    while ((stream_next_bit(s) != -1) &&
-           (nr_valid_blocks != ti->nr_sectors)) {
+    while ((nr_valid_blocks != ti->nr_sectors) &&
+           (stream_next_syncs(s, syncs, ARRAY_SIZE(syncs), 32, ~0u) != -1)) {
 
         struct ados_hdr ados_hdr;
         char dat[STD_SEC], raw[2*(sizeof(struct ados_hdr)+STD_SEC)];
         uint32_t sync = s->word, idx_off = s->index_offset_bc - 31;
 
-        for (i = 0; i < ARRAY_SIZE(syncs); i++)
-            if (sync == syncs[i])
-                break;
-        if (i == ARRAY_SIZE(syncs))
-            continue;
-
         lat = s->latency;
         if (stream_next_bytes(s, raw, sizeof(raw)) == -1)
             break;
         lat = s->latency - lat;
 
-        mfm_decode_bytes(bc_mfm_even_odd, 4, &raw[2*0], &ados_hdr);
-        mfm_decode_bytes(bc_mfm_even_odd, 16, &raw[2*4], ados_hdr.lbl);
+        /* Verify checksums on the raw MFM: decode only what passes. */
         mfm_decode_bytes(bc_mfm_even_odd, 4, &raw[2*20],
                          &ados_hdr.hdr_checksum);
-        mfm_decode_bytes(bc_mfm_even_odd, 4, &raw[2*24],
-                         &ados_hdr.dat_checksum);
-        mfm_decode_bytes(bc_mfm_even_odd, STD_SEC, &raw[2*28], dat);
-
         ados_hdr.hdr_checksum = be32toh(ados_hdr.hdr_checksum);
-        ados_hdr.dat_checksum = be32toh(ados_hdr.dat_checksum);
-        if ((amigados_checksum(&ados_hdr, 20) != ados_hdr.hdr_checksum) ||
-            (amigados_checksum(dat, STD_SEC) != ados_hdr.dat_checksum))
+        if (amigados_checksum_mfm(raw, 20) != ados_hdr.hdr_checksum)
             continue;
 
+        mfm_decode_bytes(bc_mfm_even_odd, 4, &raw[2*0], &ados_hdr);
         if ((ados_hdr.sector >= ti->nr_sectors) ||
             is_valid_sector(ti, ados_hdr.sector))
             continue;
 
-        /* Detect non-standard header info. */
-        if ((ados_hdr.format != 0xffu) ||
-            (ados_hdr.track != tracknr) ||
-            (sync != syncs[0]))
+        mfm_decode_bytes(bc_mfm_even_odd, 16, &raw[2*4], ados_hdr.lbl);
+        mfm_decode_bytes(bc_mfm_even_odd, 4, &raw[2*24],
+                         &ados_hdr.dat_checksum);
+        ados_hdr.dat_checksum = be32toh(ados_hdr.dat_checksum);
+        mfm_decode_bytes(bc_mfm_even_odd, STD_SEC, &raw[2*28], dat);
+
+        if (amigados_checksum_mfm(&raw[2*28], STD_SEC)
+            != ados_hdr.dat_checksum) {
+            /* Keep this revolution's decode for fused recovery. Copies
+             * which disagree on the header are a different sector. */
+            i = nr_cands[ados_hdr.sector];
+            if (cand == NULL)
+                cand = track_scratch(
+                    ti->nr_sectors * MAX_CANDS * sizeof(*cand));
+            c = &cand[ados_hdr.sector * MAX_CANDS];
+            if ((i == MAX_CANDS) ||
+                ((i != 0) && memcmp(&c->hdr, &ados_hdr, sizeof(ados_hdr))))
+                continue;
+            c += i;
+            c->sync = sync;
+            c->idx_off = idx_off;
+            c->lat = lat;
+            c->hdr = ados_hdr;
+            memcpy(c->dat, dat, STD_SEC);
+            nr_cands[ados_hdr.sector]++;
+            continue;
+        }
+
+        if (ados_set_sector(ti, tracknr, block, sync, &ados_hdr, dat))
             has_extended_blocks = 1;
-        for (i = 0; i < 16; i++)
-            if (ados_hdr.lbl[i] != 0)
-                has_extended_blocks = 1;
-
-        ext = (struct ados_ext *)(block + ados_hdr.sector * EXT_SEC);
-        ext->sync = htobe32(sync);
-        memcpy(ext->hdr, &ados_hdr, sizeof(ext->hdr));
-        memcpy(ext->dat, dat, STD_SEC);
         latency[ados_hdr.sector] = lat;
-
-        set_sector_valid(ti, ados_hdr.sector);
         nr_valid_blocks++;
         if (least_block > ados_hdr.sector) {
             ti->data_bitoff = idx_off;
@@ -144,6 +274,23 @@ static void *ados_write_raw(
         }
     }
 
+    /* Sectors bad in every revolution: try to fuse the candidate decodes. */
+    for (i = 0; (cand != NULL) && (i < ti->nr_sectors); i++) {
+        uint8_t dat[STD_SEC];
+        c = &cand[i * MAX_CANDS];
+        if (is_valid_sector(ti, i) || (nr_cands[i] == 0) ||
+            !ados_fuse_sector(c, nr_cands[i], dat))
+            continue;
+        if (ados_set_sector(ti, tracknr, block, c->sync, &c->hdr, dat))
+            has_extended_blocks = 1;
+        latency[i] = c->lat;
+        nr_valid_blocks++;
+        if (least_block > i) {
+            ti->data_bitoff = c->idx_off;
+            least_block = i;
+        }
+    }
+
     if (nr_valid_blocks == 0) {
         memfree(block);
         return NULL;
@@ -190,15 +337,46 @@ static void *ados_write_raw(
     init_track_info(
         ti, has_extended_blocks ? TRKTYP_amigados_extended : TRKTYP_amigados);
 
-    for (i = 0; i < ti->nr_sectors; i++)
-        if (is_valid_sector(ti, i))
-            break;
+    i = next_valid_sector(ti, 0);
     ti->data_bitoff -= i * 544*8*2;
     ti->data_bitoff -= 32; /* initial gap */
 
     return block;
 }
 
+/* The MFM of a standard sector from its sync mark to its header checksum
+ * depends only on track and sector: it is encoded once per process. */
+#define TMPL_TRACKS 168
+#define TMPL_BYTES  (4 + 2*sizeof(struct ados_hdr) - 4*2)
+static uint8_t (*tmpl)[11][TMPL_BYTES];
+static pthread_once_t tmpl_once = PTHREAD_ONCE_INIT;
+
+static void tmpl_init(void)
+{
+    struct ados_hdr hdr;
+    unsigned int trk, sec;
+    uint32_t sync, csum;
+    uint8_t *p;
+
+    tmpl = memalloc(TMPL_TRACKS * sizeof(*tmpl));
+    for (trk = 0; trk < TMPL_TRACKS; trk++) {
+        for (sec = 0; sec < 11; sec++) {
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.format = 0xffu;
+            hdr.track = trk;
+            hdr.sector = sec;
+            hdr.sectors_to_gap = 11 - sec;
+            csum = htobe32(amigados_checksum(&hdr, 20));
+            p = tmpl[trk][sec];
+            sync = htobe32(syncs[0]);
+            memcpy(p, &sync, 4);
+            mfm_encode_bytes(bc_mfm_even_odd, 4, &hdr, p+4, p[3]);
+            mfm_encode_bytes(bc_mfm_even_odd, 16, hdr.lbl, p+12, p[11]);
+            mfm_encode_bytes(bc_mfm_even_odd, 4, &csum, p+44, p[43]);
+        }
+    }
+}
+
 static void ados_read_raw(
     struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
 {
@@ -208,6 +386,9 @@ static void ados_read_raw(
     unsigned int i, speed;
     uint32_t sync, csum;
 
+    if ((ti->type != TRKTYP_amigados_extended) && (tracknr < TMPL_TRACKS))
+        pthread_once(&tmpl_once, tmpl_init);
+
     for (i = 0; i < ti->nr_sectors; i++) {
 
         speed = SPEED_AVG;
@@ -229,15 +410,21 @@ static void ados_read_raw(
 
         /* gap */
         tbuf_bits(tbuf, speed, bc_mfm, 16, 0);
-        /* sync mark */
-        tbuf_bits(tbuf, speed, bc_raw, 32, sync);
-        /* info */
-        tbuf_bytes(tbuf, speed, bc_mfm_even_odd, 4, &ados_hdr);
-        /* lbl */
-        tbuf_bytes(tbuf, speed, bc_mfm_even_odd, 16, ados_hdr.lbl);
-        /* header checksum */
-        csum = amigados_checksum(&ados_hdr, 20);
-        tbuf_bits(tbuf, speed, bc_mfm_even_odd, 32, csum);
+        /* sync mark, info, lbl, header checksum: from the template, if the
+         * track has one and the buffer takes pre-encoded bitcells */
+        if ((ti->type == TRKTYP_amigados_extended)
+            || (tracknr >= TMPL_TRACKS)
+            || (tbuf_raw(tbuf, speed, TMPL_BYTES, tmpl[tracknr][i]) != 0)) {
+            /* sync mark */
+            tbuf_bits(tbuf, speed, bc_raw, 32, sync);
+            /* info */
+            tbuf_bytes(tbuf, speed, bc_mfm_even_odd, 4, &ados_hdr);
+            /* lbl */
+            tbuf_bytes(tbuf, speed, bc_mfm_even_odd, 16, ados_hdr.lbl);
+            /* header checksum */
+            csum = amigados_checksum(&ados_hdr, 20);
+            tbuf_bits(tbuf, speed, bc_mfm_even_odd, 32, csum);
+        }
         /* data checksum */
         csum = amigados_checksum(dat, STD_SEC);
         if (!is_valid_sector(ti, i))
@@ -249,6 +436,24 @@ static void ados_read_raw(
     }
 }
 
+static void ados_read_sectors(
+    struct disk *d, unsigned int tracknr, struct track_sectors *sectors)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    unsigned int i, sec_sz = STD_SEC, off = 0;
+
+    if (ti->type == TRKTYP_amigados_extended) {
+        sec_sz = EXT_SEC;
+        off = offsetof(struct ados_ext, dat);
+    }
+
+    sectors->nr_bytes = ti->nr_sectors * STD_SEC;
+    sectors->data = memalloc(sectors->nr_bytes);
+    for (i = 0; i < ti->nr_sectors; i++)
+        memcpy(&sectors->data[i * STD_SEC], &ti->dat[i * sec_sz + off],
+               STD_SEC);
+}
+
 static void ados_get_name(
     struct disk *d, unsigned int tracknr, char *str, size_t size)
 {
@@ -288,21 +493,27 @@ struct track_handler amigados_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
-    .read_raw = ados_read_raw
+    .scanner = &ados_scanner,
+    .read_raw = ados_read_raw,
+    .read_sectors = ados_read_sectors
 };
 
 struct track_handler amigados_varrate_handler = {
     .bytes_per_sector = STD_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
-    .read_raw = ados_read_raw
+    .scanner = &ados_scanner,
+    .read_raw = ados_read_raw,
+    .read_sectors = ados_read_sectors
 };
 
 struct track_handler amigados_extended_handler = {
     .bytes_per_sector = EXT_SEC,
     .nr_sectors = 11,
     .write_raw = ados_write_raw,
+    .scanner = &ados_scanner,
     .read_raw = ados_read_raw,
+    .read_sectors = ados_read_sectors,
     .get_name = ados_get_name
 };
 
@@ -311,19 +522,14 @@ struct track_handler amigados_extended_handler = {
  * These are used where the protection routine does not check for any data
  * in the track gap, or expects only (MFM-encoded) zeros. */
 
-static void *ados_longtrack_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *ados_longtrack_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
     /* handler.bytes_per_sector is overloaded to contain track bit length */
-    unsigned int total_bits = handlers[ti->type]->bytes_per_sector;
-    const char *typename = ti->typename;
-    char *ablk;
-
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if (ablk == NULL)
-        return NULL;
+    unsigned int total_bits = handlers[type]->bytes_per_sector;
+    const char *typename = disk_get_format_desc_name(type);
 
     if (total_bits == 0) {
         static const uint16_t types[] = {
@@ -355,41 +561,57 @@ static void *ados_longtrack_write_raw(
 
 struct track_handler amigados_long_102200_handler = {
     .bytes_per_sector = 102200,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_long_103300_handler = {
     .bytes_per_sector = 103300,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_long_104400_handler = {
     .bytes_per_sector = 104400,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_long_105500_handler = {
     .bytes_per_sector = 105500,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_long_106600_handler = {
     .bytes_per_sector = 106600,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_long_108800_handler = {
     .bytes_per_sector = 108800,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_long_111000_handler = {
     .bytes_per_sector = 111000,
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 struct track_handler amigados_unknown_length_handler = {
-    .write_raw = ados_longtrack_write_raw,
+    .scanner = &ados_scanner,
+    .parent = TRKTYP_amigados,
+    .write_variant = ados_longtrack_write_variant,
 };
 
 /*
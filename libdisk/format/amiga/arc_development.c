@@ -44,7 +44,7 @@ static void *arc_development_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[12*512/4];
         uint16_t  csum, sum, craw[2];
@@ -53,8 +53,6 @@ static void *arc_development_write_raw(
         char *block;
 
         /* Both formats have at least one sync word. */
-        if ((uint16_t)s->word != 0x4489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (s->word == 0x44894489) {
@@ -147,15 +145,12 @@ static void *forgotten_worlds_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint16_t raw[2], dat[ti->len/2], trk, sum, csum;
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw, 4) == -1)
@@ -78,18 +78,15 @@ static void *archipelagos_write_raw(
 
 done:
     if (nr_valid_blocks == 0) {
-        free(block);
+        memfree(block);
         return NULL;
     }
 
-    for (i = 0; i < ti->nr_sectors; i++)
-        if (is_valid_sector(ti, i))
-            break;
+    i = next_valid_sector(ti, 0);
     ti->data_bitoff -= i * 0x820;
 
     /* Some releases use long tracks (for no good reason). */
-    stream_next_index(s);
-    ti->total_bits = (s->track_len_bc > 102000) ? 105500 : 100150;
+    ti->total_bits = check_track_len(s, 102001) ? 105500 : 100150;
 
     return block;
 }
@@ -127,6 +124,7 @@ struct track_handler archipelagos_handler = {
     .bytes_per_sector = 1024,
     .nr_sectors = 5,
     .write_raw = archipelagos_write_raw,
+    .scanner = &scan_sync_44894489,
     .read_raw = archipelagos_read_raw
 };
 
@@ -38,10 +38,8 @@ static void *armourgeddon_a_write_raw(
     uint16_t dat[0xc4d*2];
     unsigned int i;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4429, 16, ~0u) != -1) {
             
-        if ((uint16_t)s->word != 0x4429)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1) /* 0x5552 */
@@ -100,10 +98,8 @@ static void *armourgeddon_b_write_raw(
     uint8_t raw[2], dat[5+6*1024], *block;
     unsigned int i;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
             
-        if (s->word != 0x44894489)
-            continue;
         if (stream_next_bits(s, 32) == -1)
             goto fail;
         if (s->word != 0x44895555)
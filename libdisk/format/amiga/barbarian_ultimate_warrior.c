@@ -63,17 +63,15 @@ static int find_pattern(struct stream *s, struct track_info *ti, uint32_t *p)
     return 1;
 }
 
-static void *barbarian_ultimate_warrior_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *barbarian_ultimate_warrior_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
     uint32_t patterns[5];
     unsigned int i, nr;
-    char *ablk;
 
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if ((ablk == NULL) || (ti->type != TRKTYP_amigados)) {
+    if (ti->type != TRKTYP_amigados) {
         memfree(ablk);
         return NULL;
     }
@@ -115,7 +113,8 @@ static void barbarian_ultimate_warrior_read_raw(
 struct track_handler barbarian_ultimate_warrior_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 11,
-    .write_raw = barbarian_ultimate_warrior_write_raw,
+    .parent = TRKTYP_amigados,
+    .write_variant = barbarian_ultimate_warrior_write_variant,
     .read_raw = barbarian_ultimate_warrior_read_raw
 };
 
@@ -26,15 +26,12 @@ static void *bat_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x8945, 16, ~0u) != -1) {
 
         uint32_t csum, dat[0x629*2];
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x8945)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bytes(s, dat, sizeof(dat)) == -1)
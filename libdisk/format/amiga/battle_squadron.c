@@ -82,9 +82,7 @@ static void *battle_squadron_write_raw(
             continue;
 
         /* Some releases use long tracks  */
-        stream_next_index(s);
-        ti->total_bits = (s->track_len_bc > 101000) ? 103200
-            : 100500;
+        ti->total_bits = check_track_len(s, 101001) ? 103200 : 100500;
 
         block = memalloc(ti->len);
         memcpy(block, &dat[2], ti->len);
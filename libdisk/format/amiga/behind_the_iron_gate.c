@@ -26,15 +26,12 @@ static void *behind_the_iron_gate_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xaaaa8951, 32, ~0u) != -1) {
 
         uint32_t raw[2], dat[ti->len/4], sum, csum;
         unsigned int i;
         char *block;
 
-        if (s->word != 0xaaaa8951)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         for (i = sum = 0; i < ti->len/4; i++) {
@@ -38,13 +38,10 @@ static void *blue_byte_write_raw(
     uint32_t *block = memalloc(ti->len);
     unsigned int i;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x5542aaaa, 32, ~0u) != -1) {
 
         uint8_t dat[2*(4+6032+2)];
 
-        if (s->word != 0x5542aaaa)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         stream_start_crc(s);
@@ -66,7 +63,7 @@ static void *blue_byte_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
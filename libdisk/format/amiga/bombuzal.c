@@ -20,25 +20,21 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
-static void *bombuzal_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *bombuzal_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    char *ablk, *block;
+    char *block;
     uint8_t dat[18];
     unsigned int i;
 
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if ((ablk == NULL) || (ti->type != TRKTYP_amigados))
+    if (ti->type != TRKTYP_amigados)
         goto fail;
 
     stream_reset(s);
 
-    while (stream_next_bit(s) != -1) {
-
-        if ((uint16_t)s->word != 0xa145)
-            continue;
+    while (stream_next_sync(s, 0xa145, 16, ~0u) != -1) {
 
         ti->data_bitoff = s->index_offset_bc - 15;
 
@@ -86,7 +82,8 @@ static void bombuzal_read_raw(
 struct track_handler bombuzal_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 11,
-    .write_raw = bombuzal_write_raw,
+    .parent = TRKTYP_amigados,
+    .write_variant = bombuzal_write_variant,
     .read_raw = bombuzal_read_raw
 };
 
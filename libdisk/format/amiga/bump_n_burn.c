@@ -25,16 +25,13 @@ static void *bump_n_burn_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x22912291, 32, ~0u) != -1) {
 
         uint32_t dat[(ti->len * 2) / 4], header;
         uint32_t idx_off = s->index_offset_bc - 31;
         unsigned int disk_nr;
         void *block;
 
-        if (s->word != 0x22912291)
-            continue;
-
         stream_start_crc(s);
         if (stream_next_bytes(s, dat, 2*ti->len) == -1)
             goto fail;
@@ -52,8 +49,7 @@ static void *bump_n_burn_write_raw(
             continue;
 
         /* IPF has normal-length tracks. Dump from Barry has long tracks. */
-        stream_next_index(s);
-        if (s->track_len_bc > 101500)
+        if (check_track_len(s, 101501))
             ti->total_bits = 102800;
 
         ti->data_bitoff = idx_off;
@@ -62,27 +62,94 @@ static uint8_t lfsr_state_byte(uint32_t x)
     return (uint8_t)(x >> 15);
 }
 
+/* The LFSR is linear over GF(2), so n steps is a 23x23 bit matrix. Jump
+ * tables hold the matrices for 2^k steps forward and back: column i of a
+ * matrix is the image of state bit i. */
+static uint32_t lfsr_fwd[23][23], lfsr_bwd[23][23];
+
+static uint32_t lfsr_apply(const uint32_t *m, uint32_t x)
+{
+    uint32_t y = 0;
+    unsigned int i;
+    for (i = 0; x != 0; i++, x >>= 1)
+        if (x & 1)
+            y ^= m[i];
+    return y;
+}
+
+static void __initcall lfsr_tab_init(void)
+{
+    unsigned int i, k;
+    for (i = 0; i < 23; i++) {
+        lfsr_fwd[0][i] = lfsr_next_state(1u << i);
+        lfsr_bwd[0][i] = lfsr_prev_state(1u << i);
+    }
+    for (k = 1; k < 23; k++) {
+        for (i = 0; i < 23; i++) {
+            lfsr_fwd[k][i] = lfsr_apply(lfsr_fwd[k-1], lfsr_fwd[k-1][i]);
+            lfsr_bwd[k][i] = lfsr_apply(lfsr_bwd[k-1], lfsr_bwd[k-1][i]);
+        }
+    }
+}
+
+/* Step the LFSR @n times, forward or back. */
+static uint32_t lfsr_jump(uint32_t x, unsigned int n, bool_t forward)
+{
+    unsigned int k;
+    for (k = 0; n != 0; k++, n >>= 1)
+        if (n & 1)
+            x = lfsr_apply(forward ? lfsr_fwd[k] : lfsr_bwd[k], x);
+    return x;
+}
+
+/* LFSR steps taken by the data of sector @sec. */
+static unsigned int lfsr_sector_steps(struct track_info *ti, unsigned int sec)
+{
+    unsigned int sz = 512;
+    if (sec == 6)
+        sz -= sizeof(sec6_sig);
+    if ((ti->type == TRKTYP_copylock_old) && (sec == 5))
+        sz += sizeof(sec6_sig);
+    return sz;
+}
+
 /* Take LFSR state from start of one sector, to another. */
 static uint32_t lfsr_seek(
     struct track_info *ti, uint32_t x, unsigned int from, unsigned int to)
 {
-    unsigned int sz;
-
-    while (from != to) {
-        if (from > to)
-            from--;
-        sz = 512;
-        if (from == 6)
-            sz -= sizeof(sec6_sig);
-        if ((ti->type == TRKTYP_copylock_old) && (from == 5))
-            sz += sizeof(sec6_sig);
-        while (sz--)
-            x = (from < to) ? lfsr_next_state(x) : lfsr_prev_state(x);
-        if (from < to)
-            from++;
+    unsigned int sec, n = 0;
+
+    for (sec = min(from, to); sec < max(from, to); sec++)
+        n += lfsr_sector_steps(ti, sec);
+
+    return lfsr_jump(x, n, from < to);
+}
+
+/* Generate the @n data bytes starting at LFSR state @x. Each byte is a
+ * window one step on from the last, so the bytes in eight steps are all
+ * windows on the state at the start: the state eight steps on is then
+ * computed directly. Its new low byte is the running XOR of the old top byte
+ * from bit 22 down, inverted if bit 0 was set. */
+static void lfsr_gen_bytes(uint32_t x, uint8_t *p, unsigned int n)
+{
+    uint32_t t;
+    unsigned int j;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        for (j = 0; j < 8; j++)
+            p[j] = (uint8_t)(x >> (15 - j));
+        t = (x >> 15) & 0xff;
+        t ^= t >> 1;
+        t ^= t >> 2;
+        t ^= t >> 4;
+        t ^= -(x & 1) & 0xff;
+        x = ((x << 8) & ((1u << 23) - 1)) | t;
     }
 
-    return x;
+    for (; n != 0; n--) {
+        *p++ = lfsr_state_byte(x);
+        x = lfsr_next_state(x);
+    }
 }
 
 /* Might have got LFSR discontiguity at sector-6 signature wrong? */
@@ -122,8 +189,8 @@ static void copylock_decode(
     while ((stream_next_bit(s) != -1) &&
            (info->nr_valid_blocks != ti->nr_sectors)) {
 
-        uint8_t dat[2*512];
-        uint32_t lfsr, lfsr_sec, idx_off = s->index_offset_bc - 15;
+        uint8_t dat[2*512], gen[512];
+        uint32_t lfsr_sec, idx_off = s->index_offset_bc - 15;
         unsigned int i, sec;
 
         /* Are we at the start of a sector we have not yet analysed? */
@@ -164,18 +231,14 @@ static void copylock_decode(
         /* Get the LFSR start value for this sector. If we know the track LFSR
          * seed then we work it out from that, else we get it from sector
          * data. */
-        lfsr = lfsr_sec =
+        lfsr_sec =
             (info->lfsr_seed != 0)
             ? lfsr_seek(ti, info->lfsr_seed, 0, sec)
             : (dat[i] << 15) | (dat[i+8] << 7) | (dat[i+16] >> 1);
 
         /* Check that the data matches the LFSR-generated stream. */
-        for (; i < 512; i++) {
-            if (dat[i] != lfsr_state_byte(lfsr))
-                break;
-            lfsr = lfsr_next_state(lfsr);
-        }
-        if (i != 512)
+        lfsr_gen_bytes(lfsr_sec, gen, 512 - i);
+        if (memcmp(&dat[i], gen, 512 - i))
             continue;
 
         /* All good. Finally, stash the LFSR seed if we didn't know it. */
@@ -203,7 +266,8 @@ static void *copylock_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     struct copylock_info info;
     unsigned int sec;
-    uint32_t *block;
+    uint32_t *block, keytag[2];
+    uint8_t key[4];
 
     copylock_decode(ti, s, &info);
 
@@ -254,9 +318,7 @@ static void *copylock_write_raw(
     }
 
     /* Adjust track offset for any missing initial sectors. */
-    for (sec = 0; sec < ti->nr_sectors; sec++)
-        if (is_valid_sector(ti, sec))
-            break;
+    sec = next_valid_sector(ti, 0);
     ti->data_bitoff -= sec * (514+48)*8*2;
 
     /* Adjust track offset for first sector's sync-mark offset. */
@@ -269,6 +331,15 @@ static void *copylock_write_raw(
         set_all_sectors_valid(ti);
     }
 
+    /* The longword of LFSR data following the sector 6 signature, which a
+     * loader may read back once the sector timings check out. Tagged for
+     * tools, such as m68k/copylock, to compare with an emulated run. */
+    lfsr_gen_bytes(lfsr_seek(ti, info.lfsr_seed, 0, 6), key, sizeof(key));
+    keytag[0] = ((uint32_t)key[0] << 24) | (key[1] << 16)
+        | (key[2] << 8) | key[3];
+    keytag[1] = tracknr;
+    disk_set_tag_once(d, DSKTAG_copylock_key, sizeof(keytag), keytag);
+
     ti->len = 4;
     block = memalloc(ti->len);
     *block = htobe32(info.lfsr_seed);
@@ -279,9 +350,10 @@ static void copylock_read_raw(
     struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    uint32_t lfsr, lfsr_seed = be32toh(*(uint32_t *)ti->dat);
+    uint32_t lfsr_seed = be32toh(*(uint32_t *)ti->dat);
     unsigned int i, sec = 0;
     uint16_t speed = SPEED_AVG;
+    uint8_t dat[512];
 
     tbuf_disable_auto_sector_split(tbuf);
 
@@ -300,14 +372,13 @@ static void copylock_read_raw(
         }
         tbuf_bits(tbuf, speed, bc_mfm, 8, sec);
         /* Data */
-        lfsr = lfsr_seek(ti, lfsr_seed, 0, sec);
-        for (i = 0; i < 512; i++) {
-            if ((sec == 6) && (i == 0))
-                for (i = 0; i < sizeof(sec6_sig); i++)
-                    tbuf_bits(tbuf, speed, bc_mfm, 8, sec6_sig[i]);
-            tbuf_bits(tbuf, speed, bc_mfm, 8, lfsr_state_byte(lfsr));
-            lfsr = lfsr_next_state(lfsr);
+        i = 0;
+        if (sec == 6) {
+            memcpy(dat, sec6_sig, sizeof(sec6_sig));
+            i = sizeof(sec6_sig);
         }
+        lfsr_gen_bytes(lfsr_seek(ti, lfsr_seed, 0, sec), &dat[i], 512 - i);
+        tbuf_bytes(tbuf, speed, bc_mfm, 512, dat);
         /* Footer */
         tbuf_bits(tbuf, speed, bc_mfm, 8, 0);
 
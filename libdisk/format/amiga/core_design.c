@@ -29,14 +29,11 @@ static void *core_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     uint32_t *block = memalloc(ti->len);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x8915, 16, ~0u) != -1) {
 
         uint32_t raw[2], csum;
         unsigned int i;
 
-        if ((uint16_t)s->word != 0x8915)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bytes(s, raw, sizeof(raw)) == -1)
@@ -59,7 +56,7 @@ static void *core_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
@@ -23,15 +23,12 @@ static void *crackdown_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint16_t raw[2], dat[0xc00], csum, sum, trk;
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw, 4) == -1)
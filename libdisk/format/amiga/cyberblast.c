@@ -83,7 +83,7 @@ static void *cyberblast_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
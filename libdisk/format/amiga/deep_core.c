@@ -17,21 +17,17 @@
 static bool_t block_write_raw(
     struct stream *s, void *_dat, unsigned int bytes)
 {
-    uint32_t csum, raw[2], *dat = _dat;
-    unsigned int i;
+    uint32_t csum, raw[2*bytes/4];
 
-    if (stream_next_bytes(s, raw, sizeof(raw)) == -1)
+    if (stream_next_bytes(s, raw, 8) == -1)
         goto fail;
     mfm_decode_bytes(bc_mfm_even_odd, 4, raw, &csum);
 
-    for (i = 0; i < bytes/4; i++) {
-        if (stream_next_bytes(s, raw, sizeof(raw)) == -1)
-            goto fail;
-        mfm_decode_bytes(bc_mfm_even_odd, 4, raw, &dat[i]);
-        csum ^= dat[i];
-    }
+    if (stream_next_bytes(s, raw, 2*bytes) == -1)
+        goto fail;
 
-    return !csum;
+    return (mfm_decode_csum(bc_mfm_even_odd, MFM_CSUM_xor,
+                            bytes, 4, raw, _dat) == be32toh(csum));
 
 fail:
     return 0;
@@ -65,10 +61,7 @@ static void *sec_1_write_raw(
     ti->len = ti->nr_sectors * ti->bytes_per_sector;
     block = memalloc(ti->len);
 
-    while (stream_next_bit(s) != -1) {
-
-        if ((uint16_t)s->word != sync)
-            continue;
+    while (stream_next_sync(s, sync, 16, ~0u) != -1) {
 
         ti->data_bitoff = s->index_offset_bc - 15;
 
@@ -105,10 +98,7 @@ static void *sec_2_write_raw(
     ti->len = ti->nr_sectors * ti->bytes_per_sector;
     block = memalloc(ti->len);
 
-    while (stream_next_bit(s) != -1) {
-
-        if ((uint16_t)s->word != 0x4211)
-            continue;
+    while (stream_next_sync(s, 0x4211, 16, ~0u) != -1) {
 
         ti->data_bitoff = s->index_offset_bc - 15;
 
@@ -161,10 +151,7 @@ static void *sec_N_write_raw(
     ti->len = ti->nr_sectors * ti->bytes_per_sector;
     block = memalloc(ti->len);
 
-    while (stream_next_bit(s) != -1) {
-
-        if ((uint16_t)s->word != syncs[0])
-            continue;
+    while (stream_next_sync(s, syncs[0], 16, ~0u) != -1) {
 
         ti->data_bitoff = s->index_offset_bc - 15;
 
@@ -259,10 +246,7 @@ static void *diskid_write_raw(
     ti->bytes_per_sector = 1;
     ti->len = ti->nr_sectors * ti->bytes_per_sector;
 
-    while (stream_next_bit(s) != -1) {
-
-        if (s->word != 0xaaaa448a)
-            continue;
+    while (stream_next_sync(s, 0xaaaa448a, 32, ~0u) != -1) {
 
         ti->data_bitoff = s->index_offset_bc - 31;
 
@@ -278,8 +262,7 @@ static void *diskid_write_raw(
             continue;
 
         /* Disk 1 has a normal-length track 1. */
-        stream_next_index(s);
-        ti->total_bits = (s->track_len_bc > 102500) ? 105500 : 100500;
+        ti->total_bits = check_track_len(s, 102501) ? 105500 : 100500;
         block = memalloc(ti->len);
         block[0] = raw[3] - 0x30;
         set_all_sectors_valid(ti);
@@ -344,7 +327,13 @@ static const uint16_t d3_t5_syncs[] = {
 static unsigned int disknr(struct disk *d, unsigned int tracknr)
 {
     struct track_info *ti = &d->di->track[1];
-    return (ti->type == TRKTYP_deep_core) ? ti->dat[0] : (tracknr < 2) ? 2 : 0;
+    unsigned int nr;
+
+    if (ti->type != TRKTYP_deep_core)
+        return (tracknr < 2) ? 2 : 0;
+    nr = track_get_data(d, 1)[0];
+    track_put_data(d, 1);
+    return nr;
 }
 
 static void *deep_core_write_raw(
@@ -61,10 +61,7 @@ static void *discovery_write_raw(
     for (k = 0; k < ARRAY_SIZE(syncs); k++) {
 
         sync = syncs[k];
-        while (stream_next_bit(s) != -1) {
-
-            if ((uint16_t)s->word != sync)
-                continue;
+        while (stream_next_sync(s, sync, 16, ~0u) != -1) {
 
             ti->data_bitoff = s->index_offset_bc - 15;
 
@@ -212,15 +209,12 @@ static void *zoom_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[ti->len/4], csum;
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
-
         /* Track 118 on the NTSC version only has
          * 2 sync words and the PAL version has
          * three.*/
@@ -311,12 +305,6 @@ static int check_sequence(struct stream *s, unsigned int nr, uint8_t byte)
     return !nr;
 }
 
-static int check_length(struct stream *s, unsigned int min_bits)
-{
-    stream_next_index(s);
-    return (s->track_len_bc >= min_bits);
-}
-
 static void *zoom_prot_write_raw(
     struct disk *d, unsigned int tracknr, struct stream *s)
 {
@@ -326,7 +314,7 @@ static void *zoom_prot_write_raw(
         ti->data_bitoff = s->index_offset_bc - 15;
         if (!check_sequence(s, 1000, 0xaa))
             continue;
-        if (!check_length(s, 102000))
+        if (!check_track_len(s, 102000))
             break;
 
          ti->total_bits = 102386;
@@ -25,15 +25,12 @@ static void *dma_design_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint16_t raw[2], dat[0xc1d], sum, csum, eval;
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 32) == -1)
@@ -24,14 +24,12 @@ static void *dugger_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw[2], dat[7012/4];
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw, 8) == -1)
@@ -46,16 +46,13 @@ static void *elite_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xa2454489, 32, ~0u) != -1) {
 
         uint32_t csum, dat[(ti->len/4+1)*2];
         uint16_t trk;
         unsigned int i;
         char *block;
 
-        if (s->word != 0xa2454489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (ti->type != TRKTYP_elite_d) {
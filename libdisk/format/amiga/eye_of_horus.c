@@ -24,14 +24,12 @@ static void *eye_of_horus_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw[2], hdr[7], dat[0x1600/4], longs_per_sector;
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 31;
 
         for (i = 0; i < ARRAY_SIZE(hdr); i++) {
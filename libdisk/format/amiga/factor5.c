@@ -25,15 +25,11 @@ static void *turrican_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x9521, 16, ~0u) != -1) {
 
-        unsigned int i;
         uint32_t csum, dat[2*ti->len/4];
         char *block;
 
-        if ((uint16_t)s->word != 0x9521)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1)
@@ -43,11 +39,8 @@ static void *turrican_write_raw(
 
         if (stream_next_bytes(s, dat, 2*ti->len) == -1)
             goto fail;
-        for (i = csum = 0; i < ti->len/4; i++) {
-            csum ^= be32toh(dat[2*i]) ^ be32toh(dat[2*i+1]);
-            mfm_decode_bytes(bc_mfm_even_odd, 4, &dat[2*i], &dat[i]);
-        }
-        csum &= 0x55555555u;
+        csum = mfm_decode_csum(bc_mfm_even_odd, MFM_CSUM_amigados,
+                               ti->len, 4, dat, dat);
 
         if (stream_next_bytes(s, &dat[ti->len/4], 8) == -1)
             goto fail;
@@ -55,8 +48,7 @@ static void *turrican_write_raw(
         if (csum != be32toh(dat[ti->len/4]))
             continue;
 
-        stream_next_index(s);
-        ti->total_bits = (s->track_len_bc > 110000) ? 111600 : 108000;
+        ti->total_bits = check_track_len(s, 110001) ? 111600 : 108000;
         
         block = memalloc(ti->len);
         memcpy(block, dat, ti->len);
@@ -122,15 +114,11 @@ static void *denaris_a_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x9521, 16, ~0u) != -1) {
 
-        unsigned int i;
         uint32_t csum, sum, dat[2*ti->len/4];
         char *block;
 
-        if ((uint16_t)s->word != 0x9521)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1)
@@ -144,11 +132,8 @@ static void *denaris_a_write_raw(
 
         if (stream_next_bytes(s, dat, 2*ti->len) == -1)
             goto fail;
-        mfm_decode_bytes(bc_mfm_even_odd, ti->len, dat, dat);
-
-        for (i = sum = 0; i < ti->len/4; i++)
-            sum ^= be32toh(dat[i]) ^ (be32toh(dat[i]) >> 1);
-        sum &= 0x55555555u;
+        sum = mfm_decode_csum(bc_mfm_even_odd, MFM_CSUM_amigados,
+                              ti->len, ti->len, dat, dat);
 
         if (csum != sum)
             continue;
@@ -210,15 +195,11 @@ static void *denaris_b_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x9521, 16, ~0u) != -1) {
 
-        unsigned int i;
-        uint32_t csum, sum, raw[2], dat[ti->len/4];
+        uint32_t csum, sum, raw[2], dat[2*ti->len/4];
         char *block;
 
-        if ((uint16_t)s->word != 0x9521)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1)
@@ -226,13 +207,10 @@ static void *denaris_b_write_raw(
         if (mfm_decode_word((uint16_t)s->word) != 0)
             continue;
 
-        for (i = sum = 0; i < ti->len/4; i++) {
-            if (stream_next_bytes(s, raw, 8) == -1)
-                goto fail;
-            mfm_decode_bytes(bc_mfm_even_odd, 4, raw, &dat[i]);
-            sum ^= be32toh(raw[0]) ^  be32toh(raw[1]);
-        }
-        sum &= 0x55555555u;
+        if (stream_next_bytes(s, dat, 2*ti->len) == -1)
+            goto fail;
+        sum = mfm_decode_csum(bc_mfm_even_odd, MFM_CSUM_amigados,
+                              ti->len, 4, dat, dat);
         sum ^= 0xaaaaaaaau;
 
         if (stream_next_bytes(s, raw, 8) == -1)
@@ -296,14 +274,11 @@ static void *factor5_hiscore_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     uint32_t *block = memalloc(ti->len);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t sum, csum, dat[2];
         unsigned int i;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
-
         if (stream_next_bits(s, 16) == -1)
             continue;
         if (mfm_decode_word((uint16_t)s->word) != 0)
@@ -328,9 +303,7 @@ static void *factor5_hiscore_write_raw(
         } else {
             set_all_sectors_valid(ti);
         }
-        stream_next_index(s);
-        ti->total_bits = (s->track_len_bc > 102000) ? 102500
-            : 100150;
+        ti->total_bits = check_track_len(s, 102001) ? 102500 : 100150;
 
         return block;
     }
@@ -26,15 +26,12 @@ static void *fantastic_voyage_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44892aaa, 32, ~0u) != -1) {
 
         uint32_t raw[2], dat[ti->bytes_per_sector/4], csum, sum;
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44892aaa)
-            continue;
-
         if (stream_next_bytes(s, raw, 8) == -1)
             goto fail;
         mfm_decode_bytes(bc_mfm_even_odd, 4, raw, &csum);
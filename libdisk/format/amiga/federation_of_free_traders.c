@@ -77,13 +77,11 @@ static void *federation_of_free_traders_write_raw(
 
 done:
     if (nr_valid_blocks == 0) {
-        free(block);
+        memfree(block);
         return NULL;
     }
 
-    for (i = 0; i < ti->nr_sectors; i++)
-        if (is_valid_sector(ti, i))
-            break;
+    i = next_valid_sector(ti, 0);
     ti->data_bitoff -= i * 0xfc8;
 
     return block;
@@ -125,6 +123,7 @@ struct track_handler federation_of_free_traders_handler = {
     .bytes_per_sector = 2000,
     .nr_sectors = 3,
     .write_raw = federation_of_free_traders_write_raw,
+    .scanner = &scan_sync_44894489,
     .read_raw = federation_of_free_traders_read_raw
 };
 
@@ -31,13 +31,11 @@ static void *firebird_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     uint16_t *block = memalloc(ti->len);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x89448944, 32, ~0u) != -1) {
 
         uint32_t idx_off = s->index_offset_bc - 31;
         uint8_t dat[2*(ti->len+2)];
 
-        if (s->word != 0x89448944)
-            continue;
         stream_start_crc(s);
         if (stream_next_bits(s, 16) == -1)
             goto fail;
@@ -72,7 +70,7 @@ static void *firebird_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
@@ -46,12 +46,10 @@ static void *fun_factory_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     char *block;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw[2*ti->len/4], dat[ti->len/4], hdr, csum, trackhdr, sum;
 
-        if (s->word != 0x44894489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (ti->type == TRKTYP_gadgetslostintime_a)
@@ -22,14 +22,12 @@ static void *gladiators_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x8915, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[1536], csum, sum;
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x8915)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         for (i = csum = 0; i < ARRAY_SIZE(dat); i++) {
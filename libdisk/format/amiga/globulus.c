@@ -36,11 +36,8 @@ static void *globulus_write_raw(
     for (k = 0; k < ARRAY_SIZE(syncs); k++) {
 
         sync = syncs[k];
-        while (stream_next_bit(s) != -1) {
+        while (stream_next_sync(s, sync, 32, ~0u) != -1) {
 
-            if (s->word != sync)
-                continue;
- 
             ti->data_bitoff = s->index_offset_bc - 31;
 
 			if (stream_next_bits(s, 32) == -1)
@@ -61,9 +58,7 @@ static void *globulus_write_raw(
 
 			dat[i] = sync;
 
-            stream_next_index(s);
-            ti->total_bits = (s->track_len_bc > 104000)
-                ? 104300 : 101500;
+            ti->total_bits = check_track_len(s, 104001) ? 104300 : 101500;
 
             block = memalloc(ti->len+4);
             memcpy(block, dat, ti->len+4);
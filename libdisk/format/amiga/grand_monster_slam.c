@@ -25,15 +25,13 @@ static void *grand_monster_slam_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint16_t dat[0x1604];
         uint32_t csum;
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
         if (stream_next_bits(s, 16) == -1)
             goto fail;
         if (s->word != 0x44892aaa)
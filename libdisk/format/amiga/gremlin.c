@@ -32,13 +32,11 @@ static void *gremlin_write_raw(
     uint16_t *block = memalloc(ti->len);
     unsigned int i;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint16_t raw[2], dat, csum = 0, trk;
         uint32_t idx_off = s->index_offset_bc - 15;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
         if (stream_next_bits(s, 32) == -1)
             goto fail;
         if (s->word != 0x44894489)
@@ -75,7 +73,7 @@ static void *gremlin_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
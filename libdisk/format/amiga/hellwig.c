@@ -31,16 +31,13 @@ static void *hellwig_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[ti->bytes_per_sector/4], csum, sum;
         enum checksum_type checksum_type;
         unsigned int i, two_sync;
         char *block;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1)
@@ -11,25 +11,21 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
-static void *interceptor_software_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *interceptor_software_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    char *ablk;
     unsigned int i;
 
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if ((ablk == NULL) || (ti->type != TRKTYP_amigados))
+    if (ti->type != TRKTYP_amigados)
         goto fail;
 
     stream_reset(s);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xa144, 16, ~0u) != -1) {
 
         /* Sync word 0xa144 precedes the AmigaDOS block by ~2000 bits. */
-        if ((uint16_t)s->word != 0xa144)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         /* Check for a decent-length zero sequence after the sync. */
@@ -75,7 +71,8 @@ static void interceptor_software_read_raw(
 struct track_handler interceptor_software_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 11,
-    .write_raw = interceptor_software_write_raw,
+    .parent = TRKTYP_amigados,
+    .write_variant = interceptor_software_write_variant,
     .read_raw = interceptor_software_read_raw
 };
 
@@ -30,10 +30,8 @@ static void *jinks_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x92429242, 32, ~0u) != -1) {
 
-        if (s->word != 0x92429242)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (tracknr == 161)
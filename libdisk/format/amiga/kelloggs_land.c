@@ -19,63 +19,19 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
-static void *kelloggs_land_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
-{
-    struct track_info *ti = &d->di->track[tracknr];
-
-    while (stream_next_bit(s) != -1) {
-
-        uint32_t dat[0x601], raw[2], sum, i;
-        char *block;
-
-        if (s->word != 0x44892aa9)
-            continue;
-
-        ti->data_bitoff = s->index_offset_bc - 31;
-
-        for (i = sum = 0; i < ARRAY_SIZE(dat); i++) {
-            if (stream_next_bytes(s, raw, 8) == -1)
-                goto fail;
-            mfm_decode_bytes(bc_mfm_even_odd, 4, raw, &dat[i]);
-            sum += be32toh(dat[i]);
-        }
-        sum -= be32toh(dat[i-1]);
-        if (sum != be32toh(dat[i-1]))
-            continue;
-
-        block = memalloc(ti->len);
-        memcpy(block, dat, ti->len);
-        set_all_sectors_valid(ti);
-        ti->total_bits = 105500;
-        return block;
-    }
-
-fail:
-    return NULL;
-}
-
-static void kelloggs_land_read_raw(
-    struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
-{
-    struct track_info *ti = &d->di->track[tracknr];
-    uint32_t *dat = (uint32_t *)ti->dat, sum, i;
-
-    tbuf_bits(tbuf, SPEED_AVG, bc_raw, 32, 0x44892aa9);
-
-    for (i = sum = 0; i < 0x600; i++) {
-        tbuf_bits(tbuf, SPEED_AVG, bc_mfm_even_odd, 32, be32toh(dat[i]));
-        sum += be32toh(dat[i]);
-    }
-
-    tbuf_bits(tbuf, SPEED_AVG, bc_mfm_even_odd, 32, sum);
-}
-
 struct track_handler kelloggs_land_handler = {
     .bytes_per_sector = 0x1800,
     .nr_sectors = 1,
-    .write_raw = kelloggs_land_write_raw,
-    .read_raw = kelloggs_land_read_raw
+    .scanner = &simple_scanner,
+    .write_raw = simple_write_raw,
+    .read_raw = simple_read_raw,
+    .extra_data = & (struct simple_format) {
+        .sync = 0x44892aa9,
+        .sync_bits = 32,
+        .enc = bc_mfm_even_odd,
+        .csum = SIMPLE_CSUM_add,
+        .total_bits = 105500
+    }
 };
 
 /*
@@ -23,21 +23,18 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
-static void *kickoff2_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *kickoff2_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    char *ablk;
 
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if ((ablk == NULL) || (ti->type != TRKTYP_amigados)) {
+    if (ti->type != TRKTYP_amigados) {
         memfree(ablk);
         return NULL;
     }
 
-    stream_next_index(s);
-    if (s->track_len_bc >= 104500) {
+    if (check_track_len(s, 104500)) {
         init_track_info(ti, TRKTYP_kickoff2);
         ti->total_bits += 5312;
     }
@@ -61,7 +58,8 @@ static void kickoff2_read_raw(
 struct track_handler kickoff2_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 11,
-    .write_raw = kickoff2_write_raw,
+    .parent = TRKTYP_amigados,
+    .write_variant = kickoff2_write_variant,
     .read_raw = kickoff2_read_raw
 };
 
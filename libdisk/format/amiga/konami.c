@@ -49,15 +49,12 @@ static void *konami_write_raw(
 
         ti->len = track_sizes[k];
 
-        while (stream_next_bit(s) != -1) {
+        while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
             uint32_t raw[2], dat[ti->len/4], sum, csum;
             unsigned int i;
             char *block;
 
-            if ((uint16_t)s->word != 0x4489)
-                continue;
-
             ti->data_bitoff = s->index_offset_bc - 15;
 
             if (stream_next_bits(s, 32) == -1)
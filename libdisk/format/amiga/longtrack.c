@@ -22,12 +22,6 @@ static int check_sequence(struct stream *s, unsigned int nr, uint8_t byte)
     return !nr;
 }
 
-static int check_length(struct stream *s, unsigned int min_bits)
-{
-    stream_next_index(s);
-    return (s->track_len_bc >= min_bits);
-}
-
 /* TRKTYP_protec_longtrack: PROTEC protection track, used on many releases
  *  u16 0x4454
  *  u8 0x33 (encoded in-place, 1000+ times, to track gap)
@@ -52,7 +46,7 @@ static void *protec_longtrack_write_raw(
         byte = (uint8_t)mfm_decode_word(s->word);
         if (!check_sequence(s, 1000, byte))
             continue;
-        if (!check_length(s, 107200))
+        if (!check_track_len(s, 107200))
             break;
         ti->total_bits = 110000; /* long enough */
         ti->len = 1;
@@ -64,6 +58,12 @@ static void *protec_longtrack_write_raw(
     return NULL;
 }
 
+static int protec_longtrack_probe(
+    struct disk *d, unsigned int tracknr, struct stream *s)
+{
+    return probe_sync(s, 0x4454, 16) && (probe_track_len(s) >= 107200);
+}
+
 static void protec_longtrack_read_raw(
     struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
 {
@@ -78,6 +78,7 @@ static void protec_longtrack_read_raw(
 
 struct track_handler protec_longtrack_handler = {
     .write_raw = protec_longtrack_write_raw,
+    .probe = protec_longtrack_probe,
     .read_raw = protec_longtrack_read_raw
 };
 
@@ -97,9 +98,9 @@ static void *gremlin_longtrack_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x41244124, 32, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 31;
-        if ((s->word != 0x41244124) || !check_sequence(s, 8, 0x00))
+        if (!check_sequence(s, 8, 0x00))
             continue;
         if (ti->type != TRKTYP_tiertex_longtrack)
             ti->total_bits = 105500;
@@ -151,17 +152,15 @@ static void *crystals_of_arborea_longtrack_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     uint32_t raw[2];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xaaaaa144, 32, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 15;
-        if (s->word != 0xaaaaa144)
-            continue;
         stream_next_bytes(s, raw, 8);
         mfm_decode_bytes(bc_mfm, 4, raw, raw);
         if (be32toh(raw[0]) != 0x524f4430) /* "ROD0" */
             continue;
         if (!check_sequence(s, 6500, 0x00))
             continue;
-        if (!check_length(s, 104128))
+        if (!check_track_len(s, 104128))
             break;
         ti->total_bits = 110000;
         return memalloc(0);
@@ -198,13 +197,11 @@ static void *infogrames_longtrack_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xa144, 16, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 15;
-        if ((uint16_t)s->word != 0xa144)
-            continue;
         if (!check_sequence(s, 6510, 0x00))
             continue;
-        if (!check_length(s, 104160))
+        if (!check_track_len(s, 104160))
             break;
         ti->total_bits = 105500;
         return memalloc(0);
@@ -240,11 +237,11 @@ static void *bat_longtrack_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xaaaa8945, 32, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 31;
-        if ((s->word != 0xaaaa8945) || !check_sequence(s, 6826, 0x00))
+        if (!check_sequence(s, 6826, 0x00))
             continue;
-        if (!check_length(s, 109500))
+        if (!check_track_len(s, 109500))
             break;
         ti->total_bits = 110000;
         return memalloc(0);
@@ -278,11 +275,11 @@ static void *app_longtrack_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x924a, 16, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 15;
-        if (((uint16_t)s->word != 0x924a) || !check_sequence(s, 6600, 0xdc))
+        if (!check_sequence(s, 6600, 0xdc))
             continue;
-        if (!check_length(s, 110000))
+        if (!check_track_len(s, 110000))
             break;
         ti->total_bits = 111000;
         return memalloc(0);
@@ -319,14 +316,10 @@ static void *sevencities_longtrack_write_raw(
     unsigned int i;
 
     /* Check for 924a sync word */
-    while (stream_next_bit(s) != -1)
-        if ((uint16_t)s->word == 0x924a)
-            break;
+    (void)stream_next_sync(s, 0x924a, 16, ~0u);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x9251, 16, ~0u) != -1) {
         /* Check for 9251 sync word */
-        if ((uint16_t)s->word != 0x9251)
-            continue;
         /* Next 122 bytes are used by protection check. They have a known 
          * CRC which we check here, and save the bytes as track data. */
         stream_start_crc(s);
@@ -376,7 +369,7 @@ static void *empty_longtrack_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    if (!check_length(s, 105000))
+    if (!check_track_len(s, 105000))
         return NULL;
 
     ti->total_bits = 110000;
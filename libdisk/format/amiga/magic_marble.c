@@ -38,10 +38,7 @@ static void *magic_marble_write_raw(
     for (k = 0; k < ARRAY_SIZE(syncs); k++) {
 
         sync = syncs[k];
-        while (stream_next_bit(s) != -1) {
-
-            if (s->word != sync)
-                continue;
+        while (stream_next_sync(s, sync, 32, ~0u) != -1) {
 
             ti->data_bitoff = s->index_offset_bc - 31;
 
@@ -118,10 +115,8 @@ static void *magic_marble_prot_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xaaaa1224, 32, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 31;
-        if (s->word != 0xaaaa1224)
-            continue;
 
         ti->total_bits = 96687;
         return memalloc(0);
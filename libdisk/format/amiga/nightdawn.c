@@ -24,13 +24,11 @@ static void *nightdawn_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t dat[(ti->len/4)*2];
         char *block;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 32) == -1)
@@ -74,6 +72,7 @@ struct track_handler nightdawn_handler = {
     .bytes_per_sector = 5888,
     .nr_sectors = 1,
     .write_raw = nightdawn_write_raw,
+    .scanner = &scan_sync_4489,
     .read_raw = nightdawn_read_raw
 };
 
@@ -99,10 +98,7 @@ static void *nightdawn_prot_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
-
-        if (s->word != 0x55554155)
-            continue;
+    while (stream_next_sync(s, 0x55554155, 32, ~0u) != -1) {
 
         if (!check_sequence(s, 0x2710/2, 0xff))
             continue;
@@ -39,13 +39,12 @@ static void *pdos_write_raw(
     struct disktag_rnc_pdos_key *keytag = (struct disktag_rnc_pdos_key *)
         disk_get_tag_by_id(d, DSKTAG_rnc_pdos_key);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x1448, 16, ~0u) != -1) {
 
         uint8_t hdr[2*4], dat[2*512], skip;
-        uint32_t k, *p, *q, csum;
+        uint32_t k, *p, *q, csum, key;
+        bool_t derived;
 
-        if ((uint16_t)s->word != 0x1448)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         for (i = 0; i < ti->nr_sectors; i++) {
@@ -64,15 +63,19 @@ static void *pdos_write_raw(
             csum = amigados_checksum(dat, 512);
             csum = (uint16_t)(csum | (csum >> 15));
 
+            derived = 0;
             if (keytag == NULL) {
-                /* Brute-force the key. */
-                uint32_t key = ((hdr[0] ^ i) & 0x7f) << 24;
+                /* Brute-force the key. Other tracks may be analysed in
+                 * parallel: the first key found is used for the disk. */
+                key = ((hdr[0] ^ i) & 0x7f) << 24;
                 key |= (hdr[1] ^ tracknr) << 16;
                 key |= (hdr[2] ^ (uint8_t)(csum>>8)) << 8;
                 key |= hdr[3] ^ (uint8_t)csum;
                 keytag = (struct disktag_rnc_pdos_key *)
-                    disk_set_tag(d, DSKTAG_rnc_pdos_key, 4, &key);
-            } else {
+                    disk_set_tag_once(d, DSKTAG_rnc_pdos_key, 4, &key);
+                derived = (keytag->key == key);
+            }
+            if (!derived) {
                 *(uint32_t *)hdr ^= be32toh(keytag->key) ^ 0x80;
                 if ((hdr[0] != i) || (hdr[1] != tracknr) ||
                     (hdr[2] != (uint8_t)(csum>>8)) ||
@@ -106,7 +109,7 @@ static void *pdos_write_raw(
 
 done:
     if (nr_valid_blocks == 0) {
-        free(block);
+        memfree(block);
         return NULL;
     }
 
@@ -28,16 +28,13 @@ static void *rnc_pdos_old_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     char *block;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw_dat[2*ti->bytes_per_sector/4];
         uint32_t dat[ti->nr_sectors][ti->bytes_per_sector/4];
         uint32_t hdr, csum;
         unsigned int sec;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         for (sec = 0; sec < ti->nr_sectors; sec++) {
@@ -32,7 +32,7 @@ static void *persian_gulf_inferno_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x8845, 16, ~0u) != -1) {
 
         uint32_t csum;
         uint16_t sum;
@@ -40,8 +40,6 @@ static void *persian_gulf_inferno_write_raw(
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x8845)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 32) == -1)
@@ -82,6 +80,7 @@ static void persian_gulf_inferno_read_raw(
     struct tbuf csum_tbuf;
 
     /* Encode the data stream so we can checksum over the MFM data. */
+    memset(&csum_tbuf, 0, sizeof(csum_tbuf));
     tbuf_init(&csum_tbuf, 0, 6383*16);
     for (i = 0; i < 6383; i++) {
         tbuf_bits(&csum_tbuf, SPEED_AVG, bc_mfm_even_odd, 8, dat[i]);
@@ -23,16 +23,13 @@ static void *pinball_dreams_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x448a448a, 32, ~0u) != -1) {
 
         uint32_t csum[2], dat[0x1862/2];
         uint16_t *p;
         uint8_t *block;
         unsigned int i;
 
-        if (s->word != 0x448a448a)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, csum, sizeof(csum)) == -1)
@@ -21,15 +21,12 @@ static void *prison_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     int seen = 0;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw_dat[2], hdr;
         uint8_t dat[2][1024];
         unsigned int i;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw_dat, sizeof(raw_dat)) == -1)
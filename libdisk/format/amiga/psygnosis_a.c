@@ -71,8 +71,7 @@ static void *psygnosis_a_write_raw(
             continue;
 
         /* Some titles (Armourgeddon, Obitus...) mastered with long tracks. */
-        stream_next_index(s);
-        if (s->track_len_bc > 103000)
+        if (check_track_len(s, 103001))
             ti->total_bits = 105500;
 
         block = memalloc(ti->len + 4);
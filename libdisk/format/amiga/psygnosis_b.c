@@ -77,7 +77,7 @@ static void *psygnosis_b_write_raw(
 
 done:
     if (nr_valid_blocks == 0) {
-        free(block);
+        memfree(block);
         return NULL;
     }
 
@@ -110,6 +110,7 @@ struct track_handler psygnosis_b_handler = {
     .bytes_per_sector = 1024,
     .nr_sectors = 6,
     .write_raw = psygnosis_b_write_raw,
+    .scanner = &scan_sync_4489,
     .read_raw = psygnosis_b_read_raw
 };
 
@@ -54,10 +54,8 @@ static void *psygnosis_c_track0_write_raw(
 
         metablk_words = (ver == 1) ? V1_METABLK_WORDS : V2_METABLK_WORDS;
 
-        while (stream_next_bit(s) != -1) {
+        while (stream_next_sync(s, 0x428a, 16, ~0u) != -1) {
 
-            if ((uint16_t)s->word != 0x428a)
-                continue;
             ti->data_bitoff = s->index_offset_bc - 15;
 
             if ((ver == 2) &&
@@ -131,7 +129,7 @@ static bool_t track_metadata(
     struct disk *d, unsigned int tracknr, struct track_metadata *mdat)
 {
     struct track_info *ti = &d->di->track[0];
-    struct h {
+    const struct h {
         uint32_t id;
         uint8_t exc_flags, trk_singleton, trk_range_start, trk_range_end;
     } *h;
@@ -139,7 +137,7 @@ static bool_t track_metadata(
     if (ti->type != TRKTYP_psygnosis_c_track0)
         return 0;
 
-    h = (struct h *)(ti->dat + 512*11);
+    h = (const struct h *)(track_get_data(d, 0) + 512*11);
 
     memcpy(mdat->id, &h->id, 4);
 
@@ -154,19 +152,19 @@ static bool_t track_metadata(
 
     mdat->version = ((ti->len - 512*11) == V1_METABLK_WORDS*2) ? 1 : 2;
     if (mdat->version == 1) {
-        struct h1 {
+        const struct h1 {
             uint16_t trk[160];
             uint32_t disklen;
-        } *h1 = (struct h1 *)(h + 1);
+        } *h1 = (const struct h1 *)(h + 1);
         mdat->decoded_len = be16toh(h1->trk[tracknr]);
         mdat->mask = !(mdat->decoded_len & 0x1000);
         mdat->decoded_len &= 0xfff;
     } else /* mdat->version == 2 */ {
-        struct h2 {
+        const struct h2 {
             uint8_t trk[80][3];
             uint32_t disklen;
             uint8_t mask_bitmap[20];
-        } *h2 = (struct h2 *)(h + 1);
+        } *h2 = (const struct h2 *)(h + 1);
         mdat->decoded_len = h2->trk[tracknr/2][0];
         mdat->decoded_len <<= (tracknr&1) ? 8 : 4;
         mdat->decoded_len &= 0xf00;
@@ -176,6 +174,7 @@ static bool_t track_metadata(
 
     mdat->mask = mdat->mask ? 0xaaaaaaaau : 0x55555555u;
 
+    track_put_data(d, 0);
     return 1;
 }
 
@@ -194,10 +193,8 @@ static void *psygnosis_c_custom_rll_write_raw(
 
     dat = memalloc(mdat.decoded_len * 4);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4429, 16, ~0u) != -1) {
 
-        if ((uint16_t)s->word != 0x4429)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if ((mdat.version == 2) && (stream_next_bits(s, 16) == -1))
@@ -336,10 +333,8 @@ static void *psygnosis_c_write_raw(
     if (nr_bytes == 0)
         return NULL;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4429, 16, ~0u) != -1) {
 
-        if ((uint16_t)s->word != 0x4429)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         for (i = 0; i < (nr_bytes+2+3)/4; i++) {
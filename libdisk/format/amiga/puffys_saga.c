@@ -25,14 +25,12 @@ static void *puffys_saga_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint16_t dat[2*2818], csum;
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 31;
 
         for (i = 0; i < 30; i++) {
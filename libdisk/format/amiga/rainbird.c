@@ -29,13 +29,10 @@ static void *rainbird_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     char *block;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw_dat[2*ti->len/4], hdr, csum;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw_dat, 16) == -1)
@@ -19,80 +19,34 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
-static void *rainbow_arts_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
-{
-    struct track_info *ti = &d->di->track[tracknr];
-
-    while (stream_next_bit(s) != -1) {
-
-        uint32_t raw[2], dat[0x501], csum, sync;
-        unsigned int i;
-        char *block;
-
-        sync = (ti->type == TRKTYP_spherical) ? 0x44892aaa
-            : 0x44452aaa;
-
-        if (s->word != sync)
-            continue;
-        ti->data_bitoff = s->index_offset_bc - 31;
-
-        for (i = csum = 0; i < ARRAY_SIZE(dat); i++) {
-            if (stream_next_bytes(s, raw, 8) == -1)
-                goto fail;
-            mfm_decode_bytes(bc_mfm_even_odd, 4, raw, &dat[i]);
-            csum += be32toh(dat[i]);
-        }
-
-        csum -= 2*be32toh(dat[i-1]);
-        if (csum != 0)
-            continue;
-
-        block = memalloc(ti->len);
-        memcpy(block, dat, ti->len);
-        set_all_sectors_valid(ti);
-        ti->total_bits = 101200;
-        return block;
-    }
-
-fail:
-    return NULL;
-}
-
-static void rainbow_arts_read_raw(
-    struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
-{
-    struct track_info *ti = &d->di->track[tracknr];
-    uint32_t csum, *dat = (uint32_t *)ti->dat;
-    uint16_t sync;
-    unsigned int i;
-
-    sync = (ti->type == TRKTYP_spherical) ? 0x4489
-        : 0x4445;
-
-    tbuf_bits(tbuf, SPEED_AVG, bc_raw, 16, sync);
-    tbuf_bits(tbuf, SPEED_AVG, bc_mfm, 8, 0);
-
-    for (i = csum = 0; i < ti->len/4; i++) {
-        tbuf_bits(tbuf, SPEED_AVG, bc_mfm_even_odd, 32, be32toh(dat[i]));
-        csum += be32toh(dat[i]);
-    }
-
-    tbuf_bits(tbuf, SPEED_AVG, bc_mfm_even_odd, 32, csum);
-}
-
 struct track_handler spherical_handler = {
     .bytes_per_sector = 5120,
     .nr_sectors = 1,
-    .write_raw = rainbow_arts_write_raw,
-    .read_raw = rainbow_arts_read_raw
+    .scanner = &simple_scanner,
+    .write_raw = simple_write_raw,
+    .read_raw = simple_read_raw,
+    .extra_data = & (struct simple_format) {
+        .sync = 0x44892aaa,
+        .sync_bits = 32,
+        .enc = bc_mfm_even_odd,
+        .csum = SIMPLE_CSUM_add,
+        .total_bits = 101200
+    }
 };
 
 struct track_handler conqueror_handler = {
     .bytes_per_sector = 5120,
     .nr_sectors = 1,
-    .write_raw = rainbow_arts_write_raw,
-    .read_raw = rainbow_arts_read_raw
+    .scanner = &simple_scanner,
+    .write_raw = simple_write_raw,
+    .read_raw = simple_read_raw,
+    .extra_data = & (struct simple_format) {
+        .sync = 0x44452aaa,
+        .sync_bits = 32,
+        .enc = bc_mfm_even_odd,
+        .csum = SIMPLE_CSUM_add,
+        .total_bits = 101200
+    }
 };
 
 /*
@@ -35,10 +35,13 @@ static void *ratt_dos_write_raw(
 
     if (tracknr != 2) {
         struct track_info *t2 = &d->di->track[2];
-        struct ratt_file *f = (struct ratt_file *)&t2->dat[0xbc];
+        const struct ratt_file *f;
+        const uint8_t *dat;
         if ((t2->type != TRKTYP_ratt_dos_1800) &&
             (t2->type != TRKTYP_ratt_dos_1810))
             return NULL;
+        dat = track_get_data(d, 2);
+        f = (const struct ratt_file *)&dat[0xbc];
         while (f->name[0] != '\0') {
             uint8_t last_trk = f->first_trk + f->nr_trks - 1;
             if ((f->first_trk <= 80) && (last_trk >= 80))
@@ -47,9 +50,11 @@ static void *ratt_dos_write_raw(
                 goto found;
             f++;
         }
+        track_put_data(d, 2);
         return NULL;
     found:
-        sync = be16toh(((uint16_t *)t2->dat)[6+f->sync_idx]);
+        sync = be16toh(((const uint16_t *)dat)[6+f->sync_idx]);
+        track_put_data(d, 2);
     }
 
     while (stream_next_bit(s) != -1) {
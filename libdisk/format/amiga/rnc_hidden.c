@@ -32,18 +32,17 @@ unsigned int bit_weight(uint8_t *p, unsigned int nr)
     return nr_ones;
 }
 
-static void *rnc_hidden_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *rnc_hidden_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    char *ablk, *block = NULL;
+    char *block = NULL;
     uint8_t raw[40], sig[10], sigs[4][10], nr_sigs = 0;
     uint32_t valid_blocks = 0, trailer_map = 0;
     unsigned int i, j, found, sec, nr_ones;
 
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if ((ablk == NULL) || (ti->type != TRKTYP_amigados))
+    if (ti->type != TRKTYP_amigados)
         goto out;
 
     stream_reset(s);
@@ -144,7 +143,8 @@ static void rnc_hidden_read_raw(
 struct track_handler rnc_hidden_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 11,
-    .write_raw = rnc_hidden_write_raw,
+    .parent = TRKTYP_amigados,
+    .write_variant = rnc_hidden_write_variant,
     .read_raw = rnc_hidden_read_raw
 };
 
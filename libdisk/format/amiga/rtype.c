@@ -32,15 +32,12 @@ static void *rtype_a_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x9521, 16, ~0u) != -1) {
 
         uint8_t raw_dat[2*ti->len];
         uint32_t csum;
         char *block;
 
-        if ((uint16_t)s->word != 0x9521)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1)
@@ -104,16 +101,13 @@ static void *rtype_b_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x9521, 16, ~0u) != -1) {
 
         unsigned int i;
         uint32_t raw_dat[2*ti->len/4];
         uint32_t csum = 0;
         char *block;
 
-        if ((uint16_t)s->word != 0x9521)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 16) == -1)
@@ -28,7 +28,7 @@ static void *savage_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t csum, hdr, zero;
         uint32_t raw[2], raw2[2*ti->bytes_per_sector/4];
@@ -36,9 +36,6 @@ static void *savage_write_raw(
         unsigned int sec;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         for (sec = 0; sec < ti->nr_sectors; sec++) {
@@ -148,15 +148,12 @@ static void *afterburner_sega_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0xa245a245, 32, ~0u) != -1) {
 
         uint32_t raw[2], dat[1551], csum, sum;
         unsigned int i;
         char *block;
 
-        if (s->word != 0xa245a245)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         for (i = csum = 0; i < ARRAY_SIZE(dat); i++) {
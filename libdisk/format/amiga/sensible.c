@@ -32,14 +32,11 @@ static void *sensible_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     char *block;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw_dat[2*(12+ti->len)/4], csum = 0;
         unsigned int i;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw_dat, sizeof(raw_dat)) == -1)
@@ -92,6 +89,7 @@ struct track_handler sensible_handler = {
     .bytes_per_sector = 12*512,
     .nr_sectors = 1,
     .write_raw = sensible_write_raw,
+    .scanner = &scan_sync_44894489,
     .read_raw = sensible_read_raw
 };
 
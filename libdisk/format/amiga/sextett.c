@@ -43,9 +43,7 @@ static void *sextett_protection_write_raw(
     }
 
     /* Disk 1, Track 158: find the key */
-    while (stream_next_bit(s) != -1) {
-        if (s->word != 0x92459245)
-            continue;
+    while (stream_next_sync(s, 0x92459245, 32, ~0u) != -1) {
         ti->data_bitoff = s->index_offset_bc - 31;
         if (stream_next_bits(s, 32) == -1)
             break;
@@ -0,0 +1,127 @@
+/*
+ * disk/simple.c
+ *
+ * Table-driven analyser/encoder for simple single-block custom formats.
+ *
+ * RAW TRACK LAYOUT:
+ *  sync                :: 16 or 32 raw bits
+ *  u32 mark[nr_marks]  :: raw
+ *  u32 dat[len/4][2]   :: per-long encoded (fmt->enc)
+ *  u32 csum[2]         :: per-long encoded, optional
+ *
+ * A handler describes its layout with a struct simple_format, pointed at by
+ * its .extra_data, and uses the simple_* methods below.
+ */
+
+#include <libdisk/util.h>
+#include <private/disk.h>
+
+static const struct simple_format *simple_fmt(
+    struct disk *d, unsigned int tracknr)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    return handlers[ti->type]->extra_data;
+}
+
+static uint32_t simple_checksum(
+    const struct simple_format *fmt, uint32_t *dat, unsigned int nr)
+{
+    uint32_t sum = 0;
+    unsigned int i;
+
+    switch (fmt->csum) {
+    case SIMPLE_CSUM_add:
+        for (i = 0; i < nr; i++)
+            sum += be32toh(dat[i]);
+        break;
+    default:
+        break;
+    }
+
+    return sum;
+}
+
+static void simple_scan_init(
+    struct disk *d, unsigned int tracknr, enum track_type type, void *state)
+{
+    const struct simple_format *fmt = handlers[type]->extra_data;
+    scan_sync_add(state, fmt->sync, fmt->sync_bits);
+}
+
+const struct track_scanner simple_scanner = {
+    .state_size = sizeof(struct scan_sync),
+    .init = simple_scan_init,
+    .feed = scan_sync_feed
+};
+
+void *simple_write_raw(
+    struct disk *d, unsigned int tracknr, struct stream *s)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    const struct simple_format *fmt = simple_fmt(d, tracknr);
+    unsigned int i, nr = ti->len/4;
+    unsigned int nr_raw = nr + (fmt->csum != SIMPLE_CSUM_none);
+    uint32_t *raw = track_scratch(nr_raw * 8), *dat = memalloc_nz(nr_raw * 4);
+
+    while (stream_next_sync(s, fmt->sync, fmt->sync_bits, ~0u) != -1) {
+
+        ti->data_bitoff = s->index_offset_bc - (fmt->sync_bits - 1);
+
+        for (i = 0; i < fmt->nr_marks; i++) {
+            if (stream_next_bits(s, 32) == -1)
+                goto fail;
+            if (s->word != fmt->mark[i])
+                break;
+        }
+        if (i != fmt->nr_marks)
+            continue;
+
+        if (stream_next_bytes(s, raw, nr_raw * 8) == -1)
+            goto fail;
+        for (i = 0; i < nr_raw; i++)
+            mfm_decode_bytes(fmt->enc, 4, &raw[2*i], &dat[i]);
+
+        if ((fmt->csum != SIMPLE_CSUM_none)
+            && (simple_checksum(fmt, dat, nr) != be32toh(dat[nr])))
+            continue;
+
+        set_all_sectors_valid(ti);
+        if (fmt->total_bits)
+            ti->total_bits = fmt->total_bits;
+        return dat;
+    }
+
+fail:
+    memfree(dat);
+    return NULL;
+}
+
+void simple_read_raw(
+    struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
+{
+    struct track_info *ti = &d->di->track[tracknr];
+    const struct simple_format *fmt = simple_fmt(d, tracknr);
+    uint32_t *dat = (uint32_t *)ti->dat;
+    unsigned int i, nr = ti->len/4;
+
+    tbuf_bits(tbuf, SPEED_AVG, bc_raw, fmt->sync_bits, fmt->sync);
+    for (i = 0; i < fmt->nr_marks; i++)
+        tbuf_bits(tbuf, SPEED_AVG, bc_raw, 32, fmt->mark[i]);
+
+    for (i = 0; i < nr; i++)
+        tbuf_bits(tbuf, SPEED_AVG, fmt->enc, 32, be32toh(dat[i]));
+
+    if (fmt->csum != SIMPLE_CSUM_none)
+        tbuf_bits(tbuf, SPEED_AVG, fmt->enc, 32,
+                  simple_checksum(fmt, dat, nr));
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -58,7 +58,7 @@ static void *skaermtrolden_hugo_write_raw(
 
         if (!disktag_disk_nr)
             disktag_disk_nr = (struct disktag_disk_nr *)
-                disk_set_tag(d, DSKTAG_disk_nr, 4, &disk);
+                disk_set_tag_once(d, DSKTAG_disk_nr, 4, &disk);
         if (disk != disktag_disk_nr->disk_nr)
             continue;
 
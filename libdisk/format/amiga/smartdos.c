@@ -23,13 +23,11 @@ static void *smartdos_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4488, 16, ~0u) != -1) {
 
         uint32_t dat[ti->len/2], csum, sum, *block;
         unsigned int i;
 
-        if ((uint16_t)s->word != 0x4488)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bytes(s, dat, 8) == -1)
@@ -28,15 +28,13 @@ static void *speedball_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t dat[10000], track_len, csum;
         uint32_t idx_off = s->index_offset_bc - 31;
         unsigned int i;
         void *block;
 
-        if (s->word != 0x44894489)
-            continue;
         if (stream_next_bits(s, 32) == -1)
             goto fail;
         if (mfm_decode_word(s->word) != 0xfefe)
@@ -97,6 +95,7 @@ static void speedball_read_raw(
 struct track_handler speedball_handler = {
     .nr_sectors = 1,
     .write_raw = speedball_write_raw,
+    .scanner = &scan_sync_44894489,
     .read_raw = speedball_read_raw
 };
 
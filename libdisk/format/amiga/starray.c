@@ -19,18 +19,16 @@
 #include <libdisk/util.h>
 #include <private/disk.h>
 
-static void *starray_write_raw(
-    struct disk *d, unsigned int tracknr, struct stream *s)
+static void *starray_write_variant(
+    struct disk *d, unsigned int tracknr, enum track_type type,
+    struct stream *s, void *ablk)
 {
     struct track_info *ti = &d->di->track[tracknr];
     unsigned int distance[5];
     uint16_t pattern[5];
     unsigned int i, nr, corrupted_sync = 0;
-    char *ablk;
 
-    init_track_info(ti, TRKTYP_amigados);
-    ablk = handlers[TRKTYP_amigados]->write_raw(d, tracknr, s);
-    if ((ablk == NULL) || (ti->type != TRKTYP_amigados)) {
+    if (ti->type != TRKTYP_amigados) {
         memfree(ablk);
         return NULL;
     }
@@ -91,7 +89,8 @@ static void starray_read_raw(
 struct track_handler starray_handler = {
     .bytes_per_sector = 512,
     .nr_sectors = 11,
-    .write_raw = starray_write_raw,
+    .parent = TRKTYP_amigados,
+    .write_variant = starray_write_variant,
     .read_raw = starray_read_raw
 };
 
@@ -24,15 +24,12 @@ static void *summer_games_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     char *block;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw_dat[2], dat[ti->nr_sectors][ti->bytes_per_sector/4];
         uint32_t csum, hdr;
         unsigned int i, j;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bytes(s, raw_dat, sizeof(raw_dat)) == -1)
@@ -65,7 +65,7 @@ static void *super_stardust_write_raw(
         /* Sanity-check the sector header. */
         if (!disktag_disk_nr)
             disktag_disk_nr = (struct disktag_disk_nr *)
-                disk_set_tag(d, DSKTAG_disk_nr, 4, &dsk);
+                disk_set_tag_once(d, DSKTAG_disk_nr, 4, &dsk);
         if (dsk != disktag_disk_nr->disk_nr)
             continue;
         if ((trk != tracknr) || (sec >= ti->nr_sectors)
@@ -148,6 +148,7 @@ struct track_handler super_stardust_handler = {
     .bytes_per_sector = 1032,
     .nr_sectors = 6,
     .write_raw = super_stardust_write_raw,
+    .scanner = &scan_sync_44894489,
     .read_raw = super_stardust_read_raw
 };
 
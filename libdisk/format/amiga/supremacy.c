@@ -24,15 +24,12 @@ static void *supremacy_a_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t csum, dat[0x402*2];
         unsigned int i;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bits(s, 16) == -1)
@@ -154,7 +151,7 @@ static void *supremacy_b_write_raw(
     }
 
     if (nr_valid_blocks == 0) {
-        free(block);
+        memfree(block);
         return NULL;
     }
 
@@ -25,14 +25,12 @@ static void *tracker_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x44894489, 32, ~0u) != -1) {
 
         uint32_t raw[2*512/4], dat[11*512/4], csum;
         unsigned int sec;
         char *block;
 
-        if (s->word != 0x44894489)
-            continue;
         if (stream_next_bits(s, 32) == -1)
             goto fail;
         if (s->word != 0x44894489)
@@ -24,14 +24,12 @@ static void *typhoon_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x48914891, 32, ~0u) != -1) {
 
         uint32_t csum, hdr, raw[2*ti->len/4], dat[ti->len/4];
         char *block;
 
         /* Scan for sync pattern. */
-        if (s->word != 0x48914891)
-            continue;
         if (stream_next_bits(s, 16) == -1)
             goto fail;
         if (s->word != 0x489144a9)
@@ -24,14 +24,11 @@ static void *vade_retro_alienas_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4142, 16, ~0u) != -1) {
 
         uint16_t dat[0xc58], raw[2], sum, i;
         char *block;
 
-        if ((uint16_t)s->word != 0x4142)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         for (i = sum = 0; i < 0xc58; i++) {
@@ -29,15 +29,12 @@ static void *vampires_empire_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[ti->len/4], sum, csum;
         unsigned int i;
         char *block;
 
-
-        if ((uint16_t)s->word != 0x4489)
-            continue;
         ti->data_bitoff = s->index_offset_bc - 15;
 
        if (s->word == 0x44894489) {
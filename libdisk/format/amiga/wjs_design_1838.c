@@ -23,15 +23,12 @@ static void *wjs_design_1838_write_raw(
 {
     struct track_info *ti = &d->di->track[tracknr];
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[0x60e], csum, sum;
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         switch (ti->type) {
@@ -54,15 +54,12 @@ static void *wjs_design_1858_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     const struct wjs_info *wjs_info = find_wjs_info(ti->type);
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x4489, 16, ~0u) != -1) {
 
         uint32_t raw[2], dat[0x616], csum, sum;
         unsigned int i;
         char *block;
 
-        if ((uint16_t)s->word != 0x4489)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 15;
 
         if (stream_next_bits(s, 32) == -1)
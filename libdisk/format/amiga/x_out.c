@@ -27,13 +27,10 @@ static void *x_out_write_raw(
     uint32_t *block = memalloc(ti->len);
     unsigned int i;
 
-    while (stream_next_bit(s) != -1) {
+    while (stream_next_sync(s, 0x84552aaa, 32, ~0u) != -1) {
 
         uint32_t sum, csum, dat[(2*ti->len)/4];
 
-        if (s->word != 0x84552aaa)
-            continue;
-
         ti->data_bitoff = s->index_offset_bc - 31;
 
         if (stream_next_bits(s, 32) == -1)
@@ -57,7 +54,7 @@ static void *x_out_write_raw(
     }
 
 fail:
-    free(block);
+    memfree(block);
     return NULL;
 }
 
@@ -27,10 +27,25 @@ struct ibm_track {
     struct ibm_sector secs[0];
 };
 
+/* Sectors found so far on a track being analysed, in order of track offset.
+ * Their data is kept in one buffer, and bitcells are read into another grown
+ * to the largest sector seen. All are carved from the attempt's scratch arena
+ * (see track_scratch()), so need not be freed. */
 struct ibm_psector {
-    struct ibm_psector *next;
     int offset;
-    struct ibm_sector s;
+    uint32_t dat_off;
+    struct ibm_idam idam;
+    uint8_t mark;
+    uint16_t crc;
+};
+
+struct ibm_psectors {
+    struct ibm_psector *sec;
+    unsigned int nr, max;
+    uint8_t *dat;
+    uint32_t dat_len, dat_max;
+    uint8_t *raw;
+    unsigned int raw_max;
 };
 
 #define type_is_fm(type)                            \
@@ -55,13 +70,12 @@ static bool_t is_trs80_track(int type)
 }
 
 /* Is this a TRS-80 directory mark? */
-static bool_t is_trs80_mark(int type, int mark)
+static bool_t is_trs80_mark(bool_t trs80, int mark)
 {
 /* TRS-80 address marks used in directory tracks */
 #define TRS_MARK_DAM1 0xfa
 #define TRS_MARK_DAM2 0xf8
-    return (is_trs80_track(type) 
-            && (mark == TRS_MARK_DAM1 || mark == TRS_MARK_DAM2));
+    return (trs80 && (mark == TRS_MARK_DAM1 || mark == TRS_MARK_DAM2));
 }
 
 
@@ -113,6 +127,187 @@ void ibm_read_sectors(
 }
 
 
+/***********************************
+ * Sector table used during analysis
+ */
+
+static void *ibm_grow(void *old, size_t old_sz, size_t new_sz)
+{
+    void *p = track_scratch(new_sz);
+    if (old != NULL)
+        memcpy(p, old, old_sz);
+    return p;
+}
+
+/* Buffer for the @bytes of bitcells of the sector being read. */
+static uint8_t *ibm_psectors_raw(struct ibm_psectors *ps, unsigned int bytes)
+{
+    if (bytes > ps->raw_max) {
+        ps->raw = track_scratch(bytes);
+        ps->raw_max = bytes;
+    }
+    return ps->raw;
+}
+
+/* Record a sector found at track offset @idx_off. Returns where its decoded
+ * data belongs, or NULL if it is a sector already found on an earlier
+ * revolution, with data at least as good. */
+static uint8_t *ibm_psectors_add(
+    struct ibm_psectors *ps, struct track_info *ti, unsigned int tracknr,
+    int idx_off, const struct ibm_idam *idam, uint8_t mark, uint16_t crc)
+{
+    struct ibm_psector *cur_sec;
+    unsigned int i, sec_sz = 128 << idam->no;
+
+    /* Find correct place for this sector among those decoded so far. */
+    for (i = 0; i < ps->nr; i++)
+        if ((idx_off - ps->sec[i].offset) < 1000)
+            break;
+    cur_sec = &ps->sec[i];
+
+    /* If this sector's start is within 1000 bits of one we already decoded
+     * then it is the same sector: we decoded it already on an earlier 
+     * revolution and can skip it this time round. */
+    if ((i < ps->nr) && (abs(idx_off - cur_sec->offset) < 1000)) {
+
+        /* Is this really the same sector? Check IDAM contents. */
+        if ((idam->cyl == cur_sec->idam.cyl) &&
+            (idam->head == cur_sec->idam.head) && 
+            (idam->sec == cur_sec->idam.sec) &&
+            (idam->no == cur_sec->idam.no)) {
+
+            /* If we now have a good CRC and the saved sector has a bad CRC
+             * we should try converting it again.
+             *
+             * TODO:
+             *  1 if we only have bad crcs on all reads we might try to
+             *    median combine all of the bits into a new one
+             *  2 reconstruct missing idam values if we have a data
+             *    sector */
+            if (!crc && cur_sec->crc) {
+#ifdef CRC_DEBUG
+                trk_warn(ti, tracknr, "FIXED CRC cyl:%2d, head:%2d, "
+                         "sec:%2d, no:%2d, size:%4x, offset:%5d\n",
+                         idam->cyl, idam->head, idam->sec, idam->no,
+                         sec_sz, idx_off);
+#endif
+
+                /* Replace the previous bad sector header/data. */
+                cur_sec->offset = idx_off;
+                cur_sec->crc = crc;
+                cur_sec->mark = mark;
+                cur_sec->idam = *idam;
+                return &ps->dat[cur_sec->dat_off];
+            }
+
+        } else {
+
+            /* This code should NEVER trigger */
+            trk_warn(ti, tracknr, "IDAM  WARN"
+                     " [cyl:%2d, head:%2d, sec:%2d, no:%2d, "
+                     "crc:%04x, offset:%5d] != [cyl:%2d, head:%2d, "
+                     "sec:%2d, no:%2d, crc:%04x, offset:%5d]\n",
+                     idam->cyl, idam->head, idam->sec, idam->no,
+                     crc, idx_off,
+                     cur_sec->idam.cyl, cur_sec->idam.head,
+                     cur_sec->idam.sec, cur_sec->idam.no,
+                     cur_sec->idam.crc, cur_sec->offset);
+
+        }
+
+        return NULL;
+    }
+
+#ifdef CRC_DEBUG
+    if (crc) {
+        trk_warn(ti, tracknr, "DATA  CRC cyl:%2d, head:%2d, sec:%2d, "
+                 "no:%2d, crc:%04x, offset:%5d\n",
+                 idam->cyl, idam->head, idam->sec, idam->no, crc, idx_off);
+    }
+#endif
+
+    /* Add a new sector. */
+    if (ps->nr == ps->max) {
+        unsigned int max = ps->max ? ps->max * 2 : 32;
+        ps->sec = ibm_grow(ps->sec, ps->max * sizeof(*ps->sec),
+                           max * sizeof(*ps->sec));
+        ps->max = max;
+        cur_sec = &ps->sec[i];
+    }
+    if (ps->dat_len + sec_sz > ps->dat_max) {
+        uint32_t max = ps->dat_max ? ps->dat_max : 16384;
+        while (ps->dat_len + sec_sz > max)
+            max *= 2;
+        ps->dat = ibm_grow(ps->dat, ps->dat_len, max);
+        ps->dat_max = max;
+    }
+    memmove(cur_sec + 1, cur_sec, (ps->nr - i) * sizeof(*cur_sec));
+    ps->nr++;
+    cur_sec->offset = idx_off;
+    cur_sec->dat_off = ps->dat_len;
+    cur_sec->idam = *idam;
+    cur_sec->mark = mark;
+    cur_sec->crc = crc;
+    ps->dat_len += sec_sz;
+
+    return &ps->dat[cur_sec->dat_off];
+}
+
+/* Build the track from the sectors found, each of which occupies @overhead
+ * bytes on disk besides its data. Returns NULL if there are none, or they
+ * overlap. Else *@gap_bits receives the bits of gap available. */
+static struct ibm_track *ibm_psectors_track(
+    struct ibm_psectors *ps, struct track_info *ti, unsigned int tracknr,
+    struct stream *s, unsigned int overhead, unsigned int *gap_bits)
+{
+    struct ibm_psector *cur_sec, *next_sec;
+    struct ibm_track *ibm_track;
+    struct ibm_sector *sec;
+    unsigned int i, sec_sz, dat_bytes = 0;
+
+    if (ps->nr == 0)
+        return NULL;
+
+    *gap_bits = ti->total_bits - s->track_len_bc;
+    for (i = 0; i < ps->nr; i++) {
+        int distance;
+        cur_sec = &ps->sec[i];
+        next_sec = &ps->sec[(i + 1) % ps->nr];
+        distance = next_sec->offset - cur_sec->offset;
+        if (distance <= 0)
+            distance += s->track_len_bc;
+        sec_sz = 128 << cur_sec->idam.no;
+        if ((distance -= (overhead + sec_sz) * 16) < 0) {
+            trk_warn(ti, tracknr, "Overlapping sectors");
+            return NULL;
+        }
+        *gap_bits += distance;
+        dat_bytes += sec_sz;
+    }
+
+    ti->nr_sectors = ps->nr;
+    set_all_sectors_valid(ti);
+
+    ibm_track = memalloc(sizeof(struct ibm_track)
+                         + ps->nr * sizeof(struct ibm_sector)
+                         + dat_bytes);
+
+    ti->len = sizeof(struct ibm_track);
+    for (i = 0; i < ps->nr; i++) {
+        cur_sec = &ps->sec[i];
+        sec_sz = 128 << cur_sec->idam.no;
+        sec = (struct ibm_sector *)((char *)ibm_track + ti->len);
+        sec->idam = cur_sec->idam;
+        sec->mark = cur_sec->mark;
+        sec->crc = cur_sec->crc;
+        memcpy(sec->dat, &ps->dat[cur_sec->dat_off], sec_sz);
+        ti->len += sizeof(struct ibm_sector) + sec_sz;
+    }
+
+    return ibm_track;
+}
+
+
 /***********************************
  * Double-density (IBM-MFM) handlers
  * 
@@ -131,20 +326,19 @@ void ibm_read_sectors(
 
 int ibm_scan_mark(struct stream *s, unsigned int max_scan, uint8_t *pmark)
 {
-    int idx_off = -1;
+    int idx_off;
 
-    do {
-        if (s->word != 0x44894489)
-            continue;
-        stream_start_crc(s);
-        if ((stream_next_bits(s, 32) == -1) || ((s->word >> 16) != 0x4489))
-            break;
-        idx_off = s->index_offset_bc - 63;
-        if (idx_off < 0)
-            idx_off += s->track_len_bc;
-        *pmark = (uint8_t)mfm_decode_word(s->word);
-        break;
-    } while ((stream_next_bit(s) != -1) && --max_scan);
+    if ((s->word != 0x44894489) &&
+        (stream_next_sync(s, 0x44894489, 32, max_scan - 1) == -1))
+        return -1;
+
+    stream_start_crc(s);
+    if ((stream_next_bits(s, 32) == -1) || ((s->word >> 16) != 0x4489))
+        return -1;
+    idx_off = s->index_offset_bc - 63;
+    if (idx_off < 0)
+        idx_off += s->track_len_bc;
+    *pmark = (uint8_t)mfm_decode_word(s->word);
 
     return idx_off;
 }
@@ -187,6 +381,29 @@ int ibm_scan_dam(struct stream *s)
     return (mark == IBM_MARK_DAM) ? idx_off : -1;
 }
 
+/* Called after the sector scan, so an IAM already read is found from the sync
+ * index. Otherwise the rest of the stream is searched (or the whole stream
+ * again, if it is not cached, so the caller must be done with the stream's
+ * track length). */
+bool_t ibm_scan_iam(struct stream *s)
+{
+    int seen = stream_seen_sync(s, 0x52245224, 32, 0x52245552);
+
+    if (seen > 0)
+        return 1;
+    if (seen < 0)
+        stream_reset(s);
+
+    while (stream_next_sync(s, 0x52245224, 32, ~0u) != -1) {
+        if (stream_next_bits(s, 32) == -1)
+            break;
+        if (s->word == 0x52245552)
+            return 1;
+    }
+
+    return 0;
+}
+
 static int choose_post_data_gap(
     struct track_info *ti, struct ibm_track *ibm_track,
     int gap_bits, unsigned int nr_secs)
@@ -213,29 +430,16 @@ static void *ibm_mfm_write_raw(
     struct disk *d, unsigned int tracknr, struct stream *s)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    struct ibm_psector *ibm_secs, *new_sec, *cur_sec, *next_sec, **pprev_sec;
-    struct ibm_track *ibm_track = NULL;
-    unsigned int dat_bytes = 0, gap_bits, nr_blocks = 0;
-    unsigned int sec_sz;
-    bool_t iam = 0;
-
-    /* IAM */
-    while (!iam && (stream_next_bit(s) != -1)) {
-        if (s->word != 0x52245224)
-            continue;
-        if (stream_next_bits(s, 32) == -1)
-            break;
-        iam = (s->word == 0x52245552);
-    }
-
-    stream_reset(s);
-
-    ibm_secs = NULL;
+    struct ibm_psectors ps = { 0 };
+    struct ibm_track *ibm_track;
+    unsigned int gap_bits, sec_sz;
+    const bool_t recovery = is_recovery_type(ti->type);
+    const bool_t trs80 = is_trs80_track(ti->type);
 
     while (stream_next_bit(s) != -1) {
 
         int idx_off;
-        uint8_t mark, dat[2*16384];
+        uint8_t mark, *raw, *dat;
         uint16_t crc;
         struct ibm_idam idam;
 
@@ -249,7 +453,7 @@ static void *ibm_mfm_write_raw(
         if (idam.crc) {
 #if CRC_DEBUG
             /* Warn if we are recovering */
-            if (is_recovery_type(ti->type)) {
+            if (recovery) {
                 trk_warn(ti, tracknr, "IDAM CRC cyl:%2d, head:%2d, sec:%2d, "
                          "no:%2d, crc:%04x, offset:%5d\n",
                          idam.cyl, idam.head, idam.sec,
@@ -266,146 +470,38 @@ static void *ibm_mfm_write_raw(
         }
 
         sec_sz = 128 << idam.no;
+        raw = ibm_psectors_raw(&ps, 2*sec_sz);
 
         /* DAM/DDAM */
         if ((ibm_scan_mark(s, 1000, &mark) < 0) ||
             ((mark != IBM_MARK_DAM) && (mark != IBM_MARK_DDAM)
-             && !is_trs80_mark(ti->type, mark)) ||
-            (stream_next_bytes(s, dat, 2*sec_sz) == -1) ||
+             && !is_trs80_mark(trs80, mark)) ||
+            (stream_next_bytes(s, raw, 2*sec_sz) == -1) ||
             (stream_next_bits(s, 32) == -1))
             continue;
 
         /* Skip bad data CRC unless we are doing data recovery. */
         crc = s->crc16_ccitt;
-        if (crc && !is_recovery_type(ti->type))
+        if (crc && !recovery)
             continue;
 
-        /* Find correct place for this sector in our linked list of sectors 
-         * that we have decoded so far. */
-        pprev_sec = &ibm_secs;
-        cur_sec = *pprev_sec;
-        while (cur_sec && ((idx_off - cur_sec->offset) >= 1000)) {
-            pprev_sec = &cur_sec->next;
-            cur_sec = *pprev_sec;
+        /* Decode only sectors not already found on an earlier revolution. */
+        dat = ibm_psectors_add(&ps, ti, tracknr, idx_off, &idam, mark, crc);
+        if (dat != NULL) {
+            mfm_decode_bytes(bc_mfm, sec_sz, raw, dat);
+            stream_progress(s);
         }
-
-        /* If this sector's start is within 1000 bits of one we already decoded
-         * then it is the same sector: we decoded it already on an earlier 
-         * revolution and can skip it this time round. */
-        if (cur_sec && (abs(idx_off - cur_sec->offset) < 1000)) {
-
-            /* Is this really the same sector? Check IDAM contents. */
-            if ((idam.cyl == cur_sec->s.idam.cyl) &&
-                (idam.head == cur_sec->s.idam.head) && 
-                (idam.sec == cur_sec->s.idam.sec) &&
-                (idam.no == cur_sec->s.idam.no)) {
-
-                /* If we now have a good CRC and the saved sector has a bad CRC
-                 * we should try converting it again.
-                 *
-                 * TODO:
-                 *  1 if we only have bad crcs on all reads we might try to
-                 *    median combine all of the bits into a new one
-                 *  2 reconstruct missing idam values if we have a data
-                 *    sector */
-                if (!crc && cur_sec->s.crc) {
-#ifdef CRC_DEBUG
-                    trk_warn(ti, tracknr, "FIXED CRC cyl:%2d, head:%2d, "
-                             "sec:%2d, no:%2d, size:%4x, offset:%5d\n",
-                             idam.cyl, idam.head, idam.sec, idam.no,
-                             sec_sz, idx_off);
-#endif
-
-                    /* Replace the previous bad sector header/data. */
-                    cur_sec->offset = idx_off;
-                    cur_sec->s.crc = crc;
-                    cur_sec->s.mark = mark;
-                    mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
-                    memcpy(&cur_sec->s.dat[0], dat, sec_sz);
-                    memcpy(&cur_sec->s.idam, &idam, sizeof(idam));
-                }
-
-            } else {
-
-                /* This code should NEVER trigger */
-                trk_warn(ti, tracknr, "IDAM  WARN"
-                         " [cyl:%2d, head:%2d, sec:%2d, no:%2d, "
-                         "crc:%04x, offset:%5d] != [cyl:%2d, head:%2d, "
-                         "sec:%2d, no:%2d, crc:%04x, offset:%5d]\n",
-                         idam.cyl, idam.head, idam.sec, idam.no,
-                         crc, idx_off,
-                         cur_sec->s.idam.cyl, cur_sec->s.idam.head,
-                         cur_sec->s.idam.sec, cur_sec->s.idam.no,
-                         cur_sec->s.idam.crc, cur_sec->offset);
-
-            }
-
-            continue;
-        }
-
-#ifdef CRC_DEBUG
-        if (crc) {
-            trk_warn(ti, tracknr, "DATA  CRC cyl:%2d, head:%2d, sec:%2d, "
-                     "no:%2d, crc:%04x, offset:%5d\n",
-                     idam.cyl, idam.head, idam.sec, idam.no, crc, idx_off);
-        }
-#endif
-
-        /* Add a new sector. */
-        mfm_decode_bytes(bc_mfm, sec_sz, dat, dat);
-        new_sec = memalloc(sizeof(*new_sec) + sec_sz);
-        new_sec->offset = idx_off;
-        new_sec->s.crc = crc;
-        new_sec->s.mark = mark;
-        memcpy(&new_sec->s.dat[0], dat, sec_sz);
-        memcpy(&new_sec->s.idam, &idam, sizeof(idam));
-        /* Add the new sector to linked list */
-        new_sec->next = *pprev_sec;
-        *pprev_sec = new_sec;
     }
 
-    gap_bits = ti->total_bits - s->track_len_bc;
-    for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
-        int distance, cur_size;
-        next_sec = cur_sec->next ?: ibm_secs;
-        distance = next_sec->offset - cur_sec->offset;
-        if (distance <= 0)
-            distance += s->track_len_bc;
-        sec_sz = 128 << cur_sec->s.idam.no;
-        cur_size = 62 + sec_sz;
-        if ((distance -= cur_size * 16) < 0) {
-            trk_warn(ti, tracknr, "Overlapping sectors");
-            goto out;
-        }
-        gap_bits += distance;
-        nr_blocks++;
-        dat_bytes += sec_sz;
-    }
-
-    if (nr_blocks == 0)
-        goto out;
+    ibm_track = ibm_psectors_track(&ps, ti, tracknr, s, 62, &gap_bits);
+    if (ibm_track == NULL)
+        return NULL;
 
     ti->data_bitoff = 80 * 16;
-    ti->nr_sectors = nr_blocks;
-    set_all_sectors_valid(ti);
-
-    ibm_track = memalloc(sizeof(struct ibm_track)
-                         + nr_blocks * sizeof(struct ibm_sector)
-                         + dat_bytes);
-
-    ibm_track->has_iam = iam ? 1 : 0;
+    ibm_track->has_iam = ibm_scan_iam(s);
     ibm_track->post_data_gap = choose_post_data_gap(
-        ti, ibm_track, gap_bits, nr_blocks);
+        ti, ibm_track, gap_bits, ti->nr_sectors);
 
-    ti->len = sizeof(struct ibm_track);
-    for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
-        sec_sz = 128 << cur_sec->s.idam.no;
-        memcpy((char *)ibm_track + ti->len,
-               &cur_sec->s, sizeof(struct ibm_sector) + sec_sz);
-        ti->len += sizeof(struct ibm_sector) + sec_sz;
-    }
-
-out:
     return ibm_track;
 }
 
@@ -542,50 +638,129 @@ void setup_ibm_mfm_track(
     set_all_sectors_valid(ti);
 }
 
-void retrieve_ibm_mfm_track(
-    struct disk *d, unsigned int tracknr,
-    uint8_t **psec_map, uint8_t **pcyl_map,
-    uint8_t **phead_map, uint8_t **pno_map,
-    uint8_t **pmark_map, uint16_t **pcrc_map,
-    uint8_t **pdat)
+/* A sector view shared by a track and its copies, built by whichever first
+ * asks for it. */
+struct ibm_view_slot {
+    unsigned int refs;
+    struct ibm_sector_view *view;
+};
+
+static pthread_mutex_t ibm_view_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ibm_sector_view *ibm_sector_view_build(struct track_info *ti)
 {
-    struct track_info *ti = &d->di->track[tracknr];
     struct ibm_track *ibm_track = (struct ibm_track *)ti->dat;
+    struct ibm_sector_view *v;
     struct ibm_sector *cur_sec;
-    uint8_t *sec_map, *cyl_map, *head_map, *no_map, *mark_map, *dat;
-    uint16_t *crc_map;
-    unsigned int sec, sec_sz, dat_sz = 0;
+    unsigned int sec, sec_sz, nr = ti->nr_sectors, dat_sz = 0;
+    uint8_t *dat;
 
     cur_sec = ibm_track->secs;
-    for (sec = 0; sec < ti->nr_sectors; sec++) {
+    for (sec = 0; sec < nr; sec++) {
         sec_sz = 128u << cur_sec->idam.no;
         dat_sz += sec_sz;
         cur_sec = (struct ibm_sector *)
             ((char *)cur_sec + sizeof(struct ibm_sector) + sec_sz);
     }
 
-    *psec_map = sec_map = memalloc(ti->nr_sectors);
-    *pcyl_map = cyl_map = memalloc(ti->nr_sectors);
-    *phead_map = head_map = memalloc(ti->nr_sectors);
-    *pno_map = no_map = memalloc(ti->nr_sectors);
-    *pmark_map = mark_map = memalloc(ti->nr_sectors);
-    *pcrc_map = crc_map = memalloc(ti->nr_sectors * sizeof(uint16_t));
-    *pdat = dat = memalloc(dat_sz);
+    v = memalloc(sizeof(*v) + nr * (5 + sizeof(uint16_t)) + dat_sz);
+    v->nr_secs = nr;
+    v->crcs = (uint16_t *)(v + 1);
+    v->secs = (uint8_t *)&v->crcs[nr];
+    v->cyls = v->secs + nr;
+    v->heads = v->cyls + nr;
+    v->nos = v->heads + nr;
+    v->marks = v->nos + nr;
+    v->dat = dat = v->marks + nr;
 
     cur_sec = ibm_track->secs;
-    for (sec = 0; sec < ti->nr_sectors; sec++) { 
+    for (sec = 0; sec < nr; sec++) {
         sec_sz = 128u << cur_sec->idam.no;
-        cyl_map[sec] = cur_sec->idam.cyl;
-        head_map[sec] = cur_sec->idam.head;
-        sec_map[sec] = cur_sec->idam.sec;
-        no_map[sec] = cur_sec->idam.no;
-        mark_map[sec] = cur_sec->mark;
-        crc_map[sec] = cur_sec->crc;
+        v->cyls[sec] = cur_sec->idam.cyl;
+        v->heads[sec] = cur_sec->idam.head;
+        v->secs[sec] = cur_sec->idam.sec;
+        v->nos[sec] = cur_sec->idam.no;
+        v->marks[sec] = cur_sec->mark;
+        v->crcs[sec] = cur_sec->crc;
         memcpy(dat, cur_sec->dat, sec_sz);
         dat += sec_sz;
         cur_sec = (struct ibm_sector *)
             ((char *)cur_sec + sizeof(struct ibm_sector) + sec_sz);
     }
+
+    return v;
+}
+
+/* Called with ibm_view_lock held. */
+static struct ibm_view_slot *ibm_view_slot(
+    struct disk *d, unsigned int tracknr)
+{
+    struct ibm_view_slot *slot;
+
+    if (d->ibm_views == NULL)
+        d->ibm_views = memalloc(d->di->nr_tracks * sizeof(*d->ibm_views));
+    if ((slot = d->ibm_views[tracknr]) == NULL) {
+        slot = d->ibm_views[tracknr] = memalloc(sizeof(*slot));
+        slot->refs = 1;
+    }
+    return slot;
+}
+
+const struct ibm_sector_view *ibm_sector_view(
+    struct disk *d, unsigned int tracknr)
+{
+    struct ibm_view_slot *slot;
+    struct ibm_sector_view *v;
+
+    pthread_mutex_lock(&ibm_view_lock);
+    slot = ibm_view_slot(d, tracknr);
+    if (slot->view == NULL)
+        slot->view = ibm_sector_view_build(&d->di->track[tracknr]);
+    v = slot->view;
+    pthread_mutex_unlock(&ibm_view_lock);
+
+    return v;
+}
+
+void ibm_sector_view_copy(
+    struct disk *dst, struct disk *src, unsigned int tracknr)
+{
+    struct ibm_view_slot *slot;
+
+    pthread_mutex_lock(&ibm_view_lock);
+    slot = ibm_view_slot(src, tracknr);
+    slot->refs++;
+    if (dst->ibm_views == NULL)
+        dst->ibm_views = memalloc(
+            dst->di->nr_tracks * sizeof(*dst->ibm_views));
+    dst->ibm_views[tracknr] = slot;
+    pthread_mutex_unlock(&ibm_view_lock);
+}
+
+void ibm_sector_view_put(struct disk *d, unsigned int tracknr)
+{
+    struct ibm_view_slot *slot;
+
+    pthread_mutex_lock(&ibm_view_lock);
+    if ((d->ibm_views != NULL)
+        && ((slot = d->ibm_views[tracknr]) != NULL)) {
+        if (--slot->refs == 0) {
+            memfree(slot->view);
+            memfree(slot);
+        }
+        d->ibm_views[tracknr] = NULL;
+    }
+    pthread_mutex_unlock(&ibm_view_lock);
+}
+
+void ibm_sector_views_free(struct disk *d)
+{
+    unsigned int i;
+
+    for (i = 0; (d->ibm_views != NULL) && (i < d->di->nr_tracks); i++)
+        ibm_sector_view_put(d, i);
+    memfree(d->ibm_views);
+    d->ibm_views = NULL;
 }
 
 struct track_handler ibm_mfm_dd_handler = {
@@ -641,34 +816,68 @@ struct track_handler trs80_mfm_dd_recovery_handler = {
 #define DEC_RX02_MMFM_DAM_DAT 0xfd
 #define DEC_RX02_MMFM_DDAM_DAT 0xf9
 
+static uint16_t fm_sync(uint8_t dat, uint8_t clk)
+{
+    unsigned int i;
+    uint16_t sync = 0;
+    for (i = 0; i < 8; i++) {
+        sync <<= 2;
+        sync |= ((clk & 0x80) ? 2 : 0) | ((dat & 0x80) ? 1 : 0);
+        clk <<= 1; dat <<= 1;
+    }
+    return sync;
+}
+
+/* A mark: 0x00 then any data byte clocked by IBM_FM_SYNC_CLK. The mask
+ * selects the mark's clock bits. */
+#define IBM_FM_MARK_MASK 0xffffaaaau
+
+/* Find a mark at the current bitcell or within the next @max_scan-1. */
 static int ibm_fm_scan_mark(
     struct stream *s, unsigned int max_scan, uint8_t *pmark)
 {
-    int idx_off = -1;
+    const uint32_t sync = 0xaaaa0000 | fm_sync(0, IBM_FM_SYNC_CLK);
+    int idx_off;
 
-    do {
-        if (((s->word>>16) != 0xaaaa) ||
-            ((uint8_t)mfm_decode_word(s->word>>1) != IBM_FM_SYNC_CLK))
-            continue;
-        idx_off = s->index_offset_bc - 111;
-        if (idx_off < 0)
-            idx_off += s->track_len_bc;
-        *pmark = (uint8_t)mfm_decode_word(s->word);
-        stream_start_crc(s);
-        s->crc16_ccitt = crc16_ccitt(pmark, 1, 0xffff);
-        break;
-    } while ((stream_next_bit(s) != -1) && --max_scan);
+    if (((s->word & IBM_FM_MARK_MASK) != sync)
+        && ((max_scan <= 1)
+            || (stream_next_sync_mask(s, sync, IBM_FM_MARK_MASK,
+                                      max_scan - 1) == -1)))
+        return -1;
+
+    idx_off = s->index_offset_bc - 111;
+    if (idx_off < 0)
+        idx_off += s->track_len_bc;
+    *pmark = (uint8_t)mfm_decode_word(s->word);
+    stream_start_crc(s);
+    s->crc16_ccitt = crc16_ccitt(pmark, 1, 0xffff);
 
     return idx_off;
 }
 
+/* As ibm_scan_iam(). */
+static bool_t ibm_fm_scan_iam(struct stream *s)
+{
+    int seen = stream_seen_sync(s, 0xaaaa0000|IBM_FM_IAM_RAW, 0, 0);
+
+    if (seen > 0)
+        return 1;
+    if (seen < 0)
+        stream_reset(s);
+
+    return !stream_next_sync(s, 0xaaaa0000|IBM_FM_IAM_RAW, 32, ~0u);
+}
+
 static int ibm_fm_scan_idam(struct stream *s, struct ibm_idam *idam)
 {
+    uint32_t sync = 0xaaaa0000 | fm_sync(IBM_MARK_IDAM, IBM_FM_SYNC_CLK);
     uint8_t mark;
     int idx_off;
 
-    idx_off = ibm_fm_scan_mark(s, ~0u, &mark);
-    if ((idx_off < 0) || (mark != IBM_MARK_IDAM))
+    if ((s->word != sync) && (stream_next_sync(s, sync, 32, ~0u) == -1))
+        goto fail;
+    idx_off = ibm_fm_scan_mark(s, 1, &mark);
+    if (idx_off < 0)
         goto fail;
 
     /* cyl,head */
@@ -697,27 +906,19 @@ static void *ibm_fm_write_raw(
     struct disk *d, unsigned int tracknr, struct stream *s)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    struct ibm_psector *ibm_secs, *new_sec, *cur_sec, *next_sec, **pprev_sec;
+    struct ibm_psectors ps = { 0 };
     struct ibm_track *ibm_track = NULL;
-    unsigned int dat_bytes = 0, gap_bits, nr_blocks = 0;
-    unsigned int sec_sz;
-    bool_t iam = 0;
+    unsigned int gap_bits, sec_sz;
+    const bool_t recovery = is_recovery_type(ti->type);
+    const bool_t trs80 = is_trs80_track(ti->type);
 
     if (ti->type == TRKTYP_dec_rx02)
         stream_set_density(s, 2000u);
 
-    /* IAM */
-    while (!iam && (stream_next_bit(s) != -1))
-        iam = (s->word == (0xaaaa0000|IBM_FM_IAM_RAW));
-
-    stream_reset(s);
-
-    ibm_secs = NULL;
-
     while (stream_next_bit(s) != -1) {
 
         int idx_off;
-        uint8_t mark, dat[2*16384];
+        uint8_t mark, *dat, *p;
         uint16_t crc;
         struct ibm_idam idam;
 
@@ -731,7 +932,7 @@ static void *ibm_fm_write_raw(
         if (idam.crc) {
 #if CRC_DEBUG
             /* Warn if we are recovering */
-            if (is_recovery_type(ti->type)) {
+            if (recovery) {
                 trk_warn(ti, tracknr, "IDAM CRC cyl:%2d, head:%2d, sec:%2d, "
                          "no:%2d, crc:%04x, offset:%5d\n",
                          idam.cyl, idam.head, idam.sec,
@@ -752,6 +953,7 @@ static void *ibm_fm_write_raw(
         /* DAM/DDAM */
         if (ibm_fm_scan_mark(s, 1000, &mark) < 0)
             continue;
+        dat = ibm_psectors_raw(&ps, 2*(max(sec_sz, 256u)+2));
         if ((ti->type == TRKTYP_dec_rx02)
             && ((mark == DEC_RX02_MMFM_DAM_DAT)
                 || (mark == DEC_RX02_MMFM_DDAM_DAT))) {
@@ -779,7 +981,7 @@ static void *ibm_fm_write_raw(
             mfm_decode_bytes(bc_mfm, sec_sz+2, dat, dat);
             crc = crc16_ccitt(dat, sec_sz+2, crc);
         } else if ((mark == IBM_MARK_DAM) || (mark == IBM_MARK_DDAM)
-                   || is_trs80_mark(ti->type, mark)) {
+                   || is_trs80_mark(trs80, mark)) {
             if (stream_next_bytes(s, dat, 2*sec_sz) == -1)
                 continue;
             if (stream_next_bits(s, 32) == -1)
@@ -791,126 +993,26 @@ static void *ibm_fm_write_raw(
         }
 
         /* Skip bad data CRC unless we are doing data recovery. */
-        if (crc && !is_recovery_type(ti->type))
-            continue;
-
-        /* Find correct place for this sector in our linked list of sectors 
-         * that we have decoded so far. */
-        pprev_sec = &ibm_secs;
-        cur_sec = *pprev_sec;
-        while (cur_sec && ((idx_off - cur_sec->offset) >= 1000)) {
-            pprev_sec = &cur_sec->next;
-            cur_sec = *pprev_sec;
-        }
-
-        /* If this sector's start is within 1000 bits of one we already decoded
-         * then it is the same sector: we decoded it already on an earlier 
-         * revolution and can skip it this time round. */
-        if (cur_sec && (abs(idx_off - cur_sec->offset) < 1000)) {
-
-            /* Is this really the same sector? Check IDAM contents. */
-            if ((idam.cyl == cur_sec->s.idam.cyl) &&
-                (idam.head == cur_sec->s.idam.head) && 
-                (idam.sec == cur_sec->s.idam.sec) &&
-                (idam.no == cur_sec->s.idam.no)) {
-
-                /* If we now have a good CRC and the saved sector has a bad CRC
-                 * we should try converting it again. */
-                if (!crc && cur_sec->s.crc) {
-#ifdef CRC_DEBUG
-                    trk_warn(ti, tracknr, "FIXED CRC cyl:%2d, head:%2d, "
-                             "sec:%2d, no:%2d, size:%4x, offset:%5d\n",
-                             idam.cyl, idam.head, idam.sec, idam.no,
-                             sec_sz, idx_off);
-#endif
-
-                    /* Replace the previous bad sector header/data. */
-                    cur_sec->offset = idx_off;
-                    cur_sec->s.crc = crc;
-                    cur_sec->s.mark = mark;
-                    memcpy(&cur_sec->s.dat[0], dat, sec_sz);
-                    memcpy(&cur_sec->s.idam, &idam, sizeof(idam));
-                }
-
-            } else {
-
-                /* This code should NEVER trigger */
-                trk_warn(ti, tracknr, "IDAM  WARN"
-                         " [cyl:%2d, head:%2d, sec:%2d, no:%2d, "
-                         "crc:%04x, offset:%5d] != [cyl:%2d, head:%2d, "
-                         "sec:%2d, no:%2d, crc:%04x, offset:%5d]\n",
-                         idam.cyl, idam.head, idam.sec, idam.no,
-                         crc, idx_off,
-                         cur_sec->s.idam.cyl, cur_sec->s.idam.head,
-                         cur_sec->s.idam.sec, cur_sec->s.idam.no,
-                         cur_sec->s.idam.crc, cur_sec->offset);
-
-            }
-
+        if (crc && !recovery)
             continue;
-        }
 
-#ifdef CRC_DEBUG
-        if (crc) {
-            trk_warn(ti, tracknr, "DATA  CRC cyl:%2d, head:%2d, sec:%2d, "
-                     "no:%2d, crc:%04x, offset:%5d\n",
-                     idam.cyl, idam.head, idam.sec, idam.no, crc, idx_off);
+        /* Keep only sectors not already found on an earlier revolution. */
+        p = ibm_psectors_add(&ps, ti, tracknr, idx_off, &idam, mark, crc);
+        if (p != NULL) {
+            memcpy(p, dat, sec_sz);
+            stream_progress(s);
         }
-#endif
-
-        /* Add a new sector. */
-        new_sec = memalloc(sizeof(*new_sec) + sec_sz);
-        new_sec->offset = idx_off;
-        new_sec->s.crc = crc;
-        new_sec->s.mark = mark;
-        memcpy(&new_sec->s.dat[0], dat, sec_sz);
-        memcpy(&new_sec->s.idam, &idam, sizeof(idam));
-        /* Add the new sector to linked list */
-        new_sec->next = *pprev_sec;
-        *pprev_sec = new_sec;
     }
 
-    gap_bits = ti->total_bits - s->track_len_bc;
-    for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
-        int distance, cur_size;
-        next_sec = cur_sec->next ?: ibm_secs;
-        distance = next_sec->offset - cur_sec->offset;
-        if (distance <= 0)
-            distance += s->track_len_bc;
-        sec_sz = 128 << cur_sec->s.idam.no;
-        cur_size = 33 + sec_sz;
-        if ((distance -= cur_size * 16) < 0) {
-            trk_warn(ti, tracknr, "Overlapping sectors");
-            goto out;
-        }
-        gap_bits += distance;
-        nr_blocks++;
-        dat_bytes += sec_sz;
-    }
-
-    if (nr_blocks == 0)
+    ibm_track = ibm_psectors_track(&ps, ti, tracknr, s, 33, &gap_bits);
+    if (ibm_track == NULL)
         goto out;
 
     ti->data_bitoff = 40 * 16;
-    ti->nr_sectors = nr_blocks;
-    set_all_sectors_valid(ti);
-
-    ibm_track = memalloc(sizeof(struct ibm_track)
-                         + nr_blocks * sizeof(struct ibm_sector)
-                         + dat_bytes);
-
-    ibm_track->has_iam = iam ? 1 : 0;
+    ibm_track->has_iam = ibm_fm_scan_iam(s);
     ibm_track->post_data_gap = ((ti->type == TRKTYP_dec_rx01)
                        || (ti->type == TRKTYP_dec_rx02)) ? 27
-        : choose_post_data_gap(ti, ibm_track, gap_bits, nr_blocks);
-
-    ti->len = sizeof(struct ibm_track);
-    for (cur_sec = ibm_secs; cur_sec; cur_sec = cur_sec->next) {
-        sec_sz = 128 << cur_sec->s.idam.no;
-        memcpy((char *)ibm_track + ti->len,
-               &cur_sec->s, sizeof(struct ibm_sector) + sec_sz);
-        ti->len += sizeof(struct ibm_sector) + sec_sz;
-    }
+        : choose_post_data_gap(ti, ibm_track, gap_bits, ti->nr_sectors);
 
 out:
     if (ti->type == TRKTYP_dec_rx02)
@@ -920,48 +1022,50 @@ out:
 
 #define ENC_RAW      (1u<<0)
 #define ENC_HALFRATE (1u<<1)
-static void fm_bits(struct tbuf *tbuf, unsigned int flags,
-                    unsigned int bits, uint32_t x)
+/* Every caller passes constant @flags, so that each encoding variant is
+ * compiled without per-bit tests. The bitcells are gathered and emitted raw
+ * a word at a time, and the CRC is updated over the data bits alone. */
+static __always_inline void fm_bits(struct tbuf *tbuf, unsigned int flags,
+                                    unsigned int bits, uint32_t x)
 {
+    const unsigned int cell = (flags & ENC_HALFRATE) ? 2 : 1;
+    unsigned int n = 0, nr_dat = 0;
+    uint32_t dat = 0;
+    uint64_t w = 0;
+    uint16_t crc;
     int i;
 
     for (i = bits-1; i >= 0; i--) {
         uint8_t b = (x >> i) & 1;
-        if (!(flags & ENC_RAW) || !(i & 1))
-            tbuf->crc16_ccitt = crc16_ccitt_bit(b, tbuf->crc16_ccitt);
+        if (!(flags & ENC_RAW) || !(i & 1)) {
+            dat = (dat << 1) | b;
+            nr_dat++;
+        }
         if (!(flags & ENC_RAW)) {
-            if (flags & ENC_HALFRATE)
-                tbuf->bit(tbuf, SPEED_AVG, bc_raw, 0);
-            tbuf->bit(tbuf, SPEED_AVG, bc_raw, 1);
+            w = (w << cell) | 1;
+            n += cell;
         }
-        if (flags & ENC_HALFRATE)
-            tbuf->bit(tbuf, SPEED_AVG, bc_raw, 0);
-        tbuf->bit(tbuf, SPEED_AVG, bc_raw, b);
+        w = (w << cell) | b;
+        n += cell;
     }
-}
 
-static uint16_t fm_sync(uint8_t dat, uint8_t clk)
-{
-    unsigned int i;
-    uint16_t sync = 0;
-    for (i = 0; i < 8; i++) {
-        sync <<= 2;
-        sync |= ((clk & 0x80) ? 2 : 0) | ((dat & 0x80) ? 1 : 0);
-        clk <<= 1; dat <<= 1;
+    crc = crc16_ccitt_bits(dat, nr_dat, tbuf->crc16_ccitt);
+    if (n > 32) {
+        tbuf_bits(tbuf, SPEED_AVG, bc_raw, n - 32, w >> 32);
+        n = 32;
     }
-    return sync;
+    tbuf_bits(tbuf, SPEED_AVG, bc_raw, n, (uint32_t)w);
+    tbuf->crc16_ccitt = crc;
 }
 
-static void ibm_fm_read_raw(
-    struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
+static __always_inline void fm_read_raw(
+    struct disk *d, unsigned int tracknr, struct tbuf *tbuf,
+    const unsigned int flags)
 {
     struct track_info *ti = &d->di->track[tracknr];
     struct ibm_track *ibm_track = (struct ibm_track *)ti->dat;
     struct ibm_sector *cur_sec;
-    unsigned int sec, i, j, sec_sz, flags = 0;
-
-    if (ti->type == TRKTYP_dec_rx02)
-        flags |= ENC_HALFRATE;
+    unsigned int sec, i, j, sec_sz;
 
     /* IAM */
     if (ibm_track->has_iam) {
@@ -986,7 +1090,7 @@ static void ibm_fm_read_raw(
         fm_bits(tbuf, flags, 8, cur_sec->idam.cyl);
         fm_bits(tbuf, flags, 8, cur_sec->idam.head);
         fm_bits(tbuf, flags, 8, cur_sec->idam.sec);
-        fm_bits(tbuf, flags, 8, ((ti->type == TRKTYP_dec_rx02)
+        fm_bits(tbuf, flags, 8, ((flags & ENC_HALFRATE)
                                  ? 0 : cur_sec->idam.no));
         fm_bits(tbuf, flags, 16, tbuf->crc16_ccitt);
         for (i = 0; i < 11; i++)
@@ -1004,8 +1108,7 @@ static void ibm_fm_read_raw(
             uint16_t w16, mmfm[256+2+2], crc;
             uint32_t w32;
             crc = crc16_ccitt(cur_sec->dat, 256, tbuf->crc16_ccitt);
-            flags &= ~ENC_HALFRATE;
-            fm_bits(tbuf, flags|ENC_RAW, 1, 0); /* 1us of delay to next flux */
+            fm_bits(tbuf, ENC_RAW, 1, 0); /* 1us of delay to next flux */
             /* MMFM area: Data, CRC, lead-out. */
             memcpy(dat, cur_sec->dat, 256);
             dat[256+0] = crc >> 8; dat[256+1] = crc;
@@ -1034,8 +1137,7 @@ static void ibm_fm_read_raw(
                     mmfm[i-1] = w32 >> 16;
             }
             for (i = 0; i < sizeof(dat); i++)
-                fm_bits(tbuf, flags|ENC_RAW, 16, mmfm[i]);
-            flags |= ENC_HALFRATE;
+                fm_bits(tbuf, ENC_RAW, 16, mmfm[i]);
         } else {
             for (i = 0; i < sec_sz; i++)
                 fm_bits(tbuf, flags, 8, cur_sec->dat[i]);
@@ -1049,6 +1151,15 @@ static void ibm_fm_read_raw(
     }
 }
 
+static void ibm_fm_read_raw(
+    struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
+{
+    if (d->di->track[tracknr].type == TRKTYP_dec_rx02)
+        fm_read_raw(d, tracknr, tbuf, ENC_HALFRATE);
+    else
+        fm_read_raw(d, tracknr, tbuf, 0);
+}
+
 struct track_handler ibm_fm_sd_handler = {
     .density = trkden_single,
     .get_name = ibm_get_name,
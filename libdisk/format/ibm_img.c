@@ -20,25 +20,13 @@ static void *ibm_img_write_raw(
     struct track_info *ti = &d->di->track[tracknr];
     struct ibm_extra_data *extra_data = handlers[ti->type]->extra_data;
     char *block = memalloc(ti->len + 1);
+    uint8_t *dat = memalloc(2*ti->bytes_per_sector);
     unsigned int nr_valid_blocks = 0;
-    bool_t iam = 0;
-
-    /* IAM */
-    while (!iam && (stream_next_bit(s) != -1)) {
-        if (s->word != 0x52245224)
-            continue;
-        if (stream_next_bits(s, 32) == -1)
-            break;
-        iam = (s->word == 0x52245552);
-    }
-
-    stream_reset(s);
 
     while ((stream_next_bit(s) != -1) &&
            (nr_valid_blocks != ti->nr_sectors)) {
 
         int idx_off, sec_sz;
-        uint8_t dat[2*16384];
         struct ibm_idam idam;
 
         /* IDAM */
@@ -84,12 +72,14 @@ static void *ibm_img_write_raw(
         nr_valid_blocks++;
     }
 
+    memfree(dat);
+
     if (nr_valid_blocks == 0) {
         memfree(block);
         return NULL;
     }
 
-    block[ti->len++] = iam;
+    block[ti->len++] = ibm_scan_iam(s);
     ti->data_bitoff = 0;
 
     return block;
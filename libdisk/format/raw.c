@@ -11,16 +11,60 @@
 
 #define MAX_BYTES 100000u
 
+/* Track data comes in one of two layouts, both in host byte order:
+ *  Per byte:  uint16_t speed[nr_bytes]; uint8_t dat[nr_bytes];
+ *  Runs:      struct raw_runs; uint8_t dat[nr_bytes];
+ * Runs are told apart by their first halfword, which is never a speed. Both
+ * give every byte the same speed; the per-byte layout is kept where runs
+ * would be larger, and is also built by other containers (e.g., IPF). DSK
+ * images holding raw tracks are version 1, as older readers know only the
+ * per-byte layout. */
+#define RAW_RUNS_MAGIC 0xffffu
+struct raw_runs {
+    uint16_t magic, pad;
+    uint32_t nr_runs;
+    struct raw_run {
+        uint16_t speed, nr_bytes;
+    } run[0];
+};
+
+/* Split per-byte @speed[] into runs of equal speed. Returns the number of
+ * runs, or 0 if there are too many for runs to be the smaller layout. */
+static unsigned int speed_runs(
+    const uint16_t *speed, unsigned int bytes, struct raw_run *run)
+{
+    unsigned int i, j, nr_runs = 0, max_runs;
+
+    if (2 * bytes <= sizeof(struct raw_runs))
+        return 0;
+    max_runs = (2 * bytes - sizeof(struct raw_runs)) / sizeof(*run);
+    for (i = 0; i < bytes; i = j) {
+        if (nr_runs == max_runs)
+            return 0;
+        for (j = i + 1; (j < bytes) && (j - i < 0xffff)
+                 && (speed[j] == speed[i]); j++)
+            continue;
+        run[nr_runs].speed = speed[i];
+        run[nr_runs].nr_bytes = j - i;
+        nr_runs++;
+    }
+
+    return nr_runs;
+}
+
 static void *raw_write_raw(
     struct disk *d, unsigned int tracknr, struct stream *s)
 {
     struct disk_info *di = d->di;
     struct track_info *ti = &di->track[tracknr];
-    char *dat = memalloc(MAX_BYTES);
-    uint16_t *block = NULL, *block_p;
-    uint32_t av_latency, *speed = memalloc(4 * MAX_BYTES);
-    uint64_t tot_latency;
-    unsigned int bytes, i;
+    char *dat = track_scratch(MAX_BYTES);
+    uint16_t *speed = track_scratch(sizeof(*speed) * MAX_BYTES);
+    uint32_t *latency = track_scratch(sizeof(*latency) * MAX_BYTES);
+    struct raw_run *run = track_scratch(sizeof(*run) * MAX_BYTES);
+    struct raw_runs *hdr;
+    uint16_t *block;
+    uint64_t av_latency, tot_latency;
+    unsigned int bytes, i, nr_runs;
 
     tot_latency = 0;
     bytes = 0;
@@ -28,43 +72,78 @@ static void *raw_write_raw(
     do {
         s->latency = 0;
         if ((stream_next_bits(s, 8) == -1) || (bytes == MAX_BYTES))
-            goto out;
+            return NULL;
         dat[bytes] = (uint8_t)s->word;
-        speed[bytes] = (uint32_t)s->latency;
+        latency[bytes] = (uint32_t)s->latency;
         tot_latency += s->latency;
         bytes++;
     } while (s->index_offset_bc >= 8);
 
-    av_latency = tot_latency / bytes;
+    av_latency = tot_latency / bytes ?: 1;
     for (i = 0; i < bytes; i++)
-        speed[i] = ((uint64_t)speed[i]*SPEED_AVG + av_latency/2) / av_latency;
+        speed[i] = ((uint64_t)latency[i]*SPEED_AVG + av_latency/2)
+            / av_latency;
 
     ti->total_bits = bytes*8 - s->index_offset_bc;
-    ti->len = bytes * 3; /* 2 bytes of speed per 1 byte of dat */
     ti->data_bitoff = 0;
 
-    /* Marshal the descriptor block: speeds then data. */
-    block = block_p = memalloc(ti->len);
-    for (i = 0; i < bytes; i++)
-        *block_p++ = speed[i];
-    memcpy(block_p, dat, bytes);
-
-out:
-    memfree(dat);
-    memfree(speed);
-    return block;
+    /* Runs reproduce the per-byte speeds exactly: store whichever layout is
+     * the smaller. */
+    if ((nr_runs = speed_runs(speed, bytes, run)) == 0) {
+        ti->len = bytes * 3;
+        block = memalloc_nz(ti->len);
+        memcpy(block, speed, bytes * sizeof(*speed));
+        memcpy(&block[bytes], dat, bytes);
+        return block;
+    }
+
+    ti->len = sizeof(*hdr) + nr_runs * sizeof(*run) + bytes;
+    hdr = memalloc_nz(ti->len);
+    hdr->magic = RAW_RUNS_MAGIC;
+    hdr->pad = 0;
+    hdr->nr_runs = nr_runs;
+    memcpy(hdr->run, run, nr_runs * sizeof(*run));
+    memcpy(&hdr->run[nr_runs], dat, bytes);
+
+    return hdr;
 }
 
 static void raw_read_raw(
     struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
 {
     struct track_info *ti = &d->di->track[tracknr];
-    uint16_t *speed = (uint16_t *)ti->dat;
-    uint8_t *dat = (uint8_t *)(speed + (ti->total_bits+7)/8);
-    unsigned int i;
+    struct raw_runs *hdr = (struct raw_runs *)ti->dat;
+    unsigned int i, j, nr, nr_bytes = ti->total_bits/8;
+    uint16_t *speed;
+    uint8_t *dat;
+
+    if (hdr->magic == RAW_RUNS_MAGIC) {
+        dat = (uint8_t *)&hdr->run[hdr->nr_runs];
+        for (i = j = 0; (i < hdr->nr_runs) && (j < nr_bytes); i++) {
+            nr = min_t(unsigned int, hdr->run[i].nr_bytes, nr_bytes - j);
+            tbuf_bytes(tbuf, hdr->run[i].speed, bc_raw, nr, &dat[j]);
+            j += nr;
+        }
+        if (ti->total_bits%8)
+            tbuf_bits(tbuf, hdr->run[hdr->nr_runs-1].speed, bc_raw,
+                      ti->total_bits%8, dat[j] >> (8 - ti->total_bits%8));
+        return;
+    }
 
-    for (i = 0; i < ti->total_bits/8; i++)
-        tbuf_bits(tbuf, speed[i], bc_raw, 8, dat[i]);
+    speed = (uint16_t *)ti->dat;
+    dat = (uint8_t *)(speed + (ti->total_bits+7)/8);
+
+    /* Weak bytes read differently every time. Else emit runs of a speed. */
+    for (i = 0; i < nr_bytes; i = j) {
+        if (speed[i] == SPEED_WEAK) {
+            tbuf_weak(tbuf, 4);
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; (j < nr_bytes) && (speed[j] == speed[i]); j++)
+            continue;
+        tbuf_bytes(tbuf, speed[i], bc_raw, j - i, &dat[i]);
+    }
     if (ti->total_bits%8)
         tbuf_bits(tbuf, speed[i], bc_raw, ti->total_bits%8,
                   dat[i] >> (8 - ti->total_bits%8));
@@ -94,27 +173,37 @@ struct track_handler raw_ed_handler = {
     .read_raw = raw_read_raw
 };
 
-void setup_uniform_raw_track(
+uint8_t *setup_uniform_raw_track(
     struct disk *d, unsigned int tracknr,
     enum track_type type, unsigned int nr_bits,
-    uint8_t *raw_dat)
+    const uint8_t *raw_dat)
 {
     struct track_info *ti = &d->di->track[tracknr];
     unsigned int i, nr_bytes = (nr_bits + 7) / 8;
-    uint16_t *speed;
+    unsigned int nr_runs = (nr_bytes + 0xfffe) / 0xffff;
+    struct raw_runs *hdr;
+    uint8_t *dat;
 
     init_track_info(ti, type);
 
-    ti->len = nr_bytes * 3;
+    ti->len = sizeof(*hdr) + nr_runs * sizeof(hdr->run[0]) + nr_bytes;
     ti->total_bits = nr_bits;
     ti->data_bitoff = 0;
     ti->dat = memalloc(ti->len);
 
-    speed = (uint16_t *)ti->dat;
-    for (i = 0; i < nr_bytes; i++)
-        *speed++ = SPEED_AVG;
-
-    memcpy(speed, raw_dat, nr_bytes);
+    hdr = (struct raw_runs *)ti->dat;
+    hdr->magic = RAW_RUNS_MAGIC;
+    hdr->nr_runs = nr_runs;
+    for (i = 0; i < nr_runs; i++) {
+        hdr->run[i].speed = SPEED_AVG;
+        hdr->run[i].nr_bytes = min_t(unsigned int, nr_bytes - i*0xffff,
+                                     0xffff);
+    }
+
+    dat = (uint8_t *)&hdr->run[nr_runs];
+    if (raw_dat != NULL)
+        memcpy(dat, raw_dat, nr_bytes);
+    return dat;
 }
 
 /*
@@ -20,7 +20,13 @@ static void *unformatted_write_raw(
     struct track_info *ti = &di->track[tracknr];
     unsigned int scan_bits = 0, bad = 0, nr_zero = 0;
     unsigned int lat = s->latency, clk = s->clock;
-    unsigned int bad_sectors = 0, nr_sectors = 0;
+    uint32_t bad_sectors = 0;
+    int nr_sectors;
+
+    /* Classify the raw flux if we can. Else run it through the PLL. */
+    if ((nr_sectors = stream_flux_noise(s, &bad_sectors)) >= 0)
+        goto done;
+    nr_sectors = 0;
 
     /* Scan for bit sequences that break the MFM encoding rules.
      * Random noise will obviously do this a *lot*. */
@@ -47,6 +53,7 @@ static void *unformatted_write_raw(
         }
     }
 
+done:
     if (bad_sectors < nr_sectors) {
         unsigned int pc = (bad_sectors*1000)/nr_sectors;
         if ((pc/10) <= 90)
@@ -63,21 +70,24 @@ static void *unformatted_write_raw(
 static void unformatted_read_raw(
     struct disk *d, unsigned int tracknr, struct tbuf *tbuf)
 {
-    unsigned int i;
+    unsigned int i, j;
     int speed_delta = 200;
-    uint8_t byte = 0;
+    uint16_t rnd[8];
+    uint8_t byte;
     uint32_t bitlen = 96000 + (tbuf_rnd16(tbuf) & 1023) - 512;
 
     tbuf_init(tbuf, 0, bitlen);
 
-    for (i = 0; i < bitlen; i++) {
-        byte <<= 1;
-        byte |= !(tbuf_rnd16(tbuf) & 3);
-        if ((i & 7) == 7) {
-            tbuf_bits(tbuf, SPEED_AVG + speed_delta, bc_raw, 8, byte);
-            speed_delta = -speed_delta;
-        }
+    for (i = 0; i < bitlen/8; i++) {
+        tbuf_rnd16_bulk(tbuf, rnd, 8);
+        for (j = byte = 0; j < 8; j++)
+            byte = (byte << 1) | !(rnd[j] & 3);
+        tbuf_bits(tbuf, SPEED_AVG + speed_delta, bc_raw, 8, byte);
+        speed_delta = -speed_delta;
     }
+
+    /* Draw for the trailing partial byte, which is not written. */
+    tbuf_rnd16_bulk(tbuf, rnd, bitlen & 7);
 }
 
 struct track_handler unformatted_handler = {
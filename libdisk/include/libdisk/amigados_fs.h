@@ -0,0 +1,98 @@
+/*
+ * libdisk/amigados_fs.h
+ *
+ * Read-only access to AmigaDOS (OFS/FFS) filesystems, either on an in-memory
+ * ADF image or on the AmigaDOS tracks of a libdisk disk.
+ *
+ * There is no global state: distinct filesystem instances may be used
+ * concurrently from different threads.
+ */
+
+#ifndef __LIBDISK_AMIGADOS_FS_H__
+#define __LIBDISK_AMIGADOS_FS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct disk;
+struct ados_fs;
+
+#define ADOS_BLOCK_SIZE 512
+#define ADOS_NAME_LEN   30
+
+enum ados_type { ADOS_DIR, ADOS_FILE };
+
+struct ados_entry {
+    uint32_t block;          /* header block number */
+    enum ados_type type;
+    uint32_t size;           /* in bytes; 0 for a directory */
+    uint32_t protection;
+    time_t mtime;
+    char name[ADOS_NAME_LEN + 1];
+};
+
+struct ados_volume {
+    char name[ADOS_NAME_LEN + 1];
+    int is_ffs, is_intl;
+    time_t created, altered;
+};
+
+#pragma GCC visibility push(default)
+
+/* Open the filesystem on an ADF image of @len bytes at @dat, which must stay
+ * valid, and unchanged, until ados_fs_close(). */
+struct ados_fs *ados_fs_open_image(const void *dat, size_t len);
+
+/* Open the filesystem on @d's tracks, read via track_read_sectors(). Blocks
+ * on tracks or sectors that did not decode read as errors. @d may be closed
+ * once this returns. */
+struct ados_fs *ados_fs_open_disk(struct disk *d);
+
+void ados_fs_close(struct ados_fs *);
+
+/* Functions below return 0 on success, or -1 if the filesystem is damaged:
+ * ados_fs_error() then describes the problem. */
+
+int ados_fs_get_volume(struct ados_fs *, struct ados_volume *);
+
+/* The root directory, named after the volume. */
+int ados_fs_root(struct ados_fs *, struct ados_entry *);
+
+/* Look up a '/'-separated @path, relative to the root. Names are matched
+ * case-insensitively, as AmigaDOS does. Returns -1 with errno set to ENOENT
+ * if there is no such entry. */
+int ados_fs_lookup(struct ados_fs *, const char *path, struct ados_entry *);
+
+/* Call @fn(@opaque, entry) for each entry of directory @dir, in hash table
+ * order. A non-zero return from @fn stops the walk and is returned. */
+int ados_fs_read_dir(
+    struct ados_fs *, const struct ados_entry *dir,
+    int (*fn)(void *opaque, const struct ados_entry *), void *opaque);
+
+/* Copy the contents of @file (file->size bytes) to @buf. */
+int ados_fs_read_file(
+    struct ados_fs *, const struct ados_entry *file, void *buf);
+
+/* Returns 1 if @block is marked free in the allocation bitmap, 0 if it is in
+ * use, or -1 if the bitmap is missing or damaged. */
+int ados_fs_block_is_free(struct ados_fs *, unsigned int block);
+
+/* Number of free blocks, or -1 as for ados_fs_block_is_free(). */
+int ados_fs_nr_free_blocks(struct ados_fs *);
+
+const char *ados_fs_error(struct ados_fs *);
+
+#pragma GCC visibility pop
+
+#endif /* __LIBDISK_AMIGADOS_FS_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -3,6 +3,10 @@
  * 
  * Custom disk layouts -- container format and handlers.
  * 
+ * Distinct disk and stream instances may be used concurrently from different
+ * threads. A single instance must not be, except that handlers analysing
+ * different tracks of the same disk may run in parallel (see disk tags).
+ * 
  * Written in 2011 by Keir Fraser
  */
 
@@ -10,6 +14,7 @@
 #define __LIBDISK_DISK_H__
 
 #include <stdint.h>
+#include <libdisk/util.h>
 
 #define TRK_WEAK  (~0u)
 
@@ -20,9 +25,11 @@ enum track_type {
 };
 
 struct track_info {
+    /* Fields scanned across every track come first, packed together, and
+     * pointers last, so that an entry is 48 bytes rather than 56. */
+
     /* Enumeration */
     uint16_t type;
-    const char *typename;
 
     uint16_t flags;
 
@@ -31,8 +38,7 @@ struct track_info {
     uint8_t  nr_sectors;
     uint8_t valid_sectors[8]; /* bitmap of valid sectors */
 
-    /* Pointer and length of type-specific track data. */
-    uint8_t *dat;
+    /* Length of type-specific track data (see dat). */
     uint32_t len;
 
     /* Offset from track index of raw data returned by type handler.
@@ -47,6 +53,11 @@ struct track_info {
      * revolutions of the disk -- data and length may change due to 'flakey
      * bits' which confuse the disk controller. */
     uint32_t total_bits;
+
+    const char *typename;
+
+    /* Type-specific track data. */
+    uint8_t *dat;
 };
 
 struct disktag {
@@ -66,6 +77,16 @@ struct disktag_disk_nr {
     uint32_t disk_nr;
 };
 
+/* The LFSR longword after the signature in sector 6 of the first Copylock
+ * track decoded. Loaders commonly take this as their key, but it is not
+ * checked against any loader: only emulating the routine gives its key. */
+#define DSKTAG_copylock_key 3
+struct disktag_copylock_key {
+    struct disktag tag;
+    uint32_t key;
+    uint32_t tracknr;
+};
+
 #define DSKTAG_end 0xffffu
 
 struct disk_info {
@@ -84,10 +105,69 @@ struct stream;
 #define DISKFL_rpm_shift     2
 #define DISKFL_rpm(rpm)      ((rpm)<<DISKFL_rpm_shift)
 
+/* With DISKFL_read_only, disk_create() makes a scratch disk in memory: @name
+ * selects the container type only, and nothing is ever written. */
 struct disk *disk_create(const char *name, unsigned int flags);
 struct disk *disk_open(const char *name, unsigned int flags);
+/* Create a disk in a container of @type, named by its file suffix (e.g.,
+ * "scp"), whose image is written by disk_close() elsewhere than a named file:
+ *  _fd:     to @fd, which is left open. It need not be seekable (a pipe or
+ *           socket), in which case the image is written strictly in order.
+ *  _mem:    to memory, returned in *@pdat and *@plen, to be freed by the
+ *           caller with memfree().
+ *  _writer: in order, by calls to @write, which returns non-zero on failure.
+ * Every container type can be written to each. */
+struct disk *disk_create_fd(const char *type, int fd, unsigned int flags);
+struct disk *disk_create_mem(
+    const char *type, void **pdat, size_t *plen, unsigned int flags);
+struct disk *disk_create_writer(
+    const char *type, int (*write)(void *opaque, const void *dat, size_t len),
+    void *opaque, unsigned int flags);
+/* Create a new container file @name holding a copy of @src's tracks and
+ * tags, without re-analysing them. It is written out by disk_close(). */
+struct disk *disk_create_copy(
+    struct disk *src, const char *name, unsigned int flags);
 void disk_close(struct disk *);
+/* Containers which update an opened image in place on close, rather than
+ * rewriting it (DSK), leave dead space behind replaced track data. Have
+ * disk_close() instead rewrite @d's image in full, reclaiming the space. */
+void disk_compact(struct disk *d);
+
+/* Bound the track data held in memory for @d to about @bytes (0 for no
+ * bound). Data of settled tracks beyond the bound is spilled to a temporary
+ * file, and read back when libdisk next needs it, at the latest by
+ * disk_close(). */
+void disk_set_mem_budget(struct disk *d, uint64_t bytes);
+/* Hold the data of settled tracks of @d compressed in memory, where that
+ * makes it smaller. It is decompressed when libdisk next needs it, at the
+ * latest by disk_close(). */
+void disk_set_mem_compress(struct disk *d, bool_t compress);
+/* The caller has finished with track @tracknr for now. Its data may now be
+ * shared with any settled track of identical data, and must not be modified
+ * in place; and it may be compressed, or spilled under a memory budget,
+ * leaving ti->dat NULL. */
+void track_settle(struct disk *d, unsigned int tracknr);
+
+/* Replace track @tracknr of @dst with a copy of the same track of @src. Its
+ * data may be shared with identical tracks of @dst, as by track_settle(). */
+void track_copy(struct disk *dst, struct disk *src, unsigned int tracknr);
+
+/* Fixed properties of a track format. */
+struct track_format {
+    const char *id_name;
+    const char *desc_name;
+#define TRKFMT_raw            (1u<<0) /* raw_*: accepts any track */
+#define TRKFMT_variant        (1u<<1) /* refines format @parent */
+#define TRKFMT_single_density (1u<<2)
+#define TRKFMT_high_density   (1u<<3)
+#define TRKFMT_extra_density  (1u<<4) /* else double density */
+    uint16_t flags;
+    uint16_t parent; /* the format itself, unless a variant */
+};
 
+/* NULL (or -1) if there is no such format. */
+const struct track_format *disk_get_format(enum track_type type);
+int disk_get_format_by_id_name(const char *name);
 const char *disk_get_format_id_name(enum track_type type);
 const char *disk_get_format_desc_name(enum track_type type);
 
@@ -109,10 +189,26 @@ struct disktag *disk_set_tag(
 /* Weak bits. Regions of weak bits are timed at SPEED_AVG. */
 #define SPEED_WEAK 0xfffeu
 
+/* A run of bitcells of equal speed, extending to the start of the next run,
+ * or to the end of the track. */
+struct track_speed_run {
+    uint32_t start;
+    uint16_t speed;
+};
+
+/* A region of weak bits: @bits random data bits, MFM-encoded as twice as many
+ * bitcells from @start. If @clk_after, the clock bitcell which follows the
+ * region was encoded from its final data bit. */
+struct track_weak_run {
+    uint32_t start, bits;
+    bool_t clk_after;
+};
+
 struct track_raw {
     /* Index-aligned bitcells. bitcell[i] = bits[i/8] >> -(i-7). */
     uint8_t *bits;
-    /* Index-aligned per-bitcell speed, relative to SPEED_AVG. */
+    /* Index-aligned per-bitcell speed, relative to SPEED_AVG. NULL until
+     * built on demand by track_raw_speed(). */
     uint16_t *speed;
     /* Number of bitcells in this track. */
     uint32_t bitlen;
@@ -122,16 +218,103 @@ struct track_raw {
     uint32_t write_splice_bc;
     /* Any weak/random bits in this track? */
     uint8_t has_weak_bits;
+    /* Per-bitcell speed, as runs in bitcell order. The first starts at 0. */
+    struct track_speed_run *speed_runs;
+    uint32_t nr_speed_runs;
+    /* Weak regions, in the order they were generated. Set only if they are
+     * all the randomness in the track: the other bitcells are then stable,
+     * and the track can be re-read by track_raw_regen_weak(). */
+    struct track_weak_run *weak_runs;
+    uint32_t nr_weak_runs;
 };
 struct track_raw *track_alloc_raw_buffer(struct disk *d);
 void track_free_raw_buffer(struct track_raw *);
 void track_purge_raw_buffer(struct track_raw *);
 void track_read_raw(struct track_raw *, unsigned int tracknr);
+/* Re-read a track which has weak_runs, by generating new weak bits in place.
+ * The result is as track_read_raw() of the same track would produce. */
+void track_raw_regen_weak(struct track_raw *);
+/* Speed of bitcell @bc. *@run carries the containing run's index from one
+ * call to the next, so that walking the track in order is cheap. Start it
+ * at zero. */
+uint16_t track_raw_speed_at(
+    const struct track_raw *, uint32_t bc, uint32_t *run);
+/* Per-bitcell speed array, expanded from the runs on first use. */
+uint16_t *track_raw_speed(struct track_raw *);
+/* Rotation of @b at which its bitcells best match those of @a: bitcell i of
+ * @a lines up with bitcell (i + *@rot) % b->bitlen of @b. Returns how many of
+ * the shorter track's bitcells then differ. If @diff is non-NULL, *@diff is
+ * set to a mask of them, packed as the tracks' bits, to be freed with
+ * memfree(). */
+uint32_t track_raw_align(const struct track_raw *a, const struct track_raw *b,
+                         uint32_t *rot, uint8_t **diff);
+/* Flux for one revolution of a track, as written to SCP images: big-endian
+ * samples of 25ns ticks, with long gaps filled by weak-bit patterns. Returns
+ * *@nr_samples samples, to be freed with memfree(), and their sum in ticks in
+ * *@duration. */
+uint16_t *track_raw_scp_flux(
+    struct track_raw *, uint32_t *nr_samples, uint32_t *duration);
 int track_write_raw(
     struct track_raw *, unsigned int tracknr, enum track_type,
     unsigned int rpm);
 int track_write_raw_from_stream(
     struct disk *, unsigned int tracknr, enum track_type, struct stream *s);
+/* Try the @nr track types @types[] on @tracknr in turn, from @types[@start]
+ * and wrapping around, as successive track_write_raw_from_stream() calls
+ * would. A type whose density the track's flux rules out is skipped without
+ * a handler pass, and the flux is checked once per density. With @match
+ * NULL, stops at the first type which matches. Else calls @match(@arg, i)
+ * each time @types[i] matches, while the track holds its result, and stops
+ * once it returns 0. Returns the index in @types of the last match, else -1.
+ * The track is left as written by the last type tried. */
+int track_write_raw_from_stream_any(
+    struct disk *, unsigned int tracknr, const uint16_t *types,
+    unsigned int nr, unsigned int start, struct stream *s,
+    int (*match)(void *arg, unsigned int i), void *arg);
+
+/* Per-format statistics of track_write_raw_from_stream() calls, gathered in
+ * a table across the disks it is set on (see disk_set_stats()). A call
+ * matches if it returns 0. */
+struct track_stats {
+    uint64_t calls, matches;
+    uint64_t bitcells; /* read from the stream */
+    uint64_t nsecs;
+};
+struct track_stats_table *track_stats_alloc(void);
+void track_stats_free(struct track_stats_table *);
+/* Returns -1 if @type is not a valid track type. */
+int track_get_stats(struct track_stats_table *, enum track_type type,
+                    struct track_stats *stats);
+/* Gather statistics of @d's analysis into @table, or stop if NULL. */
+void disk_set_stats(struct disk *d, struct track_stats_table *table);
+
+/* Record spans of libdisk work (stream track selection and rewinds, format
+ * analysis, bitcell generation, container writeback) to @path as Chrome
+ * trace-event JSON, until trace_close(). Spans are recorded for the disks
+ * and streams the trace is set on (disk_set_trace(), and s->trace), which
+ * must be closed first. Returns NULL if @path cannot be created. */
+struct trace *trace_open(const char *path);
+void trace_close(struct trace *);
+void disk_set_trace(struct disk *d, struct trace *trace);
+
+/* Progress events, for monitoring a run as it goes: one NDJSON line as it
+ * starts, as each of its @nr_tracks tracks is done, and as it ends, appended
+ * to @path ("-" is stderr; a Unix socket is connected to) until
+ * progress_close(). Every event is labelled with @tool and @name (e.g., the
+ * image). Returns NULL if @path cannot be opened. */
+struct progress *progress_open(const char *path, const char *tool,
+                               const char *name, unsigned int nr_tracks);
+/* Track @tracknr is done, having taken @nsecs, read @bytes from the drive,
+ * and taken in @flux flux samples and decoded @bitcells bitcells (each 0 if
+ * not applicable). May be called from several threads. Does nothing if @p
+ * is NULL. */
+void progress_track(struct progress *p, unsigned int tracknr, uint64_t nsecs,
+                    uint64_t bytes, uint64_t flux, uint64_t bitcells);
+void progress_close(struct progress *p);
+
+/* Maximum threads @d's container may use to encode tracks as it is written
+ * out by disk_close(). The default is 1. */
+void disk_set_jobs(struct disk *d, unsigned int nr);
 
 struct track_sectors {
     uint8_t *data;
@@ -148,6 +331,13 @@ void track_mark_unformatted(
     struct disk *, unsigned int tracknr);
 
 int is_valid_sector(struct track_info *, unsigned int sector);
+/* Whole-bitmap queries. next_{valid,invalid}_sector() return the first
+ * matching sector at or after @sector, or nr_sectors if there is none. */
+unsigned int nr_valid_sectors(const struct track_info *);
+unsigned int next_valid_sector(
+    const struct track_info *, unsigned int sector);
+unsigned int next_invalid_sector(
+    const struct track_info *, unsigned int sector);
 void set_sector_valid(struct track_info *, unsigned int sector);
 void set_sector_invalid(struct track_info *, unsigned int sector);
 void set_all_sectors_valid(struct track_info *ti);
@@ -12,6 +12,28 @@
 #include <stdint.h>
 #include <libdisk/util.h>
 
+/* Lock quality of the PLL over one revolution of a flux-based track. A flux
+ * transition's phase error is its distance from the centre of the timing
+ * window of the bitcell in which it falls. */
+#define STREAM_PLL_REVS 8
+struct stream_pll_rev {
+    uint32_t nr_flux;       /* flux transitions */
+    uint32_t phase_err;     /* sum of |phase error|, ns */
+    uint32_t max_phase_err; /* ns */
+    /* Flux transitions by |phase error|, in eighths of a bitcell: [0,1/8),
+     * [1/8,1/4), [1/4,3/8), [3/8,1/2]. */
+    uint32_t phase_hist[4];
+    uint32_t resyncs;       /* transitions after more than 3 zeros, out of
+                             * sync, which pull the clock back to centre */
+    uint32_t clamps;        /* clock adjustments held at the range limit */
+    uint32_t max_drift;     /* of the clock from clock_centre, ns */
+};
+/* rev[0] runs to the first index pulse; rev[r] from pulse r to the next.
+ * Later revolutions are not counted. */
+struct stream_pll_stats {
+    struct stream_pll_rev rev[STREAM_PLL_REVS];
+};
+
 struct stream {
     const struct stream_type *type;
 
@@ -22,22 +44,62 @@ struct stream {
     uint32_t index_offset_bc; /* offset in bitcells (=N) */
     uint32_t index_offset_ns; /* offset in nanoseconds */
 
+    /* Bitcells read since the stream was opened, less index_offset_bc. The
+     * sum is maintained without per-bitcell work: this is rebased whenever
+     * index_offset_bc is reset. */
+    int64_t bc_read_base;
+
     /* Distance between the most recent two index pulses. */
     uint32_t track_len_bc; /* in bitcells */
     uint32_t track_len_ns; /* in nanoseconds */
 
+    /* Distance between the first two index pulses since stream_reset(), or 0
+     * if not yet seen (or the density has since changed). */
+    uint32_t rev_len_bc;
+
+    /* Flux intervals taken in from the stream type since it was opened. */
+    uint64_t nr_flux;
+
+    /* Shortest common flux interval on the current track, in nanoseconds,
+     * from a histogram taken when the track is selected. 0 if the flux does
+     * not fit a regular bitcell clock. @flux_mfm is set if there is also a
+     * peak at 1.5x, so that the shortest interval is two bitcells. */
+    uint32_t flux_min_ns;
+    bool_t   flux_mfm;
+
     /* Number of index pulses seen so far. */
     uint32_t nr_index;
 
     /* Maximum number of full revolutions to read. */
     uint32_t max_revolutions;
 
+    /* No-progress cutoff, in full revolutions (0 = none). A handler's attempt
+     * at a track ends once this many pass without it finding a new valid
+     * sector. Handlers of a single block find none until they succeed, so
+     * have their own bound. */
+    uint32_t idle_revs_sectored, idle_revs_track;
+    /* The cutoff in force for the current attempt (set by libdisk), and
+     * nr_index at the attempt's most recent progress. */
+    uint32_t idle_revolutions, progress_index;
+
+    /* Bound, in bytes, on the current track's flux buffer and recorded
+     * bitcell passes (0 = unbounded). Passes which would exceed it are
+     * decoded live from the flux rather than recorded. */
+    uint64_t mem_budget;
+
+    /* Seconds to wait for a track still being captured to file (0 = none).
+     * A track is waited for until its file is complete, or has not grown for
+     * this long; after which the capture is taken to have ended. */
+    uint32_t wait_secs;
+
     /* Most recent 32 bits read from the stream. */
     uint32_t word;
 
-    /* Rolling CRC-CCITT of incoming data. */
+    /* Rolling CRC-CCITT of incoming data. Maintained only from the most
+     * recent stream_start_crc() until the next stream_reset(). */
     uint16_t crc16_ccitt;
     uint8_t  crc_bitoff;
+    bool_t   crc_active;
 
     /* RPM of drive which created this stream. */
     unsigned int drive_rpm;
@@ -51,31 +113,231 @@ struct stream {
     int pll_period_adj_pct; /* 0 - 100 */
     int pll_phase_adj_pct;  /* 0 - 100 */
 
+    /* PLL implementation (PLL_*). PLL_fixed produces bitcells identical to
+     * PLL_reference, but folds the parameters above into fixed-point factors
+     * when the stream is reset or its density is set. Parameter changes
+     * therefore take effect at the next stream_reset(). Bitcell images are
+     * read directly, without the PLL, only under PLL_fixed. */
+    uint8_t pll_kernel;
+    struct {
+        uint64_t period_fac, phase_fac; /* pct/100 and (100-pct)/100, Q32 */
+        int clock_min, clock_max;
+    } pll_fixed;
+
     /* Flux-based streams. */
     int flux;                /* Nanoseconds to next flux reversal */
     int clock, clock_centre; /* Clock base value in nanoseconds */
     unsigned int clocked_zeros;
     int ns_to_index;         /* Distance to next index pulse */
 
+    /* Lock quality of the PLL's decode of the current track with the current
+     * settings, since the last stream_reset(), as far as the PLL has run.
+     * Collected when the bitcells are recorded in the cache, and kept with
+     * the recording for its replays. Zero for bitcell-native streams, and
+     * unless @pll_stats_on: accounting costs the PLL some 10% of its speed. */
+    uint8_t pll_stats_on;
+    struct stream_pll_stats *pll_stats;
+    struct stream_pll_stats pll_live; /* if no recording holds them */
+
     uint32_t prng_seed;
+
+    /* Decoded bitcells of the current track, replayed across resets, and the
+     * position in the pass being replayed or recorded. Bitcells [cache_pos,
+     * fast_end) of the pass hold no index pulse, and are replayed by the
+     * inline stream_next_bit() without a call into the library. */
+    struct stream_cache *cache;
+    uint32_t cache_pos, fast_end;
+    const uint8_t *fast_bits;
+    const uint16_t *fast_lat, *fast_clock;
+
+    /* Flux intervals of the current track, read from the stream type once
+     * and replayed across resets; and the replay position within them. */
+    struct flux_buf *flux_buf;
+    uint32_t flux_pos, flux_idx;
+
+    /* Bitcell-native streams: the current track's bitcell image, if the
+     * stream type provides one, and the position within it. @bc_native is set
+     * while the image is read directly. @bc_resync is set if it has since
+     * stopped being, and the flux must be brought level with it. */
+    const struct bitcell_image *bc_image;
+    bool_t bc_native, bc_resync;
+    uint32_t bc_pos, bc_run;
+    uint64_t bc_ns; /* nanoseconds read since stream_reset() */
+
+    /* Clones: the stream whose loaded track (@clone_track) is shared. */
+    struct stream *clone_of;
+    unsigned int clone_track;
+
+    /* Decode shared by the variants of one parent type, while libdisk tries
+     * a list of types on this stream's track, or NULL. */
+    struct parent_memo *parent_memo;
+
+    /* Timeline trace to record this stream's track selections and resets
+     * to (see trace_open()), or NULL. Clones share it. */
+    struct trace *trace;
 };
 
+#define PLL_fixed     0 /* default */
+#define PLL_reference 1
+
 #pragma GCC visibility push(default)
 struct stream *stream_open(
     const char *name, unsigned int drive_rpm, unsigned int data_rpm);
 struct stream *stream_soft_open(
     uint8_t *data, uint16_t *speed, uint32_t bitlen, unsigned int data_rpm);
+/* Single-track stream over SCP-format flux in memory: @nr_revs revolutions
+ * of big-endian 25ns samples, @nr_samples[i] in each, stored back to back.
+ * @dat is not copied, and must remain valid until the stream is closed. */
+struct stream *stream_scp_open(
+    const uint16_t *dat, const uint32_t *nr_samples, unsigned int nr_revs,
+    unsigned int drive_rpm, unsigned int data_rpm);
+/* Open an image held in memory, of the type named by its file suffix (e.g.,
+ * "scp", "scz", "dfi", "ipf"). @dat is parsed in place, and must remain valid until
+ * the stream is closed. Returns NULL if the type cannot be opened from
+ * memory, or does not recognise @dat. */
+struct stream *stream_open_mem(
+    const char *type, const void *dat, size_t len,
+    unsigned int drive_rpm, unsigned int data_rpm);
+/* Kryoflux STREAM held in memory, as one buffer per track file. As each track
+ * is selected, @get_track(@opaque, tracknr, &dat, &len) is called, and
+ * returns non-zero if the track is absent. The track's data is parsed before
+ * stream_select_track() returns, and is not referenced afterwards. */
+struct stream *stream_open_kryoflux_mem(
+    int (*get_track)(void *opaque, unsigned int tracknr,
+                     const void **dat, size_t *len),
+    void *opaque, unsigned int drive_rpm, unsigned int data_rpm);
 void stream_close(struct stream *s);
+/* Identity of the device which captured @s, from the image's metadata (e.g.,
+ * the manufacturer, model and serial number in an SCP footer), or "" if it
+ * does not say. KryoFlux STREAMs carry it in each track file, so have it once
+ * a track has been selected. */
+const char *stream_device(struct stream *s);
+/* Load the support libraries of stream types which use them (e.g., CAPS), and
+ * keep them loaded, so that a long-lived process opening many images does not
+ * reload them for each. */
+void stream_preload(void);
+/* Make an independent cursor over the track currently selected on @s, sharing
+ * its loaded flux data read-only. The clone may be used from another thread,
+ * but cannot select a different track. @s must not change track, and must
+ * outlive the clone. Returns NULL if the stream type cannot be cloned. */
+struct stream *stream_clone(struct stream *s);
 int stream_select_track(struct stream *s, unsigned int tracknr);
 void stream_reset(struct stream *s);
 void stream_next_index(struct stream *s);
-int stream_next_bit(struct stream *s);
+/* Out-of-line stream_next_bit(), for when the bitcell is not in the window
+ * replayed inline. */
+int stream_next_bit_slow(struct stream *s);
 int stream_next_bits(struct stream *s, unsigned int bits);
 int stream_next_bytes(struct stream *s, void *p, unsigned int bytes);
+/* Decode up to @nr bitcells into @bits (bitcell[i] = bits[i/8] >> -(i-7)).
+ * If non-NULL, @idx_off[i] receives the index offset of bitcell i (as
+ * s->index_offset_bc) and @lat[i] its latency in nanoseconds. Stream state
+ * (word, CRC, index counters) is updated exactly as by stream_next_bit().
+ * Returns the number of bitcells decoded, which is less than @nr only if the
+ * stream is exhausted. */
+int stream_next_bitcells(
+    struct stream *s, void *bits, uint32_t *idx_off, uint32_t *lat,
+    unsigned int nr);
+/* Advance until the most recent @bits bitcells (at most 32) match @sync,
+ * reading no more than @max_bits bitcells. Returns 0 on a match, else -1.
+ * Equivalent to looping over stream_next_bit() and testing s->word, but may
+ * skip ahead using a per-track index of sync positions. */
+int stream_next_sync(
+    struct stream *s, uint32_t sync, unsigned int bits, unsigned int max_bits);
+/* As stream_next_sync(), but stops at whichever of @nr_syncs @syncs matches
+ * first. Returns the index of the matching sync, else -1. */
+int stream_next_syncs(
+    struct stream *s, const uint32_t *syncs, unsigned int nr_syncs,
+    unsigned int bits, unsigned int max_bits);
+/* As stream_next_sync(), but matching the most recent 32 bitcells against
+ * @sync only where @mask is set: for instance, the clock bits of an FM mark,
+ * whatever its data. */
+int stream_next_sync_mask(
+    struct stream *s, uint32_t sync, uint32_t mask, unsigned int max_bits);
+/* Whether 32-bit @sync, followed immediately by the @next_bits (at most 32)
+ * bitcells @next, occurs among the bitcells read so far in this pass. Answered
+ * from the sync index without moving the stream. Returns 1 or 0, or -1 if the
+ * pass is not cached and the caller must search for itself. */
+int stream_seen_sync(
+    struct stream *s, uint32_t sync, unsigned int next_bits, uint32_t next);
+/* Bitcell length of the current revolution, from the most recent index pulse
+ * to the next, without running the PLL and without moving the stream. Exact
+ * if the cached pass has recorded the next index pulse (@exact is set). Else
+ * estimated from the buffered flux: index-to-index time over the bitcell
+ * period of the track's flux histogram (see flux_min_ns), which is good to a
+ * few percent on a track of uniform density. Returns 0 if neither is known. */
+uint32_t stream_estimate_track_len(struct stream *s, bool_t *exact);
+
+/* Position @s at bitcell @bc after index pulse @rev (0 being the pulse
+ * stream_reset() stops at), as stream_reset(), @rev stream_next_index() calls
+ * and reading @bc bitcells would. Once the cache has recorded that far, the
+ * stream is repositioned without reading through the intervening bitcells.
+ * The CRC is left inactive. Returns -1 if the stream ends first. */
+int stream_seek_bc(struct stream *s, unsigned int rev, uint32_t bc);
+/* Digest of the flux of the currently selected track, as far as any pass can
+ * read it, for caching results derived from it. Returns -1 if the flux is not
+ * the same on every pass (e.g., it is jittered). May rewind the stream. */
+int stream_track_digest(struct stream *s, uint64_t *digest);
+/* PLL settings (pll_period_adj_pct[i], pll_phase_adj_pct[i]) which are about
+ * to be tried in turn on the current track. The first pass to start with any
+ * of them decodes the track with all of them at once, in a single run of the
+ * PLL lanes over the track's flux, and the passes which start with the
+ * others replay the results. Lanes run only over buffered flux, with the
+ * PLL_fixed kernel: else each pass runs the PLL as usual. Cleared when
+ * another track is selected, or by @nr = 0. Returns -1 if the stream has no
+ * bitcell cache, or @nr exceeds STREAM_PLL_LANES. */
+#define STREAM_PLL_LANES 16
+int stream_set_pll_lanes(
+    struct stream *s, const uint8_t *period_adj_pct,
+    const uint8_t *phase_adj_pct, unsigned int nr);
+/* Successive revolutions of the current track, aligned bitcell for bitcell
+ * (see stream_align_revs()). */
+struct stream_align {
+    unsigned int nr;  /* revolutions aligned, including the first */
+    uint32_t nr_bits; /* bitcells in the first revolution */
+    /* off[r]: bitcell of revolution r which aligns with the first bitcell of
+     * revolution 0, relative to r's index pulse (off[0] = 0). */
+    int32_t *off;
+    /* Bitcells of revolution 0, and a mask of those that read the same in
+     * every revolution once aligned, packed as by stream_next_bitcells(). */
+    uint8_t *bits, *stable;
+};
+/* Decode up to @nr revolutions from the first index pulse, and align each
+ * with the first: within +/-@max_shift bitcells at the index, then following
+ * any drift across the revolution. Rewinds the stream, and leaves it beyond
+ * the last revolution. Returns -1 if not even one full revolution can be
+ * read. Free with stream_align_free(). */
+int stream_align_revs(struct stream *s, unsigned int nr,
+                      unsigned int max_shift, struct stream_align *a);
+void stream_align_free(struct stream_align *a);
 void stream_start_crc(struct stream *s);
 void stream_set_density(struct stream *s, unsigned int ns_per_cell);
 #pragma GCC visibility pop
 
+static inline int stream_next_bit(struct stream *s)
+{
+    uint32_t pos = s->cache_pos;
+    int b;
+
+    if (pos >= s->fast_end)
+        return stream_next_bit_slow(s);
+    s->cache_pos = pos + 1;
+    s->latency += s->fast_lat[pos];
+    s->index_offset_bc++;
+    s->index_offset_ns += s->fast_lat[pos];
+    s->clock = s->fast_clock[pos];
+    b = (s->fast_bits[pos>>3] >> (~pos & 7)) & 1;
+    s->word = (s->word << 1) | b;
+    return b;
+}
+
+/* The handler decoding from @s has found something new: restart its
+ * no-progress cutoff (see idle_revolutions). */
+static inline void stream_progress(struct stream *s)
+{
+    s->progress_index = s->nr_index;
+}
+
 #endif /* __LIBDISK_STREAM_H__ */
 
 /*
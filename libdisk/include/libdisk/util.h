@@ -37,6 +37,9 @@
 #endif
 
 #define __initcall __attribute__((constructor))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
 
 #ifndef offsetof
 #define offsetof(a,b) __builtin_offsetof(a,b)
@@ -78,18 +81,50 @@ typedef char bool_t;
 void filename_extension(const char *filename, char *extension, size_t size);
 
 void *memalloc(size_t size);
+/* As memalloc(), but not zeroed: for buffers which are filled before use. */
+void *memalloc_nz(size_t size);
+/* As realloc(), for blocks from the above. Any growth is not zeroed. */
+void *memrealloc(void *p, size_t size);
 void memfree(void *p);
 
+/* Allocation accounting, off until enabled. Each allocation is charged to
+ * the tag of what its thread is doing: reading streams, in a container's
+ * open, load or close, in a handler's analysis, or generating bitcells.
+ * Live and peak bytes are of all allocations made while enabled, where the
+ * C library can say how large a block being freed is (else zero). */
+enum mem_tag {
+    MEMTAG_other, MEMTAG_stream, MEMTAG_container, MEMTAG_handler,
+    MEMTAG_tbuf, MEMTAG_NR
+};
+struct mem_stats {
+    uint64_t allocs, bytes;
+};
+void mem_enable_stats(int enable);
+/* Set the calling thread's tag. Returns the tag it replaces. */
+enum mem_tag mem_set_tag(enum mem_tag tag);
+const char *mem_tag_name(enum mem_tag tag);
+/* Returns -1 if @tag is not valid. */
+int mem_get_stats(enum mem_tag tag, struct mem_stats *stats);
+void mem_get_usage(uint64_t *live, uint64_t *peak);
+
 void read_exact(int fd, void *buf, size_t count);
 void write_exact(int fd, const void *buf, size_t count);
 
 uint32_t crc32_add(const void *buf, size_t len, uint32_t crc);
 uint32_t crc32(const void *buf, size_t len);
 
+/* Fast 64-bit non-cryptographic hash, for content addressing. Chain calls by
+ * passing the previous result as @h (0 to start). Not endian-neutral. */
+uint64_t hash64_add(const void *buf, size_t len, uint64_t h);
+
 uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc);
 uint16_t crc16_ccitt_bit(uint8_t b, uint16_t crc);
+/* Accumulate the @bits least significant bits of @x, most significant first. */
+uint16_t crc16_ccitt_bits(uint32_t x, unsigned int bits, uint16_t crc);
 
 uint16_t rnd16(uint32_t *p_seed);
+/* The next @nr results of rnd16(), into @out. */
+void rnd16_bulk(uint32_t *p_seed, uint16_t *out, unsigned int nr);
 
 #if !defined(__PLATFORM_HAS_ENDIAN_H__)
 
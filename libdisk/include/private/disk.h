@@ -1,8 +1,10 @@
 #ifndef __PRIVATE_DISK_H__
 #define __PRIVATE_DISK_H__
 
+#include <pthread.h>
 #include <libdisk/disk.h>
 #include <libdisk/stream.h>
+#include <private/stream.h>
 #include <private/util.h>
 
 #define DEFAULT_RPM 300
@@ -16,19 +18,104 @@ struct disk_list_tag {
     struct disktag tag;
 };
 
+/* Tags with id below this are also indexed by id, for O(1) lookup. */
+#define NR_INDEXED_TAGS 16
+
 struct container;
 
+/* Where a container writes its image. A file or memory buffer may be seeked;
+ * an unseekable file (pipe, socket) or a writer callback takes data only in
+ * order. */
+struct disk_sink {
+    int fd;          /* file, or -1 */
+    bool_t seekable;
+    off_t pos, len;  /* write position; extent written */
+    off_t reserved;  /* file: extent allocated by sink_reserve() */
+    /* Memory: the image so far, handed over by disk_close(). */
+    uint8_t *buf;
+    size_t max;
+    void **pdat;
+    size_t *plen;
+    /* Writer callback. */
+    int (*write)(void *opaque, const void *dat, size_t len);
+    void *opaque;
+};
+
+/* Container image output. sink_rewind() discards anything written so far.
+ * Containers which back-patch must check sink_seekable(), else write their
+ * image in order: sink_seek() fails other than to the current position.
+ * A container which knows its image's size may sink_reserve() it after
+ * rewinding, so that a file's blocks are allocated in one go, and a memory
+ * image is not grown as it is written. */
+bool_t sink_seekable(struct disk *d);
+void sink_rewind(struct disk *d);
+void sink_reserve(struct disk *d, size_t len);
+void sink_seek(struct disk *d, off_t off);
+off_t sink_tell(struct disk *d);
+void sink_write(struct disk *d, const void *dat, size_t len);
+
 /* Private data relating to an open disk. */
 struct disk {
+    /* Image file opened or created by name, or -1. */
     int fd;
+    struct disk_sink sink;
     bool_t read_only;
     bool_t kryoflux_hack;
+    /* Rewrite an opened image in full on close (see disk_compact()). */
+    bool_t compact;
     unsigned int rpm;
     struct container *container;
+    /* Container-private state: a single allocation, or NULL. */
+    void *container_priv;
+    /* Image file mapping, into which track data may point. */
+    struct stream_map map;
     struct disk_info *di;
-    struct disk_list_tag *tags;
+    /* Tags may be looked up and set by handlers analysing different tracks
+     * concurrently. Replaced tags are retired rather than freed, so that a
+     * tag pointer remains valid until the disk is closed. */
+    pthread_mutex_t tags_lock;
+    struct disk_list_tag *tags, *retired_tags;
+    struct disktag *tag_by_id[NR_INDEXED_TAGS];
+    /* Finalised raw tracks, most recently used first. */
+    pthread_mutex_t raw_cache_lock;
+    struct raw_cache_ent *raw_cache;
+    uint32_t raw_cache_bytes;
+    /* Track data spilled under a memory budget, or NULL if there is none
+     * (see disk_set_mem_budget()). */
+    struct disk_spill *spill;
+    /* Data buffers shared by tracks of identical data, or NULL if none has
+     * been settled (see track_settle()). */
+    pthread_mutex_t share_lock;
+    struct track_share *share;
+    /* Per-track count of readers holding the data in place (see
+     * track_get_data()), or NULL if none has been taken. Under share_lock. */
+    unsigned int *data_pins;
+    pthread_cond_t data_unpinned;
+    /* Per-track IBM sector views, or NULL if none has been taken (see
+     * ibm_sector_view()). */
+    struct ibm_view_slot **ibm_views;
+    /* Threads for disk_parallel() (see disk_set_jobs()); where statistics
+     * and trace spans of work on the disk go, or NULL. */
+    unsigned int nr_jobs;
+    struct track_stats_table *stats;
+    struct trace *trace;
 };
 
+/* What the parent type's write_raw() made of @tracknr: the track info, with
+ * its own copy of the data (NULL if the decode failed), and where it left the
+ * stream. Held by the stream being decoded (see struct stream), for the
+ * duration of one track_write_raw_from_stream_any(). */
+struct parent_memo {
+    uint16_t type;
+    bool_t valid;
+    unsigned int tracknr, rev;
+    uint32_t bc;
+    struct track_info ti;
+};
+
+/* Drop every cached raw track, so that each is next read from its handler. */
+void raw_cache_flush(struct disk *d);
+
 /* How to interpret data being appended to a track buffer. */
 enum bitcell_encoding {
     bc_raw,           /* emit all bits; do not insert clock bits */
@@ -52,6 +139,18 @@ struct tbuf {
                 enum bitcell_encoding enc, uint8_t dat);
     void (*gap)(struct tbuf *, uint16_t speed, unsigned int bits);
     void (*weak)(struct tbuf *, unsigned int bits);
+    /* Capacities of raw.bits and raw.speed; and buffers kept from the
+     * previous track, which tbuf_init() reuses rather than allocating. */
+    uint32_t bits_max, speed_max;
+    uint8_t *spare_bits;
+    uint16_t *spare_speed;
+    uint32_t spare_bits_max, spare_speed_max;
+    /* Weak regions recorded in raw.weak_runs: capacity, whether the most
+     * recent is awaiting the encoding of what follows it, and whether they
+     * can be regenerated (no custom encoders, and no other use of the PRNG,
+     * counted by @nr_rnd). */
+    uint32_t weak_max, nr_rnd, nr_weak_rnd;
+    bool_t weak_pending, weak_exact;
 };
 
 /* Append new raw track data into a track buffer. */
@@ -60,6 +159,13 @@ void tbuf_bits(struct tbuf *, uint16_t speed,
                enum bitcell_encoding enc, unsigned int bits, uint32_t x);
 void tbuf_bytes(struct tbuf *, uint16_t speed,
                 enum bitcell_encoding enc, unsigned int bytes, void *data);
+/* Append an even number of @bytes of bitcells already encoded (e.g., a cached
+ * template), as tbuf_bytes(bc_raw) would, but without re-encoding them.
+ * Returns -1, having appended nothing, if the buffer takes its data field by
+ * field (e.g., for IPF) rather than as bitcells: the caller must then append
+ * the fields themselves. */
+int tbuf_raw(struct tbuf *, uint16_t speed, unsigned int bytes,
+             const void *data);
 void tbuf_gap(struct tbuf *, uint16_t speed, unsigned int bits);
 void tbuf_weak(struct tbuf *, unsigned int bits);
 void tbuf_start_crc(struct tbuf *tbuf);
@@ -68,6 +174,7 @@ void tbuf_disable_auto_sector_split(struct tbuf *tbuf);
 
 #define TBUF_PRNG_INIT 0xae659201u
 uint16_t tbuf_rnd16(struct tbuf *tbuf);
+void tbuf_rnd16_bulk(struct tbuf *tbuf, uint16_t *out, unsigned int nr);
 
 enum track_density {
     trkden_double, /* default */
@@ -77,6 +184,23 @@ enum track_density {
 };
 
 /* Track handler -- interface for various raw-bitcell analysers/encoders. */
+/* Push-style early reject: the resumable alternative to a probe() hook.
+ * Rather than pulling bitcells from the stream, a scanner is fed them a
+ * chunk at a time by a driver which decodes the track once for every
+ * scanner being tried on it (see dsk_scan()). */
+enum scan_verdict { SCAN_more, SCAN_match, SCAN_reject };
+struct track_scanner {
+    /* Bytes of per-attempt state, zeroed and passed to init() (if any). */
+    unsigned int state_size;
+    void (*init)(
+        struct disk *, unsigned int tracknr, enum track_type, void *state);
+    /* Consume bitcells [0,@nr) of @bits (bitcell i = bits[i/8] >> -(i-7)).
+     * SCAN_reject only if write_raw() would certainly fail. A scanner which
+     * still wants more at the end of the stream is rejected. */
+    enum scan_verdict (*feed)(void *state, const uint8_t *bits,
+                              unsigned int nr);
+};
+
 struct track_handler {
     enum track_density density;
     unsigned int bytes_per_sector;
@@ -85,6 +209,21 @@ struct track_handler {
         struct disk *, unsigned int tracknr, char *, size_t);
     void *(*write_raw)(
         struct disk *, unsigned int tracknr, struct stream *);
+    /* Optional early reject, called on the freshly selected track before
+     * write_raw(). Returns 0 only if write_raw() would certainly fail. May
+     * consume the stream, which is rewound before write_raw() is called. */
+    int (*probe)(
+        struct disk *, unsigned int tracknr, struct stream *);
+    /* Optional early reject in place of probe(), fed the track's bitcells. */
+    const struct track_scanner *scanner;
+    /* A variant refines track type @parent, and has write_variant() in place
+     * of write_raw(). It is called with the track as the parent's write_raw()
+     * decoded it, takes ownership of the decoded data @dat, and returns the
+     * variant's data, or NULL if the track is not variant @type. */
+    uint16_t parent;
+    void *(*write_variant)(
+        struct disk *, unsigned int tracknr, enum track_type type,
+        struct stream *, void *dat);
     void (*read_raw)(
         struct disk *, unsigned int tracknr, struct tbuf *);
     void *(*write_sectors)(
@@ -100,6 +239,78 @@ extern const struct track_handler *handlers[];
 /* Set up a track with defaults for a given track format. */
 void init_track_info(struct track_info *ti, enum track_type type);
 
+/* Set tag @id, unless it is already set. Returns the tag in force, so that
+ * handlers deriving a disk-wide value (e.g., a decryption key) from whichever
+ * track they analyse first all agree on the first value derived. */
+struct disktag *disk_set_tag_once(
+    struct disk *d, uint16_t id, uint16_t len, void *dat);
+
+/* Rebuild the tag index, for containers which build d->tags directly. */
+void disk_index_tags(struct disk *d);
+
+/* Call @fn(@arg, i) for every i in [0,@nr), spread across the threads
+ * allowed for @d by disk_set_jobs(). Calls may run concurrently and in any
+ * order. */
+void disk_parallel(
+    struct disk *d, unsigned int nr, void (*fn)(void *arg, unsigned int i),
+    void *arg);
+
+/* Scratch memory for the handler attempt in progress on this thread, carved
+ * from a per-thread arena: not zeroed, and not to be freed. It is all
+ * reclaimed when dsk_write_raw() returns, so must not hold the track data
+ * returned by write_raw(). */
+void *track_scratch(size_t size);
+void track_scratch_reset(void);
+
+/* While @ti is decoded from @s under a no-progress cutoff (see
+ * s->idle_revolutions), each sector set valid in @ti is progress on @s. Pass
+ * NULL when the attempt is over. Per thread. */
+void track_watch_progress(struct track_info *ti, struct stream *s);
+
+/* Probe helpers. probe_sync() searches the rest of the stream for @sync, the
+ * low @bits bits of s->word (at most 32). probe_track_len() rewinds the
+ * stream and returns the bitcell length of its longest revolution. */
+int probe_sync(struct stream *s, uint32_t sync, unsigned int bits);
+uint32_t probe_track_len(struct stream *s);
+
+/* Is the revolution from the most recent index pulse at least @min_bits
+ * long? As stream_next_index() and a test of s->track_len_bc, but the PLL is
+ * run only if stream_estimate_track_len() is too close to call. The stream
+ * position is undefined afterwards. */
+bool_t check_track_len(struct stream *s, uint32_t min_bits);
+/* Scanner state which matches once any of its syncs, each the low @bits
+ * bits (at most 32) of the bitcells fed so far, is seen. */
+#define SCAN_MAX_SYNCS 4
+struct scan_sync {
+    uint32_t word;
+    unsigned int fed, nr;
+    struct { uint32_t sync, mask; unsigned int bits; } sync[SCAN_MAX_SYNCS];
+};
+void scan_sync_add(struct scan_sync *, uint32_t sync, unsigned int bits);
+enum scan_verdict scan_sync_feed(
+    void *state, const uint8_t *bits, unsigned int nr);
+/* Scanners for handlers which cannot match without a 0x44894489 (or
+ * 0x4489) sync. */
+extern const struct track_scanner scan_sync_44894489, scan_sync_4489;
+
+/* Simple custom formats, described as data rather than code: a sync, then up
+ * to two raw marker longs, then the data longs and an optional checksum long,
+ * each long MFM-encoded in turn. A handler points .extra_data at its struct
+ * simple_format and uses the simple_* methods. */
+enum simple_csum { SIMPLE_CSUM_none, SIMPLE_CSUM_add };
+struct simple_format {
+    uint32_t sync;
+    uint8_t sync_bits;          /* 16 or 32 */
+    uint8_t nr_marks;
+    uint32_t mark[2];           /* raw longs following the sync */
+    enum bitcell_encoding enc;  /* bc_mfm_even_odd or bc_mfm_odd_even */
+    enum simple_csum csum;      /* over the data longs, stored after them */
+    uint32_t total_bits;        /* 0 leaves the default */
+};
+extern const struct track_scanner simple_scanner;
+void *simple_write_raw(struct disk *, unsigned int tracknr, struct stream *);
+void simple_read_raw(struct disk *, unsigned int tracknr, struct tbuf *);
+
 /* Container -- interface for a disk-image container format. */
 struct container {
     /* Create a brand new empty container. */
@@ -111,8 +322,24 @@ struct container {
     /* Analyse and write a raw stream to given track in container. */
     int (*write_raw)(struct disk *, unsigned int tracknr,
                      enum track_type, struct stream *);
+    /* Optional: fetch track data which open() left in the file. */
+    void (*load)(struct disk *, unsigned int tracknr);
 };
 
+/* Free a track's data, unless it points into the disk's image mapping, and
+ * drop any cached raw copy of the track. */
+void track_free_data(struct disk *d, struct track_info *ti);
+
+/* Ensure a track's data is in memory. */
+void track_load_data(struct disk *d, unsigned int tracknr);
+
+/* Read the data of a track other than the one being analysed: other workers
+ * may settle that track meanwhile. track_get_data() loads it and returns
+ * ti->dat, which is neither freed, replaced, spilled nor compressed until the
+ * matching track_put_data(). */
+const uint8_t *track_get_data(struct disk *d, unsigned int tracknr);
+void track_put_data(struct disk *d, unsigned int tracknr);
+
 /* Supported container formats. */
 extern struct container container_adf;
 extern struct container container_eadf;
@@ -130,6 +357,19 @@ void dsk_init(struct disk *d);
 int dsk_write_raw(
     struct disk *d, unsigned int tracknr, enum track_type type,
     struct stream *s);
+/* Would dsk_write_raw() turn @type away from @tracknr on its flux alone,
+ * before any handler pass? Leaves the track selected at @type's density, and
+ * the stream's word and PRNG state as they were. */
+int dsk_density_ruled_out(
+    unsigned int tracknr, enum track_type type, struct stream *s);
+
+/* Run the scanners of all @nr @types on @tracknr together, in one pass over
+ * the track at each density, setting @verdict[i] for each type: SCAN_more if
+ * it has no scanner, or its density is ruled out. Leaves the stream's word
+ * and PRNG state as they were. */
+void dsk_scan(
+    struct disk *d, unsigned int tracknr, const uint16_t *types,
+    unsigned int nr, struct stream *s, uint8_t *verdict);
 
 /* Decode/Encode helpers for MFM analysers. */
 /* mfm_decode_word: Decode 32-bit MFM to 16-bit word. */
@@ -141,7 +381,23 @@ void mfm_decode_bytes(
 void mfm_encode_bytes(
     enum bitcell_encoding enc, unsigned int bytes, void *in, void *out,
     uint8_t prev_bit);
+/* Decode @bytes of data which were MFM-encoded in turn as chunks of @chunk
+ * bytes (4 for alternating even/odd longs; @bytes for a single block), and
+ * return a checksum of the decoded big-endian longs. @out may be @in. */
+enum mfm_csum {
+    MFM_CSUM_none,
+    MFM_CSUM_xor,       /* XOR of the longs */
+    MFM_CSUM_add,       /* sum of the longs */
+    MFM_CSUM_amigados   /* amigados_checksum() */
+};
+uint32_t mfm_decode_csum(
+    enum bitcell_encoding enc, enum mfm_csum csum, unsigned int bytes,
+    unsigned int chunk, void *in, void *out);
 uint32_t amigados_checksum(void *dat, unsigned int bytes);
+/* amigados_checksum() of @bytes of bc_mfm_even_odd data, computed directly
+ * from its 2*@bytes of raw MFM. The checksum is linear, so the even and odd
+ * halves may be separate blocks, as long as all are included. */
+uint32_t amigados_checksum_mfm(void *raw, unsigned int bytes);
 
 /* IBM format decode helpers. */
 struct ibm_idam { uint8_t cyl, head, sec, no, crc;};
@@ -151,6 +407,7 @@ struct ibm_idam { uint8_t cyl, head, sec, no, crc;};
 int ibm_scan_mark(struct stream *s, unsigned int max_scan, uint8_t *pmark);
 int ibm_scan_idam(struct stream *s, struct ibm_idam *idam);
 int ibm_scan_dam(struct stream *s);
+bool_t ibm_scan_iam(struct stream *s);
 
 void setup_ibm_mfm_track(
     struct disk *d, unsigned int tracknr,
@@ -158,17 +415,30 @@ void setup_ibm_mfm_track(
     uint8_t *sec_map, uint8_t *cyl_map, uint8_t *head_map,
     uint8_t *mark_map, uint8_t *dat);
 
-void retrieve_ibm_mfm_track(
-    struct disk *d, unsigned int tracknr,
-    uint8_t **psec_map, uint8_t **pcyl_map,
-    uint8_t **phead_map, uint8_t **pno_map,
-    uint8_t **pmark_map, uint16_t **pcrc_map,
-    uint8_t **pdat);
+/* Sector layout of an IBM-MFM track: the ID field, mark and CRC status (0 =
+ * good) of each sector in track order, and their data back to back. */
+struct ibm_sector_view {
+    unsigned int nr_secs;
+    uint8_t *secs, *cyls, *heads, *nos, *marks, *dat;
+    uint16_t *crcs;
+};
+
+/* The sector view of IBM-MFM track @tracknr, parsed from its data on first
+ * use and then shared read-only, also with copies of the track made by
+ * track_copy(). Valid until the track is next modified. */
+const struct ibm_sector_view *ibm_sector_view(
+    struct disk *d, unsigned int tracknr);
+void ibm_sector_view_copy(
+    struct disk *dst, struct disk *src, unsigned int tracknr);
+void ibm_sector_view_put(struct disk *d, unsigned int tracknr);
+void ibm_sector_views_free(struct disk *d);
 
-void setup_uniform_raw_track(
+/* Set up a raw track of uniform density. Returns its bitcells, copied from
+ * @raw_dat, or left zeroed for the caller to fill if @raw_dat is NULL. */
+uint8_t *setup_uniform_raw_track(
     struct disk *d, unsigned int tracknr,
     enum track_type type, unsigned int nr_bits,
-    uint8_t *raw_dat);
+    const uint8_t *raw_dat);
 
 bool_t track_is_copylock(struct track_info *ti);
 
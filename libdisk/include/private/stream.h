@@ -1,22 +1,131 @@
 #ifndef __PRIVATE_STREAM_H__
 #define __PRIVATE_STREAM_H__
 
+#include <sys/types.h>
 #include <libdisk/stream.h>
 #include <private/util.h>
 
 struct stream_type {
     struct stream *(*open)(const char *name, unsigned int data_rpm);
+    /* Optional. Open an image held in caller memory (see stream_open_mem()),
+     * parsing it in place. */
+    struct stream *(*open_mem)(
+        const void *dat, size_t len, unsigned int data_rpm);
     void (*close)(struct stream *);
     int (*select_track)(struct stream *, unsigned int tracknr);
     void (*reset)(struct stream *);
     int (*next_flux)(struct stream *);
+    /* Optional. Return a copy of the stream, positioned on the current track,
+     * which reads the loaded track data without modifying it. The copy must
+     * be a single block beginning with struct stream: it is memfree()d on
+     * close. Returns NULL if the current track cannot be shared. */
+    struct stream *(*clone)(struct stream *);
+    /* Optional. Hint that @tracknr is likely to be selected next, so that its
+     * data can be read ahead in the background. Must leave the current track
+     * undisturbed, and fail silently. */
+    void (*prefetch)(struct stream *, unsigned int tracknr);
+    /* Optional. Load any support library now, and keep it loaded until the
+     * process exits. Fails silently. */
+    void (*preload)(void);
+    /* Optional. Identity of the capture device (see stream_device()). */
+    const char *(*device)(struct stream *);
+    /* Set if select_track() parses the whole track into memory, so that
+     * next_flux() is already cheap to replay and need not be buffered. */
+    bool_t parsed;
     const char *suffix[];
 };
 
+/* Read-only view of a range of a file, from which a stream type can parse
+ * flux in place. The range is mapped where the platform allows, and read into
+ * memory otherwise. Bytes beyond end of file read as zero. */
+struct stream_map {
+    void *base;
+    size_t len;
+    bool_t mapped;
+    void *pool; /* read-ahead buffer (see uring.c), or NULL */
+};
+const void *stream_map(struct stream_map *m, int fd, off_t off, size_t len);
+void stream_unmap(struct stream_map *m); /* no-op if nothing is mapped */
+
+/* Ask the OS to start reading a range of a file into memory. A @len of zero
+ * extends to end of file. A no-op where the platform has no such hint. */
+void stream_readahead(int fd, off_t off, off_t len);
+
+/* Read-ahead through io_uring, where built with HAVE_URING (see uring.c).
+ * uring_readahead() returns -1 if it cannot queue the read. A later read of a
+ * range it covers, from any descriptor of the same file, is served from its
+ * buffer: uring_take() hands the buffer over (to be returned by uring_put()
+ * with *@pbase), and uring_read() copies from it. Each returns NULL or -1 if
+ * no queued read covers the range. uring_take() waits for any read of the
+ * start of the range, so that it can then be mapped from the page cache. */
+int uring_readahead(int fd, off_t off, off_t len);
+void *uring_take(int fd, off_t off, size_t len, void **pbase);
+void uring_put(void *base);
+int uring_read(int fd, off_t off, void *buf, size_t len);
+
+/* An image a stream type reads from: an open file, or a buffer in caller
+ * memory (@fd is -1), which is used in place. As with files, bytes beyond
+ * the end of a buffer read as zero. */
+struct stream_src {
+    int fd;
+    const uint8_t *mem;
+    off_t size;
+};
+int stream_src_open(struct stream_src *src, const char *name); /* -1 on error */
+void stream_src_mem(struct stream_src *src, const void *dat, size_t len);
+void stream_src_close(struct stream_src *src);
+void stream_src_read(struct stream_src *src, off_t off, void *buf, size_t len);
+const void *stream_src_map(
+    struct stream_src *src, struct stream_map *m, off_t off, size_t len);
+void stream_src_readahead(struct stream_src *src, off_t off, off_t len);
+
 void stream_setup(
     struct stream *s, const struct stream_type *st,
     unsigned int drive_rpm, unsigned int data_rpm);
 
+/* Called by a stream type when the current track will not replay identically
+ * after a reset (weak bits, flakey tracks). Drops any cached bitcells and
+ * disables caching until a different track is selected. */
+void stream_cache_invalidate(struct stream *s);
+
+/* In-memory image of a track's bitcells, from which the soft, disk-image and
+ * CAPS stream types synthesise flux. The bitcells fall into runs of equal
+ * period: run i is [runs[i].start, runs[i+1].start), and runs[0].start is 0.
+ * @ns_per_cell is the nominal period, of a bitcell at SPEED_AVG.
+ *
+ * A stream type which points s->bc_image at the current track's image is
+ * bitcell-native: while the density is within the PLL's reach of the image's
+ * own, stream_next_bit() and friends read the image directly, rather than
+ * running the PLL over the synthesised flux. The stream type's next_flux()
+ * must deliver the image as bitcell_image_flux() does, starting from bitcell
+ * 1 after reset, and calling its reset() as it wraps. */
+struct bitcell_run {
+    uint32_t start, ns;
+};
+struct bitcell_image {
+    const uint8_t *bits;
+    uint32_t bitlen, nr_runs, ns_per_cell;
+    struct bitcell_run *runs;
+};
+/* Add to *@flux the period of each bitcell from *@pos up to and including the
+ * next 1, stopping early at the bitcell which takes *@flux to 1ms. *@pos is
+ * left at the bitcell after the last one added. *@run caches the position in
+ * the runs from one call to the next: start it at zero. Returns -1 if the
+ * image is exhausted first, else 0. */
+int bitcell_image_flux(
+    const struct bitcell_image *im, uint32_t *pos, uint32_t *run, int *flux);
+
+/* Index of the first 1 bitcell in [@pos,@end), or @end if there is none. */
+uint32_t next_set_bit(const uint8_t *bits, uint32_t pos, uint32_t end);
+
+/* Classify the current track's flux as noise or not, without running the PLL.
+ * The buffered flux is cut into windows of 1000 bitcells at the nominal clock
+ * (s->clock_centre), and a window is noisy if it breaks the MFM rules (long
+ * runs of zero bitcells, jumps in the apparent clock) at least 20 times.
+ * Returns the number of windows, with the number noisy in @nr_noisy; or -1 if
+ * the track's flux is not buffered. Does not move the stream. */
+int stream_flux_noise(struct stream *s, uint32_t *nr_noisy);
+
 #endif /* __PRIVATE_STREAM_H__ */
 
 /*
@@ -11,6 +11,20 @@
     fprintf(stderr, "*** T%u.%u: %s: " msg "\n", cyl(trk), hd(trk), \
            (ti)->typename, ## a)
 
+/* Timeline tracing (see trace.c). A span is timed from trace_begin(), which
+ * returns 0 if @trace is NULL, to trace_end(), which then does nothing. */
+#define TRACE_NO_TRACK (~0u)
+struct trace;
+uint64_t trace_begin(struct trace *trace);
+void trace_end(struct trace *trace, const char *cat, const char *name,
+               unsigned int tracknr, uint64_t t0);
+
+/* LZ4 block format (see lz4.c). @dst must hold lz4_bound(@len) bytes.
+ * lz4_decompress() returns 0 if @src decodes to exactly @dlen bytes. */
+uint32_t lz4_bound(uint32_t len);
+uint32_t lz4_compress(const void *src, uint32_t len, void *dst);
+int lz4_decompress(const void *src, uint32_t len, void *dst, uint32_t dlen);
+
 #endif /* __PRIVATE_UTIL_H__ */
 
 /*
@@ -0,0 +1,161 @@
+/*
+ * libdisk/lz4.c
+ *
+ * LZ4 block-format compression, for track data held in memory (see
+ * disk_set_mem_compress()). The compressor is a greedy single pass over a
+ * hash of each 4-byte sequence: fast rather than tight, as it runs once per
+ * settled track.
+ */
+
+#include <string.h>
+#include <libdisk/util.h>
+#include <private/util.h>
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5  /* the block always ends with this many literals */
+#define MF_LIMIT      12 /* ...and no match starts this close to its end */
+#define MAX_OFFSET    65535
+#define HASH_BITS     12
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static unsigned int hash(uint32_t x)
+{
+    return (x * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *op, uint32_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *put_literals(
+    uint8_t *op, const uint8_t *lit, uint32_t len, uint32_t mlen)
+{
+    *op++ = (min_t(uint32_t, len, 15) << 4) | min_t(uint32_t, mlen, 15);
+    if (len >= 15)
+        op = put_len(op, len - 15);
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+uint32_t lz4_bound(uint32_t len)
+{
+    return len + len / 255 + 16;
+}
+
+uint32_t lz4_compress(const void *src, uint32_t len, void *dst)
+{
+    uint32_t table[1u << HASH_BITS];
+    const uint8_t *base = src, *ip = base, *anchor = base, *ref;
+    const uint8_t *end = base + len, *match_end = end - LAST_LITERALS;
+    uint8_t *op = dst;
+    uint32_t seq, off, mlen;
+    unsigned int h;
+
+    memset(table, 0, sizeof(table));
+
+    while ((len >= MF_LIMIT) && (ip < end - MF_LIMIT)) {
+        seq = read32(ip);
+        h = hash(seq);
+        ref = base + table[h];
+        table[h] = ip - base;
+        off = ip - ref;
+        if ((off == 0) || (off > MAX_OFFSET) || (read32(ref) != seq)) {
+            ip++;
+            continue;
+        }
+
+        for (mlen = MIN_MATCH;
+             (ip + mlen < match_end) && (ip[mlen] == ref[mlen]);
+             mlen++)
+            continue;
+
+        op = put_literals(op, anchor, ip - anchor, mlen - MIN_MATCH);
+        *op++ = off;
+        *op++ = off >> 8;
+        if (mlen - MIN_MATCH >= 15)
+            op = put_len(op, mlen - MIN_MATCH - 15);
+        ip = anchor = ip + mlen;
+    }
+
+    op = put_literals(op, anchor, end - anchor, 0);
+    return op - (uint8_t *)dst;
+}
+
+static int get_len(const uint8_t **pip, const uint8_t *iend, uint32_t *plen)
+{
+    const uint8_t *ip = *pip;
+    uint8_t b;
+
+    do {
+        if (ip >= iend)
+            return -1;
+        *plen += b = *ip++;
+    } while (b == 255);
+
+    *pip = ip;
+    return 0;
+}
+
+int lz4_decompress(const void *src, uint32_t len, void *dst, uint32_t dlen)
+{
+    const uint8_t *ip = src, *iend = ip + len, *ref;
+    uint8_t *op = dst, *oend = op + dlen;
+    uint32_t lit, mlen, off;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit = token >> 4;
+        if ((lit == 15) && get_len(&ip, iend, &lit))
+            return -1;
+        if ((lit > iend - ip) || (lit > oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if ((mlen == 15) && get_len(&ip, iend, &mlen))
+            return -1;
+        mlen += MIN_MATCH;
+        if ((off == 0) || (off > op - (uint8_t *)dst) || (mlen > oend - op))
+            return -1;
+        ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--)
+                *op++ = *ref++;
+        }
+    }
+
+    return (op == oend) ? 0 : -1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,210 @@
+/*
+ * libdisk/progress.c
+ *
+ * Progress events: one JSON object per line (NDJSON) as a run starts, as
+ * each track is done, and as the run ends, for dashboards which tail them.
+ *
+ *  {"event": "start", "tool": T, "name": N, "host": H, "pid": N,
+ *   "tracks": N}
+ *  {"event": "track", ... "track": "<cyl>.<head>", "tracknr": N,
+ *   "done": N, "elapsed_ms": N, "track_ms": N, "bytes": N,
+ *   "flux_per_sec": N, "mbit_per_sec": F, "eta_ms": N}
+ *  {"event": "end", ... "done": N, "elapsed_ms": N, "bytes": N,
+ *   "flux": N, "bitcells": N}
+ *
+ * bytes is the running total. The rates are over the track's own time, so
+ * that a slow track stands out; eta_ms is projected from the run so far.
+ * Every line is a single write, so that runs sharing a file or socket do not
+ * interleave. A reader which goes away ends the events, but not the run.
+ */
+
+#include <libdisk/util.h>
+#include <private/disk.h>
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct progress {
+    int fd;
+    bool_t sock;
+    pthread_mutex_t lock;
+    char label[512];
+    unsigned int nr_tracks, done;
+    uint64_t t0, bytes, flux, bc;
+};
+
+static uint64_t progress_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Copy @s into @p as the body of a JSON string. */
+static void put_str(char *p, size_t size, const char *s)
+{
+    char *end = p + size - 1;
+
+    for (; *s && (p < end - 1); s++) {
+        if ((*s == '"') || (*s == '\\'))
+            *p++ = '\\';
+        else if ((uint8_t)*s < 0x20)
+            continue;
+        *p++ = *s;
+    }
+    *p = '\0';
+}
+
+static int connect_socket(const char *path)
+{
+#if !defined(__MINGW32__)
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* Write one event. Caller holds p->lock. */
+static void progress_put(struct progress *p, const char *fmt, ...)
+{
+    char line[1024];
+    int len, rc;
+    va_list ap;
+
+    if (p->fd < 0)
+        return;
+
+    len = snprintf(line, sizeof(line), "{%s, ", p->label);
+    va_start(ap, fmt);
+    len += vsnprintf(&line[len], sizeof(line) - len, fmt, ap);
+    va_end(ap);
+    len = min_t(int, len, sizeof(line) - 3);
+    strcpy(&line[len], "}\n");
+    len += 2;
+
+#if !defined(__MINGW32__)
+    if (p->sock)
+        rc = send(p->fd, line, len, MSG_NOSIGNAL);
+    else
+#endif
+        rc = write(p->fd, line, len);
+    if (rc != len) {
+        warnx("Progress events stopped");
+        if (p->fd != STDERR_FILENO)
+            close(p->fd);
+        p->fd = -1;
+    }
+}
+
+struct progress *progress_open(const char *path, const char *tool,
+                               const char *name, unsigned int nr_tracks)
+{
+    char host[64] = "", ename[256];
+    struct progress *p;
+    struct stat st;
+    bool_t sock = 0;
+    int fd;
+
+    if (!strcmp(path, "-"))
+        fd = STDERR_FILENO;
+    else if ((stat(path, &st) == 0) && S_ISSOCK(st.st_mode))
+        sock = ((fd = connect_socket(path)) >= 0);
+    else
+        fd = file_open(path, O_WRONLY|O_CREAT|O_APPEND, 0666);
+    if (fd < 0)
+        return NULL;
+
+    (void)gethostname(host, sizeof(host) - 1);
+    put_str(ename, sizeof(ename), name);
+
+    p = memalloc(sizeof(*p));
+    p->fd = fd;
+    p->sock = sock;
+    pthread_mutex_init(&p->lock, NULL);
+    snprintf(p->label, sizeof(p->label),
+             "\"tool\": \"%s\", \"name\": \"%s\", \"host\": \"%s\", "
+             "\"pid\": %d", tool, ename, host, (int)getpid());
+    p->nr_tracks = nr_tracks;
+    p->t0 = progress_now();
+    progress_put(p, "\"event\": \"start\", \"tracks\": %u", nr_tracks);
+
+    return p;
+}
+
+void progress_track(struct progress *p, unsigned int tracknr, uint64_t nsecs,
+                    uint64_t bytes, uint64_t flux, uint64_t bitcells)
+{
+    uint64_t elapsed, eta = 0;
+    double secs = nsecs / 1e9;
+
+    if (p == NULL)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    elapsed = progress_now() - p->t0;
+    p->done++;
+    p->bytes += bytes;
+    p->flux += flux;
+    p->bc += bitcells;
+    if (p->done < p->nr_tracks)
+        eta = elapsed / p->done * (p->nr_tracks - p->done);
+    progress_put(p, "\"event\": \"track\", \"track\": \"%u.%u\", "
+                 "\"tracknr\": %u, \"done\": %u, \"elapsed_ms\": %"PRIu64", "
+                 "\"track_ms\": %"PRIu64", \"bytes\": %"PRIu64", "
+                 "\"flux_per_sec\": %"PRIu64", \"mbit_per_sec\": %.2f, "
+                 "\"eta_ms\": %"PRIu64,
+                 cyl(tracknr), hd(tracknr), tracknr, p->done,
+                 elapsed / 1000000, nsecs / 1000000, p->bytes,
+                 secs ? (uint64_t)(flux / secs) : 0,
+                 secs ? bitcells / secs / 1e6 : 0.0, eta / 1000000);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void progress_close(struct progress *p)
+{
+    if (p == NULL)
+        return;
+
+    progress_put(p, "\"event\": \"end\", \"done\": %u, \"elapsed_ms\": %"PRIu64
+                 ", \"bytes\": %"PRIu64", \"flux\": %"PRIu64
+                 ", \"bitcells\": %"PRIu64, p->done,
+                 (progress_now() - p->t0) / 1000000,
+                 p->bytes, p->flux, p->bc);
+    if ((p->fd >= 0) && (p->fd != STDERR_FILENO))
+        close(p->fd);
+    pthread_mutex_destroy(&p->lock);
+    memfree(p);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,5 +1,16 @@
 /*
  * stream/caps.c
+ *
+ * The CAPS/SPS library is not safe to call from many threads at once. Each
+ * stream's calls are instead made by a helper process of its own, so that
+ * streams on several threads decode in parallel. The helpers are forked by
+ * a pool process, which each process forks as it opens its first stream.
+ * A helper locks each track into memory shared with its stream. Without a
+ * pool, streams call the library themselves.
+ *
+ * The library is given each image in memory: a file is mapped, and an image
+ * already in memory (stream_open_mem()) is used in place, or copied to its
+ * helper.
  */
 
 #include <libdisk/util.h>
@@ -7,10 +18,19 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include <caps/capsimage.h>
 #include <dlfcn.h>
+#include <pthread.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #ifdef __APPLE__
 #define CAPSLIB_NAME    "/Library/Frameworks/CAPSImage.framework/CAPSImage"
@@ -21,16 +41,40 @@
 #define CAPS_FLAGS (DI_LOCK_DENVAR|DI_LOCK_DENNOISE|DI_LOCK_NOISE|      \
                     DI_LOCK_UPDATEFD|DI_LOCK_TYPE)
 
+/* Revolutions of a flakey track generated when it is selected. Each reset
+ * replays the next of them, rather than locking the track again. */
+#define NR_FLAKEY_REVS 8
+
+/* A locked track: its speed map, then its revolutions (more than one only if
+ * it is flakey), each tracklen bytes. It occupies at most CAPS_TRACK_BYTES. */
+struct caps_track {
+    uint32_t type, tracklen, timelen, nr_revs;
+    uint16_t speed[];
+};
+#define CAPS_TRACK_BYTES (1u << 20)
+#define track_bits(t) ((uint8_t *)&(t)->speed[(t)->timelen])
+
 struct caps_stream {
     struct stream s;
+    struct stream_src src;
+    struct stream_map map;
+
+    /* The image is open in the library in this process (container), or in
+     * a helper process (helper_fd). */
     CapsLong container;
+    int helper_fd;
+    FILE *shm;
+
+    /* Tracks are locked into the buffer which is not current, so that a
+     * failed lock modifies nothing. Shared with the helper, if any. */
+    struct caps_track *buf[2];
+    unsigned int cur;
 
     /* Current track info */
     unsigned int track;
-    uint8_t *bits;
-    uint16_t *speed;
-    uint32_t pos, bitlen, ns_per_cell;
-    struct CapsTrackInfoT1 ti;
+    struct bitcell_image im;
+    uint32_t pos, run;
+    unsigned int next_rev;
 };
 
 static struct {
@@ -81,14 +125,20 @@ static void print_library_download_info(void)
     w("See the Disk-Utilities/README for more help.\n");
 }
 
-static int get_capslib(void)
+/* Serialises library load/unload across streams opened on other threads. */
+static pthread_mutex_t capslib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void pool_stop(void);
+
+static int __get_capslib(bool_t quiet)
 {
     if (capslib.ref++)
         return 1;
 
 #ifdef __APPLE__
     if ((capslib.handle = dlopen(CAPSLIB_NAME, RTLD_LAZY)) == NULL) {
-        warnx("Unable to open " CAPSLIB_NAME);
+        if (!quiet)
+            warnx("Unable to open " CAPSLIB_NAME);
         goto fail_no_handle;
     }
     capslib.version = 5; /* guess */
@@ -98,7 +148,9 @@ static int get_capslib(void)
     } else if ((capslib.handle = dlopen(CAPSLIB_NAME ".4", RTLD_LAZY))) {
         capslib.version = 4;
     } else {
-        warnx("Unable to open " CAPSLIB_NAME ".5 or " CAPSLIB_NAME ".4");
+        if (!quiet)
+            warnx("Unable to open " CAPSLIB_NAME ".5 or "
+                  CAPSLIB_NAME ".4");
         goto fail_no_handle;
     }
 #endif
@@ -126,79 +178,474 @@ static int get_capslib(void)
 fail:
     dlclose(capslib.handle);
 fail_no_handle:
-    print_library_download_info();
+    if (!quiet)
+        print_library_download_info();
     --capslib.ref;
     return 0;
 }
 
-static void put_capslib(void)
+static int get_capslib(void)
 {
-    if (--capslib.ref)
-        return;
-    CAPSExit();
-    dlclose(capslib.handle);
+    int ok;
+    pthread_mutex_lock(&capslib_lock);
+    ok = __get_capslib(0);
+    pthread_mutex_unlock(&capslib_lock);
+    return ok;
 }
 
-static struct stream *caps_open(const char *name, unsigned int data_rpm)
+static void put_capslib(void)
 {
-    int fd;
-    char sig[4], suffix[8];
-    struct caps_stream *cpss;
+    pthread_mutex_lock(&capslib_lock);
+    if (--capslib.ref == 0) {
+        pool_stop();
+        CAPSExit();
+        dlclose(capslib.handle);
+    }
+    pthread_mutex_unlock(&capslib_lock);
+}
 
-    /* Simple signature check */
-    if ((fd = file_open(name, O_RDONLY)) == -1)
-        return NULL;
-    read_exact(fd, sig, 4);
-    close(fd);
-    if (strncmp(sig, "CAPS", 4))
-        return NULL;
+/* A reference which is never put: the library stays loaded. Streams are
+ * opened by forked jobs, each of which starts its own pool. */
+static void caps_preload(void)
+{
+    pthread_mutex_lock(&capslib_lock);
+    (void)__get_capslib(1);
+    pthread_mutex_unlock(&capslib_lock);
+}
 
-    if (!get_capslib())
-        return NULL;
+/* Open the image at @dat in a new container. The library references the
+ * image in place: it must remain until close_image(). */
+static CapsLong open_image(const void *dat, size_t len)
+{
+    CapsLong container;
 
-    cpss = memalloc(sizeof(*cpss));
-    cpss->track = ~0u;
+    if (len > UINT32_MAX) {
+        warnx("caps: Image too large");
+        return -1;
+    }
 
-    if ((cpss->container = CAPSAddImage()) < 0) {
+    if ((container = CAPSAddImage()) < 0) {
         warnx("caps: Could not create image container");
-        goto fail1;
+        return -1;
     }
 
-    if (CAPSLockImage(cpss->container, name) != imgeOk) {
+    if (CAPSLockImageMemory(container, (CapsUByte *)dat, len,
+                            DI_LOCK_MEMREF) != imgeOk) {
         warnx("caps: Could not load image into container");
-        goto fail2;
+        goto fail;
     }
 
-    if (CAPSLoadImage(cpss->container, CAPS_FLAGS) != imgeOk) {
+    if (CAPSLoadImage(container, CAPS_FLAGS) != imgeOk) {
         warnx("caps: Could not prefetch image data");
-        goto fail3;
+        CAPSUnlockImage(container);
+        goto fail;
+    }
+
+    return container;
+
+fail:
+    CAPSRemImage(container);
+    return -1;
+}
+
+static void close_image(CapsLong container)
+{
+    CAPSUnlockAllTracks(container);
+    CAPSUnlockImage(container);
+    CAPSRemImage(container);
+}
+
+/* Lock track @tracknr into @t. A flakey track differs on each lock
+ * (DI_LOCK_UPDATEFD): a set of revolutions is copied out, sharing the first
+ * lock's speed map. */
+static int lock_track(CapsLong container, unsigned int tracknr,
+                      struct caps_track *t)
+{
+    struct CapsTrackInfoT1 ti;
+    uint64_t room = CAPS_TRACK_BYTES - sizeof(*t);
+    unsigned int i;
+
+    memset(&ti, 0, sizeof(ti));
+    ti.type = 1;
+    if (CAPSLockTrack((struct CapsTrackInfo *)&ti, container,
+                      cyl(tracknr), hd(tracknr), CAPS_FLAGS))
+        return -1;
+    if ((uint64_t)ti.timelen * 2 + ti.tracklen > room)
+        return -1;
+
+    t->type = ti.type;
+    t->tracklen = ti.tracklen;
+    t->timelen = ti.timelen;
+    for (i = 0; i < ti.timelen; i++)
+        t->speed[i] = ti.timebuf[i];
+    room -= ti.timelen * 2;
+
+    for (t->nr_revs = 0;;) {
+        memcpy(&track_bits(t)[t->nr_revs++ * t->tracklen],
+               ti.trackbuf, t->tracklen);
+        if (!(t->type & CTIT_FLAG_FLAKEY) || (t->nr_revs == NR_FLAKEY_REVS)
+            || ((t->nr_revs + 1) * (uint64_t)t->tracklen > room))
+            break;
+        memset(&ti, 0, sizeof(ti));
+        ti.type = 1;
+        if (CAPSLockTrack((struct CapsTrackInfo *)&ti, container,
+                          cyl(tracknr), hd(tracknr), CAPS_FLAGS)
+            || (ti.tracklen != t->tracklen))
+            break;
+    }
+
+    return 0;
+}
+
+/* Open image file @src in a new container, mapping it into @m. */
+static CapsLong open_image_src(struct stream_src *src, struct stream_map *m)
+{
+    const void *dat = stream_src_map(src, m, 0, src->size);
+    return open_image(dat, src->size);
+}
+
+/*
+ * Helper processes. A stream's requests are answered in order, each by an
+ * int32_t result. CAPS_OPEN is followed by the image name (arg bytes).
+ * CAPS_OPEN_MEM opens the image in shared memory, after the track buffers.
+ */
+
+struct caps_req {
+    uint32_t op, arg, buf;
+};
+#define CAPS_OPEN     0
+#define CAPS_LOCK     1 /* arg: track number */
+#define CAPS_OPEN_MEM 2 /* arg: image length */
+
+static struct {
+    pid_t pid, owner;
+    int fd;
+} pool = { .fd = -1 };
+
+static int msg_read(int fd, void *buf, size_t len)
+{
+    ssize_t done;
+
+    while (len != 0) {
+        if ((done = read(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (done == 0)
+            return -1;
+        buf = (char *)buf + done;
+        len -= done;
     }
 
-    return &cpss->s;
+    return 0;
+}
 
-fail3:
-    CAPSUnlockImage(cpss->container);
-fail2:
-    CAPSRemImage(cpss->container);
-fail1:
-    if ((capslib.version < 5) && strcmp(suffix, "ipf")) {
+static int msg_write(int fd, const void *buf, size_t len)
+{
+    ssize_t done;
+
+    while (len != 0) {
+        if ((done = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + done;
+        len -= done;
+    }
+
+    return 0;
+}
+
+static void helper_main(int fd, int shm_fd)
+{
+    struct caps_track *buf[2];
+    struct caps_req req;
+    struct stream_src src;
+    struct stream_map map;
+    struct stat st;
+    CapsLong container = -1;
+    char name[4096];
+    uint8_t *p;
+    int32_t rc;
+
+    if ((fstat(shm_fd, &st) != 0) || (st.st_size < 2 * CAPS_TRACK_BYTES))
+        _exit(1);
+    p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (p == MAP_FAILED)
+        _exit(1);
+    buf[0] = (struct caps_track *)p;
+    buf[1] = (struct caps_track *)(p + CAPS_TRACK_BYTES);
+
+    while (msg_read(fd, &req, sizeof(req)) == 0) {
+        rc = -1;
+        switch (req.op) {
+        case CAPS_OPEN:
+            if ((req.arg >= sizeof(name))
+                || (msg_read(fd, name, req.arg) != 0))
+                goto out;
+            name[req.arg] = '\0';
+            if ((container < 0) && (stream_src_open(&src, name) == 0)
+                && ((container = open_image_src(&src, &map)) >= 0))
+                rc = 0;
+            break;
+        case CAPS_OPEN_MEM:
+            if ((container < 0)
+                && (req.arg <= st.st_size - 2 * CAPS_TRACK_BYTES)
+                && ((container = open_image(p + 2 * CAPS_TRACK_BYTES,
+                                            req.arg)) >= 0))
+                rc = 0;
+            break;
+        case CAPS_LOCK:
+            if ((container >= 0) && (req.buf < 2))
+                rc = lock_track(container, req.arg, buf[req.buf]);
+            break;
+        }
+        if (msg_write(fd, &rc, sizeof(rc)) != 0)
+            break;
+    }
+
+out:
+    if (container >= 0)
+        close_image(container);
+    _exit(0);
+}
+
+/* The pool process forks a helper for each (stream socket, shared memory)
+ * pair of descriptors it is sent. It exits with its owner. */
+static void pool_main(int fd)
+{
+    char c, cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2];
+
+    signal(SIGCHLD, SIG_IGN); /* helpers are not waited for */
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if (recvmsg(fd, &msg, 0) <= 0)
+            _exit(0);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if ((cmsg == NULL) || (cmsg->cmsg_type != SCM_RIGHTS)
+            || (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))))
+            continue;
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        if (fork() == 0) {
+            close(fd);
+            helper_main(fds[0], fds[1]);
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+/* Start this process's pool, as its first stream is opened: before
+ * analysis threads are started, so that the pool is forked single-threaded.
+ * Returns whether there is a pool. Caller holds capslib_lock. */
+static int pool_start(void)
+{
+    int sv[2];
+
+    if (pool.owner == getpid())
+        return (pool.fd >= 0);
+    /* A pool inherited across fork() is the parent's. */
+    if (pool.fd >= 0)
+        close(pool.fd);
+    pool.fd = -1;
+    pool.owner = getpid();
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        return 0;
+    if ((pool.pid = fork()) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+    if (pool.pid == 0) {
+        close(sv[0]);
+        pool_main(sv[1]);
+    }
+    close(sv[1]);
+    pool.fd = sv[0];
+    return 1;
+}
+
+/* Caller holds capslib_lock. */
+static void pool_stop(void)
+{
+    if ((pool.fd < 0) || (pool.owner != getpid()))
+        return;
+    close(pool.fd);
+    (void)waitpid(pool.pid, NULL, 0);
+    pool.fd = -1;
+    pool.owner = 0;
+}
+
+/* Give @cpss a helper with image @name open, or if @name is NULL, a copy of
+ * the image in memory. */
+static int helper_open(struct caps_stream *cpss, const char *name)
+{
+    off_t shm_size = 2 * CAPS_TRACK_BYTES;
+    char c = 0, cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct caps_req req;
+    int sv[2], fds[2], rc = -1;
+    int32_t res;
+    void *p;
+
+    if (name == NULL)
+        shm_size += cpss->src.size;
+    if ((cpss->shm = tmpfile()) == NULL)
+        return -1;
+    if ((ftruncate(fileno(cpss->shm), shm_size) != 0)
+        || ((name == NULL)
+            && (pwrite(fileno(cpss->shm), cpss->src.mem, cpss->src.size,
+                       2 * CAPS_TRACK_BYTES) != cpss->src.size))
+        || ((p = mmap(NULL, 2 * CAPS_TRACK_BYTES, PROT_READ|PROT_WRITE,
+                      MAP_SHARED, fileno(cpss->shm), 0)) == MAP_FAILED))
+        goto fail;
+    cpss->buf[0] = p;
+    cpss->buf[1] = (struct caps_track *)((uint8_t *)p + CAPS_TRACK_BYTES);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        goto fail;
+    fds[0] = sv[1];
+    fds[1] = fileno(cpss->shm);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    pthread_mutex_lock(&capslib_lock);
+    if (pool.fd >= 0)
+        rc = (sendmsg(pool.fd, &msg, MSG_NOSIGNAL) == 1) ? 0 : -1;
+    pthread_mutex_unlock(&capslib_lock);
+    close(sv[1]);
+    cpss->helper_fd = sv[0];
+    if (rc != 0)
+        goto fail;
+
+    req.op = name ? CAPS_OPEN : CAPS_OPEN_MEM;
+    req.arg = name ? strlen(name) : cpss->src.size;
+    req.buf = 0;
+    if ((msg_write(cpss->helper_fd, &req, sizeof(req)) != 0)
+        || (name && (msg_write(cpss->helper_fd, name, req.arg) != 0))
+        || (msg_read(cpss->helper_fd, &res, sizeof(res)) != 0)
+        || (res != 0))
+        goto fail;
+
+    return 0;
+
+fail:
+    if (cpss->helper_fd >= 0)
+        close(cpss->helper_fd);
+    cpss->helper_fd = -1;
+    if (cpss->buf[0] != NULL)
+        munmap(cpss->buf[0], 2 * CAPS_TRACK_BYTES);
+    cpss->buf[0] = cpss->buf[1] = NULL;
+    fclose(cpss->shm);
+    cpss->shm = NULL;
+    return -1;
+}
+
+/* Open image @src, named @name if it is a file. */
+static struct stream *caps_open_src(struct stream_src *src, const char *name)
+{
+    int pooled;
+    char sig[4], suffix[8];
+    struct caps_stream *cpss;
+
+    /* Simple signature check */
+    stream_src_read(src, 0, sig, 4);
+    if (strncmp(sig, "CAPS", 4) || !get_capslib()) {
+        stream_src_close(src);
+        return NULL;
+    }
+
+    cpss = memalloc(sizeof(*cpss));
+    cpss->src = *src;
+    cpss->track = ~0u;
+    cpss->container = -1;
+    cpss->helper_fd = -1;
+
+    pthread_mutex_lock(&capslib_lock);
+    pooled = pool_start();
+    pthread_mutex_unlock(&capslib_lock);
+
+    if (pooled) {
+        if (helper_open(cpss, name) == 0)
+            return &cpss->s;
+    } else if ((cpss->container = (name ? open_image_src(src, &cpss->map)
+                                   : open_image(src->mem, src->size))) >= 0) {
+        cpss->buf[0] = memalloc(CAPS_TRACK_BYTES);
+        cpss->buf[1] = memalloc(CAPS_TRACK_BYTES);
+        return &cpss->s;
+    }
+
+    if (name != NULL)
+        filename_extension(name, suffix, sizeof(suffix));
+    if ((capslib.version < 5) && name && strcmp(suffix, "ipf")) {
         w("CT Raw image files require v5+ of the CAPS/SPS library\n");
         print_library_download_info();
     }
+    stream_unmap(&cpss->map);
+    stream_src_close(&cpss->src);
     memfree(cpss);
     put_capslib();
-    filename_extension(name, suffix, sizeof(suffix));
-        
     return NULL;
 }
 
+static struct stream *caps_open(const char *name, unsigned int data_rpm)
+{
+    struct stream_src src;
+
+    if (stream_src_open(&src, name) == -1)
+        return NULL;
+    return caps_open_src(&src, name);
+}
+
+static struct stream *caps_open_mem(
+    const void *dat, size_t len, unsigned int data_rpm)
+{
+    struct stream_src src;
+
+    stream_src_mem(&src, dat, len);
+    return caps_open_src(&src, NULL);
+}
+
 static void caps_close(struct stream *s)
 {
     struct caps_stream *cpss = container_of(s, struct caps_stream, s);
-    CAPSUnlockAllTracks(cpss->container);
-    CAPSUnlockImage(cpss->container);
-    CAPSRemImage(cpss->container);
-    memfree(cpss->speed);
+
+    if (cpss->helper_fd >= 0) {
+        /* The helper exits as its socket closes. */
+        close(cpss->helper_fd);
+        munmap(cpss->buf[0], 2 * CAPS_TRACK_BYTES);
+        fclose(cpss->shm);
+    } else {
+        close_image(cpss->container);
+        memfree(cpss->buf[0]);
+        memfree(cpss->buf[1]);
+    }
+    stream_unmap(&cpss->map);
+    stream_src_close(&cpss->src);
+    memfree(cpss->im.runs);
     memfree(cpss);
     put_capslib();
 }
@@ -206,30 +653,52 @@ static void caps_close(struct stream *s)
 static int caps_select_track(struct stream *s, unsigned int tracknr)
 {
     struct caps_stream *cpss = container_of(s, struct caps_stream, s);
-    struct CapsTrackInfoT1 ti;
-    unsigned int i;
-    int rc;
-
-    /* Attempt to load one track revolution. Modify nothing on failure. */
-    memset(&ti, 0, sizeof(ti));
-    ti.type = 1;
-    rc = CAPSLockTrack((struct CapsTrackInfo *)&ti, cpss->container,
-                       cyl(tracknr), hd(tracknr), CAPS_FLAGS);
+    struct caps_track *t = cpss->buf[!cpss->cur];
+    struct caps_req req;
+    unsigned int i, n, sp, prev;
+    int32_t rc;
+
+    /* Lock into the spare buffer. Modify nothing on failure. */
+    if (cpss->helper_fd >= 0) {
+        req.op = CAPS_LOCK;
+        req.arg = tracknr;
+        req.buf = !cpss->cur;
+        if ((msg_write(cpss->helper_fd, &req, sizeof(req)) != 0)
+            || (msg_read(cpss->helper_fd, &rc, sizeof(rc)) != 0))
+            rc = -1;
+    } else {
+        rc = lock_track(cpss->container, tracknr, t);
+    }
     if (rc)
         return -1;
 
     /* Commit new track info. */
-    memcpy(&cpss->ti, &ti, sizeof(ti));
+    cpss->cur = !cpss->cur;
     cpss->track = tracknr;
 
-    /* Commit new speed/density info. */
-    memfree(cpss->speed);
-    cpss->speed = NULL;
-    if (cpss->ti.timelen) {
-        cpss->speed = memalloc(cpss->ti.timelen * sizeof(uint16_t));
-        for (i = 0; i < cpss->ti.timelen; i++)
-            cpss->speed[i] = cpss->ti.timebuf[i];
+    /* Bitcell period of each run of bytes of equal speed. Every revolution
+     * of a flakey track is the same length, and shares the speed map. */
+    cpss->im.bitlen = t->tracklen * 8;
+    cpss->im.ns_per_cell = track_nsecs_from_rpm(s->data_rpm) / cpss->im.bitlen;
+    for (i = n = 0, prev = ~0u; i < t->tracklen; i++) {
+        sp = (i < t->timelen) ? t->speed[i] : 1000u;
+        n += (sp != prev);
+        prev = sp;
     }
+    memfree(cpss->im.runs);
+    cpss->im.runs = memalloc(n * sizeof(*cpss->im.runs));
+    cpss->im.nr_runs = n;
+    for (i = n = 0, prev = ~0u; i < t->tracklen; i++) {
+        sp = (i < t->timelen) ? t->speed[i] : 1000u;
+        if (sp != prev) {
+            cpss->im.runs[n].start = i * 8;
+            cpss->im.runs[n].ns = (cpss->im.ns_per_cell * sp) / 1000u;
+            n++;
+        }
+        prev = sp;
+    }
+    s->bc_image = &cpss->im;
+    cpss->next_rev = 0;
 
     return 0;
 }
@@ -237,44 +706,44 @@ static int caps_select_track(struct stream *s, unsigned int tracknr)
 static void caps_reset(struct stream *s)
 {
     struct caps_stream *cpss = container_of(s, struct caps_stream, s);
+    struct caps_track *t = cpss->buf[cpss->cur];
 
-    if (cpss->ti.type & CTIT_FLAG_FLAKEY)
-        (void)caps_select_track(s, cpss->track);
-
-    cpss->bits = cpss->ti.trackbuf;
-    cpss->bitlen = cpss->ti.tracklen * 8;
-    cpss->pos = 0;
-    cpss->ns_per_cell = track_nsecs_from_rpm(s->data_rpm) / cpss->bitlen;
+    /* Each reset of a flakey track replays its next revolution. */
+    if (t->type & CTIT_FLAG_FLAKEY) {
+        stream_cache_invalidate(s);
+        cpss->im.bits = &track_bits(t)[cpss->next_rev * t->tracklen];
+        cpss->next_rev = (cpss->next_rev + 1) % t->nr_revs;
+    } else {
+        cpss->im.bits = track_bits(t);
+    }
+    cpss->pos = cpss->run = 0;
 }
 
 static int caps_next_flux(struct stream *s)
 {
     struct caps_stream *cpss = container_of(s, struct caps_stream, s);
-    uint16_t speed;
-    uint8_t dat;
+    uint32_t pos = cpss->pos + 1;
     int flux = 0;
 
-    do {
-        if (++cpss->pos >= cpss->bitlen) {
-            caps_reset(s);
-            s->ns_to_index = s->flux + flux;
-        }
-        dat = !!(cpss->bits[cpss->pos >> 3] & (0x80u >> (cpss->pos & 7)));
-        speed = ((cpss->pos >> 3) < cpss->ti.timelen)
-            ? cpss->speed[cpss->pos >> 3] : 1000u;
-        flux += (cpss->ns_per_cell * speed) / 1000u;
-    } while (!dat && (flux < 1000000 /* 1ms */));
+    while (bitcell_image_flux(&cpss->im, &pos, &cpss->run, &flux)) {
+        caps_reset(s);
+        pos = 0;
+        s->ns_to_index = s->flux + flux;
+    }
 
+    cpss->pos = pos - 1;
     s->flux += flux;
     return 0;
 }
 
 struct stream_type caps = {
     .open = caps_open,
+    .open_mem = caps_open_mem,
     .close = caps_close,
     .select_track = caps_select_track,
     .reset = caps_reset,
     .next_flux = caps_next_flux,
+    .preload = caps_preload,
     .suffix = { "ipf", "ct", "ctr", "raw", NULL }
 };
 
@@ -16,45 +16,36 @@
 
 struct dfe2_stream {
     struct stream s;
-    int fd;
+    struct stream_src src;
 
     /* Current track number. */
     unsigned int track;
 
-    /* Raw track data. */
-    unsigned char *dat;      /* track data */
+    /* Raw track data, mapped from the image. */
+    struct stream_map map;
+    const unsigned char *dat; /* track data */
     unsigned int datsz;      /* track size */
-    unsigned int filesz;     /* file size */
+    off_t dat_off;           /* image offset of track data */
 
     unsigned int dat_idx;    /* current index into dat[] */
     unsigned int stream_idx; /* current index into non-OOB data in dat[] */
     unsigned int index_pos;  /* stream_idx position of next index pulse */
 
+    /* Acquisition clock, once found from a track's index period: it is the
+     * same for every track of the file. */
     unsigned int acq_freq;
+    uint32_t ps_per_tick;
 };
 
 #define DRIVE_SPEED_UNCERTAINTY 0.05
 #define MHZ(x) ((x) * 1000000)
-#define SCK_PS_PER_TICK (1000000000/(dfss->acq_freq/1000))
 
-static struct stream *dfe2_open(const char *name, unsigned int data_rpm)
+static struct stream *dfe2_open_src(struct stream_src *src, const char *name)
 {
-    struct stat sbuf;
     struct dfe2_stream *dfss;
     char magic[4];
-    int fd, filesz;
-
-    if (stat(name, &sbuf) < 0)
-        return NULL;
 
-    if ((fd = file_open(name, O_RDONLY)) == -1)
-        err(1, "%s", name);
-
-    read_exact(fd, magic, sizeof(magic));
-
-    if (((filesz = lseek(fd, 0, SEEK_END)) < 0) ||
-        (lseek(fd, 0, SEEK_SET) < 0))
-        err(1, "%s", name);
+    stream_src_read(src, 0, magic, sizeof(magic));
 
     if (memcmp(magic, "DFER", sizeof(magic)) == 0)
         errx(1, "Old-style DFI not supported!");
@@ -62,17 +53,39 @@ static struct stream *dfe2_open(const char *name, unsigned int data_rpm)
         errx(1, "%s is not a DFI file!", name);
 
     dfss = memalloc(sizeof(*dfss));
-    dfss->fd = fd;
-    dfss->filesz = filesz;
+    dfss->src = *src;
 
     return &dfss->s;
 }
 
+static struct stream *dfe2_open(const char *name, unsigned int data_rpm)
+{
+    struct stat sbuf;
+    struct stream_src src;
+
+    if (stat(name, &sbuf) < 0)
+        return NULL;
+
+    if (stream_src_open(&src, name) == -1)
+        err(1, "%s", name);
+
+    return dfe2_open_src(&src, name);
+}
+
+static struct stream *dfe2_open_mem(
+    const void *dat, size_t len, unsigned int data_rpm)
+{
+    struct stream_src src;
+
+    stream_src_mem(&src, dat, len);
+    return dfe2_open_src(&src, "DFI image");
+}
+
 static void dfe2_close(struct stream *s)
 {
     struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
-    close(dfss->fd);
-    memfree(dfss->dat);
+    stream_src_close(&dfss->src);
+    stream_unmap(&dfss->map);
     memfree(dfss);
 }
 
@@ -84,11 +97,11 @@ static bool_t check_freq(uint32_t index_pos, uint32_t freq)
             < (freq * DRIVE_SPEED_UNCERTAINTY));
 }
 
-/* Ugly heuristic to guess acq frequency */
+/* Ugly heuristic to guess acq frequency. Returns 0 if none fits. */
 static unsigned int dfe2_find_acq_freq(struct stream *s)
 {
     struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
-    unsigned char *dat = dfss->dat;
+    const unsigned char *dat = dfss->dat;
 
     unsigned int i = 0;
     uint32_t carry = 0;
@@ -123,9 +136,7 @@ static unsigned int dfe2_find_acq_freq(struct stream *s)
         return MHZ(50);
     if (check_freq(index_pos, MHZ(100)))
         return MHZ(100);
-    fprintf(stderr, "Cannot determine acq frequency! Maybe you used a "
-            "nonstandard drive! Using default of 50MHz.\n");
-    return MHZ(50);
+    return 0;
 }
 
 static int dfe2_select_track(struct stream *s, unsigned int tracknr)
@@ -139,18 +150,19 @@ static int dfe2_select_track(struct stream *s, unsigned int tracknr)
     uint16_t head = 0;
     uint16_t sector = 0;
     uint32_t data_length = 0;
+    off_t off = 4;
     
     if (dfss->dat && (dfss->track == tracknr))
         return 0;
 
-    memfree(dfss->dat);
+    stream_unmap(&dfss->map);
     dfss->dat = NULL;
     
-    lseek(dfss->fd, 4, SEEK_SET);
     for (curtrack = 0; curtrack <= tracknr; curtrack++) {
-        if (lseek(dfss->fd, data_length, SEEK_CUR) >= dfss->filesz)
+        if ((off += data_length) >= dfss->src.size)
             return -1;
-        read_exact(dfss->fd, header, 10);
+        stream_src_read(&dfss->src, off, header, 10);
+        off += 10;
         cyl = be16toh(*(uint16_t *)&header[0]);
         head = be16toh(*(uint16_t *)&header[2]);
         sector = be16toh(*(uint16_t *)&header[4]);
@@ -162,23 +174,37 @@ static int dfe2_select_track(struct stream *s, unsigned int tracknr)
         errx(1, "Hard sectored disks are not supported!\n");
 
     dfss->datsz = data_length;
-    dfss->dat = memalloc(data_length);
-    read_exact(dfss->fd, dfss->dat, data_length);
+    dfss->dat_off = off;
+    dfss->dat = stream_src_map(&dfss->src, &dfss->map, off, data_length);
 
     dfss->track = tracknr;
-    dfss->acq_freq = dfe2_find_acq_freq(&dfss->s);
+    if (!dfss->acq_freq && !(dfss->acq_freq = dfe2_find_acq_freq(s)))
+        fprintf(stderr, "Cannot determine acq frequency! Maybe you used a "
+                "nonstandard drive! Using default of 50MHz.\n");
+    dfss->ps_per_tick = 1000000000/((dfss->acq_freq ?: MHZ(50))/1000);
 
     s->max_revolutions = ~0u;
     return 0;
 }
 
+static void dfe2_prefetch(struct stream *s, unsigned int tracknr)
+{
+    struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
+
+    /* Tracks are found by walking the file, so only the one immediately
+     * following is cheap to locate. Guess it is the same size as this one. */
+    if ((dfss->dat == NULL) || (tracknr != dfss->track + 1))
+        return;
+    stream_src_readahead(&dfss->src, dfss->dat_off + dfss->datsz,
+                         10 + dfss->datsz);
+}
+
 static void dfe2_reset(struct stream *s)
 {
     struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
 
     dfss->dat_idx = dfss->stream_idx = 0;
     dfss->index_pos = ~0u;
-    lseek(dfss->fd, 0, SEEK_SET);
 }
 
 static int dfe2_next_flux(struct stream *s)
@@ -186,7 +212,7 @@ static int dfe2_next_flux(struct stream *s)
     struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
 
     unsigned int i = dfss->dat_idx; 
-    unsigned char *dat = dfss->dat;
+    const unsigned char *dat = dfss->dat;
 
     uint32_t carry = 0;
     uint32_t abspos = dfss->stream_idx;
@@ -228,18 +254,34 @@ static int dfe2_next_flux(struct stream *s)
     if (!done)
         return -1;
 
-    val = (val * (uint32_t)SCK_PS_PER_TICK) / 1000u;
+    val = (val * dfss->ps_per_tick) / 1000u;
     val = (val * s->drive_rpm) / s->data_rpm;
     s->flux += val;
     return 0;
 }
 
+static struct stream *dfe2_clone(struct stream *s)
+{
+    struct dfe2_stream *dfss = container_of(s, struct dfe2_stream, s);
+    struct dfe2_stream *c;
+
+    if (dfss->dat == NULL)
+        return NULL;
+
+    c = memalloc(sizeof(*c));
+    *c = *dfss;
+    return &c->s;
+}
+
 struct stream_type discferret_dfe2 = {
     .open = dfe2_open,
+    .open_mem = dfe2_open_mem,
     .close = dfe2_close,
     .select_track = dfe2_select_track,
     .reset = dfe2_reset,
     .next_flux = dfe2_next_flux,
+    .clone = dfe2_clone,
+    .prefetch = dfe2_prefetch,
     .suffix = { "dfi", NULL }
 
 };
@@ -22,7 +22,8 @@ struct di_stream {
     /* Current track info */
     unsigned int track;
     struct track_raw *track_raw;
-    uint32_t pos, ns_per_cell;
+    struct bitcell_image im;
+    uint32_t pos, run;
 };
 
 static struct stream *di_open(const char *name, unsigned int data_rpm)
@@ -46,6 +47,7 @@ static void di_close(struct stream *s)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
     track_free_raw_buffer(dis->track_raw);
+    memfree(dis->im.runs);
     disk_close(dis->d);
     memfree(dis);
 }
@@ -53,17 +55,38 @@ static void di_close(struct stream *s)
 static int di_select_track(struct stream *s, unsigned int tracknr)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
+    struct track_raw *raw;
+    uint32_t i, ns_per_cell;
+    uint16_t speed;
 
     if (dis->track == tracknr)
         return 0;
 
     dis->track = ~0u;
+    s->bc_image = NULL;
     track_read_raw(dis->track_raw, tracknr);
     if (dis->track_raw->bits == NULL)
         return -1;
     dis->track = tracknr;
-    dis->ns_per_cell = (track_nsecs_from_rpm(s->data_rpm)
-                        / dis->track_raw->bitlen);
+
+    /* Bitcell period of each speed run. Weak bits are clocked at SPEED_AVG. */
+    raw = dis->track_raw;
+    ns_per_cell = track_nsecs_from_rpm(s->data_rpm) / raw->bitlen;
+    memfree(dis->im.runs);
+    dis->im.bits = raw->bits;
+    dis->im.bitlen = raw->bitlen;
+    dis->im.ns_per_cell = ns_per_cell;
+    dis->im.nr_runs = max(raw->nr_speed_runs, 1u);
+    dis->im.runs = memalloc(dis->im.nr_runs * sizeof(*dis->im.runs));
+    dis->im.runs[0].ns = ns_per_cell;
+    for (i = 0; i < raw->nr_speed_runs; i++) {
+        speed = raw->speed_runs[i].speed;
+        if (speed == SPEED_WEAK)
+            speed = SPEED_AVG;
+        dis->im.runs[i].start = raw->speed_runs[i].start;
+        dis->im.runs[i].ns = (ns_per_cell * speed) / SPEED_AVG;
+    }
+    s->bc_image = &dis->im;
 
     return 0;
 }
@@ -72,47 +95,60 @@ static void di_reset(struct stream *s)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
 
-    if (dis->track_raw->has_weak_bits) {
+    if (dis->track_raw->weak_runs != NULL) {
+        /* Only the weak regions change: generate them afresh in place. */
+        stream_cache_invalidate(s);
+        track_raw_regen_weak(dis->track_raw);
+    } else if (dis->track_raw->has_weak_bits) {
         unsigned int tracknr = dis->track;
+        stream_cache_invalidate(s);
         dis->track = ~0u;
         if (di_select_track(s, tracknr))
             BUG();
     }
 
-    dis->pos = 0;
+    dis->pos = dis->run = 0;
 }
 
 static int di_next_flux(struct stream *s)
 {
     struct di_stream *dis = container_of(s, struct di_stream, s);
-    uint16_t speed;
-    uint8_t dat;
+    uint32_t pos = dis->pos + 1;
     int flux = 0;
 
-    do {
-        if (++dis->pos >= dis->track_raw->bitlen) {
-            di_reset(s);
-            s->ns_to_index = s->flux + flux;
-        }
-        dat = !!(dis->track_raw->bits[dis->pos >> 3]
-                 & (0x80u >> (dis->pos & 7)));
-        speed = dis->track_raw->speed[dis->pos];
-        if (speed == SPEED_WEAK)
-            speed = SPEED_AVG;
-        flux += (dis->ns_per_cell * speed) / SPEED_AVG;
-    } while (!dat && (flux < 1000000 /* 1ms */));
+    while (bitcell_image_flux(&dis->im, &pos, &dis->run, &flux)) {
+        di_reset(s);
+        pos = 0;
+        s->ns_to_index = s->flux + flux;
+    }
 
+    dis->pos = pos - 1;
     s->flux += flux;
     return 0;
 }
 
+static struct stream *di_clone(struct stream *s)
+{
+    struct di_stream *dis = container_of(s, struct di_stream, s);
+    struct di_stream *c;
+
+    /* Weak bits are regenerated into the track buffer on every reset. */
+    if ((dis->track == ~0u) || dis->track_raw->has_weak_bits)
+        return NULL;
+
+    c = memalloc(sizeof(*c));
+    *c = *dis;
+    return &c->s;
+}
+
 struct stream_type disk_image = {
     .open = di_open,
     .close = di_close,
     .select_track = di_select_track,
     .reset = di_reset,
     .next_flux = di_next_flux,
-    .suffix = { "adf", "eadf", "dsk", "hfe", "imd", "img", NULL }
+    .clone = di_clone,
+    .suffix = { "adf", "eadf", "dsk", "hfe", "imd", "img", "ipf", NULL }
 };
 
 /*
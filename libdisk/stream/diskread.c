@@ -18,11 +18,13 @@ struct dr_stream {
     struct stream s;
     int fd;
 
-    /* Current track number. */
-    unsigned int track;
+    /* Current track number, and number of tracks in the file. */
+    unsigned int track, nr_tracks;
 
-    /* Raw track data. */
-    unsigned char *dat;
+    /* Raw track data, mapped from the file. Each track holds as many
+     * revolutions as were streamed in the time taken to fill it. */
+    struct stream_map map;
+    const unsigned char *dat;
 
     unsigned int dat_idx;    /* current index into dat[] */
     uint8_t b, bpos;
@@ -43,7 +45,10 @@ static struct stream *dr_open(const char *name, unsigned int data_rpm)
     struct dr_stream *drs;
     int fd;
 
-    if ((stat(name, &sbuf) < 0) || (sbuf.st_size != BYTES_PER_FILE))
+    /* A dump cut short (e.g., between batches) holds fewer tracks. */
+    if ((stat(name, &sbuf) < 0) || (sbuf.st_size == 0)
+        || (sbuf.st_size > BYTES_PER_FILE)
+        || (sbuf.st_size % BYTES_PER_TRACK))
         return NULL;
 
     if ((fd = file_open(name, O_RDONLY)) == -1)
@@ -51,7 +56,7 @@ static struct stream *dr_open(const char *name, unsigned int data_rpm)
 
     drs = memalloc(sizeof(*drs));
     drs->fd = fd;
-    drs->dat = memalloc(BYTES_PER_TRACK);
+    drs->nr_tracks = sbuf.st_size / BYTES_PER_TRACK;
     drs->track = ~0u;
 
     return &drs->s;
@@ -60,8 +65,8 @@ static struct stream *dr_open(const char *name, unsigned int data_rpm)
 static void dr_close(struct stream *s)
 {
     struct dr_stream *drs = container_of(s, struct dr_stream, s);
+    stream_unmap(&drs->map);
     close(drs->fd);
-    memfree(drs->dat);
     memfree(drs);
 }
 
@@ -72,17 +77,27 @@ static int dr_select_track(struct stream *s, unsigned int tracknr)
     if (drs->track == tracknr)
         return 0;
 
-    if (tracknr >= TRACKS_PER_FILE)
+    if (tracknr >= drs->nr_tracks)
         return -1;
 
-    lseek(drs->fd, tracknr*BYTES_PER_TRACK, SEEK_SET);
-    read_exact(drs->fd, drs->dat, BYTES_PER_TRACK);
+    stream_unmap(&drs->map);
+    drs->dat = stream_map(&drs->map, drs->fd,
+                          (off_t)tracknr*BYTES_PER_TRACK, BYTES_PER_TRACK);
     drs->track = tracknr;
 
     s->max_revolutions = ~0u;
     return 0;
 }
 
+static void dr_prefetch(struct stream *s, unsigned int tracknr)
+{
+    struct dr_stream *drs = container_of(s, struct dr_stream, s);
+
+    if (tracknr < drs->nr_tracks)
+        stream_readahead(drs->fd, (off_t)tracknr*BYTES_PER_TRACK,
+                         BYTES_PER_TRACK);
+}
+
 static void dr_reset(struct stream *s)
 {
     struct dr_stream *drs = container_of(s, struct dr_stream, s);
@@ -128,6 +143,7 @@ struct stream_type diskread = {
     .open = dr_open,
     .close = dr_close,
     .select_track = dr_select_track,
+    .prefetch = dr_prefetch,
     .reset = dr_reset,
     .next_flux = dr_next_flux,
     .suffix = { "dat", NULL }
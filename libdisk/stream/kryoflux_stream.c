@@ -3,6 +3,11 @@
  * 
  * Parse KryoFlux STREAM format, as read directly from the device.
  * 
+ * The per-track files may also be packed into a single (uncompressed) tar
+ * archive, which is indexed once on open and read with a single descriptor,
+ * or be held in caller memory (see stream_open_kryoflux_mem()). Track files
+ * may be read while DTC is still writing them (see stream->wait_secs).
+ * 
  * Written in 2011 by Keir Fraser
  */
 
@@ -14,20 +19,42 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+/* Location of a track file within a tar archive. */
+struct kfs_member {
+    off_t off;
+    uint32_t sz;
+};
+
 struct kfs_stream {
     struct stream s;
     char *basename;
 
+    /* Tar archive of track files, indexed by track number. */
+    int tar_fd;
+    struct kfs_member *member;
+    unsigned int nr_members;
+
+    /* Track files in caller memory. */
+    int (*get_track)(void *opaque, unsigned int tracknr,
+                     const void **dat, size_t *len);
+    void *opaque;
+
     /* Current track number. */
     unsigned int track;
 
-    /* Raw track data. */
-    unsigned char *dat;
-    unsigned int datsz;
+    /* A wait for a track file timed out: do not wait for later tracks. */
+    bool_t capture_ended;
 
-    unsigned int dat_idx;    /* current index into dat[] */
-    unsigned int stream_idx; /* current index into non-OOB data in dat[] */
-    unsigned int index_pos;  /* stream_idx position of next index pulse */
+    /* Capture device, from the first KFInfo block parsed. */
+    char device[64];
+
+    /* Flux intervals (ns) parsed from the track file, and the interval
+     * numbers before which an index pulse is signalled. Shared by clones. */
+    uint32_t *flux, *index;
+    unsigned int nr_flux, nr_index;
+
+    unsigned int flux_pos;   /* next entry in flux[] */
+    unsigned int index_pos;  /* next entry in index[] */
 };
 
 #define MCK_FREQ (((18432000 * 73) / 14) / 2)
@@ -35,12 +62,108 @@ struct kfs_stream {
 #define ICK_FREQ (MCK_FREQ / 16)
 #define SCK_PS_PER_TICK (1000000000/(SCK_FREQ/1000))
 
+#define KFS_POLL_MS 100
+
+/* Parse an octal tar header field. */
+static uint32_t tar_octal(const char *p, unsigned int len)
+{
+    uint32_t val = 0;
+
+    while (len-- && (*p == ' '))
+        p++;
+    while (len-- && (*p >= '0') && (*p <= '7'))
+        val = (val << 3) | (*p++ - '0');
+    return val;
+}
+
+/* Index every member of the archive named <prefix>NN.S.raw, where <prefix>
+ * is shared with the first such member. */
+static struct stream *kfs_open_tar(const char *name)
+{
+    unsigned char hdr[512];
+    char mname[260], *prefix = NULL;
+    struct kfs_stream *kfss;
+    unsigned int cyl, hd, tracknr, len, n;
+    uint32_t sz;
+    off_t off = 0;
+    int fd;
+
+    if ((fd = file_open(name, O_RDONLY)) == -1)
+        return NULL;
+
+    kfss = memalloc(sizeof(*kfss));
+    kfss->tar_fd = fd;
+
+    while ((lseek(fd, off, SEEK_SET) == off)
+           && (read(fd, hdr, sizeof(hdr)) == sizeof(hdr))
+           && (hdr[0] != '\0')) {
+        off += sizeof(hdr);
+        sz = tar_octal((char *)&hdr[124], 12);
+
+        /* Regular files only. Long names are absent from real dumps. */
+        if ((hdr[156] != '0') && (hdr[156] != '\0'))
+            goto next;
+
+        /* POSIX ustar splits long paths into prefix/name. */
+        if (!memcmp(&hdr[257], "ustar", 5) && (hdr[345] != '\0'))
+            snprintf(mname, sizeof(mname), "%.155s/%.100s",
+                     (char *)&hdr[345], (char *)hdr);
+        else
+            snprintf(mname, sizeof(mname), "%.100s", (char *)hdr);
+
+        if (((len = strlen(mname)) < 8)
+            || (sscanf(&mname[len-8], "%2u.%1u.raw%n", &cyl, &hd, &n) != 2)
+            || (n != 8))
+            goto next;
+        mname[len-8] = '\0';
+        if (prefix == NULL) {
+            prefix = memalloc(len - 7);
+            strcpy(prefix, mname);
+        } else if (strcmp(prefix, mname)) {
+            goto next;
+        }
+
+        tracknr = cyl*2 + hd;
+        if (tracknr >= kfss->nr_members) {
+            struct kfs_member *old = kfss->member;
+            kfss->member = memalloc((tracknr + 1) * sizeof(*kfss->member));
+            if (old != NULL) {
+                memcpy(kfss->member, old,
+                       kfss->nr_members * sizeof(*kfss->member));
+                memfree(old);
+            }
+            kfss->nr_members = tracknr + 1;
+        }
+        kfss->member[tracknr].off = off;
+        kfss->member[tracknr].sz = sz;
+
+    next:
+        off += (sz + 511) & ~511u;
+    }
+
+    if (prefix == NULL) {
+        warnx("%s: No Kryoflux STREAM files in archive", name);
+        close(fd);
+        memfree(kfss);
+        return NULL;
+    }
+
+    kfss->basename = prefix;
+    return &kfss->s;
+}
+
 static struct stream *kfs_open(const char *name, unsigned int data_rpm)
 {
     char track0[strlen(name) + 9];
     struct stat sbuf;
     struct kfs_stream *kfss;
     char *basename;
+    char suffix[8];
+
+    filename_extension(name, suffix, sizeof(suffix));
+    if (!strcmp(suffix, "tar") && (stat(name, &sbuf) == 0)
+        && !S_ISDIR(sbuf.st_mode))
+        return kfs_open_tar(name);
 
     basename = memalloc(strlen(name) + 2);
     strcpy(basename, name);
@@ -55,140 +178,353 @@ static struct stream *kfs_open(const char *name, unsigned int data_rpm)
 
     kfss = memalloc(sizeof(*kfss));
     kfss->basename = basename;
+    kfss->tar_fd = -1;
 
     return &kfss->s;
 }
 
+struct stream *kfs_open_mem(
+    int (*get_track)(void *opaque, unsigned int tracknr,
+                     const void **dat, size_t *len),
+    void *opaque)
+{
+    struct kfs_stream *kfss = memalloc(sizeof(*kfss));
+
+    kfss->basename = memalloc(1); /* "": there are no track file names */
+    kfss->tar_fd = -1;
+    kfss->get_track = get_track;
+    kfss->opaque = opaque;
+
+    return &kfss->s;
+}
+
+static void kfs_free_track(struct kfs_stream *kfss)
+{
+    memfree(kfss->flux);
+    memfree(kfss->index);
+    kfss->flux = kfss->index = NULL;
+    kfss->nr_flux = kfss->nr_index = 0;
+}
+
 static void kfs_close(struct stream *s)
 {
     struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
-    memfree(kfss->dat);
+    kfs_free_track(kfss);
+    if (kfss->tar_fd != -1)
+        close(kfss->tar_fd);
+    memfree(kfss->member);
     memfree(kfss->basename);
     memfree(kfss);
 }
 
+static void kfs_push(uint32_t **p, unsigned int *nr, uint32_t val)
+{
+    if ((*nr & (*nr - 1)) == 0) {
+        uint32_t *old = *p;
+        *p = memalloc((*nr ? *nr * 2 : 1024) * sizeof(**p));
+        if (old != NULL) {
+            memcpy(*p, old, *nr * sizeof(**p));
+            memfree(old);
+        }
+    }
+    (*p)[(*nr)++] = val;
+}
+
+/* Note the device named by a KFInfo block: a list of "key=value" pairs, of
+ * which those that identify the hardware are kept. */
+static void kfs_info(struct kfs_stream *kfss, const unsigned char *p,
+                     unsigned int sz)
+{
+    static const char *const keys[] = { "name", "hwid", "hwrv", "sn" };
+    char info[256], *pair, *next, *val;
+    unsigned int i, len = 0;
+
+    if (kfss->device[0] != '\0')
+        return;
+
+    sz = min_t(unsigned int, sz, sizeof(info) - 1);
+    memcpy(info, p, sz);
+    info[sz] = '\0';
+
+    for (pair = info; pair != NULL; pair = next) {
+        if ((next = strchr(pair, ',')) != NULL)
+            *next++ = '\0';
+        while (*pair == ' ')
+            pair++;
+        if ((val = strchr(pair, '=')) == NULL)
+            continue;
+        *val++ = '\0';
+        for (i = 0; i < ARRAY_SIZE(keys); i++)
+            if (!strcmp(pair, keys[i]))
+                break;
+        if ((i == ARRAY_SIZE(keys)) || (len >= sizeof(kfss->device)))
+            continue;
+        len += snprintf(&kfss->device[len], sizeof(kfss->device) - len,
+                        "%s%s%s%s", len ? " " : "", i ? pair : "",
+                        i ? "=" : "", val);
+    }
+}
+
+/* Decode the whole track file into flux intervals and index positions. An
+ * index pulse is signalled before the first interval which begins at or
+ * beyond its stream position. */
+static void kfs_parse(struct stream *s, const unsigned char *dat,
+                      unsigned int datsz)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+    unsigned int i = 0, stream_idx = 0, index_pos = ~0u;
+    uint32_t val;
+    bool_t done;
+
+    for (;;) {
+        if (stream_idx >= index_pos) {
+            index_pos = ~0u;
+            kfs_push(&kfss->index, &kfss->nr_index, kfss->nr_flux);
+        }
+
+        val = 0;
+        done = 0;
+        while (!done && (i < datsz)) {
+            switch (dat[i]) {
+            case 0x00 ... 0x07: two_byte_sample:
+                val += ((uint32_t)dat[i] << 8) + dat[i+1];
+                i += 2; stream_idx += 2;
+                done = 1;
+                break;
+            case 0x8: /* nop1 */
+                i += 1; stream_idx += 1;
+                break;
+            case 0x9: /* nop2 */
+                i += 2; stream_idx += 2;
+                break;
+            case 0xa: /* nop3 */
+                i += 3; stream_idx += 3;
+                break;
+            case 0xb: /* overflow16 */
+                val += 0x10000;
+                i += 1; stream_idx += 1;
+                break;
+            case 0xc: /* value16 */
+                i += 1; stream_idx += 1;
+                goto two_byte_sample;
+            case 0xd: /* oob */ {
+                uint32_t pos;
+                uint16_t sz = le16toh(*(const uint16_t *)&dat[i+2]);
+                i += 4;
+                pos = le32toh(*(const uint32_t *)&dat[i+0]);
+                switch (dat[i-3]) {
+                case 0x1: /* stream read */
+                case 0x3: /* stream end */
+                    if (pos != stream_idx)
+                        errx(1, "Out-of-sync during track read");
+                    break;
+                case 0x2: /* index */
+                    /* sys_time ticks at ick_freq */
+                    index_pos = pos;
+                    break;
+                case 0x4: /* KFInfo */
+                    if ((i <= datsz) && (sz <= datsz - i))
+                        kfs_info(kfss, &dat[i], sz);
+                    break;
+                case 0xd: /* eof */
+                    i = datsz;
+                    sz = 0;
+                    break;
+                }
+                i += sz;
+                break;
+            }
+            default: /* 1-byte sample */
+                val += dat[i];
+                i += 1; stream_idx += 1;
+                done = 1;
+                break;
+            }
+        }
+
+        if (!done)
+            break;
+
+        val = (val * (uint32_t)SCK_PS_PER_TICK) / 1000u;
+        val = (val * s->drive_rpm) / s->data_rpm;
+        kfs_push(&kfss->flux, &kfss->nr_flux, val);
+    }
+}
+
+/* DTC closes each track file with an EOF block: OOB type 0x0d, size 0x0d0d. */
+static bool_t kfs_file_complete(const char *trackname, off_t *psz)
+{
+    unsigned char eof[4] = { 0 };
+    off_t sz;
+    int fd;
+
+    *psz = -1;
+    if ((fd = file_open(trackname, O_RDONLY)) == -1)
+        return 0;
+    if ((sz = lseek(fd, 0, SEEK_END)) >= 4) {
+        if ((lseek(fd, sz - 4, SEEK_SET) < 0)
+            || (read(fd, eof, 4) != 4))
+            memset(eof, 0, 4);
+    }
+    close(fd);
+
+    *psz = sz;
+    return !memcmp(eof, "\x0d\x0d\x0d\x0d", 4);
+}
+
+/* Poll for the track file until it is complete, or until it has neither
+ * appeared nor grown for s->wait_secs. */
+static void kfs_wait_track(struct kfs_stream *kfss, const char *trackname)
+{
+    unsigned int idle_ms = 0;
+    off_t sz, prev_sz = -1;
+
+    if (kfss->capture_ended)
+        return;
+
+    while (!kfs_file_complete(trackname, &sz)) {
+        if (sz != prev_sz) {
+            prev_sz = sz;
+            idle_ms = 0;
+        } else if ((idle_ms += KFS_POLL_MS) >= kfss->s.wait_secs * 1000) {
+            kfss->capture_ended = 1;
+            return;
+        }
+        usleep(KFS_POLL_MS * 1000);
+    }
+}
+
 static int kfs_select_track(struct stream *s, unsigned int tracknr)
 {
     struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
     char trackname[strlen(kfss->basename) + 9];
+    struct stream_map map = { 0 };
+    const unsigned char *dat;
     off_t sz;
     int fd;
 
-    if (kfss->dat && (kfss->track == tracknr))
+    if (kfss->flux && (kfss->track == tracknr))
         return 0;
 
-    memfree(kfss->dat);
-    kfss->dat = NULL;
+    kfs_free_track(kfss);
+
+    if (kfss->get_track != NULL) {
+        const void *mdat;
+        size_t len;
+        if (kfss->get_track(kfss->opaque, tracknr, &mdat, &len) != 0)
+            return -1;
+        kfs_parse(s, mdat, len);
+        goto parsed;
+    }
+
+    if (kfss->tar_fd != -1) {
+        struct kfs_member *m;
+        if ((tracknr >= kfss->nr_members)
+            || ((m = &kfss->member[tracknr])->off == 0))
+            return -1;
+        dat = stream_map(&map, kfss->tar_fd, m->off, m->sz);
+        kfs_parse(s, dat, m->sz);
+        goto parsed;
+    }
 
     sprintf(trackname, "%s%02u.%u.raw", kfss->basename,
             cyl(tracknr), hd(tracknr));
+    if (s->wait_secs)
+        kfs_wait_track(kfss, trackname);
     if ((fd = file_open(trackname, O_RDONLY)) == -1)
         return -1;
     if (((sz = lseek(fd, 0, SEEK_END)) < 0) ||
         (lseek(fd, 0, SEEK_SET) < 0))
         err(1, "%s", trackname);
-    kfss->dat = memalloc(sz);
-    read_exact(fd, kfss->dat, sz);
+    dat = stream_map(&map, fd, 0, sz);
     close(fd);
-    kfss->datsz = sz;
+    kfs_parse(s, dat, sz);
+parsed:
+    stream_unmap(&map);
     kfss->track = tracknr;
 
     s->max_revolutions = ~0u;
     return 0;
 }
 
+static void kfs_prefetch(struct stream *s, unsigned int tracknr)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+    char trackname[strlen(kfss->basename) + 9];
+    int fd;
+
+    if (kfss->get_track != NULL)
+        return;
+
+    if (kfss->tar_fd != -1) {
+        if ((tracknr < kfss->nr_members) && kfss->member[tracknr].off)
+            stream_readahead(kfss->tar_fd, kfss->member[tracknr].off,
+                             kfss->member[tracknr].sz);
+        return;
+    }
+
+    sprintf(trackname, "%s%02u.%u.raw", kfss->basename,
+            cyl(tracknr), hd(tracknr));
+    if ((fd = file_open(trackname, O_RDONLY)) == -1)
+        return;
+    stream_readahead(fd, 0, 0);
+    close(fd);
+}
+
 static void kfs_reset(struct stream *s)
 {
     struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
 
-    kfss->dat_idx = kfss->stream_idx = 0;
-    kfss->index_pos = ~0u;
+    kfss->flux_pos = kfss->index_pos = 0;
 }
 
 static int kfs_next_flux(struct stream *s)
 {
     struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
-    unsigned int i = kfss->dat_idx;
-    unsigned char *dat = kfss->dat;
-    uint32_t val = 0;
-    bool_t done = 0;
 
-    if (kfss->stream_idx >= kfss->index_pos) {
-        kfss->index_pos = ~0u;
+    if ((kfss->index_pos < kfss->nr_index)
+        && (kfss->index[kfss->index_pos] == kfss->flux_pos)) {
+        kfss->index_pos++;
         s->ns_to_index = s->flux;
     }
 
-    while (!done && (i < kfss->datsz)) {
-        switch (dat[i]) {
-        case 0x00 ... 0x07: two_byte_sample:
-            val += ((uint32_t)dat[i] << 8) + dat[i+1];
-            i += 2; kfss->stream_idx += 2;
-            done = 1;
-            break;
-        case 0x8: /* nop1 */
-            i += 1; kfss->stream_idx += 1;
-            break;
-        case 0x9: /* nop2 */
-            i += 2; kfss->stream_idx += 2;
-            break;
-        case 0xa: /* nop3 */
-            i += 3; kfss->stream_idx += 3;
-            break;
-        case 0xb: /* overflow16 */
-            val += 0x10000;
-            i += 1; kfss->stream_idx += 1;
-            break;
-        case 0xc: /* value16 */
-            i += 1; kfss->stream_idx += 1;
-            goto two_byte_sample;
-        case 0xd: /* oob */ {
-            uint32_t pos;
-            uint16_t sz = le16toh(*(uint16_t *)&dat[i+2]);
-            i += 4;
-            pos = le32toh(*(uint32_t *)&dat[i+0]);
-            switch (dat[i-3]) {
-            case 0x1: /* stream read */
-            case 0x3: /* stream end */
-                if (pos != kfss->stream_idx)
-                    errx(1, "Out-of-sync during track read");
-                break;
-            case 0x2: /* index */
-                /* sys_time ticks at ick_freq */
-                kfss->index_pos = pos;
-                break;
-            case 0xd: /* eof */
-                i = kfss->datsz;
-                sz = 0;
-                break;
-            }
-            i += sz;
-            break;
-        }
-        default: /* 1-byte sample */
-            val += dat[i];
-            i += 1; kfss->stream_idx += 1;
-            done = 1;
-            break;
-        }
-    }
-
-    kfss->dat_idx = i;
-
-    if (!done)
+    if (kfss->flux_pos >= kfss->nr_flux)
         return -1;
 
-    val = (val * (uint32_t)SCK_PS_PER_TICK) / 1000u;
-    val = (val * s->drive_rpm) / s->data_rpm;
-    s->flux += val;
+    s->flux += kfss->flux[kfss->flux_pos++];
     return 0;
 }
 
+static struct stream *kfs_clone(struct stream *s)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+    struct kfs_stream *c;
+
+    if (kfss->flux == NULL)
+        return NULL;
+
+    c = memalloc(sizeof(*c));
+    *c = *kfss;
+    return &c->s;
+}
+
+static const char *kfs_device(struct stream *s)
+{
+    struct kfs_stream *kfss = container_of(s, struct kfs_stream, s);
+    return kfss->device;
+}
+
 struct stream_type kryoflux_stream = {
     .open = kfs_open,
     .close = kfs_close,
     .select_track = kfs_select_track,
     .reset = kfs_reset,
-    .next_flux = kfs_next_flux
+    .next_flux = kfs_next_flux,
+    .clone = kfs_clone,
+    .prefetch = kfs_prefetch,
+    .device = kfs_device,
+    .parsed = 1,
+    .suffix = { "tar", NULL }
 };
 
 /*
@@ -7,18 +7,96 @@
  */
 
 #include <libdisk/util.h>
+#include <libdisk/disk.h>
 #include <private/stream.h>
 
 struct soft_stream {
     struct stream s;
-    uint8_t *dat;
-    uint16_t *speed;
-    uint32_t pos, bitlen, ns_per_cell;
+    struct bitcell_image im;
+    uint32_t pos, run;
 };
 
+uint32_t next_set_bit(const uint8_t *bits, uint32_t pos, uint32_t end)
+{
+    uint64_t x;
+    uint8_t b;
+
+    /* Usually within the next 57 bitcells: try them all at once. */
+    if (pos + 64 <= end) {
+        memcpy(&x, &bits[pos >> 3], 8);
+        x = be64toh(x) << (pos & 7);
+        if (x != 0)
+            return pos + __builtin_clzll(x);
+    }
+
+    /* The rest of the first byte, then whole longs, then whole bytes. */
+    if (pos & 7) {
+        b = bits[pos >> 3] & (0xffu >> (pos & 7));
+        pos &= ~7u;
+        if (b != 0)
+            goto found;
+        pos += 8;
+    }
+    for (; pos + 64 <= end; pos += 64) {
+        memcpy(&x, &bits[pos >> 3], 8);
+        if (x != 0)
+            return pos + __builtin_clzll(be64toh(x));
+    }
+    for (; pos < end; pos += 8) {
+        if ((b = bits[pos >> 3]) != 0)
+            goto found;
+    }
+    return end;
+
+found:
+    return min_t(uint32_t, pos + __builtin_clz(b) - 24, end);
+}
+
+int bitcell_image_flux(
+    const struct bitcell_image *im, uint32_t *ppos, uint32_t *prun,
+    int *pflux)
+{
+    const struct bitcell_run *r = im->runs;
+    uint32_t pos = *ppos, i = *prun, end, nxt, nr;
+    uint64_t flux = *pflux, ns;
+    int rc = -1;
+
+    if ((i >= im->nr_runs) || (r[i].start > pos))
+        i = 0;
+
+    while (pos < im->bitlen) {
+        while ((i + 1 < im->nr_runs) && (r[i+1].start <= pos))
+            i++;
+        end = (i + 1 < im->nr_runs) ? r[i+1].start : im->bitlen;
+        nxt = next_set_bit(im->bits, pos, end);
+        nr = nxt - pos + (nxt < end);
+        ns = (uint64_t)nr * r[i].ns;
+        if (flux + ns >= 1000000 /* 1ms */) {
+            /* Cut short at the bitcell which takes us to 1ms. */
+            nr = (1000000 - flux + r[i].ns - 1) / r[i].ns;
+            pos += nr;
+            flux += (uint64_t)nr * r[i].ns;
+            rc = 0;
+            break;
+        }
+        pos += nr;
+        flux += ns;
+        if (nxt < end) {
+            rc = 0;
+            break;
+        }
+    }
+
+    *ppos = pos;
+    *prun = i;
+    *pflux = flux;
+    return rc;
+}
+
 static void ss_close(struct stream *s)
 {
     struct soft_stream *ss = container_of(s, struct soft_stream, s);
+    memfree(ss->im.runs);
     memfree(ss);
 }
 
@@ -30,26 +108,22 @@ static int ss_select_track(struct stream *s, unsigned int tracknr)
 static void ss_reset(struct stream *s)
 {
     struct soft_stream *ss = container_of(s, struct soft_stream, s);
-    ss->pos = 0;
+    ss->pos = ss->run = 0;
 }
 
 static int ss_next_flux(struct stream *s)
 {
     struct soft_stream *ss = container_of(s, struct soft_stream, s);
-    uint16_t speed;
-    uint8_t dat;
+    uint32_t pos = ss->pos + 1;
     int flux = 0;
 
-    do {
-        if (++ss->pos >= ss->bitlen) {
-            ss_reset(s);
-            s->ns_to_index = s->flux + flux;
-        }
-        dat = !!(ss->dat[ss->pos >> 3] & (0x80u >> (ss->pos & 7)));
-        speed = ss->speed ? ss->speed[ss->pos] : 1000u;
-        flux += (ss->ns_per_cell * speed) / 1000u;
-    } while (!dat && (flux < 1000000 /* 1ms */));
+    while (bitcell_image_flux(&ss->im, &pos, &ss->run, &flux)) {
+        ss_reset(s);
+        pos = 0;
+        s->ns_to_index = s->flux + flux;
+    }
 
+    ss->pos = pos - 1;
     s->flux += flux;
     return 0;
 }
@@ -65,14 +139,33 @@ struct stream *stream_soft_open(
     uint8_t *data, uint16_t *speed, uint32_t bitlen, unsigned int data_rpm)
 {
     struct soft_stream *ss;
+    uint32_t i, n, ns_per_cell;
+    uint16_t sp;
 
     ss = memalloc(sizeof(*ss));
-    ss->dat = data;
-    ss->speed = speed;
-    ss->bitlen = bitlen;
-    ss->ns_per_cell = track_nsecs_from_rpm(data_rpm) / ss->bitlen;
+    ss->im.bits = data;
+    ss->im.bitlen = bitlen;
+    ss->im.ns_per_cell = ns_per_cell = track_nsecs_from_rpm(data_rpm) / bitlen;
+
+    /* Runs of equal speed, each with its bitcell period. */
+    for (i = n = 0; i < bitlen; i++)
+        if ((i == 0) || (speed && (speed[i] != speed[i-1])))
+            n++;
+    ss->im.runs = memalloc(n * sizeof(*ss->im.runs));
+    ss->im.nr_runs = n;
+    for (i = n = 0; i < bitlen; i++) {
+        if ((i == 0) || (speed && (speed[i] != speed[i-1]))) {
+            sp = speed ? speed[i] : SPEED_AVG;
+            if (sp == SPEED_WEAK)
+                sp = SPEED_AVG;
+            ss->im.runs[n].start = i;
+            ss->im.runs[n].ns = (ns_per_cell * sp) / SPEED_AVG;
+            n++;
+        }
+    }
 
     stream_setup(&ss->s, &stream_soft, data_rpm, data_rpm);
+    ss->s.bc_image = &ss->im;
 
     return &ss->s;
 }
@@ -12,7 +12,11 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
 #include <libdisk/util.h>
 #include <private/stream.h>
 #include <private/disk.h>
@@ -34,6 +38,15 @@ extern struct stream_type disk_image;
 extern struct stream_type caps;
 extern struct stream_type discferret_dfe2;
 extern struct stream_type supercard_scp;
+extern struct stream_type supercard_scz;
+#if defined(__linux__) || defined(__APPLE__)
+extern struct stream_type supercard_live;
+#endif
+
+struct stream *kfs_open_mem(
+    int (*get_track)(void *opaque, unsigned int tracknr,
+                     const void **dat, size_t *len),
+    void *opaque);
 
 const static struct stream_type *stream_type[] = {
     &kryoflux_stream,
@@ -42,10 +55,293 @@ const static struct stream_type *stream_type[] = {
     &caps,
     &discferret_dfe2,
     &supercard_scp,
+    &supercard_scz,
     NULL
 };
 
-static int flux_next_bit(struct stream *s);
+static inline int flux_next_bit(struct stream *s);
+static void pll_setup(struct stream *s);
+static void native_start(struct stream *s);
+static void native_check(struct stream *s);
+
+/* Bitcell cache: the decoded output of a PLL pass over the current track is
+ * recorded, and replayed by later passes which start from the same PLL
+ * configuration. This saves re-running the PLL for every handler that probes
+ * a track. A pass which outruns its recording falls back to the live PLL after
+ * silently re-decoding the recorded prefix. Room for a full set of PLL lanes
+ * (see stream_set_pll_lanes()). */
+#define NR_CACHED_PASSES STREAM_PLL_LANES
+
+/* A sync search over a recording pass decodes ahead of the caller in chunks
+ * of this many bitcells, which are then indexed and skipped in bulk. */
+#define RECORD_CHUNK 1024
+/* Fewest bitcells worth recording ahead to read them in bulk. */
+#define RECORD_MIN 256
+
+/* Sync index: bitcell positions within a recorded pass at which a given sync
+ * pattern ends. Built lazily on first use, and shared by every handler which
+ * subsequently searches the pass for the same pattern. All of a pass's
+ * indexes are extended together, in a single scan of its bitcells. */
+#define NR_SYNC_INDEXES 16
+
+/* Bitcells between the latency checkpoints which stream_seek_bc() keeps for
+ * each recorded pass. */
+#define SEEK_STRIDE 1024
+
+/* Syncs searched for on recent tracks. The first index built on a new pass
+ * also builds indexes for these, so that all the handlers tried against a
+ * track (which mostly search for the syncs they searched for last time)
+ * share one scan, and each then finds its hits, or their absence, at once. */
+#define NR_EXPECT_SYNCS 8
+
+struct sync_index {
+    uint32_t sync, mask;
+    uint32_t scanned;        /* bitcells of the pass scanned so far */
+    uint32_t nr, max, *pos;
+};
+
+struct bc_pass {
+    /* PLL configuration at start of pass. */
+    int clock_centre, period_adj_pct, phase_adj_pct;
+    uint32_t prng_seed;
+    /* Recorded bitcells. */
+    uint32_t nr, max;
+    uint8_t *bits, *index;   /* bitmaps: bitcell value; index pulse seen */
+    uint16_t *lat, *clock;   /* per-bitcell latency and PLL clock (ns) */
+    bool_t complete;         /* recording ran to end of stream */
+    struct stream_pll_stats pll_stats; /* of the recorded bitcells */
+    struct sync_index sync[NR_SYNC_INDEXES];
+    unsigned int nr_sync;
+    /* Bitmap of the low 16 bits of every indexed sync, which rules out most
+     * bitcells without comparing against each index; and for each byte
+     * value, the alignments (bit r) at which it is the last whole byte of
+     * one of those, r bitcells before its end. Bitcells a sync's mask
+     * ignores match either way. Both NULL if any indexed sync is shorter
+     * than 16 bits. */
+    uint8_t *sync_filter, *sync_align;
+    bool_t no_filter;
+    /* Built lazily for stream_seek_bc(): the positions of the index pulses,
+     * and the total latency before every SEEK_STRIDE'th bitcell. */
+    uint32_t *idx_pos, nr_idx_pos, max_idx_pos, idx_scanned;
+    uint64_t *lat_sum;
+    uint32_t nr_lat_sum, max_lat_sum;
+};
+
+/* Stream fields visible to handlers, which differ between the caller's
+ * position and the PLL's while the PLL decodes ahead. */
+struct stream_view {
+    uint64_t latency;
+    int64_t bc_read_base;
+    uint32_t index_offset_bc, index_offset_ns;
+    uint32_t track_len_bc, track_len_ns;
+    uint32_t rev_len_bc;
+    uint32_t nr_index;
+    int clock;
+};
+
+struct stream_cache {
+    unsigned int track;
+    struct bc_pass pass[NR_CACHED_PASSES];
+    unsigned int nr_pass, next_victim;
+    struct bc_pass *cur;
+    enum { sc_live, sc_record, sc_replay, sc_diverged } mode;
+    bool_t disabled;         /* track is uncacheable (see stream_cache_invalidate) */
+    bool_t extending;        /* PLL is decoding ahead (see cache_extend) */
+    struct { uint32_t sync, mask; } expect[NR_EXPECT_SYNCS];
+    unsigned int nr_expect, next_expect;
+    /* PLL settings to record together (see stream_set_pll_lanes()). */
+    struct { uint8_t period, phase; } lane[STREAM_PLL_LANES];
+    unsigned int nr_lane;
+};
+
+/* Flux intervals of one track in nanoseconds, as delivered by the stream
+ * type's next_flux(), which is only called to extend the buffer. Each index
+ * pulse is recorded as the interval it was signalled before, and its offset
+ * from the start of that interval. Tracks which must vary across resets
+ * (weak bits, single-revolution jitter) are not buffered. */
+struct flux_index {
+    uint32_t pos;
+    int32_t off;
+};
+
+struct flux_buf {
+    uint32_t *dat;
+    uint32_t nr, max;
+    struct flux_index *idx;
+    uint32_t nr_idx, max_idx;
+    uint32_t end;  /* interval count at which the buffer is complete */
+    /* stream_flux_noise() result, for bitcell period @noise_clock (0 if not
+     * yet known). Written by the owning stream only, never by clones. */
+    uint32_t noise_clock, nr_windows, nr_noisy;
+};
+
+/* Tracks read ahead of the one selected. */
+#define PREFETCH_TRACKS 2
+
+/* Intervals buffered past the final index a pass can reach (see
+ * max_revolutions), for the PLL to run on while it reaches the index. */
+#define FLUX_SLACK 1024
+
+static void flux_buf_free(struct stream *s);
+static int flux_buf_extend(struct stream *s);
+
+static inline int __stream_next_bit(struct stream *s);
+static void cache_start_pass(struct stream *s);
+static void pll_stats_go_live(struct stream *s);
+static int cache_next_cell(struct stream *s);
+static void cache_flush(struct stream_cache *sc);
+static bool_t record_lanes(struct stream *s);
+static struct sync_index *cache_sync_index(
+    struct stream *s, uint32_t sync, uint32_t mask);
+static uint32_t cache_index_distance(struct stream *s);
+static int cache_skip(struct stream *s, uint32_t n);
+static uint32_t cache_avail(struct stream *s, uint32_t n);
+static int cache_seek(struct stream *s, unsigned int rev, uint32_t bc);
+static void fast_open(struct stream *s);
+static int cache_read_bytes(struct stream *s, uint8_t *dat, uint32_t n);
+
+const void *stream_map(struct stream_map *m, int fd, off_t off, size_t len)
+{
+#if !defined(__MINGW32__)
+    struct stat sbuf;
+    off_t start;
+    void *p;
+#endif
+
+    m->pool = NULL;
+#if defined(HAVE_URING)
+    if ((len != 0) && ((p = uring_take(fd, off, len, &m->pool)) != NULL)) {
+        m->base = NULL;
+        m->len = 0;
+        m->mapped = 0;
+        return p;
+    }
+#endif
+
+#if !defined(__MINGW32__)
+    /* Pages wholly beyond end of file cannot be accessed once mapped. */
+    if ((len != 0) && (fstat(fd, &sbuf) == 0) && (off + len <= sbuf.st_size)) {
+        start = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        p = mmap(NULL, len + (off - start), PROT_READ, MAP_PRIVATE, fd, start);
+        if (p != MAP_FAILED) {
+            m->base = p;
+            m->len = len + (off - start);
+            m->mapped = 1;
+            return (char *)p + (off - start);
+        }
+    }
+#endif
+
+    m->base = memalloc(len);
+    m->len = len;
+    m->mapped = 0;
+    if (lseek(fd, off, SEEK_SET) != off)
+        err(1, NULL);
+    read_exact(fd, m->base, len);
+    return m->base;
+}
+
+void stream_unmap(struct stream_map *m)
+{
+#if defined(HAVE_URING)
+    if (m->pool != NULL)
+        uring_put(m->pool);
+    m->pool = NULL;
+#endif
+#if !defined(__MINGW32__)
+    if (m->mapped)
+        munmap(m->base, m->len);
+    else
+#endif
+        memfree(m->base);
+    m->base = NULL;
+    m->len = 0;
+    m->mapped = 0;
+}
+
+void stream_readahead(int fd, off_t off, off_t len)
+{
+#if defined(HAVE_URING)
+    if (uring_readahead(fd, off, len) == 0)
+        return;
+#endif
+#if defined(POSIX_FADV_WILLNEED)
+    (void)posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+int stream_src_open(struct stream_src *src, const char *name)
+{
+    if ((src->fd = file_open(name, O_RDONLY)) == -1)
+        return -1;
+    src->mem = NULL;
+    if ((src->size = lseek(src->fd, 0, SEEK_END)) < 0)
+        err(1, "%s", name);
+    return 0;
+}
+
+void stream_src_mem(struct stream_src *src, const void *dat, size_t len)
+{
+    src->fd = -1;
+    src->mem = dat;
+    src->size = len;
+}
+
+void stream_src_close(struct stream_src *src)
+{
+    if (src->fd != -1)
+        close(src->fd);
+    src->fd = -1;
+    src->mem = NULL;
+}
+
+void stream_src_read(struct stream_src *src, off_t off, void *buf, size_t len)
+{
+    size_t n;
+
+    if (src->fd != -1) {
+#if defined(HAVE_URING)
+        if (uring_read(src->fd, off, buf, len) == 0)
+            return;
+#endif
+        if (lseek(src->fd, off, SEEK_SET) != off)
+            err(1, NULL);
+        read_exact(src->fd, buf, len);
+        return;
+    }
+
+    n = (off >= src->size) ? 0 : min_t(off_t, len, src->size - off);
+    memcpy(buf, src->mem + off, n);
+    memset((char *)buf + n, 0, len - n);
+}
+
+const void *stream_src_map(
+    struct stream_src *src, struct stream_map *m, off_t off, size_t len)
+{
+    if (src->fd != -1)
+        return stream_map(m, src->fd, off, len);
+
+    m->pool = NULL;
+    if (off + (off_t)len <= src->size) {
+        m->base = NULL;
+        m->len = 0;
+        m->mapped = 0;
+        return src->mem + off;
+    }
+
+    /* Runs off the end of the buffer: copied, and zero-padded. */
+    m->base = memalloc(len);
+    m->len = len;
+    m->mapped = 0;
+    stream_src_read(src, off, m->base, len);
+    return m->base;
+}
+
+void stream_src_readahead(struct stream_src *src, off_t off, off_t len)
+{
+    if (src->fd != -1)
+        stream_readahead(src->fd, off, len);
+}
 
 void stream_setup(
     struct stream *s, const struct stream_type *st,
@@ -59,6 +355,33 @@ void stream_setup(
     s->pll_phase_adj_pct = DEFAULT_PHASE_ADJ_PCT;
     s->clock = s->clock_centre = CLOCK_CENTRE;
     s->prng_seed = 0xae659201u;
+    pll_setup(s);
+}
+
+/* Set up a stream just opened by type @st, if it is non-NULL. */
+static struct stream *stream_opened(
+    struct stream *s, const struct stream_type *st,
+    unsigned int drive_rpm, unsigned int data_rpm)
+{
+    if (s != NULL) {
+        stream_setup(s, st, drive_rpm, data_rpm);
+        s->cache = memalloc(sizeof(*s->cache));
+        s->cache->track = ~0u;
+    }
+
+    return s;
+}
+
+static struct stream *stream_open_type(
+    const struct stream_type *st, const char *name,
+    unsigned int drive_rpm, unsigned int data_rpm)
+{
+    enum mem_tag tag = mem_set_tag(MEMTAG_stream);
+    struct stream *s;
+
+    s = stream_opened(st->open(name, data_rpm), st, drive_rpm, data_rpm);
+    mem_set_tag(tag);
+    return s;
 }
 
 struct stream *stream_open(
@@ -71,44 +394,369 @@ struct stream *stream_open(
     struct stream *s;
     unsigned int i;
 
-    /* Only Kryoflux STREAMs may be anything other than a single file. */
+    /* Kryoflux STREAMs are a directory, or base name, of per-track files. */
     if ((stat(name, &sbuf) < 0) || S_ISDIR(sbuf.st_mode)) {
         st = &kryoflux_stream;
         goto found;
     }
 
+#if defined(__linux__) || defined(__APPLE__)
+    /* A serial device node is a SuperCard Pro, read live. */
+    if (S_ISCHR(sbuf.st_mode)) {
+        st = &supercard_live;
+        goto found;
+    }
+#endif
+
     filename_extension(name, suffix, sizeof(suffix));
 
+    /* Several types may claim a suffix: the first to open the file wins. */
     for (i = 0; (st = stream_type[i]) != NULL; i++) {
         for (suffix_list = st->suffix; *suffix_list != NULL; suffix_list++) {
-            if (!strcmp(suffix, *suffix_list))
-                goto found;
+            if (strcmp(suffix, *suffix_list))
+                continue;
+            if ((s = stream_open_type(st, name, drive_rpm, data_rpm)) != NULL)
+                return s;
+            break;
         }
     }
 
     return NULL;
 
 found:
-    if ((s = st->open(name, data_rpm)) != NULL)
-        stream_setup(s, st, drive_rpm, data_rpm);
+    return stream_open_type(st, name, drive_rpm, data_rpm);
+}
 
-    return s;
+struct stream *stream_open_mem(
+    const char *type, const void *dat, size_t len,
+    unsigned int drive_rpm, unsigned int data_rpm)
+{
+    const struct stream_type *st;
+    const char *const *suffix_list;
+    enum mem_tag tag;
+    struct stream *s;
+    unsigned int i;
+
+    for (i = 0; (st = stream_type[i]) != NULL; i++) {
+        if (st->open_mem == NULL)
+            continue;
+        for (suffix_list = st->suffix; *suffix_list != NULL; suffix_list++) {
+            if (strcmp(type, *suffix_list))
+                continue;
+            tag = mem_set_tag(MEMTAG_stream);
+            s = st->open_mem(dat, len, data_rpm);
+            s = stream_opened(s, st, drive_rpm, data_rpm);
+            mem_set_tag(tag);
+            if (s != NULL)
+                return s;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+struct stream *stream_open_kryoflux_mem(
+    int (*get_track)(void *opaque, unsigned int tracknr,
+                     const void **dat, size_t *len),
+    void *opaque, unsigned int drive_rpm, unsigned int data_rpm)
+{
+    return stream_opened(kfs_open_mem(get_track, opaque),
+                         &kryoflux_stream, drive_rpm, data_rpm);
+}
+
+void stream_preload(void)
+{
+    const struct stream_type *st;
+    unsigned int i;
+
+    for (i = 0; (st = stream_type[i]) != NULL; i++)
+        if (st->preload != NULL)
+            st->preload();
 }
 
 void stream_close(struct stream *s)
 {
-    s->type->close(s);
+    if (s->cache != NULL) {
+        cache_flush(s->cache);
+        memfree(s->cache);
+    }
+    flux_buf_free(s);
+    if (s->clone_of != NULL)
+        memfree(s);
+    else
+        s->type->close(s);
+}
+
+const char *stream_device(struct stream *s)
+{
+    return (s->type->device != NULL) ? s->type->device(s) : "";
+}
+
+struct stream *stream_clone(struct stream *s)
+{
+    struct stream *c;
+    unsigned int tracknr;
+
+    if ((s->type->clone == NULL) || (s->cache == NULL)
+        || ((tracknr = s->cache->track) == ~0u))
+        return NULL;
+
+    /* Clones share the flux buffer, so must never need to extend it. */
+    if (s->flux_buf != NULL)
+        while (flux_buf_extend(s) == 0)
+            continue;
+
+    if ((c = s->type->clone(s)) == NULL)
+        return NULL;
+
+    c->clone_of = s->clone_of ?: s;
+    c->clone_track = tracknr;
+    c->parent_memo = NULL;
+    c->cache = memalloc(sizeof(*c->cache));
+    c->cache->track = tracknr;
+    memcpy(c->cache->expect, s->cache->expect, sizeof(c->cache->expect));
+    c->cache->nr_expect = s->cache->nr_expect;
+    stream_reset(c);
+
+    return c;
+}
+
+static void flux_buf_free(struct stream *s)
+{
+    struct flux_buf *fb = s->flux_buf;
+
+    s->flux_buf = NULL;
+    if ((fb == NULL) || (s->clone_of != NULL))
+        return;
+    memfree(fb->dat);
+    memfree(fb->idx);
+    memfree(fb);
+}
+
+static void *grow(void *old, size_t old_sz, size_t new_sz)
+{
+    void *new = memalloc(new_sz);
+    memcpy(new, old, old_sz);
+    memfree(old);
+    return new;
+}
+
+/* Read one more interval from the stream type into the buffer. */
+static int flux_buf_extend(struct stream *s)
+{
+    struct flux_buf *fb = s->flux_buf;
+    int flux = s->flux, ns_to_index = s->ns_to_index;
+    uint32_t nr_index = s->nr_index;
+    int rc;
+
+    if (fb->nr >= fb->end)
+        return -1;
+
+    /* The stream type sees the index count it would have seen live. */
+    s->flux = 0;
+    s->ns_to_index = INT_MAX;
+    s->nr_index = fb->nr_idx;
+    rc = s->type->next_flux(s);
+
+    if (rc != 0) {
+        fb->end = fb->nr;
+    } else {
+        s->nr_flux++;
+        if (s->ns_to_index != INT_MAX) {
+            if (fb->nr_idx == fb->max_idx) {
+                fb->max_idx = fb->max_idx ? fb->max_idx * 2 : 16;
+                fb->idx = grow(fb->idx, fb->nr_idx * sizeof(*fb->idx),
+                               fb->max_idx * sizeof(*fb->idx));
+            }
+            fb->idx[fb->nr_idx].pos = fb->nr;
+            fb->idx[fb->nr_idx].off = s->ns_to_index;
+            if (++fb->nr_idx > s->max_revolutions)
+                fb->end = fb->nr + FLUX_SLACK;
+        }
+        if (fb->nr == fb->max) {
+            fb->max = fb->max ? fb->max * 2 : 1u << 16;
+            fb->dat = grow(fb->dat, fb->nr * sizeof(*fb->dat),
+                           fb->max * sizeof(*fb->dat));
+        }
+        fb->dat[fb->nr++] = s->flux;
+    }
+
+    s->flux = flux;
+    s->ns_to_index = ns_to_index;
+    s->nr_index = nr_index;
+    return rc;
+}
+
+/* The stream-type next_flux(), served from the track's buffer if it has one.
+ * Index pulses update s->ns_to_index exactly as the stream type would. */
+static inline int next_flux(struct stream *s)
+{
+    struct flux_buf *fb = s->flux_buf;
+
+    if (fb == NULL) {
+        s->nr_flux++;
+        return s->type->next_flux(s);
+    }
+
+    if ((s->flux_pos == fb->nr) && flux_buf_extend(s))
+        return -1;
+
+    if ((s->flux_idx < fb->nr_idx)
+        && (fb->idx[s->flux_idx].pos == s->flux_pos))
+        s->ns_to_index = s->flux + fb->idx[s->flux_idx++].off;
+    s->flux += fb->dat[s->flux_pos++];
+    return 0;
+}
+
+/* Rewind the stream type (or the track's buffer) to the track start. */
+static void flux_rewind(struct stream *s)
+{
+    if (s->flux_buf != NULL)
+        s->flux_pos = s->flux_idx = 0;
+    else
+        s->type->reset(s);
+}
+
+/* Buffer the newly selected track's flux, unless it varies across resets. */
+static void flux_buf_init(struct stream *s)
+{
+    s->flux = 0;
+    s->ns_to_index = INT_MAX;
+    s->nr_index = 0;
+    s->type->reset(s);
+    if ((s->cache == NULL) || s->cache->disabled || s->type->parsed)
+        return;
+
+    s->flux_buf = memalloc(sizeof(*s->flux_buf));
+    s->flux_buf->end = ~0u;
+    s->flux_pos = s->flux_idx = 0;
+}
+
+/* Flux-interval histogram taken when a track is selected. */
+#define HIST_SAMPLES 8192
+#define HIST_BIN_NS  50
+#define HIST_BINS    400 /* up to 20us */
+
+/* Intervals within @tol nanoseconds of @ns. */
+static uint32_t hist_count(
+    const uint32_t *hist, unsigned int ns, unsigned int tol)
+{
+    unsigned int i, nr = 0;
+
+    for (i = (ns - tol) / HIST_BIN_NS;
+         (i <= (ns + tol) / HIST_BIN_NS) && (i < HIST_BINS);
+         i++)
+        nr += hist[i];
+    return nr;
+}
+
+static void flux_histogram(struct stream *s)
+{
+    uint32_t hist[HIST_BINS], prng_seed = s->prng_seed, total = 0, fit;
+    uint64_t sum = 0, nr = 0;
+    unsigned int i, lo, hi, t;
+
+    s->flux_min_ns = 0;
+    s->flux_mfm = 0;
+
+    memset(hist, 0, sizeof(hist));
+    s->flux = 0;
+    s->ns_to_index = INT_MAX;
+    s->nr_index = 0;
+    flux_rewind(s);
+    for (i = 0; i < HIST_SAMPLES; i++) {
+        s->flux = 0;
+        if (next_flux(s) != 0)
+            break;
+        if (s->flux <= 0)
+            continue;
+        if ((s->flux / HIST_BIN_NS) < HIST_BINS)
+            hist[s->flux / HIST_BIN_NS]++;
+        total++;
+    }
+    s->flux = 0;
+    s->prng_seed = prng_seed;
+
+    if (total < HIST_SAMPLES/8)
+        return;
+
+    /* The shortest interval is the first peak with a share of the total,
+     * averaged over the following 25%. */
+    for (lo = 0; (lo < HIST_BINS) && (hist[lo] < total/64); lo++)
+        continue;
+    hi = min_t(unsigned int, lo + lo/4 + 1, HIST_BINS - 1);
+    for (i = lo; i <= hi; i++) {
+        sum += (uint64_t)hist[i] * (i * HIST_BIN_NS + HIST_BIN_NS/2);
+        nr += hist[i];
+    }
+    if (nr == 0)
+        return;
+    t = sum / nr;
+
+    /* Nearly every interval must be a multiple of half the shortest for the
+     * estimate to be trusted: noise and unformatted tracks fit no clock. */
+    for (i = 2, fit = 0; i <= 8; i++)
+        fit += hist_count(hist, (t * i) / 2, t / 5);
+    if (fit < total - total/10)
+        return;
+
+    s->flux_min_ns = t;
+    s->flux_mfm = (hist_count(hist, (t * 3) / 2, t / 8) >= total/16);
 }
 
 int stream_select_track(struct stream *s, unsigned int tracknr)
 {
+    struct stream_cache *sc = s->cache;
+    bool_t changed = (sc == NULL) || (sc->track != tracknr);
+    enum mem_tag tag;
+    unsigned int i;
+    uint64_t t;
     int rc;
 
+    if ((s->clone_of != NULL) && (tracknr != s->clone_track))
+        return -1;
+
+    s->fast_end = 0;
+
+    if ((sc != NULL) && changed) {
+        cache_flush(sc);
+        sc->track = tracknr;
+        sc->disabled = 0;
+        sc->nr_lane = 0;
+        flux_buf_free(s);
+    }
+
+    /* A buffered track needs nothing more from the stream type, whose
+     * position must be left at the end of the buffer. Reselecting a track
+     * is a no-op for the stream types, which leave max_revolutions unset. */
     s->max_revolutions = 0;
-    rc = s->type->select_track(s, tracknr);
-    if (rc)
-        return rc;
+    if (s->flux_buf == NULL) {
+        t = trace_begin(s->trace);
+        tag = mem_set_tag(MEMTAG_stream);
+        rc = s->type->select_track(s, tracknr);
+        mem_set_tag(tag);
+        trace_end(s->trace, "stream", "select_track", tracknr, t);
+        if (rc != 0) {
+            if (sc != NULL) {
+                cache_flush(sc);
+                sc->track = ~0u;
+            }
+            return rc;
+        }
+    }
     s->max_revolutions = max_t(uint32_t, s->max_revolutions, 4);
+    if (changed) {
+        flux_buf_init(s);
+        flux_histogram(s);
+    }
+
+    /* Callers mostly step through tracks in order: overlap loading the next
+     * tracks with analysis of this one. Hints for tracks already hinted are
+     * cheap, so that each step adds one more to the queue. */
+    if (changed && (s->clone_of == NULL) && (s->type->prefetch != NULL))
+        for (i = 1; i <= PREFETCH_TRACKS; i++)
+            s->type->prefetch(s, tracknr + i);
 
     stream_reset(s);
     return 0;
@@ -116,104 +764,1687 @@ int stream_select_track(struct stream *s, unsigned int tracknr)
 
 void stream_reset(struct stream *s)
 {
+    uint64_t t = trace_begin(s->trace);
+
+    s->fast_end = 0;
+
     /* Flux-based streams */
     s->flux = 0;
     s->clocked_zeros = 0;
     s->clock = s->clock_centre;
 
-    s->nr_index = 0;
+    s->nr_index = s->progress_index = 0;
     s->latency = 0;
+    s->bc_read_base += (int64_t)s->index_offset_bc - ((1u<<31)-1);
     s->index_offset_bc
         = s->index_offset_ns
         = s->track_len_bc
         = s->track_len_ns
         = (1u<<31)-1; /* bad */
+    s->rev_len_bc = 0;
     s->ns_to_index = INT_MAX;
+    s->crc_active = 0;
+    pll_setup(s);
+    memset(&s->pll_live, 0, sizeof(s->pll_live));
+    s->pll_stats = &s->pll_live;
 
-    s->type->reset(s);
+    flux_rewind(s);
+    native_start(s);
+
+    if (s->cache != NULL)
+        cache_start_pass(s);
 
     if (s->nr_index == 0)
         stream_next_index(s);
+
+    trace_end(s->trace, "stream", "reset",
+              s->cache ? s->cache->track : TRACE_NO_TRACK, t);
 }
 
 void stream_next_index(struct stream *s)
 {
+    uint32_t n;
+
     do {
-        if (stream_next_bit(s) == -1)
+        if ((n = cache_index_distance(s)) != 0) {
+            if (cache_skip(s, n) == -1)
+                break;
+        } else if (__stream_next_bit(s) == -1) {
             break;
+        }
     } while (s->index_offset_bc != 0);
 }
 
-void stream_start_crc(struct stream *s)
+int stream_seek_bc(struct stream *s, unsigned int rev, uint32_t bc)
 {
-    uint16_t x = htobe16(mfm_decode_word(s->word));
-    s->crc16_ccitt = crc16_ccitt(&x, 2, 0xffff);
-    s->crc_bitoff = 0;
-}
+    unsigned int i;
 
-int stream_next_bit(struct stream *s)
-{
-    uint64_t lat = s->latency;
-    int b;
-    if (s->nr_index > s->max_revolutions)
-        return -1;
-    s->index_offset_bc++;
-    if ((b = flux_next_bit(s)) == -1)
-        return -1;
-    lat = s->latency - lat;
-    s->index_offset_ns += lat;
-    s->ns_to_index -= lat;
-    if (s->ns_to_index <= 0) {
-        s->track_len_bc = s->index_offset_bc;
-        s->track_len_ns = s->index_offset_ns;
-        s->ns_to_index = INT_MAX;
-        s->index_offset_bc = s->index_offset_ns = 0;
-        s->nr_index++;
-    }
-    s->word = (s->word << 1) | b;
-    if (++s->crc_bitoff == 16) {
-        uint8_t b = mfm_decode_word(s->word);
-        s->crc16_ccitt = crc16_ccitt(&b, 1, s->crc16_ccitt);
-        s->crc_bitoff = 0;
-    }
-    return b;
-}
+    stream_reset(s);
+    if (cache_seek(s, rev, bc) == 0)
+        return 0;
 
-int stream_next_bits(struct stream *s, unsigned int bits)
-{
-    unsigned int i;
-    for (i = 0; i < bits; i++)
-        if (stream_next_bit(s) == -1)
+    for (i = 0; i < rev; i++) {
+        stream_next_index(s);
+        if ((s->nr_index != i + 2) || (s->index_offset_bc != 0))
             return -1;
-    return 0;
+    }
+    return (bc != 0) ? stream_next_bits(s, bc) : 0;
 }
 
-int stream_next_bytes(struct stream *s, void *p, unsigned int bytes)
+uint32_t stream_estimate_track_len(struct stream *s, bool_t *exact)
 {
-    unsigned int i;
-    unsigned char *dat = p;
+    struct stream_cache *sc = s->cache;
+    struct flux_buf *fb = s->flux_buf;
+    struct bc_pass *p;
+    uint32_t i, n = s->nr_index;
+    int64_t ns;
 
-    for (i = 0; i < bytes; i++) {
-        if (stream_next_bits(s, 8) == -1)
-            return -1;
-        dat[i] = (uint8_t)s->word;
+    *exact = 0;
+    if ((n == 0) || (n > s->max_revolutions))
+        return 0;
+
+    if ((sc != NULL) && ((sc->mode == sc_replay) || (sc->mode == sc_record))) {
+        p = sc->cur;
+        for (i = s->cache_pos; i < p->nr; i++) {
+            if (!(i & 7) && !p->index[i>>3]) {
+                i += 7;
+                continue;
+            }
+            if (p->index[i>>3] & (0x80u >> (i&7))) {
+                *exact = 1;
+                return s->index_offset_bc + i + 1 - s->cache_pos;
+            }
+        }
     }
 
-    return 0;
+    if ((fb == NULL) || !s->flux_mfm)
+        return 0;
+
+    /* Buffer flux up to the next index pulse. Clones' buffers are full. */
+    while ((fb->nr_idx <= n) && (s->clone_of == NULL)
+           && (flux_buf_extend(s) == 0))
+        continue;
+    if (fb->nr_idx <= n)
+        return 0;
+
+    ns = (int64_t)fb->idx[n].off - fb->idx[n-1].off;
+    for (i = fb->idx[n-1].pos; i < fb->idx[n].pos; i++)
+        ns += fb->dat[i];
+
+    /* The shortest MFM interval is two bitcells. */
+    return (ns > 0) ? (ns * 2) / s->flux_min_ns : 0;
 }
 
-void stream_set_density(struct stream *s, unsigned int ns_per_cell)
+/* Unformatted-track classification: see stream_flux_noise(). */
+#define NOISE_WINDOW_BITS 1000
+#define NOISE_WINDOW_THRESH (NOISE_WINDOW_BITS/50)
+
+int stream_flux_noise(struct stream *s, uint32_t *nr_noisy)
 {
+    struct flux_buf *fb = s->flux_buf;
+    uint32_t c = s->clock_centre, t = 0, pt = 0, pn = 0, n, inv;
+    uint32_t cells = 0, bad = 0, windows = 0, noisy = 0;
+    uint64_t x, y;
+    unsigned int i;
+
+    if (fb == NULL)
+        return -1;
+
+    if ((s->clone_of == NULL) && (fb->noise_clock == c)) {
+        *nr_noisy = fb->nr_noisy;
+        return fb->nr_windows;
+    }
+
+    /* Buffer the whole track. Clones' buffers are full. */
+    while ((s->clone_of == NULL) && (flux_buf_extend(s) == 0))
+        continue;
+
+    /* Bitcells per interval, rounded, by reciprocal multiplication. */
+    inv = ((1ull << 32) + c - 1) / c;
+
+    for (i = 0; i < fb->nr; i++) {
+        t += fb->dat[i];
+        n = ((uint64_t)(t + c/2) * inv) >> 32;
+        if (n == 0) {
+            /* Shorter than half a bitcell: merged into the next. */
+            bad++;
+            continue;
+        }
+        /* More than three zero bitcells in a row breaks the MFM rules. */
+        if (n > 4)
+            bad += n - 4;
+        /* So does a jump of over 20% in the apparent clock (t/n), tested
+         * by cross-multiplication. */
+        if (pn != 0) {
+            x = (uint64_t)t * pn;
+            y = (uint64_t)pt * n;
+            if (((x > y) ? x - y : y - x) * 5 > y)
+                bad++;
+        }
+        pt = t;
+        pn = n;
+        t = 0;
+        for (cells += n; cells >= NOISE_WINDOW_BITS;
+             cells -= NOISE_WINDOW_BITS) {
+            noisy += (bad >= NOISE_WINDOW_THRESH);
+            windows++;
+            bad = 0;
+        }
+    }
+
+    if (s->clone_of == NULL) {
+        fb->noise_clock = c;
+        fb->nr_windows = windows;
+        fb->nr_noisy = noisy;
+    }
+
+    *nr_noisy = noisy;
+    return windows;
+}
+
+static uint64_t flux_buf_digest(struct flux_buf *fb)
+{
+    uint64_t h = hash64_add(fb->dat, fb->nr * sizeof(*fb->dat), 0);
+    return hash64_add(fb->idx, fb->nr_idx * sizeof(*fb->idx), h);
+}
+
+int stream_track_digest(struct stream *s, uint64_t *digest)
+{
+    struct flux_buf *fb = s->flux_buf;
+
+    /* Flux which differs on every pass (see stream_cache_invalidate()). */
+    if ((s->cache == NULL) || s->cache->disabled)
+        return -1;
+
+    if (fb != NULL) {
+        /* Buffer the whole track. Clones' buffers are full. */
+        while ((s->clone_of == NULL) && (flux_buf_extend(s) == 0))
+            continue;
+        *digest = flux_buf_digest(fb);
+        return 0;
+    }
+
+    /* Not buffered: buffer the track just long enough to digest it. */
+    s->flux = 0;
+    s->ns_to_index = INT_MAX;
+    s->nr_index = 0;
+    s->type->reset(s);
+    s->flux_buf = fb = memalloc(sizeof(*fb));
+    fb->end = ~0u;
+    while (flux_buf_extend(s) == 0)
+        continue;
+    *digest = flux_buf_digest(fb);
+    flux_buf_free(s);
+
+    stream_reset(s);
+    return 0;
+}
+
+void stream_start_crc(struct stream *s)
+{
+    uint16_t x = htobe16(mfm_decode_word(s->word));
+    s->crc16_ccitt = crc16_ccitt(&x, 2, 0xffff);
+    s->crc_bitoff = 0;
+    s->crc_active = 1;
+    s->fast_end = 0;
+}
+
+/* Bitcell-native streams: is the density close enough to the image's own for
+ * the PLL to lock to it, so that the image can be read directly instead? The
+ * reference PLL always runs, as the yardstick for the direct reads. */
+static bool_t native_ok(struct stream *s)
+{
+    const struct bitcell_image *im = s->bc_image;
+    return ((im != NULL) && (im->bitlen > 1)
+            && (s->pll_kernel == PLL_fixed)
+            && (im->ns_per_cell >= CLOCK_MIN(s->clock_centre))
+            && (im->ns_per_cell <= CLOCK_MAX(s->clock_centre)));
+}
+
+/* At stream reset: the image is read from where its flux would begin. */
+static void native_start(struct stream *s)
+{
+    s->bc_native = native_ok(s);
+    s->bc_resync = 0;
+    s->bc_pos = 1;
+    s->bc_run = 0;
+    s->bc_ns = 0;
+}
+
+/* After a change of density mid-pass: fall back to the PLL if need be. */
+static void native_check(struct stream *s)
+{
+    if (s->bc_native && !native_ok(s)) {
+        s->bc_native = 0;
+        s->bc_resync = 1;
+    }
+}
+
+/* Bring the flux level with a native pass which has been read to s->bc_ns,
+ * so that the PLL can take over from there. */
+static void native_to_flux(struct stream *s)
+{
+    uint64_t left = s->bc_ns;
+    int off;
+
+    s->bc_resync = 0;
+    s->clocked_zeros = 0;
+    flux_rewind(s);
+    for (;;) {
+        s->flux = 0;
+        s->ns_to_index = INT_MAX;
+        if (next_flux(s) != 0) {
+            s->flux = 0;
+            break;
+        }
+        if (left < s->flux) {
+            /* Part way through this interval. The index pulse, if it is in
+             * this interval and not yet passed, is still to come. */
+            off = s->ns_to_index;
+            s->flux -= left;
+            s->ns_to_index = (off != INT_MAX) && (off >= left)
+                ? off - left : INT_MAX;
+            break;
+        }
+        left -= s->flux;
+    }
+}
+
+/* Advance one bitcell of a bitcell-native stream, as flux_next_cell(). The
+ * PLL clocks each bitcell of the synthesised flux out one bitcell period late:
+ * in the period of image bitcell @pos it returns bitcell @pos-1, and sees the
+ * index pulse while returning the image's last bitcell. */
+static inline int native_next_cell(struct stream *s)
+{
+    const struct bitcell_image *im = s->bc_image;
+    const struct bitcell_run *r = im->runs;
+    uint32_t pos = s->bc_pos, prev, lat;
+    int b;
+
+    while ((s->bc_run + 1 < im->nr_runs) && (r[s->bc_run+1].start <= pos))
+        s->bc_run++;
+    lat = r[s->bc_run].ns;
+    prev = (pos ?: im->bitlen) - 1;
+    b = !!(im->bits[prev>>3] & (0x80u >> (prev&7)));
+
+    s->clock = lat;
+    s->latency += lat;
+    s->bc_ns += lat;
+    s->index_offset_bc++;
+    s->index_offset_ns += lat;
+    if (pos == 0) {
+        s->track_len_bc = s->index_offset_bc;
+        s->track_len_ns = s->index_offset_ns;
+        if (s->nr_index == 1)
+            s->rev_len_bc = s->track_len_bc;
+        s->bc_read_base += s->index_offset_bc;
+        s->index_offset_bc = s->index_offset_ns = 0;
+        s->nr_index++;
+    }
+    if (++pos >= im->bitlen) {
+        pos = s->bc_run = 0;
+        /* Unbuffered tracks vary from one revolution to the next. */
+        if (s->flux_buf == NULL)
+            s->type->reset(s);
+    }
+    s->bc_pos = pos;
+
+    return b;
+}
+
+/* Advance one bitcell through the PLL, and update index bookkeeping. */
+static inline int flux_next_cell(struct stream *s)
+{
+    uint64_t lat = s->latency;
+    int b;
+    if (s->bc_native)
+        return native_next_cell(s);
+    if (s->bc_resync)
+        native_to_flux(s);
+    s->index_offset_bc++;
+    if ((b = flux_next_bit(s)) == -1)
+        return -1;
+    lat = s->latency - lat;
+    s->index_offset_ns += lat;
+    s->ns_to_index -= lat;
+    if (s->ns_to_index <= 0) {
+        s->track_len_bc = s->index_offset_bc;
+        s->track_len_ns = s->index_offset_ns;
+        if (s->nr_index == 1)
+            s->rev_len_bc = s->track_len_bc;
+        s->ns_to_index = INT_MAX;
+        s->bc_read_base += s->index_offset_bc;
+        s->index_offset_bc = s->index_offset_ns = 0;
+        s->nr_index++;
+    }
+    return b;
+}
+
+/* Past the last revolution to be read, or the no-progress cutoff? */
+static inline bool_t revs_exhausted(const struct stream *s)
+{
+    return (s->nr_index > s->max_revolutions)
+        || (s->idle_revolutions
+            && (s->nr_index - s->progress_index > s->idle_revolutions));
+}
+
+/* Advance one bitcell: PLL (or cache), index bookkeeping and rolling CRC
+ * (if stream_start_crc() has been called since the last stream_reset()).
+ * This is the common core of all the stream_next_* decoders. */
+static inline int __stream_next_bit(struct stream *s)
+{
+    int b;
+    if (revs_exhausted(s))
+        return -1;
+    b = (s->cache != NULL) ? cache_next_cell(s) : flux_next_cell(s);
+    if (b == -1)
+        return -1;
+    s->word = (s->word << 1) | b;
+    if (s->crc_active && (++s->crc_bitoff == 16)) {
+        uint8_t b = mfm_decode_word(s->word);
+        s->crc16_ccitt = crc16_ccitt(&b, 1, s->crc16_ccitt);
+        s->crc_bitoff = 0;
+    }
+    return b;
+}
+
+int stream_next_bit_slow(struct stream *s)
+{
+    int b = __stream_next_bit(s);
+    fast_open(s);
+    return b;
+}
+
+int stream_next_bits(struct stream *s, unsigned int bits)
+{
+    uint32_t n;
+
+    while (bits != 0) {
+        if ((n = cache_avail(s, bits)) != 0) {
+            if (cache_skip(s, n) == -1)
+                return -1;
+        } else {
+            if (__stream_next_bit(s) == -1)
+                return -1;
+            n = 1;
+        }
+        bits -= n;
+    }
+
+    return 0;
+}
+
+int stream_next_bytes(struct stream *s, void *p, unsigned int bytes)
+{
+    unsigned char *dat = p;
+    uint32_t n;
+    unsigned int j;
+
+    while (bytes != 0) {
+        if ((n = cache_avail(s, bytes * 8) / 8) != 0) {
+            if (cache_read_bytes(s, dat, n) == -1)
+                return -1;
+        } else {
+            for (j = 0; j < 8; j++)
+                if (__stream_next_bit(s) == -1)
+                    return -1;
+            *dat = (uint8_t)s->word;
+            n = 1;
+        }
+        dat += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+int stream_next_bitcells(
+    struct stream *s, void *bits, uint32_t *idx_off, uint32_t *lat,
+    unsigned int nr)
+{
+    uint8_t *p = bits, x = 0;
+    uint64_t prev = s->latency;
+    unsigned int i;
+    int b;
+
+    for (i = 0; i < nr; i++) {
+        if ((b = __stream_next_bit(s)) == -1)
+            break;
+        x = (x << 1) | b;
+        if ((i & 7) == 7)
+            *p++ = x;
+        if (idx_off != NULL)
+            idx_off[i] = s->index_offset_bc;
+        if (lat != NULL) {
+            /* Handlers may zero s->latency between calls, but not within
+             * this loop, so the delta is always well defined. */
+            lat[i] = (uint32_t)(s->latency - prev);
+            prev = s->latency;
+        }
+    }
+
+    /* Flush a trailing partial byte, left-aligned as in struct track_raw. */
+    if (i & 7)
+        *p = x << (8 - (i & 7));
+
+    return i;
+}
+
+void stream_set_density(struct stream *s, unsigned int ns_per_cell)
+{
+    struct stream_cache *sc = s->cache;
+
+    /* A mid-pass density change invalidates the rest of the recording. */
+    s->fast_end = 0;
+    if (sc != NULL) {
+        if ((sc->mode == sc_record) && (s->cache_pos == sc->cur->nr)) {
+            pll_stats_go_live(s);
+            sc->mode = sc_live; /* PLL is level with the caller */
+        } else if ((sc->mode == sc_record) || (sc->mode == sc_replay))
+            sc->mode = sc_diverged;
+    }
+
     /* Flux-based streams */
     s->clock = s->clock_centre = ns_per_cell;
+    pll_setup(s);
+    s->rev_len_bc = 0;
+
+    /* Else the decoder is rewound before it is used again. */
+    if ((sc == NULL) || (sc->mode == sc_live))
+        native_check(s);
+}
+
+static void bc_pass_free(struct bc_pass *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < p->nr_sync; i++)
+        memfree(p->sync[i].pos);
+    memfree(p->sync_filter);
+    memfree(p->sync_align);
+    memfree(p->bits);
+    memfree(p->index);
+    memfree(p->lat);
+    memfree(p->clock);
+    memfree(p->idx_pos);
+    memfree(p->lat_sum);
+    memset(p, 0, sizeof(*p));
+}
+
+static void cache_flush(struct stream_cache *sc)
+{
+    unsigned int i;
+
+    for (i = 0; i < sc->nr_pass; i++)
+        bc_pass_free(&sc->pass[i]);
+    sc->nr_pass = sc->next_victim = 0;
+    sc->cur = NULL;
+    sc->mode = sc_live;
+}
+
+void stream_cache_invalidate(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+
+    if (sc == NULL)
+        return;
+
+    /* Uncacheable tracks are invalidated when first reset, before any
+     * recording can begin. There is no caller position to resume from if the
+     * PLL is running ahead. */
+    BUG_ON(sc->extending);
+
+    /* Safe mid-pass: the remainder of the pass simply runs live. */
+    s->fast_end = 0;
+    cache_flush(sc);
+    sc->disabled = 1;
+}
+
+static void view_save(struct stream *s, struct stream_view *v)
+{
+    v->latency = s->latency;
+    v->index_offset_bc = s->index_offset_bc;
+    v->bc_read_base = s->bc_read_base;
+    v->index_offset_ns = s->index_offset_ns;
+    v->track_len_bc = s->track_len_bc;
+    v->track_len_ns = s->track_len_ns;
+    v->rev_len_bc = s->rev_len_bc;
+    v->nr_index = s->nr_index;
+    v->clock = s->clock;
+}
+
+static void view_restore(struct stream *s, const struct stream_view *v)
+{
+    s->latency = v->latency;
+    s->index_offset_bc = v->index_offset_bc;
+    s->bc_read_base = v->bc_read_base;
+    s->index_offset_ns = v->index_offset_ns;
+    s->track_len_bc = v->track_len_bc;
+    s->track_len_ns = v->track_len_ns;
+    s->rev_len_bc = v->rev_len_bc;
+    s->nr_index = v->nr_index;
+    s->clock = v->clock;
+}
+
+/* Bytes held for a recorded pass of @max bitcells. */
+#define PASS_BYTES(max) ((uint64_t)(max) * (1 + 1 + 16 + 16) / 8)
+
+/* Bytes held in the current track's flux buffer and recorded passes. */
+static uint64_t cache_bytes(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct flux_buf *fb = s->flux_buf;
+    uint64_t bytes = 0;
+    unsigned int i;
+
+    if (fb != NULL)
+        bytes += fb->max * sizeof(*fb->dat) + fb->max_idx * sizeof(*fb->idx);
+    for (i = 0; i < sc->nr_pass; i++)
+        bytes += PASS_BYTES(sc->pass[i].max);
+    return bytes;
+}
+
+static void cache_start_pass(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p;
+    unsigned int i;
+
+    sc->cur = NULL;
+    sc->mode = sc_live;
+    if (sc->disabled)
+        return;
+
+    for (i = 0; i < sc->nr_pass; i++) {
+        p = &sc->pass[i];
+        if ((p->clock_centre == s->clock_centre) &&
+            (p->period_adj_pct == s->pll_period_adj_pct) &&
+            (p->phase_adj_pct == s->pll_phase_adj_pct)) {
+            sc->cur = p;
+            s->cache_pos = 0;
+            s->pll_stats = &p->pll_stats;
+            sc->mode = sc_replay;
+            return;
+        }
+    }
+
+    /* Record this pass along with the other PLL lanes, and replay it. */
+    if (record_lanes(s)) {
+        cache_start_pass(s);
+        return;
+    }
+
+    /* Make way for the new recording within the memory budget. */
+    if ((s->mem_budget != 0) && (cache_bytes(s) >= s->mem_budget)) {
+        for (i = 0; i < sc->nr_pass; i++)
+            bc_pass_free(&sc->pass[i]);
+        sc->nr_pass = sc->next_victim = 0;
+    }
+
+    if (sc->nr_pass < NR_CACHED_PASSES) {
+        p = &sc->pass[sc->nr_pass++];
+    } else {
+        p = &sc->pass[sc->next_victim];
+        sc->next_victim = (sc->next_victim + 1) % NR_CACHED_PASSES;
+        bc_pass_free(p);
+    }
+
+    p->clock_centre = s->clock_centre;
+    p->period_adj_pct = s->pll_period_adj_pct;
+    p->phase_adj_pct = s->pll_phase_adj_pct;
+    p->prng_seed = s->prng_seed;
+    sc->cur = p;
+    s->cache_pos = 0;
+    s->pll_stats = &p->pll_stats;
+    sc->mode = sc_record;
+}
+
+/* The PLL runs on beyond the current pass's recording: its lock quality from
+ * here on is kept by the stream itself. */
+static void pll_stats_go_live(struct stream *s)
+{
+    if (s->pll_stats != &s->pll_live) {
+        s->pll_live = *s->pll_stats;
+        s->pll_stats = &s->pll_live;
+    }
+}
+
+/* Make room to record @n more bitcells. New bitmap space is zeroed. Returns
+ * 0 if that would exceed the stream's memory budget. */
+static bool_t cache_reserve(struct stream *s, struct bc_pass *p, uint32_t n)
+{
+    uint32_t max = p->max ?: 1u << 17;
+
+    while (p->nr + n > max)
+        max *= 2;
+    if (max == p->max)
+        return 1;
+    if ((s->mem_budget != 0) && (cache_bytes(s) + PASS_BYTES(max - p->max)
+                                 > s->mem_budget))
+        return 0;
+
+    p->bits = grow(p->bits, p->max/8, max/8);
+    p->index = grow(p->index, p->max/8, max/8);
+    p->lat = grow(p->lat, p->max*2, max*2);
+    p->clock = grow(p->clock, p->max*2, max*2);
+    p->max = max;
+    return 1;
+}
+
+/* Caller ensures there is room (see cache_reserve()). */
+static inline void cache_record_cell(
+    struct stream *s, struct bc_pass *p, int b, bool_t index, uint32_t lat)
+{
+    uint32_t i = p->nr;
+
+    if (b)
+        p->bits[i>>3] |= 0x80u >> (i&7);
+    if (index)
+        p->index[i>>3] |= 0x80u >> (i&7);
+    p->lat[i] = lat;
+    p->clock[i] = s->clock;
+    p->nr++;
+}
+
+/* Switch a replaying pass to the live PLL by re-decoding the recorded prefix
+ * from the start of the track. Handler-visible state is preserved. */
+static void cache_go_live(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p = sc->cur;
+    struct stream saved = *s;
+    struct stream_pll_stats pll_stats = p->pll_stats;
+    uint32_t i;
+
+    s->clock = s->clock_centre = p->clock_centre;
+    pll_setup(s);
+    s->flux = 0;
+    s->clocked_zeros = 0;
+    s->nr_index = 0;
+    s->latency = 0;
+    s->index_offset_bc = s->index_offset_ns = (1u<<31)-1;
+    s->ns_to_index = INT_MAX;
+    s->prng_seed = p->prng_seed;
+    flux_rewind(s);
+    native_start(s);
+    for (i = 0; i < s->cache_pos; i++)
+        if (flux_next_cell(s) == -1)
+            BUG();
+    p->pll_stats = pll_stats; /* already counted */
+
+    s->latency = saved.latency;
+    s->index_offset_bc = saved.index_offset_bc;
+    s->bc_read_base = saved.bc_read_base;
+    s->index_offset_ns = saved.index_offset_ns;
+    s->track_len_bc = saved.track_len_bc;
+    s->track_len_ns = saved.track_len_ns;
+    s->rev_len_bc = saved.rev_len_bc;
+    s->nr_index = saved.nr_index;
+
+    if (sc->mode == sc_diverged) {
+        /* Apply the density change which caused the divergence. */
+        s->clock = s->clock_centre = saved.clock_centre;
+        pll_setup(s);
+        native_check(s);
+        pll_stats_go_live(s);
+        sc->mode = sc_live;
+    } else {
+        /* Continue recording from the end of the prefix. */
+        sc->mode = sc_record;
+    }
+}
+
+/* OR @n bitcells from @src at bitcell @sof into @dst at bitcell @dof. */
+static void copy_bits(
+    uint8_t *dst, uint32_t dof, const uint8_t *src, uint32_t sof, uint32_t n)
+{
+    uint8_t b;
+
+    for (; n >= 8; n -= 8, sof += 8, dof += 8) {
+        b = src[sof>>3];
+        if (sof & 7)
+            b = (b << (sof&7)) | (src[(sof>>3)+1] >> (8-(sof&7)));
+        dst[dof>>3] |= b >> (dof&7);
+        if (dof & 7)
+            dst[(dof>>3)+1] |= b << (8-(dof&7));
+    }
+    for (; n != 0; n--, sof++, dof++)
+        if (src[sof>>3] & (0x80u >> (sof&7)))
+            dst[dof>>3] |= 0x80u >> (dof&7);
+}
+
+/* Record up to @n bitcells of a bitcell-native pass in bulk, stopping short
+ * of the index pulse and of a change of bitcell period. Returns the number
+ * recorded, which is zero if the next bitcell must be recorded singly. */
+static uint32_t native_record(struct stream *s, struct bc_pass *p, uint32_t n)
+{
+    const struct bitcell_image *im = s->bc_image;
+    const struct bitcell_run *r = im->runs;
+    uint32_t pos = s->bc_pos, ns, i;
+
+    if (pos == 0)
+        return 0;
+
+    while ((s->bc_run + 1 < im->nr_runs) && (r[s->bc_run+1].start <= pos))
+        s->bc_run++;
+    ns = r[s->bc_run].ns;
+    n = min(n, ((s->bc_run + 1 < im->nr_runs)
+                ? r[s->bc_run+1].start : im->bitlen) - pos);
+
+    copy_bits(p->bits, p->nr, im->bits, pos - 1, n);
+    for (i = p->nr; i < p->nr + n; i++)
+        p->lat[i] = p->clock[i] = ns;
+    p->nr += n;
+
+    s->clock = ns;
+    s->latency += (uint64_t)n * ns;
+    s->bc_ns += (uint64_t)n * ns;
+    s->index_offset_bc += n;
+    s->index_offset_ns += n * ns;
+    if ((pos += n) >= im->bitlen) {
+        pos = s->bc_run = 0;
+        if (s->flux_buf == NULL)
+            s->type->reset(s);
+    }
+    s->bc_pos = pos;
+
+    return n;
+}
+
+/* Record up to @n further bitcells of a pass whose caller is level with the
+ * end of the recording. The caller's view of the stream is preserved, and
+ * the caller is served from the recording until it catches up, at which point
+ * the PLL state in the stream is once again its own. Returns the number of
+ * bitcells recorded, which is zero only at end of stream.
+ *
+ * With a fixed clock (pll_period_adj_pct == 0) the zero bitcells between flux
+ * transitions are counted and recorded in bulk, rather than clocked through
+ * the PLL one at a time. */
+static uint32_t cache_extend(struct stream *s, uint32_t n)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p = sc->cur;
+    struct stream_view caller;
+    uint32_t start = p->nr, end = start + n, nr_index, z, i;
+    uint64_t latency;
+    int b, c;
+
+    if (p->complete)
+        return 0;
+
+    if (!cache_reserve(s, p, n))
+        return 0;
+
+    view_save(s, &caller);
+    sc->extending = 1;
+
+    while (p->nr < end) {
+        if (s->bc_native && (native_record(s, p, end - p->nr) != 0))
+            continue;
+        if ((s->pll_period_adj_pct == 0) && !s->bc_native && !s->bc_resync) {
+            c = s->clock;
+            while (s->flux < (c/2))
+                if (next_flux(s) != 0)
+                    goto complete;
+            z = min_t(uint32_t, (s->flux - c/2) / c, end - p->nr);
+            if ((z != 0) && (s->ns_to_index > (int)(z * c))) {
+                s->flux -= z * c;
+                s->latency += z * c;
+                s->clocked_zeros += z;
+                s->index_offset_bc += z;
+                s->index_offset_ns += z * c;
+                s->ns_to_index -= z * c;
+                for (i = p->nr; i < p->nr + z; i++) {
+                    p->lat[i] = c;
+                    p->clock[i] = c;
+                }
+                p->nr += z;
+                continue;
+            }
+        }
+        nr_index = s->nr_index;
+        latency = s->latency;
+        if ((b = flux_next_cell(s)) == -1)
+            goto complete;
+        cache_record_cell(s, p, b, s->nr_index != nr_index,
+                          (uint32_t)(s->latency - latency));
+    }
+
+out:
+    sc->extending = 0;
+    view_restore(s, &caller);
+    return p->nr - start;
+
+complete:
+    p->complete = 1;
+    goto out;
+}
+
+static inline int cache_record_next(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p = sc->cur;
+    uint32_t nr_index = s->nr_index;
+    uint64_t latency = s->latency;
+    int b;
+
+    if (p->complete)
+        return -1;
+    if ((p->nr == p->max) && !cache_reserve(s, p, 1)) {
+        /* Over the memory budget: the rest of the pass runs live. Later
+         * passes replay the recording as far as it goes. */
+        pll_stats_go_live(s);
+        sc->mode = sc_live;
+        return flux_next_cell(s);
+    }
+    if ((b = flux_next_cell(s)) == -1) {
+        p->complete = 1;
+        return -1;
+    }
+    cache_record_cell(s, p, b, s->nr_index != nr_index,
+                      (uint32_t)(s->latency - latency));
+    s->cache_pos++;
+    return b;
+}
+
+static int cache_next_cell(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p = sc->cur;
+    uint32_t pos = s->cache_pos, lat;
+
+    switch (sc->mode) {
+    case sc_replay:
+        if (pos < p->nr)
+            break;
+        if (p->complete)
+            return -1;
+        cache_go_live(s);
+        return cache_record_next(s);
+    case sc_record:
+        /* Serve any bitcells decoded ahead, then record as we go. A native
+         * pass is cheaper to record ahead in bulk. */
+        if ((pos < p->nr)
+            || (s->bc_native && (cache_extend(s, RECORD_CHUNK) != 0)))
+            break;
+        return cache_record_next(s);
+    case sc_diverged:
+        cache_go_live(s);
+        /* fallthrough */
+    default:
+        return flux_next_cell(s);
+    }
+
+    s->cache_pos++;
+    lat = p->lat[pos];
+    s->latency += lat;
+    s->index_offset_bc++;
+    s->index_offset_ns += lat;
+    s->clock = p->clock[pos];
+    if (p->index[pos>>3] & (0x80u >> (pos&7))) {
+        s->track_len_bc = s->index_offset_bc;
+        s->track_len_ns = s->index_offset_ns;
+        if (s->nr_index == 1)
+            s->rev_len_bc = s->track_len_bc;
+        s->bc_read_base += s->index_offset_bc;
+        s->index_offset_bc = s->index_offset_ns = 0;
+        s->nr_index++;
+    }
+    return !!(p->bits[pos>>3] & (0x80u >> (pos&7)));
+}
+
+/* Index of @sync in pass @p, added if it is new and there is room. */
+static struct sync_index *sync_index_add(
+    struct bc_pass *p, uint32_t sync, uint32_t mask)
+{
+    struct sync_index *si;
+    uint32_t free, x, v;
+    unsigned int j;
+
+    for (j = 0; j < p->nr_sync; j++) {
+        si = &p->sync[j];
+        if ((si->sync == sync) && (si->mask == mask))
+            return si;
+    }
+    if (p->nr_sync == NR_SYNC_INDEXES)
+        return NULL;
+    si = &p->sync[p->nr_sync++];
+    si->sync = sync;
+    si->mask = mask;
+
+    if (__builtin_clz(mask) > 16) {
+        p->no_filter = 1;
+        memfree(p->sync_filter);
+        memfree(p->sync_align);
+        p->sync_filter = p->sync_align = NULL;
+    } else if (!p->no_filter) {
+        if (p->sync_filter == NULL) {
+            p->sync_filter = memalloc(0x10000/8);
+            p->sync_align = memalloc(0x100);
+        }
+        /* Every value of the bitcells outside the mask: each subset x of
+         * them, set over the sync. */
+        free = ~mask & 0xffff;
+        for (x = free; ; x = (x - 1) & free) {
+            v = (sync & 0xffff) | x;
+            p->sync_filter[v >> 3] |= 1u << (v & 7);
+            if (x == 0)
+                break;
+        }
+        for (j = 0; j < 8; j++) {
+            free = ~(mask >> j) & 0xff;
+            for (x = free; ; x = (x - 1) & free) {
+                p->sync_align[(uint8_t)(sync >> j) | x] |= 1u << j;
+                if (x == 0)
+                    break;
+            }
+        }
+    }
+
+    return si;
+}
+
+/* The 32 bitcells of pass @p ending at bitcell @i, preceded by zeroes if
+ * @i < 31. */
+static uint32_t bc_window(struct bc_pass *p, uint32_t i)
+{
+    uint64_t x = 0;
+    uint32_t k;
+    for (k = (i < 31) ? 0 : (i-31)>>3; k <= (i>>3); k++)
+        x = (x << 8) | p->bits[k];
+    return (uint32_t)(x >> (7 - (i&7)));
+}
+
+/* Record bitcell @i of pass @p, at which the 32 bitcells @w end, in each of
+ * the pass's sync indexes which it matches. */
+static void sync_index_match(struct bc_pass *p, uint32_t i, uint32_t w)
+{
+    struct sync_index *si;
+    unsigned int j;
+
+    for (j = 0; j < p->nr_sync; j++) {
+        si = &p->sync[j];
+        if (((w & si->mask) != si->sync) || (i < si->scanned)
+            || (i + 1 < 32 - __builtin_clz(si->mask)))
+            continue;
+        if (si->nr == si->max) {
+            uint32_t max = si->max ? si->max * 2 : 64;
+            si->pos = grow(si->pos, si->max*4, max*4);
+            si->max = max;
+        }
+        si->pos[si->nr++] = i;
+    }
+}
+
+/* Extend all of pass @p's sync indexes over any bitcells recorded since they
+ * were last used. */
+static void sync_index_scan(struct bc_pass *p)
+{
+    uint32_t i, k, w, lo = p->nr;
+    unsigned int j, m;
+
+    for (j = 0; j < p->nr_sync; j++)
+        lo = min_t(uint32_t, lo, p->sync[j].scanned);
+
+    if (p->sync_align != NULL) {
+        /* Every sync is at least 16 bitcells, so one ending at bitcell
+         * 8k+7+r (0 <= r < 8) wholly contains byte k of the pass. A lookup
+         * of that byte tests all eight alignments at once, and only those
+         * it allows are compared in full. */
+        for (k = (lo > 14) ? (lo - 14) / 8 : 0; 8*k + 7 < p->nr; k++) {
+            for (m = p->sync_align[p->bits[k]]; m != 0; m &= m - 1) {
+                i = 8*k + 7 + __builtin_ctz(m);
+                if ((i < lo) || (i >= p->nr))
+                    continue;
+                w = bc_window(p, i);
+                if (p->sync_filter[(w & 0xffff) >> 3] & (1u << (w & 7)))
+                    sync_index_match(p, i, w);
+            }
+        }
+    } else {
+        /* Resume with the window of bitcells preceding the scan. */
+        for (w = 0, i = (lo > 32) ? lo - 32 : 0; i < lo; i++)
+            w = (w << 1) | ((p->bits[i>>3] >> (~i&7)) & 1);
+        for (i = lo; i < p->nr; i++) {
+            w = (w << 1) | ((p->bits[i>>3] >> (~i&7)) & 1);
+            sync_index_match(p, i, w);
+        }
+    }
+
+    for (j = 0; j < p->nr_sync; j++)
+        p->sync[j].scanned = p->nr;
+}
+
+/* Remember @sync for indexing on future passes (see NR_EXPECT_SYNCS). */
+static void cache_expect_sync(
+    struct stream_cache *sc, uint32_t sync, uint32_t mask)
+{
+    unsigned int j;
+
+    for (j = 0; j < sc->nr_expect; j++)
+        if ((sc->expect[j].sync == sync) && (sc->expect[j].mask == mask))
+            return;
+    if (sc->nr_expect < NR_EXPECT_SYNCS) {
+        j = sc->nr_expect++;
+    } else {
+        j = sc->next_expect;
+        sc->next_expect = (j + 1) % NR_EXPECT_SYNCS;
+    }
+    sc->expect[j].sync = sync;
+    sc->expect[j].mask = mask;
+}
+
+static struct sync_index *cache_sync_index(
+    struct stream *s, uint32_t sync, uint32_t mask)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p;
+    struct sync_index *si;
+    unsigned int j;
+
+    /* Only a replaying or recording pass has bitcells to index. Within the
+     * first 32 bitcells a sync may straddle the stale word carried in from
+     * before the pass began, so the caller scans those by hand. */
+    if ((sc == NULL) || ((sc->mode != sc_replay) && (sc->mode != sc_record))
+        || (s->cache_pos < 32))
+        return NULL;
+    p = sc->cur;
+
+    if (p->nr_sync == 0)
+        for (j = 0; j < sc->nr_expect; j++)
+            (void)sync_index_add(p, sc->expect[j].sync, sc->expect[j].mask);
+    cache_expect_sync(sc, sync, mask);
+
+    if ((si = sync_index_add(p, sync, mask)) != NULL)
+        sync_index_scan(p);
+    return si;
+}
+
+/* Bitcells to replay, up to and including the next recorded index pulse (or
+ * to the end of the recording), if cache_skip() can replay them in bulk.
+ * Else 0. */
+static uint32_t cache_index_distance(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p;
+    uint32_t i;
+
+    if ((sc == NULL) || (sc->mode != sc_replay) || (s->cache_pos < 32))
+        return 0;
+    p = sc->cur;
+
+    for (i = s->cache_pos; i < p->nr; i++) {
+        if (!(i & 7) && !p->index[i>>3]) {
+            i += 7;
+            continue;
+        }
+        if (p->index[i>>3] & (0x80u >> (i&7)))
+            return i + 1 - s->cache_pos;
+    }
+
+    return p->nr - s->cache_pos;
+}
+
+/* Replay @n recorded bitcells in bulk, with the same effect on stream state
+ * as @n calls to __stream_next_bit(). Caller ensures that the pass is
+ * replaying, that at least 32 bitcells have been replayed, and that @n
+ * bitcells remain in the recording. */
+static int cache_skip(struct stream *s, uint32_t n)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p = sc->cur;
+    uint32_t i = s->cache_pos, end = i + n, j, seg_end, lat;
+
+    while (i < end) {
+        if (revs_exhausted(s))
+            return -1;
+
+        /* Find the next index pulse (or end of skip). */
+        for (seg_end = i; seg_end < end; seg_end++) {
+            if (!(seg_end & 7) && !p->index[seg_end>>3]
+                && (seg_end + 8 <= end)) {
+                seg_end += 7;
+                continue;
+            }
+            if (p->index[seg_end>>3] & (0x80u >> (seg_end&7))) {
+                seg_end++;
+                break;
+            }
+        }
+
+        /* Rolling CRC: one decoded byte per 16 bitcells, folded in a
+         * buffer's worth at a time. */
+        if (s->crc_active) {
+            j = i + 15 - s->crc_bitoff;
+            while (j < seg_end) {
+                uint8_t b[64];
+                unsigned int k;
+                for (k = 0; (k < sizeof(b)) && (j < seg_end); k++, j += 16)
+                    b[k] = mfm_decode_word(bc_window(p, j));
+                s->crc16_ccitt = crc16_ccitt(b, k, s->crc16_ccitt);
+            }
+            s->crc_bitoff = (s->crc_bitoff + seg_end - i) & 15;
+        }
+
+        for (lat = 0, j = i; j < seg_end; j++)
+            lat += p->lat[j];
+        s->latency += lat;
+        s->index_offset_bc += seg_end - i;
+        s->index_offset_ns += lat;
+        s->clock = p->clock[seg_end-1];
+
+        if (p->index[(seg_end-1)>>3] & (0x80u >> ((seg_end-1)&7))) {
+            s->track_len_bc = s->index_offset_bc;
+            s->track_len_ns = s->index_offset_ns;
+            if (s->nr_index == 1)
+                s->rev_len_bc = s->track_len_bc;
+            s->bc_read_base += s->index_offset_bc;
+            s->index_offset_bc = s->index_offset_ns = 0;
+            s->nr_index++;
+        }
+
+        i = s->cache_pos = seg_end;
+        s->word = bc_window(p, i-1);
+    }
+
+    return 0;
+}
+
+/* Positions of the first @nr index pulses in pass @p, scanning on from
+ * where the last call left off. Returns how many of them are recorded. */
+static uint32_t pass_index_scan(struct bc_pass *p, uint32_t nr)
+{
+    uint32_t i = p->idx_scanned;
+
+    while ((p->nr_idx_pos < nr) && (i < p->nr)) {
+        if (!(i & 7) && (i + 8 <= p->nr) && !p->index[i>>3]) {
+            i += 8;
+            continue;
+        }
+        if (p->index[i>>3] & (0x80u >> (i&7))) {
+            if (p->nr_idx_pos == p->max_idx_pos) {
+                p->max_idx_pos = p->max_idx_pos ? p->max_idx_pos * 2 : 8;
+                p->idx_pos = grow(p->idx_pos, p->nr_idx_pos * 4,
+                                  p->max_idx_pos * 4);
+            }
+            p->idx_pos[p->nr_idx_pos++] = i;
+        }
+        i++;
+    }
+
+    p->idx_scanned = i;
+    return p->nr_idx_pos;
+}
+
+/* Total latency of the first @pos bitcells of pass @p (@pos <= p->nr). */
+static uint64_t pass_lat_to(struct bc_pass *p, uint32_t pos)
+{
+    uint32_t k = pos / SEEK_STRIDE, i, j;
+    uint64_t t;
+
+    while (p->nr_lat_sum <= k) {
+        if (p->nr_lat_sum == p->max_lat_sum) {
+            p->max_lat_sum = p->max_lat_sum ? p->max_lat_sum * 2 : 256;
+            p->lat_sum = grow(p->lat_sum, p->nr_lat_sum * 8,
+                              p->max_lat_sum * 8);
+        }
+        j = p->nr_lat_sum;
+        t = 0;
+        if (j != 0) {
+            t = p->lat_sum[j-1];
+            for (i = (j-1) * SEEK_STRIDE; i < j * SEEK_STRIDE; i++)
+                t += p->lat[i];
+        }
+        p->lat_sum[p->nr_lat_sum++] = t;
+    }
+
+    for (t = p->lat_sum[k], i = k * SEEK_STRIDE; i < pos; i++)
+        t += p->lat[i];
+    return t;
+}
+
+/* Open the window of bitcells which the inline stream_next_bit() may replay
+ * from the current pass: up to its next index pulse. */
+static void fast_open(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p;
+    uint32_t i;
+
+    s->fast_end = 0;
+    if ((sc == NULL) || (sc->mode != sc_replay) || s->crc_active ||
+        (s->nr_index > s->max_revolutions))
+        return;
+
+    p = sc->cur;
+    for (i = 0; ; i++) {
+        if ((i == p->nr_idx_pos) && (pass_index_scan(p, i + 1) == i)) {
+            s->fast_end = p->nr;
+            break;
+        }
+        if (p->idx_pos[i] >= s->cache_pos) {
+            s->fast_end = p->idx_pos[i];
+            break;
+        }
+    }
+    s->fast_bits = p->bits;
+    s->fast_lat = p->lat;
+    s->fast_clock = p->clock;
+}
+
+/* stream_seek_bc() from a replayed recording, without reading through it.
+ * The stream has just been reset. Returns -1 if the recording does not yet
+ * reach the target. */
+static int cache_seek(struct stream *s, unsigned int rev, uint32_t bc)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p;
+    uint32_t *ip, start, pos;
+    uint64_t lat_start, lat;
+    int64_t total;
+
+    if ((sc == NULL) || (sc->mode != sc_replay) || (s->cache_pos == 0) ||
+        (rev >= s->max_revolutions))
+        return -1;
+    p = sc->cur;
+    if (pass_index_scan(p, rev + 1) <= rev)
+        return -1;
+    ip = p->idx_pos;
+    start = ip[rev] + 1;
+    pos = start + bc;
+    if ((pos > p->nr) || (s->cache_pos != ip[0] + 1) ||
+        ((rev + 1 < p->nr_idx_pos) && (pos > ip[rev+1])))
+        return -1;
+
+    /* As the reset left them, at the first index pulse. */
+    total = s->bc_read_base + s->index_offset_bc;
+
+    lat_start = pass_lat_to(p, start);
+    lat = pass_lat_to(p, pos);
+    if (rev != 0) {
+        s->track_len_bc = ip[rev] - ip[rev-1];
+        s->track_len_ns = lat_start - pass_lat_to(p, ip[rev-1] + 1);
+        s->rev_len_bc = ip[1] - ip[0];
+    }
+    s->nr_index = rev + 1;
+    s->latency = lat;
+    s->index_offset_bc = bc;
+    s->index_offset_ns = lat - lat_start;
+    s->bc_read_base = total + (pos - s->cache_pos) - bc;
+    s->clock = p->clock[pos-1];
+    if (pos - s->cache_pos < 32)
+        s->word = (s->word << (pos - s->cache_pos)) |
+            (bc_window(p, pos-1) & ((1u << (pos - s->cache_pos)) - 1));
+    else
+        s->word = bc_window(p, pos-1);
+    s->cache_pos = pos;
+    return 0;
+}
+
+/* Number of bitcells, up to @n, which cache_skip() can replay from the
+ * current position. A pass being recorded, and level with the end of its
+ * recording, is first extended by up to @n bitcells. */
+static uint32_t cache_avail(struct stream *s, uint32_t n)
+{
+    struct stream_cache *sc = s->cache;
+    struct bc_pass *p;
+
+    if ((sc == NULL) || ((p = sc->cur) == NULL) || (s->cache_pos < 32))
+        return 0;
+    if ((sc->mode == sc_record) && (s->cache_pos == p->nr) && (n >= RECORD_MIN))
+        (void)cache_extend(s, n);
+    if ((sc->mode != sc_replay) && (sc->mode != sc_record))
+        return 0;
+    return min_t(uint32_t, n, p->nr - s->cache_pos);
+}
+
+/* As cache_skip() over @n bytes' worth of bitcells, which are copied out. */
+static int cache_read_bytes(struct stream *s, uint8_t *dat, uint32_t n)
+{
+    struct bc_pass *p = s->cache->cur;
+    uint32_t pos = s->cache_pos, i, k, sh;
+
+    if (cache_skip(s, n * 8) == -1)
+        return -1;
+
+    for (i = 0; i < n; i++, pos += 8) {
+        k = pos >> 3;
+        sh = pos & 7;
+        dat[i] = sh ? (p->bits[k] << sh) | (p->bits[k+1] >> (8 - sh))
+            : p->bits[k];
+    }
+
+    return 0;
+}
+
+/* Offset from the next bitcell to be replayed to the next indexed position of
+ * @si at or beyond it, or ~0u if there is none. */
+static uint32_t sync_index_next(struct stream *s, struct sync_index *si)
+{
+    uint32_t lo = 0, hi = si->nr, pos = s->cache_pos;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (si->pos[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo < si->nr) ? si->pos[lo] + 1 - pos : ~0u;
+}
+
+static int next_syncs(
+    struct stream *s, const uint32_t *syncs, unsigned int nr_syncs,
+    uint32_t mask, unsigned int max_bits)
+{
+    struct sync_index *si;
+    uint32_t n;
+    unsigned int i;
+
+    while (max_bits != 0) {
+        /* Distance to the nearest indexed match of any sync. */
+        for (i = 0, n = ~0u; i < nr_syncs; i++) {
+            if ((si = cache_sync_index(s, syncs[i] & mask, mask)) == NULL)
+                break;
+            n = min_t(uint32_t, n, sync_index_next(s, si));
+        }
+        if (i == nr_syncs) {
+            if (n == ~0u)
+                n = s->cache->cur->nr - s->cache_pos;
+            if ((n == 0) && (s->cache->mode == sc_record)
+                && (cache_extend(s, RECORD_CHUNK) != 0))
+                continue; /* index the new bitcells and search again */
+            if (n != 0) {
+                /* Skip straight there: no bitcell before it can match. */
+                n = min_t(uint32_t, n, max_bits);
+                max_bits -= n;
+                if (cache_skip(s, n) == -1)
+                    return -1;
+                goto check;
+            }
+        }
+        if (__stream_next_bit(s) == -1)
+            return -1;
+        max_bits--;
+    check:
+        for (i = 0; i < nr_syncs; i++)
+            if ((s->word & mask) == (syncs[i] & mask))
+                return i;
+    }
+
+    return -1;
 }
 
-static int flux_next_bit(struct stream *s)
+int stream_next_syncs(
+    struct stream *s, const uint32_t *syncs, unsigned int nr_syncs,
+    unsigned int bits, unsigned int max_bits)
 {
-    int new_flux;
+    uint32_t mask = (bits >= 32) ? ~0u : (1u << bits) - 1;
+    return next_syncs(s, syncs, nr_syncs, mask, max_bits);
+}
+
+int stream_next_sync(
+    struct stream *s, uint32_t sync, unsigned int bits, unsigned int max_bits)
+{
+    return (stream_next_syncs(s, &sync, 1, bits, max_bits) < 0) ? -1 : 0;
+}
+
+int stream_next_sync_mask(
+    struct stream *s, uint32_t sync, uint32_t mask, unsigned int max_bits)
+{
+    return (next_syncs(s, &sync, 1, mask, max_bits) < 0) ? -1 : 0;
+}
+
+int stream_seen_sync(
+    struct stream *s, uint32_t sync, unsigned int next_bits, uint32_t next)
+{
+    uint32_t mask = (next_bits >= 32) ? ~0u : (1u << next_bits) - 1;
+    struct sync_index *si;
+    struct bc_pass *p;
+    uint32_t j;
+
+    if ((si = cache_sync_index(s, sync, ~0u)) == NULL)
+        return -1;
+    p = s->cache->cur;
+
+    for (j = 0; j < si->nr; j++) {
+        if (si->pos[j] + next_bits >= s->cache_pos)
+            break;
+        if ((next_bits == 0)
+            || ((bc_window(p, si->pos[j] + next_bits) & mask)
+                == (next & mask)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Q32 factor f such that (|x| * f) >> 32 == |x| * pct / 100 (truncated) for
+ * all |x| < 2^24, which comfortably bounds any flux or clock delta. */
+static uint64_t pll_factor(int pct)
+{
+    return (((uint64_t)pct << 32) + 99) / 100;
+}
+
+static void pll_setup(struct stream *s)
+{
+    s->pll_fixed.period_fac = pll_factor(s->pll_period_adj_pct);
+    s->pll_fixed.phase_fac = pll_factor(100 - s->pll_phase_adj_pct);
+    s->pll_fixed.clock_min = CLOCK_MIN(s->clock_centre);
+    s->pll_fixed.clock_max = CLOCK_MAX(s->clock_centre);
+}
+
+/* x * pct / 100, rounded toward zero as by C division. */
+static inline int pll_scale(int x, uint64_t fac)
+{
+    int m = x >> 31;
+    uint32_t ax = (x ^ m) - m;
+    int q = (int)((ax * fac) >> 32);
+    return (q ^ m) - m;
+}
+
+int stream_set_pll_lanes(
+    struct stream *s, const uint8_t *period_adj_pct,
+    const uint8_t *phase_adj_pct, unsigned int nr)
+{
+    struct stream_cache *sc = s->cache;
+    unsigned int i;
+
+    if ((sc == NULL) || (nr > STREAM_PLL_LANES))
+        return -1;
+
+    for (i = 0; i < nr; i++) {
+        if ((period_adj_pct[i] > 100) || (phase_adj_pct[i] > 100))
+            return -1;
+        sc->lane[i].period = period_adj_pct[i];
+        sc->lane[i].phase = phase_adj_pct[i];
+    }
+    sc->nr_lane = nr;
+    return 0;
+}
+
+/* Account a flux transition, @err ns from the centre of the @window ns
+ * timing window, after @zeros zero bitcells. The PLL then wanted a clock of
+ * @want ns, and was given @clock. */
+static inline void pll_account(
+    struct stream_pll_stats *st, unsigned int rev, int err, int window,
+    unsigned int zeros, int want, int clock, int centre)
+{
+    struct stream_pll_rev *r;
+    uint32_t e = abs(err), d = abs(clock - centre);
+
+    if (rev >= STREAM_PLL_REVS)
+        return;
+    r = &st->rev[rev];
+    r->nr_flux++;
+    r->phase_err += e;
+    r->max_phase_err = max(r->max_phase_err, e);
+    e *= 8;
+    r->phase_hist[(e < window) ? 0 : (e < 2*window) ? 1
+                  : (e < 3*window) ? 2 : 3]++;
+    r->resyncs += (zeros > 3);
+    r->clamps += (want != clock);
+    r->max_drift = max(r->max_drift, d);
+}
+
+/* One lane of the PLL, as flux_next_bit() with the PLL_fixed kernel. */
+struct pll_lane {
+    struct bc_pass *p;
+    int flux, clock, ns_to_index;
+    unsigned int clocked_zeros, rev;
+    uint64_t period_fac, phase_fac;
+};
+
+/* Clock out and record the bitcells of a lane which has taken in all the
+ * flux up to the next interval. Returns 0 if the lane's recording is out of
+ * room, in which case it ends there. */
+static bool_t lane_cells(struct stream *s, struct pll_lane *l)
+{
+    struct bc_pass *p = l->p;
+    int c, lat, new_flux, delta, want;
+    uint32_t z, i;
+
+    while (l->flux >= (l->clock/2)) {
+        c = l->clock;
+
+        /* Zero bitcells at a steady clock, in bulk (as cache_extend()). */
+        z = (l->flux - c/2) / c;
+        if ((z != 0) && (l->ns_to_index > (int)(z * c))) {
+            if ((p->nr + z > p->max) && !cache_reserve(s, p, z))
+                return 0;
+            for (i = p->nr; i < p->nr + z; i++)
+                p->lat[i] = p->clock[i] = c;
+            p->nr += z;
+            l->flux -= z * c;
+            l->clocked_zeros += z;
+            l->ns_to_index -= z * c;
+            continue;
+        }
+
+        if ((p->nr == p->max) && !cache_reserve(s, p, 1))
+            return 0;
+
+        lat = c;
+        l->flux -= c;
+        if (l->flux >= (c/2)) {
+            l->clocked_zeros++;
+        } else {
+            delta = (l->clocked_zeros <= 3) ? l->flux : (s->clock_centre - c);
+            want = c + pll_scale(delta, l->period_fac);
+            l->clock = max(s->pll_fixed.clock_min,
+                           min(s->pll_fixed.clock_max, want));
+            if (s->pll_stats_on)
+                pll_account(&p->pll_stats, l->rev, l->flux, c,
+                            l->clocked_zeros, want, l->clock,
+                            s->clock_centre);
+            c = l->clock;
+            new_flux = pll_scale(l->flux, l->phase_fac);
+            lat += l->flux - new_flux;
+            l->flux = new_flux;
+            l->clocked_zeros = 0;
+            p->bits[p->nr>>3] |= 0x80u >> (p->nr&7);
+        }
+
+        l->ns_to_index -= lat;
+        if (l->ns_to_index <= 0) {
+            l->ns_to_index = INT_MAX;
+            l->rev++;
+            p->index[p->nr>>3] |= 0x80u >> (p->nr&7);
+        }
+        p->lat[p->nr] = lat;
+        p->clock[p->nr] = l->clock;
+        p->nr++;
+    }
+
+    return 1;
+}
+
+/* If the pass being started has one of the stream's PLL lane settings, and
+ * is not yet recorded, record all the lanes that are not, in lockstep over
+ * the track's buffered flux: each interval and index pulse is fetched once
+ * for every lane. Returns 1 if the recordings were made. */
+static bool_t record_lanes(struct stream *s)
+{
+    struct stream_cache *sc = s->cache;
+    struct flux_buf *fb = s->flux_buf;
+    struct pll_lane lane[STREAM_PLL_LANES], *l;
+    struct bc_pass *p;
+    unsigned int i, j, nr = 0, live;
+    uint32_t pos, idx = 0;
+    bool_t found = 0, is_idx;
+
+    if ((sc->nr_lane == 0) || (fb == NULL) || s->bc_native
+        || (s->pll_kernel != PLL_fixed))
+        return 0;
+
+    for (i = 0; i < sc->nr_lane; i++)
+        if ((sc->lane[i].period == s->pll_period_adj_pct) &&
+            (sc->lane[i].phase == s->pll_phase_adj_pct))
+            found = 1;
+    if (!found)
+        return 0;
+
+    /* The lanes replace the cache's current contents. */
+    for (i = 0; i < sc->nr_pass; i++)
+        bc_pass_free(&sc->pass[i]);
+    sc->nr_pass = sc->next_victim = 0;
+
+    for (i = 0; i < sc->nr_lane; i++) {
+        for (j = 0; j < i; j++)
+            if ((sc->lane[j].period == sc->lane[i].period) &&
+                (sc->lane[j].phase == sc->lane[i].phase))
+                break;
+        if (j != i)
+            continue;
+        p = &sc->pass[sc->nr_pass++];
+        p->clock_centre = s->clock_centre;
+        p->period_adj_pct = sc->lane[i].period;
+        p->phase_adj_pct = sc->lane[i].phase;
+        p->prng_seed = s->prng_seed;
+        l = &lane[nr++];
+        l->p = p;
+        l->flux = 0;
+        l->clock = s->clock_centre;
+        l->ns_to_index = INT_MAX;
+        l->clocked_zeros = l->rev = 0;
+        l->period_fac = pll_factor(p->period_adj_pct);
+        l->phase_fac = pll_factor(100 - p->phase_adj_pct);
+    }
+
+    while (flux_buf_extend(s) == 0)
+        continue;
+
+    for (pos = 0, live = nr; (pos < fb->nr) && (live != 0); pos++) {
+        is_idx = (idx < fb->nr_idx) && (fb->idx[idx].pos == pos);
+        for (i = 0; i < nr; i++) {
+            l = &lane[i];
+            if (l->p == NULL)
+                continue;
+            if (is_idx)
+                l->ns_to_index = l->flux + fb->idx[idx].off;
+            l->flux += fb->dat[pos];
+            if (!lane_cells(s, l)) {
+                l->p = NULL;
+                live--;
+            }
+        }
+        idx += is_idx;
+    }
+
+    for (i = 0; i < nr; i++)
+        if (lane[i].p != NULL)
+            lane[i].p->complete = 1;
+
+    return 1;
+}
+
+static inline int flux_next_bit(struct stream *s)
+{
+    int new_flux, c, want;
 
     while (s->flux < (s->clock/2))
-        if (s->type->next_flux(s) != 0)
+        if (next_flux(s) != 0)
             return -1;
 
     s->latency += s->clock;
@@ -224,6 +2455,23 @@ static int flux_next_bit(struct stream *s)
         return 0;
     }
 
+    c = s->clock;
+    if (s->pll_kernel == PLL_fixed) {
+        int delta = (s->clocked_zeros <= 3)
+            ? s->flux : (s->clock_centre - s->clock);
+        want = s->clock + pll_scale(delta, s->pll_fixed.period_fac);
+        s->clock = max(s->pll_fixed.clock_min,
+                       min(s->pll_fixed.clock_max, want));
+        if (s->pll_stats_on)
+            pll_account(s->pll_stats, s->nr_index, s->flux, c,
+                        s->clocked_zeros, want, s->clock, s->clock_centre);
+        new_flux = pll_scale(s->flux, s->pll_fixed.phase_fac);
+        s->latency += s->flux - new_flux;
+        s->flux = new_flux;
+        s->clocked_zeros = 0;
+        return 1;
+    }
+
     /* PLL: Adjust clock frequency according to phase mismatch. 
      * eg. pll_period_adj_pct=0% -> timing-window centre freq. never changes */
     if (s->clocked_zeros <= 3) {
@@ -235,8 +2483,12 @@ static int flux_next_bit(struct stream *s)
     }
 
     /* Clamp the clock's adjustment range. */
+    want = s->clock;
     s->clock = max(CLOCK_MIN(s->clock_centre),
                    min(CLOCK_MAX(s->clock_centre), s->clock));
+    if (s->pll_stats_on)
+        pll_account(s->pll_stats, s->nr_index, s->flux, c,
+                    s->clocked_zeros, want, s->clock, s->clock_centre);
 
     /* PLL: Adjust clock phase according to mismatch. 
      * eg. pll_phase_adj_pct=100% -> timing window snaps to observed flux. */
@@ -0,0 +1,255 @@
+/*
+ * stream/supercard_live.c
+ *
+ * Read flux directly from a SuperCard Pro device (named by its serial
+ * device node), capturing each track as it is selected.
+ *
+ * Each track is first captured for a couple of revolutions. Further
+ * revolutions are captured only if the decoder asks for them, which in
+ * practice means only for tracks that fail to decode. While a track is being
+ * analysed, the next track is captured in the background.
+ */
+
+#include <libdisk/util.h>
+#include <private/stream.h>
+#include "../../scp/scp.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LIVE_FIRST_REVS 2
+#define LIVE_MAX_REVS   ARRAY_SIZE(((struct scp_flux *)0)->info)
+
+#define SCK_NS_PER_TICK (25u)
+
+struct live_stream {
+    struct stream s;
+    struct scp_handle *scp;
+    char *device;            /* device node, which names the unit */
+
+    /* Current track number, and its captured flux. */
+    unsigned int track;
+    uint16_t *dat;
+    unsigned int datsz, datmax;
+    unsigned int revs;       /* captured revolutions */
+    unsigned int index_off[LIVE_MAX_REVS]; /* data offset of each index */
+
+    unsigned int dat_idx;    /* current index into dat[] */
+    unsigned int index_pos;  /* next index offset */
+
+    /* Background capture of the track expected next. Device access is
+     * single-threaded: the foreground waits for this before using it. */
+    pthread_t ahead_thread;
+    bool_t ahead_busy;
+    unsigned int ahead_track, ahead_revs;
+    struct scp_flux *ahead;
+};
+
+static void live_capture(struct live_stream *ls, unsigned int tracknr,
+                         unsigned int nr_revs, struct scp_flux *flux)
+{
+    scp_seek_track(ls->scp, tracknr, 0);
+    scp_read_flux(ls->scp, nr_revs, flux);
+}
+
+static void *live_ahead_fn(void *arg)
+{
+    struct live_stream *ls = arg;
+    live_capture(ls, ls->ahead_track, LIVE_FIRST_REVS, ls->ahead);
+    return NULL;
+}
+
+static void live_ahead_wait(struct live_stream *ls)
+{
+    if (!ls->ahead_busy)
+        return;
+    pthread_join(ls->ahead_thread, NULL);
+    ls->ahead_busy = 0;
+    ls->ahead_revs = LIVE_FIRST_REVS;
+}
+
+/* Append the first @nr_revs revolutions of @flux to the current track. */
+static void live_append(struct live_stream *ls, const struct scp_flux *flux,
+                        unsigned int nr_revs)
+{
+    unsigned int i, pos = 0, nr;
+
+    for (i = 0; (i < nr_revs) && (ls->revs < LIVE_MAX_REVS); i++) {
+        nr = flux->info[i].nr_bitcells;
+        if (nr > ARRAY_SIZE(flux->flux) - pos)
+            break;
+        if (ls->datsz + nr > ls->datmax) {
+            uint16_t *old = ls->dat;
+            ls->datmax = (ls->datsz + nr) * 2;
+            ls->dat = memalloc(ls->datmax * sizeof(*ls->dat));
+            memcpy(ls->dat, old, ls->datsz * sizeof(*ls->dat));
+            memfree(old);
+        }
+        memcpy(&ls->dat[ls->datsz], &flux->flux[pos], nr * sizeof(*ls->dat));
+        pos += nr;
+        ls->datsz += nr;
+        ls->index_off[ls->revs++] = ls->datsz;
+    }
+}
+
+static struct stream *live_open(const char *name, unsigned int data_rpm)
+{
+    struct live_stream *ls;
+    struct stat sbuf;
+
+    if ((stat(name, &sbuf) < 0) || !S_ISCHR(sbuf.st_mode))
+        return NULL;
+
+    ls = memalloc(sizeof(*ls));
+    ls->scp = scp_open(name);
+    ls->device = memalloc(strlen(name) + 1);
+    strcpy(ls->device, name);
+    ls->ahead = memalloc(sizeof(*ls->ahead));
+    ls->track = ls->ahead_track = ~0u;
+    scp_selectdrive(ls->scp, 0);
+
+    return &ls->s;
+}
+
+static void live_close(struct stream *s)
+{
+    struct live_stream *ls = container_of(s, struct live_stream, s);
+
+    live_ahead_wait(ls);
+    scp_deselectdrive(ls->scp, 0);
+    scp_close(ls->scp);
+    memfree(ls->ahead);
+    memfree(ls->dat);
+    memfree(ls->device);
+    memfree(ls);
+}
+
+static int live_select_track(struct stream *s, unsigned int tracknr)
+{
+    struct live_stream *ls = container_of(s, struct live_stream, s);
+
+    if (ls->revs && (ls->track == tracknr))
+        return 0;
+
+    if (tracknr >= SCP_MAX_TRACKS)
+        return -1;
+
+    ls->datsz = ls->revs = 0;
+    ls->track = tracknr;
+
+    live_ahead_wait(ls);
+    if (ls->ahead_track != tracknr) {
+        live_capture(ls, tracknr, LIVE_FIRST_REVS, ls->ahead);
+        ls->ahead_revs = LIVE_FIRST_REVS;
+    }
+    live_append(ls, ls->ahead, ls->ahead_revs);
+    ls->ahead_track = ~0u;
+
+    if (ls->revs == 0)
+        return -1;
+
+    s->max_revolutions = LIVE_MAX_REVS + 1;
+    return 0;
+}
+
+static void live_prefetch(struct stream *s, unsigned int tracknr)
+{
+    struct live_stream *ls = container_of(s, struct live_stream, s);
+
+    if (ls->ahead_busy || (tracknr >= SCP_MAX_TRACKS))
+        return;
+
+    ls->ahead_track = tracknr;
+    if (pthread_create(&ls->ahead_thread, NULL, live_ahead_fn, ls) == 0)
+        ls->ahead_busy = 1;
+    else
+        ls->ahead_track = ~0u;
+}
+
+/* The decoder has read every captured revolution: capture the rest. This
+ * discards any read-ahead, since the head must return to this track. */
+static void live_capture_more(struct live_stream *ls)
+{
+    struct scp_flux *flux = memalloc(sizeof(*flux));
+
+    live_ahead_wait(ls);
+    ls->ahead_track = ~0u;
+    live_capture(ls, ls->track, LIVE_MAX_REVS - ls->revs, flux);
+    live_append(ls, flux, LIVE_MAX_REVS - ls->revs);
+    memfree(flux);
+}
+
+static void live_reset(struct stream *s)
+{
+    struct live_stream *ls = container_of(s, struct live_stream, s);
+
+    ls->dat_idx = 0;
+    ls->index_pos = 0;
+}
+
+static int live_next_flux(struct stream *s)
+{
+    struct live_stream *ls = container_of(s, struct live_stream, s);
+    uint32_t val = 0, t;
+    unsigned int nr_index_seen = 0;
+
+    for (;;) {
+        if (ls->dat_idx >= ls->index_pos) {
+            uint32_t rev = s->nr_index;
+            if ((rev >= ls->revs) && (ls->revs < LIVE_MAX_REVS))
+                live_capture_more(ls);
+            rev %= ls->revs;
+            ls->index_pos = ls->index_off[rev];
+            ls->dat_idx = rev ? ls->index_off[rev-1] : 0;
+            s->ns_to_index = s->flux;
+            /* Bail if we see no flux transitions in a complete revolution. */
+            if (nr_index_seen++)
+                return -1;
+            val = 0;
+        }
+
+        t = be16toh(ls->dat[ls->dat_idx++]);
+
+        if (t == 0) { /* overflow */
+            val += 0x10000;
+            continue;
+        }
+
+        val += t;
+        break;
+    }
+
+    val = ((uint64_t)val * SCK_NS_PER_TICK * s->drive_rpm) / s->data_rpm;
+    s->flux += val;
+    return 0;
+}
+
+static const char *live_device(struct stream *s)
+{
+    struct live_stream *ls = container_of(s, struct live_stream, s);
+    return ls->device;
+}
+
+struct stream_type supercard_live = {
+    .open = live_open,
+    .close = live_close,
+    .select_track = live_select_track,
+    .reset = live_reset,
+    .next_flux = live_next_flux,
+    .prefetch = live_prefetch,
+    .device = live_device,
+    .suffix = { NULL }
+};
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,7 +1,8 @@
 /*
  * stream/supercard_scp.c
  * 
- * Parse SuperCard Pro SCP flux format.
+ * Parse SuperCard Pro SCP flux format, and the SCZ archival variant in which
+ * each track's data is compressed separately.
  * 
  * Written in 2014 by Simon Owen, based on code by Keir Fraser
  */
@@ -13,24 +14,40 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_ZLIB
+/* zlib declares its own crc32(), which is not used here. */
+#define crc32 zlib_crc32
+#include <zlib.h>
+#undef crc32
+#endif
 
 struct scp_stream {
     struct stream s;
-    int fd;
+    struct stream_src src;
 
     /* Current track number. */
     unsigned int track;
 
-    /* Raw track data. */
-    uint16_t *dat;
+    /* Raw track data: mapped from the image where the revolutions are stored
+     * back to back, else read into a private buffer a revolution at a time,
+     * as the stream first reaches each one. */
+    struct stream_map map;
+    uint16_t *buf;
+    const uint16_t *dat;
     unsigned int datsz;
 
     unsigned int revs;       /* stored disk revolutions */
+    unsigned int nr_loaded;  /* revolutions present in dat[] */
     unsigned int dat_idx;    /* current index into dat[] */
     unsigned int index_pos;  /* next index offset */
     int jitter;              /* accumulated injected jitter */
 
-    unsigned int index_off[]; /* data offsets of each index */
+    char device[128];        /* from the footer's hardware strings */
+
+    struct {
+        unsigned int index_off; /* data offset of the index ending it */
+        uint32_t file_off;      /* file offset of its flux */
+    } rev[];
 };
 
 struct disk_header {
@@ -46,23 +63,68 @@ struct disk_header {
     uint32_t checksum;
 };
 
+struct footer {
+    uint32_t manufacturer_offset;
+    uint32_t model_offset;
+    uint32_t serial_offset;
+    uint32_t creator_offset;
+    uint32_t application_offset;
+    uint32_t comments_offset;
+    uint64_t creation_time;
+    uint64_t modification_time;
+    uint8_t application_version;
+    uint8_t hardware_version;
+    uint8_t firmware_version;
+    uint8_t format_revision;
+    uint8_t sig[4];
+};
+
+#define _FLAG_footer 5
+
 #define SCK_NS_PER_TICK (25u)
 
-static struct stream *scp_open(const char *name, unsigned int data_rpm)
+/* Name the capture device by the footer's manufacturer, model and serial
+ * number strings (each a 16-bit length, then the characters). */
+static void scp_footer(struct scp_stream *scss)
+{
+    struct stream_src *src = &scss->src;
+    struct footer ftr;
+    uint32_t offs[3];
+    uint16_t len;
+    unsigned int i, n = 0;
+
+    if (src->size < 16 + sizeof(ftr))
+        return;
+    stream_src_read(src, src->size - sizeof(ftr), &ftr, sizeof(ftr));
+    if (memcmp(ftr.sig, "FPCS", sizeof(ftr.sig)))
+        return;
+
+    offs[0] = le32toh(ftr.manufacturer_offset);
+    offs[1] = le32toh(ftr.model_offset);
+    offs[2] = le32toh(ftr.serial_offset);
+    for (i = 0; i < ARRAY_SIZE(offs); i++) {
+        if ((offs[i] == 0) || (offs[i] >= src->size))
+            continue;
+        stream_src_read(src, offs[i], &len, sizeof(len));
+        len = min_t(unsigned int, le16toh(len),
+                    sizeof(scss->device) - n - 2);
+        if (len == 0)
+            continue;
+        if (n != 0)
+            scss->device[n++] = ' ';
+        stream_src_read(src, offs[i] + sizeof(len), &scss->device[n], len);
+        n += strnlen(&scss->device[n], len);
+    }
+    scss->device[n] = '\0';
+}
+
+static struct stream *scp_open_src(struct stream_src *src, const char *name)
 {
-    struct stat sbuf;
     struct scp_stream *scss;
     struct disk_header header;
     uint8_t revs;
-    int fd;
-
-    if (stat(name, &sbuf) < 0)
-        return NULL;
-
-    if ((fd = file_open(name, O_RDONLY)) == -1)
-        err(1, "%s", name);
 
-    read_exact(fd, &header, sizeof(header));
+    stream_src_read(src, 0, &header, sizeof(header));
 
     if (memcmp(header.sig, "SCP", 3) != 0)
         errx(1, "%s is not a SCP file!", name);
@@ -75,89 +137,131 @@ static struct stream *scp_open(const char *name, unsigned int data_rpm)
              name, header.cell_width);
 
     if (!(header.flags & (1u<<4))) {
-        int sz;
-        uint8_t *p, *buf;
+        off_t sz;
+        struct stream_map map;
+        const uint8_t *p;
         uint32_t csum = 0;
-        if ((sz = lseek(fd, 0, SEEK_END)) < 16)
+        if ((sz = src->size) < 16)
             errx(1, "%s is too short", name);
         sz -= 16;
-        buf = memalloc(sz);
-        lseek(fd, 16, SEEK_SET);
-        read_exact(fd, buf, sz);
-        p = buf;
+        p = stream_src_map(src, &map, 16, sz);
         while (sz--)
             csum += *p++;
-        memfree(buf);
+        stream_unmap(&map);
         if (csum != le32toh(header.checksum))
             errx(1, "%s has bad checksum", name);
-        lseek(fd, 16, SEEK_SET);
     }
 
-    scss = memalloc(sizeof(*scss) + revs*sizeof(unsigned int));
-    scss->fd = fd;
+    scss = memalloc(sizeof(*scss) + revs*sizeof(scss->rev[0]));
+    scss->src = *src;
     scss->revs = revs;
+    if (header.flags & (1u<<_FLAG_footer))
+        scp_footer(scss);
 
     return &scss->s;
 }
 
+static struct stream *scp_open(const char *name, unsigned int data_rpm)
+{
+    struct stat sbuf;
+    struct stream_src src;
+
+    if (stat(name, &sbuf) < 0)
+        return NULL;
+
+    if (stream_src_open(&src, name) == -1)
+        err(1, "%s", name);
+
+    return scp_open_src(&src, name);
+}
+
+static struct stream *scp_open_mem(
+    const void *dat, size_t len, unsigned int data_rpm)
+{
+    struct stream_src src;
+
+    stream_src_mem(&src, dat, len);
+    return scp_open_src(&src, "SCP image");
+}
+
 static void scp_close(struct stream *s)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
-    close(scss->fd);
-    memfree(scss->dat);
+    stream_src_close(&scss->src);
+    stream_unmap(&scss->map);
+    memfree(scss->buf);
     memfree(scss);
 }
 
+/* Read revolutions into the private buffer until @nr are present. */
+static void scp_load_revs(struct scp_stream *scss, unsigned int nr)
+{
+    unsigned int rev, start;
+
+    while (scss->nr_loaded < nr) {
+        rev = scss->nr_loaded++;
+        start = rev ? scss->rev[rev-1].index_off : 0;
+        stream_src_read(&scss->src, scss->rev[rev].file_off, &scss->buf[start],
+                        (scss->rev[rev].index_off - start)
+                        * sizeof(scss->dat[0]));
+    }
+}
+
 static int scp_select_track(struct stream *s, unsigned int tracknr)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
     uint8_t trk_header[4];
     uint32_t longwords[3];
-    unsigned int rev, trkoffset[scss->revs];
-    uint32_t hdr_offset, tdh_offset;
+    unsigned int rev;
+    uint32_t hdr_offset, tdh_offset, end = 0;
+    bool_t contiguous;
 
     if (scss->dat && (scss->track == tracknr))
         return 0;
 
-    memfree(scss->dat);
+    stream_unmap(&scss->map);
+    memfree(scss->buf);
+    scss->buf = NULL;
     scss->dat = NULL;
-    scss->datsz = 0;
-    
-    hdr_offset = 0x10 + tracknr*sizeof(uint32_t);
+    scss->datsz = scss->nr_loaded = 0;
 
-    if (lseek(scss->fd, hdr_offset, SEEK_SET) != hdr_offset)
-        return -1;
+    hdr_offset = 0x10 + tracknr*sizeof(uint32_t);
 
-    read_exact(scss->fd, longwords, sizeof(uint32_t));
+    stream_src_read(&scss->src, hdr_offset, longwords, sizeof(uint32_t));
     tdh_offset = le32toh(longwords[0]);
 
-    if (lseek(scss->fd, tdh_offset, SEEK_SET) != tdh_offset)
-        return -1;
-
-    read_exact(scss->fd, trk_header, sizeof(trk_header));
+    stream_src_read(&scss->src, tdh_offset, trk_header, sizeof(trk_header));
     if (memcmp(trk_header, "TRK", 3) != 0)
         return -1;
 
     if (trk_header[3] != tracknr)
         return -1;
 
+    contiguous = 1;
     for (rev = 0 ; rev < scss->revs ; rev++) {
-        read_exact(scss->fd, longwords, sizeof(longwords));
-        trkoffset[rev] = tdh_offset + le32toh(longwords[2]);
-        scss->index_off[rev] = le32toh(longwords[1]);
-        scss->datsz += scss->index_off[rev];
+        stream_src_read(&scss->src, tdh_offset + 4 + rev*sizeof(longwords),
+                        longwords, sizeof(longwords));
+        scss->rev[rev].file_off = tdh_offset + le32toh(longwords[2]);
+        scss->rev[rev].index_off = le32toh(longwords[1]);
+        if (rev && (scss->rev[rev].file_off != end))
+            contiguous = 0;
+        end = scss->rev[rev].file_off
+            + scss->rev[rev].index_off * sizeof(uint16_t);
+        scss->datsz += scss->rev[rev].index_off;
+        scss->rev[rev].index_off = scss->datsz;
     }
 
-    scss->dat = memalloc(scss->datsz * sizeof(scss->dat[0]));
-    scss->datsz = 0;
-
-    for (rev = 0 ; rev < scss->revs ; rev++) {
-        if (lseek(scss->fd, trkoffset[rev], SEEK_SET) != trkoffset[rev])
-            return -1;
-        read_exact(scss->fd, &scss->dat[scss->datsz],
-                   scss->index_off[rev] * sizeof(scss->dat[0]));
-        scss->datsz += scss->index_off[rev];
-        scss->index_off[rev] = scss->datsz;
+    if (contiguous
+        && !(((uintptr_t)scss->src.mem + scss->rev[0].file_off) & 1)) {
+        /* Parse the flux in place. */
+        scss->dat = stream_src_map(&scss->src, &scss->map,
+                                   scss->rev[0].file_off,
+                                   scss->datsz * sizeof(scss->dat[0]));
+        scss->nr_loaded = scss->revs;
+    } else {
+        /* Most tracks decode from the first revolution alone. */
+        scss->dat = scss->buf = memalloc(scss->datsz * sizeof(scss->dat[0]));
+        scp_load_revs(scss, 1);
     }
 
     scss->track = tracknr;
@@ -166,6 +270,27 @@ static int scp_select_track(struct stream *s, unsigned int tracknr)
     return 0;
 }
 
+static void scp_prefetch(struct stream *s, unsigned int tracknr)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    uint32_t hdr_offset = 0x10 + tracknr*sizeof(uint32_t), tdh_offset;
+    uint32_t longwords[4];
+
+    /* Only the first revolution is read up front (see scp_load_revs()). An
+     * image in memory has nothing to read ahead. */
+    if (scss->src.fd == -1)
+        return;
+    stream_src_read(&scss->src, hdr_offset, &tdh_offset, sizeof(tdh_offset));
+    if ((tdh_offset = le32toh(tdh_offset)) == 0)
+        return;
+    stream_src_read(&scss->src, tdh_offset, longwords, sizeof(longwords));
+    if (memcmp(longwords, "TRK", 3))
+        return;
+    stream_src_readahead(&scss->src, tdh_offset,
+                         le32toh(longwords[3])
+                         + le32toh(longwords[2]) * sizeof(uint16_t));
+}
+
 static void scp_reset(struct stream *s)
 {
     struct scp_stream *scss = container_of(s, struct scp_stream, s);
@@ -173,6 +298,10 @@ static void scp_reset(struct stream *s)
     scss->jitter = 0;
     scss->dat_idx = 0;
     scss->index_pos = 0;
+
+    /* Single-revolution images are jittered, so differ on every reset. */
+    if (scss->revs == 1)
+        stream_cache_invalidate(s);
 }
 
 static int scp_next_flux(struct stream *s)
@@ -184,8 +313,10 @@ static int scp_next_flux(struct stream *s)
     for (;;) {
         if (scss->dat_idx >= scss->index_pos) {
             uint32_t rev = s->nr_index % scss->revs;
-            scss->index_pos = scss->index_off[rev];
-            scss->dat_idx = rev ? scss->index_off[rev-1] : 0;
+            if (rev >= scss->nr_loaded)
+                scp_load_revs(scss, rev + 1);
+            scss->index_pos = scss->rev[rev].index_off;
+            scss->dat_idx = rev ? scss->rev[rev-1].index_off : 0;
             s->ns_to_index = s->flux;
             /* Some drives return no flux transitions for tracks >= 160.
              * Bail if we see no flux transitions in a complete revolution. */
@@ -237,11 +368,258 @@ static int scp_next_flux(struct stream *s)
     return 0;
 }
 
+static struct stream *scp_clone(struct stream *s)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    size_t sz = sizeof(*scss) + scss->revs*sizeof(scss->rev[0]);
+    struct scp_stream *c;
+
+    if (scss->dat == NULL)
+        return NULL;
+
+    /* Clones share the buffer, so must never need to load into it. */
+    scp_load_revs(scss, scss->revs);
+
+    c = memalloc(sz);
+    memcpy(c, scss, sz);
+    return &c->s;
+}
+
+static const char *scp_device(struct stream *s)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    return scss->device;
+}
+
 struct stream_type supercard_scp = {
     .open = scp_open,
+    .open_mem = scp_open_mem,
     .close = scp_close,
     .select_track = scp_select_track,
     .reset = scp_reset,
     .next_flux = scp_next_flux,
+    .clone = scp_clone,
+    .prefetch = scp_prefetch,
+    .device = scp_device,
     .suffix = { "scp", NULL }
 };
+
+static int scpm_select_track(struct stream *s, unsigned int tracknr)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    s->max_revolutions = scss->revs + 1;
+    return 0;
+}
+
+static void scpm_close(struct stream *s)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    memfree(scss);
+}
+
+static struct stream_type supercard_scp_mem = {
+    .close = scpm_close,
+    .select_track = scpm_select_track,
+    .reset = scp_reset,
+    .next_flux = scp_next_flux,
+    .clone = scp_clone
+};
+
+struct stream *stream_scp_open(
+    const uint16_t *dat, const uint32_t *nr_samples, unsigned int nr_revs,
+    unsigned int drive_rpm, unsigned int data_rpm)
+{
+    struct scp_stream *scss;
+    unsigned int rev;
+
+    if (nr_revs == 0)
+        return NULL;
+
+    scss = memalloc(sizeof(*scss) + nr_revs*sizeof(scss->rev[0]));
+    scss->src.fd = -1;
+    scss->dat = dat;
+    scss->revs = scss->nr_loaded = nr_revs;
+    for (rev = 0; rev < nr_revs; rev++) {
+        scss->datsz += nr_samples[rev];
+        scss->rev[rev].index_off = scss->datsz;
+    }
+
+    stream_setup(&scss->s, &supercard_scp_mem, drive_rpm, data_rpm);
+
+    return &scss->s;
+}
+
+/*
+ * SCZ layout:
+ *  0x00: SCP disk header, signature "SCZ" (checksum unused)
+ *  0x10: SCZ_MAX_TRACKS x { offset, compressed size, inflated size } (LE32)
+ * Each track block is a zlib stream which inflates to the track's data as it
+ * would appear in an SCP image: the "TRK" header and revolution table, with
+ * flux offsets relative to the header, followed by the flux.
+ */
+
+#define SCZ_MAX_TRACKS 168
+
+struct scz_track {
+    uint32_t off, csz, usz;
+};
+
+#ifdef HAVE_ZLIB
+
+static struct stream *scz_open_src(struct stream_src *src, const char *name)
+{
+    struct scp_stream *scss;
+    struct disk_header header;
+    uint8_t revs;
+
+    stream_src_read(src, 0, &header, sizeof(header));
+
+    if (memcmp(header.sig, "SCZ", 3) != 0)
+        errx(1, "%s is not a SCZ file!", name);
+
+    if ((revs = header.nr_revolutions) == 0)
+        errx(1, "%s has an invalid revolution count (%u)!", name, revs);
+
+    if (header.cell_width != 0 && header.cell_width != 16)
+        errx(1, "%s has unsupported bit cell time width (%u)",
+             name, header.cell_width);
+
+    scss = memalloc(sizeof(*scss) + revs*sizeof(scss->rev[0]));
+    scss->src = *src;
+    scss->revs = revs;
+    if (header.flags & (1u<<_FLAG_footer))
+        scp_footer(scss);
+
+    return &scss->s;
+}
+
+static struct stream *scz_open(const char *name, unsigned int data_rpm)
+{
+    struct stream_src src;
+
+    if (stream_src_open(&src, name) == -1)
+        return NULL;
+
+    return scz_open_src(&src, name);
+}
+
+static struct stream *scz_open_mem(
+    const void *dat, size_t len, unsigned int data_rpm)
+{
+    struct stream_src src;
+
+    stream_src_mem(&src, dat, len);
+    return scz_open_src(&src, "SCZ image");
+}
+
+static bool_t scz_read_track(struct scp_stream *scss, unsigned int tracknr,
+                             struct scz_track *t)
+{
+    off_t off = 0x10 + tracknr*sizeof(*t);
+
+    if (tracknr >= SCZ_MAX_TRACKS)
+        return 0;
+    stream_src_read(&scss->src, off, t, sizeof(*t));
+    t->off = le32toh(t->off);
+    t->csz = le32toh(t->csz);
+    t->usz = le32toh(t->usz);
+    return t->off != 0;
+}
+
+/* Only the requested track is read and inflated. All of its revolutions are
+ * then present in the private buffer, so scp_load_revs() is never needed. */
+static int scz_select_track(struct stream *s, unsigned int tracknr)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    struct scz_track t;
+    unsigned char *cdat, *udat = NULL;
+    uint32_t hdr_sz, nr, off;
+    unsigned int rev, start;
+    uLongf usz;
+    int rc = -1;
+
+    if (scss->dat && (scss->track == tracknr))
+        return 0;
+
+    memfree(scss->buf);
+    scss->buf = NULL;
+    scss->dat = NULL;
+    scss->datsz = scss->nr_loaded = 0;
+
+    hdr_sz = 4 + scss->revs * 3 * sizeof(uint32_t);
+    if (!scz_read_track(scss, tracknr, &t) || (t.usz < hdr_sz))
+        return -1;
+
+    cdat = memalloc(t.csz);
+    stream_src_read(&scss->src, t.off, cdat, t.csz);
+    udat = memalloc(t.usz);
+    usz = t.usz;
+    if ((uncompress(udat, &usz, cdat, t.csz) != Z_OK) || (usz != t.usz)
+        || memcmp(udat, "TRK", 3) || (udat[3] != tracknr))
+        goto out;
+
+    for (rev = 0; rev < scss->revs; rev++) {
+        nr = le32toh(*(uint32_t *)&udat[4 + rev*12 + 4]);
+        off = le32toh(*(uint32_t *)&udat[4 + rev*12 + 8]);
+        if ((off > t.usz) || (nr > (t.usz - off) / sizeof(uint16_t)))
+            goto out;
+        scss->datsz += nr;
+        scss->rev[rev].index_off = scss->datsz;
+    }
+
+    scss->dat = scss->buf = memalloc(scss->datsz * sizeof(scss->dat[0]));
+    for (rev = start = 0; rev < scss->revs; rev++) {
+        off = le32toh(*(uint32_t *)&udat[4 + rev*12 + 8]);
+        memcpy(&scss->buf[start], &udat[off],
+               (scss->rev[rev].index_off - start) * sizeof(scss->dat[0]));
+        start = scss->rev[rev].index_off;
+    }
+    scss->nr_loaded = scss->revs;
+    scss->track = tracknr;
+
+    s->max_revolutions = scss->revs + 1;
+    rc = 0;
+
+out:
+    if (rc)
+        scss->datsz = 0;
+    memfree(cdat);
+    memfree(udat);
+    return rc;
+}
+
+static void scz_prefetch(struct stream *s, unsigned int tracknr)
+{
+    struct scp_stream *scss = container_of(s, struct scp_stream, s);
+    struct scz_track t;
+
+    if (scz_read_track(scss, tracknr, &t))
+        stream_src_readahead(&scss->src, t.off, t.csz);
+}
+
+struct stream_type supercard_scz = {
+    .open = scz_open,
+    .open_mem = scz_open_mem,
+    .close = scp_close,
+    .select_track = scz_select_track,
+    .reset = scp_reset,
+    .next_flux = scp_next_flux,
+    .clone = scp_clone,
+    .prefetch = scz_prefetch,
+    .suffix = { "scz", NULL }
+};
+
+#else /* !HAVE_ZLIB */
+
+static struct stream *scz_open(const char *name, unsigned int data_rpm)
+{
+    warnx("%s: SCZ support is not enabled (build with zlib=y)", name);
+    return NULL;
+}
+
+struct stream_type supercard_scz = {
+    .open = scz_open,
+    .suffix = { "scz", NULL }
+};
+
+#endif
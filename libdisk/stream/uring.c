@@ -0,0 +1,416 @@
+/*
+ * stream/uring.c
+ *
+ * Asynchronous read-ahead through io_uring (Linux). stream_readahead() queues
+ * a read of the range into a pooled buffer, rather than hinting the page
+ * cache, and stream_map() or stream_src_read() of a range it covers is then
+ * served from the buffer, waiting only for as much of the read as is still in
+ * flight. Reads are matched by file identity rather than descriptor, as some
+ * stream types reopen a file to read it (e.g., Kryoflux track files).
+ *
+ * Where the kernel refuses io_uring (too old, or forbidden by a sandbox), or
+ * every slot is in flight, stream_readahead() falls back to posix_fadvise().
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <libdisk/util.h>
+#include <private/stream.h>
+
+/* Reads queued, or completed and not yet taken. */
+#define NR_SLOTS 16
+
+/* Larger ranges are left to the page cache. */
+#define READ_MAX_BYTES (16u << 20)
+
+/* Bound on buffers held by slots and kept free for reuse. */
+#define POOL_MAX_BYTES (64u << 20)
+
+/* Pooled buffers are preceded by their header. Data must be aligned for
+ * parsing in place, as from a mapping. */
+struct pool_buf {
+    struct pool_buf *next;
+    size_t cap;
+} __attribute__((aligned(16)));
+
+enum { slot_free, slot_busy, slot_done };
+
+static struct uring_slot {
+    int state;
+    int fd;          /* dup()ed for the lifetime of the slot */
+    dev_t dev;
+    ino_t ino;
+    off_t off;
+    size_t len;
+    int res;         /* bytes read, or -errno */
+    uint64_t seq;    /* age, for eviction */
+    struct pool_buf *pb;
+} slots[NR_SLOTS];
+
+static struct {
+    int fd;          /* -1 until set up; -2 if unavailable */
+    pid_t pid;       /* process which set it up */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} ring = { .fd = -1 };
+
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_buf *free_bufs;
+static size_t pool_bytes;
+static uint64_t seq;
+
+static void *pool_data(struct pool_buf *pb)
+{
+    return pb + 1;
+}
+
+static struct pool_buf *pool_get(size_t len)
+{
+    struct pool_buf *pb, **ppb;
+
+    for (ppb = &free_bufs; (pb = *ppb) != NULL; ppb = &pb->next) {
+        if (pb->cap >= len) {
+            *ppb = pb->next;
+            return pb;
+        }
+    }
+
+    if (pool_bytes + len > POOL_MAX_BYTES)
+        return NULL;
+    pb = memalloc_nz(sizeof(*pb) + len);
+    pb->cap = len;
+    pool_bytes += len;
+    return pb;
+}
+
+static void pool_put(struct pool_buf *pb)
+{
+    pb->next = free_bufs;
+    free_bufs = pb;
+}
+
+/* Drop every free buffer, to make room for a larger one. */
+static void pool_trim(void)
+{
+    struct pool_buf *pb;
+
+    while ((pb = free_bufs) != NULL) {
+        free_bufs = pb->next;
+        pool_bytes -= pb->cap;
+        memfree(pb);
+    }
+}
+
+static int ring_setup(void)
+{
+    struct io_uring_params p;
+    size_t sq_sz, cq_sz;
+    uint8_t *sq, *cq;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, NR_SLOTS, &p)) < 0)
+        return -1;
+
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_sz = cq_sz = max(sq_sz, cq_sz);
+
+    sq = mmap(NULL, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto fail;
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto fail;
+
+    ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.fd = fd;
+    return 0;
+
+    /* Mappings made so far are left: this happens at most once. */
+fail:
+    close(fd);
+    return -1;
+}
+
+/* Is the ring usable by this process? A child inherits the parent's ring and
+ * slots, but must not share them: it starts afresh. */
+static bool_t ring_ready(void)
+{
+    pid_t pid = getpid();
+
+    if ((ring.fd >= 0) && (ring.pid != pid)) {
+        ring.fd = -1;
+        memset(slots, 0, sizeof(slots));
+        free_bufs = NULL;
+        pool_bytes = 0;
+    }
+
+    if (ring.fd == -1) {
+        ring.pid = pid;
+        if (ring_setup() != 0)
+            ring.fd = -2;
+    }
+
+    return ring.fd >= 0;
+}
+
+static void ring_reap(void)
+{
+    unsigned int head = *ring.cq_head;
+    struct io_uring_cqe *cqe;
+    struct uring_slot *slot;
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        slot = &slots[cqe->user_data];
+        slot->res = cqe->res;
+        slot->state = slot_done;
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void slot_wait(struct uring_slot *slot)
+{
+    while (slot->state == slot_busy) {
+        if ((syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            && (errno != EINTR))
+            err(1, "io_uring_enter");
+        ring_reap();
+    }
+}
+
+static void slot_release(struct uring_slot *slot)
+{
+    slot_wait(slot);
+    if (slot->pb != NULL)
+        pool_put(slot->pb);
+    close(slot->fd);
+    memset(slot, 0, sizeof(*slot));
+}
+
+/* A free slot, evicting the oldest completed read if need be. */
+static struct uring_slot *slot_alloc(void)
+{
+    struct uring_slot *slot, *oldest = NULL;
+
+    for (slot = slots; slot != &slots[NR_SLOTS]; slot++) {
+        if (slot->state == slot_free)
+            return slot;
+        if ((slot->state == slot_done)
+            && ((oldest == NULL) || (slot->seq < oldest->seq)))
+            oldest = slot;
+    }
+
+    if (oldest != NULL)
+        slot_release(oldest);
+    return oldest;
+}
+
+/* The slot whose read covers [@off,@off+@len) of the file @st. */
+static struct uring_slot *slot_find(struct stat *st, off_t off, size_t len)
+{
+    struct uring_slot *slot;
+
+    for (slot = slots; slot != &slots[NR_SLOTS]; slot++)
+        if ((slot->state != slot_free) && (slot->dev == st->st_dev)
+            && (slot->ino == st->st_ino) && (slot->off <= off)
+            && (off + len <= slot->off + slot->len))
+            return slot;
+    return NULL;
+}
+
+int uring_readahead(int fd, off_t off, off_t len)
+{
+    struct io_uring_sqe *sqe;
+    struct uring_slot *slot;
+    struct stat st;
+    unsigned int tail, idx;
+    int rc = -1;
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+    if (len == 0)
+        len = st.st_size - off;
+    if ((len <= 0) || (len > READ_MAX_BYTES))
+        return -1;
+
+    pthread_mutex_lock(&uring_lock);
+
+    if (!ring_ready())
+        goto out;
+    if (slot_find(&st, off, len) != NULL) {
+        rc = 0;
+        goto out;
+    }
+    if ((slot = slot_alloc()) == NULL)
+        goto out;
+    if ((slot->pb = pool_get(len)) == NULL) {
+        pool_trim();
+        if ((slot->pb = pool_get(len)) == NULL)
+            goto out;
+    }
+    if ((slot->fd = dup(fd)) == -1) {
+        pool_put(slot->pb);
+        slot->pb = NULL;
+        goto out;
+    }
+
+    slot->state = slot_busy;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->off = off;
+    slot->len = len;
+    slot->seq = ++seq;
+
+    tail = *ring.sq_tail;
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (uintptr_t)pool_data(slot->pb);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = slot - slots;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) != 1) {
+        /* Not submitted: withdraw it. */
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+        slot->state = slot_done;
+        slot_release(slot);
+        goto out;
+    }
+
+    rc = 0;
+out:
+    pthread_mutex_unlock(&uring_lock);
+    return rc;
+}
+
+/* Complete a read which came up short (e.g., a signal, or a size limit), and
+ * zero-fill beyond end of file. Returns -1 if it failed. */
+static int slot_complete(struct uring_slot *slot)
+{
+    uint8_t *p = pool_data(slot->pb);
+    ssize_t done;
+
+    if (slot->res < 0)
+        return -1;
+    while ((size_t)slot->res < slot->len) {
+        done = pread(slot->fd, p + slot->res, slot->len - slot->res,
+                     slot->off + slot->res);
+        if (done < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            return -1;
+        }
+        if (done == 0) {
+            memset(p + slot->res, 0, slot->len - slot->res);
+            break;
+        }
+        slot->res += done;
+    }
+    slot->res = slot->len;
+    return 0;
+}
+
+/* Find and wait for the read covering a range of @fd's file, if any. */
+static struct uring_slot *slot_lookup(int fd, off_t off, size_t len)
+{
+    struct uring_slot *slot;
+    struct stat st;
+
+    if ((ring.fd < 0) || (ring.pid != getpid()) || (fstat(fd, &st) != 0)
+        || ((slot = slot_find(&st, off, len)) == NULL))
+        return NULL;
+
+    slot_wait(slot);
+    if (slot_complete(slot) != 0) {
+        slot_release(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+void *uring_take(int fd, off_t off, size_t len, void **pbase)
+{
+    struct uring_slot *slot;
+    void *p = NULL;
+
+    pthread_mutex_lock(&uring_lock);
+    if ((slot = slot_lookup(fd, off, len)) != NULL) {
+        *pbase = slot->pb;
+        p = (uint8_t *)pool_data(slot->pb) + (off - slot->off);
+        slot->pb = NULL;
+        slot_release(slot);
+    } else if ((slot = slot_lookup(fd, off, 1)) != NULL) {
+        /* Only the start of the range was read ahead (e.g., the first of a
+         * track's revolutions), and is now in the page cache. */
+        slot_release(slot);
+    }
+    pthread_mutex_unlock(&uring_lock);
+    return p;
+}
+
+void uring_put(void *base)
+{
+    pthread_mutex_lock(&uring_lock);
+    if (ring.pid == getpid())
+        pool_put(base);
+    pthread_mutex_unlock(&uring_lock);
+}
+
+int uring_read(int fd, off_t off, void *buf, size_t len)
+{
+    struct uring_slot *slot;
+    int rc = -1;
+
+    pthread_mutex_lock(&uring_lock);
+    if ((slot = slot_lookup(fd, off, len)) != NULL) {
+        memcpy(buf, (uint8_t *)pool_data(slot->pb) + (off - slot->off), len);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&uring_lock);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,337 @@
+/*
+ * stream_align.c
+ *
+ * Bitcell alignment of successive revolutions of a track. Revolutions are
+ * decoded back to back into one packed buffer, and each is matched against
+ * the first by Hamming distance, 64 bitcells per popcount: first over a long
+ * window at every shift within the caller's bound, then over short windows
+ * which follow the drift as the revolution proceeds. Bitcells which read the
+ * same in every revolution, once aligned, are marked stable.
+ *
+ * The same Hamming distance finds the rotation at which the raw bitcells of
+ * two tracks best match (track_raw_align()), for comparing images.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <private/stream.h>
+
+/* Bitcells decoded per call to stream_next_bitcells(). */
+#define CHUNK 4096
+
+/* Bitcells compared at each shift, to find a revolution's offset. */
+#define SEARCH_WIN 16384
+
+/* Bitcells compared per step as the offset is tracked across the revolution,
+ * and how far the offset may move at each step. */
+#define TRACK_WIN  256
+#define TRACK_SLIP 2
+
+/* Bitcells compared at each rotation, to find two tracks' best match. */
+#define ROT_WIN 2048
+
+struct revbuf {
+    uint8_t *bits;
+    uint32_t nr, max; /* bitcells */
+};
+
+/* 64 bitcells from bitcell @pos, first in the most significant bit. The
+ * buffer is padded so that this may read past its end. */
+static inline uint64_t get64(const uint8_t *bits, uint32_t pos)
+{
+    uint64_t x;
+    unsigned int sh = pos & 7;
+
+    memcpy(&x, &bits[pos >> 3], 8);
+    x = be64toh(x);
+    if (sh != 0)
+        x = (x << sh) | (bits[(pos >> 3) + 8] >> (8 - sh));
+    return x;
+}
+
+/* Bitcells which differ between the @n of @x from @a and the @n of @y from
+ * @b. Gives up, returning @limit, once that many are found. */
+static uint32_t hamming(const uint8_t *x, uint32_t a, const uint8_t *y,
+                        uint32_t b, uint32_t n, uint32_t limit)
+{
+    uint32_t d = 0;
+
+    for (; n >= 64; n -= 64, a += 64, b += 64) {
+        d += __builtin_popcountll(get64(x, a) ^ get64(y, b));
+        if (d >= limit)
+            return limit;
+    }
+    if (n != 0)
+        d += __builtin_popcountll((get64(x, a) ^ get64(y, b)) >> (64 - n));
+    return min(d, limit);
+}
+
+static void revbuf_grow(struct revbuf *b)
+{
+    uint8_t *p;
+
+    b->max = b->max ? b->max * 2 : 1u << 20;
+    p = memalloc(b->max/8 + 16);
+    memcpy(p, b->bits, (b->nr + 7) / 8);
+    memfree(b->bits);
+    b->bits = p;
+}
+
+/* Best shift of revolution @base against the first over @n bitcells from
+ * @pos, within [@lo,@hi]. Ties go to the shift nearest @pref. */
+static int best_shift(const struct revbuf *b, uint32_t base, uint32_t pos,
+                      uint32_t n, int lo, int hi, int pref)
+{
+    uint32_t c, best_c = ~0u;
+    int d, best = pref;
+
+    for (d = lo; d <= hi; d++) {
+        c = hamming(b->bits, pos, b->bits, base + pos + d, n, ~0u);
+        if ((c < best_c) || ((c == best_c) &&
+                             (abs(d - pref) < abs(best - pref)))) {
+            best_c = c;
+            best = d;
+        }
+    }
+
+    return best;
+}
+
+/* Clear the stable bits of the @n bitcells from @pos which differ in the
+ * revolution at @base + @d. */
+static void mark_unstable(const struct revbuf *b, uint8_t *stable,
+                          uint32_t base, int d, uint32_t pos, uint32_t n)
+{
+    uint64_t x, m;
+    uint32_t i;
+
+    for (i = 0; i < n; i += 64) {
+        x = get64(b->bits, pos + i) ^ get64(b->bits, base + pos + i + d);
+        if (n - i < 64)
+            x &= ~0ull << (64 - (n - i));
+        memcpy(&m, &stable[(pos + i) >> 3], 8);
+        m = htobe64(be64toh(m) & ~x);
+        memcpy(&stable[(pos + i) >> 3], &m, 8);
+    }
+}
+
+int stream_align_revs(struct stream *s, unsigned int nr,
+                      unsigned int max_shift, struct stream_align *a)
+{
+    struct revbuf b = { 0 };
+    uint32_t idx_off[CHUNK], *start, len, n, i, base, w;
+    unsigned int r, nr_start = 1;
+    int lo, hi, d, got;
+
+    memset(a, 0, sizeof(*a));
+    if (nr == 0)
+        return -1;
+
+    /* Bitcell 0 is the one in which the index pulse falls. */
+    stream_reset(s);
+    stream_next_index(s);
+    if ((s->nr_index == 0) || (s->index_offset_bc != 0))
+        return -1;
+    revbuf_grow(&b);
+    b.bits[0] = (s->word & 1) << 7;
+    b.nr = 1;
+
+    /* Decode @nr revolutions, and enough beyond to shift the last. */
+    start = memalloc((nr + 1) * sizeof(*start));
+    for (;;) {
+        if (b.nr + CHUNK + 8 > b.max)
+            revbuf_grow(&b);
+        /* Decode whole bytes, topping up the partial first byte. */
+        n = (8 - (b.nr & 7)) & 7;
+        for (i = 0; i < n; i++) {
+            if ((got = stream_next_bit(s)) == -1)
+                goto decoded;
+            b.bits[b.nr >> 3] |= got << (7 - (b.nr & 7));
+            if ((s->index_offset_bc == 0) && (nr_start <= nr))
+                start[nr_start++] = b.nr;
+            b.nr++;
+        }
+        got = stream_next_bitcells(s, &b.bits[b.nr >> 3], idx_off,
+                                   NULL, CHUNK);
+        for (i = 0; (i < got) && (nr_start <= nr); i++)
+            if (idx_off[i] == 0)
+                start[nr_start++] = b.nr + i;
+        b.nr += got;
+        if ((got < CHUNK) ||
+            ((nr_start > nr) && (b.nr >= start[nr] + 2*max_shift + 64)))
+            break;
+    }
+
+decoded:
+    if (nr_start < 2) {
+        memfree(start);
+        memfree(b.bits);
+        return -1;
+    }
+    memset(&b.bits[(b.nr + 7) / 8], 0, b.max/8 + 16 - (b.nr + 7) / 8);
+    if (b.nr & 7)
+        b.bits[b.nr >> 3] &= 0xff00u >> (b.nr & 7);
+
+    a->nr = nr_start - 1;
+    a->nr_bits = len = start[1];
+    max_shift = min(max_shift, len / 4);
+    a->off = memalloc(a->nr * sizeof(*a->off));
+    a->bits = memalloc_nz((len + 7) / 8);
+    memcpy(a->bits, b.bits, (len + 7) / 8);
+    a->stable = memalloc(((len + 63) / 64) * 8);
+    memset(a->stable, 0xff, len / 8);
+    if (len & 7)
+        a->stable[len >> 3] = 0xff00u >> (len & 7);
+
+    for (r = 1; r < a->nr; r++) {
+        base = start[r];
+
+        /* Offset at the index: the best shift over the opening window. */
+        lo = -(int)min_t(uint32_t, max_shift, base);
+        hi = max_shift;
+        n = min_t(uint32_t, min_t(uint32_t, len, SEARCH_WIN),
+                  b.nr - (base + hi));
+        a->off[r] = best_shift(&b, base, 0, n, lo, hi, 0);
+
+        /* Follow the offset's drift, marking the bitcells which differ. */
+        d = a->off[r];
+        for (w = 0; w < len; w += TRACK_WIN) {
+            n = min_t(uint32_t, TRACK_WIN, len - w);
+            lo = max_t(int, d - TRACK_SLIP, -(int)(base + w));
+            hi = d + TRACK_SLIP;
+            if ((int64_t)base + w + hi + n > b.nr)
+                hi = (int)(b.nr - (base + w + n));
+            if (hi < lo) {
+                /* Ran out of bitcells: the rest cannot be shown stable. */
+                memset(&a->stable[w >> 3], 0, (len - w + 7) / 8);
+                break;
+            }
+            d = best_shift(&b, base, w, n, lo, hi, d);
+            mark_unstable(&b, a->stable, base, d, w, n);
+        }
+    }
+
+    memfree(start);
+    memfree(b.bits);
+    return 0;
+}
+
+void stream_align_free(struct stream_align *a)
+{
+    memfree(a->off);
+    memfree(a->bits);
+    memfree(a->stable);
+    memset(a, 0, sizeof(*a));
+}
+
+/* The bitcells of @t twice over, padded, so that get64() can read @len from
+ * any rotation. */
+static uint8_t *double_bits(const struct track_raw *t)
+{
+    uint32_t len = t->bitlen, i, p;
+    uint8_t *src, *dst;
+    uint64_t x;
+
+    src = memalloc((len + 7) / 8 + 16);
+    memcpy(src, t->bits, (len + 7) / 8);
+    if (len & 7)
+        src[len >> 3] &= 0xff00u >> (len & 7);
+
+    dst = memalloc_nz(((2*len + 63) / 64) * 8 + 16);
+    memset(&dst[((2*len + 63) / 64) * 8], 0, 16);
+    for (i = p = 0; i < 2*len; i += 64) {
+        x = get64(src, p);
+        if (len - p < 64)
+            x = (x & (~0ull << (64 - (len - p))))
+                | (get64(src, 0) >> (len - p));
+        x = htobe64(x);
+        memcpy(&dst[i >> 3], &x, 8);
+        if ((p += 64) >= len)
+            p -= len;
+    }
+
+    memfree(src);
+    return dst;
+}
+
+uint32_t track_raw_align(const struct track_raw *a, const struct track_raw *b,
+                         uint32_t *rot, uint8_t **diff)
+{
+    uint32_t len = min(a->bitlen, b->bitlen), cand[3], c, best_c;
+    uint32_t r, pos, start, n, i;
+    uint8_t *x, *y;
+    uint64_t m;
+
+    *rot = 0;
+    if (diff)
+        *diff = NULL;
+    if ((a->bitlen < 64) || (b->bitlen < 64))
+        return len;
+
+    x = double_bits(a);
+    y = double_bits(b);
+
+    /* Same rotation, as for copies of one image: nothing else can beat an
+     * exact match. */
+    best_c = hamming(x, 0, y, 0, len, ~0u);
+    if (best_c == 0)
+        goto out;
+
+    /* Search every rotation over a window from where @a's data starts, which
+     * unlike the gaps is unlikely to match at more than one. Try the rotation
+     * which lines up the two tracks' data first: it often wins, and then
+     * most others are rejected within a word or two. */
+    start = (a->data_start_bc < a->bitlen) ? a->data_start_bc : 0;
+    n = min_t(uint32_t, ROT_WIN, len);
+    cand[0] = 0;
+    cand[1] = (b->data_start_bc < b->bitlen)
+        ? (b->data_start_bc + b->bitlen - start % b->bitlen) % b->bitlen
+        : 0;
+    cand[2] = cand[1];
+    c = hamming(x, start, y, (start + cand[1]) % b->bitlen, n, ~0u);
+    for (r = 0, pos = start % b->bitlen; r < b->bitlen; r++) {
+        i = hamming(x, start, y, pos, n, c);
+        if (i < c) {
+            c = i;
+            cand[2] = r;
+        }
+        if (++pos == b->bitlen)
+            pos = 0;
+    }
+
+    /* The winner over the whole track. */
+    for (i = 1; i < ARRAY_SIZE(cand); i++) {
+        c = hamming(x, 0, y, cand[i], len, best_c);
+        if (c < best_c) {
+            best_c = c;
+            *rot = cand[i];
+        }
+    }
+
+out:
+    if (diff) {
+        *diff = memalloc(((len + 63) / 64) * 8);
+        for (i = 0; i < len; i += 64) {
+            m = get64(x, i) ^ get64(y, *rot + i);
+            if (len - i < 64)
+                m &= ~0ull << (64 - (len - i));
+            m = htobe64(m);
+            memcpy(&(*diff)[i >> 3], &m, 8);
+        }
+    }
+    memfree(x);
+    memfree(y);
+    return best_c;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,101 @@
+/*
+ * libdisk/trace.c
+ *
+ * Timeline tracing: spans of libdisk work, written as Chrome trace-event
+ * JSON (load into Perfetto, or chrome://tracing). Each span is a complete
+ * ("X") event, naming the thread which ran it and the track it was for.
+ */
+
+#include <libdisk/util.h>
+#include <private/disk.h>
+
+#include <time.h>
+#include <unistd.h>
+
+struct trace {
+    FILE *fp;
+    pthread_mutex_t lock;
+    uint64_t t0;
+    unsigned int serial, nr_events, nr_threads;
+};
+
+/* This thread's id in the trace it last recorded to, named by the trace's
+ * serial number: a trace may be allocated where a closed one was. */
+static unsigned int trace_serial;
+static __thread unsigned int tid_serial, trace_tid;
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct trace *trace_open(const char *path)
+{
+    struct trace *trace;
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL)
+        return NULL;
+    fprintf(fp, "[\n");
+    trace = memalloc(sizeof(*trace));
+    trace->fp = fp;
+    trace->serial = __atomic_add_fetch(&trace_serial, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->t0 = trace_now();
+    return trace;
+}
+
+void trace_close(struct trace *trace)
+{
+    if (trace == NULL)
+        return;
+    fprintf(trace->fp, "\n]\n");
+    fclose(trace->fp);
+    pthread_mutex_destroy(&trace->lock);
+    memfree(trace);
+}
+
+uint64_t trace_begin(struct trace *trace)
+{
+    return (trace != NULL) ? trace_now() : 0;
+}
+
+void trace_end(struct trace *trace, const char *cat, const char *name,
+               unsigned int tracknr, uint64_t t0)
+{
+    uint64_t t1;
+
+    if (!t0 || (trace == NULL))
+        return;
+    t1 = trace_now();
+
+    pthread_mutex_lock(&trace->lock);
+    /* Small thread ids, in order of first event, read better than the
+     * system's. */
+    if (tid_serial != trace->serial) {
+        tid_serial = trace->serial;
+        trace_tid = ++trace->nr_threads;
+    }
+    fprintf(trace->fp, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %u",
+            trace->nr_events++ ? ",\n" : "", name, cat,
+            (t0 - trace->t0) / 1e3, (t1 - t0) / 1e3, (int)getpid(),
+            trace_tid);
+    if (tracknr != TRACE_NO_TRACK)
+        fprintf(trace->fp, ", \"args\": {\"track\": \"%u.%u\"}",
+                cyl(tracknr), hd(tracknr));
+    fprintf(trace->fp, "}");
+    pthread_mutex_unlock(&trace->lock);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
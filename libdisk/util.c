@@ -11,6 +11,19 @@
 #include <ctype.h>
 #include <unistd.h>
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define mem_block_size(p) malloc_usable_size(p)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define mem_block_size(p) malloc_size(p)
+#elif defined(__MINGW32__)
+#include <malloc.h>
+#define mem_block_size(p) _msize(p)
+#else
+#define mem_block_size(p) 0
+#endif
+
 void __bug(const char *file, int line)
 {
     warnx("BUG at %s:%d", file, line);
@@ -37,20 +50,122 @@ void filename_extension(const char *filename, char *extension, size_t size)
     extension[i] = '\0';
 }
 
+static bool_t mem_stats_enabled;
+static __thread uint8_t mem_tag;
+static struct mem_stats mem_stats[MEMTAG_NR];
+static uint64_t mem_live, mem_peak;
+
+static const char *const mem_tag_names[] = {
+    [MEMTAG_other] = "other",
+    [MEMTAG_stream] = "stream",
+    [MEMTAG_container] = "container",
+    [MEMTAG_handler] = "handler",
+    [MEMTAG_tbuf] = "tbuf"
+};
+
+static void mem_account_alloc(void *p, size_t size)
+{
+    struct mem_stats *ms = &mem_stats[mem_tag];
+    uint64_t live, peak, bytes = mem_block_size(p);
+
+    __atomic_add_fetch(&ms->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ms->bytes, size, __ATOMIC_RELAXED);
+    if (bytes == 0)
+        return;
+    live = __atomic_add_fetch(&mem_live, bytes, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+    while ((live > peak)
+           && !__atomic_compare_exchange_n(&mem_peak, &peak, live, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        continue;
+}
+
 void *memalloc(size_t size)
 {
     void *p = malloc(size?:1);
     if (p == NULL)
         err(1, NULL);
     memset(p, 0, size);
+    if (mem_stats_enabled)
+        mem_account_alloc(p, size);
+    return p;
+}
+
+void *memalloc_nz(size_t size)
+{
+    void *p = malloc(size?:1);
+    if (p == NULL)
+        err(1, NULL);
+    if (mem_stats_enabled)
+        mem_account_alloc(p, size);
+    return p;
+}
+
+static void mem_account_free(void *p)
+{
+    uint64_t bytes;
+
+    /* Blocks allocated before accounting was enabled are not subtracted
+     * from more than was added. */
+    if (mem_stats_enabled && (p != NULL)
+        && ((bytes = mem_block_size(p)) != 0)) {
+        uint64_t live = __atomic_load_n(&mem_live, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(
+                   &mem_live, &live, (live > bytes) ? live - bytes : 0, 1,
+                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+    }
+}
+
+void *memrealloc(void *p, size_t size)
+{
+    /* Accounted as a free of the old block and an allocation of the new. */
+    mem_account_free(p);
+    if ((p = realloc(p, size?:1)) == NULL)
+        err(1, NULL);
+    if (mem_stats_enabled)
+        mem_account_alloc(p, size);
     return p;
 }
 
 void memfree(void *p)
 {
+    mem_account_free(p);
     free(p);
 }
 
+void mem_enable_stats(int enable)
+{
+    mem_stats_enabled = enable;
+}
+
+enum mem_tag mem_set_tag(enum mem_tag tag)
+{
+    enum mem_tag old = mem_tag;
+    mem_tag = tag;
+    return old;
+}
+
+const char *mem_tag_name(enum mem_tag tag)
+{
+    return (tag < MEMTAG_NR) ? mem_tag_names[tag] : NULL;
+}
+
+int mem_get_stats(enum mem_tag tag, struct mem_stats *stats)
+{
+    if (tag >= MEMTAG_NR)
+        return -1;
+    stats->allocs = __atomic_load_n(&mem_stats[tag].allocs, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&mem_stats[tag].bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void mem_get_usage(uint64_t *live, uint64_t *peak)
+{
+    *live = __atomic_load_n(&mem_live, __ATOMIC_RELAXED);
+    *peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+}
+
 void read_exact(int fd, void *buf, size_t count)
 {
     ssize_t done;
@@ -89,25 +204,47 @@ void write_exact(int fd, const void *buf, size_t count)
     }
 }
 
-static uint32_t crc32_tab[256];
-static void __initcall crc32_tab_init(void)
+/* Slicing-by-8 tables: tab[k][i] is the CRC contribution of byte i followed
+ * by k zero bytes, so eight bytes can be folded in with one lookup each. */
+static uint32_t crc32_tab[8][256];
+static uint16_t crc16_ccitt_tab[8][256];
+static void __initcall crc_tab_init(void)
 {
     unsigned int i, j;
     for (i = 0; i < 256; i++) {
         uint32_t c = i;
-        for (j = 0; j < 8; j++)
+        uint16_t d = i << 8;
+        for (j = 0; j < 8; j++) {
             c = (c >> 1) ^ ((c & 1) ? 0xedb88320 : 0);
-        crc32_tab[i] = c;
+            d = (d << 1) ^ ((d & 0x8000) ? 0x1021 : 0);
+        }
+        crc32_tab[0][i] = c;
+        crc16_ccitt_tab[0][i] = d;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            uint32_t c = crc32_tab[j-1][i];
+            uint16_t d = crc16_ccitt_tab[j-1][i];
+            crc32_tab[j][i] = crc32_tab[0][(uint8_t)c] ^ (c >> 8);
+            crc16_ccitt_tab[j][i] = crc16_ccitt_tab[0][d >> 8] ^ (d << 8);
+        }
     }
 }
 
 uint32_t crc32_add(const void *buf, size_t len, uint32_t crc)
 {
-    unsigned int i;
-    const char *b = buf;
+    const uint8_t *b = buf;
     crc = ~crc;
-    for (i = 0; i < len; i++)
-        crc = crc32_tab[(uint8_t)(crc ^ *b++)] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, b += 8) {
+        uint32_t lo = crc ^ (b[0] | (b[1] << 8) | (b[2] << 16)
+                             | ((uint32_t)b[3] << 24));
+        crc = (crc32_tab[7][(uint8_t)lo] ^ crc32_tab[6][(uint8_t)(lo >> 8)] ^
+               crc32_tab[5][(uint8_t)(lo >> 16)] ^ crc32_tab[4][lo >> 24] ^
+               crc32_tab[3][b[4]] ^ crc32_tab[2][b[5]] ^
+               crc32_tab[1][b[6]] ^ crc32_tab[0][b[7]]);
+    }
+    while (len--)
+        crc = crc32_tab[0][(uint8_t)(crc ^ *b++)] ^ (crc >> 8);
     return ~crc;
 }
 
@@ -116,17 +253,64 @@ uint32_t crc32(const void *buf, size_t len)
     return crc32_add(buf, len, 0);
 }
 
+#define H64_P1 0x9e3779b185ebca87ull
+#define H64_P2 0xc2b2ae3d27d4eb4full
+#define H64_P3 0x165667b19e3779f9ull
+
+static inline uint64_t rol64(uint64_t x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t hash64_add(const void *buf, size_t len, uint64_t h)
+{
+    const uint8_t *b = buf;
+    uint64_t x;
+
+    h ^= len * H64_P3;
+    for (; len >= 8; len -= 8, b += 8) {
+        memcpy(&x, b, 8);
+        h = rol64(h ^ (x * H64_P2), 31) * H64_P1;
+    }
+    if (len != 0) {
+        x = 0;
+        memcpy(&x, b, len);
+        h = rol64(h ^ (x * H64_P2), 31) * H64_P1;
+    }
+
+    /* Avalanche, so that every input bit affects every output bit. */
+    h ^= h >> 33;
+    h *= H64_P2;
+    h ^= h >> 29;
+    h *= H64_P3;
+    h ^= h >> 32;
+    return h;
+}
+
 uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc)
 {
-    unsigned int i;
     const uint8_t *b = buf;
-    for (i = 0; i < len; i++) {
-        crc  = (uint8_t)(crc >> 8) | (crc << 8);
-        crc ^= *b++;
-        crc ^= (uint8_t)crc >> 4;
-        crc ^= crc << 12;
-        crc ^= (crc & 0xff) << 5;
+    for (; len >= 8; len -= 8, b += 8) {
+        crc = (crc16_ccitt_tab[7][b[0] ^ (crc >> 8)] ^
+               crc16_ccitt_tab[6][b[1] ^ (uint8_t)crc] ^
+               crc16_ccitt_tab[5][b[2]] ^ crc16_ccitt_tab[4][b[3]] ^
+               crc16_ccitt_tab[3][b[4]] ^ crc16_ccitt_tab[2][b[5]] ^
+               crc16_ccitt_tab[1][b[6]] ^ crc16_ccitt_tab[0][b[7]]);
     }
+    while (len--)
+        crc = crc16_ccitt_tab[0][*b++ ^ (crc >> 8)] ^ (crc << 8);
+    return crc;
+}
+
+uint16_t crc16_ccitt_bits(uint32_t x, unsigned int bits, uint16_t crc)
+{
+    while (bits >= 8) {
+        bits -= 8;
+        crc = crc16_ccitt_tab[0][(uint8_t)(x >> bits) ^ (crc >> 8)]
+            ^ (crc << 8);
+    }
+    while (bits--)
+        crc = crc16_ccitt_bit((x >> bits) & 1, crc);
     return crc;
 }
 
@@ -145,6 +329,32 @@ uint16_t rnd16(uint32_t *p_seed)
     return *p_seed >> 16;
 }
 
+#define RND_A 1103515245u
+#define RND_C 12345u
+
+void rnd16_bulk(uint32_t *p_seed, uint16_t *out, unsigned int nr)
+{
+    /* Each of four lanes steps directly from the last seed of the previous
+     * four, so that the multiplies do not wait on one another. */
+    const uint32_t a2 = RND_A*RND_A, a3 = a2*RND_A, a4 = a3*RND_A;
+    const uint32_t c2 = RND_C*(1+RND_A), c3 = c2 + RND_C*a2;
+    const uint32_t c4 = c3 + RND_C*a3;
+    uint32_t seed = *p_seed;
+
+    for (; nr >= 4; nr -= 4) {
+        out[0] = (seed*RND_A + RND_C) >> 16;
+        out[1] = (seed*a2 + c2) >> 16;
+        out[2] = (seed*a3 + c3) >> 16;
+        seed = seed*a4 + c4;
+        out[3] = seed >> 16;
+        out += 4;
+    }
+    while (nr--)
+        *out++ = rnd16(&seed);
+
+    *p_seed = seed;
+}
+
 #if !defined(__PLATFORM_HAS_ENDIAN_H__)
 
 uint16_t htobe16(uint16_t host_16bits)
@@ -16,6 +16,9 @@
 
 #define SUBSYSTEM subsystem_main
 
+/* Longest loop, in instructions, which may be found to be idle. */
+#define IDLE_MAX_INSNS 8
+
 #define CUSTOM_BASE 0xdff000
 #define CIAA_BASE   0xbfe001
 #define CIAB_BASE   0xbfd000
@@ -23,31 +26,80 @@
 void __assert_failed(
     struct amiga_state *s, const char *file, unsigned int line)
 {
+    logging_dump(s);
     errx(1, "Assertion failed at %s:%u", file, line);
 }
 
+#define count_access(s, acc) do {            \
+    if ((s)->ctxt.profile)                  \
+        (s)->accesses[acc]++;               \
+} while (0)
+
+/* I/O reads which idle-loop detection must know about. DSKBYTR changes as
+ * the disk streams, and reading a non-zero ICR clears it. INTREQR and ICR
+ * hold flags which the disk may raise between events. */
+static void idle_custom_read(struct amiga_state *s, uint16_t addr)
+{
+    if ((addr >> 1) == CUST_dskbytr)
+        s->idle.dirty = 1;
+    else if ((addr >> 1) == CUST_intreqr)
+        s->idle.disk = 1;
+}
+
+static void idle_cia_read(struct amiga_state *s, uint8_t off, uint8_t val)
+{
+    if ((off >= CIATALO) && (off <= CIATBHI)) {
+        s->idle.dirty = 1;
+        return;
+    }
+    if (off != CIAICR)
+        return;
+    s->idle.disk = 1;
+    if (val)
+        s->idle.dirty = 1;
+}
+
 static int amiga_read(uint32_t addr, uint32_t *val, unsigned int bytes,
                       struct m68k_emulate_ctxt *ctxt)
 {
     struct amiga_state *s = container_of(ctxt, struct amiga_state, ctxt);
+    struct memory *m;
 
     if (addr & 0xff000000)
         log_warn("32-bit address access %08x @ PC=%08x", addr, ctxt->regs->pc);
     addr &= 0xffffff;
 
+    /* RAM and ROM pages need no I/O decode. */
+    if ((m = s->mem_page[addr >> MEM_PAGE_SHIFT]) != NULL) {
+        count_access(s, (m == s->ram) ? acc_ram : acc_rom);
+        if (addr + bytes - 1 <= m->end)
+            return mem_read_at(m, addr, val, bytes);
+        return mem_read(addr, val, bytes, s);
+    }
+
+    /* The disk is observed only through I/O: bring it up to date. */
+    disk_sync(s);
+
     if ((addr & 0xfff0ff) == CIAB_BASE) {
+        count_access(s, acc_cia);
         *val = cia_read_reg(s, &s->ciab, (addr >> 8) & 15);
+        idle_cia_read(s, (addr >> 8) & 15, *val);
         return M68KEMUL_OKAY;
     }
 
     if ((addr & 0xfff0ff) == CIAA_BASE) {
+        count_access(s, acc_cia);
         *val = cia_read_reg(s, &s->ciaa, (addr >> 8) & 15);
+        idle_cia_read(s, (addr >> 8) & 15, *val);
         return M68KEMUL_OKAY;
     }
 
     if ((addr & 0xfff000) == CUSTOM_BASE) {
+        count_access(s, acc_custom);
         addr -= CUSTOM_BASE;
+        idle_custom_read(s, addr & ~1);
         if (bytes == 4) {
+            idle_custom_read(s, addr + 2);
             *val = (custom_read_reg(s, addr) << 16)
                 | custom_read_reg(s, addr + 2);
         } else if (bytes == 2) {
@@ -61,6 +113,7 @@ static int amiga_read(uint32_t addr, uint32_t *val, unsigned int bytes,
         return M68KEMUL_OKAY;
     }
 
+    count_access(s, acc_other);
     return mem_read(addr, val, bytes, s);
 }
 
@@ -68,22 +121,40 @@ static int amiga_write(uint32_t addr, uint32_t val, unsigned int bytes,
                        struct m68k_emulate_ctxt *ctxt)
 {
     struct amiga_state *s = container_of(ctxt, struct amiga_state, ctxt);
+    struct memory *m;
 
     if (addr & 0xff000000)
         log_warn("32-bit address access %08x @ PC=%08x", addr, ctxt->regs->pc);
     addr &= 0xffffff;
+    s->idle.dirty = 1;
+    if (ctxt->icache)
+        m68k_icache_invalidate(ctxt->icache, addr, bytes);
+
+    /* RAM and ROM pages need no I/O decode. */
+    if ((m = s->mem_page[addr >> MEM_PAGE_SHIFT]) != NULL) {
+        count_access(s, (m == s->ram) ? acc_ram : acc_rom);
+        if (addr + bytes - 1 <= m->end)
+            return mem_write_at(m, addr, val, bytes);
+        return mem_write(addr, val, bytes, s);
+    }
+
+    /* The disk is observed only through I/O: bring it up to date. */
+    disk_sync(s);
 
     if ((addr & 0xfff0ff) == CIAB_BASE) {
+        count_access(s, acc_cia);
         cia_write_reg(s, &s->ciab, (addr >> 8) & 15, val);
         return M68KEMUL_OKAY;
     }
 
     if ((addr & 0xfff0ff) == CIAA_BASE) {
+        count_access(s, acc_cia);
         cia_write_reg(s, &s->ciaa, (addr >> 8) & 15, val);
         return M68KEMUL_OKAY;
     }
 
     if ((addr & 0xfff000) == CUSTOM_BASE) {
+        count_access(s, acc_custom);
         addr -= CUSTOM_BASE;
         if (bytes == 4) {
             custom_write_reg(s, addr, val >> 16);
@@ -94,9 +165,11 @@ static int amiga_write(uint32_t addr, uint32_t val, unsigned int bytes,
             val = (uint8_t)val;
             custom_write_reg(s, addr&~1, val << (!(addr&1)?8:0));
         }
+        disk_sync(s); /* DMA may have started or stopped */
         return M68KEMUL_OKAY;
     }
 
+    count_access(s, acc_other);
     if ((addr & 0xff0000) == 0xff0000)
         return mem_write(addr, val, bytes, s);
 
@@ -161,26 +234,109 @@ static struct m68k_emulate_ops amiga_m68k_ops = {
     .deliver_exception = amiga_deliver_exception
 };
 
+static bool_t regs_equal(const struct m68k_regs *a, const struct m68k_regs *b)
+{
+    return (!memcmp(a->d, b->d, sizeof(a->d))
+            && !memcmp(a->a, b->a, sizeof(a->a))
+            && (a->pc == b->pc) && (a->xsp == b->xsp) && (a->sr == b->sr));
+}
+
+/* A branch back to @pc. If the previous one was to the same place, with the
+ * same registers, and the loop in between only read state which has not
+ * changed, then every iteration will be the same until the next event fires,
+ * or the disk raises a flag which the loop reads. Fast-forward over all the
+ * iterations which would complete before then. */
+static void idle_check(struct amiga_state *s)
+{
+    struct event_base *base = &s->event_base;
+    struct m68k_regs *regs = s->ctxt.regs;
+    time_ns_t now = base->current_time, iter, limit, skip;
+
+    m68k_sync_flags(&s->ctxt);
+    if ((s->idle.head == regs->pc) && !s->idle.dirty
+        && (s->idle.insns <= IDLE_MAX_INSNS)
+        && regs_equal(&s->idle.regs, regs)) {
+        iter = now - s->idle.time;
+        limit = event_next_time(base);
+        if (s->idle.disk)
+            limit = disk_next_flag(s, limit);
+        /* Without an event to wait for, the loop never exits. */
+        if ((limit != ~(time_ns_t)0) && (limit > now) && (iter != 0)) {
+            skip = ((limit - now - 1) / iter) * iter;
+            base->current_time = now += skip;
+            s->idle.skipped += skip;
+        }
+    } else {
+        s->idle.head = regs->pc;
+        s->idle.regs = *regs;
+    }
+
+    s->idle.time = now;
+    s->idle.insns = 0;
+    s->idle.dirty = s->idle.disk = 0;
+}
+
 int amiga_emulate(struct amiga_state *s)
 {
+    uint32_t pc = s->ctxt.regs->pc;
     int rc = m68k_emulate(&s->ctxt);
-    if ((rc != M68KEMUL_OKAY) || !s->ctxt.emulate)
+    if ((rc != M68KEMUL_OKAY) || !s->ctxt.emulate) {
+        s->idle.dirty = 1;
         return rc;
+    }
     s->event_base.current_time += s->ctxt.cycles * M68K_CYCLE_NS;
-    fire_events(&s->event_base);
+    if (s->event_base.current_time >= event_next_time(&s->event_base)) {
+        fire_events(&s->event_base);
+        s->idle.dirty = 1;
+    }
+    if (s->ctxt.regs->pc <= pc)
+        idle_check(s);
+    else
+        s->idle.insns++;
     return rc;
 }
 
-void amiga_init(struct amiga_state *s, unsigned int mem_size)
+void amiga_profile_report(
+    struct amiga_state *s, void (*print)(const char *, ...))
+{
+    static const char *const acc_name[NR_ACC] = {
+        [acc_ram] = "RAM", [acc_rom] = "ROM", [acc_cia] = "CIA",
+        [acc_custom] = "Custom", [acc_other] = "Other"
+    };
+    unsigned int i;
+
+    if (s->ctxt.profile == NULL)
+        return;
+
+    m68k_profile_report(s->ctxt.profile, print);
+    print("  %-20s %12s\n", "Memory accesses", "Count");
+    for (i = 0; i < NR_ACC; i++)
+        print("  %-20s %12llu\n", acc_name[i],
+              (unsigned long long)s->accesses[i]);
+    print("  %-20s %12llu\n", "Idle loop skip (us)",
+          (unsigned long long)(s->idle.skipped / 1000));
+}
+
+void amiga_init(struct amiga_state *s, unsigned int mem_size,
+                const char *df0_filename, FILE *logfile)
 {
     memset(s, 0, sizeof(*s));
     s->ctxt.regs = memalloc(sizeof(*s->ctxt.regs));
     s->ctxt.ops = &amiga_m68k_ops;
+    logging_init(s, logfile);
+    event_base_init(&s->event_base);
     s->ram = mem_init(s, 0, mem_size);
-    s->rom = mem_init(s, ROM_BASE, ROM_SIZE);
+    if (df0_filename != NULL)
+        s->rom = mem_init(s, ROM_BASE, ROM_SIZE);
+    /* I/O decode takes precedence over any memory in these pages. */
+    mem_unmap_page(s, CIAA_BASE);
+    mem_unmap_page(s, CIAB_BASE);
+    mem_unmap_page(s, CUSTOM_BASE);
     exec_init(s);
-    logging_init(s);
-    disk_init(s);
+    cia_init(s, &s->ciaa);
+    cia_init(s, &s->ciab);
+    custom_init(s);
+    disk_init(s, df0_filename);
 
     /* Reserve space for stacks. */
     mem_reserve(s, 0, 0x2000);
@@ -188,6 +344,18 @@ void amiga_init(struct amiga_state *s, unsigned int mem_size)
     s->ctxt.regs->xsp = 0x1000;  /* SSP */
 }
 
+void amiga_destroy(struct amiga_state *s)
+{
+    disk_destroy(s);
+    cia_destroy(&s->ciaa);
+    cia_destroy(&s->ciab);
+    mem_destroy(s);
+    event_base_destroy(&s->event_base);
+    memfree(s->ctxt.regs);
+    logging_dump(s);
+    logging_destroy(s);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -28,6 +28,13 @@
 #define ROM_BASE 0xff0000
 #define ROM_SIZE (256*1024)
 
+enum { acc_ram, acc_rom, acc_cia, acc_custom, acc_other, NR_ACC };
+
+/* Custom register handlers, indexed by register number (offset/2). */
+struct amiga_state;
+typedef uint16_t custom_read_fn(struct amiga_state *, uint16_t reg);
+typedef void custom_write_fn(struct amiga_state *, uint16_t reg, uint16_t val);
+
 struct amiga_state {
     /* 68000 register state */
     struct m68k_emulate_ctxt ctxt;
@@ -38,6 +45,9 @@ struct amiga_state {
     /* Emulated RAM/ROM */
     struct memory *memory;
     struct memory *ram, *rom;
+    struct memory *mem_page[MEM_NR_PAGES];
+    /* Snapshot which memory matched when dirty pages were last cleared. */
+    struct amiga_snapshot *mem_snapshot;
 
     /* Emulated CIA chips */
     struct cia ciaa, ciab;
@@ -51,9 +61,27 @@ struct amiga_state {
     /* Logging. */
     enum loglevel max_loglevel;
     FILE *logfile;
+    struct log_entry *log_ring;
+    uint64_t log_prod, log_cons;
 
-    /* Custom registers. */
+    /* Custom registers, and their handlers (see custom_init()). */
     uint16_t custom[256];
+    custom_read_fn *custom_read[256];
+    custom_write_fn *custom_write[256];
+
+    /* Memory accesses by region, counted while ctxt.profile is set. */
+    uint64_t accesses[NR_ACC];
+
+    /* Idle-loop detection (see amiga_emulate()). */
+    struct {
+        uint32_t head;         /* PC most recently branched back to */
+        struct m68k_regs regs; /* registers on arrival at @head */
+        time_ns_t time;        /* time of arrival at @head */
+        unsigned int insns;    /* instructions emulated since */
+        uint8_t dirty;         /* machine state may have changed since */
+        uint8_t disk;          /* a flag the disk may raise was read since */
+        time_ns_t skipped;     /* total time fast-forwarded */
+    } idle;
 };
 
 void __assert_failed(
@@ -62,10 +90,21 @@ void __assert_failed(
         if (!(p)) __assert_failed(s, __FILE__, __LINE__);       \
 } while (0)
 
-void amiga_init(struct amiga_state *, unsigned int mem_size);
+/* Without @df0_filename the machine has no drive, and no ROM: only RAM. */
+void amiga_init(struct amiga_state *, unsigned int mem_size,
+                const char *df0_filename, FILE *logfile);
+void amiga_destroy(struct amiga_state *);
 int amiga_emulate(struct amiga_state *);
-
-void amiga_insert_df0(const char *filename);
+void amiga_profile_report(
+    struct amiga_state *, void (*print)(const char *, ...));
+
+/* Checkpoint the whole machine, and later return to the checkpoint. Only
+ * memory pages written since are copied back when restoring the snapshot
+ * most recently taken or restored. Weak bits and PRNG-generated tracks are
+ * re-randomised. */
+struct amiga_snapshot *amiga_snapshot(struct amiga_state *);
+void amiga_restore(struct amiga_state *, struct amiga_snapshot *);
+void amiga_snapshot_free(struct amiga_state *, struct amiga_snapshot *);
 
 void exec_init(struct amiga_state *);
 
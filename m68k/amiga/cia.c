@@ -19,6 +19,125 @@ static const char *cia_name(struct cia *cia, struct amiga_state *s)
     return is_ciaa(cia,s) ? "CIAA" : "CIAB";
 }
 
+static uint8_t *timer_cr(struct cia_timer *t)
+{
+    return t->idx ? &t->cia->crb : &t->cia->cra;
+}
+
+/* Only counting of the E clock is emulated: INMODE must be 0. */
+static bool_t timer_running(struct cia_timer *t)
+{
+    uint8_t cr = *timer_cr(t);
+    return ((cr & (1u << CIACRAB_START))
+            && !(cr & (t->idx ? 3u << CIACRBB_INMODE0
+                       : 1u << CIACRAB_INMODE)));
+}
+
+/* Count the timer down to the current time. On underflow it reloads from
+ * the latch and raises its ICR flag, and in one-shot mode it stops. */
+static void timer_sync(struct cia_timer *t)
+{
+    struct amiga_state *s = t->s;
+    time_ns_t now = s->event_base.current_time;
+    uint64_t n;
+
+    n = now / CIA_TICK_NS - t->time / CIA_TICK_NS;
+    t->time = now;
+    if (!timer_running(t) || (n <= t->val)) {
+        if (timer_running(t))
+            t->val -= n;
+        return;
+    }
+
+    n -= t->val + 1;
+    cia_set_icr_flag(s, t->cia, t->idx ? CIAICRB_TB : CIAICRB_TA);
+    if (*timer_cr(t) & (1u << CIACRAB_RUNMODE)) {
+        *timer_cr(t) &= ~(1u << CIACRAB_START);
+        t->val = t->latch;
+    } else {
+        t->val = t->latch - n % (t->latch + 1);
+    }
+}
+
+/* Set the underflow event if anyone may see the underflow happen. Called
+ * with the timer synced to the current time. */
+static void timer_schedule(struct cia_timer *t)
+{
+    uint8_t icr_bit = t->idx ? CIAICRB_TB : CIAICRB_TA;
+
+    if (timer_running(t)
+        && (t->watched || (t->cia->icrw & (1u << icr_bit))))
+        event_set(&t->underflow,
+                  (t->time / CIA_TICK_NS + t->val + 1) * CIA_TICK_NS);
+    else
+        event_unset(&t->underflow);
+}
+
+static void timer_watch(struct cia_timer *t)
+{
+    timer_sync(t);
+    t->watched = 1;
+    timer_schedule(t);
+}
+
+static void underflow_cb(void *_t)
+{
+    struct cia_timer *t = _t;
+    timer_sync(t);
+    timer_schedule(t);
+}
+
+static void timer_write_cr(struct cia_timer *t, uint8_t val)
+{
+    struct amiga_state *s = t->s;
+    uint8_t inmode = t->idx ? 3u << CIACRBB_INMODE0 : 1u << CIACRAB_INMODE;
+
+    timer_sync(t);
+    if (val & (1u << CIACRAB_LOAD))
+        t->val = t->latch;
+    if ((val & inmode) && (val & (1u << CIACRAB_START)))
+        log_warn("%s timer %c: only E-clock counting is emulated",
+                 cia_name(t->cia, s), 'A' + t->idx);
+    *timer_cr(t) = val & ~(1u << CIACRAB_LOAD);
+    t->watched = 0;
+    timer_schedule(t);
+}
+
+static void timer_write_hi(struct cia_timer *t, uint8_t val)
+{
+    timer_sync(t);
+    t->latch = (t->latch & 0xff) | ((uint16_t)val << 8);
+    /* A stopped timer loads the latch. In one-shot mode the timer also
+     * starts. */
+    if (*timer_cr(t) & (1u << CIACRAB_RUNMODE))
+        *timer_cr(t) |= 1u << CIACRAB_START;
+    else if (timer_running(t))
+        return;
+    t->val = t->latch;
+    t->watched = 0;
+    timer_schedule(t);
+}
+
+void cia_init(struct amiga_state *s, struct cia *cia)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2; i++) {
+        cia->timer[i].idx = i;
+        cia->timer[i].s = s;
+        cia->timer[i].cia = cia;
+        cia->timer[i].latch = cia->timer[i].val = 0xffff;
+        event_init(&s->event_base, &cia->timer[i].underflow,
+                   underflow_cb, &cia->timer[i]);
+    }
+}
+
+void cia_destroy(struct cia *cia)
+{
+    event_unset(&cia->timer[0].underflow);
+    event_unset(&cia->timer[1].underflow);
+}
+
 void cia_write_reg(
     struct amiga_state *s, struct cia *cia, uint8_t off, uint8_t val)
 {
@@ -40,32 +159,28 @@ void cia_write_reg(
         cia->ddrb = val;
         break;
     case CIATALO:
-        cia->ta_latch = (cia->ta_latch & 0xff00) | val;
+    case CIATBLO: {
+        struct cia_timer *t = &cia->timer[off == CIATBLO];
+        t->latch = (t->latch & 0xff00) | val;
         break;
+    }
     case CIATAHI:
-        cia->ta_latch = (cia->ta_latch & 0xff) | ((uint16_t)val<<8);
-        /* Load current time if CRA[0]=0 (time stopped) */
-        /* Start timer if CRA[3]=1 (one-shot mode) */
-        break;
-    case CIATBLO:
-        cia->tb_latch = (cia->tb_latch & 0xff00) | val;
-        break;
     case CIATBHI:
-        cia->tb_latch = (cia->tb_latch & 0xff) | ((uint16_t)val<<8);
-        /* Load current time if CRB[0]=0 (time stopped) */
-        /* Start timer if CRB[3]=1 (one-shot mode) */
+        timer_write_hi(&cia->timer[off == CIATBHI], val);
         break;
     case CIAICR:
         if (val & 0x80)
             cia->icrw |= val & 0x7f;
         else
             cia->icrw &= ~val;
+        timer_sync(&cia->timer[0]);
+        timer_schedule(&cia->timer[0]);
+        timer_sync(&cia->timer[1]);
+        timer_schedule(&cia->timer[1]);
         break;
     case CIACRA:
-        cia->cra = val;
-        break;
     case CIACRB:
-        cia->crb = val;
+        timer_write_cr(&cia->timer[off == CIACRB], val);
         break;
     default:
         log_error("Ignoring write to %s reg %x\n", cia_name(cia,s), off);
@@ -92,26 +207,24 @@ uint8_t cia_read_reg(
         val = cia->ddrb;
         break;
     case CIATALO:
-        val = cia->ta_latch;
-        break;
     case CIATAHI:
-        val = cia->ta_latch >> 8;
-        break;
     case CIATBLO:
-        val = cia->tb_latch;
-        break;
-    case CIATBHI:
-        val = cia->tb_latch >> 8;
+    case CIATBHI: {
+        struct cia_timer *t = &cia->timer[off >= CIATBLO];
+        timer_sync(t);
+        val = (off & 1) ? t->val >> 8 : t->val;
         break;
+    }
     case CIAICR:
+        timer_watch(&cia->timer[0]);
+        timer_watch(&cia->timer[1]);
         val = cia->icrr;
         cia->icrr = 0;
         break;
     case CIACRA:
-        val = cia->cra;
-        break;
     case CIACRB:
-        val = cia->crb;
+        timer_watch(&cia->timer[off == CIACRB]);
+        val = (off == CIACRB) ? cia->crb : cia->cra;
         break;
     default:
         log_error("Ignoring read from %s reg %x\n", cia_name(cia,s), off);
@@ -13,12 +13,29 @@
 
 #define CIA_TICK_NS (M68K_CYCLE_NS*10)
 
+struct amiga_state;
+struct cia;
+
+/* A timer is not ticked: its counter is worked out from the clock when it is
+ * observed. While running, it held @val at @time, and counts down once per
+ * E-clock tick (each multiple of CIA_TICK_NS). The @underflow event is set
+ * only while its ICR flag or run state may be seen without the counter being
+ * read: when its interrupt is enabled, or ICR or its control register has
+ * been read since it was last programmed. */
+struct cia_timer {
+    uint16_t latch, val;
+    time_ns_t time;
+    uint8_t idx, watched;
+    struct event underflow;
+    struct amiga_state *s;
+    struct cia *cia;
+};
+
 struct cia {
     /* Peripheral data registers, and their direction masks. */
     uint8_t pra_o, pra_i, prb_o, prb_i, ddra, ddrb;
-    /* Timer A/B latches, and when the timer started in current mode. */
-    uint16_t ta_latch, tb_latch;
-    time_ns_t ta_started, tb_started;
+    /* Timers A and B. */
+    struct cia_timer timer[2];
     /* TOD latch, and when TOD started counting up from this value. */
     uint32_t tod_latch;
     time_ns_t tod_started;
@@ -28,8 +45,8 @@ struct cia {
     uint8_t cra, crb;
 };
 
-struct amiga_state;
-
+void cia_init(struct amiga_state *, struct cia *);
+void cia_destroy(struct cia *);
 void cia_write_reg(
     struct amiga_state *, struct cia *, uint8_t off, uint8_t val);
 uint8_t cia_read_reg(
@@ -37,7 +54,7 @@ uint8_t cia_read_reg(
 void cia_set_icr_flag(
     struct amiga_state *, struct cia *, uint8_t bit);
 
-const char *cia_reg_name[16];
+extern const char *cia_reg_name[16];
 
 /* CIA registers. */
 #define CIAPRA    0x0
@@ -11,73 +11,134 @@
 
 #define SUBSYSTEM subsystem_main
 
-void custom_write_reg(struct amiga_state *s, uint16_t addr, uint16_t val)
-{
-    addr >>= 1;
-    if (addr >= ARRAY_SIZE(custom_reg_name))
-        return;
-
-    switch (addr) {
-    case CUST_dsklen:
-        s->custom[addr] = val;
-        disk_dsklen_changed(s);
-        break;
-    case CUST_dmacon:
-    case CUST_intena:
-    case CUST_intreq:
-    case CUST_adkcon:
-        if (val & 0x8000)
-            s->custom[addr] |= val & 0x7fff;
-        else
-            s->custom[addr] &= ~val;
-        break;
-    default:
-        s->custom[addr] = val;
-        break;
-    }
+static void log_write(struct amiga_state *s, enum subsystem subsystem,
+                      uint16_t reg, uint16_t val)
+{
+    _log_info(subsystem, "Write %04x to custom register %s (%x) becomes %04x",
+              val, custom_reg_name[reg], (reg<<1)+0xdff000, s->custom[reg]);
+}
 
-    log_info("Write %04x to custom register %s (%x) becomes %04x",
-             val, custom_reg_name[addr], (addr<<1)+0xdff000,
-             s->custom[addr]);
-}
-
-uint16_t custom_read_reg(struct amiga_state *s, uint16_t addr)
-{
-    uint16_t val = 0xffff;
-
-    addr >>= 1;
-    if (addr >= ARRAY_SIZE(custom_reg_name))
-        return val;
-
-    switch (addr) {
-    case CUST_dmaconr:
-        val = s->custom[CUST_dmacon];
-        break;
-    case CUST_adkconr:
-        val = s->custom[CUST_adkcon];
-        break;
-    case CUST_intenar:
-        val = s->custom[CUST_intena];
-        break;
-    case CUST_intreqr:
-        val = s->custom[CUST_intreq];
-        break;
-    case CUST_dskbytr:
-        val = s->custom[CUST_dskbytr];
-        s->custom[CUST_dskbytr] &= 0x7fff;
-        break;
-    default:
-        val = s->custom[addr];
-        break;
-    }
+static void log_read(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+    log_info("Read %04x from custom register %s (%x)",
+             val, custom_reg_name[reg], (reg<<1)+0xdff000);
+}
 
-    if ((addr != CUST_dskbytr) && (addr != CUST_intreqr))
-        log_info("Read %04x from custom register %s (%x)",
-                 val, custom_reg_name[addr], (addr<<1)+0xdff000);
+/* Registers without side effects. */
+static void write_plain(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+    s->custom[reg] = val;
+    log_write(s, SUBSYSTEM, reg, val);
+}
 
+static uint16_t read_plain(struct amiga_state *s, uint16_t reg)
+{
+    uint16_t val = s->custom[reg];
+    log_read(s, reg, val);
     return val;
 }
 
+/* Unimplemented registers beyond the end of the name table. */
+static void write_none(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+}
+
+static uint16_t read_none(struct amiga_state *s, uint16_t reg)
+{
+    return 0xffff;
+}
+
+/* DMACON, INTENA, INTREQ, ADKCON: bit 15 selects set or clear. */
+static void write_setclr(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+    if (val & 0x8000)
+        s->custom[reg] |= val & 0x7fff;
+    else
+        s->custom[reg] &= ~val;
+    log_write(s, SUBSYSTEM, reg, val);
+}
+
+/* DMACONR, ADKCONR, INTENAR read back their write-only counterparts. */
+static uint16_t read_dmaconr(struct amiga_state *s, uint16_t reg)
+{
+    uint16_t val = s->custom[CUST_dmacon];
+    log_read(s, reg, val);
+    return val;
+}
+
+static uint16_t read_adkconr(struct amiga_state *s, uint16_t reg)
+{
+    uint16_t val = s->custom[CUST_adkcon];
+    log_read(s, reg, val);
+    return val;
+}
+
+static uint16_t read_intenar(struct amiga_state *s, uint16_t reg)
+{
+    uint16_t val = s->custom[CUST_intena];
+    log_read(s, reg, val);
+    return val;
+}
+
+/* INTREQR and DSKBYTR are polled: reads are not logged. */
+static uint16_t read_intreqr(struct amiga_state *s, uint16_t reg)
+{
+    return s->custom[CUST_intreq];
+}
+
+static uint16_t read_dskbytr(struct amiga_state *s, uint16_t reg)
+{
+    uint16_t val = s->custom[CUST_dskbytr];
+    s->custom[CUST_dskbytr] &= 0x7fff; /* DSKBYT clears on read */
+    return val;
+}
+
+/* Disk DMA registers. */
+static void write_dskpt(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+    s->custom[reg] = val;
+    log_write(s, subsystem_disk, reg, val);
+}
+
+static void write_dsklen(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+    s->custom[CUST_dsklen] = val;
+    disk_dsklen_changed(s);
+    log_write(s, subsystem_disk, reg, val);
+}
+
+static void write_dsksync(struct amiga_state *s, uint16_t reg, uint16_t val)
+{
+    s->custom[CUST_dsksync] = val;
+    log_write(s, subsystem_disk, reg, val);
+}
+
+void custom_init(struct amiga_state *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->custom_read); i++) {
+        bool_t named = (i < ARRAY_SIZE(custom_reg_name));
+        s->custom_read[i] = named ? read_plain : read_none;
+        s->custom_write[i] = named ? write_plain : write_none;
+    }
+
+    s->custom_read[CUST_dmaconr] = read_dmaconr;
+    s->custom_read[CUST_adkconr] = read_adkconr;
+    s->custom_read[CUST_intenar] = read_intenar;
+    s->custom_read[CUST_intreqr] = read_intreqr;
+    s->custom_read[CUST_dskbytr] = read_dskbytr;
+
+    s->custom_write[CUST_dmacon] = write_setclr;
+    s->custom_write[CUST_intena] = write_setclr;
+    s->custom_write[CUST_intreq] = write_setclr;
+    s->custom_write[CUST_adkcon] = write_setclr;
+    s->custom_write[CUST_dskpth] = write_dskpt;
+    s->custom_write[CUST_dskptl] = write_dskpt;
+    s->custom_write[CUST_dsklen] = write_dsklen;
+    s->custom_write[CUST_dsksync] = write_dsksync;
+}
+
 void intreq_set_bit(struct amiga_state *s, uint8_t bit)
 {
     if (!(s->custom[CUST_intreq] & (1u<<bit)))
@@ -9,12 +9,28 @@
 #ifndef __AMIGA_CUSTOM_H__
 #define __AMIGA_CUSTOM_H__
 
-void custom_write_reg(struct amiga_state *s, uint16_t addr, uint16_t val);
-uint16_t custom_read_reg(struct amiga_state *s, uint16_t addr);
+void custom_init(struct amiga_state *s);
+
+/* @addr is the byte offset from the custom chip base. Accesses beyond the
+ * last register are ignored, and read as all ones. */
+static inline void custom_write_reg(
+    struct amiga_state *s, uint16_t addr, uint16_t val)
+{
+    addr >>= 1;
+    if (addr < ARRAY_SIZE(s->custom_write))
+        s->custom_write[addr](s, addr, val);
+}
+
+static inline uint16_t custom_read_reg(struct amiga_state *s, uint16_t addr)
+{
+    addr >>= 1;
+    return ((addr < ARRAY_SIZE(s->custom_read))
+            ? s->custom_read[addr](s, addr) : 0xffff);
+}
 
 void intreq_set_bit(struct amiga_state *s, uint8_t bit);
 
-const char *custom_reg_name[243];
+extern const char *custom_reg_name[243];
 
 #define CUST_dmaconr  (0x02/2)
 #define CUST_adkconr  (0x10/2)
@@ -20,23 +20,43 @@
 
 #define SUBSYSTEM subsystem_disk
 
-static const char *df0_filename =
-    "/home/keir/Amiga/raw_dumps/newzealandstory/nzs.dat";
-
 #define STEP_DELAY     MILLISECS(1)
 #define MOTORON_DELAY  MILLISECS(100)
 #define MOTOROFF_DELAY MILLISECS(1)
 
+static unsigned int cell_ns(struct amiga_state *s, unsigned int pos)
+{
+    uint16_t speed = track_raw_speed(s->disk.track_raw)[pos];
+    if (speed == SPEED_WEAK)
+        return s->disk.av_ns_per_cell;
+    return (s->disk.av_ns_per_cell * speed) / SPEED_AVG;
+}
+
 static void track_load_byte(struct amiga_state *s)
 {
-    uint16_t speed = s->disk.track_raw->speed[s->disk.input_pos];
-    if (speed == SPEED_WEAK) {
-        s->disk.ns_per_cell = s->disk.av_ns_per_cell;
+    unsigned int pos = s->disk.input_pos;
+    s->disk.ns_per_cell = cell_ns(s, pos);
+    if (track_raw_speed(s->disk.track_raw)[pos] == SPEED_WEAK)
         s->disk.input_byte = (uint8_t)random();
-    } else {
-        s->disk.ns_per_cell = (s->disk.av_ns_per_cell * speed) / SPEED_AVG;
-        s->disk.input_byte = s->disk.track_raw->bits[s->disk.input_pos/8];
+    else
+        s->disk.input_byte = s->disk.track_raw->bits[pos/8];
+}
+
+/* Time at which the bitcell @cells ahead of the last one streamed ends. */
+static time_ns_t cell_time(struct amiga_state *s, unsigned int cells)
+{
+    time_ns_t t = s->disk.last_bitcell_time;
+    unsigned int pos = s->disk.input_pos, ns = s->disk.ns_per_cell;
+
+    while (cells--) {
+        t += ns;
+        if (++pos == s->disk.track_raw->bitlen)
+            pos = 0;
+        if (!(pos & 7))
+            ns = cell_ns(s, pos);
     }
+
+    return t;
 }
 
 static void disk_dma_word(struct amiga_state *s, uint16_t w)
@@ -58,9 +78,9 @@ static void disk_dma_word(struct amiga_state *s, uint16_t w)
     }
 }
 
-static void data_cb(void *_s)
+/* Stream every bitcell which has passed under the head since last time. */
+static void disk_advance(struct amiga_state *s)
 {
-    struct amiga_state *s = _s;
     time_ns_t t = s->disk.last_bitcell_time;
     time_ns_t now = s->event_base.current_time;
     uint16_t w = s->disk.data_word;
@@ -105,25 +125,90 @@ static void data_cb(void *_s)
 
     s->disk.last_bitcell_time = t - s->disk.ns_per_cell;
     s->disk.data_word = w;
+}
+
+void disk_sync(struct amiga_state *s)
+{
+    if (!s->disk.streaming || s->disk.syncing)
+        return;
+
+    /* A DMA word may be written back into the I/O space. */
+    s->disk.syncing = 1;
+    disk_advance(s);
+    s->disk.syncing = 0;
+
+    /* Without DMA the stream is observed only through the I/O registers,
+     * which sync on access. With DMA, wake at the next word boundary: a sync
+     * match can start DMA no sooner than that. */
+    if (s->disk.dma)
+        event_set(&s->disk.data_delay,
+                  cell_time(s, 16 - (s->disk.data_word_bitpos & 15)));
+    else
+        event_unset(&s->disk.data_delay);
+}
+
+/* Earliest time, no later than @limit, at which streaming may raise a flag:
+ * DSKSYNC in INTREQ, or the index pulse in CIAB ICR. The bitstream is
+ * otherwise observed only through DSKBYTR, or by DMA, which wakes on its own
+ * event. Weak bitcells are random: stop short at the first. */
+time_ns_t disk_next_flag(struct amiga_state *s, time_ns_t limit)
+{
+    struct track_raw *raw = s->disk.track_raw;
+    time_ns_t t = s->disk.last_bitcell_time;
+    unsigned int pos = s->disk.input_pos, ns = s->disk.ns_per_cell;
+    uint8_t byte = s->disk.input_byte;
+    uint16_t w = s->disk.data_word;
+    int wordsync = !!(s->custom[CUST_adkcon] & (1u<<10));
+
+    if (!s->disk.streaming)
+        return limit;
+
+    for (t += ns; t <= limit; t += ns) {
+        w <<= 1;
+        if (byte & 0x80)
+            w |= 1;
+        byte <<= 1;
+        if (++pos == raw->bitlen)
+            return t;
+        if (!(pos & 7)) {
+            if (track_raw_speed(raw)[pos] == SPEED_WEAK)
+                return t;
+            ns = cell_ns(s, pos);
+            byte = raw->bits[pos/8];
+        }
+        if (wordsync && (w == s->custom[CUST_dsksync]))
+            return t;
+    }
+
+    return limit;
+}
 
-    event_set(s->disk.data_delay, t);
+static void data_cb(void *_s)
+{
+    disk_sync(_s);
 }
 
 static void track_load(struct amiga_state *s)
 {
+    if (s->disk.df0_disk == NULL)
+        return;
     log_info("Loading track %u", s->disk.tracknr);
     track_read_raw(s->disk.track_raw, s->disk.tracknr);
     s->disk.input_pos = s->disk.data_word_bitpos = s->disk.data_word = 0;
     s->disk.last_bitcell_time = s->event_base.current_time;
     s->disk.av_ns_per_cell = 200000000ul / s->disk.track_raw->bitlen;
+    s->disk.streaming = 1;
     track_load_byte(s);
-    data_cb(s);
+    disk_sync(s);
 }
 
 static void track_unload(struct amiga_state *s)
 {
+    if (s->disk.df0_disk == NULL)
+        return;
     track_purge_raw_buffer(s->disk.track_raw);
-    event_unset(s->disk.data_delay);
+    s->disk.streaming = 0;
+    event_unset(&s->disk.data_delay);
 }
 
 static void disk_recalc_cia_inputs(struct amiga_state *s)
@@ -152,10 +237,12 @@ static void motor_cb(void *_s)
     struct amiga_state *s = _s;
     if (s->disk.motor == motor_spinning_up) {
         log_info("Disk motor on and fully spun up");
+        disk_sync(s);
         s->disk.motor = motor_on;
         track_load(s);
     } else {
         log_info("Disk motor off and fully spun down");
+        disk_sync(s);
         s->disk.motor = motor_off;
         track_unload(s);
     }
@@ -165,6 +252,7 @@ static void motor_cb(void *_s)
 static void step_cb(void *_s)
 {
     struct amiga_state *s = _s;
+    disk_sync(s);
     if (s->disk.step == step_in)
         s->disk.tracknr += 2;
     else
@@ -195,21 +283,21 @@ void disk_cia_changed(struct amiga_state *s)
             if (s->disk.motor == motor_off) {
                 log_info("Disk spinning up");
                 s->disk.motor = motor_spinning_up;
-                event_set_delta(s->disk.motor_delay, MOTORON_DELAY);
+                event_set_delta(&s->disk.motor_delay, MOTORON_DELAY);
             } else if (s->disk.motor == motor_spinning_down) {
                 log_warn("Disk spindown aborted");
                 s->disk.motor = motor_on;
-                event_unset(s->disk.motor_delay);
+                event_unset(&s->disk.motor_delay);
             }
         } else {
             if (s->disk.motor == motor_on) {
                 log_info("Disk spinning down");
                 s->disk.motor = motor_spinning_down;
-                event_set_delta(s->disk.motor_delay, MOTOROFF_DELAY);
+                event_set_delta(&s->disk.motor_delay, MOTOROFF_DELAY);
             } else if (s->disk.motor == motor_spinning_up) {
                 log_warn("Disk spinup aborted");
                 s->disk.motor = motor_off;
-                event_unset(s->disk.motor_delay);
+                event_unset(&s->disk.motor_delay);
             }
         }
     }
@@ -224,7 +312,7 @@ void disk_cia_changed(struct amiga_state *s)
             ((s->disk.step == step_in) && (s->disk.tracknr >= 159)))
             s->disk.step = step_none;
         if (s->disk.step != step_none)
-            event_set_delta(s->disk.step_delay, STEP_DELAY);
+            event_set_delta(&s->disk.step_delay, STEP_DELAY);
     }
 
 out:
@@ -246,12 +334,27 @@ void disk_dsklen_changed(struct amiga_state *s)
     s->disk.dsklen = new_dsklen;
 }
 
-void disk_init(struct amiga_state *s)
+/* The disk state has been overwritten from a snapshot: rebuild the track
+ * buffer to match. */
+void disk_restored(struct amiga_state *s)
 {
-    s->disk.df0_disk = disk_open(df0_filename, DISKFL_read_only);
     if (s->disk.df0_disk == NULL)
-        errx(1, "%s", df0_filename);
-    s->disk.track_raw = track_alloc_raw_buffer(s->disk.df0_disk);
+        return;
+    if (s->disk.streaming)
+        track_read_raw(s->disk.track_raw, s->disk.tracknr);
+    else
+        track_purge_raw_buffer(s->disk.track_raw);
+}
+
+void disk_init(struct amiga_state *s, const char *df0_filename)
+{
+    /* With no drive, the disk never streams. */
+    if (df0_filename != NULL) {
+        s->disk.df0_disk = disk_open(df0_filename, DISKFL_read_only);
+        if (s->disk.df0_disk == NULL)
+            errx(1, "%s", df0_filename);
+        s->disk.track_raw = track_alloc_raw_buffer(s->disk.df0_disk);
+    }
 
     /* Set up CIA peripheral data registers. */
     s->ciaa.pra_i = 0xff; /* disk inputs, all off (active low) */
@@ -259,18 +362,24 @@ void disk_init(struct amiga_state *s)
     s->ciab.prb_o = 0xff; /* disk outputs, all off (active low) */
     s->ciab.ddrb = 0xff;
 
-    s->disk.motor_delay = event_alloc(&s->event_base, motor_cb, s);
+    event_init(&s->event_base, &s->disk.motor_delay, motor_cb, s);
     s->disk.motor = motor_off;
-    s->disk.step_delay = event_alloc(&s->event_base, step_cb, s);
+    event_init(&s->event_base, &s->disk.step_delay, step_cb, s);
     s->disk.step = step_none;
     s->disk.old_ciabb = s->ciab.prb_o;
     s->disk.tracknr = 1;
-    s->disk.data_delay = event_alloc(&s->event_base, data_cb, s);
+    event_init(&s->event_base, &s->disk.data_delay, data_cb, s);
 }
 
-void amiga_insert_df0(const char *filename)
+void disk_destroy(struct amiga_state *s)
 {
-    df0_filename = filename;
+    event_unset(&s->disk.motor_delay);
+    event_unset(&s->disk.step_delay);
+    event_unset(&s->disk.data_delay);
+    if (s->disk.df0_disk == NULL)
+        return;
+    track_free_raw_buffer(s->disk.track_raw);
+    disk_close(s->disk.df0_disk);
 }
 
 /*
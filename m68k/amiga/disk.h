@@ -21,10 +21,10 @@ enum step_state {
 };
 
 struct amiga_disk {
-    struct event *motor_delay;
+    struct event motor_delay;
     enum motor_state motor;
 
-    struct event *step_delay;
+    struct event step_delay;
     enum step_state step;
 
     uint8_t old_ciabb;
@@ -35,7 +35,10 @@ struct amiga_disk {
     struct track_raw *track_raw;
     unsigned int av_ns_per_cell;
 
-    struct event *data_delay;
+    /* The bitstream is streamed lazily, up to the current time, whenever it
+     * is observed. data_delay is set only while DMA is in progress. */
+    struct event data_delay;
+    uint8_t streaming, syncing;
     time_ns_t last_bitcell_time;
     unsigned int data_word_bitpos, ns_per_cell;
     unsigned int input_pos, input_byte;
@@ -45,9 +48,13 @@ struct amiga_disk {
     uint16_t dsklen;
 };
 
-void disk_init(struct amiga_state *);
+void disk_init(struct amiga_state *, const char *df0_filename);
+void disk_destroy(struct amiga_state *);
 void disk_cia_changed(struct amiga_state *);
 void disk_dsklen_changed(struct amiga_state *);
+void disk_sync(struct amiga_state *);
+time_ns_t disk_next_flag(struct amiga_state *, time_ns_t limit);
+void disk_restored(struct amiga_state *);
 
 #endif /* __DISK_H__ */
 
@@ -7,60 +7,125 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <amiga/amiga.h>
 
-struct event {
-    time_ns_t time;
-    void (*cb)(void *);
-    void *cb_data;
-    struct event *next;
-    struct event_base *base;
-};
+static int event_before(const struct event *a, const struct event *b)
+{
+    return (a->time < b->time) || ((a->time == b->time) && (a->seq < b->seq));
+}
 
-static void remove_from_list(struct event **pprev, struct event *e)
+static void heap_place(struct event_base *base, unsigned int i,
+                       struct event *e)
 {
-    struct event *curr, **_pprev = pprev;
+    base->heap[i] = e;
+    e->heap_idx = i;
+}
 
-    while ((curr = *_pprev) != e)
-        _pprev = &curr->next;
+static void heap_sift_up(struct event_base *base, unsigned int i)
+{
+    struct event *e = base->heap[i];
+    unsigned int parent;
+
+    while (i != 0) {
+        parent = (i - 1) / 2;
+        if (!event_before(e, base->heap[parent]))
+            break;
+        heap_place(base, i, base->heap[parent]);
+        i = parent;
+    }
+    heap_place(base, i, e);
+}
 
-    *_pprev = e->next;
+static void heap_sift_down(struct event_base *base, unsigned int i)
+{
+    struct event *e = base->heap[i];
+    unsigned int child;
+
+    while ((child = 2*i + 1) < base->nr_events) {
+        if ((child + 1 < base->nr_events)
+            && event_before(base->heap[child+1], base->heap[child]))
+            child++;
+        if (!event_before(base->heap[child], e))
+            break;
+        heap_place(base, i, base->heap[child]);
+        i = child;
+    }
+    heap_place(base, i, e);
 }
 
-static void add_to_list(struct event **pprev, struct event *e)
+static void update_next_time(struct event_base *base)
 {
-    struct event *curr, **_pprev = pprev;
+    base->next_time = base->nr_events ? base->heap[0]->time : ~0ull;
+}
 
-    while (((curr = *_pprev) != NULL) && (curr->time <= e->time))
-        _pprev = &curr->next;
+static void heap_reserve(struct event_base *base, unsigned int nr)
+{
+    struct event **old = base->heap;
 
-    e->next = curr;
-    *_pprev = e;
+    if (nr <= base->max_events)
+        return;
+
+    while (base->max_events < nr)
+        base->max_events = base->max_events ? base->max_events * 2 : 8;
+    base->heap = memalloc(base->max_events * sizeof(*base->heap));
+    if (old != NULL) {
+        memcpy(base->heap, old, base->nr_events * sizeof(*old));
+        memfree(old);
+    }
 }
 
-struct event *event_alloc(
-    struct event_base *base, void (*cb)(void *), void *cb_data)
+static void add_to_heap(struct event_base *base, struct event *e)
 {
-    struct event *event = memalloc(sizeof(*event));
-    event->cb = cb;
-    event->cb_data = cb_data;
-    event->time = 0;
-    event->next = NULL;
-    event->base = base;
-    return event;
+    e->seq = base->seq++;
+    heap_place(base, base->nr_events++, e);
+    heap_sift_up(base, e->heap_idx);
+    update_next_time(base);
 }
 
-void event_destroy(struct event *event)
+static void remove_from_heap(struct event_base *base, struct event *e)
 {
-    event_unset(event);
-    memfree(event);
+    unsigned int i = e->heap_idx;
+    struct event *last = base->heap[--base->nr_events];
+
+    if (last != e) {
+        heap_place(base, i, last);
+        if ((i != 0) && event_before(last, base->heap[(i - 1) / 2]))
+            heap_sift_up(base, i);
+        else
+            heap_sift_down(base, i);
+    }
+    update_next_time(base);
+}
+
+void event_base_init(struct event_base *base)
+{
+    memset(base, 0, sizeof(*base));
+    base->next_time = ~0ull;
+}
+
+void event_base_destroy(struct event_base *base)
+{
+    memfree(base->heap);
+    base->heap = NULL;
+    base->nr_events = base->max_events = base->nr_inited = 0;
+}
+
+void event_init(struct event_base *base, struct event *event,
+                void (*cb)(void *), void *cb_data)
+{
+    memset(event, 0, sizeof(*event));
+    event->cb = cb;
+    event->cb_data = cb_data;
+    event->base = base;
+    heap_reserve(base, ++base->nr_inited);
 }
 
 void event_set(struct event *event, time_ns_t time)
 {
     event_unset(event);
     event->time = time;
-    add_to_list(&event->base->active_events, event);
+    add_to_heap(event->base, event);
 }
 
 void event_set_delta(struct event *event, time_ns_t delta)
@@ -72,7 +137,7 @@ void event_unset(struct event *event)
 {
     if (!event->time)
         return;
-    remove_from_list(&event->base->active_events, event);
+    remove_from_heap(event->base, event);
     event->time = 0;
 }
 
@@ -80,14 +145,70 @@ void fire_events(struct event_base *base)
 {
     struct event *event;
 
-    while (((event = base->active_events) != NULL) &&
-           (event->time <= base->current_time)) {
-        base->active_events = event->next;
+    while ((base->nr_events != 0) &&
+           ((event = base->heap[0])->time <= base->current_time)) {
+        remove_from_heap(base, event);
         event->time = 0;
         (*event->cb)(event->cb_data);
     }
 }
 
+struct event_snapshot {
+    time_ns_t current_time;
+    uint64_t seq;
+    unsigned int nr_events;
+    struct event_snapshot_ent {
+        struct event *event;
+        time_ns_t time;
+        uint64_t seq;
+    } ent[];
+};
+
+struct event_snapshot *event_snapshot(struct event_base *base)
+{
+    struct event_snapshot *snap;
+    unsigned int i;
+
+    snap = memalloc(sizeof(*snap) + base->nr_events * sizeof(snap->ent[0]));
+    snap->current_time = base->current_time;
+    snap->seq = base->seq;
+    snap->nr_events = base->nr_events;
+    for (i = 0; i < base->nr_events; i++) {
+        snap->ent[i].event = base->heap[i];
+        snap->ent[i].time = base->heap[i]->time;
+        snap->ent[i].seq = base->heap[i]->seq;
+    }
+
+    return snap;
+}
+
+void event_restore(struct event_base *base, struct event_snapshot *snap)
+{
+    struct event *e;
+    unsigned int i;
+
+    while (base->nr_events != 0)
+        base->heap[--base->nr_events]->time = 0;
+
+    /* The saved array is itself a valid heap: reinstate it as is. */
+    heap_reserve(base, snap->nr_events);
+    for (i = 0; i < snap->nr_events; i++) {
+        e = snap->ent[i].event;
+        e->time = snap->ent[i].time;
+        e->seq = snap->ent[i].seq;
+        heap_place(base, i, e);
+    }
+    base->nr_events = snap->nr_events;
+    base->current_time = snap->current_time;
+    base->seq = snap->seq;
+    update_next_time(base);
+}
+
+void event_snapshot_free(struct event_snapshot *snap)
+{
+    memfree(snap);
+}
+
 /*
  * Local variables:
  * mode: C
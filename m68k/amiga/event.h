@@ -17,18 +17,44 @@ typedef uint64_t time_ns_t;
 #define MICROSECS(x) ((x) * 1000ull)
 #define MILLISECS(x) ((x) * 1000000ull)
 
-struct event;
+/* Events are embedded in the structures of the devices which schedule them.
+ * Setting and unsetting them takes O(log n) time, and never allocates. */
+struct event {
+    /* [Private] */
+    time_ns_t time; /* 0 if not registered */
+    void (*cb)(void *);
+    void *cb_data;
+    struct event_base *base;
+    /* Registration order, for FIFO firing of simultaneous events. */
+    uint64_t seq;
+    unsigned int heap_idx;
+};
 
 struct event_base {
     /* Absolute time since simulation start. */
     time_ns_t current_time;
-    /* [Private] list of registered events. */
-    struct event *active_events;
+    /* Time of the earliest registered event, or ~0 if none. Callers may
+     * skip fire_events() until current_time reaches this. */
+    time_ns_t next_time;
+    /* [Private] binary min-heap of registered events. */
+    struct event **heap;
+    unsigned int nr_events, max_events;
+    /* [Private] number of initialised events: the heap has room for all. */
+    unsigned int nr_inited;
+    uint64_t seq;
 };
 
-struct event *event_alloc(
-    struct event_base *base, void (*cb)(void *), void *cb_data);
-void event_destroy(struct event *event);
+void event_base_init(struct event_base *base);
+void event_base_destroy(struct event_base *base);
+
+/* Time of the earliest registered event, or ~0 if none. */
+static inline time_ns_t event_next_time(const struct event_base *base)
+{
+    return base->next_time;
+}
+
+void event_init(struct event_base *base, struct event *event,
+                void (*cb)(void *), void *cb_data);
 
 void event_set(struct event *event, time_ns_t time);
 void event_set_delta(struct event *event, time_ns_t delta);
@@ -36,6 +62,13 @@ void event_unset(struct event *event);
 
 void fire_events(struct event_base *base);
 
+/* Capture and reinstate the time and every registered event. The set of
+ * initialised events must not change in between. */
+struct event_snapshot;
+struct event_snapshot *event_snapshot(struct event_base *base);
+void event_restore(struct event_base *base, struct event_snapshot *snap);
+void event_snapshot_free(struct event_snapshot *snap);
+
 #endif /* __EVENT_H__ */
 
 /*
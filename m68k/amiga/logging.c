@@ -6,6 +6,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <amiga/amiga.h>
 
@@ -16,26 +17,172 @@ static const char *subsys_name[] = {
     [subsystem_mem] = "Mem"
 };
 
+enum { arg_int, arg_long, arg_llong, arg_size, arg_double, arg_ptr, arg_none };
+
+/* Parse the conversion at @p (just past its '%'). Return the end of the
+ * conversion, and in @type the type of argument it consumes. */
+static const char *parse_conv(const char *p, int *type)
+{
+    int longs = 0, size = 0;
+
+    p += strspn(p, "-+ #0123456789.");
+    for (; (*p == 'h') || (*p == 'l') || (*p == 'z'); p++) {
+        longs += (*p == 'l');
+        size |= (*p == 'z');
+    }
+
+    switch (*p) {
+    case '\0':
+        *type = arg_none;
+        return p;
+    case '%':
+        *type = arg_none;
+        break;
+    case 's': case 'p':
+        *type = arg_ptr;
+        break;
+    case 'e': case 'f': case 'g': case 'E': case 'G':
+        *type = arg_double;
+        break;
+    default:
+        *type = size ? arg_size : (longs >= 2) ? arg_llong
+            : longs ? arg_long : arg_int;
+        break;
+    }
+
+    return p + 1;
+}
+
 static void write_log(
     struct amiga_state *s,
     enum loglevel loglevel,
     enum subsystem subsystem,
     const char *fmt, va_list args)
 {
+    struct log_entry *e;
+    const char *p = fmt;
+    int type;
+
     if (loglevel < s->max_loglevel)
         return;
-    fprintf(s->logfile, "[%s,PC=%08x,%u.%03uus] ",
-            subsys_name[subsystem], s->ctxt.regs->pc,
-            (unsigned int)(s->event_base.current_time/1000),
-            (unsigned int)(s->event_base.current_time%1000));
-    (void)vfprintf(s->logfile, fmt, args);
-    fprintf(s->logfile, "\n");
+
+    e = &s->log_ring[s->log_prod++ & (LOG_RING_SIZE-1)];
+    e->time = s->event_base.current_time;
+    e->fmt = fmt;
+    e->pc = s->ctxt.regs->pc;
+    e->level = loglevel;
+    e->subsystem = subsystem;
+    e->nr_args = 0;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        p = parse_conv(p + 1, &type);
+        if ((type == arg_none) || (e->nr_args == LOG_MAX_ARGS))
+            continue;
+        switch (type) {
+        case arg_int:
+            e->arg[e->nr_args].i = va_arg(args, int);
+            break;
+        case arg_long:
+            e->arg[e->nr_args].i = va_arg(args, long);
+            break;
+        case arg_llong:
+            e->arg[e->nr_args].i = va_arg(args, long long);
+            break;
+        case arg_size:
+            e->arg[e->nr_args].i = va_arg(args, size_t);
+            break;
+        case arg_double:
+            e->arg[e->nr_args].d = va_arg(args, double);
+            break;
+        case arg_ptr:
+            e->arg[e->nr_args].p = va_arg(args, const void *);
+            break;
+        }
+        e->nr_args++;
+    }
 }
 
-void logging_init(struct amiga_state *s)
+static void dump_entry(FILE *f, const struct log_entry *e)
+{
+    const char *p = e->fmt, *q;
+    char spec[32];
+    unsigned int i = 0;
+    int type;
+
+    fprintf(f, "[%s,PC=%08x,%u.%03uus] ",
+            subsys_name[e->subsystem], e->pc,
+            (unsigned int)(e->time/1000), (unsigned int)(e->time%1000));
+
+    while ((q = strchr(p, '%')) != NULL) {
+        fwrite(p, 1, q - p, f);
+        p = parse_conv(q + 1, &type);
+        if (type == arg_none) {
+            if (p[-1] == '%')
+                fputc('%', f);
+            continue;
+        }
+        snprintf(spec, sizeof(spec), "%.*s", (int)(p - q), q);
+        if (i == e->nr_args) {
+            fputs(spec, f);
+            continue;
+        }
+        switch (type) {
+        case arg_int:
+            fprintf(f, spec, (int)e->arg[i].i);
+            break;
+        case arg_long:
+            fprintf(f, spec, (long)e->arg[i].i);
+            break;
+        case arg_llong:
+            fprintf(f, spec, e->arg[i].i);
+            break;
+        case arg_size:
+            fprintf(f, spec, (size_t)e->arg[i].i);
+            break;
+        case arg_double:
+            fprintf(f, spec, e->arg[i].d);
+            break;
+        case arg_ptr:
+            fprintf(f, spec, e->arg[i].p);
+            break;
+        }
+        i++;
+    }
+    fputs(p, f);
+    fputc('\n', f);
+}
+
+void logging_dump(struct amiga_state *s)
+{
+    uint64_t cons = s->log_cons;
+
+    if (s->log_ring == NULL)
+        return;
+
+    if (s->log_prod - cons > LOG_RING_SIZE) {
+        fprintf(s->logfile, "[%llu earlier log entries dropped]\n",
+                (unsigned long long)(s->log_prod - cons - LOG_RING_SIZE));
+        cons = s->log_prod - LOG_RING_SIZE;
+    }
+
+    for (; cons != s->log_prod; cons++)
+        dump_entry(s->logfile, &s->log_ring[cons & (LOG_RING_SIZE-1)]);
+    s->log_cons = cons;
+    fflush(s->logfile);
+}
+
+void logging_init(struct amiga_state *s, FILE *logfile)
 {
     s->max_loglevel = loglevel_info;
-    s->logfile = stderr;
+    s->logfile = logfile;
+    s->log_ring = memalloc(LOG_RING_SIZE * sizeof(*s->log_ring));
+    s->log_prod = s->log_cons = 0;
+}
+
+void logging_destroy(struct amiga_state *s)
+{
+    memfree(s->log_ring);
+    s->log_ring = NULL;
 }
 
 #define LOG(lvl)                                                        \
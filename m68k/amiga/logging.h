@@ -23,19 +23,49 @@ enum loglevel {
 
 struct amiga_state;
 
+/* Log entries are recorded unformatted, in a ring of the most recent
+ * LOG_RING_SIZE, and formatted only when dumped. %s arguments must therefore
+ * be static strings. */
+#define LOG_RING_SIZE 16384 /* power of two */
+#define LOG_MAX_ARGS  8
+
+union log_arg {
+    long long i;
+    double d;
+    const void *p;
+};
+
+struct log_entry {
+    time_ns_t time;
+    const char *fmt;
+    uint32_t pc;
+    uint8_t level, subsystem, nr_args;
+    union log_arg arg[LOG_MAX_ARGS];
+};
+
 void __log_info(struct amiga_state *, enum subsystem, const char *, ...);
 void __log_warn(struct amiga_state *, enum subsystem, const char *, ...);
 void __log_error(struct amiga_state *, enum subsystem, const char *, ...);
 
-#define _log_info(sub, f, a...) __log_info(s, sub, f, ##a)
-#define _log_warn(sub, f, a...) __log_warn(s, sub, f, ##a)
-#define _log_error(sub, f, a...) __log_error(s, sub, f, ##a)
+/* The level is checked before the arguments are evaluated. */
+#define _log(lvl, sub, f, a...) do {                    \
+    if (loglevel_##lvl >= s->max_loglevel)              \
+        __log_##lvl(s, sub, f, ##a);                    \
+} while (0)
+#define _log_info(sub, f, a...) _log(info, sub, f, ##a)
+#define _log_warn(sub, f, a...) _log(warn, sub, f, ##a)
+#define _log_error(sub, f, a...) _log(error, sub, f, ##a)
 
 #define log_info(f, a...) _log_info(SUBSYSTEM, f, ##a)
 #define log_warn(f, a...) _log_warn(SUBSYSTEM, f, ##a)
 #define log_error(f, a...) _log_error(SUBSYSTEM, f, ##a)
 
-void logging_init(struct amiga_state *);
+void logging_init(struct amiga_state *, FILE *logfile);
+void logging_destroy(struct amiga_state *);
+
+/* Format and write out the entries recorded since the last dump. Called on
+ * amiga_destroy() and on assertion failure. */
+void logging_dump(struct amiga_state *);
 
 #endif /* __LOGGING_H__ */
 
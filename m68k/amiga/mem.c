@@ -16,7 +16,14 @@
 static struct memory *find_memory(
     struct amiga_state *s, uint32_t addr, uint32_t bytes)
 {
-    struct memory *m = s->memory;
+    struct memory *m;
+
+    if ((addr < (1u << 24))
+        && ((m = s->mem_page[addr >> MEM_PAGE_SHIFT]) != NULL)
+        && (m->end >= (addr + bytes - 1)))
+        return m;
+
+    m = s->memory;
     while (m && (m->end < (addr + bytes - 1)))
         m = m->next;
     return (m && (m->start <= addr)) ? m : NULL;
@@ -34,22 +41,7 @@ int mem_read(uint32_t addr, uint32_t *val, unsigned int bytes,
         return M68KEMUL_OKAY;
     }
 
-    addr -= m->start;
-    switch (bytes) {
-    case 1:
-        *val = *(uint8_t *)&m->dat[addr];
-        break;
-    case 2:
-        *val = be16toh(*(uint16_t *)&m->dat[addr]);
-        break;
-    case 4:
-        *val = be32toh(*(uint32_t *)&m->dat[addr]);
-        break;
-    default:
-        return M68KEMUL_UNHANDLEABLE;
-    }
-
-    return M68KEMUL_OKAY;
+    return mem_read_at(m, addr, val, bytes);
 }
 
 int mem_write(uint32_t addr, uint32_t val, unsigned int bytes,
@@ -63,32 +55,19 @@ int mem_write(uint32_t addr, uint32_t val, unsigned int bytes,
         return M68KEMUL_OKAY;
     }
 
-    addr -= m->start;
-    switch (bytes) {
-    case 1:
-        *(uint8_t *)&m->dat[addr] = val;
-        break;
-    case 2:
-        *(uint16_t *)&m->dat[addr] = htobe16(val);
-        break;
-    case 4:
-        *(uint32_t *)&m->dat[addr] = htobe32(val);
-        break;
-    default:
-        return M68KEMUL_UNHANDLEABLE;
-    }
-
-    return M68KEMUL_OKAY;
+    if (s->ctxt.icache)
+        m68k_icache_invalidate(s->ctxt.icache, addr, bytes);
+    return mem_write_at(m, addr, val, bytes);
 }
 
-static void regions_dump(struct region *r)
+static void regions_dump(struct amiga_state *s, struct region *r)
 {
-    printf("Region list: ");
+    fprintf(s->logfile, "Region list: ");
     while (r) {
-        printf("%x-%x, ", r->start, r->end);
+        fprintf(s->logfile, "%x-%x, ", r->start, r->end);
         r = r->next;
     }
-    printf("\n");
+    fprintf(s->logfile, "\n");
 }
 
 void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes)
@@ -99,7 +78,7 @@ void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes)
 
     ASSERT(m != NULL);
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     pprev = &m->free;
     while (((r = *pprev) != NULL) && (r->end < start))
@@ -125,7 +104,7 @@ void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes)
         memfree(r);
     }
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 }
 
 uint32_t mem_alloc(struct amiga_state *s, struct memory *m, uint32_t bytes)
@@ -133,7 +112,7 @@ uint32_t mem_alloc(struct amiga_state *s, struct memory *m, uint32_t bytes)
     uint32_t addr;
     struct region *r, **pprev;
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     pprev = &m->free;
     while (((r = *pprev) != NULL) && ((r->end - r->start + 1) < bytes))
@@ -150,7 +129,7 @@ uint32_t mem_alloc(struct amiga_state *s, struct memory *m, uint32_t bytes)
         memfree(r);
     }
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     return addr;
 }
@@ -162,7 +141,7 @@ void mem_free(struct amiga_state *s, uint32_t addr, uint32_t bytes)
 
     ASSERT(m != NULL);
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 
     pprev = &m->free;
     while (((r = *pprev) != NULL) && (r->end < addr))
@@ -186,20 +165,27 @@ void mem_free(struct amiga_state *s, uint32_t addr, uint32_t bytes)
         memfree(r);
     }
 
-    memset(&m->dat[addr - m->start], 0xaa, bytes);
+    addr -= m->start;
+    memset(&m->dat[addr], 0xaa, bytes);
+    memset(&m->dirty[addr >> MEM_PAGE_SHIFT], 1,
+           ((addr + bytes - 1) >> MEM_PAGE_SHIFT)
+           - (addr >> MEM_PAGE_SHIFT) + 1);
 
-    regions_dump(m->free);
+    regions_dump(s, m->free);
 }
 
 struct memory *mem_init(struct amiga_state *s, uint32_t start, uint32_t bytes)
 {
     struct memory *m, *curr, **pprev;
+    uint32_t page;
 
+    ASSERT(!(start & 1));
     m = memalloc(sizeof(*m) + bytes);
 
     m->start = start;
     m->end = start + bytes - 1;
     m->dat = (uint8_t *)(m + 1);
+    m->dirty = memalloc(mem_nr_pages(m));
 
     m->free = memalloc(sizeof(struct region));
     m->free->next = NULL;
@@ -212,9 +198,43 @@ struct memory *mem_init(struct amiga_state *s, uint32_t start, uint32_t bytes)
     m->next = curr;
     *pprev = m;
 
+    /* Map every page which lies entirely within the new memory. */
+    page = (start + (1u << MEM_PAGE_SHIFT) - 1) >> MEM_PAGE_SHIFT;
+    while ((page < MEM_NR_PAGES)
+           && ((((uint64_t)page + 1) << MEM_PAGE_SHIFT) - 1 <= m->end))
+        s->mem_page[page++] = m;
+
     return m;
 }
 
+void mem_free_regions(struct region *r)
+{
+    struct region *n;
+
+    for (; r != NULL; r = n) {
+        n = r->next;
+        memfree(r);
+    }
+}
+
+void mem_destroy(struct amiga_state *s)
+{
+    struct memory *m;
+
+    while ((m = s->memory) != NULL) {
+        s->memory = m->next;
+        mem_free_regions(m->free);
+        memfree(m->dirty);
+        memfree(m);
+    }
+    memset(s->mem_page, 0, sizeof(s->mem_page));
+}
+
+void mem_unmap_page(struct amiga_state *s, uint32_t addr)
+{
+    s->mem_page[(addr & 0xffffff) >> MEM_PAGE_SHIFT] = NULL;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -19,14 +19,99 @@ struct watch {
     int (*cb)(struct amiga_state *, uint32_t addr);
 };
 
+/* RAM/ROM lookup table over the 24-bit address space. A page maps to the
+ * memory which covers it entirely, or is NULL (I/O, unmapped, or a page only
+ * partly covered). */
+#define MEM_PAGE_SHIFT 12
+#define MEM_NR_PAGES   (1u << (24 - MEM_PAGE_SHIFT))
+
 struct memory {
     struct memory *next;
     uint32_t start, end;
     uint8_t *dat;
     struct region *free;
     struct watch *watch;
+    /* Pages written since the last snapshot or restore. */
+    uint8_t *dirty;
 };
 
+#define mem_nr_pages(m) ((((m)->end - (m)->start) >> MEM_PAGE_SHIFT) + 1)
+
+/* Memory contents are held as host-order 16-bit words, so that word accesses
+ * need no byte swap. On a little-endian host, each byte of a word is found at
+ * its 68000 address with the low bit flipped. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MEM_BYTE_XOR 1
+#else
+#define MEM_BYTE_XOR 0
+#endif
+
+#define mem_dat8(m, off) ((m)->dat[(off) ^ MEM_BYTE_XOR])
+#define mem_dat16(m, off) (*(uint16_t *)&(m)->dat[off])
+
+/* Access @bytes at @addr, which lie wholly within @m. */
+static inline int mem_read_at(
+    struct memory *m, uint32_t addr, uint32_t *val, unsigned int bytes)
+{
+    uint32_t off = addr - m->start;
+
+    if ((bytes != 1) && (off & 1)) {
+        for (*val = 0; bytes--; off++)
+            *val = (*val << 8) | mem_dat8(m, off);
+        return M68KEMUL_OKAY;
+    }
+
+    switch (bytes) {
+    case 1:
+        *val = mem_dat8(m, off);
+        break;
+    case 2:
+        *val = mem_dat16(m, off);
+        break;
+    case 4:
+        *val = ((uint32_t)mem_dat16(m, off) << 16) | mem_dat16(m, off + 2);
+        break;
+    default:
+        return M68KEMUL_UNHANDLEABLE;
+    }
+
+    return M68KEMUL_OKAY;
+}
+
+static inline int mem_write_at(
+    struct memory *m, uint32_t addr, uint32_t val, unsigned int bytes)
+{
+    uint32_t off = addr - m->start;
+
+    m->dirty[off >> MEM_PAGE_SHIFT] = 1;
+    m->dirty[(off + bytes - 1) >> MEM_PAGE_SHIFT] = 1;
+
+    if ((bytes != 1) && (off & 1)) {
+        while (bytes--) {
+            mem_dat8(m, off + bytes) = val;
+            val >>= 8;
+        }
+        return M68KEMUL_OKAY;
+    }
+
+    switch (bytes) {
+    case 1:
+        mem_dat8(m, off) = val;
+        break;
+    case 2:
+        mem_dat16(m, off) = val;
+        break;
+    case 4:
+        mem_dat16(m, off) = val >> 16;
+        mem_dat16(m, off + 2) = val;
+        break;
+    default:
+        return M68KEMUL_UNHANDLEABLE;
+    }
+
+    return M68KEMUL_OKAY;
+}
+
 void mem_reserve(struct amiga_state *s, uint32_t start, uint32_t bytes);
 uint32_t mem_alloc(struct amiga_state *, struct memory *, uint32_t bytes);
 void mem_free(struct amiga_state *, uint32_t addr, uint32_t bytes);
@@ -36,6 +121,9 @@ int mem_read(uint32_t addr, uint32_t *val, unsigned int bytes,
 int mem_write(uint32_t addr, uint32_t val, unsigned int bytes,
               struct amiga_state *);
 struct memory *mem_init(struct amiga_state *, uint32_t start, uint32_t bytes);
+void mem_unmap_page(struct amiga_state *, uint32_t addr);
+void mem_destroy(struct amiga_state *);
+void mem_free_regions(struct region *);
 
 #endif /* __AMIGA_MEM_H__ */
 
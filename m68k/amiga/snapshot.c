@@ -0,0 +1,137 @@
+/*
+ * snapshot.c
+ * 
+ * Snapshot and restore of the emulated Amiga.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <amiga/amiga.h>
+
+struct mem_image {
+    struct memory *m;
+    uint8_t *dat;
+    struct region *free;
+};
+
+struct amiga_snapshot {
+    struct m68k_emulate_ctxt ctxt;
+    struct m68k_regs regs;
+    struct cia ciaa, ciab;
+    struct amiga_disk disk;
+    uint16_t custom[256];
+    struct event_snapshot *events;
+    unsigned int nr_mem;
+    struct mem_image *mem;
+};
+
+static struct region *regions_copy(const struct region *r)
+{
+    struct region *head = NULL, **pprev = &head, *n;
+
+    for (; r != NULL; r = r->next) {
+        n = memalloc(sizeof(*n));
+        n->start = r->start;
+        n->end = r->end;
+        *pprev = n;
+        pprev = &n->next;
+    }
+
+    return head;
+}
+
+struct amiga_snapshot *amiga_snapshot(struct amiga_state *s)
+{
+    struct amiga_snapshot *snap = memalloc(sizeof(*snap));
+    struct mem_image *img;
+    struct memory *m;
+
+    snap->ctxt = s->ctxt;
+    snap->regs = *s->ctxt.regs;
+    snap->ciaa = s->ciaa;
+    snap->ciab = s->ciab;
+    snap->disk = s->disk;
+    memcpy(snap->custom, s->custom, sizeof(snap->custom));
+    snap->events = event_snapshot(&s->event_base);
+
+    for (m = s->memory; m != NULL; m = m->next)
+        snap->nr_mem++;
+    snap->mem = memalloc(snap->nr_mem * sizeof(*snap->mem));
+    for (m = s->memory, img = snap->mem; m != NULL; m = m->next, img++) {
+        img->m = m;
+        img->dat = memalloc(m->end - m->start + 1);
+        memcpy(img->dat, m->dat, m->end - m->start + 1);
+        img->free = regions_copy(m->free);
+        memset(m->dirty, 0, mem_nr_pages(m));
+    }
+    s->mem_snapshot = snap;
+
+    return snap;
+}
+
+void amiga_restore(struct amiga_state *s, struct amiga_snapshot *snap)
+{
+    struct m68k_regs *regs = s->ctxt.regs;
+    struct m68k_icache *icache = s->ctxt.icache;
+    struct mem_image *img;
+    struct memory *m;
+    uint32_t off, len, size;
+    unsigned int i, page;
+
+    s->ctxt = snap->ctxt;
+    s->ctxt.regs = regs;
+    s->ctxt.icache = icache;
+    if (icache)
+        m68k_icache_flush(icache);
+    *regs = snap->regs;
+    s->idle.dirty = 1;
+    s->ciaa = snap->ciaa;
+    s->ciab = snap->ciab;
+    s->disk = snap->disk;
+    memcpy(s->custom, snap->custom, sizeof(s->custom));
+    event_restore(&s->event_base, snap->events);
+    disk_restored(s);
+
+    for (i = 0, img = snap->mem; i < snap->nr_mem; i++, img++) {
+        m = img->m;
+        size = m->end - m->start + 1;
+        for (page = 0; page < mem_nr_pages(m); page++) {
+            if ((s->mem_snapshot == snap) && !m->dirty[page])
+                continue;
+            off = page << MEM_PAGE_SHIFT;
+            len = min_t(uint32_t, size - off, 1u << MEM_PAGE_SHIFT);
+            memcpy(&m->dat[off], &img->dat[off], len);
+        }
+        memset(m->dirty, 0, mem_nr_pages(m));
+        mem_free_regions(m->free);
+        m->free = regions_copy(img->free);
+    }
+    s->mem_snapshot = snap;
+}
+
+void amiga_snapshot_free(struct amiga_state *s, struct amiga_snapshot *snap)
+{
+    unsigned int i;
+
+    if (s->mem_snapshot == snap)
+        s->mem_snapshot = NULL;
+
+    for (i = 0; i < snap->nr_mem; i++) {
+        memfree(snap->mem[i].dat);
+        mem_free_regions(snap->mem[i].free);
+    }
+    memfree(snap->mem);
+    event_snapshot_free(snap->events);
+    memfree(snap);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
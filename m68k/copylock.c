@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <utime.h>
+#include <pthread.h>
 
 #include <amiga/amiga.h>
 #include <libdisk/util.h>
@@ -34,15 +35,21 @@ static int test_bit(unsigned int bit, char *map)
     return !!(map[bit/8] & (1u << (bit&7)));
 }
 
+/* Output stream of the extraction running on this thread. */
+static __thread FILE *out;
+
 static void dump(const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    vfprintf(out, fmt, args);
     va_end(args);
 }
 
 static int ctrl_c;
+
+/* -p: profile the emulation loop and report it after the register dump. */
+static int profile;
 static void sigint_handler(int signum)
 {
     ctrl_c = 1;
@@ -63,17 +70,73 @@ static void init_sigint_handler(void)
 #endif
 }
 
-int main(int argc, char **argv)
+/* Opcode words of the final instruction of a run, replayed to the
+ * disassembler in place of memory. */
+static __thread struct {
+    uint32_t pc;
+    const uint16_t *op;
+    unsigned int op_words;
+    const struct m68k_emulate_ops *ops;
+} replay;
+
+static int replay_read(uint32_t addr, uint32_t *val, unsigned int bytes,
+                       struct m68k_emulate_ctxt *ctxt)
+{
+    uint32_t off;
+
+    for (*val = 0; bytes != 0; bytes--, addr++) {
+        off = addr - replay.pc;
+        *val <<= 8;
+        if (off < 2*replay.op_words)
+            *val |= (uint8_t)(replay.op[off/2] >> ((off & 1) ? 0 : 8));
+    }
+
+    return M68KEMUL_OKAY;
+}
+
+static const char *replay_addr_name(uint32_t addr,
+                                    struct m68k_emulate_ctxt *ctxt)
+{
+    return replay.ops->addr_name ? replay.ops->addr_name(addr, ctxt) : NULL;
+}
+
+static const struct m68k_emulate_ops replay_ops = {
+    .read = replay_read,
+    .addr_name = replay_addr_name
+};
+
+/* Report the key libdisk tagged from the df0 image's Copylock track. It is
+ * only the usual choice of key: if @d0 is non-NULL it is the key the emulated
+ * routine returned, which stands, and the tag is checked against it. */
+static void tagged_key(struct disk *d, const uint32_t *d0)
+{
+    struct disktag_copylock_key *tag = (struct disktag_copylock_key *)
+        disk_get_tag_by_id(d, DSKTAG_copylock_key);
+
+    if (tag == NULL) {
+        fprintf(out, "No Copylock key tag\n");
+        return;
+    }
+
+    fprintf(out, "Tagged key: %08x (track %u)", tag->key, tag->tracknr);
+    if (d0 != NULL)
+        fprintf(out, ", %s emulation",
+                (*d0 == tag->key) ? "matches" : "DIFFERS from");
+    else
+        fprintf(out, ", unconfirmed without emulation");
+    fprintf(out, "\n");
+}
+
+/* Run one extraction. @argv is as for the single-image command line. */
+static void copylock(char **argv, FILE *logfile)
 {
     struct amiga_state s;
-    struct m68k_regs *regs;
+    struct m68k_regs *regs, last;
+    uint16_t last_op[ARRAY_SIZE(s.ctxt.op)];
+    struct m68k_profile *prof;
     char *p, *shadow, *bmap;
     int rc, i, fd, zeroes_run = 0;
-    uint32_t off, len, base;
-
-    if (argc != 6)
-        errx(1, "Usage: %s <infile> <off> <len> <base> <df0_file>",
-             argv[0]);
+    uint32_t off, len, base, last_pc;
 
     fd = file_open(argv[1], O_RDONLY);
     if (fd == -1)
@@ -94,14 +157,11 @@ int main(int argc, char **argv)
     shadow = memalloc(MEM_SIZE);
     bmap = memalloc(MEM_SIZE/8);
 
-    for (i = 0; i < argc; i++)
-        printf("%s ", argv[i]);
-    printf("\n");
+    for (i = 0; i < 6; i++)
+        fprintf(out, "%s ", argv[i]);
+    fprintf(out, "\n");
 
-    init_sigint_handler();
-
-    amiga_insert_df0(argv[5]);
-    amiga_init(&s, MEM_SIZE);
+    amiga_init(&s, MEM_SIZE, argv[5], logfile);
     regs = s.ctxt.regs;
 
     if (lseek(fd, off, SEEK_SET) != off)
@@ -120,16 +180,16 @@ int main(int argc, char **argv)
         unsigned int bptr = 0;
         if (be32toh(p[0]) != 0x3f3)
             errx(1, "Unexpected image signature %08x", be32toh(p[0]));
-        printf("Loadable image: ");
+        fprintf(out, "Loadable image: ");
         for (i = 1; p[i] != 0; i++)
             continue;
         nr_chunks = be32toh(p[i+1]);        
-        printf("%u chunks\n", nr_chunks);
+        fprintf(out, "%u chunks\n", nr_chunks);
         i += 1 + 1 + 2 + nr_chunks;
         for (j = 0; j < nr_chunks; j++) {
             type = be32toh(p[i]);
             nr_longs = be32toh(p[i+1]) & 0x3fffffffu;
-            printf("Chunk %u: %08x, %u longwords\n", j, type, nr_longs);
+            fprintf(out, "Chunk %u: %08x, %u longwords\n", j, type, nr_longs);
             i += 2;
             bptr = mem_off;
             mem_off += 4;
@@ -164,13 +224,19 @@ int main(int argc, char **argv)
     memset(shadow, 0, MEM_SIZE);
 
     regs->pc = base;
-    s.ctxt.disassemble = 1;
+    /* Copylock decoders run for millions of instructions: build disassembly
+     * text only for the final one, below. */
+    s.ctxt.disassemble = 0;
     s.ctxt.emulate = 1;
 
     mem_write(regs->a[7], 0xdeadbeee, 4, &s);
+    if (profile)
+        s.ctxt.profile = m68k_profile_alloc();
+    s.ctxt.icache = m68k_icache_alloc();
 
+    last_pc = regs->pc;
     while (!ctrl_c && (regs->pc != 0xdeadbeee)) {
-        uint32_t pc = regs->pc;
+        uint32_t pc = last_pc = regs->pc;
 
         rc = amiga_emulate(&s);
         if (rc != M68KEMUL_OKAY)
@@ -185,10 +251,41 @@ int main(int argc, char **argv)
         }
     }
 
-    printf("%08x %04x %04x %04x %s\n", regs->pc,
-           s.ctxt.op[0], s.ctxt.op[1],s.ctxt.op[2],s.ctxt.dis);
+    /* Disassemble the final instruction from its recorded opcode words:
+     * neither memory nor the machine state is touched again. */
+    prof = s.ctxt.profile;
+    s.ctxt.profile = NULL;
+    m68k_icache_free(s.ctxt.icache);
+    s.ctxt.icache = NULL;
+    m68k_sync_flags(&s.ctxt);
+    last = *regs;
+    memcpy(last_op, s.ctxt.op, sizeof(last_op));
+    replay.pc = last_pc;
+    replay.op = last_op;
+    replay.op_words = s.ctxt.op_words;
+    replay.ops = s.ctxt.ops;
+    s.ctxt.ops = &replay_ops;
+    s.ctxt.prefetch_valid = 0;
+    regs->pc = last_pc;
+    s.ctxt.disassemble = 1;
+    s.ctxt.emulate = 0;
+    (void)m68k_emulate(&s.ctxt);
+    s.ctxt.ops = replay.ops;
+    s.ctxt.prefetch_valid = 0;
+    *regs = last;
+
+    fprintf(out, "%08x %04x %04x %04x %s\n", regs->pc,
+           last_op[0], last_op[1], last_op[2], s.ctxt.dis);
     m68k_dump_regs(regs, dump);
     m68k_dump_stack(&s.ctxt, stack_current, dump);
+    tagged_key(s.disk.df0_disk, &regs->d[0]);
+
+    if (prof != NULL) {
+        s.ctxt.profile = prof;
+        amiga_profile_report(&s, dump);
+        s.ctxt.profile = NULL;
+        m68k_profile_free(prof);
+    }
 
     for (i = 0; i < MEM_SIZE; i++)
         if (test_bit(i, bmap))
@@ -201,8 +298,8 @@ int main(int argc, char **argv)
 
 #define finish_zeroes_run() do {                        \
     if (zeroes_run >= 2) {                              \
-        printf("      [%u more]\n", zeroes_run-1);      \
-        printf("-------------------------------\n");    \
+        fprintf(out, "      [%u more]\n", zeroes_run-1);      \
+        fprintf(out, "-------------------------------\n");    \
     }                                                   \
     zeroes_run = 0;                                     \
 } while (0)
@@ -225,7 +322,7 @@ int main(int argc, char **argv)
                 pc += 2;
             regs->pc = pc;
             zeroes_run = 0;
-            printf("-------------------------------\n");
+            fprintf(out, "-------------------------------\n");
             continue;
 #endif
         }
@@ -240,34 +337,34 @@ int main(int argc, char **argv)
         }
 
         /* Print an '*' for lines that were not actually executed. */
-        printf("%08x %c", pc, test_bit(pc, bmap) ? ' ' : '*');
+        fprintf(out, "%08x %c", pc, test_bit(pc, bmap) ? ' ' : '*');
 
         if (zeroes_run == 2) {
-            printf(".... .... ");
+            fprintf(out, ".... .... ");
             goto skip;
         }
 
         for (i = 0; i < 3; i++) {
             if (i < s.ctxt.op_words)
-                printf("%04x ", s.ctxt.op[i]);
+                fprintf(out, "%04x ", s.ctxt.op[i]);
             else
-                printf("     ");
+                fprintf(out, "     ");
         }
         if ((p = strchr(s.ctxt.dis, '\t')) != NULL)
             *p = '\0';
-        printf(" %s", s.ctxt.dis);
+        fprintf(out, " %s", s.ctxt.dis);
         if (p) {
             int spaces = 8-(p-s.ctxt.dis);
             if (spaces < 1)
                 spaces = 1;
-            printf("%*s%s", spaces, "", p+1);
+            fprintf(out, "%*s%s", spaces, "", p+1);
         }
-        printf("\n");
+        fprintf(out, "\n");
         if (i < s.ctxt.op_words) {
-            printf("%08x  ", pc + 2*i);
+            fprintf(out, "%08x  ", pc + 2*i);
             while (i < s.ctxt.op_words)
-                printf("%04x ", s.ctxt.op[i++]);
-            printf("\n");
+                fprintf(out, "%04x ", s.ctxt.op[i++]);
+            fprintf(out, "\n");
         }
 
     skip:
@@ -276,6 +373,148 @@ int main(int argc, char **argv)
 
     finish_zeroes_run();
 
+    free(bmap);
+    amiga_destroy(&s);
+}
+
+struct job {
+    char *argv[6];
+    char *outfile;
+};
+
+struct batch {
+    pthread_mutex_t lock;
+    unsigned int next, nr;
+    struct job *job;
+};
+
+static void *worker_fn(void *_b)
+{
+    struct batch *b = _b;
+    struct job *job;
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->nr)
+            break;
+        job = &b->job[i];
+        if ((out = fopen(job->outfile, "w")) == NULL)
+            err(1, "%s", job->outfile);
+        copylock(job->argv, out);
+        if (fclose(out) != 0)
+            err(1, "%s", job->outfile);
+    }
+
+    return NULL;
+}
+
+static char *copy_str(const char *str)
+{
+    char *p = memalloc(strlen(str) + 1);
+    return strcpy(p, str);
+}
+
+/* Each manifest line is: <infile> <off> <len> <base> <df0_file> <outfile>.
+ * Blank lines and lines starting with '#' are ignored. */
+static void batch(const char *prog, const char *manifest, unsigned int jobs)
+{
+    char line[4096], f[6][1024];
+    struct job *job = NULL;
+    struct batch b = { .next = 0 };
+    unsigned int i, j, nr = 0, max_jobs = 0;
+    pthread_t *threads;
+    int rc;
+    FILE *fp;
+
+    if ((fp = fopen(manifest, "r")) == NULL)
+        err(1, "%s", manifest);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#')
+            continue;
+        rc = sscanf(line, "%1023s %1023s %1023s %1023s %1023s %1023s",
+                    f[0], f[1], f[2], f[3], f[4], f[5]);
+        if (rc <= 0)
+            continue;
+        if (rc != 6)
+            errx(1, "%s: Bad manifest line: %s", manifest, line);
+        if (nr == max_jobs) {
+            struct job *old = job;
+            max_jobs = max_jobs ? max_jobs * 2 : 16;
+            job = memalloc(max_jobs * sizeof(*job));
+            if (old != NULL) {
+                memcpy(job, old, nr * sizeof(*job));
+                memfree(old);
+            }
+        }
+        job[nr].argv[0] = (char *)prog;
+        for (i = 0; i < 5; i++)
+            job[nr].argv[i+1] = copy_str(f[i]);
+        job[nr].outfile = copy_str(f[5]);
+        nr++;
+    }
+
+    fclose(fp);
+
+    /* Each image gets its own emulator instance: run them on a pool of
+     * worker threads, the calling thread being worker 0. */
+    b.nr = nr;
+    b.job = job;
+    pthread_mutex_init(&b.lock, NULL);
+    jobs = max(min(jobs, nr), 1u);
+    threads = memalloc(jobs * sizeof(*threads));
+    for (i = 1; i < jobs; i++)
+        if ((rc = pthread_create(&threads[i], NULL, worker_fn, &b)) != 0)
+            errx(1, "Failed to create worker thread: %s", strerror(rc));
+    worker_fn(&b);
+    for (i = 1; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    memfree(threads);
+    pthread_mutex_destroy(&b.lock);
+
+    for (i = 0; i < nr; i++) {
+        for (j = 1; j < 6; j++)
+            memfree(job[i].argv[j]);
+        memfree(job[i].outfile);
+    }
+    memfree(job);
+}
+
+int main(int argc, char **argv)
+{
+    init_sigint_handler();
+
+    if ((argc >= 2) && !strcmp(argv[1], "-p")) {
+        profile = 1;
+        argv[1] = argv[0];
+        argc--; argv++;
+    }
+
+    if ((argc == 3) && !strcmp(argv[1], "-n")) {
+        struct disk *d = disk_open(argv[2], DISKFL_read_only);
+        if (d == NULL)
+            errx(1, "Unable to open %s", argv[2]);
+        out = stdout;
+        tagged_key(d, NULL);
+        disk_close(d);
+        return 0;
+    }
+
+    if ((argc >= 3) && (argc <= 4) && !strcmp(argv[1], "-b")) {
+        batch(argv[0], argv[2], (argc == 4) ? atoi(argv[3]) : 1);
+        return 0;
+    }
+
+    if (argc != 6)
+        errx(1, "Usage: %s [-p] <infile> <off> <len> <base> <df0_file>\n"
+             "       %s [-p] -b <manifest> [<jobs>]\n"
+             "       %s -n <df0_file>", argv[0], argv[0], argv[0]);
+
+    out = stdout;
+    copylock(argv, stderr);
     return 0;
 }
 
@@ -6,6 +6,7 @@
  * Written in 2011 by Keir Fraser
  */
 
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -110,17 +111,494 @@ static struct m68k_emulate_ops emul_ops = {
 /* read_exact */
 #include "../libdisk/util.c"
 
+static uint16_t mem_word(struct m68k_state *s, uint32_t addr)
+{
+    return be16toh(*(uint16_t *)&s->mem[addr]);
+}
+
+/*
+ * Recursive descent: instructions are decoded (not executed) by following
+ * control flow from the entry points, and everything not reached is data.
+ */
+
+/* Classification of each byte of the image. */
+#define MAP_DATA  0
+#define MAP_INSN  1 /* first byte of an instruction */
+#define MAP_BODY  2 /* later bytes of an instruction */
+#define MAP_TABLE 3 /* word offsets of a jump table */
+
+/* Label kinds, in increasing order of precedence. */
+#define LAB_none 0
+#define LAB_dat  1 /* referenced PC-relative */
+#define LAB_tab  2 /* jump table */
+#define LAB_loc  3 /* branch target */
+#define LAB_sub  4 /* entry point or subroutine */
+static const char *lab_prefix[] = { NULL, "dat", "tab", "loc", "sub" };
+
+struct rd {
+    struct m68k_state *s;
+    uint32_t base, len;
+    /* Per byte of the image: MAP_* and LAB_*. */
+    uint8_t *map, *lab;
+    /* Per word of the image: offset of the instruction text in @pool. */
+    uint32_t *dis;
+    char *pool;
+    unsigned int pool_len, pool_max;
+    /* Addresses still to be traced. */
+    uint32_t *work;
+    unsigned int nr_work, max_work;
+    /* Jump tables found so far: at each, either word offsets from the table
+     * (@otab), or a run of branch instructions (@btab). */
+    uint32_t *otab, *btab;
+    unsigned int nr_otab, max_otab, nr_btab, max_btab;
+};
+
+/* Make room for @need more items in array @p of @nr items. */
+static void *grow(
+    void *p, unsigned int *max, unsigned int nr, unsigned int need, size_t sz)
+{
+    void *q;
+    if (nr + need <= *max)
+        return p;
+    while (nr + need > *max)
+        *max = *max ? *max * 2 : 64;
+    q = memalloc(*max * sz);
+    if (p != NULL) {
+        memcpy(q, p, nr * sz);
+        memfree(p);
+    }
+    return q;
+}
+
+static bool_t in_image(struct rd *rd, uint32_t addr)
+{
+    return (addr >= rd->base) && ((addr - rd->base) < rd->len);
+}
+
+static void add_label(struct rd *rd, uint32_t addr, uint8_t kind)
+{
+    if (in_image(rd, addr) && (rd->lab[addr - rd->base] < kind))
+        rd->lab[addr - rd->base] = kind;
+}
+
+static void push(struct rd *rd, uint32_t addr, uint8_t kind)
+{
+    if (!in_image(rd, addr) || (addr & 1))
+        return;
+    add_label(rd, addr, kind);
+    if (rd->map[addr - rd->base] != MAP_DATA)
+        return;
+    rd->work = grow(rd->work, &rd->max_work, rd->nr_work, 1,
+                    sizeof(uint32_t));
+    rd->work[rd->nr_work++] = addr;
+}
+
+static void push_table(
+    uint32_t **tab, unsigned int *nr, unsigned int *max, uint32_t addr)
+{
+    unsigned int i;
+    for (i = 0; i < *nr; i++)
+        if ((*tab)[i] == addr)
+            return;
+    *tab = grow(*tab, max, *nr, 1, sizeof(uint32_t));
+    (*tab)[(*nr)++] = addr;
+}
+
+/* Label the addresses of PC-relative operands in disassembly @text. */
+static void pcrel_labels(struct rd *rd, const char *text)
+{
+    const char *p, *q;
+
+    for (p = text; (p = strstr(p, "(pc")) != NULL; p++) {
+        for (q = p; (q > text) && isxdigit((unsigned char)q[-1]); q--)
+            continue;
+        if (q != p)
+            add_label(rd, strtoul(q, NULL, 16), LAB_dat);
+    }
+}
+
+static bool_t falls_through(const uint16_t *op)
+{
+    if ((op[0] & 0xff00u) == 0x6000u)  /* bra */
+        return 0;
+    if ((op[0] & 0xffc0u) == 0x4ec0u)  /* jmp */
+        return 0;
+    switch (op[0]) {
+    case 0x4e73: /* rte */
+    case 0x4e75: /* rts */
+    case 0x4e77: /* rtr */
+    case 0x4afc: /* illegal */
+        return 0;
+    }
+    return 1;
+}
+
+/* Queue the control-flow successors of the instruction @op at @pc, other
+ * than the next instruction. @prev is the previous instruction, if any. */
+static void branch_targets(
+    struct rd *rd, uint32_t pc, const uint16_t *op,
+    uint32_t prev_pc, const uint16_t *prev)
+{
+    uint8_t kind;
+    uint32_t tab;
+    int32_t disp;
+
+    if ((op[0] & 0xf000u) == 0x6000u) {
+        /* bcc/bra/bsr */
+        disp = (int8_t)op[0];
+        if (disp == 0)
+            disp = (int16_t)op[1];
+        else if (disp == -1)
+            disp = (int32_t)(((uint32_t)op[1] << 16) | op[2]);
+        push(rd, pc + 2 + disp,
+             (((op[0] >> 8) & 0xf) == 1) ? LAB_sub : LAB_loc);
+    } else if ((op[0] & 0xf0f8u) == 0x50c8u) {
+        /* dbcc */
+        push(rd, pc + 2 + (int16_t)op[1], LAB_loc);
+    } else if ((op[0] & 0xff80u) == 0x4e80u) {
+        /* jmp/jsr: targets in registers are not followed */
+        kind = (op[0] & (1u<<6)) ? LAB_loc : LAB_sub;
+        switch (op[0] & 0x3fu) {
+        case 0x38: /* abs.w */
+            push(rd, (int16_t)op[1], kind);
+            break;
+        case 0x39: /* abs.l */
+            push(rd, ((uint32_t)op[1] << 16) | op[2], kind);
+            break;
+        case 0x3a: /* d16(pc) */
+            push(rd, pc + 2 + (int16_t)op[1], kind);
+            break;
+        case 0x3b: /* d8(pc,Xn): a jump table */
+            if (op[1] & (1u<<8))
+                break;
+            tab = pc + 2 + (int8_t)op[1];
+            if ((prev != NULL) && !(prev[1] & (1u<<8))
+                && ((prev[0] & 0xf1ffu) == 0x303bu)
+                && ((prev_pc + 2 + (int8_t)prev[1]) == tab)) {
+                /* move.w tab(pc,Xn),Dn ; jmp tab(pc,Dn) */
+                add_label(rd, tab, LAB_tab);
+                push_table(&rd->otab, &rd->nr_otab, &rd->max_otab, tab);
+            } else {
+                push(rd, tab, LAB_tab);
+                push_table(&rd->btab, &rd->nr_btab, &rd->max_btab, tab);
+            }
+            break;
+        }
+    }
+}
+
+/* Decode along a path of straight-line code, until it ends or runs into
+ * code which has already been traced. */
+static void trace(struct rd *rd, uint32_t addr)
+{
+    struct m68k_emulate_ctxt *c = &rd->s->ctxt;
+    uint16_t prev[ARRAY_SIZE(c->op)];
+    uint32_t off, prev_pc = 0;
+    unsigned int i, n, len;
+    bool_t have_prev = 0;
+    int rc;
+
+    for (;;) {
+        if (!in_image(rd, addr) || (addr & 1))
+            break;
+        off = addr - rd->base;
+        if (rd->map[off] != MAP_DATA)
+            break;
+        c->regs->pc = addr;
+        rc = m68k_emulate(c);
+        n = c->op_words * 2;
+        if ((rc != M68KEMUL_OKAY) || (n == 0) || (n > (rd->len - off)))
+            break;
+        for (i = 1; i < n; i++)
+            if (rd->map[off+i] != MAP_DATA)
+                return;
+        rd->map[off] = MAP_INSN;
+        memset(&rd->map[off+1], MAP_BODY, n-1);
+
+        len = strlen(c->dis) + 1;
+        rd->pool = grow(rd->pool, &rd->pool_max, rd->pool_len, len, 1);
+        memcpy(&rd->pool[rd->pool_len], c->dis, len);
+        rd->dis[off/2] = rd->pool_len;
+        rd->pool_len += len;
+
+        pcrel_labels(rd, c->dis);
+        branch_targets(rd, addr, c->op, prev_pc, have_prev ? prev : NULL);
+        if (!falls_through(c->op))
+            break;
+        memcpy(prev, c->op, sizeof(prev));
+        prev_pc = addr;
+        have_prev = 1;
+        addr += n;
+    }
+}
+
+/* Word offsets from the table base, ending at the first word which is not a
+ * plausible offset, or which the table itself points at. */
+static void scan_otab(struct rd *rd, uint32_t tab)
+{
+    uint32_t a, tgt, end = rd->base + rd->len;
+    unsigned int i;
+
+    for (i = 0; ; i++) {
+        a = tab + 2*i;
+        if ((a + 2 > end) || (a >= end) || (rd->map[a - rd->base] != MAP_DATA)
+            || ((i != 0) && (rd->lab[a - rd->base] != LAB_none)))
+            break;
+        tgt = tab + (int16_t)mem_word(rd->s, a);
+        if (!in_image(rd, tgt) || (tgt & 1)
+            || ((tgt >= tab) && (tgt <= a)))
+            break;
+        if ((tgt > a) && (tgt < end))
+            end = tgt;
+        rd->map[a - rd->base] = rd->map[a + 1 - rd->base] = MAP_TABLE;
+        push(rd, tgt, LAB_loc);
+    }
+}
+
+/* Branch instructions like the first, which has been traced, back to back. */
+static void scan_btab(struct rd *rd, uint32_t tab)
+{
+    uint32_t a, off = tab - rd->base;
+    uint16_t op;
+    unsigned int i, n;
+
+    if (!in_image(rd, tab) || (rd->map[off] != MAP_INSN))
+        return;
+    for (n = 1; (off + n < rd->len) && (rd->map[off+n] == MAP_BODY); n++)
+        continue;
+    op = mem_word(rd->s, tab);
+    if (((op & 0xff00u) != 0x6000u) && (op != 0x4ef9u))
+        return;
+
+    for (i = 1; i < 256; i++) {
+        a = tab + i*n;
+        if (!in_image(rd, a + n - 1) || (rd->lab[a - rd->base] >= LAB_tab))
+            break;
+        if ((op & 0xff00u) == 0x6000u) {
+            uint16_t w = mem_word(rd->s, a);
+            if (((w & 0xff00u) != 0x6000u)
+                || (((w & 0xffu) == 0) != ((op & 0xffu) == 0))
+                || (((w & 0xffu) == 0xffu) != ((op & 0xffu) == 0xffu)))
+                break;
+        } else if (mem_word(rd->s, a) != op) {
+            break;
+        }
+        push(rd, a, LAB_none);
+    }
+}
+
+static void rd_trace(struct rd *rd)
+{
+    unsigned int otab_done = 0, btab_done = 0;
+
+    for (;;) {
+        if (rd->nr_work != 0)
+            trace(rd, rd->work[--rd->nr_work]);
+        else if (otab_done < rd->nr_otab)
+            scan_otab(rd, rd->otab[otab_done++]);
+        else if (btab_done < rd->nr_btab)
+            scan_btab(rd, rd->btab[btab_done++]);
+        else
+            break;
+    }
+}
+
+static const char *label_name(struct rd *rd, uint32_t addr, char *buf)
+{
+    sprintf(buf, "%s_%x", lab_prefix[rd->lab[addr - rd->base]], addr);
+    return buf;
+}
+
+/* Print operands, with any branch target or PC-relative address that has
+ * a label replaced by it. */
+static void print_operands(struct rd *rd, const char *p)
+{
+    char name[16];
+    const char *q;
+    uint32_t addr;
+    bool_t tok = 1;
+
+    while (*p != '\0') {
+        if (!tok || !isxdigit((unsigned char)*p)) {
+            tok = (*p == ',');
+            putchar(*p++);
+            continue;
+        }
+        for (q = p; isxdigit((unsigned char)*q); q++)
+            continue;
+        addr = strtoul(p, NULL, 16);
+        if ((rd != NULL) && ((*q == '\0') || (*q == ',')
+                             || !strncmp(q, "(pc", 3))
+            && !((q - p == 2) && ((*p == 'a') || (*p == 'd')))
+            && in_image(rd, addr) && (rd->lab[addr - rd->base] != LAB_none))
+            fputs(label_name(rd, addr, name), stdout);
+        else
+            fwrite(p, 1, q - p, stdout);
+        p = q;
+        tok = 0;
+    }
+}
+
+static void print_insn(
+    struct rd *rd, uint32_t pc, const uint16_t *op, unsigned int op_words,
+    const char *dis)
+{
+    const char *p;
+    int j, spaces;
+
+    printf("%08x  ", pc);
+    for (j = 0; j < 3; j++) {
+        if (j < op_words)
+            printf("%04x ", op[j]);
+        else
+            printf("     ");
+    }
+    if ((p = strchr(dis, '\t')) != NULL) {
+        printf(" %.*s", (int)(p - dis), dis);
+        spaces = 8 - (p - dis);
+        printf("%*s", (spaces < 1) ? 1 : spaces, "");
+        print_operands(rd, p+1);
+    } else {
+        printf(" %s", dis);
+    }
+    printf("\n");
+    if (j < op_words) {
+        printf("%08x  ", pc + 2*j);
+        while (j < op_words)
+            printf("%04x ", op[j++]);
+        printf("\n");
+    }
+}
+
+/* Data from @addr up to the next label, instruction or jump table. */
+static uint32_t print_data(struct rd *rd, uint32_t addr)
+{
+    uint32_t off = addr - rd->base, end = off + 1;
+    unsigned int i, n;
+    uint16_t w;
+
+    while ((end < rd->len) && (rd->map[end] == MAP_DATA)
+           && (rd->lab[end] == LAB_none))
+        end++;
+
+    while (off < end) {
+        printf("%08x  %15s ", rd->base + off, "");
+        if ((off & 1) || (end - off == 1)) {
+            printf("dc.b    %02x\n", (uint8_t)rd->s->mem[rd->base + off]);
+            off++;
+            continue;
+        }
+        w = mem_word(rd->s, rd->base + off);
+        for (n = 1; (off + 2*n + 1 < end)
+                 && (mem_word(rd->s, rd->base + off + 2*n) == w); n++)
+            continue;
+        if (n >= 8) {
+            printf("dcb.w   %u,%04x\n", n, w);
+            off += 2*n;
+            continue;
+        }
+        printf("dc.w    ");
+        for (i = 0; (i < 8) && (off + 1 < end); i++, off += 2)
+            printf("%s%04x", i ? "," : "", mem_word(rd->s, rd->base + off));
+        printf("\n");
+    }
+
+    return rd->base + end;
+}
+
+static void rd_print(struct rd *rd)
+{
+    char name[2][16];
+    uint32_t addr = rd->base, off;
+    uint16_t op[8];
+    unsigned int i, n;
+
+    while ((off = addr - rd->base) < rd->len) {
+        if (rd->lab[off] != LAB_none)
+            printf("%s:\n", label_name(rd, addr, name[0]));
+        switch (rd->map[off]) {
+        case MAP_INSN:
+            for (n = 1; (off + 2*n < rd->len)
+                     && (rd->map[off + 2*n] == MAP_BODY); n++)
+                continue;
+            for (i = 0; i < n; i++)
+                op[i] = mem_word(rd->s, addr + 2*i);
+            print_insn(rd, addr, op, n, &rd->pool[rd->dis[off/2]]);
+            addr += 2*n;
+            /* Separate blocks, but not the entries of a branch table. */
+            if (!falls_through(op) && in_image(rd, addr)
+                && ((rd->map[addr - rd->base] != MAP_INSN)
+                    || (rd->lab[addr - rd->base] != LAB_none)))
+                printf("\n");
+            break;
+        case MAP_TABLE: {
+            uint32_t tab = addr, tgt;
+            while (rd->map[tab - rd->base] != MAP_TABLE
+                   || rd->lab[tab - rd->base] != LAB_tab)
+                tab -= 2;
+            tgt = tab + (int16_t)mem_word(rd->s, addr);
+            printf("%08x  %04x            dc.w    %s-%s\n", addr,
+                   mem_word(rd->s, addr), label_name(rd, tgt, name[0]),
+                   label_name(rd, tab, name[1]));
+            addr += 2;
+            break;
+        }
+        default:
+            addr = print_data(rd, addr);
+            break;
+        }
+    }
+}
+
+static void disassemble_recursive(
+    struct m68k_state *s, uint32_t base, uint32_t len,
+    char **entry, unsigned int nr_entry)
+{
+    struct rd rd = { .s = s, .base = base, .len = len };
+    unsigned int i;
+
+    rd.map = memalloc(len);
+    rd.lab = memalloc(len);
+    rd.dis = memalloc((len / 2 + 1) * sizeof(uint32_t));
+
+    s->ctxt.disassemble = 1;
+    s->ctxt.emulate = 0;
+
+    push(&rd, base, LAB_sub);
+    for (i = 0; i < nr_entry; i++)
+        push(&rd, strtoul(entry[i], NULL, 16), LAB_sub);
+    rd_trace(&rd);
+    rd_print(&rd);
+
+    memfree(rd.map);
+    memfree(rd.lab);
+    memfree(rd.dis);
+    memfree(rd.pool);
+    memfree(rd.work);
+    memfree(rd.otab);
+    memfree(rd.btab);
+}
+
 int main(int argc, char **argv)
 {
     struct m68k_state s = { { 0 } };
     struct m68k_regs regs = { { 0 } };
-    char *p;
-    int i, j, fd, zeroes_run = 0;
+    int i, fd, zeroes_run = 0, recursive = 0;
     uint32_t off, len, base;
 
-    if (argc != 5)
-        errx(1, "Usage: %s <infile> <off> <len> <base>",
-             argv[0]);
+    if ((argc >= 2) && !strcmp(argv[1], "-r")) {
+        recursive = 1;
+        argv[1] = argv[0];
+        argc--; argv++;
+    }
+
+    if ((argc < 5) || (!recursive && (argc != 5)))
+        errx(1, "Usage: %s <infile> <off> <len> <base>\n"
+             "       %s -r <infile> <off> <len> <base> [<entry>...]",
+             argv[0], argv[0]);
+
+    /* Output is written in large blocks, however much there is. */
+    setvbuf(stdout, NULL, _IOFBF, 1u << 20);
 
     fd = file_open(argv[1], O_RDONLY);
     if (fd == -1)
@@ -155,6 +633,12 @@ int main(int argc, char **argv)
 
     s.ctxt.regs = &regs;
     s.ctxt.ops = &emul_ops;
+
+    if (recursive) {
+        disassemble_recursive(&s, base, len, &argv[5], argc - 5);
+        return 0;
+    }
+
     s.ctxt.disassemble = 1;
     s.ctxt.emulate = 1;
 
@@ -176,35 +660,12 @@ int main(int argc, char **argv)
             zeroes_run = 0;
         }
 
-        printf("%08x  ", pc);
-
         if (zeroes_run == 2) {
-            printf(".... .... ");
+            printf("%08x  .... .... ", pc);
             goto skip;
         }
 
-        for (j = 0; j < 3; j++) {
-            if (j < s.ctxt.op_words)
-                printf("%04x ", s.ctxt.op[j]);
-            else
-                printf("     ");
-        }
-        if ((p = strchr(s.ctxt.dis, '\t')) != NULL)
-            *p = '\0';
-        printf(" %s", s.ctxt.dis);
-        if (p) {
-            int spaces = 8-(p-s.ctxt.dis);
-            if (spaces < 1)
-                spaces = 1;
-            printf("%*s%s", spaces, "", p+1);
-        }
-        printf("\n");
-        if (j < s.ctxt.op_words) {
-            printf("%08x  ", pc + 2*j);
-            while (j < s.ctxt.op_words)
-                printf("%04x ", s.ctxt.op[j++]);
-            printf("\n");
-        }
+        print_insn(NULL, pc, s.ctxt.op, s.ctxt.op_words, s.ctxt.dis);
 
     skip:
         regs.pc = pc + s.ctxt.op_words*2;
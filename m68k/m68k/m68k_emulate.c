@@ -9,6 +9,8 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "m68k_emulate.h"
 
 /* Type, address-of, and value of an instruction's operand. */
@@ -24,11 +26,61 @@ struct operand {
     uint32_t mem;
 };
 
+/* An effective address as fetched from the instruction stream. It becomes an
+ * operand only when bound against the registers, by bind_ea(). */
+struct ea {
+    uint8_t mode, reg;
+    uint16_t ext; /* modes 6 and 7.3: brief extension word */
+    /* Mode 5: displacement. Modes 7.0-7.3: address (excluding any index).
+     * Mode 7.4: immediate. */
+    uint32_t val;
+};
+
+/* An instruction, fully fetched, and ready to execute. */
+struct insn {
+    uint16_t op;
+    uint32_t imm; /* immediate source operand, or branch target */
+    struct ea ea[2];
+};
+
+/* Executes a decoded instruction, from the instruction's operation onwards.
+ * Shared by the decoder and the predecoded-instruction cache. */
+typedef int (*exec_fn)(struct m68k_emulate_ctxt *, const struct insn *);
+
 struct m68k_emulate_priv_ctxt {
     char *dis_p; /* ptr into dis[] char buffer */
     struct m68k_regs sh_regs; /* shadow copy of regs before writeback */
+    struct m68k_lazy_cc sh_cc; /* shadow copy of deferred condition codes */
     struct operand operand;
     struct m68k_exception exception;
+    /* The decoded instruction, if of a form which can be cached. */
+    struct insn insn;
+    /* Cache the instruction when it executes? And how many of its words the
+     * prefetch queue held when its fetch began. */
+    uint8_t icache_miss, icache_pf_words;
+};
+
+/* The cache is direct mapped by PC. An entry holds an instruction's opcode
+ * words, which must still match memory and the prefetch queue when it is
+ * executed, and its decode. */
+#define ICACHE_SHIFT     12
+#define ICACHE_MAX_WORDS 5
+struct icache_ent {
+    uint32_t pc;
+    exec_fn exec; /* NULL if the entry is free */
+    uint8_t op_sz, op_words;
+    uint16_t op[ICACHE_MAX_WORDS];
+    struct insn insn;
+};
+
+/* One bit per 256-byte block of the address space, set when an entry may
+ * overlap the block: writes elsewhere need not search the cache. */
+#define ICACHE_BLOCK_SHIFT 8
+#define ICACHE_NR_BLOCKS   (1u << (24 - ICACHE_BLOCK_SHIFT))
+
+struct m68k_icache {
+    struct icache_ent ent[1u << ICACHE_SHIFT];
+    uint32_t map[ICACHE_NR_BLOCKS / 32];
 };
 
 /* SR flags */
@@ -183,7 +235,7 @@ static const char *addr_name(struct m68k_emulate_ctxt *c, uint32_t addr)
 
 static int fetch_insn_word(struct m68k_emulate_ctxt *c, uint16_t *word)
 {
-    uint32_t val;
+    uint32_t val = 0;
     int rc = fetch(&val, 2, c);
     c->op[c->op_words++] = *word = val;
     return rc;
@@ -221,18 +273,22 @@ static int fetch_insn_##s##bytes(struct m68k_emulate_ctxt *c,   \
 _fetch_insn_bytes(s,)
 _fetch_insn_bytes(u,u)
 
-static void dump(struct m68k_emulate_ctxt *c, const char *fmt, ...)
+static void _dump(struct m68k_emulate_ctxt *c, const char *fmt, ...)
 {
     va_list args;
 
-    if (!c->disassemble)
-        return;
-
     va_start(args, fmt);
     c->p->dis_p += vsprintf(c->p->dis_p, fmt, args);
     va_end(args);
 }
 
+/* Disassembly text. Execute-only callers pay neither the call nor the
+ * argument evaluation. */
+#define dump(c, ...) do {                       \
+    if ((c)->disassemble)                       \
+        _dump(c, __VA_ARGS__);                  \
+} while (0)
+
 static int deliver_exception(struct m68k_emulate_ctxt *c)
 {
     if (c->ops->deliver_exception)
@@ -240,33 +296,105 @@ static int deliver_exception(struct m68k_emulate_ctxt *c)
     return m68k_deliver_exception(c, &c->p->exception);
 }
 
+/* Deferred condition-code operations. */
+#define CCOP_none 0
+#define CCOP_mov  1 /* N,Z from result; V=C=0 */
+#define CCOP_cmp  2 /* N,Z,V,C from dst-src */
+#define CCOP_add  3 /* X,N,Z,V,C from dst+src */
+#define CCOP_sub  4 /* X,N,Z,V,C from dst-src */
+
+static uint16_t cc_eval(const struct m68k_lazy_cc *cc, uint16_t sr)
+{
+    uint32_t msb = cc->msb, s = cc->src, d = cc->dst, r = cc->res;
+
+    if (cc->op == CCOP_none)
+        return sr;
+
+    sr &= ~(CC_N|CC_Z|CC_V|CC_C);
+    if (r & msb)
+        sr |= CC_N;
+    if ((r & ((msb<<1)-1)) == 0)
+        sr |= CC_Z;
+
+    switch (cc->op) {
+    case CCOP_add:
+        sr &= ~CC_X;
+        if (!((s ^ d) & msb) && ((d ^ r) & msb))
+            sr |= CC_V;
+        if ((s & d & msb) || (s & ~r & msb) || (d & ~r & msb))
+            sr |= CC_C | CC_X;
+        break;
+    case CCOP_sub:
+        sr &= ~CC_X;
+        if ((s & ~d & msb) || (r & ~d & msb) || (s & r & msb))
+            sr |= CC_X;
+        /* fall through */
+    case CCOP_cmp:
+        if (((s ^ d) & msb) && ((d ^ r) & msb))
+            sr |= CC_V;
+        if ((s & ~d & msb) || (r & ~d & msb) || (s & r & msb))
+            sr |= CC_C;
+        break;
+    }
+
+    return sr;
+}
+
+/* All accesses to the shadow SR go via here, so that it is never seen without
+ * the condition codes of the last flag-setting operation. */
+static uint16_t *cc_sync(struct m68k_emulate_ctxt *c)
+{
+    struct m68k_emulate_priv_ctxt *p = c->p;
+    if (p->sh_cc.op != CCOP_none) {
+        p->sh_regs.sr = cc_eval(&p->sh_cc, p->sh_regs.sr);
+        p->sh_cc.op = CCOP_none;
+    }
+    return &p->sh_regs.sr;
+}
+
+#define sh_sr(c) (*cc_sync(c))
+
+static void cc_defer(
+    struct m68k_emulate_ctxt *c, uint8_t op, uint32_t msb,
+    uint32_t s, uint32_t d, uint32_t r)
+{
+    struct m68k_lazy_cc *cc = &c->p->sh_cc;
+    /* mov and cmp preserve X, which a pending add/sub has yet to compute. */
+    if ((op <= CCOP_cmp) && (cc->op >= CCOP_add))
+        (void)cc_sync(c);
+    cc->op = op;
+    cc->msb = msb;
+    cc->src = s;
+    cc->dst = d;
+    cc->res = r;
+}
+
+static uint32_t cc_msb(struct m68k_emulate_ctxt *c)
+{
+    return 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
+}
+
+static void cc_mov(struct m68k_emulate_ctxt *c, uint32_t result)
+{
+    uint32_t msb = (c->op_sz == OPSZ_W ? 1u << 15
+                    : c->op_sz == OPSZ_B ? 1u << 7 : 1u << 31);
+    cc_defer(c, CCOP_mov, msb, 0, 0, result);
+}
+
 static void update_sr(struct m68k_emulate_ctxt *c, uint16_t new_sr)
 {
-    uint16_t old_sr = sh_reg(c, sr);
+    uint16_t old_sr = sh_sr(c);
     if ((old_sr ^ new_sr) & SR_S) {
         uint32_t xsp = sh_reg(c, a[7]);
         sh_reg(c, a[7]) = sh_reg(c, xsp);
         sh_reg(c, xsp) = xsp;
     }
-    sh_reg(c, sr) = new_sr;
-}
-
-static void cc_mov(struct m68k_emulate_ctxt *c, uint32_t result)
-{
-    uint16_t sr = sh_reg(c, sr);
-    sr &= ~(CC_N|CC_Z|CC_V|CC_C);
-    if (c->op_sz == OPSZ_W)
-        result = (int16_t)result;
-    else if (c->op_sz == OPSZ_B)
-        result = (int8_t)result;
-    sr |= result & (1u<<31) ? CC_N : 0;
-    sr |= result == 0 ? CC_Z : 0;
-    sh_reg(c, sr) = sr;
+    sh_sr(c) = new_sr;
 }
 
 static int cc_eval_condition(struct m68k_emulate_ctxt *c, uint8_t cond)
 {
-    uint8_t cc = c->regs->sr;
+    uint8_t cc = sh_sr(c);
     int r = 0;
 
     switch ((cond >> 1) & 7) {
@@ -288,56 +416,51 @@ static int cc_eval_condition(struct m68k_emulate_ctxt *c, uint8_t cond)
     return (cond & 1) ? !r : r;
 }
 
-static int decode_ea(struct m68k_emulate_ctxt *c)
+static int32_t ea_index(struct m68k_emulate_ctxt *c, uint16_t ext)
+{
+    int32_t idx = (ext & (1u<<15) ? sh_reg(c,a) : sh_reg(c,d))[(ext>>12)&7];
+    if (!(ext & (1u<<11)))
+        idx = (int16_t)idx;
+    idx <<= (ext>>9)&3;
+    return idx;
+}
+
+/* Fetch any extension words of effective address @modereg (as in opcode bits
+ * 5:0), and disassemble it. No register is read for the operand, nor
+ * modified: see bind_ea(). */
+static int fetch_ea(
+    struct m68k_emulate_ctxt *c, struct ea *ea, uint8_t modereg)
 {
-    struct operand *op = &c->p->operand;
     const char *name;
-    uint8_t mode, reg;
+    uint8_t reg;
     int rc = 0;
 
-    op->type = OP_MEM; /* most common */
-    mode = (c->op[0] >> 3) & 7;
-    reg = c->op[0] & 7;
+    ea->mode = (modereg >> 3) & 7;
+    ea->reg = reg = modereg & 7;
 
-    switch (mode) {
+    switch (ea->mode) {
     case 0:
-        op->type = OP_REG;
-        op->reg = &sh_reg(c, d[reg]);
         dump(c, "%s", dreg[reg]);
         break;
     case 1:
-        op->type = OP_REG;
-        op->reg = &sh_reg(c, a[reg]);
         dump(c, "%s", areg[reg]);
         break;
     case 2:
-        op->reg = &sh_reg(c, a[reg]);
-        op->mem = *op->reg;
-        if ((name = addr_name(c, op->mem)) != NULL)
+        if ((name = addr_name(c, sh_reg(c, a[reg]))) != NULL)
             dump(c, "%s", name);
         dump(c, "(%s)", areg[reg]);
         break;
     case 3:
-        op->reg = &sh_reg(c, a[reg]);
-        op->mem = *op->reg;
-        *op->reg += (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
-        if ((reg == 7) && (c->op_sz == OPSZ_B))
-            (*op->reg)++; /* keep sp word-aligned */
         dump(c, "(%s)+", areg[reg]);
         break;
     case 4:
-        op->reg = &sh_reg(c, a[reg]);
-        op->mem = *op->reg -=
-            (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
-        if ((reg == 7) && (c->op_sz == OPSZ_B))
-            op->mem = --(*op->reg); /* keep sp word-aligned */
         dump(c, "-(%s)", areg[reg]);
         break;
     case 5: {
         int32_t disp;
         bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_W));
-        op->mem = sh_reg(c, a[reg]) + disp;
-        if ((name = addr_name(c, op->mem)) != NULL)
+        ea->val = disp;
+        if ((name = addr_name(c, sh_reg(c, a[reg]) + disp)) != NULL)
             dump(c, "%s", name);
         else if (disp < 0)
             dump(c, "-%x", -disp);
@@ -349,14 +472,9 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
     case 6: {
         uint16_t ext;
         bail_if(rc = fetch_insn_word(c, &ext));
+        ea->ext = ext;
         if (!(ext & (1u << 8))) {
-            int32_t idx = (ext & (1u<<15) ? sh_reg(c,a) : sh_reg(c,d))[
-                (ext>>12)&7];
             int8_t disp = (int8_t)ext;
-            if (!(ext & (1u<<11)))
-                idx = (int16_t)idx;
-            idx <<= (ext>>9)&3;
-            op->mem = sh_reg(c, a[reg]) + disp + idx;
             if (disp < 0) {
                 dump(c, "-");
                 disp = -disp;
@@ -373,37 +491,32 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
     case 7: {
         switch (reg) {
         case 0:
-            bail_if(rc = fetch_insn_sbytes(c, (int32_t *)&op->mem, OPSZ_W));
+            bail_if(rc = fetch_insn_sbytes(c, (int32_t *)&ea->val, OPSZ_W));
         abs_addr:
-            if ((name = addr_name(c, op->mem)) != NULL)
+            if ((name = addr_name(c, ea->val)) != NULL)
                 dump(c, "%s", name);
             else
-                dump(c, "%x", op->mem);
+                dump(c, "%x", ea->val);
             break;
         case 1:
-            bail_if(rc = fetch_insn_ubytes(c, &op->mem, OPSZ_L));
+            bail_if(rc = fetch_insn_ubytes(c, &ea->val, OPSZ_L));
             goto abs_addr;
         case 2: {
             int32_t disp;
-            op->mem = sh_reg(c, pc);
+            ea->val = sh_reg(c, pc);
             bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_W));
-            op->mem += disp;
-            dump(c, "%x(pc)", op->mem);
+            ea->val += disp;
+            dump(c, "%x(pc)", ea->val);
             break;
         }
         case 3: {
-            uint32_t target = sh_reg(c, pc);
             uint16_t ext;
+            ea->val = sh_reg(c, pc);
             bail_if(rc = fetch_insn_word(c, &ext));
-            target += (int8_t)ext;
+            ea->ext = ext;
+            ea->val += (int8_t)ext;
             if (!(ext & (1u << 8))) {
-                int32_t idx = (ext & (1u<<15) ? sh_reg(c,a) : sh_reg(c,d))[
-                    (ext>>12)&7];
-                if (!(ext & (1u<<11)))
-                    idx = (int16_t)idx;
-                idx <<= (ext>>9)&3;
-                op->mem = target + idx;
-                dump(c, "%04x(pc,%s.%c*%u)", target,
+                dump(c, "%04x(pc,%s.%c*%u)", ea->val,
                      (ext & (1u<<15) ? areg : dreg)[(ext>>12)&7],
                      ext & (1u<<11) ? 'l' : 'w', 1u << ((ext>>9)&3));
             } else {
@@ -413,9 +526,8 @@ static int decode_ea(struct m68k_emulate_ctxt *c)
             break;
         }
         case 4:
-            op->type = OP_IMM;
-            bail_if(rc = fetch_insn_ubytes(c, &op->val, c->op_sz));
-            dump(c, "#%x", op->val);
+            bail_if(rc = fetch_insn_ubytes(c, &ea->val, c->op_sz));
+            dump(c, "#%x", ea->val);
             break;
         default:
             dump(c, "???");
@@ -429,10 +541,84 @@ bail:
     return rc;
 }
 
-static int decode_mem_ea(struct m68k_emulate_ctxt *c)
+/* Is @ea a memory operand? */
+static int ea_is_mem(const struct ea *ea)
+{
+    return (ea->mode >= 2) && ((ea->mode != 7) || (ea->reg <= 3));
+}
+
+/* Make @ea, fetched by fetch_ea(), the current operand, for an access of size
+ * c->op_sz. Postincrement and predecrement modes update their register. */
+static void bind_ea(struct m68k_emulate_ctxt *c, const struct ea *ea)
+{
+    struct operand *op = &c->p->operand;
+    uint8_t reg = ea->reg;
+
+    op->type = OP_MEM; /* most common */
+
+    switch (ea->mode) {
+    case 0:
+        op->type = OP_REG;
+        op->reg = &sh_reg(c, d[reg]);
+        break;
+    case 1:
+        op->type = OP_REG;
+        op->reg = &sh_reg(c, a[reg]);
+        break;
+    case 2:
+        op->reg = &sh_reg(c, a[reg]);
+        op->mem = *op->reg;
+        break;
+    case 3:
+        op->reg = &sh_reg(c, a[reg]);
+        op->mem = *op->reg;
+        *op->reg += (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
+        if ((reg == 7) && (c->op_sz == OPSZ_B))
+            (*op->reg)++; /* keep sp word-aligned */
+        break;
+    case 4:
+        op->reg = &sh_reg(c, a[reg]);
+        op->mem = *op->reg -=
+            (c->op_sz == OPSZ_B ? 1 : c->op_sz == OPSZ_W ? 2 : 4);
+        if ((reg == 7) && (c->op_sz == OPSZ_B))
+            op->mem = --(*op->reg); /* keep sp word-aligned */
+        break;
+    case 5:
+        op->mem = sh_reg(c, a[reg]) + ea->val;
+        break;
+    case 6:
+        op->mem = sh_reg(c, a[reg]) + (int8_t)ea->ext + ea_index(c, ea->ext);
+        break;
+    case 7:
+        switch (reg) {
+        case 3:
+            op->mem = ea->val + ea_index(c, ea->ext);
+            break;
+        case 4:
+            op->type = OP_IMM;
+            op->val = ea->val;
+            break;
+        default:
+            op->mem = ea->val;
+            break;
+        }
+        break;
+    }
+}
+
+static int decode_ea(struct m68k_emulate_ctxt *c)
+{
+    struct ea ea;
+    int rc = fetch_ea(c, &ea, c->op[0]);
+    if (rc == 0)
+        bind_ea(c, &ea);
+    return rc;
+}
+
+static int fetch_mem_ea(struct m68k_emulate_ctxt *c, struct ea *ea)
 {
-    int rc = decode_ea(c);
-    if ((rc == 0) && (c->p->operand.type != OP_MEM))
+    int rc = fetch_ea(c, ea, c->op[0]);
+    if ((rc == 0) && !ea_is_mem(ea))
         rc = M68KEMUL_UNHANDLEABLE;
     return rc;
 }
@@ -464,7 +650,7 @@ static int read_ea(struct m68k_emulate_ctxt *c)
         /* already in op->val */
         break;
     case OP_SR:
-        op->val = sh_reg(c, sr);
+        op->val = sh_sr(c);
         if (bytes == 1)
             op->val = (uint8_t)op->val;
         break;
@@ -496,7 +682,7 @@ static int write_ea(struct m68k_emulate_ctxt *c)
         break;
     case OP_SR:
         if (bytes == 1)
-            sh_reg(c, sr) = (sh_reg(c, sr) & ~0xffu) | (uint8_t)op->val;
+            sh_sr(c) = (sh_sr(c) & ~0xffu) | (uint8_t)op->val;
         else
             update_sr(c, op->val);
         break;
@@ -508,64 +694,559 @@ static int write_ea(struct m68k_emulate_ctxt *c)
     return rc;
 }
 
-static uint32_t _op_sub(struct m68k_emulate_ctxt *c, uint32_t s, uint32_t d)
+static uint32_t _op_sub(
+    struct m68k_emulate_ctxt *c, uint8_t ccop, uint32_t s, uint32_t d)
 {
-    uint32_t msb, r;
-    uint16_t sr;
-
-    msb = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
-    r = d - s;
-
-    sr = sh_reg(c, sr) & ~(CC_N|CC_Z|CC_V|CC_C);
-    if (r & msb)
-        sr |= CC_N;
-    if ((r & ((msb<<1)-1)) == 0)
-        sr |= CC_Z;
-    if (((s ^ d) & msb) && ((d ^ r) & msb))
-        sr |= CC_V;
-    if ((s & ~d & msb) || (r & ~d & msb) || (s & r & msb))
-        sr |= CC_C;
-    sh_reg(c, sr) = sr;
-
+    uint32_t r = d - s;
+    cc_defer(c, ccop, cc_msb(c), s, d, r);
     return r;
 }
 
 static void op_cmp(struct m68k_emulate_ctxt *c, uint32_t s, uint32_t d)
 {
-    (void)_op_sub(c, s, d);
+    (void)_op_sub(c, CCOP_cmp, s, d);
 }
 
 static int op_sub(struct m68k_emulate_ctxt *c, uint32_t s)
 {
-    c->p->operand.val = _op_sub(c, s, c->p->operand.val);
-    sh_reg(c, sr) &= ~CC_X;
-    if (sh_reg(c, sr) & CC_C)
-        sh_reg(c, sr) |= CC_X;
+    c->p->operand.val = _op_sub(c, CCOP_sub, s, c->p->operand.val);
     return write_ea(c);
 }
 
 static int op_add(struct m68k_emulate_ctxt *c, uint32_t s)
 {
-    uint32_t msb, d, r;
-    uint16_t sr;
+    uint32_t d = c->p->operand.val, r = d + s;
+    cc_defer(c, CCOP_add, cc_msb(c), s, d, r);
+    c->p->operand.val = r;
+    return write_ea(c);
+}
 
-    msb = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
-    d = c->p->operand.val;
-    r = d + s;
+static struct icache_ent *icache_slot(struct m68k_icache *ic, uint32_t pc)
+{
+    return &ic->ent[(pc >> 1) & ((1u << ICACHE_SHIFT) - 1)];
+}
 
-    sr = sh_reg(c, sr) & ~(CC_X|CC_N|CC_Z|CC_V|CC_C);
-    if (r & msb)
-        sr |= CC_N;
-    if ((r & ((msb<<1)-1)) == 0)
-        sr |= CC_Z;
-    if (!((s ^ d) & msb) && ((d ^ r) & msb))
-        sr |= CC_V;
-    if ((s & d & msb) || (s & ~r & msb) || (d & ~r & msb))
-        sr |= CC_C | CC_X;
-    sh_reg(c, sr) = sr;
+static void icache_map(struct m68k_icache *ic, uint32_t addr)
+{
+    uint32_t blk = addr >> ICACHE_BLOCK_SHIFT;
+    ic->map[blk/32] |= 1u << (blk&31);
+}
+
+/* The instruction at regs->pc has been fetched into c->op[], and is about to
+ * be executed by @fn: cache it, unless words taken from the prefetch queue
+ * are stale (memory has since been written), or the cache cannot hold it. */
+static void icache_insert(struct m68k_emulate_ctxt *c, exec_fn fn)
+{
+    struct icache_ent *e;
+    uint32_t v, pc = c->regs->pc, end = pc + 2*c->op_words - 1;
+    unsigned int i;
+
+    if ((c->op_words > ICACHE_MAX_WORDS) || (end >> 24))
+        return;
+
+    for (i = 0; (i < c->p->icache_pf_words) && (i < c->op_words); i++)
+        if (c->ops->read(pc + 2*i, &v, 2, c) || ((uint16_t)v != c->op[i]))
+            return;
+
+    e = icache_slot(c->icache, pc);
+    e->pc = pc;
+    e->exec = fn;
+    e->op_sz = c->op_sz;
+    e->op_words = c->op_words;
+    memcpy(e->op, c->op, c->op_words * sizeof(e->op[0]));
+    e->insn = c->p->insn;
+    icache_map(c->icache, pc);
+    icache_map(c->icache, end);
+}
+
+/* Look up the instruction at @pc. It must match what fetch() would see,
+ * including any words held in the prefetch queue. */
+static struct icache_ent *icache_lookup(
+    struct m68k_emulate_ctxt *c, uint32_t pc)
+{
+    struct icache_ent *e = icache_slot(c->icache, pc);
+    unsigned int i;
+
+    if (!e->exec || (e->pc != pc))
+        return NULL;
+    if (c->prefetch_addr == pc)
+        for (i = 0; (i < c->prefetch_valid) && (i < e->op_words); i++)
+            if (c->prefetch_dat[i] != e->op[i])
+                return NULL;
+    return e;
+}
+
+/* Consume cached instruction @e as fetch() would have: advance the PC, take
+ * any of its words from the prefetch queue, and refill the queue. */
+static void icache_fetch(
+    struct m68k_emulate_ctxt *c, const struct icache_ent *e)
+{
+    uint32_t v;
+
+    if (sh_reg(c, pc) != c->prefetch_addr)
+        c->prefetch_valid = 0;
+    if (c->prefetch_valid > e->op_words) {
+        c->prefetch_dat[0] = c->prefetch_dat[1];
+        c->prefetch_valid--;
+    } else {
+        c->prefetch_valid = 0;
+    }
+
+    sh_reg(c, pc) += 2 * e->op_words;
+    c->prefetch_addr = sh_reg(c, pc);
+    c->cycles += 4 * e->op_words;
+    c->op_sz = e->op_sz;
+    c->op_words = e->op_words;
+    memcpy(c->op, e->op, e->op_words * sizeof(e->op[0]));
+
+    while (c->prefetch_valid != 2) {
+        if (c->ops->read(c->prefetch_addr + c->prefetch_valid*2, &v, 2, c))
+            break;
+        c->prefetch_dat[c->prefetch_valid++] = (uint16_t)v;
+    }
+}
+
+/* Execute c->p->insn, now fully fetched, by @fn. */
+static int execute(struct m68k_emulate_ctxt *c, exec_fn fn)
+{
+    if (c->p->icache_miss)
+        icache_insert(c, fn);
+    return fn(c, &c->p->insn);
+}
+
+static int ex_rts(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bail_if(rc = read(sh_reg(c,a[7]), &sh_reg(c, pc), 4, c));
+    sh_reg(c, a[7]) += 4;
+bail:
+    return rc;
+}
+
+static int ex_swap(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t *reg = &sh_reg(c, d[i->op&7]);
+    *reg = (*reg << 16) | (uint16_t)(*reg >> 16);
+    cc_mov(c, *reg);
+    return 0;
+}
+
+static int ex_clr(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    c->p->operand.val = 0;
+    bail_if(rc = write_ea(c));
+    sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
+    sh_sr(c) |= CC_Z;
+bail:
+    return rc;
+}
+
+static int ex_ext(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t *reg = &sh_reg(c, d[i->op&7]);
+    *reg = (c->op_sz == OPSZ_W
+            ? (*reg & ~0xffffu) | (uint16_t)(int8_t)*reg
+            : (int16_t)*reg);
+    cc_mov(c, *reg);
+    return 0;
+}
+
+static int ex_jmp(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc = 0;
+    bind_ea(c, &i->ea[0]);
+    if (!(i->op & (1u<<6))) {
+        /* push return address (current pc) */
+        sh_reg(c, a[7]) -= 4;
+        bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
+    }
+    /* update pc to jump target */
+    sh_reg(c, pc) = c->p->operand.mem;
+bail:
+    return rc;
+}
+
+static int ex_lea(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    bind_ea(c, &i->ea[0]);
+    sh_reg(c, a[(i->op>>9)&7]) = c->p->operand.mem;
+    return 0;
+}
+
+static int ex_neg(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t s;
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    s = c->p->operand.val;
+    c->p->operand.val = 0;
+    rc = op_sub(c, s);
+bail:
+    return rc;
+}
+
+static int ex_not(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    c->p->operand.val = ~c->p->operand.val;
+    cc_mov(c, c->p->operand.val);
+    rc = write_ea(c);
+bail:
+    return rc;
+}
+
+static int ex_pea(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    bind_ea(c, &i->ea[0]);
+    sh_reg(c, a[7]) -= 4;
+    return write(sh_reg(c, a[7]), c->p->operand.mem, 4, c);
+}
+
+static int ex_tst(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    cc_mov(c, c->p->operand.val);
+bail:
+    return rc;
+}
+
+static int ex_alu_imm(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+
+    if ((i->op & 0x3fu) != 0x3cu)
+        bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    switch ((i->op >> 9) & 7) {
+    case 0: /* or */
+        c->p->operand.val |= i->imm;
+        cc_mov(c, c->p->operand.val);
+        bail_if(rc = write_ea(c));
+        break;
+    case 1: /* and */
+        c->p->operand.val &= i->imm;
+        cc_mov(c, c->p->operand.val);
+        bail_if(rc = write_ea(c));
+        break;
+    case 2: /* sub */
+        bail_if(rc = op_sub(c, i->imm));
+        break;
+    case 3: /* add */
+        bail_if(rc = op_add(c, i->imm));
+        break;
+    case 5: /* eor */
+        c->p->operand.val ^= i->imm;
+        cc_mov(c, c->p->operand.val);
+        bail_if(rc = write_ea(c));
+        break;
+    case 6: /* cmp */
+        op_cmp(c, i->imm, c->p->operand.val);
+        break;
+    default:
+        rc = M68KEMUL_UNHANDLEABLE;
+        break;
+    }
+
+bail:
+    return rc;
+}
+
+/* Most move instructions perform the second prefetch after writeback. We
+ * simulate this by discarding our second word of prefetch. */
+static void move_prefetch(struct m68k_emulate_ctxt *c)
+{
+    if (c->prefetch_valid > 1)
+        c->prefetch_valid = 1;
+}
+
+static int ex_movea(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    if (c->op_sz == OPSZ_W) {
+        c->p->operand.val = (int16_t)c->p->operand.val;
+        c->op_sz = OPSZ_L;
+    }
+    sh_reg(c, a[(i->op>>9)&7]) = c->p->operand.val;
+    move_prefetch(c);
+bail:
+    return rc;
+}
+
+static int ex_move(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    struct operand src, dst;
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    src = c->p->operand;
+    bind_ea(c, &i->ea[1]);
+    dst = c->p->operand;
+    c->p->operand = src;
+    bail_if(rc = read_ea(c));
+    dst.val = c->p->operand.val;
+    c->p->operand = dst;
+    bail_if(rc = write_ea(c));
+    cc_mov(c, dst.val);
+    move_prefetch(c);
+bail:
+    return rc;
+}
+
+static int ex_addq(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint8_t val = (i->op >> 9) & 7 ? : 8;
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    if (((i->op >> 3) & 7) == 1) {
+        /* adda/suba semantics */
+        uint32_t *reg = c->p->operand.reg;
+        c->op_sz = OPSZ_L;
+        *reg = i->op & (1u<<8) ? *reg - val : *reg + val;
+    } else {
+        rc = ((i->op & (1u<<8)) ? op_sub : op_add)(c, val);
+    }
+bail:
+    return rc;
+}
+
+static int ex_dbcc(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    if (!cc_eval_condition(c, (i->op >> 8) & 0xf)) {
+        uint32_t *reg = &sh_reg(c, d[i->op&7]);
+        *reg = (*reg & ~0xffffu) | (uint16_t)(*reg - 1);
+        if ((int16_t)*reg != -1)
+            sh_reg(c, pc) = i->imm;
+    }
+    return 0;
+}
+
+static int ex_bcc(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint8_t cond = (i->op >> 8) & 0xf;
+    int rc = 0;
+    if (cond == 1) {
+        /* bsr: push return address (current pc) onto stack */
+        sh_reg(c, a[7]) -= 4;
+        bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
+    } else if (!cc_eval_condition(c, cond))
+        goto bail; /* bcc condition is false: no branch */
+    sh_reg(c, pc) = i->imm;
+bail:
+    return rc;
+}
+
+static int ex_moveq(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t *reg = &sh_reg(c, d[(i->op>>9)&7]);
+    *reg = (int8_t)i->op;
+    cc_mov(c, *reg);
+    return 0;
+}
+
+static int ex_cmpa(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    if (c->op_sz == OPSZ_W) {
+        c->p->operand.val = (int16_t)c->p->operand.val;
+        c->op_sz = OPSZ_L;
+    }
+    op_cmp(c, c->p->operand.val, sh_reg(c, a[(i->op>>9)&7]));
+bail:
+    return rc;
+}
+
+static int ex_cmp(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    op_cmp(c, c->p->operand.val, sh_reg(c, d[(i->op>>9)&7]));
+bail:
+    return rc;
+}
+
+static int ex_eor(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    c->p->operand.val ^= sh_reg(c, d[(i->op>>9)&7]);
+    cc_mov(c, c->p->operand.val);
+    rc = write_ea(c);
+bail:
+    return rc;
+}
+
+static int ex_mul(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t *reg = &sh_reg(c, d[(i->op>>9)&7]);
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
+    bail_if(rc = read_ea(c));
+    if (i->op & (1u<<8))
+        *reg = (int16_t)*reg * (int16_t)c->p->operand.val;
+    else
+        *reg = (uint16_t)*reg * (uint16_t)c->p->operand.val;
+    if ((uint32_t)*reg == 0)
+        sh_sr(c) |= CC_Z;
+    if ((int32_t)*reg < 0)
+        sh_sr(c) |= CC_N;
+bail:
+    return rc;
+}
 
+static int ex_andor(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t r, *reg = &sh_reg(c, d[(i->op>>9)&7]);
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    r = i->op & (1u<<14) ?
+        c->p->operand.val & *reg : c->p->operand.val | *reg;
+    cc_mov(c, r);
+    if (!(i->op & (1u<<8))) {
+        c->p->operand.type = OP_REG;
+        c->p->operand.reg = reg;
+    }
     c->p->operand.val = r;
-    return write_ea(c);
+    rc = write_ea(c);
+bail:
+    return rc;
+}
+
+static int ex_adda(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t r, *reg = &sh_reg(c, a[(i->op>>9)&7]);
+    int rc;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    r = c->p->operand.val;
+    if (c->op_sz == OPSZ_W) {
+        r = (int16_t)r;
+        c->op_sz = OPSZ_L;
+    }
+    *reg = i->op & (1u<<14) ? *reg + r : *reg - r;
+bail:
+    return rc;
+}
+
+static int ex_addsub(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint32_t op1, *reg = &sh_reg(c, d[(i->op>>9)&7]);
+    int rc;
+    op1 = *reg;
+    bind_ea(c, &i->ea[0]);
+    bail_if(rc = read_ea(c));
+    if (!(i->op & (1u<<8))) {
+        op1 = c->p->operand.val;
+        c->p->operand.type = OP_REG;
+        c->p->operand.reg = reg;
+        c->p->operand.val = *reg;
+    }
+    rc = ((i->op & (1u<<14)) ? op_add : op_sub)(c, op1);
+bail:
+    return rc;
+}
+
+static int ex_shift(struct m68k_emulate_ctxt *c, const struct insn *i)
+{
+    uint16_t op = i->op;
+    uint32_t m, v;
+    uint8_t x, typ, cnt;
+    int rc;
+
+    if ((op & 0xc0u) == 0xc0u) {
+        /* shift/rotate <ea> */
+        typ = (op >> 9) & 3;
+        cnt = 1;
+        bind_ea(c, &i->ea[0]);
+    } else {
+        /* shift/rotate <dn> */
+        typ = (op >> 3) & 3;
+        cnt = ((op & (1u<<5)) ? sh_reg(c, d[(op>>9)&7]) & 63
+               : ((op >> 9) & 7 ?: 8));
+        c->p->operand.type = OP_REG;
+        c->p->operand.reg = &sh_reg(c, d[op&7]);
+    }
+    bail_if(rc = read_ea(c));
+    v = c->p->operand.val;
+    m = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
+    sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
+    while (cnt--) {
+        switch ((typ << 1) | ((op >> 8) & 1)) {
+        case 0: /* asr */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & 1)
+                sh_sr(c) |= CC_X|CC_C;
+            v = (v >> 1) | (v & m);
+            break;
+        case 1: /* asl */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & m)
+                sh_sr(c) |= CC_X|CC_C;
+            if ((v ^ (v << 1)) & m)
+                sh_sr(c) |= CC_V;
+            v = (v << 1);
+            break;
+        case 2: /* lsr */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & 1)
+                sh_sr(c) |= CC_X|CC_C;
+            v = (v >> 1);
+            break;
+        case 3: /* lsl */
+            sh_sr(c) &= ~(CC_X|CC_C);
+            if (v & m)
+                sh_sr(c) |= CC_X|CC_C;
+            v = (v << 1);
+            break;
+        case 4: /* roxr */
+            x = !!(v & 1);
+            v = (v >> 1) | (sh_sr(c) & CC_X ? m : 0);
+            sh_sr(c) &= ~CC_X;
+            sh_sr(c) |= x ? CC_X : 0;
+            break;
+        case 5: /* roxl */
+            x = !!(v & m);
+            v = (v << 1) | (sh_sr(c) & CC_X ? 1 : 0);
+            sh_sr(c) &= ~CC_X;
+            sh_sr(c) |= x ? CC_X : 0;
+            break;
+        case 6: /* ror */
+            sh_sr(c) &= ~CC_C;
+            if (v & 1)
+                sh_sr(c) |= CC_C;
+            v = (v >> 1) | (sh_sr(c) & CC_C ? m : 0);
+            break;
+        case 7: /* rol */
+            sh_sr(c) &= ~CC_C;
+            if (v & m)
+                sh_sr(c) |= CC_C;
+            v = (v << 1) | (sh_sr(c) & CC_C ? 1 : 0);
+            break;
+        }
+    }
+    if (typ == 2) /* roxl/roxr */
+        sh_sr(c) |= sh_sr(c) & CC_X ? CC_C : 0;
+    v &= (m << 1) - 1;
+    sh_sr(c) |= (v == 0 ? CC_Z : 0) | (v & m ? CC_N : 0);
+    c->p->operand.val = v;
+    rc = write_ea(c);
+
+bail:
+    return rc;
 }
 
 static int misc_insn(struct m68k_emulate_ctxt *c)
@@ -597,14 +1278,14 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         uint16_t data;
         bail_if(rc = fetch_insn_word(c, &data));
         dump(c, "stop\t#%x", data);
-        raise_exception_if(!(sh_reg(c, sr) & SR_S), M68KVEC_priv_violation);
+        raise_exception_if(!(sh_sr(c) & SR_S), M68KVEC_priv_violation);
         update_sr(c, data);
         /* should wait for an interrupt/exception... */
     } else if (op == 0x4e73u) {
         /* rte */
         uint32_t new_pc, new_sr;
         dump(c, "rte");
-        raise_exception_if(!(sh_reg(c, sr) & SR_S), M68KVEC_priv_violation);
+        raise_exception_if(!(sh_sr(c) & SR_S), M68KVEC_priv_violation);
         bail_if(rc = read(sh_reg(c, a[7]) + 2, &new_pc, 4, c));
         bail_if(rc = read(sh_reg(c, a[7]) + 0, &new_sr, 2, c));
         sh_reg(c, a[7]) += 6;
@@ -624,12 +1305,11 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
     } else if (op == 0x4e75u) {
         /* rts */
         dump(c, "rts");
-        bail_if(rc = read(sh_reg(c,a[7]), &sh_reg(c, pc), 4, c));
-        sh_reg(c, a[7]) += 4;
+        rc = execute(c, ex_rts);
     } else if (op == 0x4e76u) {
         /* trapv */
         dump(c, "trapv");
-        raise_exception_if(sh_reg(c, sr) & CC_V, M68KVEC_trapcc_trapv);
+        raise_exception_if(sh_sr(c) & CC_V, M68KVEC_trapcc_trapv);
     } else if (op == 0x4e77u) {
         /* rtr */
         uint32_t new_pc, new_sr;
@@ -637,19 +1317,17 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         bail_if(rc = read(sh_reg(c, a[7]) + 2, &new_pc, 4, c));
         bail_if(rc = read(sh_reg(c, a[7]) + 0, &new_sr, 2, c));
         sh_reg(c, a[7]) += 6;
-        sh_reg(c, sr) &= ~0xffu;
-        sh_reg(c, sr) |= (uint8_t)new_sr;
+        sh_sr(c) &= ~0xffu;
+        sh_sr(c) |= (uint8_t)new_sr;
         sh_reg(c, pc) = new_pc;
     }
 
     /* 2. Exact matches with no invalid cases. */
     else if ((op & 0xfff8u) == 0x4840u) {
         /* swap */
-        uint32_t *reg = &sh_reg(c, d[op&7]);
         c->op_sz = OPSZ_L;
         dump(c, "swap\t%s", dreg[op&7]);
-        *reg = (*reg << 16) | (uint16_t)(*reg >> 16);
-        cc_mov(c, *reg);
+        rc = execute(c, ex_swap);
     } else if ((op & 0xfff8u) == 0x4848u) {
         /* bkpt */
         dump(c, "bkpt\t#%x", op&7);
@@ -699,11 +1377,8 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* clr */
         dump(c, "clr.%c\t", op_sz_ch[c->op_sz]);
-        bail_if(rc = decode_ea(c));
-        c->p->operand.val = 0;
-        bail_if(rc = write_ea(c));
-        sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
-        sh_reg(c, sr) |= CC_Z;
+        bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+        rc = execute(c, ex_clr);
     } else if ((op & 0xffc0u) == 0x4c40u) {
         /* divs/divu.l */
         uint16_t ext, dr, dq, sz;
@@ -722,37 +1397,27 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         rc = M68KEMUL_UNHANDLEABLE;
     } else if ((op & 0xffb8u) == 0x4880u) {
         /* ext */
-        uint32_t *reg = &sh_reg(c, d[op&7]);
         c->op_sz = (op & (1u<<6)) ? OPSZ_L : OPSZ_W;
         dump(c, "ext.%c\t%s", op_sz_ch[c->op_sz], dreg[op&7]);
-        *reg = (c->op_sz == OPSZ_W
-                ? (*reg & ~0xffffu) | (uint16_t)(int8_t)*reg
-                : (int16_t)*reg);
-        cc_mov(c, *reg);
+        rc = execute(c, ex_ext);
     } else if ((op & 0xff80u) == 0x4e80u) {
         /* jmp/jsr */
         dump(c, "j%s\t", (op & (1u<<6)) ? "mp" : "sr");
-        bail_if(rc = decode_mem_ea(c));
-        if (!(op & (1u<<6))) {
-            /* push return address (current pc) */
-            sh_reg(c, a[7]) -= 4;
-            bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
-        }
-        /* update pc to jump target */
-        sh_reg(c, pc) = c->p->operand.mem;
+        bail_if(rc = fetch_mem_ea(c, &c->p->insn.ea[0]));
+        rc = execute(c, ex_jmp);
     } else if ((op & 0xf1c0u) == 0x41c0u) {
         /* lea */
         c->op_sz = OPSZ_L;
         dump(c, "lea.l\t");
-        bail_if(rc = decode_mem_ea(c));
+        bail_if(rc = fetch_mem_ea(c, &c->p->insn.ea[0]));
         dump(c, ",%s", areg[(op>>9)&7]);
-        sh_reg(c, a[(op>>9)&7]) = c->p->operand.mem;
+        rc = execute(c, ex_lea);
     } else if ((op & 0xfdc0u) == 0x40c0u) {
         /* move from ccr/sr */
         c->op_sz = OPSZ_W;
         dump(c, "move.w\t%s,", op & (1u<<9) ? "ccr" : "sr");
         bail_if(rc = decode_ea(c));
-        c->p->operand.val = sh_reg(c, sr);
+        c->p->operand.val = sh_sr(c);
         if (op & (1u<<9))
             c->p->operand.val = (uint8_t)c->p->operand.val;
         bail_if(rc = write_ea(c));
@@ -764,19 +1429,19 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         dump(c, ",%s", op & (1u<<9) ? "sr" : "ccr");
         bail_if(rc = read_ea(c));
         if (op & (1u<<9)) {
-            raise_exception_if(!(sh_reg(c, sr) & SR_S),
+            raise_exception_if(!(sh_sr(c) & SR_S),
                                M68KVEC_priv_violation);
             update_sr(c, c->p->operand.val);
         } else {
-            sh_reg(c, sr) &= ~0xffu;
-            sh_reg(c, sr) |= (uint8_t)c->p->operand.val;
+            sh_sr(c) &= ~0xffu;
+            sh_sr(c) |= (uint8_t)c->p->operand.val;
         }
     } else if ((op & 0xfff0u) == 0x4e60u) {
         /* move to/from usp */
         c->op_sz = OPSZ_L;
         dump(c, "move.l\t");
         dump(c, op&(1u<<3) ? "usp,%s" : "%s,usp", areg[op&7]);
-        raise_exception_if(!(sh_reg(c, sr) & SR_S), M68KVEC_priv_violation);
+        raise_exception_if(!(sh_sr(c) & SR_S), M68KVEC_priv_violation);
         if (op & (1u<<3))
             sh_reg(c, a[op&7]) = sh_reg(c, xsp);
         else
@@ -882,13 +1547,9 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
     } else if (((op & 0xff00u) == 0x4400u) &&
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* neg */
-        uint32_t s;
         dump(c, "neg.%c\t", op_sz_ch[c->op_sz]);
-        bail_if(rc = decode_ea(c));
-        bail_if(rc = read_ea(c));
-        s = c->p->operand.val;
-        c->p->operand.val = 0;
-        rc = op_sub(c, s);
+        bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+        rc = execute(c, ex_neg);
     } else if (((op & 0xff00u) == 0x4000u) &&
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* negx */
@@ -899,44 +1560,40 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
         bail_if(rc = read_ea(c));
         s = c->p->operand.val;
         c->p->operand.val = 0;
-        sr = sh_reg(c, sr);
+        sr = sh_sr(c);
         bail_if(rc = op_sub(c, s));
         if (sr & CC_X) {
-            uint16_t sr2 = sh_reg(c, sr);
+            uint16_t sr2 = sh_sr(c);
             bail_if(rc = op_sub(c, 1));
             /* overflow and carry accumulate across the two subtracts */
-            sh_reg(c, sr) |= sr2 & (CC_X|CC_V|CC_C);
+            sh_sr(c) |= sr2 & (CC_X|CC_V|CC_C);
         }
         /* CC.Z is never set by this instruction, only cleared */
-        if ((sh_reg(c, sr) & CC_Z) && !(sr & CC_Z))
-            sh_reg(c, sr) &= ~CC_Z;
+        if ((sh_sr(c) & CC_Z) && !(sr & CC_Z))
+            sh_sr(c) &= ~CC_Z;
     } else if (((op & 0xff00u) == 0x4600u) &&
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* not */
         dump(c, "not.%c\t", op_sz_ch[c->op_sz]);
-        bail_if(rc = decode_ea(c));
-        bail_if(rc = read_ea(c));
-        c->p->operand.val = ~c->p->operand.val;
-        cc_mov(c, c->p->operand.val);
-        rc = write_ea(c);
+        bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+        rc = execute(c, ex_not);
     } else if ((op & 0xffc0u) == 0x4840u) {
         /* pea */
         c->op_sz = OPSZ_L;
         dump(c, "pea.l\t");
-        bail_if(rc = decode_mem_ea(c));
-        sh_reg(c, a[7]) -= 4;
-        bail_if(rc = write(sh_reg(c, a[7]), c->p->operand.mem, 4, c));
+        bail_if(rc = fetch_mem_ea(c, &c->p->insn.ea[0]));
+        rc = execute(c, ex_pea);
     } else if ((op & 0xffc0u) == 0x4ac0u) {
         /* tas */
         c->op_sz = OPSZ_B;
         dump(c, "tas.b\t");
         bail_if(rc = decode_ea(c));
         bail_if(rc = read_ea(c));
-        sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
+        sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
         if (c->p->operand.val & 0x80)
-            sh_reg(c, sr) |= CC_N;
+            sh_sr(c) |= CC_N;
         if (!(c->p->operand.val & 0xff))
-            sh_reg(c, sr) |= CC_Z;
+            sh_sr(c) |= CC_Z;
         c->p->operand.val |= 0x80;
         bail_if(rc = write_ea(c));
     } else if ((op & 0xfff0u) == 0x4e40u) {
@@ -948,9 +1605,8 @@ static int misc_insn(struct m68k_emulate_ctxt *c)
                ((c->op_sz = (op>>6)&3) != OPSZ_X)) {
         /* tst */
         dump(c, "tst.%c\t", op_sz_ch[c->op_sz]);
-        bail_if(rc = decode_ea(c));
-        bail_if(rc = read_ea(c));
-        cc_mov(c, c->p->operand.val);
+        bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+        rc = execute(c, ex_tst);
     } else {
     unknown:
         dump(c, "???");
@@ -961,13 +1617,146 @@ bail:
     return rc;
 }
 
+struct profile_ent {
+    uint32_t pc;
+    uint64_t count, cycles;
+};
+
+struct m68k_profile {
+    /* Indexed by opcode bits 15:12. */
+    struct profile_ent class[16];
+    /* Open-addressed hash table of PCs, keyed by pc + 1 (0 = free). */
+    struct profile_ent *pc;
+    unsigned int nr_pc, max_pc;
+};
+
+static const char *const op_class_name[16] = {
+    "bitop/movep/imm", "move.b", "move.l", "move.w",
+    "misc", "addq/subq/scc/dbcc", "bcc/bsr/bra", "moveq",
+    "or/div/sbcd", "sub/subx", "line-a", "cmp/eor",
+    "and/mul/abcd/exg", "add/addx", "shift/rotate", "line-f"
+};
+
+static struct profile_ent *profile_pc_slot(
+    struct profile_ent *tab, unsigned int max, uint32_t pc)
+{
+    unsigned int i = (pc * 0x9e3779b1u) & (max - 1);
+    while (tab[i].pc && (tab[i].pc != pc + 1))
+        i = (i + 1) & (max - 1);
+    return &tab[i];
+}
+
+static void profile_insn(
+    struct m68k_profile *prof, uint32_t pc, uint16_t op, uint16_t cycles)
+{
+    struct profile_ent *e, *tab;
+    unsigned int i, max;
+
+    prof->class[op >> 12].count++;
+    prof->class[op >> 12].cycles += cycles;
+
+    /* Keep the PC table at most half full. If it cannot grow, PCs not yet
+     * seen are counted only by class. */
+    if (2 * (prof->nr_pc + 1) > prof->max_pc) {
+        max = prof->max_pc ? prof->max_pc * 2 : 4096;
+        if ((tab = calloc(max, sizeof(*tab))) != NULL) {
+            for (i = 0; i < prof->max_pc; i++)
+                if (prof->pc[i].pc)
+                    *profile_pc_slot(tab, max, prof->pc[i].pc - 1) =
+                        prof->pc[i];
+            free(prof->pc);
+            prof->pc = tab;
+            prof->max_pc = max;
+        }
+    }
+
+    if (prof->max_pc == 0)
+        return;
+    e = profile_pc_slot(prof->pc, prof->max_pc, pc);
+    if (!e->pc) {
+        if (prof->nr_pc + 1 >= prof->max_pc)
+            return;
+        e->pc = pc + 1;
+        prof->nr_pc++;
+    }
+    e->count++;
+    e->cycles += cycles;
+}
+
+struct m68k_profile *m68k_profile_alloc(void)
+{
+    return calloc(1, sizeof(struct m68k_profile));
+}
+
+void m68k_profile_free(struct m68k_profile *prof)
+{
+    if (prof == NULL)
+        return;
+    free(prof->pc);
+    free(prof);
+}
+
+static int profile_ent_cmp(const void *_a, const void *_b)
+{
+    const struct profile_ent *a = _a, *b = _b;
+    if (a->cycles != b->cycles)
+        return (a->cycles < b->cycles) ? 1 : -1;
+    return (a->pc > b->pc) - (a->pc < b->pc);
+}
+
+#define PROFILE_TOP_PCS 32
+
+void m68k_profile_report(
+    struct m68k_profile *prof, void (*print)(const char *, ...))
+{
+    struct profile_ent class[16], *pcs;
+    uint64_t count = 0, cycles = 0;
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < 16; i++) {
+        class[i] = prof->class[i];
+        class[i].pc = i;
+        count += class[i].count;
+        cycles += class[i].cycles;
+    }
+    qsort(class, 16, sizeof(*class), profile_ent_cmp);
+
+    print("Profile: %llu instructions, %llu cycles\n",
+          (unsigned long long)count, (unsigned long long)cycles);
+    print("  %-20s %12s %12s %6s\n", "Class", "Count", "Cycles", "%");
+    for (i = 0; (i < 16) && class[i].count; i++)
+        print("  %-20s %12llu %12llu %5.1f%%\n",
+              op_class_name[class[i].pc],
+              (unsigned long long)class[i].count,
+              (unsigned long long)class[i].cycles,
+              cycles ? class[i].cycles * 100.0 / cycles : 0.0);
+
+    if ((pcs = malloc((prof->nr_pc + 1) * sizeof(*pcs))) == NULL)
+        return;
+    for (i = 0; i < prof->max_pc; i++)
+        if (prof->pc[i].pc)
+            pcs[nr++] = prof->pc[i];
+    qsort(pcs, nr, sizeof(*pcs), profile_ent_cmp);
+
+    print("  %-20s %12s %12s %6s\n", "PC", "Count", "Cycles", "%");
+    for (i = 0; (i < nr) && (i < PROFILE_TOP_PCS); i++)
+        print("  %08x%12s %12llu %12llu %5.1f%%\n", pcs[i].pc - 1, "",
+              (unsigned long long)pcs[i].count,
+              (unsigned long long)pcs[i].cycles,
+              cycles ? pcs[i].cycles * 100.0 / cycles : 0.0);
+    free(pcs);
+}
+
 int m68k_emulate(struct m68k_emulate_ctxt *c)
 {
     struct m68k_emulate_priv_ctxt priv = {
         .sh_regs = *c->regs,
+        .sh_cc = c->cc,
         .dis_p = c->dis
     };
-    uint16_t op;
+    const struct icache_ent *e;
+    uint16_t op = 0;
+    uint32_t pc = c->regs->pc;
     int rc, trace = !!(c->regs->sr & SR_T);
 
     /* Initialise emulator state. */
@@ -976,7 +1765,23 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
     c->op_sz = OPSZ_X;
     c->op_words = 0;
     c->cycles = 0;
+
+    /* Run from the predecoded-instruction cache if we can. Otherwise decode,
+     * and cache the instruction if it is of a form which can be. */
+    if (c->icache && c->emulate && !c->disassemble && !(pc >> 24)) {
+        if ((e = icache_lookup(c, pc)) != NULL) {
+            icache_fetch(c, e);
+            op = e->op[0];
+            rc = e->exec(c, &e->insn);
+            goto bail;
+        }
+        priv.icache_miss = 1;
+        if (c->prefetch_addr == pc)
+            priv.icache_pf_words = c->prefetch_valid;
+    }
+
     bail_if(rc = fetch_insn_word(c, &op));
+    priv.insn.op = op;
 
     switch ((op >> 12) & 0xf) {
     case 0x0: { /* COMPLETE (but callm/cas/cas2/chk2/cmp2/moves/rtm) */
@@ -990,45 +1795,18 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "%si.%c\t", imm_alu_op[(op>>9)&7],
                  op_sz_ch[c->op_sz]);
             dump(c, "#%x,", imm);
+            c->p->insn.imm = imm;
             if ((op & 0x3fu) == 0x3cu) {
                 dump(c, "%s", (c->op_sz==OPSZ_B) ? "ccr" : "sr");
                 c->p->operand.type = OP_SR;
                 raise_exception_if(
-                    (c->op_sz != OPSZ_B) && !(sh_reg(c, sr) & SR_S),
+                    (c->op_sz != OPSZ_B) && !(sh_sr(c) & SR_S),
                     M68KVEC_priv_violation);
+                /* Not cached: privilege depends on SR. */
+                rc = ex_alu_imm(c, &c->p->insn);
             } else {
-                bail_if(rc = decode_ea(c));
-            }
-
-            bail_if(rc = read_ea(c));
-            switch ((op >> 9) & 7) {
-            case 0: /* or */
-                c->p->operand.val |= imm;
-                cc_mov(c, c->p->operand.val);
-                bail_if(rc = write_ea(c));
-                break;
-            case 1: /* and */
-                c->p->operand.val &= imm;
-                cc_mov(c, c->p->operand.val);
-                bail_if(rc = write_ea(c));
-                break;
-            case 2: /* sub */
-                bail_if(rc = op_sub(c, imm));
-                break;
-            case 3: /* add */
-                bail_if(rc = op_add(c, imm));
-                break;
-            case 5: /* eor */
-                c->p->operand.val ^= imm;
-                cc_mov(c, c->p->operand.val);
-                bail_if(rc = write_ea(c));
-                break;
-            case 6: /* cmp */
-                op_cmp(c, imm, c->p->operand.val);
-                break;
-            default:
-                rc = M68KEMUL_UNHANDLEABLE;
-                break;
+                bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+                rc = execute(c, ex_alu_imm);
             }
         } else if ((op & 0xf138u) == 0x0108u) {
             /* movep */
@@ -1076,9 +1854,9 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             bail_if(rc = decode_ea(c));
             bail_if(rc = read_ea(c));
             idx &= c->op_sz == OPSZ_B ? 7 : 31;
-            sh_reg(c, sr) &= ~CC_Z;
+            sh_sr(c) &= ~CC_Z;
             if (!(c->p->operand.val & (1u<<idx)))
-                sh_reg(c, sr) |= CC_Z;
+                sh_sr(c) |= CC_Z;
             switch ((op >> 6 ) & 3) {
             case 1: c->p->operand.val ^= 1u << idx; break;
             case 2: c->p->operand.val &= ~(1u << idx); break;
@@ -1095,42 +1873,24 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
         c->op_sz = OPSZ_L;
         goto move;
     case 0x3: { /* COMPLETE */
-        struct operand src, dst;
         c->op_sz = OPSZ_W;
     move:
         if (((op >> 6) & 7) == 1) {
             if (c->op_sz == OPSZ_B)
                 goto unknown;
             dump(c, "movea.%c\t", op_sz_ch[c->op_sz]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             dump(c, ",%s", areg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            if (c->op_sz == OPSZ_W) {
-                c->p->operand.val = (int16_t)c->p->operand.val;
-                c->op_sz = OPSZ_L;
-            }
-            sh_reg(c, a[(op>>9)&7]) = c->p->operand.val;
+            rc = execute(c, ex_movea);
         } else {
             dump(c, "move.%c\t", op_sz_ch[c->op_sz]);
-            bail_if(rc = decode_ea(c));
-            src = c->p->operand;
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             dump(c, ",");
-            /* Swizzle the opcode to shift dst ea to the right place */
-            c->op[0] = ((op >> 9) & 0x07) | ((op >> 3) & 0x38);
-            bail_if(rc = decode_ea(c));
-            dst = c->p->operand;
-            c->op[0] = op; /* restore */
-            c->p->operand = src;
-            bail_if(rc = read_ea(c));
-            dst.val = c->p->operand.val;
-            c->p->operand = dst;
-            bail_if(rc = write_ea(c));
-            cc_mov(c, dst.val);
+            /* The dst ea has its mode and register fields swapped */
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[1],
+                                  ((op >> 9) & 0x07) | ((op >> 3) & 0x38)));
+            rc = execute(c, ex_move);
         }
-        /* Most move instructions perform the second prefetch after writeback.
-         * We simulate this by discarding our second word of prefetch. */
-        if (c->prefetch_valid > 1)
-            c->prefetch_valid = 1;
         break;
     }
     case 0x4: { /* COMPLETE */
@@ -1149,28 +1909,16 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "%sq.%c\t#%x,",
                  op & (1u<<8) ? "sub" : "add",
                  op_sz_ch[c->op_sz], val);
-            bail_if(rc = decode_ea(c));
-            bail_if(rc = read_ea(c));
-            if (((op >> 3) & 7) == 1) {
-                /* adda/suba semantics */
-                uint32_t *reg = c->p->operand.reg;
-                c->op_sz = OPSZ_L;
-                *reg = op & (1u<<8) ? *reg - val : *reg + val;
-            } else {
-                bail_if(rc = ((op & (1u<<8)) ? op_sub : op_add)(c, val));
-            }
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+            rc = execute(c, ex_addq);
         } else if ((op & 0x0038u) == 0x0008u) {
             /* dbcc */
             uint32_t pc = sh_reg(c,pc);
             int32_t disp;
             bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_W));
             dump(c, "db%s.w\t%s,%04x", cc[cond], dreg[op&7], pc + disp);
-            if (!cc_eval_condition(c, cond)) {
-                uint32_t *reg = &sh_reg(c, d[op&7]);
-                *reg = (*reg & ~0xffffu) | (uint16_t)(*reg - 1);
-                if ((int16_t)*reg != -1)
-                    sh_reg(c, pc) = pc + disp;
-            }
+            c->p->insn.imm = pc + disp;
+            rc = execute(c, ex_dbcc);
         } else if ((op & 0x003fu) >= 0x003au) {
             /* trapcc */
             uint32_t imm;
@@ -1206,19 +1954,12 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
         else if (disp == -1)
             bail_if(rc = fetch_insn_sbytes(c, &disp, OPSZ_L));
         dump(c, "\t%04x", target + disp);
-        if (cond == 1) {
-            /* bsr: push return address (current pc) onto stack */
-            sh_reg(c, a[7]) -= 4;
-            bail_if(rc = write(sh_reg(c, a[7]), sh_reg(c, pc), 4, c));
-        } else if (!cc_eval_condition(c, cond))
-            break; /* bcc condition is false: no branch */
-        sh_reg(c, pc) = target + disp;
+        c->p->insn.imm = target + disp;
+        rc = execute(c, ex_bcc);
         break;
     }
     case 0x7: { /* COMPLETE */
-        uint32_t *reg = &sh_reg(c, d[(op>>9)&7]);
         int8_t val = (int8_t)op;
-        *reg = val;
         c->op_sz = OPSZ_L;
         dump(c, "moveq\t#");
         if (val < 0) {
@@ -1226,7 +1967,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             val = -val;
         }
         dump(c, "%x,%s", val, dreg[(op>>9)&7]);
-        cc_mov(c, *reg);
+        rc = execute(c, ex_moveq);
         break;
     }
     case 0x8: /* COMPLETE */
@@ -1244,21 +1985,15 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             /* cmpa */
             c->op_sz = op & (1u<<8) ? OPSZ_L : OPSZ_W;
             dump(c, "cmpa.%c\t", op_sz_ch[c->op_sz]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             dump(c, ",%s", areg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            if (c->op_sz == OPSZ_W) {
-                c->p->operand.val = (int16_t)c->p->operand.val;
-                c->op_sz = OPSZ_L;
-            }
-            op_cmp(c, c->p->operand.val, sh_reg(c, a[(op>>9)&7]));
+            rc = execute(c, ex_cmpa);
         } else if ((op & 0xf100u) == 0xb000u) {
             /* cmp */
             dump(c, "cmp.%c\t", op_sz_ch[c->op_sz]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             dump(c, ",%s", dreg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            op_cmp(c, c->p->operand.val, sh_reg(c, d[(op>>9)&7]));
+            rc = execute(c, ex_cmp);
         } else if ((op & 0xf138u) == 0xb108u) {
             /* cmpm */
             dump(c, "cmpm.%c\t(%s)+,(%s)+", op_sz_ch[c->op_sz],
@@ -1268,11 +2003,8 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             /* eor */
             dump(c, "eor.%c\t%s,", op_sz_ch[c->op_sz],
                            dreg[(op>>9)&7]);
-            bail_if(rc = decode_ea(c));
-            bail_if(rc = read_ea(c));
-            c->p->operand.val ^= sh_reg(c, d[(op>>9)&7]);
-            cc_mov(c, c->p->operand.val);
-            bail_if(rc = write_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
+            rc = execute(c, ex_eor);
         }
         break;
     }
@@ -1300,7 +2032,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 c->p->operand.val = *c->p->operand.reg;
             }
             op2 = c->p->operand.val;
-            x = !!(sh_reg(c, sr) & CC_X);
+            x = !!(sh_sr(c) & CC_X);
             if (op & (1u<<14)) {
                 /* abcd */
                 digit[0] = (op2&15) + (op1&15) + x;
@@ -1320,11 +2052,11 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             }
             c->p->operand.val = (uint8_t)(digit[1]<<4 | digit[0]);
             bail_if(rc = write_ea(c));
-            sh_reg(c, sr) &= ~(CC_X|CC_C);
+            sh_sr(c) &= ~(CC_X|CC_C);
             if (x)
-                sh_reg(c, sr) |= CC_X|CC_C;
+                sh_sr(c) |= CC_X|CC_C;
             if (c->p->operand.val)
-                sh_reg(c, sr) &= ~CC_Z;
+                sh_sr(c) &= ~CC_Z;
         } else if ((op & 0xf0c0u) == 0x80c0u) {
             /* divs.w/divu.w */
             uint32_t q, r, *reg = &sh_reg(c, d[(op>>9)&7]);
@@ -1332,7 +2064,7 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             dump(c, "div%c.w\t", op & (1u<<8) ? 's' : 'u');
             bail_if(rc = decode_ea(c));
             dump(c, ",%s", dreg[(op>>9)&7]);
-            sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
+            sh_sr(c) &= ~(CC_N|CC_Z|CC_V|CC_C);
             bail_if(rc = read_ea(c));
             raise_exception_if((uint16_t)c->p->operand.val == 0,
                                M68KVEC_zero_divide);
@@ -1340,36 +2072,26 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 q = (int32_t)*reg / (int16_t)c->p->operand.val;
                 r = (int32_t)*reg % (int16_t)c->p->operand.val;
                 if (((int32_t)q > 0x7fff) || ((int32_t)q < -0x8000))
-                    sh_reg(c, sr) |= CC_V;
+                    sh_sr(c) |= CC_V;
             } else {
                 q = (uint32_t)*reg / (uint16_t)c->p->operand.val;
                 r = (uint32_t)*reg % (uint16_t)c->p->operand.val;
                 if (q > 0xffff)
-                    sh_reg(c, sr) |= CC_V;
+                    sh_sr(c) |= CC_V;
             }
-            if (!(sh_reg(c, sr) & CC_V))
+            if (!(sh_sr(c) & CC_V))
                 *reg = (r << 16) | (uint16_t)q;
             if ((uint16_t)q == 0)
-                sh_reg(c, sr) |= CC_Z;
+                sh_sr(c) |= CC_Z;
             if ((int16_t)q < 0)
-                sh_reg(c, sr) |= CC_N;
+                sh_sr(c) |= CC_N;
         } else if ((op & 0xf0c0u) == 0xc0c0u) {
             /* muls.w/mulu.w */
-            uint32_t *reg = &sh_reg(c, d[(op>>9)&7]);
             c->op_sz = OPSZ_W;
             dump(c, "mul%c.w\t", op & (1u<<8) ? 's' : 'u');
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             dump(c, ",%s", dreg[(op>>9)&7]);
-            sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
-            bail_if(rc = read_ea(c));
-            if (op & (1u<<8))
-                *reg = (int16_t)*reg * (int16_t)c->p->operand.val;
-            else
-                *reg = (uint16_t)*reg * (uint16_t)c->p->operand.val;
-            if ((uint32_t)*reg == 0)
-                sh_reg(c, sr) |= CC_Z;
-            if ((int32_t)*reg < 0)
-                sh_reg(c, sr) |= CC_N;
+            rc = execute(c, ex_mul);
         } else if ((op & 0xf130u) == 0xc100u) {
             /* exg */
             uint32_t *r1, *r2, t;
@@ -1385,26 +2107,16 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
             *r2 = t;
         } else {
             /* and/or */
-            uint32_t r, *reg = &sh_reg(c, d[(op>>9)&7]);
             c->op_sz = (op>>6) & 3;
             dump(c, "%s.%c\t",
                  op & (1u<<14) ? "and" : "or",
                  op_sz_ch[c->op_sz]);
             if (op & (1u<<8))
                 dump(c, "%s,", dreg[(op>>9)&7]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             if (!(op & (1u<<8)))
                 dump(c, ",%s", dreg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            r = op & (1u<<14) ?
-                c->p->operand.val & *reg : c->p->operand.val | *reg;
-            cc_mov(c, r);
-            if (!(op & (1u<<8))) {
-                c->p->operand.type = OP_REG;
-                c->p->operand.reg = reg;
-            }
-            c->p->operand.val = r;
-            bail_if(rc = write_ea(c));
+            rc = execute(c, ex_andor);
         }
         break;
     }
@@ -1414,18 +2126,11 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
         c->op_sz = (op>>6)&3;
         if ((op & 0xc0u) == 0xc0u) {
             /* adda/suba */
-            uint32_t r, *reg = &sh_reg(c, a[(op>>9)&7]);
             c->op_sz = op & (1u<<8) ? OPSZ_L : OPSZ_W;
             dump(c, "a.%c\t", op_sz_ch[c->op_sz]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             dump(c, ",%s", areg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            r = c->p->operand.val;
-            if (c->op_sz == OPSZ_W) {
-                r = (int16_t)r;
-                c->op_sz = OPSZ_L;
-            }
-            *reg = op & (1u<<14) ? *reg + r : *reg - r;
+            rc = execute(c, ex_adda);
         } else if ((op & 0x130u) == 0x100u) {
             /* addx/subx */
             uint32_t op1;
@@ -1450,135 +2155,53 @@ int m68k_emulate(struct m68k_emulate_ctxt *c)
                 c->p->operand.reg = &sh_reg(c, d[(op>>9)&7]);
                 c->p->operand.val = *c->p->operand.reg;
             }
-            sr = sh_reg(c, sr);
+            sr = sh_sr(c);
             bail_if(rc = ((op & (1u<<14)) ? op_add : op_sub)(c, op1));
             if (sr & CC_X) {
-                uint16_t sr2 = sh_reg(c, sr);
+                uint16_t sr2 = sh_sr(c);
                 bail_if(rc = ((op & (1u<<14)) ? op_add : op_sub)(c, 1));
                 /* overflow and carry accumulate */
-                sh_reg(c, sr) |= sr2 & (CC_X|CC_V|CC_C);
+                sh_sr(c) |= sr2 & (CC_X|CC_V|CC_C);
             }
             /* CC.Z is never set by this instruction, only cleared */
-            if ((sh_reg(c, sr) & CC_Z) && !(sr & CC_Z))
-                sh_reg(c, sr) &= ~CC_Z;
+            if ((sh_sr(c) & CC_Z) && !(sr & CC_Z))
+                sh_sr(c) &= ~CC_Z;
         } else {
             /* add/sub */
-            uint32_t op1, *reg = &sh_reg(c, d[(op>>9)&7]);
-            op1 = *reg;
             dump(c, ".%c\t", op_sz_ch[c->op_sz]);
             if (op & (1u<<8))
                 dump(c, "%s,", dreg[(op>>9)&7]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
             if (!(op & (1u<<8)))
                 dump(c, ",%s", dreg[(op>>9)&7]);
-            bail_if(rc = read_ea(c));
-            if (!(op & (1u<<8))) {
-                op1 = c->p->operand.val;
-                c->p->operand.type = OP_REG;
-                c->p->operand.reg = reg;
-                c->p->operand.val = *reg;
-            }
-            bail_if(rc = ((op & (1u<<14)) ? op_add : op_sub)(c, op1));
+            rc = execute(c, ex_addsub);
         }
         break;
     }
     case 0xe: { /* COMPLETE */
         static const char *sr[] = {
             "as", "ls", "rox", "ro" };
-        uint32_t m, v;
-        uint8_t x, typ, cnt;
         if ((op & 0xf8c0u) == 0xe8c0u) {
             /* bitfield access */
             goto unknown;
         } else if ((op & 0xc0u) == 0xc0u) {
             /* shift/rotate <ea> */
             c->op_sz = OPSZ_W;
-            typ = (op >> 9) & 3;
-            cnt = 1;
-            dump(c, "%s%c.%c\t", sr[typ],
+            dump(c, "%s%c.%c\t", sr[(op >> 9) & 3],
                  op&(1u<<8) ? 'l' : 'r', op_sz_ch[c->op_sz]);
-            bail_if(rc = decode_ea(c));
+            bail_if(rc = fetch_ea(c, &c->p->insn.ea[0], op));
         } else {
             /* shift/rotate <dn> */
             c->op_sz = (op >> 6) & 3;
-            typ = (op >> 3) & 3;
-            dump(c, "%s%c.%c\t", sr[typ],
+            dump(c, "%s%c.%c\t", sr[(op >> 3) & 3],
                  op&(1u<<8) ? 'l' : 'r', op_sz_ch[c->op_sz]);
-            if (op & (1u<<5)) {
-                cnt = sh_reg(c, d[(op>>9)&7]) & 63;
+            if (op & (1u<<5))
                 dump(c, "%s", dreg[(op>>9)&7]);
-            } else {
-                cnt = (op >> 9) & 7 ?: 8;
-                dump(c, "#%x", cnt);
-            }
+            else
+                dump(c, "#%x", (op >> 9) & 7 ?: 8);
             dump(c, ",%s", dreg[op&7]);
-            c->p->operand.type = OP_REG;
-            c->p->operand.reg = &sh_reg(c, d[op&7]);
-        }
-        bail_if(rc = read_ea(c));
-        v = c->p->operand.val;
-        m = 1u << (c->op_sz == OPSZ_L ? 31 : c->op_sz == OPSZ_W ? 15 : 7);
-        sh_reg(c, sr) &= ~(CC_N|CC_Z|CC_V|CC_C);
-        while (cnt--) {
-            switch ((typ << 1) | ((op >> 8) & 1)) {
-            case 0: /* asr */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & 1)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                v = (v >> 1) | (v & m);
-                break;
-            case 1: /* asl */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & m)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                if ((v ^ (v << 1)) & m)
-                    sh_reg(c, sr) |= CC_V;
-                v = (v << 1);
-                break;
-            case 2: /* lsr */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & 1)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                v = (v >> 1);
-                break;
-            case 3: /* lsl */
-                sh_reg(c, sr) &= ~(CC_X|CC_C);
-                if (v & m)
-                    sh_reg(c, sr) |= CC_X|CC_C;
-                v = (v << 1);
-                break;
-            case 4: /* roxr */
-                x = !!(v & 1);
-                v = (v >> 1) | (sh_reg(c, sr) & CC_X ? m : 0);
-                sh_reg(c, sr) &= ~CC_X;
-                sh_reg(c, sr) |= x ? CC_X : 0;
-                break;
-            case 5: /* roxl */
-                x = !!(v & m);
-                v = (v << 1) | (sh_reg(c, sr) & CC_X ? 1 : 0);
-                sh_reg(c, sr) &= ~CC_X;
-                sh_reg(c, sr) |= x ? CC_X : 0;
-                break;
-            case 6: /* ror */
-                sh_reg(c, sr) &= ~CC_C;
-                if (v & 1)
-                    sh_reg(c, sr) |= CC_C;
-                v = (v >> 1) | (sh_reg(c, sr) & CC_C ? m : 0);
-                break;
-            case 7: /* rol */
-                sh_reg(c, sr) &= ~CC_C;
-                if (v & m)
-                    sh_reg(c, sr) |= CC_C;
-                v = (v << 1) | (sh_reg(c, sr) & CC_C ? 1 : 0);
-                break;
-            }
         }
-        if (typ == 2) /* roxl/roxr */
-            sh_reg(c, sr) |= sh_reg(c, sr) & CC_X ? CC_C : 0;
-        v &= (m << 1) - 1;
-        sh_reg(c, sr) |= (v == 0 ? CC_Z : 0) | (v & m ? CC_N : 0);
-        c->p->operand.val = v;
-        rc = write_ea(c);
+        rc = execute(c, ex_shift);
         break;
     }
     case 0xf: /* COMPLETE */
@@ -1606,6 +2229,7 @@ bail:
         (c->p->exception.vector >= M68KVEC_trap_0)) {
         /* No instruction-aborting exception? Write back register state. */
         *c->regs = c->p->sh_regs;
+        c->cc = c->p->sh_cc;
     } else {
         /* Instruction was aborted. Discard register state; no trace. */
         trace = 0;
@@ -1628,11 +2252,56 @@ bail:
     }
 
 out:
-    if (rc != M68KEMUL_UNHANDLEABLE)
+    if (rc != M68KEMUL_UNHANDLEABLE) {
         rc = M68KEMUL_OKAY;
+        if (c->profile && c->emulate)
+            profile_insn(c->profile, pc, op, c->cycles);
+    }
     return rc;
 }
 
+struct m68k_icache *m68k_icache_alloc(void)
+{
+    return calloc(1, sizeof(struct m68k_icache));
+}
+
+void m68k_icache_free(struct m68k_icache *ic)
+{
+    free(ic);
+}
+
+void m68k_icache_invalidate(
+    struct m68k_icache *ic, uint32_t addr, unsigned int bytes)
+{
+    struct icache_ent *e;
+    uint32_t pc, end = addr + bytes, blk;
+
+    /* Nothing to do unless an entry may overlap the write. */
+    if ((bytes == 0) || (addr >> 24))
+        return;
+    for (blk = addr >> ICACHE_BLOCK_SHIFT;
+         !(ic->map[blk/32] & (1u << (blk&31)));
+         blk++)
+        if ((blk + 1 >= ICACHE_NR_BLOCKS)
+            || (blk >= (end - 1) >> ICACHE_BLOCK_SHIFT))
+            return;
+
+    /* Any instruction overlapping the write starts at most
+     * ICACHE_MAX_WORDS-1 words before it. */
+    pc = addr & ~1u;
+    pc = (pc >= 2*(ICACHE_MAX_WORDS-1)) ? pc - 2*(ICACHE_MAX_WORDS-1) : 0;
+    for (; pc < end; pc += 2) {
+        e = icache_slot(ic, pc);
+        if ((e->pc == pc) && (pc + 2*e->op_words > addr))
+            e->exec = NULL;
+    }
+}
+
+void m68k_icache_flush(struct m68k_icache *ic)
+{
+    memset(ic, 0, sizeof(*ic));
+}
+
 void m68k_dump_regs(struct m68k_regs *r, void (*print)(const char *, ...))
 {
     print("D0: %08x D1: %08x D2: %08x D3: %08x\n",
@@ -1678,14 +2347,23 @@ void m68k_dump_stack(
     }
 }
 
+void m68k_sync_flags(struct m68k_emulate_ctxt *c)
+{
+    c->regs->sr = cc_eval(&c->cc, c->regs->sr);
+    c->cc.op = CCOP_none;
+}
+
 int m68k_deliver_exception(
     struct m68k_emulate_ctxt *c, struct m68k_exception *e)
 {
-    uint16_t old_sr = c->regs->sr;
+    uint16_t old_sr;
     uint32_t old_pc = c->regs->pc;
     int rc;
 
+    m68k_sync_flags(c);
+    old_sr = c->regs->sr;
     c->p->sh_regs = *c->regs;
+    c->p->sh_cc = c->cc;
 
     update_sr(c, (old_sr | SR_S) & ~SR_T);
     bail_if(rc = read(4*e->vector, &sh_reg(c, pc), 4, c));
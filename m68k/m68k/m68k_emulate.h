@@ -11,6 +11,8 @@
 
 struct m68k_emulate_ctxt;
 struct m68k_exception;
+struct m68k_profile;
+struct m68k_icache;
 
 /* Return codes from state-accessor functions and from m68k_emulate(). */
  /* Completed successfully. State modified appropriately. */
@@ -70,6 +72,13 @@ struct m68k_regs {
     uint16_t sr;
 };
 
+/* Condition codes of the last flag-setting operation, not yet folded into
+ * sr[4:0]. */
+struct m68k_lazy_cc {
+    uint8_t op;
+    uint32_t msb, src, dst, res;
+};
+
 /* m68k_emulate_ctxt.op_sz */
 #define OPSZ_B 0 /* byte/1 */
 #define OPSZ_W 1 /* word/2 */
@@ -106,6 +115,15 @@ struct m68k_emulate_ctxt
     uint32_t prefetch_addr, prefetch_valid;
     uint16_t prefetch_dat[2];
 
+    /* PRIVATE: Deferred condition codes. See m68k_sync_flags(). */
+    struct m68k_lazy_cc cc;
+
+    /* IN: Execution profile to accumulate into, or NULL. */
+    struct m68k_profile *profile;
+
+    /* IN: Predecoded-instruction cache to execute from, or NULL. */
+    struct m68k_icache *icache;
+
     /* PRIVATE */
     struct m68k_emulate_priv_ctxt *p;
 };
@@ -114,6 +132,10 @@ struct m68k_emulate_ctxt
  * Returns M68KEMUL_OKAY or M68KEMUL_UNHANDLEABLE. */
 int m68k_emulate(struct m68k_emulate_ctxt *);
 
+/* m68k_sync_flags: Fold deferred condition codes into regs->sr. Required
+ * before regs->sr[4:0] is inspected or compared outside the emulator. */
+void m68k_sync_flags(struct m68k_emulate_ctxt *);
+
 /* m68k_dump_regs: Print register dump to stdout. */
 void m68k_dump_regs(struct m68k_regs *, void (*print)(const char *, ...));
 
@@ -124,6 +146,30 @@ void m68k_dump_stack(
     struct m68k_emulate_ctxt *, enum stack,
     void (*print)(const char *, ...));
 
+/* m68k_profile_alloc: Allocate an empty profile, or NULL if out of memory.
+ * Attach to ctxt.profile to count executions and cycles of every emulated
+ * instruction, by opcode class and by PC. */
+struct m68k_profile *m68k_profile_alloc(void);
+void m68k_profile_free(struct m68k_profile *);
+
+/* m68k_profile_report: Print the profile, busiest first. */
+void m68k_profile_report(
+    struct m68k_profile *, void (*print)(const char *, ...));
+
+/* m68k_icache_alloc: Allocate an empty predecoded-instruction cache, or NULL
+ * if out of memory. Attach to ctxt.icache and instructions are decoded once
+ * per PC, then run from the cache whenever ctxt.emulate is set and
+ * ctxt.disassemble is not. Only code below 16MB (the 68000's 24-bit address
+ * space) is cached. The caller must report each write to memory which may
+ * hold code, including those made through ops->write, via
+ * m68k_icache_invalidate(); and any other change to memory contents via
+ * m68k_icache_flush(). */
+struct m68k_icache *m68k_icache_alloc(void);
+void m68k_icache_free(struct m68k_icache *);
+void m68k_icache_invalidate(
+    struct m68k_icache *, uint32_t addr, unsigned int bytes);
+void m68k_icache_flush(struct m68k_icache *);
+
 struct m68k_exception {
     uint8_t vector;
     /* M68KVEC_{addr,bus}_error only: */
@@ -7,6 +7,7 @@
  */
 
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -19,7 +20,10 @@
 
 #include "scp.h"
 
+/* libdisk builds this file into its live SCP stream, and has its own. */
+#ifndef SCP_IN_LIBDISK
 #include "../libdisk/util.c"
+#endif
 
 const struct scp_params default_scp_params = {
     .select_delay_ms = 1,
@@ -35,6 +39,7 @@ struct scp_handle {
     char *sername;
     struct termios oldtio, newtio;
     struct scp_params scp_params;
+    uint32_t sendram_csum; /* byte sum of the last SENDRAM_USB payload */
 };
 
 static const char *scp_err[] = {
@@ -155,6 +160,32 @@ void scp_close(struct scp_handle *scp)
     memfree(scp);
 }
 
+/* Receive @len bytes straight into @dat, summing each chunk as it lands while
+ * it is still in cache, rather than in a separate pass over the whole. */
+static uint32_t read_and_sum(int fd, uint8_t *dat, uint32_t len)
+{
+    uint32_t csum = 0;
+    ssize_t nr;
+
+    while (len > 0) {
+        nr = read(fd, dat, len);
+        if (nr < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            err(1, NULL);
+        }
+        if (nr == 0) {
+            memset(dat, 0, len);
+            break;
+        }
+        len -= nr;
+        while (nr--)
+            csum += *dat++;
+    }
+
+    return csum;
+}
+
 void scp_send(
     struct scp_handle *scp,
     uint8_t cmd,
@@ -174,7 +205,9 @@ void scp_send(
     write_exact(scp->fd, buf, len + 3);
 
     if (cmd == SCPCMD_SENDRAM_USB) {
-        read_exact(scp->fd, dat, 512*1024);
+        uint32_t *ramcmd = dat;
+        uint32_t len = be32toh(ramcmd[1]);
+        scp->sendram_csum = read_and_sum(scp->fd, dat, len);
     } else if (cmd == SCPCMD_LOADRAM_USB) {
         uint32_t *ramcmd = dat;
         uint32_t len = be32toh(ramcmd[1]);
@@ -224,10 +257,14 @@ void scp_deselectdrive(struct scp_handle *scp, unsigned int drv)
     scp_send(scp, SCPCMD_DSELA + drv, NULL, 0);
 }
 
-void scp_seek_track(struct scp_handle *scp, unsigned int track,
+void scp_switchdrive(struct scp_handle *scp, unsigned int drv)
+{
+    scp_send(scp, SCPCMD_SELA + drv, NULL, 0);
+}
+
+void scp_step_track(struct scp_handle *scp, unsigned int track,
                     int double_step)
 {
-    struct scp_params *p = &scp->scp_params;
     uint8_t cyl = track >> 1, side = track & 1;
     if (double_step)
         cyl *= 2;
@@ -236,13 +273,25 @@ void scp_seek_track(struct scp_handle *scp, unsigned int track,
     else
         scp_send(scp, SCPCMD_STEPTO, &cyl, 1);
     scp_send(scp, SCPCMD_SIDE, &side, 1);
-    
+}
+
+void scp_settle(struct scp_handle *scp)
+{
+    struct scp_params *p = &scp->scp_params;
+
     if (p->seek_settle_delay_ms > p->step_delay_ms) {
         uint32_t extra_ms = p->seek_settle_delay_ms - p->step_delay_ms;
         usleep(extra_ms * 1000);
     }
 }
 
+void scp_seek_track(struct scp_handle *scp, unsigned int track,
+                    int double_step)
+{
+    scp_step_track(scp, track, double_step);
+    scp_settle(scp);
+}
+
 void scp_read_flux(struct scp_handle *scp, unsigned int nr_revs,
                    struct scp_flux *flux)
 {
@@ -259,9 +308,19 @@ void scp_read_flux(struct scp_handle *scp, unsigned int nr_revs,
         flux->info[i].nr_bitcells = be32toh(flux->info[i].nr_bitcells);
     }
 
+    /* Fetch only the revolutions asked for, not the whole of the RAM. */
+    flux->nr_bytes = 0;
+    for (i = 0; i < nr_revs; i++)
+        flux->nr_bytes += flux->info[i].nr_bitcells * sizeof(uint16_t);
+    flux->nr_bytes = min_t(uint32_t, flux->nr_bytes, sizeof(flux->flux));
+    flux->csum = 0;
+    if (flux->nr_bytes == 0)
+        return;
+
     *(uint32_t *)&flux->flux[0] = htobe32(0);
-    *(uint32_t *)&flux->flux[2] = htobe32(512*1024);
+    *(uint32_t *)&flux->flux[2] = htobe32(flux->nr_bytes);
     scp_send(scp, SCPCMD_SENDRAM_USB, flux->flux, 8);
+    flux->csum = scp->sendram_csum;
 }
 
 void scp_write_flux(struct scp_handle *scp, void *dat, unsigned int nr_dat)
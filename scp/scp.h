@@ -18,6 +18,8 @@ struct scp_flux {
     struct {
         uint32_t index_time, nr_bitcells;
     } info[5];
+    /* Bytes of flux[] received from the device, and their byte sum. */
+    uint32_t nr_bytes, csum;
     uint16_t flux[512*1024/2];
 };
 
@@ -83,8 +85,15 @@ void scp_getinfo(struct scp_handle *scp, void *info);
 void scp_ramtest(struct scp_handle *scp);
 void scp_selectdrive(struct scp_handle *scp, unsigned int drv);
 void scp_deselectdrive(struct scp_handle *scp, unsigned int drv);
+/* Select @drv, whose motor is already on (see scp_selectdrive()). */
+void scp_switchdrive(struct scp_handle *scp, unsigned int drv);
 void scp_seek_track(struct scp_handle *scp, unsigned int track,
                     int double_step);
+/* scp_seek_track() is scp_step_track() followed by scp_settle(). Several
+ * drives may be stepped and then settled together. */
+void scp_step_track(struct scp_handle *scp, unsigned int track,
+                    int double_step);
+void scp_settle(struct scp_handle *scp);
 void scp_read_flux(struct scp_handle *scp, unsigned int nr_revs,
                    struct scp_flux *flux);
 void scp_write_flux(struct scp_handle *scp, void *dat, unsigned int nr_dat);
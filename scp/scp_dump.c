@@ -17,8 +17,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <libdisk/util.h>
+#include <libdisk/disk.h>
+#include <libdisk/stream.h>
 #include <time.h>
 #include "scp.h"
 
@@ -39,18 +42,43 @@ static struct scp_params scp_params;
 
 #define log(_f, _a...) do { if (!quiet) printf(_f, ##_a); } while (0)
 
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Flux samples in the first @nr_revs revolutions of @flux. */
+static uint64_t flux_samples(const struct scp_flux *flux, int nr_revs)
+{
+    uint64_t n = 0;
+    int rev;
+
+    for (rev = 0; rev < nr_revs; rev++)
+        n += flux->info[rev].nr_bitcells;
+    return n;
+}
+
 static void usage(int rc)
 {
-    printf("Usage: scp_dump [options] out_file\n");
+    printf("Usage: scp_dump [options] out_file [out_file_B]\n");
     printf("Options:\n");
     printf("  -h, --help        Display this information\n");
     printf("  -q, --quiet       Quiesce normal informational output\n");
     printf("  -d, --device      Name of serial device (%s)\n",
            DEFAULT_SERDEVICE);
-    printf("  -u, --unit={A,B}  Which drive to dump (%c)\n",
+    printf("  -u, --unit={A,B,AB}  Which drive to dump (%c). AB dumps both\n"
+           "                    at once, to out_file and out_file_B\n",
            DEFAULT_UNIT ? 'B' : 'A');
     printf("  -r, --revs        Nr revolutions per track (%d)\n",
            DEFAULT_REVS);
+    printf("  -a, --adaptive=FORMAT  Read one revolution, and all -r\n"
+           "                    (default %u) only if FORMAT fails to decode\n",
+           (unsigned int)ARRAY_SIZE(((struct scp_flux *)0)->info));
+    printf("  -x, --retry=N     Re-read tracks which fail the --adaptive check\n"
+           "                    for N more revolutions, in a second sweep,\n"
+           "                    and keep the new read in the image\n");
     printf("  -R, --ramtest     Test SCP on-board SRAM before dumping\n");
     printf("  -s, --start       First track to dump (%d)\n",
            DEFAULT_STARTTRK);
@@ -62,6 +90,8 @@ static void usage(int rc)
            default_scp_params.step_delay_ms);
     printf("  -K, --settle-delay  Settle time after seek, millisecs (%u)\n",
            default_scp_params.seek_settle_delay_ms);
+    printf("  -P, --progress=FILE  Append progress events to FILE as NDJSON\n"
+           "                    ('-' is stderr; a Unix socket is connected to)\n");
 
     exit(rc);
 }
@@ -87,36 +117,232 @@ static void checksum_and_write(
     *p_csum = csum;
 }
 
+/* Image file output, run in a writer thread so that the device can seek to
+ * and read the next track meanwhile. */
+struct writer {
+    pthread_t thread;
+    bool_t busy;
+    int fd, trk, nr_revs, flux_revs;
+    uint32_t *th_offs, file_off, csum;
+    struct scp_flux *flux;
+};
+
+static void *write_track(void *arg)
+{
+    struct writer *w = arg;
+    struct track_header thdr;
+    unsigned int sizeof_thdr = 4 + 12*w->nr_revs;
+    uint32_t dat_off, rev_off[ARRAY_SIZE(thdr.rev)];
+    int rev;
+
+    w->th_offs[w->trk] = htole32(w->file_off);
+
+    memset(&thdr, 0, sizeof_thdr);
+    memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
+    thdr.tracknr = w->trk;
+
+    dat_off = sizeof_thdr;
+    for (rev = 0; rev < w->flux_revs; rev++) {
+        rev_off[rev] = dat_off;
+        dat_off += w->flux->info[rev].nr_bitcells * sizeof(uint16_t);
+    }
+
+    /* Revolutions not read (see --adaptive) repeat those that were. */
+    for (rev = 0; rev < w->nr_revs; rev++) {
+        int r = rev % w->flux_revs;
+        thdr.rev[rev].duration = htole32(w->flux->info[r].index_time);
+        thdr.rev[rev].nr_samples = htole32(w->flux->info[r].nr_bitcells);
+        thdr.rev[rev].offset = htole32(rev_off[r]);
+    }
+    checksum_and_write(w->fd, &w->csum, &thdr, sizeof_thdr);
+    if (w->flux->nr_bytes == dat_off - sizeof_thdr) {
+        /* Summed as it was received: write straight from the buffer. */
+        write_exact(w->fd, w->flux->flux, w->flux->nr_bytes);
+        w->csum += w->flux->csum;
+    } else {
+        checksum_and_write(w->fd, &w->csum, w->flux->flux,
+                           dat_off - sizeof_thdr);
+    }
+    w->file_off += dat_off;
+
+    return NULL;
+}
+
+static void writer_wait(struct writer *w)
+{
+    if (w->busy)
+        pthread_join(w->thread, NULL);
+    w->busy = 0;
+}
+
+static void writer_start(struct writer *w, int trk, struct scp_flux *flux,
+                         int flux_revs)
+{
+    int rc;
+
+    writer_wait(w);
+    w->trk = trk;
+    w->flux = flux;
+    w->flux_revs = flux_revs;
+    if ((rc = pthread_create(&w->thread, NULL, write_track, w)) != 0)
+        errx(1, "Failed to create writer thread: %s", strerror(rc));
+    w->busy = 1;
+}
+
+/* Does the flux decode cleanly as @type, every sector valid? */
+static bool_t track_is_clean(
+    struct disk *d, unsigned int trk, enum track_type type,
+    const struct scp_flux *flux, unsigned int nr_revs)
+{
+    struct track_info *ti = &disk_get_info(d)->track[trk];
+    uint32_t nr_samples[ARRAY_SIZE(flux->info)];
+    struct stream *s;
+    unsigned int i;
+    bool_t clean;
+
+    for (i = 0; i < nr_revs; i++)
+        nr_samples[i] = flux->info[i].nr_bitcells;
+    s = stream_scp_open(flux->flux, nr_samples, nr_revs, 0, 0);
+    clean = (track_write_raw_from_stream(d, trk, type, s) == 0);
+    for (i = 0; clean && (i < ti->nr_sectors); i++)
+        clean = is_valid_sector(ti, i);
+    stream_close(s);
+
+    return clean;
+}
+
+/* An output image: one per drive being dumped. */
+struct image {
+    unsigned int unit;
+    int fd;
+    struct disk_header dhdr;
+    uint32_t *th_offs;
+    struct scp_flux *flux[2];
+    unsigned int next_flux;  /* flux[] to read into next */
+    struct writer w;
+    /* Tracks to re-read (see --retry). */
+    bool_t retry[SCP_MAX_TRACKS];
+};
+
+static void image_create(struct image *im, const char *name,
+                         unsigned int unit, int nr_revs,
+                         int start_trk, int end_trk)
+{
+    im->unit = unit;
+    if ((im->fd = file_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "Error creating %s", name);
+
+    memset(&im->dhdr, 0, sizeof(im->dhdr));
+    memcpy(im->dhdr.sig, "SCP", sizeof(im->dhdr.sig));
+    im->dhdr.disk_type = DISKTYPE_amiga;
+    im->dhdr.nr_revolutions = nr_revs;
+    im->dhdr.start_track = start_trk;
+    im->dhdr.end_track = end_trk;
+    im->dhdr.flags = (1u<<_FLAG_footer);
+    write_exact(im->fd, &im->dhdr, sizeof(im->dhdr));
+
+    im->th_offs = memalloc(SCP_MAX_TRACKS * sizeof(uint32_t));
+    write_exact(im->fd, im->th_offs, SCP_MAX_TRACKS * sizeof(uint32_t));
+
+    /* Double buffered: one track is written out while the next is read. */
+    memset(&im->w, 0, sizeof(im->w));
+    im->w.fd = im->fd;
+    im->w.nr_revs = nr_revs;
+    im->w.th_offs = im->th_offs;
+    im->w.file_off = sizeof(im->dhdr) + SCP_MAX_TRACKS * sizeof(uint32_t);
+    im->flux[0] = memalloc(sizeof(*im->flux[0]));
+    im->flux[1] = memalloc(sizeof(*im->flux[1]));
+    im->next_flux = 0;
+    memset(im->retry, 0, sizeof(im->retry));
+}
+
+/* Step every drive to @trk, or with @retry_only only those with it to
+ * re-read, and let them settle together. */
+static void seek_units(struct scp_handle *scp, struct image *im,
+                       unsigned int nr_units, int trk, bool_t retry_only)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_units; i++) {
+        if (retry_only && !im[i].retry[trk])
+            continue;
+        if (nr_units > 1)
+            scp_switchdrive(scp, im[i].unit);
+        scp_step_track(scp, trk, double_step);
+    }
+    scp_settle(scp);
+}
+
+static void image_finish(struct image *im, const uint8_t *hwinfo)
+{
+    const static char app_name[] = "scp_dump (keirf)";
+    struct footer ftr;
+    uint16_t app_name_len;
+    uint32_t csum;
+    int fd = im->fd;
+
+    writer_wait(&im->w);
+    csum = im->w.csum;
+    memfree(im->flux[0]);
+    memfree(im->flux[1]);
+
+    memset(&ftr, 0, sizeof(ftr));
+    memcpy(ftr.sig, "FPCS", sizeof(ftr.sig));
+    ftr.application_offset = htole32(lseek(fd, 0, SEEK_CUR));
+    ftr.creation_time = ftr.modification_time = htole64(time(NULL));
+    ftr.application_version = 0x10; /* should be moved to a general include? */
+    ftr.format_revision = 0x16; /* last specification used, 1.6 */
+    ftr.hardware_version = hwinfo[0];
+    ftr.firmware_version = hwinfo[1];
+
+    app_name_len = htole16(strlen(app_name));
+    checksum_and_write(fd, &csum, &app_name_len, sizeof(app_name_len));
+    checksum_and_write(fd, &csum, app_name, sizeof(app_name));
+    checksum_and_write(fd, &csum, &ftr, sizeof(ftr));
+
+    lseek(fd, sizeof(im->dhdr), SEEK_SET);
+    checksum_and_write(fd, &csum, im->th_offs,
+                       SCP_MAX_TRACKS * sizeof(uint32_t));
+
+    im->dhdr.checksum = htole32(csum);
+    lseek(fd, 0, SEEK_SET);
+    write_exact(fd, &im->dhdr, sizeof(im->dhdr));
+    close(fd);
+    memfree(im->th_offs);
+}
+
 int main(int argc, char **argv)
 {
     struct scp_handle *scp;
-    struct scp_flux flux;
-    struct disk_header dhdr;
-    struct track_header thdr;
-    int rev, nr_revs = DEFAULT_REVS;
+    struct image im[2], *m;
+    struct scp_flux *flux;
+    int nr_revs = -1, flux_revs, adaptive_type = -1, retry_revs = 0;
     int trk, start_trk = -1, end_trk = -1;
-    unsigned int sizeof_thdr, unit = DEFAULT_UNIT;
-    uint32_t *th_offs, file_off, dat_off, csum = 0;
-    int ch, fd, quiet = 0, ramtest = 0;
-    char *sername = DEFAULT_SERDEVICE;
-    struct footer ftr;
+    unsigned int unit = DEFAULT_UNIT, nr_units = 1, nr_reread = 0, i;
+    unsigned int nr_retry = 0, nr_fixed = 0;
+    struct disk *adaptive_disk = NULL;
+    struct progress *progress = NULL;
+    int ch, quiet = 0, ramtest = 0;
+    char *sername = DEFAULT_SERDEVICE, *progress_path = NULL;
     uint8_t hwinfo[2];
-    uint16_t app_name_len;
-    const static char app_name[] = "scp_dump (keirf)";
+    uint64_t t0, bytes, samples;
 
-    const static char sopts[] = "hqd:u:r:Rs:e:Dk:K:";
+    const static char sopts[] = "hqd:u:r:a:x:Rs:e:Dk:K:P:";
     const static struct option lopts[] = {
         { "help", 0, NULL, 'h' },
         { "quiet", 0, NULL, 'q' },
         { "device", 1, NULL, 'd' },
         { "unit", 1, NULL, 'u' },
         { "revs", 1, NULL, 'r' },
+        { "adaptive", 1, NULL, 'a' },
+        { "retry", 1, NULL, 'x' },
         { "ramtest", 0, NULL, 'R' },
         { "start", 1, NULL, 's' },
         { "end", 1, NULL, 'e' },
         { "double-step", 0, NULL, 'D' },
         { "step-delay", 1, NULL, 'k' },
         { "settle-delay", 1, NULL, 'K' },
+        { "progress", 1, NULL, 'P' },
         { 0, 0, 0, 0 }
     };
 
@@ -134,8 +360,14 @@ int main(int argc, char **argv)
             sername = optarg;
             break;
         case 'u':
+            if (!strcasecmp(optarg, "AB")) {
+                unit = 0;
+                nr_units = 2;
+                break;
+            }
             if (strlen(optarg) != 1)
                 goto bad;
+            nr_units = 1;
             switch (*optarg) {
             case 'a': case 'A': unit = 0; break;
             case 'b': case 'B': unit = 1; break;
@@ -147,6 +379,15 @@ int main(int argc, char **argv)
         case 'r':
             nr_revs = atoi(optarg);
             break;
+        case 'a':
+            if ((adaptive_type = disk_get_format_by_id_name(optarg)) < 0) {
+                warnx("Unknown format '%s'", optarg);
+                usage(1);
+            }
+            break;
+        case 'x':
+            retry_revs = atoi(optarg);
+            break;
         case 'R':
             ramtest = 1;
             break;
@@ -165,6 +406,9 @@ int main(int argc, char **argv)
         case 'K':
             scp_params.seek_settle_delay_ms = atoi(optarg);
             break;
+        case 'P':
+            progress_path = optarg;
+            break;
         default:
             usage(1);
             break;
@@ -176,7 +420,7 @@ int main(int argc, char **argv)
     if (end_trk < 0)
         end_trk = default_tracknr(DEFAULT_ENDTRK);
 
-    if (argc != (optind + 1))
+    if (argc != (optind + nr_units))
         usage(1);
 
     if ((end_trk >= SCP_MAX_TRACKS) || (start_trk > end_trk)) {
@@ -184,27 +428,26 @@ int main(int argc, char **argv)
         usage(1);
     }
 
-    if (nr_revs > ARRAY_SIZE(flux.info)) {
-        warnx("Too many revolutions specified (%u, max %u)",
-              nr_revs, (unsigned int)ARRAY_SIZE(flux.info));
+    if ((retry_revs < 0) || (retry_revs && (adaptive_type < 0))) {
+        warnx("--retry needs a number of revolutions, and --adaptive");
         usage(1);
     }
 
-    if ((fd = file_open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
-        err(1, "Error creating %s", argv[optind]);
+    if (nr_revs < 0)
+        nr_revs = (adaptive_type < 0) ? DEFAULT_REVS
+            : ARRAY_SIZE(flux->info) - retry_revs;
 
-    memset(&dhdr, 0, sizeof(dhdr));
-    memcpy(dhdr.sig, "SCP", sizeof(dhdr.sig));
-    dhdr.disk_type = DISKTYPE_amiga;
-    dhdr.nr_revolutions = nr_revs;
-    dhdr.start_track = start_trk;
-    dhdr.end_track = end_trk;
-    dhdr.flags = (1u<<_FLAG_footer);
-    write_exact(fd, &dhdr, sizeof(dhdr));
+    /* Every track in the image has as many revolutions as a re-read. */
+    if ((nr_revs < 1) || (nr_revs + retry_revs > ARRAY_SIZE(flux->info))) {
+        warnx("Bad number of revolutions (%d%s, max %u)",
+              nr_revs + retry_revs, retry_revs ? " with --retry" : "",
+              (unsigned int)ARRAY_SIZE(flux->info));
+        usage(1);
+    }
 
-    th_offs = memalloc(SCP_MAX_TRACKS * sizeof(uint32_t));
-    write_exact(fd, th_offs, SCP_MAX_TRACKS * sizeof(uint32_t));
-    file_off = sizeof(dhdr) + SCP_MAX_TRACKS * sizeof(uint32_t);
+    for (i = 0; i < nr_units; i++)
+        image_create(&im[i], argv[optind+i], unit+i, nr_revs + retry_revs,
+                     start_trk, end_trk);
 
     scp = scp_open(sername);
     if (!quiet)
@@ -212,62 +455,114 @@ int main(int argc, char **argv)
     if (ramtest)
         scp_ramtest(scp);
     scp_set_params(scp, &scp_params);
-    scp_selectdrive(scp, unit);
+    for (i = 0; i < nr_units; i++)
+        scp_selectdrive(scp, im[i].unit);
     scp_getinfo(scp, &hwinfo);
 
+    if (progress_path
+        && !(progress = progress_open(progress_path, "scp_dump", argv[optind],
+                                      (end_trk - start_trk + 1) * nr_units)))
+        err(1, "Unable to open progress %s", progress_path);
+
     log("Reading track %7s", "");
 
-    sizeof_thdr = 4 + 12*nr_revs;
+    if ((adaptive_type >= 0)
+        && ((adaptive_disk = disk_create("adaptive.dsk",
+                                         DISKFL_read_only)) == NULL))
+        errx(1, "Unable to create scratch disk");
     for (trk = start_trk; trk <= end_trk; trk++) {
         log("\b\b\b\b\b\b\b%-4u...", trk);
         fflush(stdout);
+        t0 = time_ns();
+
+        /* With two drives, both step and then settle together. Each is then
+         * read in turn, while the other's previous track is written out. */
+        seek_units(scp, im, nr_units, trk, 0);
+
+        for (i = 0; i < nr_units; i++) {
+            m = &im[i];
+            flux = m->flux[m->next_flux++ & 1];
+            if (nr_units > 1)
+                scp_switchdrive(scp, m->unit);
+            flux_revs = 0;
+            bytes = samples = 0;
+            if (adaptive_disk != NULL) {
+                scp_read_flux(scp, 1, flux);
+                if (track_is_clean(adaptive_disk, trk, adaptive_type,
+                                   flux, 1)) {
+                    flux_revs = 1;
+                } else {
+                    nr_reread++;
+                    bytes = flux->nr_bytes;
+                    samples = flux_samples(flux, 1);
+                }
+            }
+            if (flux_revs == 0) {
+                flux_revs = nr_revs;
+                scp_read_flux(scp, flux_revs, flux);
+                if (retry_revs)
+                    m->retry[trk] = !track_is_clean(
+                        adaptive_disk, trk, adaptive_type, flux, flux_revs);
+            }
+            writer_start(&m->w, trk, flux, flux_revs);
+            /* The first drive's time includes the step and settle. */
+            progress_track(progress, trk, time_ns() - t0,
+                           bytes + flux->nr_bytes,
+                           samples + flux_samples(flux, flux_revs), 0);
+            t0 = time_ns();
+        }
+    }
 
-        scp_seek_track(scp, trk, double_step);
-        scp_read_flux(scp, nr_revs, &flux);
-
-        th_offs[trk] = htole32(file_off);
-
-        memset(&thdr, 0, sizeof_thdr);
-        memcpy(thdr.sig, "TRK", sizeof(thdr.sig));
-        thdr.tracknr = trk;
+    /* Re-read bad tracks on the way back, from where the heads now are. Each
+     * read is appended to the image, and its track's offset is updated. */
+    for (trk = end_trk; retry_revs && (trk >= start_trk); trk--) {
+        for (i = 0; (i < nr_units) && !im[i].retry[trk]; i++)
+            continue;
+        if (i == nr_units)
+            continue;
+        if (nr_retry == 0)
+            log("\nRe-reading track %7s", "");
+        log("\b\b\b\b\b\b\b%-4u...", trk);
+        fflush(stdout);
 
-        dat_off = sizeof_thdr;
-        for (rev = 0; rev < nr_revs; rev++) {
-            thdr.rev[rev].duration = htole32(flux.info[rev].index_time);
-            thdr.rev[rev].nr_samples = htole32(flux.info[rev].nr_bitcells);
-            thdr.rev[rev].offset = htole32(dat_off);
-            dat_off += flux.info[rev].nr_bitcells * sizeof(uint16_t);
+        seek_units(scp, im, nr_units, trk, 1);
+
+        for (i = 0; i < nr_units; i++) {
+            m = &im[i];
+            if (!m->retry[trk])
+                continue;
+            flux = m->flux[m->next_flux++ & 1];
+            if (nr_units > 1)
+                scp_switchdrive(scp, m->unit);
+            flux_revs = nr_revs + retry_revs;
+            scp_read_flux(scp, flux_revs, flux);
+            nr_retry++;
+            nr_fixed += track_is_clean(adaptive_disk, trk, adaptive_type,
+                                       flux, flux_revs);
+            writer_start(&m->w, trk, flux, flux_revs);
         }
-        checksum_and_write(fd, &csum, &thdr, sizeof_thdr);
-        checksum_and_write(fd, &csum, flux.flux, dat_off - sizeof_thdr);
-        file_off += dat_off;
     }
 
+    for (i = 0; i < nr_units; i++)
+        writer_wait(&im[i].w);
+    if (adaptive_disk != NULL) {
+        disk_close(adaptive_disk);
+        log("\n%u of %u tracks read for all %d revolutions",
+            nr_reread, (end_trk - start_trk + 1) * nr_units, nr_revs);
+    }
+    if (retry_revs)
+        log("\n%u of %u tracks re-read for %d revolutions decode cleanly",
+            nr_fixed, nr_retry, nr_revs + retry_revs);
+
     log("\n");
 
-    scp_deselectdrive(scp, unit);
+    for (i = 0; i < nr_units; i++)
+        scp_deselectdrive(scp, im[i].unit);
     scp_close(scp);
 
-    memset(&ftr, 0, sizeof(ftr));
-    memcpy(ftr.sig, "FPCS", sizeof(ftr.sig));
-    ftr.application_offset = htole32(lseek(fd, 0, SEEK_CUR));
-    ftr.creation_time = ftr.modification_time = htole64(time(NULL));
-    ftr.application_version = 0x10; /* should be moved to a general include? */
-    ftr.format_revision = 0x16; /* last specification used, 1.6 */
-    ftr.hardware_version = hwinfo[0];
-    ftr.firmware_version = hwinfo[1];
-
-    app_name_len = htole16(strlen(app_name));
-    checksum_and_write(fd, &csum, &app_name_len, sizeof(app_name_len));
-    checksum_and_write(fd, &csum, app_name, sizeof(app_name));
-    checksum_and_write(fd, &csum, &ftr, sizeof(ftr));
-
-    lseek(fd, sizeof(dhdr), SEEK_SET);
-    checksum_and_write(fd, &csum, th_offs, SCP_MAX_TRACKS * sizeof(uint32_t));
-
-    dhdr.checksum = htole32(csum);
-    lseek(fd, 0, SEEK_SET);
-    write_exact(fd, &dhdr, sizeof(dhdr));
+    for (i = 0; i < nr_units; i++)
+        image_finish(&im[i], hwinfo);
+    progress_close(progress);
 
     return 0;
 }
@@ -0,0 +1,257 @@
+/*
+ * scp_pack.c
+ *
+ * Convert between .scp images and the per-track compressed .scz format.
+ * The flux of every track is preserved exactly; the optional SCP footer is
+ * not carried across.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include <libdisk/util.h>
+#include "scp.h"
+
+/* zlib declares its own crc32(), which is not used here. */
+#define crc32 zlib_crc32
+#include <zlib.h>
+#undef crc32
+
+#include "../libdisk/util.c"
+
+/* See libdisk/stream/supercard_scp.c for the SCZ layout. */
+struct scz_track {
+    uint32_t off, csz, usz;
+};
+
+static void usage(int rc)
+{
+    printf("Usage: scp_pack [options] in_file out_file\n");
+    printf("Options:\n");
+    printf("  -h, --help    Display this information\n");
+    printf("  -u, --unpack  Convert .scz back to .scp\n");
+    printf("  -l, --level   Compression level, 1-9 (9)\n");
+
+    exit(rc);
+}
+
+static uint8_t *read_file(const char *name, uint32_t *psz)
+{
+    uint8_t *dat;
+    off_t sz;
+    int fd;
+
+    if ((fd = file_open(name, O_RDONLY)) == -1)
+        err(1, "%s", name);
+    if (((sz = lseek(fd, 0, SEEK_END)) < 0) || (lseek(fd, 0, SEEK_SET) < 0))
+        err(1, "%s", name);
+    if (sz < sizeof(struct disk_header))
+        errx(1, "%s is too short", name);
+    dat = memalloc(sz);
+    read_exact(fd, dat, sz);
+    close(fd);
+
+    *psz = sz;
+    return dat;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t *p, uint32_t x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+/* Gather a track's header and flux into a self-contained block at @out,
+ * with the flux of each revolution following the revolution table. */
+static uint32_t scp_track(const char *name, const uint8_t *dat, uint32_t sz,
+                          unsigned int trk, unsigned int revs, uint8_t *out)
+{
+    uint32_t th_off, off, nr, hdr_sz = 4 + revs*12, pos = hdr_sz;
+    unsigned int rev;
+
+    th_off = get32(&dat[0x10 + trk*4]);
+    if ((th_off == 0) || (th_off > sz) || (sz - th_off < hdr_sz))
+        return 0;
+    if (memcmp(&dat[th_off], "TRK", 3) || (dat[th_off+3] != trk))
+        errx(1, "%s: Track %u bad signature", name, trk);
+
+    memcpy(out, &dat[th_off], hdr_sz);
+    for (rev = 0; rev < revs; rev++) {
+        nr = get32(&dat[th_off + 4 + rev*12 + 4]);
+        off = get32(&dat[th_off + 4 + rev*12 + 8]);
+        if ((off > sz - th_off) || (nr > (sz - th_off - off) / 2))
+            errx(1, "%s: Track %u revolution %u out of range",
+                 name, trk, rev);
+        memcpy(&out[pos], &dat[th_off + off], nr * 2);
+        put32(&out[4 + rev*12 + 8], pos);
+        pos += nr * 2;
+    }
+
+    return pos;
+}
+
+static void pack(const char *in, const char *out, int level)
+{
+    struct disk_header *dhdr;
+    struct scz_track ent[SCP_MAX_TRACKS];
+    uint8_t *dat, *udat, *cdat;
+    uint32_t sz, usz, off;
+    unsigned int trk, revs;
+    uLongf csz;
+    int fd;
+
+    dat = read_file(in, &sz);
+    dhdr = (struct disk_header *)dat;
+    if (memcmp(dhdr->sig, "SCP", 3))
+        errx(1, "%s: Not an SCP image", in);
+    if ((revs = dhdr->nr_revolutions) == 0)
+        errx(1, "%s has an invalid revolution count", in);
+    if (sz < 0x10 + sizeof(uint32_t) * SCP_MAX_TRACKS)
+        errx(1, "%s is too short", in);
+
+    if ((fd = file_open(out, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", out);
+
+    memcpy(dhdr->sig, "SCZ", 3);
+    dhdr->flags &= ~(1u<<_FLAG_footer);
+    dhdr->checksum = 0;
+    write_exact(fd, dhdr, sizeof(*dhdr));
+
+    memset(ent, 0, sizeof(ent));
+    off = sizeof(*dhdr) + sizeof(ent);
+    if (lseek(fd, off, SEEK_SET) != off)
+        err(1, "%s", out);
+
+    udat = memalloc(sz);
+    for (trk = 0; trk < SCP_MAX_TRACKS; trk++) {
+        if ((usz = scp_track(in, dat, sz, trk, revs, udat)) == 0)
+            continue;
+        csz = compressBound(usz);
+        cdat = memalloc(csz);
+        if (compress2(cdat, &csz, udat, usz, level) != Z_OK)
+            errx(1, "%s: Track %u failed to compress", in, trk);
+        write_exact(fd, cdat, csz);
+        memfree(cdat);
+        ent[trk].off = htole32(off);
+        ent[trk].csz = htole32(csz);
+        ent[trk].usz = htole32(usz);
+        off += csz;
+    }
+
+    if (lseek(fd, sizeof(*dhdr), SEEK_SET) != sizeof(*dhdr))
+        err(1, "%s", out);
+    write_exact(fd, ent, sizeof(ent));
+    close(fd);
+
+    printf("%s: %u -> %u bytes (%.1fx)\n", out, sz, off, (double)sz / off);
+
+    memfree(udat);
+    memfree(dat);
+}
+
+static void unpack(const char *in, const char *out)
+{
+    struct disk_header dhdr;
+    uint8_t *dat, *img, *p;
+    uint32_t sz, img_sz, pos, off, csz, csum;
+    unsigned int trk;
+    uLongf usz;
+    int fd;
+
+    dat = read_file(in, &sz);
+    memcpy(&dhdr, dat, sizeof(dhdr));
+    if (memcmp(dhdr.sig, "SCZ", 3))
+        errx(1, "%s: Not an SCZ image", in);
+    if (sz < sizeof(dhdr) + sizeof(struct scz_track) * SCP_MAX_TRACKS)
+        errx(1, "%s is too short", in);
+
+    img_sz = pos = 0x10 + sizeof(uint32_t) * SCP_MAX_TRACKS;
+    for (trk = 0; trk < SCP_MAX_TRACKS; trk++)
+        img_sz += get32(&dat[0x10 + trk*12 + 8]);
+    img = memalloc(img_sz);
+
+    for (trk = 0; trk < SCP_MAX_TRACKS; trk++) {
+        p = &dat[0x10 + trk*12];
+        if ((off = get32(&p[0])) == 0)
+            continue;
+        csz = get32(&p[4]);
+        usz = get32(&p[8]);
+        if ((off > sz) || (csz > sz - off)
+            || (uncompress(&img[pos], &usz, &dat[off], csz) != Z_OK)
+            || (usz != get32(&p[8])))
+            errx(1, "%s: Track %u is corrupt", in, trk);
+        put32(&img[0x10 + trk*4], pos);
+        pos += usz;
+    }
+
+    memcpy(dhdr.sig, "SCP", 3);
+    for (p = &img[0x10], csum = 0; p != &img[img_sz]; p++)
+        csum += *p;
+    dhdr.checksum = htole32(csum);
+    memcpy(img, &dhdr, sizeof(dhdr));
+
+    if ((fd = file_open(out, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        err(1, "%s", out);
+    write_exact(fd, img, img_sz);
+    close(fd);
+
+    memfree(img);
+    memfree(dat);
+}
+
+int main(int argc, char **argv)
+{
+    int ch, level = Z_BEST_COMPRESSION, unpack_mode = 0;
+
+    const static char sopts[] = "hul:";
+    const static struct option lopts[] = {
+        { "help", 0, NULL, 'h' },
+        { "unpack", 0, NULL, 'u' },
+        { "level", 1, NULL, 'l' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, sopts, lopts, NULL)) != -1) {
+        switch (ch) {
+        case 'h':
+            usage(0);
+            break;
+        case 'u':
+            unpack_mode = 1;
+            break;
+        case 'l':
+            level = atoi(optarg);
+            if ((level < 1) || (level > 9)) {
+                warnx("Bad compression level %s", optarg);
+                usage(1);
+            }
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    if (argc != (optind + 2))
+        usage(1);
+
+    if (unpack_mode)
+        unpack(argv[optind], argv[optind+1]);
+    else
+        pack(argv[optind], argv[optind+1], level);
+
+    return 0;
+}
+
@@ -17,8 +17,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include <libdisk/util.h>
+#include <libdisk/disk.h>
 #include "scp.h"
 
 #if defined (__APPLE__)
@@ -35,9 +37,114 @@ static struct scp_params scp_params;
 
 #define log(_f, _a...) do { if (!quiet) printf(_f, ##_a); } while (0)
 
+/* Flux the device can take in one write: see scp_write_flux(). */
+#define MAX_SAMPLES (256*1024/2)
+
+/* Image file input and resampling, run in a preparer thread so that the
+ * device can seek to and write the previous track meanwhile. The input is an
+ * SCP image (@fd), or any other image libdisk can open (@disk), whose tracks
+ * are converted to flux as they are needed. */
+struct preparer {
+    pthread_t thread;
+    bool_t busy;
+    int fd;
+    struct disk *disk;
+    struct track_raw *raw;
+    unsigned int trk;
+    uint32_t th_off, drvtime;
+    unsigned int nr_samples; /* resampled, in odat[] */
+    bool_t bad_sig, trimmed;
+    uint16_t dat[MAX_SAMPLES], odat[MAX_SAMPLES];
+};
+
+/* Resample @nr samples of @imtime ticks in all to match target drive speed. */
+static void resample(struct preparer *p, const uint16_t *dat, uint32_t nr,
+                     uint32_t imtime)
+{
+    uint32_t i, j;
+    uint64_t x = 0, y;
+
+    for (i = j = 0; i < nr; i++) {
+        if (dat[i]) {
+            x += (uint64_t)be16toh(dat[i]) * p->drvtime;
+        } else {
+            x += (uint64_t)0x10000u * p->drvtime;
+            if (i < (nr-1))
+                continue;
+        }
+        y = x / imtime;
+        while ((y >= 0x10000u) && (j < MAX_SAMPLES)) {
+            p->odat[j++] = 0;
+            y -= 0x10000u;
+        }
+        if (j == MAX_SAMPLES) {
+            p->trimmed = 1;
+            break;
+        }
+        p->odat[j++] = htobe16(y ?: 1);
+        x %= imtime; /* carry the fractional part */
+    }
+    p->nr_samples = j;
+}
+
+static void *prepare_track(void *arg)
+{
+    struct preparer *p = arg;
+    struct track_header thdr;
+    uint32_t nr, imtime;
+    uint16_t *dat;
+
+    if (p->disk != NULL) {
+        track_read_raw(p->raw, p->trk);
+        dat = track_raw_scp_flux(p->raw, &nr, &imtime);
+        p->trimmed = 0;
+        resample(p, dat, nr, imtime);
+        memfree(dat);
+        return NULL;
+    }
+
+    lseek(p->fd, p->th_off, SEEK_SET);
+    read_exact(p->fd, &thdr, sizeof(thdr));
+    /* Reported when the track is reached, once earlier tracks are written. */
+    p->bad_sig = memcmp(thdr.sig, "TRK", 3) || (thdr.tracknr != p->trk);
+    if (p->bad_sig)
+        return NULL;
+    imtime = htole32(thdr.rev[0].duration);
+
+    nr = le32toh(thdr.rev[0].nr_samples);
+    p->trimmed = (nr > MAX_SAMPLES);
+    nr = min_t(uint32_t, nr, MAX_SAMPLES);
+    lseek(p->fd, p->th_off + le32toh(thdr.rev[0].offset), SEEK_SET);
+    read_exact(p->fd, p->dat, nr * 2);
+    resample(p, p->dat, nr, imtime);
+
+    return NULL;
+}
+
+static void preparer_wait(struct preparer *p)
+{
+    if (p->busy)
+        pthread_join(p->thread, NULL);
+    p->busy = 0;
+}
+
+static void preparer_start(struct preparer *p, unsigned int trk,
+                           uint32_t th_off)
+{
+    int rc;
+
+    preparer_wait(p);
+    p->trk = trk;
+    p->th_off = th_off;
+    if ((rc = pthread_create(&p->thread, NULL, prepare_track, p)) != 0)
+        errx(1, "Failed to create preparer thread: %s", strerror(rc));
+    p->busy = 1;
+}
+
 static void usage(int rc)
 {
     printf("Usage: scp_write [options] in_file\n");
+    printf("in_file is an SCP image, or any image libdisk can open\n");
     printf("Options:\n");
     printf("  -h, --help    Display this information\n");
     printf("  -q, --quiet   Quiesce normal informational output\n");
@@ -56,11 +163,12 @@ int main(int argc, char **argv)
 {
     struct scp_handle *scp;
     struct disk_header dhdr;
-    struct track_header thdr;
     struct scp_flux flux;
+    struct preparer *prep[2], *p;
+    struct disk *disk = NULL;
     unsigned int trk, start_trk = DEFAULT_STARTTRK, end_trk = DEFAULT_ENDTRK;
-    uint32_t *th_offs, th_off, dat_off, drvtime, imtime, i, j;
-    uint16_t dat[256*1024/2], odat[256*1024/2];
+    unsigned int nr_trks = 0, trks[SCP_MAX_TRACKS], i;
+    uint32_t *th_offs, drvtime;
     int ch, fd, quiet = 0;
     char *sername = DEFAULT_SERDEVICE;
 
@@ -119,10 +227,16 @@ int main(int argc, char **argv)
         err(1, "Error opening %s", argv[optind]);
 
     read_exact(fd, &dhdr, sizeof(dhdr));
-    if (memcmp(dhdr.sig, "SCP", 3))
-        errx(1, "%s: Not an SCP image", argv[optind]);
-
-    if (!(dhdr.flags & (1u<<_FLAG_writable))) {
+    if (memcmp(dhdr.sig, "SCP", 3)) {
+        /* Not SCP: generate each track's flux from the image on demand. */
+        close(fd);
+        fd = -1;
+        if ((disk = disk_open(argv[optind], DISKFL_read_only)) == NULL)
+            errx(1, "%s: Unable to open image", argv[optind]);
+        memset(&dhdr, 0, sizeof(dhdr));
+        dhdr.end_track = min_t(unsigned int, end_trk,
+                               disk_get_info(disk)->nr_tracks - 1);
+    } else if (!(dhdr.flags & (1u<<_FLAG_writable))) {
         int sz;
         uint8_t *p, *buf;
         uint32_t csum = 0;
@@ -142,7 +256,8 @@ int main(int argc, char **argv)
     }
 
     th_offs = memalloc((end_trk+1) * sizeof(uint32_t));
-    read_exact(fd, th_offs, (end_trk+1) * sizeof(uint32_t));
+    if (disk == NULL)
+        read_exact(fd, th_offs, (end_trk+1) * sizeof(uint32_t));
 
     scp = scp_open(sername);
     if (!quiet)
@@ -156,53 +271,51 @@ int main(int argc, char **argv)
     log("Drive speed: %u us per revolution (%.2f RPM)\n",
         drvtime/40, 60000000.0/(drvtime/40));
 
-    log("Writing track %7s", "");
-
-    for (trk = start_trk; trk <= end_trk; trk++) {
-
-        uint64_t x = 0, y;
+    for (trk = start_trk; trk <= end_trk; trk++)
+        if ((trk >= dhdr.start_track) && (trk <= dhdr.end_track)
+            && ((disk != NULL) || (th_offs[trk] != 0)))
+            trks[nr_trks++] = trk;
+
+    /* Track i+1 is read and resampled while track i is sought and written. */
+    for (i = 0; i < 2; i++) {
+        prep[i] = memalloc(sizeof(*prep[i]));
+        prep[i]->fd = fd;
+        prep[i]->disk = disk;
+        if (disk != NULL)
+            prep[i]->raw = track_alloc_raw_buffer(disk);
+        prep[i]->drvtime = drvtime;
+    }
+    if (nr_trks != 0)
+        preparer_start(prep[0], trks[0], le32toh(th_offs[trks[0]]));
 
-        if ((trk < dhdr.start_track) || (trk > dhdr.end_track))
-            continue;
+    log("Writing track %7s", "");
 
-        th_off = le32toh(th_offs[trk]);
-        if (th_off == 0)
-            continue;
+    for (i = 0; i < nr_trks; i++) {
+        trk = trks[i];
+        p = prep[i & 1];
+        preparer_wait(p);
+        if (i + 1 < nr_trks)
+            preparer_start(prep[(i+1) & 1], trks[i+1],
+                           le32toh(th_offs[trks[i+1]]));
 
         log("\b\b\b\b\b\b\b%-4u...", trk);
         fflush(stdout);
-
-        lseek(fd, th_off, SEEK_SET);
-        read_exact(fd, &thdr, sizeof(thdr));
-        if (memcmp(thdr.sig, "TRK", 3) || thdr.tracknr != trk)
+        if (p->bad_sig)
             errx(1, "%s: Track %u bad signature", argv[optind], trk);
-        imtime = htole32(thdr.rev[0].duration);
-
-        dat_off = th_off + le32toh(thdr.rev[0].offset);
-        lseek(fd, dat_off, SEEK_SET);
-        read_exact(fd, dat, le32toh(thdr.rev[0].nr_samples) * 2);
-
-        /* Resample data to match target drive speed */
-        for (i = j = 0; i < le32toh(thdr.rev[0].nr_samples); i++) {
-            if (dat[i]) {
-                x += (uint64_t)be16toh(dat[i]) * drvtime;
-            } else {
-                x += (uint64_t)0x10000u * drvtime;
-                if (i < (le32toh(thdr.rev[0].nr_samples)-1))
-                    continue;
-            }
-            y = x / imtime;
-            while (y >= 0x10000u) {
-                odat[j++] = 0;
-                y -= 0x10000u;
-            }
-            odat[j++] = htobe16(y ?: 1);
-            x %= imtime; /* carry the fractional part */
-        }
+        if (p->trimmed)
+            warnx("Track %u: Flux trimmed to %u samples", trk, MAX_SAMPLES);
 
         scp_seek_track(scp, trk, 0);
-        scp_write_flux(scp, odat, j);
+        scp_write_flux(scp, p->odat, p->nr_samples);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (prep[i]->raw != NULL)
+            track_free_raw_buffer(prep[i]->raw);
+        memfree(prep[i]);
     }
+    if (disk != NULL)
+        disk_close(disk);
 
     log("\n");
 
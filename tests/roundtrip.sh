@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# tests/roundtrip.sh
+#
+# Regression checks of track regeneration from an .adf image:
+#  - Bitcell images read directly (PLL_fixed) and through the reference PLL
+#    (--pll-reference) give the same track offsets and the same outputs.
+#  - An AmigaDOS .ipf holds its sector headers as data chunks, not raw.
+#
+# Run from the top of the tree, after a build: "make check".
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d /tmp/libdisk-check.XXXXXX)
+trap 'rm -rf "$tmp"' EXIT
+
+export LD_LIBRARY_PATH="$top/libdisk${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}"
+analyse() {
+    "$top/disk-analyse/disk-analyse" -q -c "$top/disk-analyse/formats" "$@"
+}
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+yes "libdisk round trip" | head -c 901120 >"$tmp/in.adf"
+
+# Direct and PLL reads of the image. --report gives each track's data_bitoff.
+for pll in fixed reference; do
+    opt=
+    [ $pll = reference ] && opt=--pll-reference
+    analyse $opt --report="$tmp/$pll.json" "$tmp/in.adf" \
+        "$tmp/$pll.dsk" "$tmp/$pll.eadf" "$tmp/$pll.hfe"
+    sed -e 's/.*"tracknr": \([0-9]*\),.*"data_bitoff": \([0-9]*\),.*/\1 \2/' \
+        "$tmp/$pll.json" | sort -n >"$tmp/$pll.bitoff"
+done
+cmp -s "$tmp/fixed.bitoff" "$tmp/reference.bitoff" \
+    || fail "data_bitoff differs between direct and PLL reads"
+grep -q '^0 1025$' "$tmp/fixed.bitoff" \
+    || fail "track 0 data_bitoff is not 1025"
+for ext in dsk eadf hfe; do
+    cmp -s "$tmp/fixed.$ext" "$tmp/reference.$ext" \
+        || fail ".$ext output differs between direct and PLL reads"
+done
+
+# Sector headers as raw chunks would make the image 1088652 bytes.
+analyse "$tmp/in.adf" "$tmp/out.ipf"
+size=$(wc -c <"$tmp/out.ipf")
+[ $size -eq 1046412 ] || fail ".ipf is $size bytes, expected 1046412"
+analyse "$tmp/out.ipf" "$tmp/out.adf"
+cmp -s "$tmp/in.adf" "$tmp/out.adf" || fail ".ipf does not read back"
+
+echo "roundtrip: OK"